@@ -36,8 +36,8 @@ rc.exe /nologo /fo ScreenBuddy.res /I resources resources\ScreenBuddy.rc || exit
 rc.exe /nologo /fo settings_ui.res /I resources resources\settings_ui.rc || exit /b 1
 echo Compiling with flags: %CL%
 cl.exe /nologo /W3 /WX /I src\core /I src\network /I src\ui /I src\utils /I . ^
-    src\core\ScreenBuddy.c src\core\config.c src\ui\settings_ui.c src\utils\logging.c src\network\direct_connection.c ^
-    src\utils\errors.c src\utils\cursor_control.c ^
+    src\core\ScreenBuddy.c src\core\config.c src\ui\settings_ui.c src\utils\logging.c src\network\direct_connection.c src\network\udp_transport.c src\network\fanout.c src\network\telemetry.c src\network\session_resume.c ^
+    src\utils\errors.c src\utils\cursor_control.c src\core\recorder.c src\network\latency.c src\network\seal_pool.c src\network\net_thread.c src\network\pacer.c src\network\region_probe.c src\network\derp_map.c src\network\derp_warm.c src\core\input_batch.c ^
     ScreenBuddy.res settings_ui.res ^
     /link /INCREMENTAL:NO /MANIFEST:EMBED /MANIFESTINPUT:resources\ScreenBuddy.manifest /SUBSYSTEM:WINDOWS /FIXED /merge:_RDATA=.rdata ^
     windowsapp.lib shell32.lib comctl32.lib iphlpapi.lib /OUT:dist\ScreenBuddy.exe || exit /b 1
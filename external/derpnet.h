@@ -9,6 +9,52 @@
 #define DERPNET_SKIP_CERT_VALIDATION 0
 #endif
 
+// Outgoing frames are collected here until DerpNet_Flush, must fit at least one max size frame
+#ifndef DERPNET_SEND_QUEUE_SIZE
+#define DERPNET_SEND_QUEUE_SIZE (1 << 19)
+#endif
+
+// Incoming data, must fit at least one max size frame; larger means fewer compactions
+#ifndef DERPNET_RECV_BUFFER_SIZE
+#define DERPNET_RECV_BUFFER_SIZE (1 << 18)
+#endif
+
+// Number of senders whose nonce counters are remembered for replay detection
+#ifndef DERPNET_REPLAY_PEERS
+#define DERPNET_REPLAY_PEERS 8
+#endif
+
+// Number of peers whose shared keys are kept, so sealing for several viewers in turn does not
+// compute a Curve25519 key per packet
+#ifndef DERPNET_SHARED_KEYS
+#define DERPNET_SHARED_KEYS 8
+#endif
+
+// DerpNet_Open races connects to the resolved addresses (RFC 8305): a new one starts this often
+// while earlier ones are still pending, or right away once one fails
+#ifndef DERPNET_CONNECT_STAGGER_MS
+#define DERPNET_CONNECT_STAGGER_MS 250
+#endif
+
+// Gives up when no address connected within this, instead of the OS SYN timeout per address
+#ifndef DERPNET_CONNECT_TIMEOUT_MS
+#define DERPNET_CONNECT_TIMEOUT_MS 10000
+#endif
+
+// Resolved addresses past this many are not tried
+#ifndef DERPNET_CONNECT_MAX_ADDRESSES
+#define DERPNET_CONNECT_MAX_ADDRESSES 16
+#endif
+
+// Set to 0 to use only the portable scalar crypto code, otherwise SSE2/AVX2 is picked at runtime
+#ifndef DERPNET_USE_SIMD
+#	if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#		define DERPNET_USE_SIMD 1
+#	else
+#		define DERPNET_USE_SIMD 0
+#	endif
+#endif
+
 #ifndef DERPNET_API
 #	ifdef DERPNET_STATIC
 #		define DERPNET_API static inline
@@ -28,38 +74,203 @@ typedef struct {
 DERPNET_API void DerpNet_CreateNewKey(DerpKey* UserSecret);
 DERPNET_API void DerpNet_GetPublicKey(const DerpKey* UserSecret, DerpKey* UserPublic);
 
+// Nonces are a random 16-byte prefix, drawn once per session, followed by a 64-bit little endian
+// counter. Receiver remembers the sender's prefix, highest counter and a 64 entry bitmap below it.
+// Packets under any other prefix are dropped until the caller calls DerpNet_ResetReplay, so a relay
+// cannot replay a session it recorded earlier, or alternate between two to reopen the window.
+typedef struct {
+	uint8_t PublicKey[32];
+	uint8_t Prefix[16];
+	uint64_t Highest;
+	uint64_t Seen;  // bit i set = counter Highest-i already received
+} DerpNetReplay;
+
+typedef struct {
+	uint8_t PublicKey[32];
+	uint8_t SharedKey[32];
+	uint64_t LastUse;  // 0 = entry unused, the least recently used one is replaced
+} DerpNetSharedKey;
+
 typedef struct {
 	uintptr_t Socket;
 	void* SocketEvent;
 	void* CredHandle[2];
 	void* CtxHandle[2];
 	uint8_t UserPrivateKey[32];
-	uint8_t LastPublicKey[32];
-	uint8_t LastSharedKey[32];
-	size_t BufferSize;
-	size_t BufferReceived;
+	size_t BufferStart;    // first unconsumed plaintext byte
+	size_t BufferSize;     // end of decrypted plaintext
+	size_t BufferReceived; // end of data read from socket
 	size_t LastFrameSize;
 	size_t TotalReceived;
 	size_t TotalSent;
-	uint8_t Buffer[1 << 16];
+	size_t TotalCopied; // bytes copied in user space on the send path (sealing + TLS records)
+	size_t SendCalls;   // select/send calls made while writing to the socket
+	size_t TotalMoved;  // bytes moved inside receive buffer (compaction + TLS record unwrapping)
+	size_t SendQueueStart; // queued bytes before this offset are already written
+	size_t SendQueueSize;
+	size_t SendBoundary;   // frame boundary at or before the first frame not started on the wire yet
+	size_t SendUrgentEnd;  // end of frames queued with DerpNet_QueueUrgent, they stay in order
+	size_t SendBudget;     // limit for DerpNet_TrySend, 0 means whole send queue
+	size_t SendAllowance;  // with SendPaced, bytes past the urgent frames a write without waiting may send
+	bool SendPaced;
+	size_t TlsRecordSize;  // encrypted TLS record waiting for writable socket
+	size_t TlsRecordSent;
+#if !defined(_WIN32)
+	int EventFd;           // epoll instance watching Socket for EPOLLIN | EPOLLOUT (edge triggered), -1 if none
+#endif
+	size_t ReplayDrops;    // received packets rejected as duplicate, too old or from another session
+	size_t SessionChanges; // authenticated packets dropped because the sender's nonce prefix changed
+	uint8_t LastSessionChange[32];
+	size_t PongsReceived;  // Pong frames answering DerpNet_SendPing
+	uint8_t LastPong[8];   // data of the latest one
+	size_t ServerPings;    // Ping frames from the server, each answered with a Pong
+	size_t KeepAlives;     // KeepAlive frames from the server
+	size_t PeersGone;      // PeerGone frames: the server dropped packets for a peer not connected to it
+	uint8_t LastPeerGone[32];
+	uint64_t ResolveUs;       // DerpNet_Open: getaddrinfo
+	uint64_t ConnectUs;       // DerpNet_Open: first connect started until one succeeded or all failed
+	uint32_t ConnectAttempts; // addresses connected to in the race
+	uint32_t ConnectFailures; // of those, failed (refused, unreachable) before one won
+	uint32_t ConnectWinner;   // position of the winner in race order, 0 = first address tried
+	bool Direct;              // opened with DerpNet_OpenDirect, no server in between
+	bool EventBorrowed;       // SocketEvent/EventFd belong to the DerpNet passed to DerpNet_OpenDirect
+	uint8_t DirectPeerKey[32];
+	uint64_t NonceCounter; // next counter for outgoing nonces, 0 = NoncePrefix not drawn yet
+	uint8_t NoncePrefix[16];
+	uint32_t ReplayNext;   // entry to reuse when new sender shows up
+	DerpNetReplay Replay[DERPNET_REPLAY_PEERS];
+	uint64_t SharedKeyClock;   // last LastUse handed out
+	size_t SharedKeyMisses;    // shared keys computed because the peer was not in SharedKeys
+	DerpNetSharedKey SharedKeys[DERPNET_SHARED_KEYS];
+	uint8_t Buffer[DERPNET_RECV_BUFFER_SIZE];
+	uint8_t SendQueue[DERPNET_SEND_QUEUE_SIZE];
+	uint8_t TlsRecord[16384 + 512];
 } DerpNet;
 
+typedef struct {
+	const void* Data;
+	size_t Size;
+} DerpNetIoVec;
+
 // use DERP server hostname from https://login.tailscale.com/derpmap/default
+// "host:port" connects to a port other than the default 8443 (8080 for plain HTTP)
+// on Windows SocketEvent is signaled for FD_READ/FD_WRITE, on Linux EventFd is an epoll fd that
+// becomes readable for the same events and can be added to caller's own epoll/poll loop
 DERPNET_API bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret);
 DERPNET_API void DerpNet_Close(DerpNet* Net);
 
+// Peer to peer link over a TCP socket the caller connected and authenticated to PeerPublicKey.
+// Frames are the same SendPacket frames sealed with the same box and nonces, so every send and
+// receive function works unchanged: sends go straight to the peer and DerpNet_Recv reports them
+// as received from PeerPublicKey. There is no TLS layer, the box already covers every frame.
+// Takes ownership of Socket, closed on failure too. With EventsWith the socket signals that
+// DerpNet's SocketEvent/EventFd instead of its own, so one wait covers both connections; this
+// one then must be closed first.
+DERPNET_API bool DerpNet_OpenDirect(DerpNet* Net, uintptr_t Socket, const DerpKey* UserSecret, const DerpKey* PeerPublicKey, const DerpNet* EventsWith);
+
 // returns 1 when received data from other user, pointer is valid till next call
 // returns -1 if disconnected from server
 // returns 0 if no new info is available to read
 // if Wait=true, then never returns 0 - always waits for one incoming message
+// Server frames are handled on the way: a Ping is answered with a Pong at the end of the send queue
+// (written with the next write), KeepAlive and PeerGone are only counted
 DERPNET_API int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** ReceivedData, uint32_t* ReceivedSize, bool Wait);
 
+// The sender started a new session (reconnected to the server, resumed after a lost connection):
+// its next authenticated packet sets the nonce prefix that is accepted from it. Until then packets
+// under a prefix other than its previous one are dropped and counted in SessionChanges.
+DERPNET_API void DerpNet_ResetReplay(DerpNet* Net, const DerpKey* SenderPublicKey);
+
 // returns false if disconnected
 DERPNET_API bool DerpNet_Send(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
 
 // use this if you're an expert!
 DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t Nonce[24], const void* Data, size_t DataSize);
 
+// same as DerpNet_Send/DerpNet_SendEx, but payload is concatenation of DataCount buffers
+// buffers are encrypted directly into the outgoing frame, no need to join them first
+DERPNET_API bool DerpNet_SendV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount);
+DERPNET_API bool DerpNet_SendExV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t Nonce[24], const DerpNetIoVec* Data, size_t DataCount);
+
+// Send functions write everything queued so far plus the new message to the socket immediately.
+// Queue functions only encrypt the message into the send queue, it is written with the next
+// Flush or Send as one socket write together with other queued messages (or earlier, if the queue fills up).
+// returns false if disconnected
+DERPNET_API bool DerpNet_Queue(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+DERPNET_API bool DerpNet_QueueV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount);
+DERPNET_API bool DerpNet_Flush(DerpNet* Net);
+
+// Queues a message ahead of every queued frame that has not started going out yet, behind the one
+// frame that is partially written and behind earlier urgent messages. Input and control messages
+// then wait for at most one large frame instead of the whole queue. A frame sealed more than
+// DERPNET_URGENT_MAX_OVERTAKE messages earlier is never overtaken, so it still arrives inside the
+// receiver's replay window.
+// DerpNet_SendUrgent also writes as much of the queue as socket takes right now, without waiting.
+// returns false if disconnected
+#define DERPNET_URGENT_MAX_OVERTAKE 32
+DERPNET_API bool DerpNet_QueueUrgent(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+DERPNET_API bool DerpNet_QueueUrgentV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount);
+DERPNET_API bool DerpNet_SendUrgent(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+
+typedef enum {
+	DERPNET_SEND_QUEUED,       // accepted, written now or left in send queue until socket is writable
+	DERPNET_SEND_WOULD_BLOCK,  // send queue is over budget, message was not accepted
+	DERPNET_SEND_DISCONNECTED,
+} DerpNetSendResult;
+
+// Non-blocking DerpNet_Send/DerpNet_SendV, never waits for the socket.
+// Message is accepted only if it fits in send budget together with bytes still queued, then
+// as much of the queue is written as socket takes right now. Call DerpNet_OnWritable when
+// socket becomes writable again (FD_WRITE on SocketEvent) to write the rest.
+DERPNET_API DerpNetSendResult DerpNet_TrySend(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+DERPNET_API DerpNetSendResult DerpNet_TrySendV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount);
+
+// Non-blocking DerpNet_Queue/DerpNet_QueueV: accepted on the same terms as DerpNet_TrySend, but only
+// encrypted into the send queue, nothing is written.
+DERPNET_API DerpNetSendResult DerpNet_TryQueue(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+DERPNET_API DerpNetSendResult DerpNet_TryQueueV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount);
+
+// Room for Size bytes of frames (DERPNET_FRAME_OVERHEAD each included) that are queued next, for a
+// message split over several frames that must go whole or not at all. Writes as much of the queue as
+// socket takes right now, then DERPNET_SEND_QUEUED if they fit in send budget together with bytes
+// still queued, or if nothing is queued any more. Queue calls for that many bytes then do not wait
+// for the socket, unless they are more than the whole send queue.
+DERPNET_API DerpNetSendResult DerpNet_TryReserve(DerpNet* Net, size_t Size);
+
+// writes queued bytes without waiting, returns false if disconnected
+DERPNET_API bool DerpNet_OnWritable(DerpNet* Net);
+
+// bytes accepted by Send/Queue functions but not yet written to socket
+DERPNET_API size_t DerpNet_GetQueuedBytes(const DerpNet* Net);
+
+// clamped between one max size frame and DERPNET_SEND_QUEUE_SIZE
+DERPNET_API void DerpNet_SetSendBudget(DerpNet* Net, size_t Budget);
+
+// Pacing: while an allowance is set, writes that do not wait (OnWritable, SendUrgent, TrySend) send
+// frames queued with DerpNet_QueueUrgent right away, but the rest of the queue only up to the allowance.
+// Every byte written past the urgent frames uses it up, the caller refills it from its own clock and
+// calls DerpNet_OnWritable. Waiting writes (Send, Flush, Queue making room) ignore it but still use it up.
+// DERPNET_UNPACED turns pacing off again, it is off after DerpNet_Open.
+#define DERPNET_UNPACED SIZE_MAX
+DERPNET_API void DerpNet_SetSendAllowance(DerpNet* Net, size_t Allowance);
+
+// Keepalive: queues a Ping frame with 8 bytes of caller data and writes the queue without waiting.
+// The server answers with a Pong frame carrying the same data, DerpNet_Recv copies it to LastPong
+// and counts it in PongsReceived. returns false if disconnected
+DERPNET_API bool DerpNet_SendPing(DerpNet* Net, const uint8_t Data[8]);
+
+// Sealing outside of Net, to spread one large send over several threads.
+// DerpNet_PrepareSeal picks shared key and the next nonce, call it on the thread that owns Net in send order.
+// DerpNet_NextNonce only draws the next nonce, for the later chunks of a send whose key sealing threads
+// may be reading already.
+// DerpNet_SealFrameV writes a complete SendPacket frame of DERPNET_FRAME_OVERHEAD + payload bytes and
+// touches no DerpNet state, so any thread can call it. DerpNet_QueueSealed queues such a frame like DerpNet_Queue.
+#define DERPNET_FRAME_OVERHEAD (1 + 4 + 32 + 24 + 16)
+DERPNET_API void DerpNet_PrepareSeal(DerpNet* Net, const DerpKey* TargetUserPublicKey, uint8_t SharedKey[32], uint8_t Nonce[24]);
+DERPNET_API void DerpNet_NextNonce(DerpNet* Net, uint8_t Nonce[24]);
+DERPNET_API size_t DerpNet_SealFrameV(uint8_t* Frame, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t Nonce[24], const DerpNetIoVec* Data, size_t DataCount);
+DERPNET_API bool DerpNet_QueueSealed(DerpNet* Net, const void* Frame, size_t FrameSize);
+
 //
 // implementation
 //
@@ -69,17 +280,62 @@ DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey
 #include <stdio.h>
 #include <string.h>
 
-#define SECURITY_WIN32
-#define _WINSOCK_DEPRECATED_NO_WARNINGS
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
-#include <security.h>
-#include <schannel.h>
-#include <bcrypt.h>
-#pragma comment (lib, "bcrypt")
-#pragma comment (lib, "ws2_32")
-#pragma comment (lib, "secur32")
+#if defined(_WIN32)
+#	define SECURITY_WIN32
+#	define _WINSOCK_DEPRECATED_NO_WARNINGS
+#	include <winsock2.h>
+#	include <windows.h>
+#	include <ws2tcpip.h>
+#	include <security.h>
+#	include <schannel.h>
+#	include <bcrypt.h>
+#	pragma comment (lib, "bcrypt")
+#	pragma comment (lib, "ws2_32")
+#	pragma comment (lib, "secur32")
+#	define DERPNET_DEBUGBREAK() __debugbreak()
+#	define DERPNET_SEND_FLAGS 0
+#else
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <time.h>
+#	include <unistd.h>
+#	include <sys/types.h>
+#	include <sys/socket.h>
+#	include <sys/select.h>
+#	include <sys/random.h>
+#	include <sys/uio.h>
+#	include <netinet/in.h>
+#	include <netinet/tcp.h>
+#	include <arpa/inet.h>
+#	include <netdb.h>
+#	include <poll.h>
+#	if defined(__linux__)
+#		include <sys/epoll.h>
+#	endif
+#	define DERPNET_DEBUGBREAK() __builtin_trap()
+#	define DERPNET_SEND_FLAGS MSG_NOSIGNAL // report a closed peer as an error instead of SIGPIPE
+#endif
+
+// TLS is implemented with Schannel only
+#ifndef DERPNET_USE_PLAIN_HTTP
+#	if defined(_WIN32)
+#		define DERPNET_USE_PLAIN_HTTP 0
+#	else
+#		define DERPNET_USE_PLAIN_HTTP 1
+#	endif
+#elif !DERPNET_USE_PLAIN_HTTP && !defined(_WIN32)
+#	error TLS transport requires Windows (Schannel), define DERPNET_USE_PLAIN_HTTP 1
+#endif
+
+#if defined(_WIN32)
+#	define DERPNET_INVALID_SOCKET INVALID_SOCKET
+#	define DerpNet__CloseSocket(Socket) closesocket(Socket)
+#	define DerpNet__SocketError() WSAGetLastError()
+#else
+#	define DERPNET_INVALID_SOCKET ((uintptr_t)-1)
+#	define DerpNet__CloseSocket(Socket) close((int)(Socket))
+#	define DerpNet__SocketError() errno
+#endif
 
 //
 // helpers
@@ -112,6 +368,17 @@ DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey
 #	error unsupported compiler/target
 #endif
 
+#if DERPNET_USE_SIMD
+#	include <immintrin.h>
+#	if defined(_MSC_VER) && !defined(__clang__)
+#		define DERPNET_TARGET_SSE2
+#		define DERPNET_TARGET_AVX2
+#	else
+#		define DERPNET_TARGET_SSE2 __attribute__((target("sse2")))
+#		define DERPNET_TARGET_AVX2 __attribute__((target("avx2")))
+#	endif
+#endif
+
 #if defined(__clang__)
 #	define rol32(x, n) __builtin_rotateleft32(x, n)
 #elif defined(_MSC_VER)
@@ -120,13 +387,58 @@ DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey
 #	define rol32(x, n) ( ((x) << (n)) | ((x) >> (32-(n))) )
 #endif
 
+#if DERPNET_USE_SIMD
+
+// best instruction set for crypto code, detected once on first use
+enum
+{
+	DERPNET_SIMD_NONE,
+	DERPNET_SIMD_SSE2,
+	DERPNET_SIMD_AVX2,
+};
+
+static int DerpNet__SimdLevel = -1;
+
+static int DerpNet__GetSimdLevel(void)
+{
+	if (DerpNet__SimdLevel < 0)
+	{
+		bool HasSse2, HasAvx2;
+#if defined(_MSC_VER) && !defined(__clang__)
+		int Info[4];
+		__cpuid(Info, 0);
+		int MaxLeaf = Info[0];
+
+		__cpuid(Info, 1);
+		HasSse2 = (Info[3] & (1 << 26)) != 0;
+		// AVX needs OS support for saving ymm registers (OSXSAVE + XCR0 bits 1 and 2)
+		bool HasAvx = (Info[2] & (1 << 27)) && (Info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+
+		HasAvx2 = false;
+		if (HasAvx && MaxLeaf >= 7)
+		{
+			__cpuidex(Info, 7, 0);
+			HasAvx2 = (Info[1] & (1 << 5)) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		HasSse2 = __builtin_cpu_supports("sse2");
+		HasAvx2 = __builtin_cpu_supports("avx2");
+#endif
+		DerpNet__SimdLevel = HasAvx2 ? DERPNET_SIMD_AVX2 : HasSse2 ? DERPNET_SIMD_SSE2 : DERPNET_SIMD_NONE;
+	}
+	return DerpNet__SimdLevel;
+}
+
+#endif // DERPNET_USE_SIMD
+
 // Use ScreenBuddy's logging system if available, otherwise fallback to printf
 #ifdef LOG_DERP
-#	define DERPNET_ASSERT(cond) do { if (!(cond)) { LOG_ERROR("DERP ASSERT FAILED: %s", #cond); __debugbreak(); } } while (0)
+#	define DERPNET_ASSERT(cond) do { if (!(cond)) { LOG_ERROR("DERP ASSERT FAILED: %s", #cond); DERPNET_DEBUGBREAK(); } } while (0)
 #	define DERPNET_LOG(...) LOG_DERP(__VA_ARGS__)
 #else
 // Always log to file by opening/appending to derp_debug.log
-#	define DERPNET_ASSERT(cond) do { if (!(cond)) __debugbreak(); } while (0)
+#	define DERPNET_ASSERT(cond) do { if (!(cond)) DERPNET_DEBUGBREAK(); } while (0)
 #	define DERPNET_LOG(...) do { \
 		FILE* _f = fopen("derp_debug.log", "a"); \
 		if (_f) { fprintf(_f, "[DERP] " __VA_ARGS__); fprintf(_f, "\n"); fclose(_f); } \
@@ -135,12 +447,12 @@ DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey
 
 static inline uint32_t Get32LE(const uint8_t* Buffer)
 {
-	return (Buffer[3] << 24) + (Buffer[2] << 16) + (Buffer[1] << 8) + Buffer[0];
+	return ((uint32_t)Buffer[3] << 24) + (Buffer[2] << 16) + (Buffer[1] << 8) + Buffer[0];
 }
 
 static inline uint32_t Get32BE(const uint8_t* Buffer)
 {
-	return (Buffer[0] << 24) + (Buffer[1] << 16) + (Buffer[2] << 8) + Buffer[3];
+	return ((uint32_t)Buffer[0] << 24) + (Buffer[1] << 16) + (Buffer[2] << 8) + Buffer[3];
 }
 
 static inline uint64_t Get64LE(const uint8_t* Buffer)
@@ -185,8 +497,23 @@ static inline void Set64LE(uint8_t* Buffer, uint64_t Value)
 
 static inline void DerpNet__GetRandom(void* Buffer, size_t BufferSize)
 {
+#if defined(_WIN32)
 	int Status = BCryptGenRandom(NULL, (PUCHAR)Buffer, (ULONG)BufferSize, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
 	DERPNET_ASSERT(Status == 0);
+#else
+	uint8_t* Bytes = (uint8_t*)Buffer;
+	while (BufferSize != 0)
+	{
+		ssize_t Read = getrandom(Bytes, BufferSize, 0);
+		if (Read < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		DERPNET_ASSERT(Read > 0);
+		Bytes += Read;
+		BufferSize -= (size_t)Read;
+	}
+#endif
 }
 
 //
@@ -646,7 +973,7 @@ static void poly1305_blocks(poly1305_state_internal_t* st, const uint8_t* m, siz
 	st->h[2] = h2;
 }
 
-void poly1305_finish(poly1305_state_internal_t* st, uint8_t mac[16])
+static void poly1305_finish(poly1305_state_internal_t* st, uint8_t mac[16])
 {
 	uint64_t h0,h1,h2,c;
 	uint64_t g0,g1,g2;
@@ -707,6 +1034,245 @@ void poly1305_finish(poly1305_state_internal_t* st, uint8_t mac[16])
 	Set64LE(&mac[8], h1);
 }
 
+#if DERPNET_USE_SIMD
+
+//
+// 4-way poly1305 with 26-bit limbs, same idea as the OpenSSL/libsodium vector code: each lane
+// accumulates every 4th block with H = H * r^4 + m, and the lanes are merged at the end with
+// h = H_0 * r^4 + H_1 * r^3 + H_2 * r^2 + H_3 * r. Each 64-bit lane holds one 26-bit limb, so
+// _mm256_mul_epu32 products and sums of five of them fit in 64 bits. Short control packets stay
+// on the scalar code, which is faster there.
+//
+
+// below this the r^2..r^4 setup and final lane merge cost more than they save
+#define poly1305_avx2_min_bytes 768
+
+// 130-bit value from 44-bit limbs into 26-bit limbs, carried until every limb fits so they can be OR'ed
+static void poly1305_to26(uint64_t out[5], const uint64_t in[3])
+{
+	uint64_t h0 = in[0], h1 = in[1], h2 = in[2], c;
+	for (;;)
+	{
+		         c = (h0 >> 44); h0 &= 0xfffffffffff;
+		h1 += c; c = (h1 >> 44); h1 &= 0xfffffffffff;
+		h2 += c; c = (h2 >> 42); h2 &= 0x3ffffffffff;
+		if (c == 0) break;
+		h0 += c * 5;
+	}
+
+	uint64_t lo = h0 | (h1 << 44);
+	uint64_t hi = (h1 >> 20) | (h2 << 24);
+	uint64_t top = h2 >> 40;
+
+	out[0] = ( lo                    ) & 0x3ffffff;
+	out[1] = ( lo >> 26              ) & 0x3ffffff;
+	out[2] = ((lo >> 52) | (hi << 12)) & 0x3ffffff;
+	out[3] = ( hi >> 14              ) & 0x3ffffff;
+	out[4] = ( hi >> 40              ) | (top << 24);
+}
+
+// 26-bit limbs (partially carried, any size) back into 44-bit limbs
+static void poly1305_from26(uint64_t out[3], const uint64_t in[5])
+{
+	uint64_t l0 = in[0], l1 = in[1], l2 = in[2], l3 = in[3], l4 = in[4], c;
+	for (;;)
+	{
+		         c = (l0 >> 26); l0 &= 0x3ffffff;
+		l1 += c; c = (l1 >> 26); l1 &= 0x3ffffff;
+		l2 += c; c = (l2 >> 26); l2 &= 0x3ffffff;
+		l3 += c; c = (l3 >> 26); l3 &= 0x3ffffff;
+		l4 += c; c = (l4 >> 26); l4 &= 0x3ffffff;
+		if (c == 0) break;
+		l0 += c * 5;
+	}
+
+	uint64_t lo = l0 | (l1 << 26) | (l2 << 52);
+	uint64_t hi = (l2 >> 12) | (l3 << 14) | (l4 << 40);
+	uint64_t top = l4 >> 24;
+
+	out[0] = ( lo                    ) & 0xfffffffffff;
+	out[1] = ((lo >> 44) | (hi << 20)) & 0xfffffffffff;
+	out[2] = ( hi >> 24              ) | (top << 40);
+}
+
+// out = a * b mod 2^130-5, 26-bit limbs
+static void poly1305_mul26(uint64_t out[5], const uint64_t a[5], const uint64_t b[5])
+{
+	uint64_t s1 = b[1] * 5, s2 = b[2] * 5, s3 = b[3] * 5, s4 = b[4] * 5;
+
+	uint64_t d0 = a[0] * b[0] + a[1] * s4   + a[2] * s3   + a[3] * s2   + a[4] * s1;
+	uint64_t d1 = a[0] * b[1] + a[1] * b[0] + a[2] * s4   + a[3] * s3   + a[4] * s2;
+	uint64_t d2 = a[0] * b[2] + a[1] * b[1] + a[2] * b[0] + a[3] * s4   + a[4] * s3;
+	uint64_t d3 = a[0] * b[3] + a[1] * b[2] + a[2] * b[1] + a[3] * b[0] + a[4] * s4;
+	uint64_t d4 = a[0] * b[4] + a[1] * b[3] + a[2] * b[2] + a[3] * b[1] + a[4] * b[0];
+
+	uint64_t c;
+	             c = (d0 >> 26); d0 &= 0x3ffffff;
+	d1 += c;     c = (d1 >> 26); d1 &= 0x3ffffff;
+	d2 += c;     c = (d2 >> 26); d2 &= 0x3ffffff;
+	d3 += c;     c = (d3 >> 26); d3 &= 0x3ffffff;
+	d4 += c;     c = (d4 >> 26); d4 &= 0x3ffffff;
+	d0 += c * 5; c = (d0 >> 26); d0 &= 0x3ffffff;
+	d1 += c;
+
+	out[0] = d0;
+	out[1] = d1;
+	out[2] = d2;
+	out[3] = d3;
+	out[4] = d4;
+}
+
+// h = h * r mod 2^130-5 in every lane, s = 5 * r
+DERPNET_TARGET_AVX2
+static void poly1305_mul_avx2(__m256i h[5], const __m256i r[5], const __m256i s[5])
+{
+	__m256i d[5];
+	d[0] = _mm256_mul_epu32(h[0], r[0]);
+	d[1] = _mm256_mul_epu32(h[0], r[1]);
+	d[2] = _mm256_mul_epu32(h[0], r[2]);
+	d[3] = _mm256_mul_epu32(h[0], r[3]);
+	d[4] = _mm256_mul_epu32(h[0], r[4]);
+
+	d[0] = _mm256_add_epi64(d[0], _mm256_mul_epu32(h[1], s[4]));
+	d[1] = _mm256_add_epi64(d[1], _mm256_mul_epu32(h[1], r[0]));
+	d[2] = _mm256_add_epi64(d[2], _mm256_mul_epu32(h[1], r[1]));
+	d[3] = _mm256_add_epi64(d[3], _mm256_mul_epu32(h[1], r[2]));
+	d[4] = _mm256_add_epi64(d[4], _mm256_mul_epu32(h[1], r[3]));
+
+	d[0] = _mm256_add_epi64(d[0], _mm256_mul_epu32(h[2], s[3]));
+	d[1] = _mm256_add_epi64(d[1], _mm256_mul_epu32(h[2], s[4]));
+	d[2] = _mm256_add_epi64(d[2], _mm256_mul_epu32(h[2], r[0]));
+	d[3] = _mm256_add_epi64(d[3], _mm256_mul_epu32(h[2], r[1]));
+	d[4] = _mm256_add_epi64(d[4], _mm256_mul_epu32(h[2], r[2]));
+
+	d[0] = _mm256_add_epi64(d[0], _mm256_mul_epu32(h[3], s[2]));
+	d[1] = _mm256_add_epi64(d[1], _mm256_mul_epu32(h[3], s[3]));
+	d[2] = _mm256_add_epi64(d[2], _mm256_mul_epu32(h[3], s[4]));
+	d[3] = _mm256_add_epi64(d[3], _mm256_mul_epu32(h[3], r[0]));
+	d[4] = _mm256_add_epi64(d[4], _mm256_mul_epu32(h[3], r[1]));
+
+	d[0] = _mm256_add_epi64(d[0], _mm256_mul_epu32(h[4], s[1]));
+	d[1] = _mm256_add_epi64(d[1], _mm256_mul_epu32(h[4], s[2]));
+	d[2] = _mm256_add_epi64(d[2], _mm256_mul_epu32(h[4], s[3]));
+	d[3] = _mm256_add_epi64(d[3], _mm256_mul_epu32(h[4], s[4]));
+	d[4] = _mm256_add_epi64(d[4], _mm256_mul_epu32(h[4], r[0]));
+
+	// partial carry, leaves limbs small enough for the next multiply
+	const __m256i Mask = _mm256_set1_epi64x(0x3ffffff);
+	__m256i c;
+	c = _mm256_srli_epi64(d[0], 26); d[0] = _mm256_and_si256(d[0], Mask); d[1] = _mm256_add_epi64(d[1], c);
+	c = _mm256_srli_epi64(d[3], 26); d[3] = _mm256_and_si256(d[3], Mask); d[4] = _mm256_add_epi64(d[4], c);
+	c = _mm256_srli_epi64(d[1], 26); d[1] = _mm256_and_si256(d[1], Mask); d[2] = _mm256_add_epi64(d[2], c);
+	c = _mm256_srli_epi64(d[4], 26); d[4] = _mm256_and_si256(d[4], Mask); d[0] = _mm256_add_epi64(d[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+	c = _mm256_srli_epi64(d[2], 26); d[2] = _mm256_and_si256(d[2], Mask); d[3] = _mm256_add_epi64(d[3], c);
+	c = _mm256_srli_epi64(d[0], 26); d[0] = _mm256_and_si256(d[0], Mask); d[1] = _mm256_add_epi64(d[1], c);
+	c = _mm256_srli_epi64(d[3], 26); d[3] = _mm256_and_si256(d[3], Mask); d[4] = _mm256_add_epi64(d[4], c);
+
+	for (int i = 0; i < 5; i++)
+	{
+		h[i] = d[i];
+	}
+}
+
+// h += four message blocks, one per lane
+DERPNET_TARGET_AVX2
+static void poly1305_add_blocks_avx2(__m256i h[5], const uint8_t* m)
+{
+	const __m256i Mask = _mm256_set1_epi64x(0x3ffffff);
+
+	__m256i a = _mm256_loadu_si256((const __m256i*)(m +  0));
+	__m256i b = _mm256_loadu_si256((const __m256i*)(m + 32));
+
+	// low and high 64 bits of blocks 0..3, unpack gives order 0,2,1,3
+	__m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+	__m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+
+	h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, Mask));
+	h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), Mask));
+	h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), Mask));
+	h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), Mask));
+	h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), _mm256_set1_epi64x(1 << 24)));
+}
+
+// same result as poly1305_blocks, bytes must be a non-zero multiple of 64
+DERPNET_TARGET_AVX2
+static void poly1305_blocks_avx2(poly1305_state_internal_t* st, const uint8_t* m, size_t bytes)
+{
+	DERPNET_ASSERT(bytes != 0 && bytes % 64 == 0 && !st->final);
+
+	uint64_t r[9][5], h[5];
+	poly1305_to26(r[1], st->r);
+	for (int i = 2; i <= 8; i++)
+	{
+		poly1305_mul26(r[i], r[i - 1], r[1]);
+	}
+	poly1305_to26(h, st->h);
+
+	// odd group count leaves the newest group in A
+	bool LastInA = (bytes / 64) % 2 == 1;
+
+	// two independent accumulators take alternating groups of four blocks, so the
+	// multiply and carry latency of one overlaps with the other; each steps by r^8
+	__m256i R[5], S[5], A[5], B[5];
+	for (int i = 0; i < 5; i++)
+	{
+		R[i] = _mm256_set1_epi64x((long long)r[8][i]);
+		S[i] = _mm256_set1_epi64x((long long)(r[8][i] * 5));
+		// current hash goes into lane 0 of the first group
+		A[i] = _mm256_set_epi64x(0, 0, 0, (long long)h[i]);
+		B[i] = _mm256_setzero_si256();
+	}
+
+	poly1305_add_blocks_avx2(A, m);
+	m += 64;
+	bytes -= 64;
+	if (bytes != 0)
+	{
+		poly1305_add_blocks_avx2(B, m);
+		m += 64;
+		bytes -= 64;
+	}
+
+	while (bytes >= 128)
+	{
+		poly1305_mul_avx2(A, R, S);
+		poly1305_mul_avx2(B, R, S);
+		poly1305_add_blocks_avx2(A, m);
+		poly1305_add_blocks_avx2(B, m + 64);
+		m += 128;
+		bytes -= 128;
+	}
+	if (bytes != 0)
+	{
+		poly1305_mul_avx2(A, R, S);
+		poly1305_add_blocks_avx2(A, m);
+	}
+
+	// lane i of the newest group still needs r^(4-i), of the older group r^(8-i)
+	__m256i* Newest = LastInA ? A : B;
+	__m256i* Older = LastInA ? B : A;
+	__m256i RN[5], SN[5], RO[5], SO[5];
+	for (int i = 0; i < 5; i++)
+	{
+		RN[i] = _mm256_set_epi64x((long long)r[1][i], (long long)r[2][i], (long long)r[3][i], (long long)r[4][i]);
+		RO[i] = _mm256_set_epi64x((long long)r[5][i], (long long)r[6][i], (long long)r[7][i], (long long)r[8][i]);
+		SN[i] = _mm256_mul_epu32(RN[i], _mm256_set1_epi64x(5));
+		SO[i] = _mm256_mul_epu32(RO[i], _mm256_set1_epi64x(5));
+	}
+	poly1305_mul_avx2(Newest, RN, SN);
+	poly1305_mul_avx2(Older, RO, SO);
+
+	for (int i = 0; i < 5; i++)
+	{
+		uint64_t Lanes[4];
+		_mm256_storeu_si256((__m256i*)Lanes, _mm256_add_epi64(A[i], B[i]));
+		h[i] = Lanes[0] + Lanes[1] + Lanes[2] + Lanes[3];
+	}
+	poly1305_from26(st->h, h);
+}
+
+#endif // DERPNET_USE_SIMD
+
 static void poly1305_update(poly1305_state_internal_t* st, const uint8_t* m, size_t bytes)
 {
 	/* handle leftover */
@@ -726,6 +1292,15 @@ static void poly1305_update(poly1305_state_internal_t* st, const uint8_t* m, siz
 	}
 
 	/* process full blocks */
+#if DERPNET_USE_SIMD
+	if (bytes >= poly1305_avx2_min_bytes && DerpNet__GetSimdLevel() >= DERPNET_SIMD_AVX2)
+	{
+		size_t want = (bytes & ~(size_t)63);
+		poly1305_blocks_avx2(st, m, want);
+		m += want;
+		bytes -= want;
+	}
+#endif
 	if (bytes >= poly1305_block_size)
 	{
 		size_t want = (bytes & ~(poly1305_block_size - 1));
@@ -825,9 +1400,8 @@ static void hsalsa20(uint8_t Output[32], const uint8_t Input[16], const uint8_t
 	Set32LE(&Output[28], x[ 9]);
 }
 
-static void salsa20(uint8_t Output[64], const uint8_t Input[16], const uint8_t Key[32])
+static void salsa20_state(uint32_t x[16], const uint8_t Input[16], const uint8_t Key[32])
 {
-	uint32_t x[16];
 	x[ 0] = Get32LE((uint8_t*)&salsa20_constant[0]);
 	x[ 1] = Get32LE(&Key[ 0]);
 	x[ 2] = Get32LE(&Key[ 4]);
@@ -844,6 +1418,12 @@ static void salsa20(uint8_t Output[64], const uint8_t Input[16], const uint8_t K
 	x[13] = Get32LE(&Key[24]);
 	x[14] = Get32LE(&Key[28]);
 	x[15] = Get32LE((uint8_t*)&salsa20_constant[12]);
+}
+
+static void salsa20(uint8_t Output[64], const uint8_t Input[16], const uint8_t Key[32])
+{
+	uint32_t x[16];
+	salsa20_state(x, Input, Key);
 
 	uint32_t j[16];
 	memcpy(j, x, sizeof(j));
@@ -856,7 +1436,7 @@ static void salsa20(uint8_t Output[64], const uint8_t Input[16], const uint8_t K
 	}
 }
 
-static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
+static void salsa20_xor_scalar(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
 {
 	uint8_t TempInput[16];
 	uint8_t Block[64];
@@ -865,7 +1445,8 @@ static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize,
 
 	while (InputSize >= 64)
 	{
-		memcpy(TempInput + 8, &Counter, sizeof(Counter));
+		Set32LE(TempInput +  8, (uint32_t)Counter);
+		Set32LE(TempInput + 12, (uint32_t)(Counter >> 32));
 		salsa20(Block, TempInput, Key);
 
 		for (size_t i = 0; i < 64; ++i)
@@ -882,7 +1463,8 @@ static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize,
 
 	if (InputSize)
 	{
-		memcpy(TempInput + 8, &Counter, sizeof(Counter));
+		Set32LE(TempInput +  8, (uint32_t)Counter);
+		Set32LE(TempInput + 12, (uint32_t)(Counter >> 32));
 		salsa20(Block, TempInput, Key);
 
 		for (size_t i = 0; i < InputSize; ++i)
@@ -892,6 +1474,210 @@ static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize,
 	}
 }
 
+#if DERPNET_USE_SIMD
+
+//
+// Multi-block salsa20: every vector lane runs the scalar algorithm for a different block,
+// lanes differ only in block counter (words 8 and 9). After the rounds each group of four
+// state words is transposed back into per-block order. Output is identical to salsa20_xor_scalar.
+//
+
+#define SALSA20_QV(a,b,c,d, ADD, XOR, ROL) \
+	x[b] = XOR(x[b], ROL(ADD(x[a], x[d]),  7)); \
+	x[c] = XOR(x[c], ROL(ADD(x[b], x[a]),  9)); \
+	x[d] = XOR(x[d], ROL(ADD(x[c], x[b]), 13)); \
+	x[a] = XOR(x[a], ROL(ADD(x[d], x[c]), 18))
+
+#define SALSA20_ROUNDS_V(ADD, XOR, ROL) \
+	for (int i = 0; i < 20; i += 2) \
+	{ \
+		SALSA20_QV( 0,  4,  8, 12, ADD, XOR, ROL); \
+		SALSA20_QV( 5,  9, 13,  1, ADD, XOR, ROL); \
+		SALSA20_QV(10, 14,  2,  6, ADD, XOR, ROL); \
+		SALSA20_QV(15,  3,  7, 11, ADD, XOR, ROL); \
+		SALSA20_QV( 0,  1,  2,  3, ADD, XOR, ROL); \
+		SALSA20_QV( 5,  6,  7,  4, ADD, XOR, ROL); \
+		SALSA20_QV(10, 11,  8,  9, ADD, XOR, ROL); \
+		SALSA20_QV(15, 12, 13, 14, ADD, XOR, ROL); \
+	}
+
+#define SALSA20_ROL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define SALSA20_ROL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+// processes whole groups of 4 blocks, returns number of bytes done
+DERPNET_TARGET_SSE2
+static size_t salsa20_xor_sse2(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
+{
+	uint8_t TempInput[16] = { 0 };
+	memcpy(TempInput, Nonce, 8);
+
+	uint32_t s[16];
+	salsa20_state(s, TempInput, Key);
+
+	size_t Done = 0;
+	while (InputSize - Done >= 4 * 64)
+	{
+		__m128i j[16];
+		for (int i = 0; i < 16; i++)
+		{
+			j[i] = _mm_set1_epi32((int)s[i]);
+		}
+
+		uint64_t c0 = Counter, c1 = Counter + 1, c2 = Counter + 2, c3 = Counter + 3;
+		j[8] = _mm_set_epi32((int)(uint32_t)c3, (int)(uint32_t)c2, (int)(uint32_t)c1, (int)(uint32_t)c0);
+		j[9] = _mm_set_epi32((int)(uint32_t)(c3 >> 32), (int)(uint32_t)(c2 >> 32), (int)(uint32_t)(c1 >> 32), (int)(uint32_t)(c0 >> 32));
+
+		__m128i x[16];
+		for (int i = 0; i < 16; i++)
+		{
+			x[i] = j[i];
+		}
+
+		SALSA20_ROUNDS_V(_mm_add_epi32, _mm_xor_si128, SALSA20_ROL_SSE2);
+
+		for (int g = 0; g < 4; g++)
+		{
+			__m128i x0 = _mm_add_epi32(x[4 * g + 0], j[4 * g + 0]);
+			__m128i x1 = _mm_add_epi32(x[4 * g + 1], j[4 * g + 1]);
+			__m128i x2 = _mm_add_epi32(x[4 * g + 2], j[4 * g + 2]);
+			__m128i x3 = _mm_add_epi32(x[4 * g + 3], j[4 * g + 3]);
+
+			__m128i t0 = _mm_unpacklo_epi32(x0, x1);
+			__m128i t1 = _mm_unpackhi_epi32(x0, x1);
+			__m128i t2 = _mm_unpacklo_epi32(x2, x3);
+			__m128i t3 = _mm_unpackhi_epi32(x2, x3);
+
+			// b[k] = words 4g..4g+3 of block k
+			__m128i b[4];
+			b[0] = _mm_unpacklo_epi64(t0, t2);
+			b[1] = _mm_unpackhi_epi64(t0, t2);
+			b[2] = _mm_unpacklo_epi64(t1, t3);
+			b[3] = _mm_unpackhi_epi64(t1, t3);
+
+			for (int k = 0; k < 4; k++)
+			{
+				size_t Offset = Done + k * 64 + g * 16;
+				__m128i In = _mm_loadu_si128((const __m128i*)(Input + Offset));
+				_mm_storeu_si128((__m128i*)(Output + Offset), _mm_xor_si128(In, b[k]));
+			}
+		}
+
+		Counter += 4;
+		Done += 4 * 64;
+	}
+	return Done;
+}
+
+// processes whole groups of 8 blocks, returns number of bytes done
+DERPNET_TARGET_AVX2
+static size_t salsa20_xor_avx2(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
+{
+	uint8_t TempInput[16] = { 0 };
+	memcpy(TempInput, Nonce, 8);
+
+	uint32_t s[16];
+	salsa20_state(s, TempInput, Key);
+
+	size_t Done = 0;
+	while (InputSize - Done >= 8 * 64)
+	{
+		__m256i j[16];
+		for (int i = 0; i < 16; i++)
+		{
+			j[i] = _mm256_set1_epi32((int)s[i]);
+		}
+
+		uint32_t Lo[8], Hi[8];
+		for (int k = 0; k < 8; k++)
+		{
+			Lo[k] = (uint32_t)(Counter + k);
+			Hi[k] = (uint32_t)((Counter + k) >> 32);
+		}
+		j[8] = _mm256_loadu_si256((const __m256i*)Lo);
+		j[9] = _mm256_loadu_si256((const __m256i*)Hi);
+
+		__m256i x[16];
+		for (int i = 0; i < 16; i++)
+		{
+			x[i] = j[i];
+		}
+
+		SALSA20_ROUNDS_V(_mm256_add_epi32, _mm256_xor_si256, SALSA20_ROL_AVX2);
+
+		// b[g][k] = words 4g..4g+3 of block k in low 128 bits, of block k+4 in high 128 bits
+		__m256i b[4][4];
+		for (int g = 0; g < 4; g++)
+		{
+			__m256i x0 = _mm256_add_epi32(x[4 * g + 0], j[4 * g + 0]);
+			__m256i x1 = _mm256_add_epi32(x[4 * g + 1], j[4 * g + 1]);
+			__m256i x2 = _mm256_add_epi32(x[4 * g + 2], j[4 * g + 2]);
+			__m256i x3 = _mm256_add_epi32(x[4 * g + 3], j[4 * g + 3]);
+
+			__m256i t0 = _mm256_unpacklo_epi32(x0, x1);
+			__m256i t1 = _mm256_unpackhi_epi32(x0, x1);
+			__m256i t2 = _mm256_unpacklo_epi32(x2, x3);
+			__m256i t3 = _mm256_unpackhi_epi32(x2, x3);
+
+			b[g][0] = _mm256_unpacklo_epi64(t0, t2);
+			b[g][1] = _mm256_unpackhi_epi64(t0, t2);
+			b[g][2] = _mm256_unpacklo_epi64(t1, t3);
+			b[g][3] = _mm256_unpackhi_epi64(t1, t3);
+		}
+
+		for (int k = 0; k < 4; k++)
+		{
+			// first and second 32 bytes of block k (0x20) and block k+4 (0x31)
+			__m256i Block[4];
+			Block[0] = _mm256_permute2x128_si256(b[0][k], b[1][k], 0x20);
+			Block[1] = _mm256_permute2x128_si256(b[2][k], b[3][k], 0x20);
+			Block[2] = _mm256_permute2x128_si256(b[0][k], b[1][k], 0x31);
+			Block[3] = _mm256_permute2x128_si256(b[2][k], b[3][k], 0x31);
+
+			size_t Offset[4] = { Done + k * 64, Done + k * 64 + 32, Done + (k + 4) * 64, Done + (k + 4) * 64 + 32 };
+			for (int h = 0; h < 4; h++)
+			{
+				__m256i In = _mm256_loadu_si256((const __m256i*)(Input + Offset[h]));
+				_mm256_storeu_si256((__m256i*)(Output + Offset[h]), _mm256_xor_si256(In, Block[h]));
+			}
+		}
+
+		Counter += 8;
+		Done += 8 * 64;
+	}
+	return Done;
+}
+
+#undef SALSA20_QV
+#undef SALSA20_ROUNDS_V
+#undef SALSA20_ROL_SSE2
+#undef SALSA20_ROL_AVX2
+
+#endif // DERPNET_USE_SIMD
+
+static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
+{
+#if DERPNET_USE_SIMD
+	int Level = DerpNet__GetSimdLevel();
+
+	size_t Done = 0;
+	if (Level >= DERPNET_SIMD_AVX2)
+	{
+		Done += salsa20_xor_avx2(Output, Input, InputSize, Key, Nonce, Counter);
+	}
+	if (Level >= DERPNET_SIMD_SSE2)
+	{
+		Done += salsa20_xor_sse2(Output + Done, Input + Done, InputSize - Done, Key, Nonce, Counter + Done / 64);
+	}
+
+	Output += Done;
+	Input += Done;
+	InputSize -= Done;
+	Counter += Done / 64;
+#endif
+
+	salsa20_xor_scalar(Output, Input, InputSize, Key, Nonce, Counter);
+}
+
 //
 // nacl box seal/unseal
 //
@@ -905,7 +1691,7 @@ static void DerpNet__GetSharedKey(uint8_t SharedKey[32], const uint8_t PrivateKe
 	hsalsa20(SharedKey, ZeroInput, SharedSecret);
 }
 
-static void DerpNet__BoxSealEx(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t SharedKey[32])
+static void DerpNet__BoxSealV(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const DerpNetIoVec* Input, size_t InputCount, const uint8_t SharedKey[32])
 {
 	// xsalsa20 key construction
 	uint8_t SubKey[32];
@@ -914,15 +1700,60 @@ static void DerpNet__BoxSealEx(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Out
 	uint8_t FirstBlock[64] = { 0 };
 	salsa20_xor(FirstBlock, FirstBlock, sizeof(FirstBlock), SubKey, Nonce + 16, 0);
 
-	size_t FirstSize = InputSize > 32 ? 32 : InputSize;
-	for (size_t i = 0; i < FirstSize; i++)
+	// message keystream starts at byte 32 of block 0; Block keeps the unused
+	// part of the current keystream block across input buffer boundaries
+	uint8_t Block[64];
+	memcpy(Block, FirstBlock, sizeof(Block));
+	size_t BlockUsed = 32;
+	uint64_t Counter = 1;
+
+	uint8_t* Out = Output;
+	for (size_t Index = 0; Index < InputCount; Index++)
 	{
-		Output[i] = Input[i] ^ FirstBlock[32 + i];
+		const uint8_t* In = (const uint8_t*)Input[Index].Data;
+		size_t InSize = Input[Index].Size;
+
+		while (InSize != 0)
+		{
+			if (BlockUsed == sizeof(Block))
+			{
+				if (InSize >= sizeof(Block))
+				{
+					// block aligned, whole blocks go through salsa20_xor directly
+					size_t BulkSize = InSize & ~(sizeof(Block) - 1);
+					salsa20_xor(Out, In, BulkSize, SubKey, Nonce + 16, Counter);
+					Counter += BulkSize / sizeof(Block);
+					Out += BulkSize;
+					In += BulkSize;
+					InSize -= BulkSize;
+					continue;
+				}
+
+				memset(Block, 0, sizeof(Block));
+				salsa20_xor(Block, Block, sizeof(Block), SubKey, Nonce + 16, Counter++);
+				BlockUsed = 0;
+			}
+
+			size_t Size = sizeof(Block) - BlockUsed;
+			Size = InSize < Size ? InSize : Size;
+			for (size_t i = 0; i < Size; i++)
+			{
+				Out[i] = In[i] ^ Block[BlockUsed + i];
+			}
+			BlockUsed += Size;
+			Out += Size;
+			In += Size;
+			InSize -= Size;
+		}
 	}
 
-	salsa20_xor(Output + FirstSize, Input + FirstSize, InputSize - FirstSize, SubKey, Nonce + 16, 1);
+	poly1305_auth(Auth, Output, Out - Output, FirstBlock);
+}
 
-	poly1305_auth(Auth, Output, InputSize, FirstBlock);
+static void DerpNet__BoxSealEx(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t SharedKey[32])
+{
+	DerpNetIoVec Data = { Input, InputSize };
+	DerpNet__BoxSealV(Nonce, Auth, Output, &Data, 1, SharedKey);
 }
 
 static void DerpNet__BoxSeal(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
@@ -984,6 +1815,7 @@ void DerpNet_GetPublicKey(const DerpKey* UserSecret, DerpKey* UserPublic)
 	curve25519_scalarmult(UserPublic->Bytes, UserSecret->Bytes, Base);
 }
 
+#if !DERPNET_USE_PLAIN_HTTP
 static bool DerpNet__TlsHandshake(DerpNet* Net, const char* Hostname, CredHandle* CredentialHandle, CtxtHandle* ContextHandle)
 {
 	DERPNET_LOG("TLS Handshake starting for host: %s", Hostname);
@@ -1116,83 +1948,143 @@ static bool DerpNet__TlsHandshake(DerpNet* Net, const char* Hostname, CredHandle
 		Net->BufferReceived += ReadSize;
 	}
 }
+#endif // !DERPNET_USE_PLAIN_HTTP
 
-static bool DerpNet__TlsWrite(DerpNet* Net, const void* Data, size_t DataSize)
+// returns 1 when socket is readable (or writable), 0 if not and Wait=false, -1 on error
+static int DerpNet__WaitSocket(DerpNet* Net, bool Write, bool Wait)
 {
-#if DERPNET_USE_PLAIN_HTTP
-	while (DataSize != 0)
-	{
-		fd_set WriteSet;
-		FD_ZERO(&WriteSet);
-		FD_SET(Net->Socket, &WriteSet);
-
-		int Select = select((int)(Net->Socket + 1), NULL, &WriteSet, NULL, NULL);
-		if (Select < 0)
-		{
-			DERPNET_LOG("select failed");
-			return false;
-		}
+#if defined(_WIN32)
+	fd_set Set;
+	FD_ZERO(&Set);
+	FD_SET(Net->Socket, &Set);
 
-		int WriteSize = send(Net->Socket, Data, (int)DataSize, 0);
-		if (WriteSize <= 0)
+	struct timeval TimeVal = { 0, 0 };
+	return select((int)(Net->Socket + 1), Write ? NULL : &Set, Write ? &Set : NULL, NULL, Wait ? NULL : &TimeVal);
+#else
+	// poll instead of select, fd numbers go past FD_SETSIZE when benchmarks open many connections
+	struct pollfd Poll = { .fd = (int)Net->Socket, .events = Write ? POLLOUT : POLLIN };
+	for (;;)
+	{
+		// POLLHUP/POLLERR also count as ready, following recv/send reports the error
+		int Result = poll(&Poll, 1, Wait ? -1 : 0);
+		if (Result < 0 && errno == EINTR)
 		{
-			DERPNET_LOG("failed to send data to server, remote server disconnected?");
-			return false;
+			continue;
 		}
-		Net->TotalSent += WriteSize;
-
-		Data = (char*)Data + WriteSize;
-		DataSize -= WriteSize;
+		return Result;
 	}
-	return true; 
-#else
-	CtxtHandle ContextHandle;
-	memcpy(&ContextHandle, Net->CtxHandle, sizeof(ContextHandle));
+#endif
+}
 
-	SecPkgContext_StreamSizes StreamSizes;
-	SECURITY_STATUS SecStatus = QueryContextAttributes(&ContextHandle, SECPKG_ATTR_STREAM_SIZES, &StreamSizes);
-	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+static bool DerpNet__WaitWritable(DerpNet* Net)
+{
+	Net->SendCalls++;
+	if (DerpNet__WaitSocket(Net, true, true) < 0)
+	{
+		DERPNET_LOG("waiting for writable socket failed");
+		return false;
+	}
+	return true;
+}
 
-	while (DataSize != 0)
+#define DERPNET_WRITEV_MAX 4
+
+// one vectored socket write, returns bytes written, 0 if socket is not writable, -1 on error
+// Wait=false never blocks, even if socket is in blocking mode
+static int DerpNet__SocketWriteV(DerpNet* Net, const DerpNetIoVec* Data, size_t DataCount, bool Wait)
+{
+	Net->SendCalls++;
+#if defined(_WIN32)
+	// socket is non-blocking after WSAEventSelect, Wait makes no difference
+	(void)Wait;
+
+	WSABUF Buffers[DERPNET_WRITEV_MAX];
+	for (size_t i = 0; i < DataCount; i++)
+	{
+		Buffers[i].buf = (char*)Data[i].Data;
+		Buffers[i].len = (ULONG)Data[i].Size;
+	}
+
+	DWORD Sent;
+	if (WSASend(Net->Socket, Buffers, (DWORD)DataCount, &Sent, 0, NULL, NULL) != 0)
+	{
+		return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+	}
+	return (int)Sent;
+#else
+	struct iovec Buffers[DERPNET_WRITEV_MAX];
+	for (size_t i = 0; i < DataCount; i++)
+	{
+		Buffers[i].iov_base = (void*)Data[i].Data;
+		Buffers[i].iov_len = Data[i].Size;
+	}
+
+	// sendmsg instead of writev to pass MSG_NOSIGNAL
+	struct msghdr Message = { .msg_iov = Buffers, .msg_iovlen = DataCount };
+	ssize_t Sent = sendmsg((int)Net->Socket, &Message, DERPNET_SEND_FLAGS | (Wait ? 0 : MSG_DONTWAIT));
+	if (Sent < 0)
 	{
-		size_t DataSizeToUse = min(DataSize, StreamSizes.cbMaximumMessage);
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+	return (int)Sent;
+#endif
+}
 
-		char WriteBuffer[16384 + 512];
-		DERPNET_ASSERT(StreamSizes.cbHeader + StreamSizes.cbMaximumMessage + StreamSizes.cbTrailer <= sizeof(WriteBuffer));
+#if !DERPNET_USE_PLAIN_HTTP
 
-		SecBuffer OutBuffers[3] = { 0 };
-		OutBuffers[0].BufferType = SECBUFFER_STREAM_HEADER;
-		OutBuffers[0].pvBuffer = WriteBuffer;
-		OutBuffers[0].cbBuffer = StreamSizes.cbHeader;
-		OutBuffers[1].BufferType = SECBUFFER_DATA;
-		OutBuffers[1].pvBuffer = WriteBuffer + StreamSizes.cbHeader;
-		OutBuffers[1].cbBuffer = (unsigned)DataSizeToUse;
-		OutBuffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
-		OutBuffers[2].pvBuffer = WriteBuffer + StreamSizes.cbHeader + DataSizeToUse;
-		OutBuffers[2].cbBuffer = StreamSizes.cbTrailer;
+// encrypts up to one TLS record worth of data, returns how much of Data was used
+static size_t DerpNet__TlsEncryptRecord(DerpNet* Net, const void* Data, size_t DataSize, uint8_t* Record, size_t* RecordSize)
+{
+	CtxtHandle ContextHandle;
+	memcpy(&ContextHandle, Net->CtxHandle, sizeof(ContextHandle));
 
-		memcpy(OutBuffers[1].pvBuffer, Data, DataSizeToUse);
+	SecPkgContext_StreamSizes StreamSizes;
+	SECURITY_STATUS SecStatus = QueryContextAttributes(&ContextHandle, SECPKG_ATTR_STREAM_SIZES, &StreamSizes);
+	DERPNET_ASSERT(SecStatus == SEC_E_OK);
 
-		SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
-		SecStatus = EncryptMessage(&ContextHandle, 0, &OutDesc, 0);
-		DERPNET_ASSERT(SecStatus == SEC_E_OK);
+	size_t DataSizeToUse = min(DataSize, StreamSizes.cbMaximumMessage);
+	DERPNET_ASSERT(StreamSizes.cbHeader + StreamSizes.cbMaximumMessage + StreamSizes.cbTrailer <= sizeof(Net->TlsRecord));
+
+	SecBuffer OutBuffers[3] = { 0 };
+	OutBuffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+	OutBuffers[0].pvBuffer = Record;
+	OutBuffers[0].cbBuffer = StreamSizes.cbHeader;
+	OutBuffers[1].BufferType = SECBUFFER_DATA;
+	OutBuffers[1].pvBuffer = Record + StreamSizes.cbHeader;
+	OutBuffers[1].cbBuffer = (unsigned)DataSizeToUse;
+	OutBuffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+	OutBuffers[2].pvBuffer = Record + StreamSizes.cbHeader + DataSizeToUse;
+	OutBuffers[2].cbBuffer = StreamSizes.cbTrailer;
+
+	memcpy(OutBuffers[1].pvBuffer, Data, DataSizeToUse);
+	Net->TotalCopied += DataSizeToUse;
+
+	SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
+	SecStatus = EncryptMessage(&ContextHandle, 0, &OutDesc, 0);
+	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+
+	*RecordSize = OutBuffers[0].cbBuffer + OutBuffers[1].cbBuffer + OutBuffers[2].cbBuffer;
+	return DataSizeToUse;
+}
+
+static bool DerpNet__TlsWriteRecords(DerpNet* Net, const void* Data, size_t DataSize)
+{
+	while (DataSize != 0)
+	{
+		uint8_t WriteBuffer[sizeof(Net->TlsRecord)];
+		size_t SizeToSend;
+		size_t DataSizeToUse = DerpNet__TlsEncryptRecord(Net, Data, DataSize, WriteBuffer, &SizeToSend);
 
-		int SizeToSend = OutBuffers[0].cbBuffer + OutBuffers[1].cbBuffer + OutBuffers[2].cbBuffer;
-		int BytesSent = 0;
+		size_t BytesSent = 0;
 		while (BytesSent != SizeToSend)
 		{
-			fd_set WriteSet;
-			FD_ZERO(&WriteSet);
-			FD_SET(Net->Socket, &WriteSet);
-
-			int Select = select((int)(Net->Socket + 1), NULL, &WriteSet, NULL, NULL);
-			if (Select < 0)
+			if (!DerpNet__WaitWritable(Net))
 			{
-				DERPNET_LOG("select failed");
 				return false;
 			}
 
-			int WriteSize = send(Net->Socket, WriteBuffer + BytesSent, SizeToSend - BytesSent, 0);
+			Net->SendCalls++;
+			int WriteSize = send(Net->Socket, (char*)WriteBuffer + BytesSent, (int)(SizeToSend - BytesSent), 0);
 			if (WriteSize <= 0)
 			{
 				DERPNET_LOG("failed to send data to server, remote server disconnected?");
@@ -1207,43 +2099,114 @@ static bool DerpNet__TlsWrite(DerpNet* Net, const void* Data, size_t DataSize)
 	}
 
 	return true;
-#endif
 }
 
-static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
-{
-#if DERPNET_USE_PLAIN_HTTP
-	fd_set ReadSet;
-	FD_ZERO(&ReadSet);
-	FD_SET(Net->Socket, &ReadSet);
+#endif
 
-	struct timeval TimeVal = { 0, 0 };
-	int Select = select((int)(Net->Socket + 1), &ReadSet, NULL, NULL, Wait ? NULL : &TimeVal);
-	if (Select < 0)
-	{
-		return false;
-	}
-	if (Select == 0)
+static bool DerpNet__TlsWriteV(DerpNet* Net, const DerpNetIoVec* Data, size_t DataCount)
+{
+#if !DERPNET_USE_PLAIN_HTTP
+	// direct connections have no TLS, they write like plain HTTP builds
+	if (!Net->Direct)
 	{
+		// every TLS record is encrypted and written separately
+		for (size_t i = 0; i < DataCount; i++)
+		{
+			if (!DerpNet__TlsWriteRecords(Net, Data[i].Data, Data[i].Size))
+			{
+				return false;
+			}
+		}
 		return true;
 	}
+#endif
 
-	int ReadSize = recv(Net->Socket, (char*)Net->Buffer + Net->BufferReceived, (int)(sizeof(Net->Buffer) - Net->BufferReceived), 0);
-	if (ReadSize <= 0)
+	DerpNetIoVec Pending[DERPNET_WRITEV_MAX];
+	size_t PendingCount = 0;
+	for (size_t i = 0; i < DataCount; i++)
 	{
-		DERPNET_LOG("failed to read data from server, remote server disconnected?");
-		return false;
+		if (Data[i].Size != 0)
+		{
+			DERPNET_ASSERT(PendingCount < DERPNET_WRITEV_MAX);
+			Pending[PendingCount++] = Data[i];
+		}
 	}
-	Net->TotalReceived += ReadSize;
-	Net->BufferReceived += ReadSize;
-	Net->BufferSize += ReadSize;
 
-	DERPNET_LOG("read %d bytes from socket", ReadSize);
-	WSAResetEvent(Net->SocketEvent);
+	size_t First = 0;
+	while (First != PendingCount)
+	{
+		// try writing first, only wait in select when socket buffer is full
+		int WriteSize = DerpNet__SocketWriteV(Net, Pending + First, PendingCount - First, true);
+		if (WriteSize < 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return false;
+		}
+		if (WriteSize == 0)
+		{
+			if (!DerpNet__WaitWritable(Net))
+			{
+				return false;
+			}
+			continue;
+		}
+		Net->TotalSent += WriteSize;
 
+		size_t Written = (size_t)WriteSize;
+		while (Written != 0)
+		{
+			size_t Size = Pending[First].Size < Written ? Pending[First].Size : Written;
+			Pending[First].Data = (const uint8_t*)Pending[First].Data + Size;
+			Pending[First].Size -= Size;
+			Written -= Size;
+			if (Pending[First].Size == 0)
+			{
+				First++;
+			}
+		}
+	}
 	return true;
+}
 
-#else
+static bool DerpNet__TlsWrite(DerpNet* Net, const void* Data, size_t DataSize)
+{
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet__TlsWriteV(Net, &Iov, 1);
+}
+
+//
+// Receive buffer layout:
+//
+//   Buffer = [cccccccccccppppppppppppppppeeeeeeeeee..............]
+//             ^          ^               ^         ^
+//             |          |               |         |
+//   consumed -+          |               |         |
+//   Buffer + BufferStart +               |         |
+//   Buffer + BufferSize -----------------+         |
+//   Buffer + BufferReceived -----------------------+
+//
+// Consuming a frame only advances BufferStart, frames are handed out as pointers into the buffer.
+// Unconsumed bytes are moved to the front only when there is no space left at the end, which
+// happens once per buffer's worth of data and moves at most one partially received frame.
+//
+
+static void DerpNet__TlsCompact(DerpNet* Net)
+{
+	size_t Size = Net->BufferReceived - Net->BufferStart;
+	memmove(Net->Buffer, Net->Buffer + Net->BufferStart, Size);
+	Net->TotalMoved += Size;
+
+	Net->BufferSize -= Net->BufferStart;
+	Net->BufferReceived -= Net->BufferStart;
+	Net->BufferStart = 0;
+
+	DERPNET_LOG("compacted input buffer, moved %zu bytes", Size);
+}
+
+#if !DERPNET_USE_PLAIN_HTTP
+
+static bool DerpNet__TlsReadRecord(DerpNet* Net, bool Wait)
+{
 	CtxtHandle ContextHandle;
 	memcpy(&ContextHandle, Net->CtxHandle, sizeof(ContextHandle));
 
@@ -1317,11 +2280,13 @@ static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
 
 				memmove(Net->Buffer + Net->BufferSize, InBuffers[1].pvBuffer, InBuffers[1].cbBuffer);
 				Net->BufferSize += InBuffers[1].cbBuffer;
+				Net->TotalMoved += InBuffers[1].cbBuffer;
 
 				if (InBuffers[3].BufferType == SECBUFFER_EXTRA)
 				{
 					size_t ExtraSize = (Net->Buffer + Net->BufferReceived) - (uint8_t*)InBuffers[3].pvBuffer;
 					memmove(Net->Buffer + Net->BufferSize, InBuffers[3].pvBuffer, ExtraSize);
+					Net->TotalMoved += ExtraSize;
 				}
 				Net->BufferReceived -= InBuffers[0].cbBuffer + StreamSizes.cbTrailer;
 				
@@ -1338,8 +2303,12 @@ static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
 
 		if (Net->BufferReceived == sizeof(Net->Buffer))
 		{
-			DERPNET_LOG("server is sending too much data instead of proper handshake?");
-			return false;
+			if (Net->BufferStart == 0)
+			{
+				DERPNET_LOG("server is sending too much data instead of proper handshake?");
+				return false;
+			}
+			DerpNet__TlsCompact(Net);
 		}
 
 		DERPNET_LOG("reading more data from socket, BufferSize=%zu, BufferReceived=%zu", Net->BufferSize, Net->BufferReceived);
@@ -1371,7 +2340,50 @@ static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
 		DERPNET_LOG("read %d bytes from socket, BufferReceived=%zu", ReadSize, Net->BufferReceived);
 		WSAResetEvent(Net->SocketEvent);
 	}
+}
+
+#endif
+
+static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
+{
+#if !DERPNET_USE_PLAIN_HTTP
+	if (!Net->Direct)
+	{
+		return DerpNet__TlsReadRecord(Net, Wait);
+	}
+#endif
+
+	int Ready = DerpNet__WaitSocket(Net, false, Wait);
+	if (Ready < 0)
+	{
+		return false;
+	}
+	if (Ready == 0)
+	{
+		return true;
+	}
+
+	if (Net->BufferReceived == sizeof(Net->Buffer))
+	{
+		DerpNet__TlsCompact(Net);
+	}
+
+	int ReadSize = recv(Net->Socket, (char*)Net->Buffer + Net->BufferReceived, (int)(sizeof(Net->Buffer) - Net->BufferReceived), 0);
+	if (ReadSize <= 0)
+	{
+		DERPNET_LOG("failed to read data from server, remote server disconnected?");
+		return false;
+	}
+	Net->TotalReceived += ReadSize;
+	Net->BufferReceived += ReadSize;
+	Net->BufferSize += ReadSize;
+
+	DERPNET_LOG("read %d bytes from socket", ReadSize);
+#if defined(_WIN32)
+	WSAResetEvent(Net->SocketEvent);
 #endif
+
+	return true;
 }
 
 static void DerpNet__TlsConsume(DerpNet* Net, size_t PlaintextSize)
@@ -1382,13 +2394,16 @@ static void DerpNet__TlsConsume(DerpNet* Net, size_t PlaintextSize)
 	}
 
 	DERPNET_ASSERT(Net->BufferSize <= Net->BufferReceived);
-	DERPNET_ASSERT(PlaintextSize <= Net->BufferSize);
+	DERPNET_ASSERT(Net->BufferStart + PlaintextSize <= Net->BufferSize);
 
-	memmove(Net->Buffer, Net->Buffer + PlaintextSize, Net->BufferReceived - PlaintextSize);
-	Net->BufferSize -= PlaintextSize;
-	Net->BufferReceived -= PlaintextSize;
+	Net->BufferStart += PlaintextSize;
+	if (Net->BufferStart == Net->BufferReceived)
+	{
+		// nothing left, next read can start at the front without moving anything
+		Net->BufferStart = Net->BufferSize = Net->BufferReceived = 0;
+	}
 
-	DERPNET_LOG("consumed %zu bytes from input buffer, BufferSize=%zu, BufferReceived=%zu", PlaintextSize, Net->BufferSize, Net->BufferReceived);
+	DERPNET_LOG("consumed %zu bytes from input buffer, BufferStart=%zu, BufferSize=%zu, BufferReceived=%zu", PlaintextSize, Net->BufferStart, Net->BufferSize, Net->BufferReceived);
 }
 
 static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameSize, bool Wait)
@@ -1399,7 +2414,10 @@ static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameS
 	{
 		for (;;)
 		{
-			if (Net->BufferSize < FrameHeaderSize)
+			const uint8_t* Frame = Net->Buffer + Net->BufferStart;
+			size_t Available = Net->BufferSize - Net->BufferStart;
+
+			if (Available < FrameHeaderSize)
 			{
 				if (!DerpNet__TlsRead(Net, Wait))
 				{
@@ -1408,10 +2426,16 @@ static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameS
 				continue;
 			}
 
-			*FrameType = Net->Buffer[0];
-			*FrameSize = Get32BE(Net->Buffer + 1);
+			*FrameType = Frame[0];
+			*FrameSize = Get32BE(Frame + 1);
+
+			if (FrameHeaderSize + *FrameSize > sizeof(Net->Buffer))
+			{
+				DERPNET_LOG("frame too large, size=%u", *FrameSize);
+				return -1;
+			}
 
-			if (Net->BufferSize < FrameHeaderSize + *FrameSize)
+			if (Available < FrameHeaderSize + *FrameSize)
 			{
 				if (!DerpNet__TlsRead(Net, Wait))
 				{
@@ -1436,7 +2460,10 @@ static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameS
 			return -1;
 		}
 
-		if (Net->BufferSize < FrameHeaderSize)
+		const uint8_t* Frame = Net->Buffer + Net->BufferStart;
+		size_t Available = Net->BufferSize - Net->BufferStart;
+
+		if (Available < FrameHeaderSize)
 		{
 			if (Net->BufferSize != LastBufferSize)
 			{
@@ -1446,10 +2473,16 @@ static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameS
 			return 0;
 		}
 
-		*FrameType = Net->Buffer[0];
-		*FrameSize = Get32BE(Net->Buffer + 1);
+		*FrameType = Frame[0];
+		*FrameSize = Get32BE(Frame + 1);
+
+		if (FrameHeaderSize + *FrameSize > sizeof(Net->Buffer))
+		{
+			DERPNET_LOG("frame too large, size=%u", *FrameSize);
+			return -1;
+		}
 
-		if (Net->BufferSize < FrameHeaderSize + *FrameSize)
+		if (Available < FrameHeaderSize + *FrameSize)
 		{
 			if (Net->BufferSize != LastBufferSize)
 			{
@@ -1466,92 +2499,472 @@ static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameS
 	}
 }
 
-bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret)
-{
-	CredHandle CredHandle;
-	CtxtHandle CtxHandle;
-
-	SecInvalidateHandle(&CredHandle);
-	SecInvalidateHandle(&CtxHandle);
-
-	struct addrinfo* AddrInfo = NULL;
-	Net->Socket = INVALID_SOCKET;
-	Net->SocketEvent = NULL;
-	Net->BufferSize = Net->BufferReceived = 0;
-	Net->TotalReceived = Net->TotalSent = 0;
-
-	WSADATA SocketData;
-	int SocketOk = WSAStartup(MAKEWORD(2, 2), &SocketData);
-	DERPNET_ASSERT(SocketOk == 0);
+//
+// Socket readiness events: WSAEventSelect on Windows, epoll on Linux. Both report read and
+// write readiness on one handle the caller waits on; internal waits use select/poll directly.
+//
 
-	//
-	// connect to DERP server
-	//
+// makes Socket signal the event Net already has
+static bool DerpNet__EventWatch(DerpNet* Net)
+{
+#if defined(_WIN32)
+	// FD_WRITE is signaled again after a send fails with WSAEWOULDBLOCK, see DerpNet_OnWritable
+	return WSAEventSelect(Net->Socket, Net->SocketEvent, FD_READ | FD_WRITE) == 0;
+#elif defined(__linux__)
+	// edge triggered like FD_WRITE: EPOLLOUT fires again once a send hit EAGAIN and socket drained
+	struct epoll_event Event = { .events = EPOLLIN | EPOLLOUT | EPOLLET };
+	Event.data.fd = (int)Net->Socket;
+	return epoll_ctl(Net->EventFd, EPOLL_CTL_ADD, (int)Net->Socket, &Event) == 0;
+#else
+	(void)Net;
+	return true;
+#endif
+}
 
-	struct addrinfo AddrHints =
+static bool DerpNet__EventOpen(DerpNet* Net)
+{
+#if defined(_WIN32)
+	Net->SocketEvent = WSACreateEvent();
+	if (!Net->SocketEvent)
 	{
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
-	};
+		return false;
+	}
+#elif defined(__linux__)
+	Net->EventFd = epoll_create1(EPOLL_CLOEXEC);
+	if (Net->EventFd < 0)
+	{
+		return false;
+	}
+#endif
+	return DerpNet__EventWatch(Net);
+}
 
-#if DERPNET_USE_PLAIN_HTTP
-	const char* DerpServerPort = "8080";  // Docker plain HTTP on 8080
+static void DerpNet__EventClose(DerpNet* Net)
+{
+#if defined(_WIN32)
+	if (Net->SocketEvent)
+	{
+		if (Net->EventBorrowed)
+		{
+			WSAEventSelect(Net->Socket, NULL, 0);
+		}
+		else
+		{
+			WSACloseEvent(Net->SocketEvent);
+		}
+		Net->SocketEvent = NULL;
+	}
 #else
-	const char* DerpServerPort = "8443";
-#endif
-	SocketOk = getaddrinfo(DerpServer, DerpServerPort, &AddrHints, &AddrInfo);
-	if (SocketOk != 0)
+	if (Net->EventFd >= 0)
 	{
-		DERPNET_LOG("cannot resolve '%s' hostname (error=%d)", DerpServer, SocketOk);
-		goto error;
+		if (Net->EventBorrowed)
+		{
+			epoll_ctl(Net->EventFd, EPOLL_CTL_DEL, (int)Net->Socket, NULL);
+		}
+		else
+		{
+			close(Net->EventFd);
+		}
+		Net->EventFd = -1;
 	}
+#endif
+	Net->EventBorrowed = false;
+}
 
-	DERPNET_LOG("Resolved '%s:%s' successfully", DerpServer, DerpServerPort);
+//
+// TCP connect racing all resolved addresses (RFC 8305 "Happy Eyeballs"), so a dead IPv6 address
+// or a slow first A record costs DERPNET_CONNECT_STAGGER_MS instead of a full TCP timeout
+//
 
-	Net->Socket = socket(AddrInfo->ai_family, AddrInfo->ai_socktype, AddrInfo->ai_protocol);
-	DERPNET_ASSERT(Net->Socket != INVALID_SOCKET);
+static uint64_t DerpNet__NowUs(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER Frequency, Counter;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Counter);
+	return (uint64_t)(Counter.QuadPart / Frequency.QuadPart * 1000000 + Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart);
+#else
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (uint64_t)Time.tv_sec * 1000000 + (uint64_t)Time.tv_nsec / 1000;
+#endif
+}
 
-	DERPNET_LOG("Connecting to '%s:%s'...", DerpServer, DerpServerPort);
+static void DerpNet__SetBlocking(uintptr_t Socket, bool Blocking)
+{
+#if defined(_WIN32)
+	u_long NonBlocking = !Blocking;
+	ioctlsocket(Socket, FIONBIO, &NonBlocking);
+#else
+	int Flags = fcntl((int)Socket, F_GETFL, 0);
+	fcntl((int)Socket, F_SETFL, Blocking ? Flags & ~O_NONBLOCK : Flags | O_NONBLOCK);
+#endif
+}
 
-	SocketOk = connect(Net->Socket, AddrInfo->ai_addr, (int)AddrInfo->ai_addrlen);
-	if (SocketOk != 0)
+// Race order: address families alternate, starting with the family of the first address (the
+// one getaddrinfo prefers), otherwise getaddrinfo order is kept. Returns number of addresses.
+static size_t DerpNet__ConnectOrder(const struct addrinfo* AddrInfo, const struct addrinfo** Order)
+{
+	const struct addrinfo* Preferred[DERPNET_CONNECT_MAX_ADDRESSES];
+	const struct addrinfo* Other[DERPNET_CONNECT_MAX_ADDRESSES];
+	size_t PreferredCount = 0;
+	size_t OtherCount = 0;
+
+	for (const struct addrinfo* Addr = AddrInfo; Addr; Addr = Addr->ai_next)
 	{
-		int error = WSAGetLastError();
-		DERPNET_LOG("cannot connect to '%s' server (error=%d)", DerpServer, error);
-		goto error;
+		if (Addr->ai_family == AddrInfo->ai_family)
+		{
+			if (PreferredCount < DERPNET_CONNECT_MAX_ADDRESSES) Preferred[PreferredCount++] = Addr;
+		}
+		else
+		{
+			if (OtherCount < DERPNET_CONNECT_MAX_ADDRESSES) Other[OtherCount++] = Addr;
+		}
 	}
 
-#if !defined(NDEBUG)
-	char Address[128];
-	DWORD AddressLength = ARRAYSIZE(Address);
-	WSAAddressToStringA(AddrInfo->ai_addr, (DWORD)AddrInfo->ai_addrlen, NULL, Address, &AddressLength);
-	DERPNET_LOG("connected to '%s' -> '%s' server", DerpServer, Address);
-#endif
-
-	freeaddrinfo(AddrInfo);
-	AddrInfo = NULL;
+	size_t Count = 0;
+	for (size_t i = 0; Count < DERPNET_CONNECT_MAX_ADDRESSES && (i < PreferredCount || i < OtherCount); i++)
+	{
+		if (i < PreferredCount) Order[Count++] = Preferred[i];
+		if (i < OtherCount && Count < DERPNET_CONNECT_MAX_ADDRESSES) Order[Count++] = Other[i];
+	}
+	return Count;
+}
 
-#if !DERPNET_USE_PLAIN_HTTP
-	DERPNET_LOG("Starting TLS handshake with '%s'...", DerpServer);
-	if (!DerpNet__TlsHandshake(Net, DerpServer, &CredHandle, &CtxHandle))
+// starts a non-blocking connect, returns invalid socket when it failed right away
+static uintptr_t DerpNet__ConnectStart(const struct addrinfo* Addr, bool* Connected)
+{
+	uintptr_t Socket = (uintptr_t)socket(Addr->ai_family, Addr->ai_socktype, Addr->ai_protocol);
+	if (Socket == DERPNET_INVALID_SOCKET)
 	{
-		DERPNET_LOG("TLS handshake failed");
-		goto error;
+		return Socket;
 	}
-	DERPNET_LOG("TLS handshake completed successfully");
+	DerpNet__SetBlocking(Socket, false);
 
-	DERPNET_ASSERT(sizeof(CredHandle) == sizeof(Net->CredHandle));
-	DERPNET_ASSERT(sizeof(CtxHandle) == sizeof(Net->CtxHandle));
-	memcpy(&Net->CredHandle, &CredHandle, sizeof(CredHandle));
-	memcpy(&Net->CtxHandle, &CtxHandle, sizeof(CtxHandle));
+	*Connected = connect(Socket, Addr->ai_addr, (int)Addr->ai_addrlen) == 0;
+	if (!*Connected)
+	{
+		int Error = DerpNet__SocketError();
+#if defined(_WIN32)
+		bool Pending = Error == WSAEWOULDBLOCK;
 #else
-	DERPNET_LOG("Using plain HTTP (no TLS)");
+		bool Pending = Error == EINPROGRESS;
 #endif
+		if (!Pending)
+		{
+			DERPNET_LOG("connect failed right away (error=%d)", Error);
+			DerpNet__CloseSocket(Socket);
+			return DERPNET_INVALID_SOCKET;
+		}
+	}
+	return Socket;
+}
 
-	Net->SocketEvent = WSACreateEvent();
-	DERPNET_ASSERT(Net->SocketEvent);
+// Waits up to TimeoutUs for pending connects to finish, sets Done[i] for the ones that did
+static void DerpNet__ConnectWait(const uintptr_t* Sockets, bool* Done, size_t Count, uint64_t TimeoutUs)
+{
+#if defined(_WIN32)
+	// a failed connect is reported in the except set, a successful one in the write set
+	fd_set WriteSet, ExceptSet;
+	FD_ZERO(&WriteSet);
+	FD_ZERO(&ExceptSet);
+	for (size_t i = 0; i < Count; i++)
+	{
+		if (Sockets[i] != DERPNET_INVALID_SOCKET)
+		{
+			FD_SET(Sockets[i], &WriteSet);
+			FD_SET(Sockets[i], &ExceptSet);
+		}
+	}
+
+	struct timeval TimeVal = { (long)(TimeoutUs / 1000000), (long)(TimeoutUs % 1000000) };
+	if (select(0, NULL, &WriteSet, &ExceptSet, &TimeVal) > 0)
+	{
+		for (size_t i = 0; i < Count; i++)
+		{
+			Done[i] = Sockets[i] != DERPNET_INVALID_SOCKET && (FD_ISSET(Sockets[i], &WriteSet) || FD_ISSET(Sockets[i], &ExceptSet));
+		}
+	}
+#else
+	struct pollfd Polls[DERPNET_CONNECT_MAX_ADDRESSES];
+	for (size_t i = 0; i < Count; i++)
+	{
+		// poll skips negative descriptors
+		Polls[i].fd = Sockets[i] == DERPNET_INVALID_SOCKET ? -1 : (int)Sockets[i];
+		Polls[i].events = POLLOUT;
+		Polls[i].revents = 0;
+	}
+
+	if (poll(Polls, (nfds_t)Count, (int)((TimeoutUs + 999) / 1000)) > 0)
+	{
+		for (size_t i = 0; i < Count; i++)
+		{
+			Done[i] = Polls[i].revents != 0;
+		}
+	}
+#endif
+}
+
+// Returns the connected socket in blocking mode and its address, or invalid socket when no
+// address connected within TimeoutMs. The other attempts are closed. Winner is the position of
+// the connected address in race order.
+static uintptr_t DerpNet__ConnectRace(const struct addrinfo* AddrInfo, uint32_t TimeoutMs, const struct addrinfo** Connected, uint32_t* Attempts, uint32_t* Failures, uint32_t* Winner)
+{
+	const struct addrinfo* Order[DERPNET_CONNECT_MAX_ADDRESSES];
+	uintptr_t Sockets[DERPNET_CONNECT_MAX_ADDRESSES];
+	size_t Count = DerpNet__ConnectOrder(AddrInfo, Order);
+	size_t Started = 0;
+	size_t Pending = 0;
+	uintptr_t Result = DERPNET_INVALID_SOCKET;
+	*Attempts = *Failures = *Winner = 0;
+
+	uint64_t NextUs = DerpNet__NowUs();
+	uint64_t DeadlineUs = NextUs + (uint64_t)TimeoutMs * 1000;
+
+	for (;;)
+	{
+		uint64_t NowUs = DerpNet__NowUs();
+		if (Started < Count && NowUs >= NextUs && NowUs < DeadlineUs)
+		{
+			bool Done = false;
+			uintptr_t Socket = DerpNet__ConnectStart(Order[Started], &Done);
+			Sockets[Started++] = Socket;
+			(*Attempts)++;
+			if (Socket == DERPNET_INVALID_SOCKET)
+			{
+				(*Failures)++;
+				continue;
+			}
+			if (Done)
+			{
+				Result = Socket;
+				*Winner = (uint32_t)(Started - 1);
+				break;
+			}
+			Pending++;
+			NextUs = NowUs + (uint64_t)DERPNET_CONNECT_STAGGER_MS * 1000;
+		}
+
+		if (Pending == 0 && Started == Count)
+		{
+			break;
+		}
+		if (NowUs >= DeadlineUs)
+		{
+			DERPNET_LOG("connect timed out after %u ms", TimeoutMs);
+			break;
+		}
+
+		uint64_t WakeUs = Started < Count && NextUs < DeadlineUs ? NextUs : DeadlineUs;
+		bool Done[DERPNET_CONNECT_MAX_ADDRESSES] = { 0 };
+		if (Pending != 0)
+		{
+			DerpNet__ConnectWait(Sockets, Done, Started, WakeUs > NowUs ? WakeUs - NowUs : 0);
+		}
+
+		for (size_t i = 0; i < Started && Result == DERPNET_INVALID_SOCKET; i++)
+		{
+			if (!Done[i])
+			{
+				continue;
+			}
+
+			int Error = 0;
+			socklen_t ErrorSize = sizeof(Error);
+			getsockopt(Sockets[i], SOL_SOCKET, SO_ERROR, (char*)&Error, &ErrorSize);
+			if (Error == 0)
+			{
+				Result = Sockets[i];
+				*Winner = (uint32_t)i;
+				break;
+			}
+
+			DERPNET_LOG("connect to address %zu failed (error=%d)", i, Error);
+			DerpNet__CloseSocket(Sockets[i]);
+			Sockets[i] = DERPNET_INVALID_SOCKET;
+			(*Failures)++;
+			Pending--;
+			NextUs = DerpNet__NowUs(); // the next address does not wait for the stagger
+		}
+		if (Result != DERPNET_INVALID_SOCKET)
+		{
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < Started; i++)
+	{
+		if (Sockets[i] != DERPNET_INVALID_SOCKET && Sockets[i] != Result)
+		{
+			DerpNet__CloseSocket(Sockets[i]);
+		}
+	}
+
+	if (Result != DERPNET_INVALID_SOCKET)
+	{
+		DerpNet__SetBlocking(Result, true);
+		*Connected = Order[*Winner];
+	}
+	return Result;
+}
+
+// DerpNet_Open's race, counters go to Net
+static uintptr_t DerpNet__Connect(DerpNet* Net, const struct addrinfo* AddrInfo, const struct addrinfo** Connected)
+{
+	uint64_t StartUs = DerpNet__NowUs();
+	uintptr_t Socket = DerpNet__ConnectRace(AddrInfo, DERPNET_CONNECT_TIMEOUT_MS, Connected, &Net->ConnectAttempts, &Net->ConnectFailures, &Net->ConnectWinner);
+	Net->ConnectUs = DerpNet__NowUs() - StartUs;
+	return Socket;
+}
+
+// state every open starts from, buffers are left alone
+static void DerpNet__Reset(DerpNet* Net)
+{
+	Net->Socket = DERPNET_INVALID_SOCKET;
+	Net->SocketEvent = NULL;
+#if !defined(_WIN32)
+	Net->EventFd = -1;
+#endif
+	Net->BufferStart = Net->BufferSize = Net->BufferReceived = 0;
+	Net->TotalReceived = Net->TotalSent = Net->TotalCopied = 0;
+	Net->SendCalls = Net->TotalMoved = 0;
+	Net->SendQueueStart = Net->SendQueueSize = 0;
+	Net->SendBoundary = Net->SendUrgentEnd = 0;
+	Net->SendPaced = false;
+	Net->TlsRecordSize = Net->TlsRecordSent = 0;
+	Net->ReplayDrops = Net->SessionChanges = 0;
+	memset(Net->LastSessionChange, 0, sizeof(Net->LastSessionChange));
+	Net->PongsReceived = 0;
+	memset(Net->LastPong, 0, sizeof(Net->LastPong));
+	Net->ServerPings = Net->KeepAlives = Net->PeersGone = 0;
+	memset(Net->LastPeerGone, 0, sizeof(Net->LastPeerGone));
+	Net->ResolveUs = Net->ConnectUs = 0;
+	Net->ConnectAttempts = Net->ConnectFailures = Net->ConnectWinner = 0;
+	Net->Direct = Net->EventBorrowed = false;
+	memset(Net->DirectPeerKey, 0, sizeof(Net->DirectPeerKey));
+	Net->NonceCounter = 0;
+	Net->ReplayNext = 0;
+	memset(Net->Replay, 0, sizeof(Net->Replay));
+	Net->SharedKeyClock = 0;
+	Net->SharedKeyMisses = 0;
+	memset(Net->SharedKeys, 0, sizeof(Net->SharedKeys));
+}
+
+bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret)
+{
+#if !DERPNET_USE_PLAIN_HTTP
+	CredHandle CredHandle;
+	CtxtHandle CtxHandle;
+
+	SecInvalidateHandle(&CredHandle);
+	SecInvalidateHandle(&CtxHandle);
+#endif
+
+	struct addrinfo* AddrInfo = NULL;
+	DerpNet__Reset(Net);
+
+	int SocketOk;
+#if defined(_WIN32)
+	WSADATA SocketData;
+	SocketOk = WSAStartup(MAKEWORD(2, 2), &SocketData);
+	DERPNET_ASSERT(SocketOk == 0);
+#endif
+
+	//
+	// connect to DERP server
+	//
+
+	struct addrinfo AddrHints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+
+#if DERPNET_USE_PLAIN_HTTP
+	const char* DerpServerPort = "8080";  // Docker plain HTTP on 8080
+#else
+	const char* DerpServerPort = "8443";
+#endif
+
+	// "host:port", a single colon so bare IPv6 addresses are left alone
+	char DerpServerHost[256];
+	const char* Colon = strchr(DerpServer, ':');
+	if (Colon && !strchr(Colon + 1, ':') && (size_t)(Colon - DerpServer) < sizeof(DerpServerHost))
+	{
+		memcpy(DerpServerHost, DerpServer, Colon - DerpServer);
+		DerpServerHost[Colon - DerpServer] = 0;
+		DerpServerPort = Colon + 1;
+	}
+	else
+	{
+		snprintf(DerpServerHost, sizeof(DerpServerHost), "%s", DerpServer);
+	}
+
+	uint64_t ResolveStartUs = DerpNet__NowUs();
+	SocketOk = getaddrinfo(DerpServerHost, DerpServerPort, &AddrHints, &AddrInfo);
+	Net->ResolveUs = DerpNet__NowUs() - ResolveStartUs;
+	if (SocketOk != 0)
+	{
+		DERPNET_LOG("cannot resolve '%s' hostname (error=%d)", DerpServer, SocketOk);
+		goto error;
+	}
+
+	DERPNET_LOG("Resolved '%s:%s' successfully", DerpServer, DerpServerPort);
+
+	DERPNET_LOG("Connecting to '%s:%s'...", DerpServer, DerpServerPort);
+
+	const struct addrinfo* ConnectedAddr = NULL;
+	Net->Socket = DerpNet__Connect(Net, AddrInfo, &ConnectedAddr);
+	if (Net->Socket == DERPNET_INVALID_SOCKET)
+	{
+		DERPNET_LOG("cannot connect to '%s' server (%u addresses tried)", DerpServer, Net->ConnectAttempts);
+		goto error;
+	}
+
+#if !defined(NDEBUG) && defined(_WIN32)
+	char Address[128];
+	DWORD AddressLength = ARRAYSIZE(Address);
+	WSAAddressToStringA(ConnectedAddr->ai_addr, (DWORD)ConnectedAddr->ai_addrlen, NULL, Address, &AddressLength);
+	DERPNET_LOG("connected to '%s' -> '%s' server", DerpServer, Address);
+#elif !defined(NDEBUG)
+	char Address[128];
+	if (getnameinfo(ConnectedAddr->ai_addr, ConnectedAddr->ai_addrlen, Address, sizeof(Address), NULL, 0, NI_NUMERICHOST) == 0)
+	{
+		DERPNET_LOG("connected to '%s' -> '%s' server", DerpServer, Address);
+	}
+#endif
+	DERPNET_LOG("resolve %.1f ms, connect %.1f ms, address %u of %u attempted (%u failed)",
+		Net->ResolveUs / 1000.0, Net->ConnectUs / 1000.0, Net->ConnectWinner + 1, Net->ConnectAttempts, Net->ConnectFailures);
+
+	freeaddrinfo(AddrInfo);
+	AddrInfo = NULL;
+
+	// small frames are batched by DerpNet_Flush, Nagle would only delay them further
+	int NoDelay = 1;
+	setsockopt(Net->Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+
+#if !DERPNET_USE_PLAIN_HTTP
+	DERPNET_LOG("Starting TLS handshake with '%s'...", DerpServer);
+	if (!DerpNet__TlsHandshake(Net, DerpServer, &CredHandle, &CtxHandle))
+	{
+		DERPNET_LOG("TLS handshake failed");
+		goto error;
+	}
+	DERPNET_LOG("TLS handshake completed successfully");
+
+	DERPNET_ASSERT(sizeof(CredHandle) == sizeof(Net->CredHandle));
+	DERPNET_ASSERT(sizeof(CtxHandle) == sizeof(Net->CtxHandle));
+	memcpy(&Net->CredHandle, &CredHandle, sizeof(CredHandle));
+	memcpy(&Net->CtxHandle, &CtxHandle, sizeof(CtxHandle));
+#else
+	DERPNET_LOG("Using plain HTTP (no TLS)");
+#endif
 
-	WSAEventSelect(Net->Socket, Net->SocketEvent, FD_READ);
+	if (!DerpNet__EventOpen(Net))
+	{
+		DERPNET_LOG("cannot create socket event");
+		goto error;
+	}
 
 	//
 	// send inital HTTP GET request, ask to switch to DERP protocol immediately
@@ -1578,7 +2991,6 @@ bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecre
 
 	uint8_t FrameType;
 	uint32_t FrameSize;
-	memset(Net->LastPublicKey, 0, sizeof(Net->LastPublicKey));
 
 	//
 	// receive ServerKey frame
@@ -1597,10 +3009,10 @@ bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecre
 
 		static const uint8_t DerpMagic[8] = { 0x44, 0x45, 0x52, 0x50, 0xf0, 0x9f, 0x94, 0x91 };
 
-		const uint8_t* Magic = Net->Buffer;
+		const uint8_t* Magic = Net->Buffer + Net->BufferStart;
 		DERPNET_ASSERT(memcmp(Magic, DerpMagic, sizeof(DerpMagic)) == 0);
 
-		memcpy(ServerPublicKey, Net->Buffer + 8, sizeof(ServerPublicKey));
+		memcpy(ServerPublicKey, Net->Buffer + Net->BufferStart + 8, sizeof(ServerPublicKey));
 
 		DerpNet__TlsConsume(Net, FrameSize);
 	}
@@ -1643,7 +3055,7 @@ bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecre
 		DERPNET_ASSERT(FrameType == 3); // ServerInfo
 		DERPNET_ASSERT(FrameSize >= 24 + 16);
 
-		uint8_t* Nonce = Net->Buffer;
+		uint8_t* Nonce = Net->Buffer + Net->BufferStart;
 		uint8_t* Auth = Nonce + 24;
 		uint8_t* Data = Auth + 16;
 
@@ -1678,32 +3090,203 @@ error:
 		FreeCredentialsHandle(&CredHandle);
 	}
 #endif
-	if (Net->SocketEvent)
-	{
-		WSACloseEvent(Net->SocketEvent);
-	}
-	if (Net->Socket != INVALID_SOCKET)
+	DerpNet__EventClose(Net);
+	if (Net->Socket != DERPNET_INVALID_SOCKET)
 	{
-		closesocket(Net->Socket);
+		DerpNet__CloseSocket(Net->Socket);
+		Net->Socket = DERPNET_INVALID_SOCKET;
 	}
 	if (AddrInfo)
 	{
 		freeaddrinfo(AddrInfo);
 	}
+#if defined(_WIN32)
+	WSACleanup();
+#endif
+
+	return false;
+}
+
+bool DerpNet_OpenDirect(DerpNet* Net, uintptr_t Socket, const DerpKey* UserSecret, const DerpKey* PeerPublicKey, const DerpNet* EventsWith)
+{
+	DerpNet__Reset(Net);
+
+#if defined(_WIN32)
+	// DerpNet_Close calls WSACleanup for every connection
+	WSADATA SocketData;
+	int SocketOk = WSAStartup(MAKEWORD(2, 2), &SocketData);
+	DERPNET_ASSERT(SocketOk == 0);
+#endif
+
+	Net->Socket = Socket;
+	Net->Direct = true;
+	memcpy(Net->DirectPeerKey, PeerPublicKey->Bytes, sizeof(Net->DirectPeerKey));
+	memcpy(Net->UserPrivateKey, UserSecret->Bytes, sizeof(Net->UserPrivateKey));
+	Net->LastFrameSize = 0;
+
+	DerpNet__SetBlocking(Socket, true);
+	int NoDelay = 1;
+	setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+
+	bool EventOk;
+	if (EventsWith)
+	{
+		Net->EventBorrowed = true;
+#if defined(_WIN32)
+		Net->SocketEvent = EventsWith->SocketEvent;
+#else
+		Net->EventFd = EventsWith->EventFd;
+#endif
+		EventOk = DerpNet__EventWatch(Net);
+	}
+	else
+	{
+		EventOk = DerpNet__EventOpen(Net);
+	}
+	if (EventOk)
+	{
+		DERPNET_LOG("direct connection ready");
+		return true;
+	}
+
+	DERPNET_LOG("cannot watch direct connection socket");
+	DerpNet__EventClose(Net);
+#if defined(_WIN32)
 	WSACleanup();
+#endif
 
+	DerpNet__CloseSocket(Socket);
+	Net->Socket = DERPNET_INVALID_SOCKET;
 	return false;
 }
 
 void DerpNet_Close(DerpNet* Net)
 {
 #if !DERPNET_USE_PLAIN_HTTP
-	DeleteSecurityContext((CtxtHandle*)Net->CtxHandle);
-	FreeCredentialsHandle((CredHandle*)Net->CredHandle);
+	if (!Net->Direct)
+	{
+		DeleteSecurityContext((CtxtHandle*)Net->CtxHandle);
+		FreeCredentialsHandle((CredHandle*)Net->CredHandle);
+	}
 #endif
-	WSACloseEvent(Net->SocketEvent);
-	closesocket(Net->Socket);
+	DerpNet__EventClose(Net);
+	DerpNet__CloseSocket(Net->Socket);
+	Net->Socket = DERPNET_INVALID_SOCKET;
+#if defined(_WIN32)
 	WSACleanup();
+#endif
+	Net->SendQueueStart = Net->SendQueueSize = 0;
+	Net->SendBoundary = Net->SendUrgentEnd = 0;
+	Net->SendPaced = false;
+	Net->TlsRecordSize = Net->TlsRecordSent = 0;
+}
+
+static DerpNetReplay* DerpNet__FindReplay(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	for (size_t i = 0; i < DERPNET_REPLAY_PEERS; i++)
+	{
+		if (memcmp(Net->Replay[i].PublicKey, PublicKey, 32) == 0)
+		{
+			return &Net->Replay[i];
+		}
+	}
+	return NULL;
+}
+
+// new senders get an entry only after their first packet authenticates, so packets with
+// made up public keys cannot evict real senders from the table
+static DerpNetReplay* DerpNet__AddReplay(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	DerpNetReplay* Replay = &Net->Replay[Net->ReplayNext];
+	Net->ReplayNext = (Net->ReplayNext + 1) % DERPNET_REPLAY_PEERS;
+
+	memset(Replay, 0, sizeof(*Replay));
+	memcpy(Replay->PublicKey, PublicKey, 32);
+	return Replay;
+}
+
+static DerpNetSharedKey* DerpNet__FindSharedKey(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	for (size_t i = 0; i < DERPNET_SHARED_KEYS; i++)
+	{
+		DerpNetSharedKey* Entry = &Net->SharedKeys[i];
+		if (Entry->LastUse != 0 && memcmp(Entry->PublicKey, PublicKey, 32) == 0)
+		{
+			Entry->LastUse = ++Net->SharedKeyClock;
+			return Entry;
+		}
+	}
+	return NULL;
+}
+
+static DerpNetSharedKey* DerpNet__AddSharedKey(DerpNet* Net, const uint8_t PublicKey[32], const uint8_t SharedKey[32])
+{
+	DerpNetSharedKey* Entry = &Net->SharedKeys[0];
+	for (size_t i = 1; i < DERPNET_SHARED_KEYS; i++)
+	{
+		if (Net->SharedKeys[i].LastUse < Entry->LastUse)
+		{
+			Entry = &Net->SharedKeys[i];
+		}
+	}
+	memcpy(Entry->PublicKey, PublicKey, 32);
+	memcpy(Entry->SharedKey, SharedKey, 32);
+	Entry->LastUse = ++Net->SharedKeyClock;
+	return Entry;
+}
+
+// true if nonce was not seen before, called before the more expensive unseal
+static bool DerpNet__ReplayCheck(const DerpNetReplay* Replay, const uint8_t Nonce[24])
+{
+	if (memcmp(Replay->Prefix, Nonce, sizeof(Replay->Prefix)) != 0)
+	{
+		// only an entry that saw nothing yet takes a prefix, another session of the sender (or
+		// one a relay recorded) waits for DerpNet_ResetReplay
+		return Replay->Seen == 0;
+	}
+
+	uint64_t Counter = Get64LE(Nonce + 16);
+	if (Counter > Replay->Highest)
+	{
+		return true;
+	}
+
+	uint64_t Age = Replay->Highest - Counter;
+	return Age < 64 && !(Replay->Seen & (1ULL << Age));
+}
+
+void DerpNet_ResetReplay(DerpNet* Net, const DerpKey* SenderPublicKey)
+{
+	DerpNetReplay* Replay = DerpNet__FindReplay(Net, SenderPublicKey->Bytes);
+	if (Replay)
+	{
+		memset(Replay->Prefix, 0, sizeof(Replay->Prefix));
+		Replay->Highest = 0;
+		Replay->Seen = 0;
+	}
+}
+
+// only authenticated packets move the window, so forged nonces cannot push it forward
+static void DerpNet__ReplayUpdate(DerpNetReplay* Replay, const uint8_t Nonce[24])
+{
+	uint64_t Counter = Get64LE(Nonce + 16);
+
+	if (memcmp(Replay->Prefix, Nonce, sizeof(Replay->Prefix)) != 0)
+	{
+		memcpy(Replay->Prefix, Nonce, sizeof(Replay->Prefix));
+		Replay->Highest = Counter;
+		Replay->Seen = 1;
+	}
+	else if (Counter > Replay->Highest)
+	{
+		uint64_t Shift = Counter - Replay->Highest;
+		Replay->Seen = Shift < 64 ? (Replay->Seen << Shift) | 1 : 1;
+		Replay->Highest = Counter;
+	}
+	else
+	{
+		Replay->Seen |= 1ULL << (Replay->Highest - Counter);
+	}
 }
 
 int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** ReceivedData, uint32_t* ReceivedSize, bool Wait)
@@ -1728,25 +3311,59 @@ int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** Receive
 			return 0;
 		}
 
-		if (FrameType == 5) // RecvPacket
+		// RecvPacket forwarded by the server, or on a direct link SendPacket written by the peer
+		if (FrameType == (Net->Direct ? 4 : 5))
 		{
 			if (FrameSize >= 32 + 24 + 16)
 			{
-				uint8_t* PublicKey = Net->Buffer;
+				uint8_t* PublicKey = Net->Buffer + Net->BufferStart;
+				if (Net->Direct)
+				{
+					// the frame names us as the target, the sender is the peer the link was opened for
+					memcpy(PublicKey, Net->DirectPeerKey, sizeof(Net->DirectPeerKey));
+				}
+
 				uint8_t* Nonce = PublicKey + 32;
 				uint8_t* Auth = Nonce + 24;
 				uint8_t* Data = Auth + 16;
 				uint32_t DataSize = FrameSize - (32 + 24 + 16);
 
-				if (memcmp(PublicKey, Net->LastPublicKey, sizeof(Net->LastPublicKey)) != 0)
+				DerpNetReplay* Replay = DerpNet__FindReplay(Net, PublicKey);
+				bool OtherSession = Replay && Replay->Seen != 0 && memcmp(Replay->Prefix, Nonce, sizeof(Replay->Prefix)) != 0;
+				if (Replay && !OtherSession && !DerpNet__ReplayCheck(Replay, Nonce))
 				{
-					DerpNet__GetSharedKey(Net->LastSharedKey, Net->UserPrivateKey, PublicKey);
-					memcpy(Net->LastPublicKey, PublicKey, sizeof(Net->LastPublicKey));
+					DERPNET_LOG("dropping replayed packet");
+					Net->ReplayDrops++;
+					DerpNet__TlsConsume(Net, FrameSize);
+					continue;
 				}
 
-				bool UnsealOk = DerpNet__BoxUnsealEx(Data, Data, DataSize, Auth, Nonce, Net->LastSharedKey);
-				if (UnsealOk)
+				// like the replay table, a sender's key is kept only once its packet authenticates
+				uint8_t NewSharedKey[32];
+				DerpNetSharedKey* Cached = DerpNet__FindSharedKey(Net, PublicKey);
+				if (!Cached)
 				{
+					DerpNet__GetSharedKey(NewSharedKey, Net->UserPrivateKey, PublicKey);
+					Net->SharedKeyMisses++;
+				}
+
+				bool UnsealOk = DerpNet__BoxUnsealEx(Data, Data, DataSize, Auth, Nonce, Cached ? Cached->SharedKey : NewSharedKey);
+				if (UnsealOk && OtherSession)
+				{
+					// opened only to tell the caller the sender may have started over, see DerpNet_ResetReplay
+					DERPNET_LOG("dropping packet from another session of the sender");
+					memcpy(Net->LastSessionChange, PublicKey, sizeof(Net->LastSessionChange));
+					Net->SessionChanges++;
+					Net->ReplayDrops++;
+				}
+				else if (UnsealOk)
+				{
+					DerpNet__ReplayUpdate(Replay ? Replay : DerpNet__AddReplay(Net, PublicKey), Nonce);
+					if (!Cached)
+					{
+						DerpNet__AddSharedKey(Net, PublicKey, NewSharedKey);
+					}
+
 					memcpy(ReceivedUserPublicKey->Bytes, PublicKey, sizeof(ReceivedUserPublicKey->Bytes));
 					*ReceivedData = Data;
 					*ReceivedSize = DataSize;
@@ -1765,6 +3382,34 @@ int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** Receive
 				DERPNET_LOG("RecvPacket frame too short, expected at least %u bytes, got %u", 32 + 24 + 16, FrameSize);
 			}
 		}
+		else if (FrameType == 0x13 && FrameSize == 8) // Pong
+		{
+			memcpy(Net->LastPong, Net->Buffer + Net->BufferStart, sizeof(Net->LastPong));
+			Net->PongsReceived++;
+		}
+		else if (FrameType == 0x12 && FrameSize == 8) // Ping
+		{
+			// answered without waiting for the socket, with no room at the end of the queue the
+			// server's next Ping gets the answer
+			Net->ServerPings++;
+			if (Net->SendQueueSize + 1 + 4 + 8 <= sizeof(Net->SendQueue))
+			{
+				uint8_t* OutFrame = Net->SendQueue + Net->SendQueueSize;
+				OutFrame[0] = 0x13; // Pong
+				Set32BE(OutFrame + 1, 8);
+				memcpy(OutFrame + 1 + 4, Net->Buffer + Net->BufferStart, 8);
+				Net->SendQueueSize += 1 + 4 + 8;
+			}
+		}
+		else if (FrameType == 6) // KeepAlive from the server needs no answer
+		{
+			Net->KeepAlives++;
+		}
+		else if (FrameType == 8 && FrameSize >= 32) // PeerGone, a reason byte may follow the key
+		{
+			memcpy(Net->LastPeerGone, Net->Buffer + Net->BufferStart, sizeof(Net->LastPeerGone));
+			Net->PeersGone++;
+		}
 		else
 		{
 			DERPNET_LOG("unknown frame, ignoring");
@@ -1778,24 +3423,250 @@ int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** Receive
 
 bool DerpNet_Send(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
 {
-	if (memcmp(TargetUserPublicKey->Bytes, Net->LastPublicKey, sizeof(Net->LastPublicKey)) != 0)
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet_SendV(Net, TargetUserPublicKey, &Iov, 1);
+}
+
+bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t InNonce[24], const void* Data, size_t DataSize)
+{
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet_SendExV(Net, TargetUserPublicKey, SharedKey, InNonce, &Iov, 1);
+}
+
+//
+// Send queue layout:
+//
+//   SendQueue = [wwwwwwwwwwwqqqqqqqqqqqqqqqq..............]
+//                ^          ^               ^
+//                |          |               |
+//   written -----+          |               |
+//   SendQueue + SendQueueStart              |
+//   SendQueue + SendQueueSize --------------+
+//
+// Frames are sealed at SendQueueSize and written from SendQueueStart whenever socket accepts
+// them. Unwritten bytes are moved to the front only when a new frame does not fit at the end.
+// With TLS the bytes from SendQueueStart have not been encrypted yet, TlsRecord holds the one
+// record that socket did not fully accept.
+// With pacing a write without Wait stops SendAllowance bytes past SendUrgentEnd.
+//
+
+// end of the queued bytes this write may send
+static size_t DerpNet__WriteEnd(const DerpNet* Net, bool Wait)
+{
+	if (Wait || !Net->SendPaced)
 	{
-		DerpNet__GetSharedKey(Net->LastSharedKey, Net->UserPrivateKey, TargetUserPublicKey->Bytes);
-		memcpy(Net->LastPublicKey, TargetUserPublicKey->Bytes, sizeof(Net->LastPublicKey));
+		return Net->SendQueueSize;
 	}
+	size_t Start = Net->SendQueueStart > Net->SendUrgentEnd ? Net->SendQueueStart : Net->SendUrgentEnd;
+	return Net->SendQueueSize - Start <= Net->SendAllowance ? Net->SendQueueSize : Start + Net->SendAllowance;
+}
 
-	uint8_t Nonce[24];
-	DerpNet__GetRandom(Nonce, sizeof(Nonce));
+// bytes From..To of the queue were written, the urgent ones among them are free
+static void DerpNet__UseAllowance(DerpNet* Net, size_t From, size_t To)
+{
+	if (!Net->SendPaced)
+	{
+		return;
+	}
+	if (From < Net->SendUrgentEnd)
+	{
+		From = Net->SendUrgentEnd < To ? Net->SendUrgentEnd : To;
+	}
+	Net->SendAllowance -= To - From < Net->SendAllowance ? To - From : Net->SendAllowance;
+}
 
-	return DerpNet_SendEx(Net, TargetUserPublicKey, Net->LastSharedKey, Nonce, Data, DataSize);
+// writes queued frames up to DerpNet__WriteEnd straight to the socket, returns like DerpNet__WriteQueued
+static int DerpNet__SocketWriteQueued(DerpNet* Net, bool Wait)
+{
+	for (;;)
+	{
+		size_t End = DerpNet__WriteEnd(Net, Wait);
+		if (Net->SendQueueStart == End)
+		{
+			return 1;
+		}
+		DerpNetIoVec Queued = { Net->SendQueue + Net->SendQueueStart, End - Net->SendQueueStart };
+		int WriteSize = DerpNet__SocketWriteV(Net, &Queued, 1, Wait);
+		if (WriteSize < 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return -1;
+		}
+		if (WriteSize == 0)
+		{
+			if (!Wait)
+			{
+				return 0;
+			}
+			if (!DerpNet__WaitWritable(Net))
+			{
+				return -1;
+			}
+			continue;
+		}
+		Net->TotalSent += WriteSize;
+		DerpNet__UseAllowance(Net, Net->SendQueueStart, Net->SendQueueStart + WriteSize);
+		Net->SendQueueStart += WriteSize;
+	}
 }
 
-bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t InNonce[24], const void* Data, size_t DataSize)
+#if !DERPNET_USE_PLAIN_HTTP
+
+static int DerpNet__TlsWriteQueued(DerpNet* Net, bool Wait)
+{
+	for (;;)
+	{
+		if (Net->TlsRecordSent == Net->TlsRecordSize)
+		{
+			size_t End = DerpNet__WriteEnd(Net, Wait);
+			if (Net->SendQueueStart == End)
+			{
+				Net->TlsRecordSize = Net->TlsRecordSent = 0;
+				return 1;
+			}
+			size_t Encrypted = DerpNet__TlsEncryptRecord(Net, Net->SendQueue + Net->SendQueueStart, End - Net->SendQueueStart, Net->TlsRecord, &Net->TlsRecordSize);
+			DerpNet__UseAllowance(Net, Net->SendQueueStart, Net->SendQueueStart + Encrypted);
+			Net->SendQueueStart += Encrypted;
+			Net->TlsRecordSent = 0;
+		}
+
+		Net->SendCalls++;
+		int WriteSize = send(Net->Socket, (char*)Net->TlsRecord + Net->TlsRecordSent, (int)(Net->TlsRecordSize - Net->TlsRecordSent), 0);
+		if (WriteSize < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+		{
+			if (!Wait)
+			{
+				return 0;
+			}
+			if (!DerpNet__WaitWritable(Net))
+			{
+				return -1;
+			}
+			continue;
+		}
+		if (WriteSize <= 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return -1;
+		}
+		Net->TotalSent += WriteSize;
+		Net->TlsRecordSent += WriteSize;
+	}
+}
+
+#endif
+
+// writes queued frames in order
+// returns 1 when everything is written, 0 when socket is full or pacing holds the rest back and
+// Wait=false, -1 if disconnected
+static int DerpNet__WriteQueued(DerpNet* Net, bool Wait)
+{
+#if DERPNET_USE_PLAIN_HTTP
+	int Written = DerpNet__SocketWriteQueued(Net, Wait);
+#else
+	int Written = Net->Direct ? DerpNet__SocketWriteQueued(Net, Wait) : DerpNet__TlsWriteQueued(Net, Wait);
+#endif
+	if (Written <= 0)
+	{
+		return Written;
+	}
+
+	if (Net->SendQueueStart != Net->SendQueueSize)
+	{
+		// paced, the rest goes out when the caller adds allowance
+		return 0;
+	}
+	Net->SendQueueStart = Net->SendQueueSize = 0;
+	Net->SendBoundary = Net->SendUrgentEnd = 0;
+	return 1;
+}
+
+// returns offset of the first queued frame that has no bytes written (or encrypted for TLS) yet
+static size_t DerpNet__NextBoundary(DerpNet* Net)
+{
+	// every queued frame is complete, so frame headers can be followed from any known boundary
+	while (Net->SendBoundary < Net->SendQueueStart)
+	{
+		Net->SendBoundary += 1 + 4 + Get32BE(Net->SendQueue + Net->SendBoundary + 1);
+	}
+	return Net->SendBoundary;
+}
+
+static void DerpNet__CompactSendQueue(DerpNet* Net)
+{
+	// headers before SendQueueStart are needed to find the boundary, so before they are overwritten
+	Net->SendBoundary = DerpNet__NextBoundary(Net) - Net->SendQueueStart;
+
+	size_t Size = Net->SendQueueSize - Net->SendQueueStart;
+	memmove(Net->SendQueue, Net->SendQueue + Net->SendQueueStart, Size);
+	Net->TotalCopied += Size;
+
+	Net->SendUrgentEnd = Net->SendUrgentEnd > Net->SendQueueStart ? Net->SendUrgentEnd - Net->SendQueueStart : 0;
+	Net->SendQueueSize = Size;
+	Net->SendQueueStart = 0;
+}
+
+static size_t DerpNet__SendBudget(const DerpNet* Net)
 {
-	uint8_t OutFrame[1 << 16];
+	return Net->SendBudget ? Net->SendBudget : sizeof(Net->SendQueue);
+}
+
+// valid until the next call replaces the entry, callers use it right away
+static const uint8_t* DerpNet__SharedKey(DerpNet* Net, const DerpKey* TargetUserPublicKey)
+{
+	DerpNetSharedKey* Entry = DerpNet__FindSharedKey(Net, TargetUserPublicKey->Bytes);
+	if (!Entry)
+	{
+		uint8_t SharedKey[32];
+		DerpNet__GetSharedKey(SharedKey, Net->UserPrivateKey, TargetUserPublicKey->Bytes);
+		Net->SharedKeyMisses++;
+		Entry = DerpNet__AddSharedKey(Net, TargetUserPublicKey->Bytes, SharedKey);
+	}
+	return Entry->SharedKey;
+}
+
+static void DerpNet__NextNonce(DerpNet* Net, uint8_t Nonce[24])
+{
+	// one OS RNG call per session instead of per packet, counter never repeats within session
+	if (Net->NonceCounter == 0)
+	{
+		DerpNet__GetRandom(Net->NoncePrefix, sizeof(Net->NoncePrefix));
+		Net->NonceCounter = 1;
+	}
+	memcpy(Nonce, Net->NoncePrefix, sizeof(Net->NoncePrefix));
+	Set64LE(Nonce + 16, Net->NonceCounter++);
+}
+
+// returns space for OutFrameSize bytes at the end of send queue, NULL if disconnected
+static uint8_t* DerpNet__ReserveFrame(DerpNet* Net, size_t OutFrameSize)
+{
+	DERPNET_ASSERT(OutFrameSize <= (1 << 16));
+
+	if (Net->SendQueueSize + OutFrameSize > sizeof(Net->SendQueue))
+	{
+		DerpNet__CompactSendQueue(Net);
+	}
 
-	size_t OutFrameSize = 1 + 4 + 32 + 24 + 16 + DataSize;
-	DERPNET_ASSERT(OutFrameSize <= sizeof(OutFrame));
+	if (Net->SendQueueSize + OutFrameSize > sizeof(Net->SendQueue))
+	{
+		if (!DerpNet_Flush(Net))
+		{
+			return NULL;
+		}
+	}
+
+	return Net->SendQueue + Net->SendQueueSize;
+}
+
+size_t DerpNet_SealFrameV(uint8_t* OutFrame, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t InNonce[24], const DerpNetIoVec* Data, size_t DataCount)
+{
+	size_t DataSize = 0;
+	for (size_t i = 0; i < DataCount; i++)
+	{
+		DataSize += Data[i].Size;
+	}
+
+	size_t OutFrameSize = DERPNET_FRAME_OVERHEAD + DataSize;
 
 	OutFrame[0] = 4; // SendPacket
 	Set32BE(OutFrame + 1, (uint32_t)(OutFrameSize - (1 + 4)));
@@ -1808,9 +3679,264 @@ bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint
 	memcpy(PublicKey, TargetUserPublicKey->Bytes, sizeof(TargetUserPublicKey->Bytes));
 	memcpy(Nonce, InNonce, 24);
 
-	DerpNet__BoxSealEx(Nonce, Auth, Output, (uint8_t*)Data, DataSize, SharedKey);
+	// encrypting from the caller's buffers is the only pass over the payload
+	DerpNet__BoxSealV(Nonce, Auth, Output, Data, DataCount, SharedKey);
+	return OutFrameSize;
+}
+
+static bool DerpNet__QueueFrame(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t InNonce[24], const DerpNetIoVec* Data, size_t DataCount)
+{
+	size_t DataSize = 0;
+	for (size_t i = 0; i < DataCount; i++)
+	{
+		DataSize += Data[i].Size;
+	}
 
-	return DerpNet__TlsWrite(Net, OutFrame, OutFrameSize);
+	uint8_t* OutFrame = DerpNet__ReserveFrame(Net, DERPNET_FRAME_OVERHEAD + DataSize);
+	if (!OutFrame)
+	{
+		return false;
+	}
+
+	Net->SendQueueSize += DerpNet_SealFrameV(OutFrame, TargetUserPublicKey, SharedKey, InNonce, Data, DataCount);
+	Net->TotalCopied += DataSize;
+	return true;
+}
+
+void DerpNet_PrepareSeal(DerpNet* Net, const DerpKey* TargetUserPublicKey, uint8_t SharedKey[32], uint8_t Nonce[24])
+{
+	memcpy(SharedKey, DerpNet__SharedKey(Net, TargetUserPublicKey), 32);
+	DerpNet__NextNonce(Net, Nonce);
+
+#if DERPNET_USE_SIMD
+	// detect now, so sealing threads only ever read the SIMD level
+	DerpNet__GetSimdLevel();
+#endif
+}
+
+void DerpNet_NextNonce(DerpNet* Net, uint8_t Nonce[24])
+{
+	DerpNet__NextNonce(Net, Nonce);
+}
+
+bool DerpNet_QueueSealed(DerpNet* Net, const void* Frame, size_t FrameSize)
+{
+	uint8_t* OutFrame = DerpNet__ReserveFrame(Net, FrameSize);
+	if (!OutFrame)
+	{
+		return false;
+	}
+
+	memcpy(OutFrame, Frame, FrameSize);
+	Net->SendQueueSize += FrameSize;
+	Net->TotalCopied += FrameSize;
+	return true;
+}
+
+bool DerpNet_SendV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount)
+{
+	const uint8_t* SharedKey = DerpNet__SharedKey(Net, TargetUserPublicKey);
+
+	uint8_t Nonce[24];
+	DerpNet__NextNonce(Net, Nonce);
+
+	return DerpNet_SendExV(Net, TargetUserPublicKey, SharedKey, Nonce, Data, DataCount);
+}
+
+bool DerpNet_SendExV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t InNonce[24], const DerpNetIoVec* Data, size_t DataCount)
+{
+	return DerpNet__QueueFrame(Net, TargetUserPublicKey, SharedKey, InNonce, Data, DataCount) && DerpNet_Flush(Net);
+}
+
+bool DerpNet_Queue(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
+{
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet_QueueV(Net, TargetUserPublicKey, &Iov, 1);
+}
+
+bool DerpNet_QueueV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount)
+{
+	const uint8_t* SharedKey = DerpNet__SharedKey(Net, TargetUserPublicKey);
+
+	uint8_t Nonce[24];
+	DerpNet__NextNonce(Net, Nonce);
+
+	return DerpNet__QueueFrame(Net, TargetUserPublicKey, SharedKey, Nonce, Data, DataCount);
+}
+
+bool DerpNet_QueueUrgent(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
+{
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet_QueueUrgentV(Net, TargetUserPublicKey, &Iov, 1);
+}
+
+bool DerpNet_QueueUrgentV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount)
+{
+	size_t DataSize = 0;
+	for (size_t i = 0; i < DataCount; i++)
+	{
+		DataSize += Data[i].Size;
+	}
+	size_t OutFrameSize = DERPNET_FRAME_OVERHEAD + DataSize;
+
+	// makes room at the end, frames after the insert point move up into it
+	if (!DerpNet__ReserveFrame(Net, OutFrameSize))
+	{
+		return false;
+	}
+
+	size_t Insert = DerpNet__NextBoundary(Net);
+	if (Insert < Net->SendUrgentEnd)
+	{
+		Insert = Net->SendUrgentEnd;
+	}
+
+	const uint8_t* SharedKey = DerpNet__SharedKey(Net, TargetUserPublicKey);
+
+	uint8_t Nonce[24];
+	DerpNet__NextNonce(Net, Nonce);
+
+	// receiver drops packets too far behind the highest counter it has seen, so go only in front
+	// of frames with recent counters (frames sealed with caller's own nonces are never overtaken)
+	uint64_t Counter = Get64LE(Nonce + 16);
+	for (size_t Offset = Insert; Offset < Net->SendQueueSize; )
+	{
+		const uint8_t* Frame = Net->SendQueue + Offset;
+		Offset += 1 + 4 + Get32BE(Frame + 1);
+
+		const uint8_t* FrameNonce = Frame + 1 + 4 + 32;
+		if (Frame[0] != 4 || memcmp(FrameNonce, Net->NoncePrefix, sizeof(Net->NoncePrefix)) != 0 || Counter - Get64LE(FrameNonce + 16) > DERPNET_URGENT_MAX_OVERTAKE)
+		{
+			Insert = Offset;
+		}
+	}
+
+	size_t Tail = Net->SendQueueSize - Insert;
+	memmove(Net->SendQueue + Insert + OutFrameSize, Net->SendQueue + Insert, Tail);
+
+	DerpNet_SealFrameV(Net->SendQueue + Insert, TargetUserPublicKey, SharedKey, Nonce, Data, DataCount);
+	Net->SendQueueSize += OutFrameSize;
+	Net->SendUrgentEnd = Insert + OutFrameSize;
+	Net->TotalCopied += DataSize + Tail;
+	return true;
+}
+
+bool DerpNet_SendUrgent(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
+{
+	return DerpNet_QueueUrgent(Net, TargetUserPublicKey, Data, DataSize) && DerpNet__WriteQueued(Net, false) >= 0;
+}
+
+bool DerpNet_SendPing(DerpNet* Net, const uint8_t Data[8])
+{
+	uint8_t* OutFrame = DerpNet__ReserveFrame(Net, 1 + 4 + 8);
+	if (!OutFrame)
+	{
+		return false;
+	}
+
+	OutFrame[0] = 0x12; // Ping
+	Set32BE(OutFrame + 1, 8);
+	memcpy(OutFrame + 1 + 4, Data, 8);
+	Net->SendQueueSize += 1 + 4 + 8;
+	return DerpNet__WriteQueued(Net, false) >= 0;
+}
+
+bool DerpNet_Flush(DerpNet* Net)
+{
+	return DerpNet__WriteQueued(Net, true) > 0;
+}
+
+DerpNetSendResult DerpNet_TrySend(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
+{
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet_TrySendV(Net, TargetUserPublicKey, &Iov, 1);
+}
+
+DerpNetSendResult DerpNet_TryReserve(DerpNet* Net, size_t Size)
+{
+	size_t Budget = DerpNet__SendBudget(Net);
+	if (DerpNet_GetQueuedBytes(Net) + Size > Budget)
+	{
+		// maybe socket has drained since last call
+		if (DerpNet__WriteQueued(Net, false) < 0)
+		{
+			return DERPNET_SEND_DISCONNECTED;
+		}
+		size_t Queued = DerpNet_GetQueuedBytes(Net);
+		if (Queued != 0 && Queued + Size > Budget)
+		{
+			return DERPNET_SEND_WOULD_BLOCK;
+		}
+	}
+	return DERPNET_SEND_QUEUED;
+}
+
+DerpNetSendResult DerpNet_TryQueue(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
+{
+	DerpNetIoVec Iov = { Data, DataSize };
+	return DerpNet_TryQueueV(Net, TargetUserPublicKey, &Iov, 1);
+}
+
+DerpNetSendResult DerpNet_TryQueueV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount)
+{
+	size_t OutFrameSize = DERPNET_FRAME_OVERHEAD;
+	for (size_t i = 0; i < DataCount; i++)
+	{
+		OutFrameSize += Data[i].Size;
+	}
+
+	DerpNetSendResult Result = DerpNet_TryReserve(Net, OutFrameSize);
+	if (Result != DERPNET_SEND_QUEUED)
+	{
+		return Result;
+	}
+
+	const uint8_t* SharedKey = DerpNet__SharedKey(Net, TargetUserPublicKey);
+
+	uint8_t Nonce[24];
+	DerpNet__NextNonce(Net, Nonce);
+
+	// budget is never larger than send queue, so frame fits after compaction and this does not wait
+	return DerpNet__QueueFrame(Net, TargetUserPublicKey, SharedKey, Nonce, Data, DataCount) ? DERPNET_SEND_QUEUED : DERPNET_SEND_DISCONNECTED;
+}
+
+DerpNetSendResult DerpNet_TrySendV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Data, size_t DataCount)
+{
+	DerpNetSendResult Result = DerpNet_TryQueueV(Net, TargetUserPublicKey, Data, DataCount);
+	if (Result != DERPNET_SEND_QUEUED)
+	{
+		return Result;
+	}
+	return DerpNet__WriteQueued(Net, false) < 0 ? DERPNET_SEND_DISCONNECTED : DERPNET_SEND_QUEUED;
+}
+
+bool DerpNet_OnWritable(DerpNet* Net)
+{
+	return DerpNet__WriteQueued(Net, false) >= 0;
+}
+
+size_t DerpNet_GetQueuedBytes(const DerpNet* Net)
+{
+	return (Net->SendQueueSize - Net->SendQueueStart) + (Net->TlsRecordSize - Net->TlsRecordSent);
+}
+
+void DerpNet_SetSendAllowance(DerpNet* Net, size_t Allowance)
+{
+	Net->SendPaced = Allowance != DERPNET_UNPACED;
+	Net->SendAllowance = Net->SendPaced ? Allowance : 0;
+}
+
+void DerpNet_SetSendBudget(DerpNet* Net, size_t Budget)
+{
+	if (Budget < (1 << 16))
+	{
+		Budget = 1 << 16;
+	}
+	if (Budget > sizeof(Net->SendQueue))
+	{
+		Budget = sizeof(Net->SendQueue);
+	}
+	Net->SendBudget = Budget;
 }
 
 #endif // defined(DERP_STATIC) || defined(DERP_IMPLEMENTATION)
@@ -61,6 +61,7 @@
 #include <commdlg.h>
 #include <shlwapi.h>
 #include <shlobj.h>
+#include <timeapi.h>
 
 #include "ScreenBuddyVS.h"
 #include "ScreenBuddyPS.h"
@@ -68,6 +69,19 @@
 #include "settings_ui.h"
 // #include "lan_discovery.h" (LAN discovery removed)
 #include "direct_connection.h"
+#include "recorder.h"
+#include "latency.h"
+#include "seal_pool.h"
+#include "net_thread.h"
+#include "input_batch.h"
+#include "pacer.h"
+#include "region_probe.h"
+#include "derp_map.h"
+#include "derp_warm.h"
+#include "udp_transport.h"
+#include "fanout.h"
+#include "telemetry.h"
+#include "session_resume.h"
 
 // ==================== DEBUG RENDERING TOGGLE ====================
 // Set to 1 for extensive render pipeline logging, 0 for production
@@ -103,6 +117,7 @@
 #pragma comment (lib, "OneCore")
 #pragma comment (lib, "CoreMessaging")
 #pragma comment (lib, "ntdll")
+#pragma comment (lib, "winmm")
 
 // why this is not documented anywhere???
 DEFINE_GUID(MF_XVP_PLAYBACK_MODE, 0x3c5d293f, 0xad67, 0x4e29, 0xaf, 0x12, 0xcf, 0x3e, 0x23, 0x8a, 0xcc, 0xe9);
@@ -409,9 +424,13 @@ enum
 	BUDDY_MAX_HOST_LENGTH  = 128,
 
 	// buffer sizes
-	BUDDY_DERPMAP_BUFFER_SIZE = 64 * 1024,
+	BUDDY_DERPMAP_CHUNK_SIZE = 16 * 1024,
 	BUDDY_SEND_BUFFER_SIZE = 65000,
 	BUDDY_FILE_CHUNK_SIZE = 8 * 1024,
+
+	// outgoing backlog, new frames and file chunks are skipped above this instead of blocking UI
+	BUDDY_SEND_BUDGET = 384 * 1024,
+	BUDDY_SEND_BACKLOG_MAX = 128 * 1024,
 	BUDDY_FILENAME_MAX = 256,
 	BUDDY_TEXT_BUFFER_MAX = 1024,
 	BUDDY_KEY_TEXT_MAX = 256,
@@ -419,11 +438,17 @@ enum
 	// timeout settings
 	BUDDY_SHARE_TIMEOUT_MS = 5 * 60 * 1000,  // 5 minutes in milliseconds
 	BUDDY_SHARE_TIMEOUT_CHECK_MS = 1000,     // Check every second
+	BUDDY_WARM_TAKE_WAIT_MS = 5000,          // warm open already under way beats starting a new one
 
 	// windows message notifications
 	BUDDY_WM_BEST_REGION = WM_USER + 1,
 	BUDDY_WM_MEDIA_EVENT = WM_USER + 2,
 	BUDDY_WM_NET_EVENT =   WM_USER + 3,
+	BUDDY_WM_DIRECT_EVENT = WM_USER + 4,
+	BUDDY_WM_RESUME =      WM_USER + 5,  // WParam: HELLO or WELCOME the decode thread took from the video channel
+
+	// BUDDY_WM_BEST_REGION LParam: region from the latency table, no thread to wait for
+	BUDDY_REGION_FROM_TABLE = 1,
 
 	// timeout settings
 	BUDDY_CONNECTION_TIMEOUT	= 30 * 1000,  // 30 seconds for connection
@@ -435,6 +460,9 @@ enum
 BUDDY_FRAME_TIMER			= 444,
 BUDDY_LAN_TIMER			= 555,
 BUDDY_SHARE_TIMEOUT_TIMER	= 666,  // Timer for 5-minute share timeout
+	BUDDY_INPUT_TIMER			= 777,  // sends pending mouse moves once per frame interval
+	BUDDY_RESUME_TIMER			= 888,  // reconnects and says HELLO while the session is being resumed
+	BUDDY_RESUME_TIMER_MS		= 50,
 
 	// dialog controls
 	BUDDY_ID_SHARE_ICON			= 100,
@@ -481,6 +509,21 @@ BUDDY_ID_LAN_CONNECT		= 237,
 	BUDDY_PACKET_FILE_DATA		= 8,
 	BUDDY_PACKET_KEYBOARD		= 9,
 	BUDDY_PACKET_VIDEO_CONFIG	= 10,
+	BUDDY_PACKET_TIMING_ECHO	= 11,
+	BUDDY_PACKET_INPUT_BATCH	= 12,
+	BUDDY_PACKET_DIRECT_OFFER	= 13,  // sharer's LAN addresses and port (see direct_connection.h)
+	BUDDY_PACKET_DIRECT_SWITCH	= 14,  // on the relay: from here on the sender sends on the direct link, or not anymore
+	BUDDY_PACKET_UDP_CANDIDATES	= 15,  // addresses to punch a UDP path to (see udp_transport.h)
+	BUDDY_PACKET_UDP_SWITCH		= 16,  // behind the video sent before it: from here on video comes over UDP, or not anymore
+	BUDDY_PACKET_FRAME_ACK		= 17,  // viewer: LE32 sequence of the frame it just decoded (see fanout.h)
+	BUDDY_PACKET_PING			= 18,  // round trip probe, answered by the network thread (see telemetry.h)
+	BUDDY_PACKET_PONG			= 19,  // the answer, with the video frames the answering side found missing
+	BUDDY_PACKET_RESUME			= 20,  // SESSION_RESUME_HELLO or _WELCOME after a lost connection (see session_resume.h)
+
+	// BUDDY_PACKET_DIRECT_SWITCH and BUDDY_PACKET_UDP_SWITCH payload
+	BUDDY_SWITCH_RELAY			= 0,
+	BUDDY_SWITCH_DIRECT			= 1,
+	BUDDY_SWITCH_LOST			= 2,   // never sent, the network thread's own note that the direct link failed
 
 	// window selection
 	BUDDY_MAX_WINDOW_COUNT		= 256,
@@ -545,8 +588,9 @@ typedef struct
 
 	// derp stuff
 	HANDLE DerpRegionThread;
+	bool DerpRegionRefresh;  // region came from the latency table, the thread only measures again for next time
 	DerpKey RemoteKey;
-	PTP_WAIT WaitCallback;
+	NetThread NetThread;  // reads the connection and sorts packets into channels (see net_thread.h)
 	size_t LastReceived;
 
 	// graphics stuff
@@ -588,15 +632,94 @@ typedef struct
 	IMFVideoSampleAllocatorEx* EncodeSampleAllocator;
 	UINT32 EncodeWidth;   // Width for manual NV12 sample creation
 	UINT32 EncodeHeight;  // Height for manual NV12 sample creation
+	uint32_t EncodeBitrate;  // last set on the encoder, moved by the telemetry target
+	bool EncodeDropped;      // a frame did not fit the send budget, the next one must be a keyframe; network lock
+
+	// session recording (tee of the encoded stream, see recorder.h)
+	Recorder Recorder;
+
+	// glass-to-glass latency (see latency.h)
+	LatencyTracker Latency;
 
-	// decoder stuff
+	// viewer input waiting for the next flush tick (see input_batch.h)
+	InputBatch Input;
+
+	// frames that need several chunks are sealed on all cores (see seal_pool.h)
+	SealPool SealPool;
+	uint8_t* SealSlots;  // SEAL_POOL_WINDOW sealed DERP frames, reused round robin
+
+	// video leaves at a paced rate instead of one burst per frame (see pacer.h), guarded by the network lock
+	Pacer Pacer;
+	bool Pacing;
+
+	// decoder stuff, used by the decode thread while it runs
 	uint32_t DecodeInputExpected;
+	LatencyVideoHeader DecodeHeader;  // timing header of the frame being received
+	uint64_t DecodeRecvTime;          // when its first chunk arrived
 	IMFMediaBuffer* DecodeInputBuffer;
 	IMFSample* DecodeOutputSample;
 
+	// viewer: the video channel is put together into frames, decoded and shown on a thread of its
+	// own, so the dialog thread only hears about connection and state changes. It runs while the
+	// network thread does.
+	BuddyThread DecodeThread;
+	BuddyMutex DecodeLock;    // guards the two flags below
+	BuddyCond DecodeWake;
+	bool DecodeReady;         // the video channel has packets again
+	bool DecodeStopping;
+	bool DecodeRunning;       // dialog thread only
+	bool DecodeCutPending;    // the sharer's next HELLO or WELCOME cuts its stream, guarded by the network lock
+	BuddyMutex RenderLock;    // the decode thread and WM_PAINT draw to the same swap chain
+	uint64_t PresentUs;       // when Buddy_RenderWindow last handed a frame to the swap chain, under RenderLock
+
 	ScreenCapture Capture;
 	DerpNet Net;
 
+	// LAN link past the relay (see direct_connection.h): once it is authenticated packets are sent
+	// there, and the relay is only read up to the peer's switch marker. The flags are guarded by
+	// the network lock.
+	DirectConnection DirectLink;
+	DerpNet* Direct;
+	bool DirectOpen;          // sending on Direct
+	bool DirectRecv;          // peer sends on it too, read it after the relay
+	bool DirectLost;          // frames sent on it may be gone, the next one must be a keyframe
+
+	// video straight between the peers over UDP (see udp_transport.h), punched with candidates sent
+	// over the session. Everything else stays on the connection above. Guarded by the network lock.
+	UdpTransport Udp;
+	UdpState UdpLogged;       // last state the network thread logged
+	bool UdpOpen;             // sharer: video goes on Udp
+	bool UdpRecv;             // viewer: the sharer's marker came, frames are taken from Udp
+	const uint8_t* UdpFrame;  // viewer: frame being handed to the network thread in chunks
+	uint32_t UdpFrameSize;
+	uint32_t UdpFrameOffset;
+	uint8_t UdpChunk[BUDDY_SEND_BUFFER_SIZE];
+
+	// sharer: viewers besides RemoteKey (see fanout.h). They only watch, their input is ignored,
+	// and they stay on the relay wherever the first viewer's video goes. Guarded by the network lock.
+	Fanout Viewers;
+
+	// round trips, goodput and the target bitrate of the session (see telemetry.h). Pings are sent
+	// and answered by the network thread, everything here is guarded by the network lock.
+	Telemetry Telemetry;
+	bool TelemetryOn;
+	uint64_t FramesMissing;   // viewer: video frames that never arrived, told to the sharer in pongs
+
+	// the session outlives a lost relay connection (see session_resume.h): ResumeWarm opens a new
+	// one with the session's key while Resume, used on the dialog thread, waits for the peer
+	SessionResume Resume;
+	DerpWarm ResumeWarm;
+	size_t PeersGoneSeen;     // DerpNet.PeersGone already looked at, guarded by the network lock
+	size_t SessionChangesSeen; // DerpNet.SessionChanges already looked at, guarded by the network lock
+	bool PeerGone;            // the relay said RemoteKey is gone, guarded by the network lock
+
+	// connections opened ahead of the click on Share or Connect (see derp_warm.h), the share one
+	// with MyPrivateKey, the connect one with a new key each time
+	DerpWarm ShareWarm;
+	DerpWarm ViewWarm;
+	uint64_t ConnectClickUs;  // Connect clicked and no frame shown yet
+	bool ConnectWarm;         // that connection came from ViewWarm
+
 	BuddyState State;
 	HINTERNET HttpSession;
 	uint64_t Freq;
@@ -739,34 +862,72 @@ typedef struct
 }
 Buddy_MousePacket;
 
-typedef struct
+//
+
+// File next to config.json
+static bool Buddy_GetDataPath(LPCWSTR Name, wchar_t* Path, size_t PathCount)
 {
-	uint8_t Packet;
-	uint16_t VirtualKey;
-	uint16_t ScanCode;
-	uint16_t Flags;
-	uint8_t IsDown;
+	if (!BuddyConfig_GetDefaultPath(Path, PathCount))
+	{
+		return false;
+	}
+	wchar_t* FileName = wcsrchr(Path, L'\\');
+	return FileName && SUCCEEDED(StringCchCopyW(FileName + 1, PathCount - (FileName + 1 - Path), Name));
 }
-Buddy_KeyboardPacket;
 
-//
+// Same, as the UTF-8 path the portable modules take
+static bool Buddy_GetDataPathUtf8(LPCWSTR Name, char* Path, size_t PathSize)
+{
+	wchar_t WidePath[MAX_PATH];
+	return Buddy_GetDataPath(Name, WidePath, ARRAYSIZE(WidePath))
+		&& WideCharToMultiByte(CP_UTF8, 0, WidePath, -1, Path, (int)PathSize, NULL, NULL) != 0;
+}
+
+static void Buddy_QueryHeaderUtf8(HINTERNET HttpRequest, DWORD Query, char* Value, size_t ValueSize)
+{
+	wchar_t Header[256];
+	DWORD HeaderSize = sizeof(Header);
+	Value[0] = 0;
+	if (!WinHttpQueryHeaders(HttpRequest, Query, WINHTTP_HEADER_NAME_BY_INDEX, Header, &HeaderSize, WINHTTP_NO_HEADER_INDEX)
+		|| !WideCharToMultiByte(CP_UTF8, 0, Header, -1, Value, (int)ValueSize, NULL, NULL))
+	{
+		Value[0] = 0;
+	}
+}
 
-static size_t Buddy_DownloadDerpMap(HINTERNET HttpSession, uint8_t* Buffer, size_t BufferMaxSize)
+// Conditional GET of the DERP map, revalidating the cached copy described by Info. A new map is
+// fed to the parser as it arrives and written next to the cache, which it replaces once complete;
+// Info then gets the new validators. Returns HTTP_STATUS_OK when the parser read a complete new
+// map, HTTP_STATUS_NOT_MODIFIED when the cached one is current, 0 otherwise.
+static DWORD Buddy_DownloadDerpMap(HINTERNET HttpSession, DerpMapParser* Parser, DerpMapCacheInfo* Info, LPCWSTR CachePath)
 {
-	size_t BufferSize = 0;
+	DWORD Result = 0;
 
-	if (!HttpSession || !Buffer || BufferMaxSize == 0)
+	if (!HttpSession)
 	{
 		return 0;
 	}
 
+	wchar_t Headers[512] = L"";
+	if (Info->etag[0])
+	{
+		StringCchPrintfW(Headers, ARRAYSIZE(Headers), L"If-None-Match: %hs\r\n", Info->etag);
+	}
+	if (Info->last_modified[0])
+	{
+		size_t Length = wcslen(Headers);
+		StringCchPrintfW(Headers + Length, ARRAYSIZE(Headers) - Length, L"If-Modified-Since: %hs\r\n", Info->last_modified);
+	}
+
 	HINTERNET HttpConnection = WinHttpConnect(HttpSession, L"login.tailscale.com", INTERNET_DEFAULT_HTTPS_PORT, 0);
 	if (HttpConnection)
 	{
 		HINTERNET HttpRequest = WinHttpOpenRequest(HttpConnection, L"GET", L"/derpmap/default", NULL, NULL, NULL, WINHTTP_FLAG_SECURE);
 		if (HttpRequest)
 		{
-			if (WinHttpSendRequest(HttpRequest, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0) && WinHttpReceiveResponse(HttpRequest, NULL))
+			LPCWSTR RequestHeaders = Headers[0] ? Headers : WINHTTP_NO_ADDITIONAL_HEADERS;
+			DWORD RequestHeadersLength = Headers[0] ? (DWORD)-1L : 0;
+			if (WinHttpSendRequest(HttpRequest, RequestHeaders, RequestHeadersLength, WINHTTP_NO_REQUEST_DATA, 0, 0, 0) && WinHttpReceiveResponse(HttpRequest, NULL))
 			{
 				DWORD Status = 0;
 				DWORD StatusSize = sizeof(Status);
@@ -779,17 +940,66 @@ static size_t Buddy_DownloadDerpMap(HINTERNET HttpSession, uint8_t* Buffer, size
 					&StatusSize,
 					WINHTTP_NO_HEADER_INDEX);
 
-				if (Status == HTTP_STATUS_OK)
+				if (Status == HTTP_STATUS_NOT_MODIFIED && Headers[0])
+				{
+					Result = HTTP_STATUS_NOT_MODIFIED;
+				}
+				else if (Status == HTTP_STATUS_OK)
 				{
-					while (BufferSize < BufferMaxSize)
+					wchar_t TempPath[MAX_PATH];
+					HANDLE File = INVALID_HANDLE_VALUE;
+					if (CachePath && SUCCEEDED(StringCchPrintfW(TempPath, ARRAYSIZE(TempPath), L"%ls.tmp", CachePath)))
+					{
+						File = CreateFileW(TempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+					}
+
+					bool Complete = true;
+					for (;;)
 					{
+						uint8_t Buffer[BUDDY_DERPMAP_CHUNK_SIZE];
 						DWORD Read;
-						if (!WinHttpReadData(HttpRequest, Buffer + BufferSize, (DWORD)(BufferMaxSize - BufferSize), &Read) || Read == 0)
+						if (!WinHttpReadData(HttpRequest, Buffer, sizeof(Buffer), &Read))
+						{
+							Complete = false;
+							break;
+						}
+						if (Read == 0)
+						{
+							break;
+						}
+						if (!DerpMapParser_Feed(Parser, Buffer, Read))
 						{
+							Complete = false;
 							break;
 						}
-						BufferSize += Read;
+
+						DWORD Written;
+						if (File != INVALID_HANDLE_VALUE && (!WriteFile(File, Buffer, Read, &Written, NULL) || Written != Read))
+						{
+							CloseHandle(File);
+							DeleteFileW(TempPath);
+							File = INVALID_HANDLE_VALUE;
+						}
+					}
+					Complete = Complete && DerpMapParser_Finish(Parser);
+
+					// validators only describe the cache file when the cache file is this map
+					Info->etag[0] = 0;
+					Info->last_modified[0] = 0;
+					if (File != INVALID_HANDLE_VALUE)
+					{
+						CloseHandle(File);
+						if (Complete && MoveFileExW(TempPath, CachePath, MOVEFILE_REPLACE_EXISTING))
+						{
+							Buddy_QueryHeaderUtf8(HttpRequest, WINHTTP_QUERY_ETAG, Info->etag, sizeof(Info->etag));
+							Buddy_QueryHeaderUtf8(HttpRequest, WINHTTP_QUERY_LAST_MODIFIED, Info->last_modified, sizeof(Info->last_modified));
+						}
+						else
+						{
+							DeleteFileW(TempPath);
+						}
 					}
+					Result = Complete ? HTTP_STATUS_OK : 0;
 				}
 			}
 			WinHttpCloseHandle(HttpRequest);
@@ -797,161 +1007,146 @@ static size_t Buddy_DownloadDerpMap(HINTERNET HttpSession, uint8_t* Buffer, size
 		WinHttpCloseHandle(HttpConnection);
 	}
 
-	return BufferSize;
+	return Result;
 }
 
-static DWORD CALLBACK Buddy_GetBestDerpRegionThread(LPVOID Arg)
+static void Buddy_OnDerpMapRegion(void* Context, uint32_t RegionId, const char* HostName)
 {
-	ScreenBuddy* Buddy = Arg;
-
-	if (!Buddy)
+	ScreenBuddy* Buddy = Context;
+	if (RegionId < BUDDY_MAX_REGION_COUNT)
 	{
-		return 0;
+		MultiByteToWideChar(CP_UTF8, 0, HostName, -1, Buddy->DerpRegions[RegionId], BUDDY_MAX_HOST_LENGTH);
 	}
+}
+
+// Region hostnames from the cached DERP map, revalidated with the server once the cache is no
+// longer fresh. A map that fails to download leaves the cached regions in place.
+static void Buddy_LoadDerpMap(ScreenBuddy* Buddy)
+{
+	uint64_t StartUs = BuddyClock_NowUs();
 
-	uint8_t Buffer[BUDDY_DERPMAP_BUFFER_SIZE];
-	size_t BufferSize = Buddy_DownloadDerpMap(Buddy->HttpSession, Buffer, sizeof(Buffer));
+	wchar_t MapPath[MAX_PATH];
+	char MapPathUtf8[MAX_PATH * 3];
+	char InfoPath[MAX_PATH * 3];
+	bool HavePaths = Buddy_GetDataPath(L"derp_map.json", MapPath, ARRAYSIZE(MapPath))
+		&& Buddy_GetDataPathUtf8(L"derp_map.json", MapPathUtf8, sizeof(MapPathUtf8))
+		&& Buddy_GetDataPathUtf8(L"derp_map.txt", InfoPath, sizeof(InfoPath));
 
-	JsonObject* Json = BufferSize ? JsonObject_Parse((char*)Buffer, (int)BufferSize) : NULL;
-	JsonObject* Regions = JsonObject_GetObject(Json, JsonCSTR("Regions"));
-	JsonIterator* Iterator = JsonObject_GetIterator(Regions);
-	if (Iterator)
+	DerpMapParser Parser;
+	DerpMapCacheInfo Info = { 0 };
+	bool Cached = false;
+	if (HavePaths)
 	{
-		do
-		{
-			JsonObject* Region = JsonIterator_GetValue(Iterator);
-			uint32_t RegionId = (uint32_t)JsonObject_GetNumber(Region, JsonCSTR("RegionID"));
-			if (RegionId < BUDDY_MAX_REGION_COUNT)
-			{
-				JsonArray* Nodes = JsonObject_GetArray(Region, JsonCSTR("Nodes"));
-				JsonObject* Node = JsonArray_GetObject(Nodes, 0);
-				HSTRING NodeHost = JsonObject_GetString(Node, JsonCSTR("HostName"));
-				if (NodeHost)
-				{
-					LPCWSTR HostName = WindowsGetStringRawBuffer(NodeHost, NULL);
-					lstrcpynW(Buddy->DerpRegions[RegionId], HostName, ARRAYSIZE(Buddy->DerpRegions[RegionId]));
-					WindowsDeleteString(NodeHost);
-				}
-				JsonRelease(Node);
-				JsonRelease(Nodes);
-			}
-			JsonRelease(Region);
-		}
-		while (JsonIterator_Next(Iterator));
-		JsonRelease(Iterator);
+		DerpMapParser_Init(&Parser, &Buddy_OnDerpMapRegion, Buddy);
+		Cached = DerpMap_ParseFile(&Parser, MapPathUtf8) && DerpMap_LoadCacheInfo(&Info, InfoPath);
 	}
-	JsonRelease(Regions);
-	JsonRelease(Json);
-
-	ADDRINFOEXW AddressHints =
+	if (!Cached)
 	{
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
-		.ai_protocol = IPPROTO_TCP,
-	};
+		memset(&Info, 0, sizeof(Info));
+	}
 
-	// resolve all hostnames
-	PADDRINFOEXW Addresses[BUDDY_MAX_REGION_COUNT] = { 0 };
-	for (size_t RegionIndex = 0; RegionIndex != BUDDY_MAX_REGION_COUNT; RegionIndex++)
+	const char* Source = "cache";
+	uint64_t Now = (uint64_t)time(NULL);
+	if (!Cached || Now - Info.fetched_at >= DERP_MAP_CACHE_FRESH)
 	{
-		if (Buddy->DerpRegions[RegionIndex][0] == 0)
+		DerpMapParser_Init(&Parser, &Buddy_OnDerpMapRegion, Buddy);
+		DWORD Status = Buddy_DownloadDerpMap(Buddy->HttpSession, &Parser, &Info, HavePaths ? MapPath : NULL);
+		if (Status != 0)
 		{
-			continue;
+			Info.fetched_at = Now;
+			if (HavePaths && !DerpMap_SaveCacheInfo(&Info, InfoPath))
+			{
+				LOG_WARN("Cannot save DERP map cache info to %s", InfoPath);
+			}
 		}
-
-		GetAddrInfoExW(Buddy->DerpRegions[RegionIndex], L"443", NS_ALL, NULL, &AddressHints, &Addresses[RegionIndex], NULL, NULL, NULL, NULL);
+		Source = Status == HTTP_STATUS_OK ? "download" : Status == HTTP_STATUS_NOT_MODIFIED ? "cache, not modified" : Cached ? "cache, download failed" : "nowhere, download failed";
 	}
 
-	// create nonblocking sockets
-	SOCKET Sockets[BUDDY_MAX_REGION_COUNT] = { 0 };
-	for (size_t RegionIndex = 0; RegionIndex != BUDDY_MAX_REGION_COUNT; RegionIndex++)
+	uint32_t RegionCount = 0;
+	for (uint32_t RegionId = 0; RegionId != BUDDY_MAX_REGION_COUNT; RegionId++)
 	{
-		PADDRINFOEXW Address = Addresses[RegionIndex];
-		if (Address == NULL)
-		{
-			continue;
-		}
-
-		SOCKET Socket = socket(Address->ai_family, Address->ai_socktype, Address->ai_protocol);
-		Assert(Socket != INVALID_SOCKET);
-
-		u_long NonBlocking = 1;
-		int NonBlockingOk = ioctlsocket(Socket, FIONBIO, &NonBlocking);
-		Assert(NonBlockingOk == 0);
-
-		Sockets[RegionIndex] = Socket;
+		RegionCount += Buddy->DerpRegions[RegionId][0] != 0;
 	}
+	LOG_NET("DERP map: %u regions from %s, ready in %.1f ms", RegionCount, Source, (BuddyClock_NowUs() - StartUs) / 1000.0);
+}
 
+// Picks the region from the saved latency table when it is recent enough; hostnames of every
+// measured region come back too, so the map does not have to be downloaded first
+static uint32_t Buddy_LoadBestDerpRegion(ScreenBuddy* Buddy)
+{
+	char TablePath[MAX_PATH * 3];
+	RegionLatencyTable* Table = malloc(sizeof(*Table));
 	uint32_t BestRegion = 0;
-
-	// start connections
-	for (size_t RegionIndex = 0; RegionIndex != BUDDY_MAX_REGION_COUNT; RegionIndex++)
+	if (Table && Buddy_GetDataPathUtf8(L"derp_latency.txt", TablePath, sizeof(TablePath)) && RegionProbe_LoadTable(Table, TablePath))
 	{
-		SOCKET Socket = Sockets[RegionIndex];
-		if (Socket == 0)
-		{
-			continue;
-		}
-
-		PADDRINFOEXW Address = Addresses[RegionIndex];
-		int Connected = connect(Socket, Address->ai_addr, (int)Address->ai_addrlen);
-		if (Connected == 0)
-		{
-			BestRegion = (uint32_t)RegionIndex;
-			break;
-		}
-		else if (Connected == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+		BestRegion = RegionProbe_TableBest(Table, (uint64_t)time(NULL), REGION_PROBE_TABLE_MAX_AGE);
+		for (uint32_t Index = 0; Index != Table->count; Index++)
 		{
-			// pending
+			uint32_t RegionId = Table->entries[Index].id;
+			if (RegionId < BUDDY_MAX_REGION_COUNT)
+			{
+				MultiByteToWideChar(CP_UTF8, 0, Table->entries[Index].host, -1, Buddy->DerpRegions[RegionId], BUDDY_MAX_HOST_LENGTH);
+			}
 		}
-		else
+		if (BestRegion >= BUDDY_MAX_REGION_COUNT)
 		{
-			Sockets[RegionIndex] = 0;
-			closesocket(Socket);
+			BestRegion = 0;
 		}
 	}
+	free(Table);
+	return BestRegion;
+}
+
+static DWORD CALLBACK Buddy_GetBestDerpRegionThread(LPVOID Arg)
+{
+	ScreenBuddy* Buddy = Arg;
+
+	if (!Buddy)
+	{
+		return 0;
+	}
 
-	// wait for first connnection to finish
-	if (BestRegion == 0)
+	Buddy_LoadDerpMap(Buddy);
+
+	// all regions are resolved at once and sampled several times, the lowest median wins
+	RegionProbe* Probe = malloc(sizeof(*Probe));
+	uint32_t BestRegion = 0;
+	if (Probe)
 	{
-		uint32_t PollRegion[BUDDY_MAX_REGION_COUNT];
-		WSAPOLLFD Poll[BUDDY_MAX_REGION_COUNT];
-		ULONG PollCount = 0;
-		for (size_t RegionIndex = 0; RegionIndex != BUDDY_MAX_REGION_COUNT; RegionIndex++)
+		RegionProbe_Init(Probe);
+		for (uint32_t RegionId = 0; RegionId != BUDDY_MAX_REGION_COUNT; RegionId++)
 		{
-			if (Sockets[RegionIndex] != 0)
+			char HostName[REGION_PROBE_MAX_HOST];
+			if (Buddy->DerpRegions[RegionId][0] != 0
+				&& WideCharToMultiByte(CP_UTF8, 0, Buddy->DerpRegions[RegionId], -1, HostName, sizeof(HostName), NULL, NULL))
 			{
-				Poll[PollCount].fd = Sockets[RegionIndex];
-				Poll[PollCount].events = POLLOUT;
-				PollRegion[PollCount] = (uint32_t)RegionIndex;
-				PollCount++;
+				RegionProbe_Add(Probe, RegionId, HostName);
 			}
 		}
 
-		if (PollCount && WSAPoll(Poll, PollCount, INFINITE) > 0)
+		RegionProbeConfig ProbeConfig = { .port = 443 };
+		RegionProbe_Run(Probe, &ProbeConfig);
+		BestRegion = RegionProbe_Best(Probe);
+
+		LOG_NET("DERP regions: %u probed in %.0f ms (resolve %.0f ms), %u did not resolve, %u failed samples, best %u",
+			Probe->count, (Probe->resolve_wall_us + Probe->probe_wall_us) / 1000.0, Probe->resolve_wall_us / 1000.0,
+			Probe->resolve_failures, Probe->sample_failures, BestRegion);
+
+		char TablePath[MAX_PATH * 3];
+		if (BestRegion && Buddy_GetDataPathUtf8(L"derp_latency.txt", TablePath, sizeof(TablePath)))
 		{
-			for (size_t Index = 0; Index != BUDDY_MAX_REGION_COUNT; Index++)
+			RegionLatencyTable* Table = malloc(sizeof(*Table));
+			if (Table)
 			{
-				if (Poll[Index].revents & POLLOUT)
+				RegionProbe_ToTable(Probe, Table, (uint64_t)time(NULL));
+				if (!RegionProbe_SaveTable(Table, TablePath))
 				{
-					BestRegion = (uint32_t)PollRegion[Index];
-					break;
+					LOG_WARN("Cannot save DERP latency table to %s", TablePath);
 				}
+				free(Table);
 			}
 		}
-	}
-
-	// done!
-	for (size_t RegionIndex = 0; RegionIndex != BUDDY_MAX_REGION_COUNT; RegionIndex++)
-	{
-		if (Sockets[RegionIndex])
-		{
-			closesocket(Sockets[RegionIndex]);
-		}
-		if (Addresses[RegionIndex])
-		{
-			FreeAddrInfoExW(Addresses[RegionIndex]);
-		}
+		free(Probe);
 	}
 
 	PostMessageW(Buddy->DialogWindow, BUDDY_WM_BEST_REGION, BestRegion, 0);
@@ -1029,9 +1224,9 @@ static void Buddy_LoadConfig(ScreenBuddy* Buddy)
 	// Load DERP settings from JSON config
 	Buddy->DerpRegion = Buddy->Config.derp_region;
 	
-	for (int RegionIndex = 0; RegionIndex < BUDDY_MAX_REGION_COUNT; RegionIndex++)
+	for (int RegionIndex = 0; RegionIndex < ARRAYSIZE(Buddy->Config.derp_regions); RegionIndex++)
 	{
-		lstrcpyW(Buddy->DerpRegions[RegionIndex], Buddy->Config.derp_regions[RegionIndex]);
+		lstrcpynW(Buddy->DerpRegions[RegionIndex], Buddy->Config.derp_regions[RegionIndex], BUDDY_MAX_HOST_LENGTH);
 	}
 
 	// Load and decrypt private key from JSON config
@@ -1098,109 +1293,1051 @@ static void Buddy_LoadConfig(ScreenBuddy* Buddy)
 
 //
 
-static void CALLBACK Buddy_WaitCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WAIT Wait, TP_WAIT_RESULT WaitResult)
+// Network thread callbacks: the thread reads and unseals, the dialog thread only gets
+// BUDDY_WM_NET_EVENT when channels have packets again or the connection dropped. A viewer's
+// video channel goes to the decode thread instead.
+
+// Network lock held. The connection packets are sent on: the direct link while it is up, the relay otherwise.
+static DerpNet* Buddy_SendNet(ScreenBuddy* Buddy)
 {
-	ScreenBuddy* Buddy = Context;
-	if (Buddy && Buddy->DialogWindow)
-	{
-		PostMessageW(Buddy->DialogWindow, BUDDY_WM_NET_EVENT, 0, 0);
-	}
+	return Buddy->DirectOpen ? Buddy->Direct : &Buddy->Net;
 }
 
-static void Buddy_NextWait(ScreenBuddy* Buddy)
+// Dialog thread. The relay connection is closed and a new one is being opened, nothing can be sent.
+static bool Buddy_Reconnecting(ScreenBuddy* Buddy)
 {
-	SetThreadpoolWait(Buddy->WaitCallback, Buddy->Net.SocketEvent, NULL);
+	return Buddy->Resume.state == SESSION_RESUME_RECONNECTING;
 }
 
-static void Buddy_StartWait(ScreenBuddy* Buddy)
+// Network lock held. Back to the relay after the direct link failed or the peer left it. The peer
+// is told on the relay, behind everything sent there before the switch, and what was sent on the
+// link may be lost, so the sharer's next frame is a keyframe.
+static void Buddy_CloseDirect(ScreenBuddy* Buddy)
 {
-	LOG_DEBUG("Starting network wait callback...");
-	Buddy->WaitCallback = CreateThreadpoolWait(&Buddy_WaitCallback, Buddy, NULL);
-	Assert(Buddy->WaitCallback);
+	if (!Buddy->DirectOpen)
+	{
+		return;
+	}
+	DerpNet_Close(Buddy->Direct);
+	Buddy->DirectOpen = false;
+	Buddy->DirectRecv = false;
+	Buddy->DirectLost = true;
 
-	Buddy_NextWait(Buddy);
-	LOG_DEBUG("Wait callback registered successfully");
+	DerpNet_SetSendAllowance(&Buddy->Net, Buddy->Pacing ? 0 : DERPNET_UNPACED);
+	uint8_t Switch[] = { BUDDY_PACKET_DIRECT_SWITCH, BUDDY_SWITCH_RELAY };
+	DerpNet_Queue(&Buddy->Net, &Buddy->RemoteKey, Switch, sizeof(Switch));
 }
 
-static void Buddy_CancelWait(ScreenBuddy* Buddy)
+// Network lock held. Sharer: video goes back on the connection, behind a marker that tells the
+// viewer to stop taking frames from UDP. Frames sent on UDP may be lost, the next one is a keyframe.
+static void Buddy_LeaveUdp(ScreenBuddy* Buddy)
 {
-	SetThreadpoolWait(Buddy->WaitCallback, NULL, NULL);
-	WaitForThreadpoolWaitCallbacks(Buddy->WaitCallback, TRUE);
-	CloseThreadpoolWait(Buddy->WaitCallback);
+	if (!Buddy->UdpOpen)
+	{
+		return;
+	}
+	Buddy->UdpOpen = false;
+	Buddy->DirectLost = true;
+
+	uint8_t Switch[] = { BUDDY_PACKET_UDP_SWITCH, BUDDY_SWITCH_RELAY };
+	DerpNet_Queue(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Switch, sizeof(Switch));
 }
 
-// Network abstraction is now DERP-only
-// Network abstraction is now DERP-only
-static bool Buddy_Send(ScreenBuddy* Buddy, const void* Data, size_t Size)
+// Network lock held. Viewer: the frame taken from UDP goes to the video channel in chunks a packet
+// can hold, the first one as it is (it starts with BUDDY_PACKET_VIDEO and the timing header), the
+// others behind their own type byte, the same way the sharer cuts frames on the connection.
+static int Buddy_UdpChunk(ScreenBuddy* Buddy, NetPacket* Packet)
 {
-   return DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, Size);
+	uint32_t Offset = Buddy->UdpFrameOffset;
+	uint32_t Size;
+	if (Offset == 0)
+	{
+		Size = min(Buddy->UdpFrameSize, BUDDY_SEND_BUFFER_SIZE);
+		Packet->data = Buddy->UdpFrame;
+		Packet->size = Size;
+	}
+	else
+	{
+		Size = min(Buddy->UdpFrameSize - Offset, BUDDY_SEND_BUFFER_SIZE - 1);
+		Buddy->UdpChunk[0] = BUDDY_PACKET_VIDEO;
+		CopyMemory(Buddy->UdpChunk + 1, Buddy->UdpFrame + Offset, Size);
+		Packet->data = Buddy->UdpChunk;
+		Packet->size = 1 + Size;
+	}
+	CopyMemory(Packet->peer, Buddy->RemoteKey.Bytes, sizeof(Packet->peer));
+
+	Buddy->UdpFrameOffset += Size;
+	if (Buddy->UdpFrameOffset == Buddy->UdpFrameSize)
+	{
+		Buddy->UdpFrame = NULL;
+	}
+	return 1;
 }
 
-static int Buddy_Recv(ScreenBuddy* Buddy, uint8_t** OutData, uint32_t* OutSize)
+// Network lock held. Reads the UDP socket, and once the sharer's marker came, takes the next frame
+// that is complete and in order.
+static int Buddy_UdpRecv(ScreenBuddy* Buddy, NetPacket* Packet)
 {
-   DerpKey DummyKey;
-   return DerpNet_Recv(&Buddy->Net, &DummyKey, OutData, OutSize, false);
-}
+	UdpTransport* Udp = &Buddy->Udp;
+	if (UdpTransport_Receive(Udp, BuddyClock_NowUs()) < 0)
+	{
+		LOG_WARN("UDP socket failed, video stays on the connection");
+		Buddy_LeaveUdp(Buddy);
+		UdpTransport_Close(Udp);
+		Buddy->UdpRecv = false;
+		return 0;
+	}
 
-//
+	const uint8_t* Frame;
+	uint32_t FrameSize;
+	while (Buddy->UdpRecv && UdpTransport_PopFrame(Udp, &Frame, &FrameSize))
+	{
+		if (FrameSize > 1 + LATENCY_VIDEO_HEADER_SIZE && Frame[0] == BUDDY_PACKET_VIDEO)
+		{
+			Buddy->UdpFrame = Frame;
+			Buddy->UdpFrameSize = FrameSize;
+			Buddy->UdpFrameOffset = 0;
+			return Buddy_UdpChunk(Buddy, Packet);
+		}
+	}
+	return 0;
+}
 
-static HRESULT STDMETHODCALLTYPE Buddy__QueryInterface(IMFAsyncCallback* This, REFIID Riid, void** Object)
+// Network lock held. Answers the peer's ping right away, behind nothing queued, and takes the
+// answers to ours. Returns false for every other packet.
+static bool Buddy_NetProbe(ScreenBuddy* Buddy, const DerpKey* RecvKey, const uint8_t* Data, uint32_t Size)
 {
-	if (Object == NULL)
+	bool Remote = RtlEqualMemory(RecvKey, &Buddy->RemoteKey, sizeof(*RecvKey));
+	if (Size == 1 + TELEMETRY_PING_SIZE && Data[0] == BUDDY_PACKET_PING)
 	{
-		return E_POINTER;
+		// viewers besides the first ping the sharer too, their answers stay on the relay
+		if (Remote || Fanout_Find(&Buddy->Viewers, RecvKey->Bytes) >= 0)
+		{
+			uint8_t Pong[1 + TELEMETRY_PONG_SIZE];
+			Pong[0] = BUDDY_PACKET_PONG;
+			Telemetry_Answer(Data + 1, Buddy->FramesMissing, Pong + 1);
+			DerpNet_QueueUrgent(Remote ? Buddy_SendNet(Buddy) : &Buddy->Net, RecvKey, Pong, sizeof(Pong));
+		}
+		return true;
 	}
-	if (IsEqualGUID(&IID_IUnknown, Riid) || IsEqualGUID(&IID_IMFAsyncCallback, Riid))
+	if (Size == 1 + TELEMETRY_PONG_SIZE && Data[0] == BUDDY_PACKET_PONG)
 	{
-		*Object = This;
-		return S_OK;
+		if (Remote && Buddy->TelemetryOn)
+		{
+			Telemetry_OnPong(&Buddy->Telemetry, Data + 1, BuddyClock_NowUs());
+		}
+		return true;
 	}
-	return E_NOINTERFACE;
+	return false;
 }
 
-static ULONG STDMETHODCALLTYPE Buddy__AddRef(IMFAsyncCallback* This)
+static int Buddy_NetRecv(void* Context, NetPacket* Packet)
 {
-	return 1;
+	ScreenBuddy* Buddy = Context;
+
+	// a frame from UDP is handed over whole, nothing may land in the video channel in the middle of it
+	if (Buddy->UdpFrame)
+	{
+		return Buddy_UdpChunk(Buddy, Packet);
+	}
+
+	DerpKey RecvKey;
+	uint8_t* RecvData;
+	uint32_t RecvSize;
+	int Recv;
+
+	for (;;)
+	{
+		Recv = DerpNet_Recv(&Buddy->Net, &RecvKey, &RecvData, &RecvSize, false);
+
+		// the relay first, the direct link only after the peer's marker said everything sent on the
+		// relay before it has arrived
+		if (Recv == 0 && Buddy->DirectOpen && Buddy->DirectRecv)
+		{
+			Recv = DerpNet_Recv(Buddy->Direct, &RecvKey, &RecvData, &RecvSize, false);
+			if (Recv < 0)
+			{
+				Buddy_CloseDirect(Buddy);
+
+				static uint8_t Lost[] = { BUDDY_PACKET_DIRECT_SWITCH, BUDDY_SWITCH_LOST };
+				RecvKey = Buddy->RemoteKey;
+				RecvData = Lost;
+				RecvSize = sizeof(Lost);
+				Recv = 1;
+			}
+		}
+
+		if (Recv <= 0 || !Buddy_NetProbe(Buddy, &RecvKey, RecvData, RecvSize))
+		{
+			break;
+		}
+		// probes never reach the channels, the next packet is read in their place
+	}
+
+	if (Recv > 0)
+	{
+		if (RecvSize == 2 && RecvData[0] == BUDDY_PACKET_DIRECT_SWITCH && RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey)))
+		{
+			if (RecvData[1] == BUDDY_SWITCH_DIRECT)
+			{
+				Buddy->DirectRecv = true;
+			}
+			else if (RecvData[1] == BUDDY_SWITCH_RELAY)
+			{
+				Buddy_CloseDirect(Buddy);
+			}
+		}
+		else if (RecvSize == 2 && RecvData[0] == BUDDY_PACKET_UDP_SWITCH && RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey)))
+		{
+			// everything the sharer sent on the connection before the marker has arrived
+			Buddy->UdpRecv = RecvData[1] == BUDDY_SWITCH_DIRECT && Buddy->Udp.state != UDP_STATE_CLOSED;
+		}
+
+		CopyMemory(Packet->peer, RecvKey.Bytes, sizeof(Packet->peer));
+		Packet->data = RecvData;
+		Packet->size = RecvSize;
+	}
+	else if (Recv == 0 && Buddy->Udp.state != UDP_STATE_CLOSED)
+	{
+		Recv = Buddy_UdpRecv(Buddy, Packet);
+	}
+	return Recv;
 }
 
-static ULONG STDMETHODCALLTYPE Buddy__Release(IMFAsyncCallback* This)
+static bool Buddy_WritePaced(ScreenBuddy* Buddy, DerpNet* Net)
 {
-	return 1;
+	if (!Buddy->Pacing)
+	{
+		return DerpNet_GetQueuedBytes(Net) == 0 || DerpNet_OnWritable(Net);
+	}
+
+	uint64_t Now = BuddyClock_NowUs();
+	uint64_t Allowance = Pacer_Allowance(&Buddy->Pacer, Now);
+	DerpNet_SetSendAllowance(Net, (size_t)Allowance);
+	bool Ok = DerpNet_OnWritable(Net);
+	Pacer_OnSent(&Buddy->Pacer, Now, Allowance - Net->SendAllowance, DerpNet_GetQueuedBytes(Net));
+	DerpNet_SetSendAllowance(Net, 0);
+	return Ok;
 }
 
-static HRESULT STDMETHODCALLTYPE Buddy__GetParameters(IMFAsyncCallback* This, DWORD* Flags, DWORD* Queue)
+// Writes what the send queue holds and the pacer allows; urgent frames always go. Network lock held.
+static bool Buddy_WriteQueued(ScreenBuddy* Buddy)
 {
-	*Flags = 0;
-	*Queue = MFASYNC_CALLBACK_QUEUE_MULTITHREADED;
-	return S_OK;
+	if (Buddy->DirectOpen)
+	{
+		// the relay's rest from before the switch goes out unpaced, a failed direct link falls back to it
+		if (DerpNet_GetQueuedBytes(&Buddy->Net) != 0 && !DerpNet_OnWritable(&Buddy->Net))
+		{
+			return false;
+		}
+		if (Buddy_WritePaced(Buddy, Buddy->Direct))
+		{
+			return true;
+		}
+		Buddy_CloseDirect(Buddy);
+	}
+	return Buddy_WritePaced(Buddy, &Buddy->Net);
 }
 
-static HRESULT STDMETHODCALLTYPE Buddy__Invoke(IMFAsyncCallback* This, IMFAsyncResult* AsyncResult)
+// Network lock held. Probes, NACKs and deadlines of the UDP path, and what it needs said on the connection
+static void Buddy_PollUdp(ScreenBuddy* Buddy)
 {
-	ScreenBuddy* Buddy = CONTAINING_RECORD(This, ScreenBuddy, EventCallback);
+	UdpTransport* Udp = &Buddy->Udp;
+	UdpTransport_Poll(Udp, BuddyClock_NowUs());
 
-	IMFMediaEvent* Event;
-	if (SUCCEEDED(IMFMediaEventGenerator_EndGetEvent(Buddy->Generator, AsyncResult, &Event)))
+	if (Udp->candidates_changed)
 	{
-		MediaEventType Type;
-		HR(IMFMediaEvent_GetType(Event, &Type));
-		IMFMediaEvent_Release(Event);
+		// STUN answered, the peer gets the reflexive address too
+		uint8_t Packet[1 + UDP_CANDIDATES_MAX_SIZE];
+		Packet[0] = BUDDY_PACKET_UDP_CANDIDATES;
+		size_t Size = UdpTransport_PackCandidates(Udp, Packet + 1);
+		DerpNet_Queue(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Packet, 1 + Size);
+	}
+	if (Udp->keyframe_needed)
+	{
+		// the viewer gave up a frame and drops the ones after it until a keyframe
+		Udp->keyframe_needed = false;
+		Buddy->DirectLost = true;
+	}
 
-		PostMessageW(Buddy->DialogWindow, BUDDY_WM_MEDIA_EVENT, (WPARAM)Type, 0);
+	if (Udp->state != Buddy->UdpLogged)
+	{
+		Buddy->UdpLogged = Udp->state;
+		if (Udp->state == UDP_STATE_CONNECTED)
+		{
+			LOG_NET("UDP path up after %.1f ms, rtt %.1f ms", Udp->stats.connect_us / 1000.0, Udp->stats.rtt_us / 1000.0);
+		}
+		else if (Udp->state == UDP_STATE_FAILED)
+		{
+			LOG_NET("No UDP path to the remote computer, video stays on the connection");
+		}
+		else if (Udp->state == UDP_STATE_LOST)
+		{
+			LOG_NET("UDP path lost (%llu frames lost, %llu shards rebuilt, %llu resent), video goes back on the connection",
+				Udp->stats.frames_lost, Udp->stats.shards_recovered, Udp->stats.shards_retransmitted);
+		}
+	}
+	if (Buddy->UdpOpen && Udp->state != UDP_STATE_CONNECTED)
+	{
+		Buddy_LeaveUdp(Buddy);
 	}
+}
 
-	return S_OK;
+// Network lock held. A peer of the session left the relay, or is back on a new connection before the
+// relay told: it seals under a new nonce prefix from now on, which DerpNet takes once the peer's
+// replay entry is reset. For RemoteKey the dialog thread waits for the peer to come back.
+static void Buddy_PeerStartsOver(ScreenBuddy* Buddy, const uint8_t Key[32])
+{
+	bool Remote = RtlEqualMemory(Key, Buddy->RemoteKey.Bytes, sizeof(Buddy->RemoteKey.Bytes));
+	if (Remote || Fanout_Find(&Buddy->Viewers, Key) >= 0)
+	{
+		DerpKey PeerKey;
+		CopyMemory(PeerKey.Bytes, Key, sizeof(PeerKey.Bytes));
+		DerpNet_ResetReplay(&Buddy->Net, &PeerKey);
+	}
+	if (Remote)
+	{
+		Buddy->PeerGone = true;
+		Buddy->DecodeCutPending = true;
+		PostMessageW(Buddy->DialogWindow, BUDDY_WM_NET_EVENT, 0, 0);
+	}
 }
 
-// Helper function to create an NV12 sample manually using D3D11 texture
-// Used when sample allocator fails (AMD GPUs)
-static IMFSample* Buddy_CreateNV12Sample(ID3D11Device* Device, UINT Width, UINT Height)
+static bool Buddy_NetFlush(void* Context)
 {
-	// Create NV12 texture with correct dimensions
-	D3D11_TEXTURE2D_DESC TextureDesc = {
-		.Width = Width,
-		.Height = Height,
-		.MipLevels = 1,
+	ScreenBuddy* Buddy = Context;
+
+	// not while a frame taken from UDP is still being handed over, Poll would free it
+	if (Buddy->Udp.state != UDP_STATE_CLOSED && !Buddy->UdpFrame)
+	{
+		Buddy_PollUdp(Buddy);
+	}
+
+	if (Buddy->TelemetryOn)
+	{
+		uint8_t Ping[1 + TELEMETRY_PING_SIZE];
+		Ping[0] = BUDDY_PACKET_PING;
+		if (Telemetry_PingDue(&Buddy->Telemetry, BuddyClock_NowUs(), Ping + 1))
+		{
+			DerpNet_QueueUrgent(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Ping, sizeof(Ping));
+		}
+	}
+
+	if (Buddy->Net.PeersGone != Buddy->PeersGoneSeen)
+	{
+		// the peer's connection to the relay is gone
+		Buddy->PeersGoneSeen = Buddy->Net.PeersGone;
+		Buddy_PeerStartsOver(Buddy, Buddy->Net.LastPeerGone);
+	}
+	if (Buddy->Net.SessionChanges != Buddy->SessionChangesSeen)
+	{
+		// the peer came back without the relay saying it was gone, its HELLO is sent until answered
+		Buddy->SessionChangesSeen = Buddy->Net.SessionChanges;
+		Buddy_PeerStartsOver(Buddy, Buddy->Net.LastSessionChange);
+	}
+
+	bool Ok = Buddy_WriteQueued(Buddy);
+	if (Buddy->TelemetryOn)
+	{
+		// what the socket did not take, on every link the session sends on
+		Telemetry_OnQueue(&Buddy->Telemetry, DerpNet_GetQueuedBytes(&Buddy->Net) + (Buddy->DirectOpen ? DerpNet_GetQueuedBytes(Buddy->Direct) : 0));
+	}
+	return Ok;
+}
+
+static uint32_t Buddy_NetWait(void* Context)
+{
+	ScreenBuddy* Buddy = Context;
+	uint32_t Result = NET_THREAD_WAIT_FOREVER;
+	if (Buddy->Udp.state != UDP_STATE_CLOSED)
+	{
+		Result = UdpTransport_NextPollMs(&Buddy->Udp, BuddyClock_NowUs());
+	}
+	if (Buddy->TelemetryOn)
+	{
+		uint64_t Now = BuddyClock_NowUs();
+		uint64_t Ping = Buddy->Telemetry.next_ping_us;
+		Result = min(Result, Ping <= Now ? 0 : (uint32_t)((Ping - Now + 999) / 1000));
+	}
+	if (!Buddy->Pacing)
+	{
+		return Result;
+	}
+
+	// nothing queued, or tokens left but the socket is full: FD_WRITE wakes the thread
+	uint64_t Wait = Pacer_NextSendUs(&Buddy->Pacer, BuddyClock_NowUs());
+	if (Wait == 0 || Wait == UINT64_MAX)
+	{
+		return Result;
+	}
+	return min(Result, (uint32_t)((Wait + 999) / 1000));
+}
+
+static int Buddy_NetChannel(const NetPacket* Packet)
+{
+	if (Packet->size == 0)
+	{
+		// connection request
+		return NET_CHANNEL_CONTROL;
+	}
+
+	switch (Packet->data[0])
+	{
+	case BUDDY_PACKET_VIDEO:
+	case BUDDY_PACKET_DIRECT_SWITCH:  // in order with the video around it
+	case BUDDY_PACKET_UDP_SWITCH:
+		return NET_CHANNEL_VIDEO;
+	case BUDDY_PACKET_MOUSE_MOVE:
+	case BUDDY_PACKET_MOUSE_BUTTON:
+	case BUDDY_PACKET_MOUSE_WHEEL:
+	case BUDDY_PACKET_KEYBOARD:
+	case BUDDY_PACKET_INPUT_BATCH:
+		return NET_CHANNEL_INPUT;
+	case BUDDY_PACKET_FILE:
+	case BUDDY_PACKET_FILE_ACCEPT:
+	case BUDDY_PACKET_FILE_REJECT:
+	case BUDDY_PACKET_FILE_DATA:
+		return NET_CHANNEL_FILE;
+	default:
+		return NET_CHANNEL_CONTROL;
+	}
+}
+
+static int Buddy_NetClassify(void* Context, const NetPacket* Packet)
+{
+	ScreenBuddy* Buddy = Context;
+	int Channel = Buddy_NetChannel(Packet);
+	if (Buddy->NetThread.config.worker_channels && Packet->size == 2 && Packet->data[0] == BUDDY_PACKET_RESUME &&
+		RtlEqualMemory(Packet->peer, Buddy->RemoteKey.Bytes, sizeof(Packet->peer)) &&
+		(Packet->data[1] == SESSION_RESUME_HELLO || Buddy->DecodeCutPending))
+	{
+		// viewer: the sharer's HELLO, or its first answer after it was gone, comes right behind the
+		// last chunk sent before its stream was cut. The decode thread drops the frame in flight there.
+		Buddy->DecodeCutPending = false;
+		Channel = NET_CHANNEL_VIDEO;
+	}
+	if (Buddy->TelemetryOn)
+	{
+		Telemetry_OnReceive(&Buddy->Telemetry, Channel, Packet->size);
+	}
+	return Channel;
+}
+
+static void Buddy_NetNotify(void* Context, NetThreadEvent Event)
+{
+	ScreenBuddy* Buddy = Context;
+	if (Event == NET_THREAD_WORKER_DATA)
+	{
+		BuddyMutex_Lock(&Buddy->DecodeLock);
+		Buddy->DecodeReady = true;
+		BuddyCond_Signal(&Buddy->DecodeWake);
+		BuddyMutex_Unlock(&Buddy->DecodeLock);
+	}
+	else if (Buddy->DialogWindow)
+	{
+		PostMessageW(Buddy->DialogWindow, BUDDY_WM_NET_EVENT, 0, 0);
+	}
+}
+
+static void Buddy_StartDecodeThread(ScreenBuddy* Buddy);
+static void Buddy_StopDecodeThread(ScreenBuddy* Buddy);
+
+// Viewing: the video channel goes to the decode thread, started here too
+static void Buddy_StartWait(ScreenBuddy* Buddy, bool Viewing)
+{
+	LOG_DEBUG("Starting network thread...");
+	NetThreadConfig Config =
+	{
+		.socket_event = Buddy->Net.SocketEvent,
+		.channel_bytes = { [NET_CHANNEL_VIDEO] = 4 << 20 },
+		.worker_channels = Viewing ? 1u << NET_CHANNEL_VIDEO : 0,
+		.recv = &Buddy_NetRecv,
+		.flush = &Buddy_NetFlush,
+		.wait = &Buddy_NetWait,
+		.classify = &Buddy_NetClassify,
+		.notify = &Buddy_NetNotify,
+		.context = Buddy,
+	};
+	// back after a lost connection, the sharer's stream was cut while this side was away
+	Buddy->DecodeCutPending = Viewing && Buddy->Resume.state == SESSION_RESUME_WAITING;
+	BOOL Started = NetThread_Start(&Buddy->NetThread, &Config);
+	Assert(Started);
+	LOG_DEBUG("Network thread started successfully");
+
+	if (Viewing)
+	{
+		Buddy_StartDecodeThread(Buddy);
+	}
+}
+
+static void Buddy_CancelWait(ScreenBuddy* Buddy)
+{
+	// it pops the video channel, which goes away with the network thread
+	Buddy_StopDecodeThread(Buddy);
+	NetThread_Stop(&Buddy->NetThread);
+}
+
+// Network abstraction is now DERP-only
+// Network abstraction is now DERP-only
+static bool Buddy_Send(ScreenBuddy* Buddy, const void* Data, size_t Size)
+{
+	if (Buddy_Reconnecting(Buddy))
+	{
+		// dropped, like the relay drops what is sent to a peer that is gone
+		return true;
+	}
+
+	NetThread_Lock(&Buddy->NetThread);
+	bool Ok = DerpNet_Send(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Data, Size);
+	if (!Ok && Buddy->DirectOpen)
+	{
+		Buddy_CloseDirect(Buddy);
+		Ok = DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, Size);
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+	return Ok;
+}
+
+// Input and control messages: go ahead of queued video chunks and file data, so they wait for
+// at most the chunk on the wire, and never block on the socket (rest goes out on FD_WRITE)
+static bool Buddy_SendUrgent(ScreenBuddy* Buddy, const void* Data, size_t Size)
+{
+	if (Buddy_Reconnecting(Buddy))
+	{
+		return true;
+	}
+
+	NetThread_Lock(&Buddy->NetThread);
+	bool Ok = DerpNet_SendUrgent(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Data, Size);
+	if (!Ok && Buddy->DirectOpen)
+	{
+		Buddy_CloseDirect(Buddy);
+		Ok = DerpNet_SendUrgent(&Buddy->Net, &Buddy->RemoteKey, Data, Size);
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+	return Ok;
+}
+
+static size_t Buddy_QueuedBytes(ScreenBuddy* Buddy)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	size_t Queued = DerpNet_GetQueuedBytes(&Buddy->Net) + (Buddy->DirectOpen ? DerpNet_GetQueuedBytes(Buddy->Direct) : 0);
+	NetThread_Unlock(&Buddy->NetThread);
+	return Queued;
+}
+
+// all links, the direct one keeps its count after it closed
+static size_t Buddy_TotalSent(ScreenBuddy* Buddy)
+{
+	return Buddy->Net.TotalSent + (Buddy->Direct ? Buddy->Direct->TotalSent : 0) + (size_t)Buddy->Udp.stats.bytes_sent;
+}
+
+static size_t Buddy_TotalReceived(ScreenBuddy* Buddy)
+{
+	return Buddy->Net.TotalReceived + (Buddy->Direct ? Buddy->Direct->TotalReceived : 0) + (size_t)Buddy->Udp.stats.bytes_received;
+}
+
+static int Buddy_Recv(ScreenBuddy* Buddy, uint8_t** OutData, uint32_t* OutSize)
+{
+   DerpKey DummyKey;
+   return DerpNet_Recv(&Buddy->Net, &DummyKey, OutData, OutSize, false);
+}
+
+static bool Buddy_WarmOpen(void* Context, void* Net, const char* Server, const uint8_t* Key)
+{
+	DerpKey PrivateKey;
+	if (Key)
+	{
+		CopyMemory(PrivateKey.Bytes, Key, sizeof(PrivateKey.Bytes));
+	}
+	else
+	{
+		DerpNet_CreateNewKey(&PrivateKey);
+	}
+	return DerpNet_Open(Net, Server, &PrivateKey);
+}
+
+static void Buddy_WarmClose(void* Context, void* Net)
+{
+	DerpNet_Close(Net);
+}
+
+static bool Buddy_WarmPing(void* Context, void* Net, uint64_t Id)
+{
+	uint8_t Data[8];
+	Set64LE(Data, Id);
+	return DerpNet_SendPing(Net, Data);
+}
+
+// before the connection is taken there is no session for what arrives, it is dropped like it was
+// when no connection was open yet
+static int Buddy_WarmPoll(void* Context, void* Net, uint64_t* Pong)
+{
+	DerpNet* Derp = Net;
+	for (;;)
+	{
+		DerpKey RecvKey;
+		uint8_t* RecvData;
+		uint32_t RecvSize;
+		int Recv = DerpNet_Recv(Derp, &RecvKey, &RecvData, &RecvSize, false);
+		if (Recv < 0)
+		{
+			return -1;
+		}
+		if (Recv == 0)
+		{
+			break;
+		}
+	}
+	if (Derp->PongsReceived)
+	{
+		*Pong = Get64LE(Derp->LastPong);
+	}
+	return 0;
+}
+
+// Points the warm connections at the configured server and current share key, starting their
+// threads the first time. Called again whenever the server changes, or with ShareOnly when only
+// the share key did.
+static void Buddy_WarmDerp(ScreenBuddy* Buddy, bool ShareOnly)
+{
+	char Server[DERP_WARM_MAX_SERVER];
+	if (!WideCharToMultiByte(CP_UTF8, 0, Buddy->Config.derp_server, -1, Server, sizeof(Server), NULL, NULL))
+	{
+		Server[0] = 0;
+	}
+
+	DerpWarm* Warms[] = { &Buddy->ShareWarm, &Buddy->ViewWarm };
+	for (int Index = 0; Index < (ShareOnly ? 1 : ARRAYSIZE(Warms)); Index++)
+	{
+		const uint8_t* Key = Warms[Index] == &Buddy->ShareWarm ? Buddy->MyPrivateKey.Bytes : NULL;
+		if (Warms[Index]->running)
+		{
+			DerpWarm_Reset(Warms[Index], Server, Key);
+			continue;
+		}
+
+		DerpNet* Net = malloc(sizeof(*Net));
+		DerpWarmConfig Config =
+		{
+			.net = Net,
+			.net_size = sizeof(*Net),
+			.open = &Buddy_WarmOpen,
+			.close = &Buddy_WarmClose,
+			.ping = &Buddy_WarmPing,
+			.poll = &Buddy_WarmPoll,
+			.context = Buddy,
+		};
+		if (!Net || !DerpWarm_Start(Warms[Index], &Config, Server, Key))
+		{
+			LOG_WARN("Cannot start warm DERP connection, Share and Connect will open their own");
+			free(Net);
+		}
+	}
+	LOG_NET("Warming DERP %s to %s", ShareOnly ? "share connection" : "connections", Server);
+}
+
+// Takes the warm connection when there is one, otherwise opens a new one like before.
+// Warmed (optional) tells which of the two it was.
+static bool Buddy_OpenDerp(ScreenBuddy* Buddy, DerpWarm* Warm, const char* DerpHostName, const DerpKey* PrivateKey, bool* Warmed)
+{
+	uint64_t StartUs = BuddyClock_NowUs();
+	bool Taken = DerpWarm_Take(Warm, &Buddy->Net, BUDDY_WARM_TAKE_WAIT_MS);
+	if (Warmed)
+	{
+		*Warmed = Taken;
+	}
+	if (Taken)
+	{
+		LOG_NET("Using warm DERP connection (opened in %.0f ms, %.0f s ago, %llu pings), took %.1f ms",
+			Warm->last_open_us / 1000.0, (StartUs - Warm->ready_us) / 1000000.0, (unsigned long long)Warm->pings,
+			(BuddyClock_NowUs() - StartUs) / 1000.0);
+		return true;
+	}
+
+	bool Opened = DerpNet_Open(&Buddy->Net, DerpHostName, PrivateKey);
+	LOG_NET("No warm DERP connection, DerpNet_Open took %.0f ms (resolve %.0f ms, connect %.0f ms, address %u of %u tried)",
+		(BuddyClock_NowUs() - StartUs) / 1000.0, Buddy->Net.ResolveUs / 1000.0, Buddy->Net.ConnectUs / 1000.0,
+		Buddy->Net.ConnectWinner + 1, Buddy->Net.ConnectAttempts);
+	if (!Opened)
+	{
+		DerpWarm_Resume(Warm);
+	}
+	return Opened;
+}
+
+// Network thread stopped. Closes the direct link and the UDP path, the session is on the relay or nowhere.
+static void Buddy_ClosePaths(ScreenBuddy* Buddy)
+{
+	// the direct link signals the relay's event, it is closed first
+	DirectConnection_Stop(&Buddy->DirectLink);
+	if (Buddy->DirectOpen)
+	{
+		DerpNet_Close(Buddy->Direct);
+		Buddy->DirectOpen = false;
+	}
+	Buddy->DirectRecv = false;
+	Buddy->DirectLost = false;
+	free(Buddy->Direct);
+	Buddy->Direct = NULL;
+
+	UdpTransport_Close(&Buddy->Udp);
+	Buddy->UdpLogged = UDP_STATE_CLOSED;
+	Buddy->UdpOpen = false;
+	Buddy->UdpRecv = false;
+	Buddy->UdpFrame = NULL;
+}
+
+// Stops opening the connection again, what it had open is closed
+static void Buddy_StopReconnect(ScreenBuddy* Buddy)
+{
+	if (Buddy->ResumeWarm.running)
+	{
+		void* Net = Buddy->ResumeWarm.config.net;
+		DerpWarm_Stop(&Buddy->ResumeWarm);
+		free(Net);
+	}
+}
+
+// Closes the session's connection, the warm connections are opened again for the next one
+static void Buddy_CloseNet(ScreenBuddy* Buddy)
+{
+	Buddy_ClosePaths(Buddy);
+	Buddy->TelemetryOn = false;
+
+	// a connection lost and not resumed was closed back then
+	bool Open = !Buddy_Reconnecting(Buddy);
+	Buddy_StopReconnect(Buddy);
+	SessionResume_Stop(&Buddy->Resume);
+	KillTimer(Buddy->DialogWindow, BUDDY_RESUME_TIMER);
+
+	// the first viewer was told by the caller, the others only hear it here
+	uint8_t Stop[1] = { BUDDY_PACKET_DISCONNECT };
+	for (uint32_t i = 0; Open && i < FANOUT_MAX_VIEWERS && Buddy->Viewers.count != 0; i++)
+	{
+		if (Buddy->Viewers.viewers[i].active)
+		{
+			DerpKey ViewerKey;
+			CopyMemory(ViewerKey.Bytes, Buddy->Viewers.viewers[i].key, sizeof(ViewerKey.Bytes));
+			DerpNet_Send(&Buddy->Net, &ViewerKey, Stop, sizeof(Stop));
+		}
+	}
+	Fanout_Init(&Buddy->Viewers, NULL);
+
+	if (Open)
+	{
+		DerpNet_Close(&Buddy->Net);
+	}
+	DerpWarm_Resume(&Buddy->ShareWarm);
+	DerpWarm_Resume(&Buddy->ViewWarm);
+}
+
+// Worker thread of DirectLink, the dialog thread takes the link on BUDDY_WM_DIRECT_EVENT
+static void Buddy_DirectDone(void* Context)
+{
+	ScreenBuddy* Buddy = Context;
+	PostMessageW(Buddy->DialogWindow, BUDDY_WM_DIRECT_EVENT, 0, 0);
+}
+
+// Sharer, once the viewer is accepted: listens on the LAN and offers the addresses over the relay.
+// Without them the session just stays on the relay.
+static void Buddy_OfferDirect(ScreenBuddy* Buddy)
+{
+	uintptr_t Listener = DirectConnection_Listen(0);
+	if (Listener == DIRECT_INVALID_SOCKET)
+	{
+		LOG_WARN("Cannot listen for a direct connection, staying on the DERP relay");
+		return;
+	}
+
+	DirectOffer Offer = { .port = DirectConnection_GetListenerPort(Listener) };
+	Offer.count = DirectConnection_LocalAddresses(Offer.addresses, DIRECT_MAX_ADDRESSES);
+	if (Offer.count == 0)
+	{
+		DirectConnection_CloseSocket(Listener);
+		LOG_WARN("No IPv4 address for a direct connection, staying on the DERP relay");
+		return;
+	}
+
+	if (!DirectConnection_StartAccept(&Buddy->DirectLink, Listener, Buddy->Net.UserPrivateKey, Buddy->RemoteKey.Bytes, 0, &Buddy_DirectDone, Buddy))
+	{
+		LOG_WARN("Cannot start direct connection thread, staying on the DERP relay");
+		return;
+	}
+
+	uint8_t Packet[1 + DIRECT_OFFER_MAX_SIZE];
+	Packet[0] = BUDDY_PACKET_DIRECT_OFFER;
+	size_t Size = DirectOffer_Pack(&Offer, Packet + 1);
+	Buddy_Send(Buddy, Packet, 1 + Size);
+	LOG_NET("Offered direct connection on port %u, %u address(es)", Offer.port, Offer.count);
+}
+
+// Viewer: races the sharer's addresses on the worker thread
+static void Buddy_ConnectDirect(ScreenBuddy* Buddy, const uint8_t* Data, uint32_t Size)
+{
+	DirectOffer Offer;
+	if (Buddy->DirectLink.running || Buddy->Direct || !DirectOffer_Unpack(&Offer, Data, Size))
+	{
+		LOG_WARN("Ignoring direct connection offer (%u bytes)", Size);
+		return;
+	}
+
+	if (!DirectConnection_StartConnect(&Buddy->DirectLink, &Offer, Buddy->Net.UserPrivateKey, Buddy->RemoteKey.Bytes, &Buddy_DirectDone, Buddy))
+	{
+		LOG_WARN("Cannot start direct connection thread, staying on the DERP relay");
+		return;
+	}
+	LOG_NET("Trying direct connection to %u address(es) on port %u", Offer.count, Offer.port);
+}
+
+// Network lock held. Binds the UDP socket, announces its candidates on the connection and asks the
+// DERP server's STUN port which address the NAT shows for it. Without it the video stays on the connection.
+static bool Buddy_OpenUdp(ScreenBuddy* Buddy)
+{
+	UdpTransportConfig Config = { 0 };
+	CopyMemory(Config.secret, Buddy->Net.UserPrivateKey, sizeof(Config.secret));
+	CopyMemory(Config.peer, Buddy->RemoteKey.Bytes, sizeof(Config.peer));
+	bool Opened = UdpTransport_Open(&Buddy->Udp, &Config, 0);
+	SecureZeroMemory(&Config, sizeof(Config));
+	if (!Opened || !UdpTransport_Watch(&Buddy->Udp, (uintptr_t)Buddy->Net.SocketEvent))
+	{
+		UdpTransport_Close(&Buddy->Udp);
+		return false;
+	}
+
+	// one candidate is left for the reflexive address
+	uint8_t Addresses[UDP_MAX_CANDIDATES - 1][4];
+	uint32_t Count = DirectConnection_LocalAddresses(Addresses, ARRAYSIZE(Addresses));
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		UdpTransport_AddHostCandidate(&Buddy->Udp, Addresses[i]);
+	}
+
+	struct sockaddr_in Server;
+	int ServerSize = sizeof(Server);
+	if (getpeername((SOCKET)Buddy->Net.Socket, (struct sockaddr*)&Server, &ServerSize) == 0 && Server.sin_family == AF_INET)
+	{
+		UdpEndpoint Stun = { .port = UDP_STUN_PORT };
+		CopyMemory(Stun.ip, &Server.sin_addr, sizeof(Stun.ip));
+		UdpTransport_StartStun(&Buddy->Udp, &Stun, BuddyClock_NowUs());
+	}
+
+	uint8_t Packet[1 + UDP_CANDIDATES_MAX_SIZE];
+	Packet[0] = BUDDY_PACKET_UDP_CANDIDATES;
+	size_t Size = UdpTransport_PackCandidates(&Buddy->Udp, Packet + 1);
+	DerpNet_Queue(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Packet, 1 + Size);
+	Buddy->UdpLogged = Buddy->Udp.state;
+	return true;
+}
+
+// Sharer, next to the direct offer: a UDP path for the video, punched through both NATs when the
+// peers are not on the same LAN
+static void Buddy_OfferUdp(ScreenBuddy* Buddy)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	bool Opened = Buddy_OpenUdp(Buddy);
+	uint32_t Count = Buddy->Udp.local_count;
+	uint16_t Port = Buddy->Udp.port;
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+
+	if (Opened)
+	{
+		LOG_NET("Offered %u UDP candidate(s) on port %u", Count, Port);
+	}
+	else
+	{
+		LOG_WARN("Cannot open a UDP socket, video stays on the connection");
+	}
+}
+
+// Both ends: the peer's candidates, punching starts with the first ones. The viewer opens its side
+// and answers with its own candidates then.
+static void Buddy_UdpCandidates(ScreenBuddy* Buddy, const uint8_t* Data, uint32_t Size)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	bool Ok = Buddy->Udp.state != UDP_STATE_CLOSED || Buddy_OpenUdp(Buddy);
+	Ok = Ok && UdpTransport_AddRemoteCandidates(&Buddy->Udp, Data, Size, BuddyClock_NowUs());
+	uint32_t Count = Buddy->Udp.remote_count;
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+
+	if (Ok)
+	{
+		LOG_NET("Punching UDP to %u candidate(s)", Count);
+	}
+	else
+	{
+		LOG_WARN("Ignoring UDP candidates (%u bytes)", Size);
+	}
+}
+
+// Decode thread, for the sharer's marker in the video channel. The network thread already started
+// or stopped taking frames from UDP.
+static void Buddy_UdpSwitch(ScreenBuddy* Buddy, const uint8_t* Data, uint32_t Size)
+{
+	if (Size == 1)
+	{
+		LOG_NET(Data[0] == BUDDY_SWITCH_DIRECT ? "Remote computer sends video over UDP now" : "Remote computer sends video on the connection again");
+	}
+}
+
+// Dialog thread, the worker is done: packets go on the direct link from here on, with a marker on the
+// relay behind everything sent there. When there is no link the marker tells the peer to leave one it
+// may already use.
+static void Buddy_DirectEvent(ScreenBuddy* Buddy)
+{
+	if (!Buddy->DirectLink.running)
+	{
+		// session ended in the meantime
+		return;
+	}
+
+	uintptr_t Socket = DirectConnection_Take(&Buddy->DirectLink);
+	DirectStats Stats = Buddy->DirectLink.stats;
+	bool Accepted = Buddy->DirectLink.accepting;
+	DirectConnection_Stop(&Buddy->DirectLink);
+
+	if (Socket != DIRECT_INVALID_SOCKET && !Buddy->Direct)
+	{
+		Buddy->Direct = malloc(sizeof(*Buddy->Direct));
+		if (!Buddy->Direct)
+		{
+			DirectConnection_CloseSocket(Socket);
+			Socket = DIRECT_INVALID_SOCKET;
+		}
+	}
+
+	DerpKey Secret;
+	CopyMemory(Secret.Bytes, Buddy->Net.UserPrivateKey, sizeof(Secret.Bytes));
+
+	NetThread_Lock(&Buddy->NetThread);
+	bool Opened = Socket != DIRECT_INVALID_SOCKET && DerpNet_OpenDirect(Buddy->Direct, Socket, &Secret, &Buddy->RemoteKey, &Buddy->Net);
+	uint8_t Switch[] = { BUDDY_PACKET_DIRECT_SWITCH, Opened ? BUDDY_SWITCH_DIRECT : BUDDY_SWITCH_RELAY };
+	DerpNet_Queue(&Buddy->Net, &Buddy->RemoteKey, Switch, sizeof(Switch));
+	if (Opened)
+	{
+		if (Buddy->Net.SendBudget)
+		{
+			DerpNet_SetSendBudget(Buddy->Direct, Buddy->Net.SendBudget);
+		}
+		DerpNet_SetSendAllowance(Buddy->Direct, Buddy->Pacing ? 0 : DERPNET_UNPACED);
+		DerpNet_SetSendAllowance(&Buddy->Net, DERPNET_UNPACED);
+		Buddy->DirectOpen = true;
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+
+	SecureZeroMemory(&Secret, sizeof(Secret));
+	if (Opened && Accepted)
+	{
+		LOG_NET("Direct connection up, accepted after %.1f ms (%u rejected), handshake %.1f ms",
+			Stats.connect_us / 1000.0, Stats.rejected, Stats.handshake_us / 1000.0);
+	}
+	else if (Opened)
+	{
+		LOG_NET("Direct connection up, address %u of %u (%u failed, %u rejected), connect %.1f ms, handshake %.1f ms",
+			Stats.winner + 1, Stats.attempts, Stats.failures, Stats.rejected, Stats.connect_us / 1000.0, Stats.handshake_us / 1000.0);
+	}
+	else
+	{
+		LOG_NET("No direct connection (%u of %u addresses failed, %u rejected), staying on the DERP relay",
+			Stats.failures, Stats.attempts, Stats.rejected);
+	}
+}
+
+// Viewer: drops the frame being put together, the rest of it is not coming
+static void Buddy_CutFrame(ScreenBuddy* Buddy)
+{
+	if (Buddy->DecodeInputExpected != 0)
+	{
+		IMFMediaBuffer_Release(Buddy->DecodeInputBuffer);
+		Buddy->DecodeInputBuffer = NULL;
+		Buddy->DecodeInputExpected = 0;
+	}
+}
+
+// For the switch markers in the video channel, on the decode thread of a viewer and the dialog thread
+// of a sharer. The direct link itself was already opened or closed by the network thread.
+static void Buddy_DirectSwitch(ScreenBuddy* Buddy, const uint8_t* Data, uint32_t Size)
+{
+	if (Size != 1)
+	{
+		return;
+	}
+	if (Data[0] == BUDDY_SWITCH_DIRECT)
+	{
+		LOG_NET("Remote computer sends on the direct connection now");
+		return;
+	}
+
+	LOG_NET(Data[0] == BUDDY_SWITCH_LOST ? "Direct connection lost, back on the DERP relay" : "Remote computer went back to the DERP relay");
+	if (Data[0] == BUDDY_SWITCH_RELAY)
+	{
+		// the rest of the frame was cut off with the link, a keyframe comes next
+		Buddy_CutFrame(Buddy);
+	}
+}
+
+//
+
+static HRESULT STDMETHODCALLTYPE Buddy__QueryInterface(IMFAsyncCallback* This, REFIID Riid, void** Object)
+{
+	if (Object == NULL)
+	{
+		return E_POINTER;
+	}
+	if (IsEqualGUID(&IID_IUnknown, Riid) || IsEqualGUID(&IID_IMFAsyncCallback, Riid))
+	{
+		*Object = This;
+		return S_OK;
+	}
+	return E_NOINTERFACE;
+}
+
+static ULONG STDMETHODCALLTYPE Buddy__AddRef(IMFAsyncCallback* This)
+{
+	return 1;
+}
+
+static ULONG STDMETHODCALLTYPE Buddy__Release(IMFAsyncCallback* This)
+{
+	return 1;
+}
+
+static HRESULT STDMETHODCALLTYPE Buddy__GetParameters(IMFAsyncCallback* This, DWORD* Flags, DWORD* Queue)
+{
+	*Flags = 0;
+	*Queue = MFASYNC_CALLBACK_QUEUE_MULTITHREADED;
+	return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE Buddy__Invoke(IMFAsyncCallback* This, IMFAsyncResult* AsyncResult)
+{
+	ScreenBuddy* Buddy = CONTAINING_RECORD(This, ScreenBuddy, EventCallback);
+
+	IMFMediaEvent* Event;
+	if (SUCCEEDED(IMFMediaEventGenerator_EndGetEvent(Buddy->Generator, AsyncResult, &Event)))
+	{
+		MediaEventType Type;
+		HR(IMFMediaEvent_GetType(Event, &Type));
+		IMFMediaEvent_Release(Event);
+
+		PostMessageW(Buddy->DialogWindow, BUDDY_WM_MEDIA_EVENT, (WPARAM)Type, 0);
+	}
+
+	return S_OK;
+}
+
+// Helper function to create an NV12 sample manually using D3D11 texture
+// Used when sample allocator fails (AMD GPUs)
+static IMFSample* Buddy_CreateNV12Sample(ID3D11Device* Device, UINT Width, UINT Height)
+{
+	// Create NV12 texture with correct dimensions
+	D3D11_TEXTURE2D_DESC TextureDesc = {
+		.Width = Width,
+		.Height = Height,
+		.MipLevels = 1,
 		.ArraySize = 1,
 		.Format = DXGI_FORMAT_NV12,  // NV12 format for video encoding
 		.SampleDesc = { 1, 0 },
@@ -1410,6 +2547,7 @@ static bool Buddy_CreateEncoder(ScreenBuddy* Buddy, int EncodeWidth, int EncodeH
 	HR(IMFMediaType_SetUINT32(OutputType, &MF_MT_MPEG2_PROFILE, eAVEncH264VProfile_High));
 	HR(IMFMediaType_SetUINT32(OutputType, &MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
 	HR(IMFMediaType_SetUINT32(OutputType, &MF_MT_AVG_BITRATE, BUDDY_ENCODE_BITRATE));
+	Buddy->EncodeBitrate = BUDDY_ENCODE_BITRATE;
 	HR(IMFMediaType_SetUINT64(OutputType, &MF_MT_FRAME_RATE, MF64(BUDDY_ENCODE_FRAMERATE, 1)));
 	HR(IMFMediaType_SetUINT64(OutputType, &MF_MT_FRAME_SIZE, MF64(EncodeWidth, EncodeHeight)));
 	HR(IMFMediaType_SetUINT64(OutputType, &MF_MT_PIXEL_ASPECT_RATIO, MF64(1, 1)));
@@ -1536,15 +2674,21 @@ static bool Buddy_ResetDecoder(ScreenBuddy* Buddy, IMFTransform* Decoder)
 	HR(IMFTransform_SetOutputType(Decoder, 0, DecodedType, 0));
 	// Direct color conversion - no Converter configuration needed
 	
-	// Use negotiated video configuration from server (or defaults if not received yet)
+	// Use negotiated video configuration from server (or defaults if not received yet); the dialog
+	// thread writes it under the network lock while the decode thread may be here
+	NetThread_Lock(&Buddy->NetThread);
+	BuddyVideoConfig VideoConfig = Buddy->VideoConfig;
+	bool VideoConfigReceived = Buddy->VideoConfigReceived;
+	NetThread_Unlock(&Buddy->NetThread);
+
 	IMFMediaType_SetUINT32(DecodedType, &MF_MT_VIDEO_NOMINAL_RANGE, 
-		Buddy->VideoConfigReceived ? Buddy->VideoConfig.nominal_range : MFNominalRange_16_235);
+		VideoConfigReceived ? VideoConfig.nominal_range : MFNominalRange_16_235);
 	IMFMediaType_SetUINT32(DecodedType, &MF_MT_YUV_MATRIX, 
-		Buddy->VideoConfigReceived ? Buddy->VideoConfig.yuv_matrix : MFVideoTransferMatrix_BT601);
+		VideoConfigReceived ? VideoConfig.yuv_matrix : MFVideoTransferMatrix_BT601);
 	IMFMediaType_SetUINT32(DecodedType, &MF_MT_VIDEO_PRIMARIES, 
-		Buddy->VideoConfigReceived ? Buddy->VideoConfig.primaries : MFVideoPrimaries_BT709);
+		VideoConfigReceived ? VideoConfig.primaries : MFVideoPrimaries_BT709);
 	IMFMediaType_SetUINT32(DecodedType, &MF_MT_TRANSFER_FUNCTION, 
-		Buddy->VideoConfigReceived ? Buddy->VideoConfig.transfer_function : MFVideoTransFunc_709);
+		VideoConfigReceived ? VideoConfig.transfer_function : MFVideoTransFunc_709);
 
 	UINT64 FrameRate;
 	HR(IMFMediaType_GetUINT64(DecodedType, &MF_MT_FRAME_RATE, &FrameRate));
@@ -1643,6 +2787,7 @@ static bool Buddy_CreateDecoder(ScreenBuddy* Buddy)
 	Buddy->DecodeInputBuffer = NULL;
 	Buddy->DecodeOutputSample = NULL;
 	Buddy->Codec = Decoder;
+	Latency_Reset(&Buddy->Latency);
 	// Direct color conversion - no Converter needed
 
 	return true;
@@ -1666,6 +2811,35 @@ static void Buddy_NextMediaEvent(ScreenBuddy* Buddy)
 // Forward declarations
 static void Buddy_OutputFromEncoder(ScreenBuddy* Buddy);
 
+static void Buddy_ForceKeyframe(ScreenBuddy* Buddy)
+{
+	ICodecAPI* Codec;
+	if (SUCCEEDED(IMFTransform_QueryInterface(Buddy->Codec, &IID_ICodecAPI, (void**)&Codec)))
+	{
+		VARIANT Force = { .vt = VT_UI4, .ulVal = 1 };
+		if (FAILED(ICodecAPI_SetValue(Codec, &CODECAPI_AVEncVideoForceKeyFrame, &Force)))
+		{
+			LOG_WARN("Encoder cannot force a keyframe, picture recovers with the next one");
+		}
+		ICodecAPI_Release(Codec);
+	}
+}
+
+// Sharer: the encoder's average bitrate follows the telemetry target from the next frame on
+static void Buddy_SetBitrate(ScreenBuddy* Buddy, uint32_t Bitrate)
+{
+	ICodecAPI* Codec;
+	if (SUCCEEDED(IMFTransform_QueryInterface(Buddy->Codec, &IID_ICodecAPI, (void**)&Codec)))
+	{
+		VARIANT Rate = { .vt = VT_UI4, .ulVal = Bitrate };
+		if (FAILED(ICodecAPI_SetValue(Codec, &CODECAPI_AVEncCommonMeanBitRate, &Rate)))
+		{
+			LOG_WARN("Encoder cannot change its bitrate, staying at the one it started with");
+		}
+		ICodecAPI_Release(Codec);
+	}
+}
+
 static void Buddy_InputToEncoder(ScreenBuddy* Buddy)
 {
 	if (Buddy->EncodeQueueWrite - Buddy->EncodeQueueRead == 0)
@@ -1677,6 +2851,19 @@ static void Buddy_InputToEncoder(ScreenBuddy* Buddy)
 	IMFSample* Sample = Buddy->EncodeQueue[Buddy->EncodeQueueRead % BUDDY_ENCODE_QUEUE_SIZE];
 	Buddy->EncodeQueueRead += 1;
 
+	// the viewer drops the frames cut off with a lost direct link, decoding starts over from here, and
+	// so it does after a frame dropped on a full send queue; a viewer besides it that joined or fell
+	// behind waits for one too
+	NetThread_Lock(&Buddy->NetThread);
+	bool Keyframe = Buddy->DirectLost || Buddy->EncodeDropped || Fanout_KeyframeNeeded(&Buddy->Viewers, BuddyClock_NowUs());
+	Buddy->DirectLost = false;
+	Buddy->EncodeDropped = false;
+	NetThread_Unlock(&Buddy->NetThread);
+	if (Keyframe)
+	{
+		Buddy_ForceKeyframe(Buddy);
+	}
+
 	HR(IMFTransform_ProcessInput(Buddy->Codec, 0, Sample, 0));
 	IMFSample_Release(Sample);
 	
@@ -1688,6 +2875,211 @@ static void Buddy_InputToEncoder(ScreenBuddy* Buddy)
 }
 
 static void Buddy_Disconnect(ScreenBuddy* Buddy, const wchar_t* Message);
+static void Buddy_LinkLost(ScreenBuddy* Buddy, const wchar_t* Message);
+
+// One encoded frame on the seal pool, split into chunks exactly like the serial path below:
+// the first chunk carries the video header, every later one just the packet type byte
+typedef struct
+{
+	ScreenBuddy* Buddy;
+	const uint8_t* Extra;
+	uint32_t ExtraSize;
+	const uint8_t* Data;
+	uint32_t Size;
+	uint32_t ChunkCount;
+	DerpNet* Net;  // connection the frame started on
+	uint8_t SharedKey[32];
+	uint8_t Nonce[SEAL_POOL_WINDOW][24];
+	size_t SlotSize[SEAL_POOL_WINDOW];
+}
+BuddySealFrame;
+
+enum
+{
+	BUDDY_SEAL_SLOT_SIZE = DERPNET_FRAME_OVERHEAD + BUDDY_SEND_BUFFER_SIZE,
+};
+
+static uint32_t Buddy_VideoChunkCount(uint32_t Size, uint32_t ExtraSize)
+{
+	uint32_t First = BUDDY_SEND_BUFFER_SIZE - ExtraSize;
+	if (Size <= First)
+	{
+		return 1;
+	}
+	return 1 + (Size - First + BUDDY_SEND_BUFFER_SIZE - 2) / (BUDDY_SEND_BUFFER_SIZE - 1);
+}
+
+// bytes a frame takes in the send queue: every chunk after the first carries a 1 byte header
+static uint32_t Buddy_VideoWireSize(uint32_t Size, uint32_t ExtraSize, uint32_t ChunkCount)
+{
+	return Size + ExtraSize + (ChunkCount - 1) + ChunkCount * DERPNET_FRAME_OVERHEAD;
+}
+
+static void Buddy_SealChunk(void* Context, uint32_t Index)
+{
+	BuddySealFrame* Frame = Context;
+
+	uint32_t First = BUDDY_SEND_BUFFER_SIZE - Frame->ExtraSize;
+	uint32_t Offset = Index == 0 ? 0 : First + (Index - 1) * (BUDDY_SEND_BUFFER_SIZE - 1);
+	uint32_t SendSize = min(Frame->Size - Offset, Index == 0 ? First : BUDDY_SEND_BUFFER_SIZE - 1);
+
+	DerpNetIoVec Chunk[] =
+	{
+		{ Frame->Extra, Index == 0 ? Frame->ExtraSize : 1 },
+		{ Frame->Data + Offset, SendSize },
+	};
+
+	uint32_t Slot = Index % SEAL_POOL_WINDOW;
+	Frame->SlotSize[Slot] = DerpNet_SealFrameV(Frame->Buddy->SealSlots + Slot * BUDDY_SEAL_SLOT_SIZE,
+		&Frame->Buddy->RemoteKey, Frame->SharedKey, Frame->Nonce[Slot], Chunk, ARRAYSIZE(Chunk));
+}
+
+static bool Buddy_EmitChunk(void* Context, uint32_t Index)
+{
+	BuddySealFrame* Frame = Context;
+	ScreenBuddy* Buddy = Frame->Buddy;
+	uint32_t Slot = Index % SEAL_POOL_WINDOW;
+
+	NetThread_Lock(&Buddy->NetThread);
+
+	// after the direct link was lost during the frame its rest is dropped, a keyframe follows on the relay
+	bool Ok = true;
+	if (Frame->Net == Buddy_SendNet(Buddy))
+	{
+		// the chunk that reuses this slot gets its nonce now, nonces stay in send order; the key
+		// is left alone, the other chunks are being sealed with it
+		if (Index + SEAL_POOL_WINDOW < Frame->ChunkCount)
+		{
+			DerpNet_NextNonce(Frame->Net, Frame->Nonce[Slot]);
+		}
+
+		// each chunk goes to the socket as soon as it and all before it are sealed
+		Ok = DerpNet_QueueSealed(Frame->Net, Buddy->SealSlots + Slot * BUDDY_SEAL_SLOT_SIZE, Frame->SlotSize[Slot]);
+		if (!Ok && Buddy->DirectOpen)
+		{
+			Buddy_CloseDirect(Buddy);
+			Ok = true;
+		}
+	}
+	Ok = Ok && Buddy_WriteQueued(Buddy);
+
+	NetThread_Unlock(&Buddy->NetThread);
+	return Ok;
+}
+
+static bool Buddy_StartSealPool(ScreenBuddy* Buddy)
+{
+	if (Buddy->SealPool.running)
+	{
+		return true;
+	}
+
+	if (!Buddy->SealSlots)
+	{
+		Buddy->SealSlots = malloc(SEAL_POOL_WINDOW * BUDDY_SEAL_SLOT_SIZE);
+	}
+	if (!Buddy->SealSlots || !SealPool_Start(&Buddy->SealPool, 0))
+	{
+		LOG_ERROR("Seal pool unavailable, sealing video chunks serially");
+		return false;
+	}
+
+	LOG_INFO("Seal pool started with %u threads", Buddy->SealPool.thread_count + 1);
+	return true;
+}
+
+// Room for a whole encoded frame on the connection, without waiting for the socket. A frame that
+// does not fit is dropped before any chunk of it is queued, so the viewer never gets half of one.
+static DerpNetSendResult Buddy_ReserveFrame(ScreenBuddy* Buddy, uint32_t WireSize)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	DerpNetSendResult Result = DerpNet_TryReserve(Buddy_SendNet(Buddy), WireSize);
+	if (Result == DERPNET_SEND_WOULD_BLOCK)
+	{
+		Buddy->EncodeDropped = true;
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+	return Result;
+}
+
+static bool Buddy_SendFrameParallel(ScreenBuddy* Buddy, BuddySealFrame* Frame)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	Frame->Net = Buddy_SendNet(Buddy);
+	DerpNet_PrepareSeal(Frame->Net, &Buddy->RemoteKey, Frame->SharedKey, Frame->Nonce[0]);
+	for (uint32_t i = 1; i < Frame->ChunkCount && i < SEAL_POOL_WINDOW; i++)
+	{
+		DerpNet_NextNonce(Frame->Net, Frame->Nonce[i]);
+	}
+	if (Buddy->Pacing)
+	{
+		Pacer_QueueFrame(&Buddy->Pacer, BuddyClock_NowUs(), Buddy_VideoWireSize(Frame->Size, Frame->ExtraSize, Frame->ChunkCount));
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+
+	// sealing runs without the lock, only the emits take it
+	return SealPool_Run(&Buddy->SealPool, Frame->ChunkCount, Buddy_SealChunk, Buddy_EmitChunk, Frame);
+}
+
+// The encoded frame for the viewers besides RemoteKey, sealed for each of them on the relay. One
+// that has not acknowledged enough of the frames before is skipped and resumes at a keyframe, and
+// so is one the relay's send queue has no room for: it never waits for the socket.
+static bool Buddy_SendToViewers(ScreenBuddy* Buddy, const uint8_t* Extra, uint32_t ExtraSize, uint32_t Sequence, const uint8_t* Data, uint32_t Size, bool Keyframe)
+{
+	uint32_t ChunkTotal = Buddy_VideoChunkCount(Size, ExtraSize);
+	uint32_t WireSize = Buddy_VideoWireSize(Size, ExtraSize, ChunkTotal);
+	bool Ok = true;
+
+	NetThread_Lock(&Buddy->NetThread);
+	uint8_t Selected[FANOUT_MAX_VIEWERS];
+	uint32_t Count = Fanout_Select(&Buddy->Viewers, Sequence, Size, Keyframe, Selected);
+	uint32_t Sent = 0;
+	for (uint32_t i = 0; Ok && i < Count; i++)
+	{
+		DerpNetSendResult Room = DerpNet_TryReserve(&Buddy->Net, WireSize);
+		if (Room == DERPNET_SEND_WOULD_BLOCK)
+		{
+			Fanout_Unsent(&Buddy->Viewers, Selected[i]);
+			continue;
+		}
+		Ok = Room == DERPNET_SEND_QUEUED;
+
+		DerpKey ViewerKey;
+		CopyMemory(ViewerKey.Bytes, Buddy->Viewers.viewers[Selected[i]].key, sizeof(ViewerKey.Bytes));
+
+		uint32_t Offset = 0;
+		uint32_t HeaderSize = ExtraSize;
+		while (Ok && Offset < Size)
+		{
+			uint32_t SendSize = min(Size - Offset, BUDDY_SEND_BUFFER_SIZE - HeaderSize);
+			DerpNetIoVec Chunk[] =
+			{
+				{ Extra, HeaderSize },
+				{ Data + Offset, SendSize },
+			};
+			Ok = DerpNet_QueueV(&Buddy->Net, &ViewerKey, Chunk, ARRAYSIZE(Chunk));
+			Offset += SendSize;
+			HeaderSize = 1;
+		}
+		Sent++;
+	}
+	if (Ok && Sent != 0)
+	{
+		// with the first viewer on a direct link the relay's queue goes out unpaced anyway
+		if (Buddy->Pacing && !Buddy->DirectOpen)
+		{
+			Pacer_QueueFrame(&Buddy->Pacer, BuddyClock_NowUs(), Sent * WireSize);
+		}
+		Ok = Buddy_WriteQueued(Buddy);
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+
+	if (Sent != 0)
+	{
+		NetThread_Wake(&Buddy->NetThread);
+	}
+	return Ok;
+}
 
 static void Buddy_OutputFromEncoder(ScreenBuddy* Buddy)
 {
@@ -1749,47 +3141,175 @@ static void Buddy_OutputFromEncoder(ScreenBuddy* Buddy)
 	DWORD OutputSize;
 	HR(IMFMediaBuffer_Lock(OutputBuffer, &OutputData, NULL, &OutputSize));
 
-	uint8_t SendBuffer[BUDDY_SEND_BUFFER_SIZE];
+	// sample time is relative to the first captured frame, both on the QPC clock
+	LONGLONG SampleTime = 0;
+	IMFSample_GetSampleTime(OutputSample, &SampleTime);
+	uint64_t CaptureUs = MFllMulDiv(Buddy->EncodeFirstTime, 1000 * 1000, Buddy->Freq, 0) + SampleTime / 10;
+
+	if (Buddy->Recorder.running)
+	{
+		// copy into the recorder pool only; disk writes happen on its own thread
+		Recorder_Write(&Buddy->Recorder, OutputData, OutputSize, (uint64_t)SampleTime / 10);
+	}
 
-	uint8_t Extra[1 + sizeof(OutputSize)];
+	LatencyVideoHeader Header;
+	Latency_SharerStampFrame(&Buddy->Latency, &Header, OutputSize, CaptureUs, BuddyClock_NowUs());
+
+	uint8_t Extra[1 + LATENCY_VIDEO_HEADER_SIZE];
 	uint32_t ExtraSize = sizeof(Extra);
 
 	Extra[0] = BUDDY_PACKET_VIDEO;
-	CopyMemory(Extra + 1, &OutputSize, sizeof(OutputSize));
+	Latency_PackVideoHeader(Extra + 1, &Header);
 
 	s_FrameCount++;
+	const BYTE* OriginalData = OutputData;
 	DWORD OriginalSize = OutputSize;
 	int ChunkCount = 0;
+
+	UINT32 CleanPoint = 0;
+	IMFSample_GetUINT32(OutputSample, &MFSampleExtension_CleanPoint, &CleanPoint);
 	
 	if (s_FrameCount <= 5 || (GetTickCount() - s_LastLogTime) >= 1000)
 	{
 		LOG_INFO("Sending encoded frame #%d, Size=%u bytes", s_FrameCount, OriginalSize);
 	}
 	
-	while (OutputSize != 0)
+	// with a UDP path up the frame goes there whole: parity and retransmits instead of the
+	// connection's ordering, so no pacing and no sealing pool. The marker on the connection comes
+	// first, the viewer takes frames from UDP only after the video sent before it.
+	bool SentUdp = false;
+	NetThread_Lock(&Buddy->NetThread);
+	if (Buddy->Udp.state == UDP_STATE_CONNECTED)
+	{
+		if (!Buddy->UdpOpen)
+		{
+			uint8_t Switch[] = { BUDDY_PACKET_UDP_SWITCH, BUDDY_SWITCH_DIRECT };
+			Buddy->UdpOpen = DerpNet_Queue(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Switch, sizeof(Switch));
+		}
+		if (Buddy->UdpOpen)
+		{
+			SentUdp = UdpTransport_SendFrame(&Buddy->Udp, Extra, ExtraSize, OutputData, OutputSize, CleanPoint != 0);
+			if (!SentUdp)
+			{
+				// too big for it, this frame and the rest go on the connection
+				Buddy_LeaveUdp(Buddy);
+			}
+		}
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+
+	uint32_t ChunkTotal = Buddy_VideoChunkCount(OutputSize, ExtraSize);
+	if (Buddy_Reconnecting(Buddy))
+	{
+		// nowhere to send it, the first frame after the resume is a keyframe
+		OutputSize = 0;
+	}
+	else if (SentUdp)
+	{
+		s_BytesSentSinceLog += OutputSize + ExtraSize;
+		ChunkCount = 1;
+		OutputSize = 0;
+		NetThread_Wake(&Buddy->NetThread);
+	}
+	else if (Buddy_ReserveFrame(Buddy, Buddy_VideoWireSize(OutputSize, ExtraSize, ChunkTotal)) == DERPNET_SEND_WOULD_BLOCK)
+	{
+		// the connection is backed up past the budget: queueing would wait for the socket
+		LOG_NET("Send queue full, frame %d of %u bytes dropped, the next one is a keyframe", s_FrameCount, OutputSize);
+		OutputSize = 0;
+	}
+	else if (ChunkTotal > 1 && Buddy_StartSealPool(Buddy))
+	{
+		// keyframe sized output: chunks are sealed on all cores and written in order as they are ready
+		BuddySealFrame Frame =
+		{
+			.Buddy = Buddy,
+			.Extra = Extra,
+			.ExtraSize = ExtraSize,
+			.Data = OutputData,
+			.Size = OutputSize,
+			.ChunkCount = ChunkTotal,
+		};
+		if (Buddy_SendFrameParallel(Buddy, &Frame))
+		{
+			s_BytesSentSinceLog += OutputSize + ExtraSize + (ChunkTotal - 1);
+			ChunkCount = ChunkTotal;
+			OutputSize = 0;
+		}
+		else
+		{
+			LOG_ERROR("DerpNet_QueueSealed FAILED! Frame=%d, Chunks=%u, Size=%u", s_FrameCount, ChunkTotal, OutputSize);
+			Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
+		}
+	}
+	else
 	{
-		if (ExtraSize)
+		bool QueueOk = true;
+
+		NetThread_Lock(&Buddy->NetThread);
+		if (Buddy->Pacing)
+		{
+			Pacer_QueueFrame(&Buddy->Pacer, BuddyClock_NowUs(), Buddy_VideoWireSize(OutputSize, ExtraSize, ChunkTotal));
+		}
+		DerpNet* Net = Buddy_SendNet(Buddy);
+		while (OutputSize != 0)
 		{
-			CopyMemory(SendBuffer, Extra, ExtraSize);
+			uint32_t SendSize = min(OutputSize, BUDDY_SEND_BUFFER_SIZE - ExtraSize);
+
+			// header and encoder output are sealed straight into the DERP send queue
+			DerpNetIoVec Chunk[] =
+			{
+				{ Extra, ExtraSize },
+				{ OutputData, SendSize },
+			};
+			if (!DerpNet_QueueV(Net, &Buddy->RemoteKey, Chunk, ARRAYSIZE(Chunk)))
+			{
+				if (Buddy->DirectOpen)
+				{
+					// the rest of the frame is dropped, a keyframe follows on the relay
+					Buddy_CloseDirect(Buddy);
+					break;
+				}
+				LOG_ERROR("DerpNet_Send FAILED! Frame=%d, Chunk=%d, Size=%u", s_FrameCount, ChunkCount, SendSize + ExtraSize);
+				QueueOk = false;
+				break;
+			}
+
+			s_BytesSentSinceLog += SendSize + ExtraSize;
+			ChunkCount++;
+
+			OutputData += SendSize;
+			OutputSize -= SendSize;
+
+			ExtraSize = 1;
 		}
 
-		uint32_t SendSize = min(OutputSize, sizeof(SendBuffer) - ExtraSize);
-		CopyMemory(SendBuffer + ExtraSize, OutputData, SendSize);
+		// all chunks of the frame leave in one socket write, or paced when the pacer is on; what
+		// is not written now is written by the network thread instead of waiting here
+		if (QueueOk && !Buddy_WriteQueued(Buddy))
+		{
+			LOG_ERROR("DerpNet_OnWritable FAILED! Frame=%d, Chunks=%d", s_FrameCount, ChunkCount);
+			QueueOk = false;
+		}
+		NetThread_Unlock(&Buddy->NetThread);
 
-		if (!Buddy_Send(Buddy, SendBuffer, SendSize + ExtraSize))
+		if (!QueueOk)
 		{
-			LOG_ERROR("DerpNet_Send FAILED! Frame=%d, Chunk=%d, Size=%u", s_FrameCount, ChunkCount, SendSize + ExtraSize);
-			Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending data!");
-			break;
+			// outside the lock, disconnecting stops the network thread
+			Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
 		}
-		
-		s_BytesSentSinceLog += SendSize + ExtraSize;
-		ChunkCount++;
+	}
 
-		OutputData += SendSize;
-		OutputSize -= SendSize;
+	if (Buddy->State == BUDDY_STATE_SHARING && !Buddy_Reconnecting(Buddy) &&
+		!Buddy_SendToViewers(Buddy, Extra, sizeof(Extra), Header.sequence, OriginalData, OriginalSize, CleanPoint != 0))
+	{
+		LOG_ERROR("DerpNet_QueueV FAILED for other viewers! Frame=%d, Size=%u", s_FrameCount, OriginalSize);
+		Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
+	}
 
-		ExtraSize = 1;
+	if (Buddy->Pacing)
+	{
+		// the network thread writes the rest of the frame as tokens come in
+		NetThread_Wake(&Buddy->NetThread);
 	}
 	
 	// Log every second
@@ -1797,7 +3317,36 @@ static void Buddy_OutputFromEncoder(ScreenBuddy* Buddy)
 	if (Now - s_LastLogTime >= 1000)
 	{
 		LOG_NET("VIDEO STREAM: %d frames, %zu bytes sent in last second (Total: %zu sent, %zu recv)",
-			s_FrameCount, s_BytesSentSinceLog, Buddy->Net.TotalSent, Buddy->Net.TotalReceived);
+			s_FrameCount, s_BytesSentSinceLog, Buddy_TotalSent(Buddy), Buddy_TotalReceived(Buddy));
+
+		LatencySummary Latency;
+		Latency_StatsSummary(&Buddy->Latency.glass, &Latency);
+		if (Latency.count)
+		{
+			LOG_NET("LATENCY: capture->present p50=%.1f ms p95=%.1f ms p99=%.1f ms (clock rtt %.1f ms)",
+				Latency.p50_us / 1000.0, Latency.p95_us / 1000.0, Latency.p99_us / 1000.0, Buddy->Latency.sync.rtt_us / 1000.0);
+
+			// while the session resumes the status says so instead
+			if (Buddy->Resume.state == SESSION_RESUME_ACTIVE)
+			{
+				wchar_t Status[128];
+				StrFormat(Status, L"Connected! Latency p50 %.0f / p95 %.0f / p99 %.0f ms",
+					Latency.p50_us / 1000.0, Latency.p95_us / 1000.0, Latency.p99_us / 1000.0);
+				SetDlgItemTextW(Buddy->DialogWindow, BUDDY_ID_SHARE_STATUS, Status);
+			}
+		}
+
+		if (Buddy->Pacing)
+		{
+			Pacer* Pacer = &Buddy->Pacer;
+			NetThread_Lock(&Buddy->NetThread);
+			LOG_NET("PACER: rate %llu KB/s, bandwidth %llu KB/s, largest write %llu bytes, queue delay avg %.1f ms max %.1f ms",
+				Pacer->rate / 1024, Pacer->bandwidth / 1024, Pacer->max_burst,
+				Pacer->delay_count ? Pacer->delay_total_us / 1000.0 / Pacer->delay_count : 0.0, Pacer->delay_max_us / 1000.0);
+			Pacer->max_burst = 0;
+			Pacer->delay_total_us = Pacer->delay_max_us = Pacer->delay_count = 0;
+			NetThread_Unlock(&Buddy->NetThread);
+		}
 		s_BytesSentSinceLog = 0;
 		s_LastLogTime = Now;
 	}
@@ -2064,7 +3613,13 @@ static void Buddy_OnFrameCapture(ScreenCapture* Capture, bool Closed)
 			LOG_INFO("Frame captured #%u, Time=%llu, EncodeNextTime=%llu", FrameCount, Frame.Time, Buddy->EncodeNextTime);
 		}
 		
-		if (Frame.Time > Buddy->EncodeNextTime)
+		// relay is not keeping up, skip frames before they are encoded so the stream stays decodable
+		size_t Backlog = Buddy_QueuedBytes(Buddy);
+		if (Backlog > BUDDY_SEND_BACKLOG_MAX)
+		{
+			LOG_DEBUG("Send backlog %zu bytes, skipping frame", Backlog);
+		}
+		else if (Frame.Time > Buddy->EncodeNextTime)
 		{
 			static uint32_t QueuedFrameCount = 0;
 			QueuedFrameCount++;
@@ -2570,6 +4125,7 @@ static void Buddy_RenderWindow(ScreenBuddy* Buddy)
 	}
 	else
 	{
+		Buddy->PresentUs = BuddyClock_NowUs();
 		LOG_RENDER("[RENDER] Frame presented successfully");
 	}
 }
@@ -2648,6 +4204,7 @@ static void Buddy_UpdateState(ScreenBuddy* Buddy, BuddyState NewState)
 
 static void Buddy_StopDecoder(ScreenBuddy* Buddy)
 {
+	Buddy_StopDecodeThread(Buddy);
 	IMFTransform_Release(Buddy->Codec);
 	// Direct color conversion - no Converter to release
 
@@ -2661,6 +4218,122 @@ static void Buddy_StopDecoder(ScreenBuddy* Buddy)
 	}
 }
 
+static void Buddy_StartRecording(ScreenBuddy* Buddy)
+{
+	if (!Buddy->Config.record_sessions || Buddy->Recorder.running)
+	{
+		return;
+	}
+
+	wchar_t Directory[MAX_PATH];
+	if (Buddy->Config.recording_directory[0])
+	{
+		StrFormat(Directory, L"%ls", Buddy->Config.recording_directory);
+	}
+	else
+	{
+		StrFormat(Directory, L"%ls\\recordings", Buddy->Config.log_directory);
+	}
+	SHCreateDirectoryExW(NULL, Directory, NULL);
+
+	SYSTEMTIME Time;
+	GetLocalTime(&Time);
+
+	wchar_t PathW[MAX_PATH];
+	StrFormat(PathW, L"%ls\\screenbuddy-%04d%02d%02d_%02d%02d%02d.h264", Directory,
+		Time.wYear, Time.wMonth, Time.wDay, Time.wHour, Time.wMinute, Time.wSecond);
+
+	char Path[MAX_PATH * 3];
+	WideCharToMultiByte(CP_UTF8, 0, PathW, -1, Path, sizeof(Path), NULL, NULL);
+
+	if (Recorder_Open(&Buddy->Recorder, Path, RECORDER_DEFAULT_POOL_SIZE))
+	{
+		LOG_INFO("Recording session to %s", Path);
+	}
+	else
+	{
+		LOG_ERROR("Failed to open session recording %s", Path);
+	}
+}
+
+static void Buddy_StopRecording(ScreenBuddy* Buddy)
+{
+	if (Buddy->Recorder.running)
+	{
+		Recorder_Close(&Buddy->Recorder);
+		LOG_INFO("Recording closed: %llu frames (%llu keyframes, %llu bytes) written, %llu frames (%llu bytes) dropped",
+			Buddy->Recorder.frames_written, Buddy->Recorder.keyframes_written, Buddy->Recorder.bytes_written,
+			Buddy->Recorder.frames_dropped, Buddy->Recorder.bytes_dropped);
+	}
+}
+
+// Paces video for the viewer that just connected: each frame is spread over Config.pacing_percent
+// of the frame interval, starting from twice the encoder bitrate until the socket shows the link
+static void Buddy_StartPacing(ScreenBuddy* Buddy)
+{
+	int Framerate = Buddy->Config.framerate > 0 ? Buddy->Config.framerate : 30;
+	PacerConfig Config =
+	{
+		.frame_interval_us = 1000000 / Framerate,
+		.frame_fraction = Buddy->Config.pacing_percent,
+		.initial_rate = 2 * (uint64_t)Buddy->Config.bitrate / 8,
+	};
+
+	// the network thread sleeps until the next write is due, the default 15.6 ms tick is too coarse
+	timeBeginPeriod(1);
+
+	NetThread_Lock(&Buddy->NetThread);
+	Pacer_Init(&Buddy->Pacer, &Config, BuddyClock_NowUs());
+	DerpNet_SetSendAllowance(Buddy_SendNet(Buddy), 0);
+	Buddy->Pacing = true;
+	NetThread_Unlock(&Buddy->NetThread);
+}
+
+// Both ends, once the session is up: pings every second and counts what arrives (see telemetry.h)
+static void Buddy_StartTelemetry(ScreenBuddy* Buddy)
+{
+	TelemetryConfig Config = { .max_bitrate = BUDDY_ENCODE_BITRATE };
+
+	NetThread_Lock(&Buddy->NetThread);
+	Telemetry_Init(&Buddy->Telemetry, &Config, BuddyClock_NowUs());
+	Buddy->FramesMissing = 0;
+	Buddy->TelemetryOn = true;
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+}
+
+// Both ends, once the session is up: a lost relay connection is opened again instead of ending it
+static void Buddy_StartResume(ScreenBuddy* Buddy)
+{
+	SessionResumeConfig Config = { 0 };
+	SessionResume_Init(&Buddy->Resume, &Config, Buddy->RemoteKey.Bytes);
+
+	NetThread_Lock(&Buddy->NetThread);
+	Buddy->PeersGoneSeen = Buddy->Net.PeersGone;
+	Buddy->SessionChangesSeen = Buddy->Net.SessionChanges;
+	Buddy->PeerGone = false;
+	NetThread_Unlock(&Buddy->NetThread);
+}
+
+// Once a second: false until then, or when the session has no telemetry
+static bool Buddy_TelemetryTick(ScreenBuddy* Buddy, TelemetrySummary* Summary)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	bool Ticked = Buddy->TelemetryOn && Telemetry_Tick(&Buddy->Telemetry, BuddyClock_NowUs(), Summary);
+	NetThread_Unlock(&Buddy->NetThread);
+	return Ticked;
+}
+
+static void Buddy_LogTelemetry(ScreenBuddy* Buddy, const TelemetrySummary* Summary)
+{
+	LOG_NET("TELEMETRY: rtt min %.1f avg %.1f p95 %.1f ms (%llu pings lost), queue %llu KB (max %llu KB), "
+		"video %llu KB/s, input %llu KB/s, file %llu KB/s, %llu frames dropped on the way, %zu peers gone",
+		Summary->rtt_min_us / 1000.0, Summary->rtt_avg_us / 1000.0, Summary->rtt_p95_us / 1000.0, Summary->pings_lost,
+		Summary->queue_bytes / 1024, Summary->queue_max / 1024,
+		Summary->goodput[NET_CHANNEL_VIDEO] / 1024, Summary->goodput[NET_CHANNEL_INPUT] / 1024, Summary->goodput[NET_CHANNEL_FILE] / 1024,
+		Summary->peer_missing, Buddy->Net.PeersGone);
+}
+
 static void Buddy_StopSharing(ScreenBuddy* Buddy)
 {
 	if (Buddy->State == BUDDY_STATE_SHARING)
@@ -2669,6 +4342,15 @@ static void Buddy_StopSharing(ScreenBuddy* Buddy)
 		ScreenCapture_Stop(&Buddy->Capture);
 		DragAcceptFiles(Buddy->DialogWindow, FALSE);
 	}
+	if (Buddy->Pacing)
+	{
+		NetThread_Lock(&Buddy->NetThread);
+		Buddy->Pacing = false;
+		DerpNet_SetSendAllowance(Buddy_SendNet(Buddy), DERPNET_UNPACED);
+		NetThread_Unlock(&Buddy->NetThread);
+		timeEndPeriod(1);
+	}
+	Buddy_StopRecording(Buddy);
 
 	IMFShutdown* Shutdown;
 	if (SUCCEEDED(IMFTransform_QueryInterface(Buddy->Codec, &IID_IMFShutdown, (void**)&Shutdown)))
@@ -2709,7 +4391,7 @@ static void Buddy_Disconnect(ScreenBuddy* Buddy, const wchar_t* Message)
 
 		Buddy_ShowMessage(Buddy, Message);
 		Buddy_CancelWait(Buddy);
-		DerpNet_Close(&Buddy->Net);
+		Buddy_CloseNet(Buddy);
 		LOG_INFO("Viewer connection cleaned up");
 	}
 	else if (Buddy->State == BUDDY_STATE_SHARE_STARTED || Buddy->State == BUDDY_STATE_SHARING)
@@ -2717,14 +4399,121 @@ static void Buddy_Disconnect(ScreenBuddy* Buddy, const wchar_t* Message)
 		LOG_INFO("Cleaning up sharing session...");
 		Buddy_StopSharing(Buddy);
 
-		MessageBoxW(Buddy->DialogWindow, Message, BUDDY_TITLE, MB_ICONERROR);
-		Buddy_CancelWait(Buddy);
-		DerpNet_Close(&Buddy->Net);
-		LOG_INFO("Sharing session cleaned up");
+		MessageBoxW(Buddy->DialogWindow, Message, BUDDY_TITLE, MB_ICONERROR);
+		Buddy_CancelWait(Buddy);
+		Buddy_CloseNet(Buddy);
+		LOG_INFO("Sharing session cleaned up");
+	}
+
+	Buddy_UpdateState(Buddy, BUDDY_STATE_DISCONNECTED);
+	LOG_INFO("State updated to DISCONNECTED");
+}
+
+// The relay connection failed. Keeps codecs and capture and opens a new connection with the same
+// key in the background; the session ends only when that fails or the peer does not come back.
+static void Buddy_LinkLost(ScreenBuddy* Buddy, const wchar_t* Message)
+{
+	if (Buddy_Reconnecting(Buddy))
+	{
+		return;
+	}
+	if (!SessionResume_OnLinkLost(&Buddy->Resume, BuddyClock_NowUs()))
+	{
+		Buddy_Disconnect(Buddy, Message);
+		return;
+	}
+
+	Buddy_CancelWait(Buddy);
+	Buddy_ClosePaths(Buddy);
+	Buddy->TelemetryOn = false;
+
+	DerpKey PrivateKey;
+	CopyMemory(PrivateKey.Bytes, Buddy->Net.UserPrivateKey, sizeof(PrivateKey.Bytes));
+	DerpNet_Close(&Buddy->Net);
+
+	char Server[DERP_WARM_MAX_SERVER];
+	if (!WideCharToMultiByte(CP_UTF8, 0, Buddy->Config.derp_server, -1, Server, sizeof(Server), NULL, NULL))
+	{
+		Server[0] = 0;
+	}
+
+	DerpNet* Net = malloc(sizeof(*Net));
+	DerpWarmConfig Config =
+	{
+		.net = Net,
+		.net_size = sizeof(*Net),
+		.max_backoff_ms = SESSION_RESUME_MAX_BACKOFF_MS,
+		.open = &Buddy_WarmOpen,
+		.close = &Buddy_WarmClose,
+		.ping = &Buddy_WarmPing,
+		.poll = &Buddy_WarmPoll,
+		.context = Buddy,
+	};
+	bool Started = Net && DerpWarm_Start(&Buddy->ResumeWarm, &Config, Server, PrivateKey.Bytes);
+	SecureZeroMemory(&PrivateKey, sizeof(PrivateKey));
+	if (!Started)
+	{
+		free(Net);
+		LOG_ERROR("Cannot start reconnecting to DERP server %s", Server);
+		// still RECONNECTING, so CloseNet leaves the closed connection alone
+		Buddy_Disconnect(Buddy, Message);
+		return;
+	}
+
+	LOG_WARN("%ls Reconnecting to %s, the session is kept for %u s", Message, Server, Buddy->Resume.config.grace_ms / 1000);
+	SetTimer(Buddy->DialogWindow, BUDDY_RESUME_TIMER, BUDDY_RESUME_TIMER_MS, NULL);
+	if (Buddy->State == BUDDY_STATE_SHARING)
+	{
+		SetDlgItemTextW(Buddy->DialogWindow, BUDDY_ID_SHARE_STATUS, L"Connection lost, resuming...");
+	}
+}
+
+// Writes out messages queued during the last burst of window messages; never waits, the
+// network thread writes the rest when the socket becomes writable again
+static void Buddy_FlushNet(ScreenBuddy* Buddy)
+{
+	if ((Buddy->State == BUDDY_STATE_CONNECTED || Buddy->State == BUDDY_STATE_SHARING) && !Buddy_Reconnecting(Buddy))
+	{
+		NetThread_Lock(&Buddy->NetThread);
+		bool Ok = Buddy_WriteQueued(Buddy);
+		NetThread_Unlock(&Buddy->NetThread);
+
+		if (!Ok)
+		{
+			Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
+		}
+	}
+}
+
+// Viewer: sends the input collected since the last tick as one packet. Runs on BUDDY_INPUT_TIMER,
+// once per frame interval, and right away for clicks, wheel and keys.
+static void Buddy_FlushInput(ScreenBuddy* Buddy)
+{
+	uint8_t Data[1 + INPUT_BATCH_MAX_SIZE];
+	uint32_t Size = InputBatch_Take(&Buddy->Input, Data + 1);
+	if (Size == 0 || Buddy->State != BUDDY_STATE_CONNECTED)
+	{
+		return;
+	}
+
+	Data[0] = BUDDY_PACKET_INPUT_BATCH;
+	if (!Buddy_SendUrgent(Buddy, Data, 1 + Size))
+	{
+		Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending input!");
 	}
+}
 
-	Buddy_UpdateState(Buddy, BUDDY_STATE_DISCONNECTED);
-	LOG_INFO("State updated to DISCONNECTED");
+static void Buddy_AddInput(ScreenBuddy* Buddy, const InputEvent* Event)
+{
+	if (!InputBatch_Add(&Buddy->Input, Event))
+	{
+		Buddy_FlushInput(Buddy);
+		InputBatch_Add(&Buddy->Input, Event);
+	}
+	if (Event->type != INPUT_EVENT_MOVE)
+	{
+		Buddy_FlushInput(Buddy);
+	}
 }
 
 static HRESULT CALLBACK Buddy_TaskCallback(HWND TaskWindow, UINT Message, WPARAM WParam, LPARAM LParam, LONG_PTR Data)
@@ -2767,9 +4556,9 @@ static void Buddy_SendFile(ScreenBuddy* Buddy, wchar_t* FileName)
 			CopyMemory(&Data[1], &FileSize, sizeof(FileSize));
 			size_t DataSize = 1 + 8 + WideCharToMultiByte(CP_UTF8, 0, FileName, -1, (char*)&Data[1 + 8], BUDDY_FILENAME_MAX, NULL, NULL) - 1;
 
-			if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, DataSize))
+			if (!Buddy_SendUrgent(Buddy, Data, DataSize))
 			{
-				Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending filename!");
+				Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending filename!");
 			}
 			else
 			{
@@ -2831,6 +4620,7 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 		Buddy_CreateRendering(Buddy, Window);
 		Buddy_ShowMessage(Buddy, L"Connecting...");
 		SetTimer(Window, BUDDY_UPDATE_TITLE_TIMER, 1000, NULL);
+		SetTimer(Window, BUDDY_INPUT_TIMER, Buddy->Config.framerate > 0 ? 1000 / Buddy->Config.framerate : 16, NULL);
 		SetWindowTextW(Window, BUDDY_TITLE);
 		return 0;
 
@@ -2852,25 +4642,70 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			LOG_ERROR("Socket handle: %p", (void*)Buddy->Net.Socket);
 			Buddy_Disconnect(Buddy, L"Timeout while connecting to remote computer!");
 		}
+		else if (WParam == BUDDY_INPUT_TIMER)
+		{
+			Buddy_FlushInput(Buddy);
+		}
 		else if (WParam == BUDDY_UPDATE_TITLE_TIMER)
 		{
-			size_t BytesReceived = Buddy->Net.TotalReceived - Buddy->LastReceived;
-			Buddy->LastReceived = Buddy->Net.TotalReceived;
+			// a connection opened again after a loss counts from zero
+			size_t TotalReceived = Buddy_TotalReceived(Buddy);
+			size_t BytesReceived = TotalReceived >= Buddy->LastReceived ? TotalReceived - Buddy->LastReceived : TotalReceived;
+			Buddy->LastReceived = TotalReceived;
 
+			// the decode thread adds to it under the network lock
 			wchar_t Title[BUDDY_FILENAME_MAX];
-			StrFormat(Title, L"%ls - %.f KB/s", BUDDY_TITLE, (double)BytesReceived / 1024.0);
+			LatencySummary Latency;
+			NetThread_Lock(&Buddy->NetThread);
+			Latency_StatsSummary(&Buddy->Latency.glass, &Latency);
+			uint64_t FramesLost = Buddy->Latency.sequence.lost;
+			NetThread_Unlock(&Buddy->NetThread);
+			if (Latency.count)
+			{
+				StrFormat(Title, L"%ls - %.f KB/s - latency p50 %.0f / p95 %.0f / p99 %.0f ms - %llu frames lost", BUDDY_TITLE,
+					(double)BytesReceived / 1024.0, Latency.p50_us / 1000.0, Latency.p95_us / 1000.0, Latency.p99_us / 1000.0,
+					FramesLost);
+			}
+			else
+			{
+				StrFormat(Title, L"%ls - %.f KB/s", BUDDY_TITLE, (double)BytesReceived / 1024.0);
+			}
+
+			TelemetrySummary Telemetry;
+			if (Buddy_TelemetryTick(Buddy, &Telemetry))
+			{
+				Buddy_LogTelemetry(Buddy, &Telemetry);
+				if (Telemetry.rtt_count)
+				{
+					size_t Length = wcslen(Title);
+					swprintf_s(Title + Length, _countof(Title) - Length, L" - rtt %.0f / %.0f / p95 %.0f ms - queue %llu KB - video %llu / input %llu / file %llu KB/s",
+						Telemetry.rtt_min_us / 1000.0, Telemetry.rtt_avg_us / 1000.0, Telemetry.rtt_p95_us / 1000.0, Telemetry.queue_bytes / 1024,
+						Telemetry.goodput[NET_CHANNEL_VIDEO] / 1024, Telemetry.goodput[NET_CHANNEL_INPUT] / 1024, Telemetry.goodput[NET_CHANNEL_FILE] / 1024);
+				}
+			}
+			if (Buddy->Resume.state == SESSION_RESUME_RECONNECTING || Buddy->Resume.state == SESSION_RESUME_WAITING)
+			{
+				uint64_t Now = BuddyClock_NowUs();
+				uint64_t Left = Buddy->Resume.deadline_us > Now ? Buddy->Resume.deadline_us - Now : 0;
+				StrFormat(Title, L"%ls - connection lost, resuming (%llu s left)", BUDDY_TITLE, (Left + 999999) / 1000000);
+			}
 			SetWindowTextW(Window, Title);
 		}
 		else if (WParam == BUDDY_FILE_TIMER)
 		{
-			if (Buddy->ProgressWindow)
+			// paused while the connection is opened again, the rest follows the resume
+			if (Buddy->ProgressWindow && !Buddy_Reconnecting(Buddy))
 			{
 				LARGE_INTEGER TimeNow;
 				QueryPerformanceCounter(&TimeNow);
 
-				uint8_t Buffer[1 + BUDDY_FILE_CHUNK_SIZE];
+				uint8_t Buffer[BUDDY_FILE_CHUNK_SIZE];
 				DWORD Read = 0;
-				if (Buddy->FileHandle && ReadFile(Buddy->FileHandle, Buffer + 1, sizeof(Buffer) - 1, &Read, NULL))
+				if (Buddy_QueuedBytes(Buddy) > BUDDY_SEND_BACKLOG_MAX)
+				{
+					// video goes first, try again on next tick
+				}
+				else if (Buddy->FileHandle && ReadFile(Buddy->FileHandle, Buffer, sizeof(Buffer), &Read, NULL))
 				{
 					if (Read == 0)
 					{
@@ -2878,13 +4713,38 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 					}
 					else
 					{
-						Buffer[0] = BUDDY_PACKET_FILE_DATA;
-						if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Buffer, 1 + Read))
+						uint8_t Packet = BUDDY_PACKET_FILE_DATA;
+						DerpNetIoVec Chunk[] =
+						{
+							{ &Packet, sizeof(Packet) },
+							{ Buffer, Read },
+						};
+						NetThread_Lock(&Buddy->NetThread);
+						DerpNetSendResult Result = DerpNet_TrySendV(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Chunk, ARRAYSIZE(Chunk));
+						if (Result == DERPNET_SEND_DISCONNECTED && Buddy->DirectOpen)
+						{
+							// the direct link is gone, the chunk goes on the relay next tick
+							Buddy_CloseDirect(Buddy);
+							Result = DERPNET_SEND_WOULD_BLOCK;
+						}
+						NetThread_Unlock(&Buddy->NetThread);
+						if (Result == DERPNET_SEND_DISCONNECTED)
+						{
+							Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending file data!");
+						}
+						else if (Result == DERPNET_SEND_WOULD_BLOCK)
 						{
-							Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending file data!");
+							// chunk was not accepted, read it again on next tick
+							LARGE_INTEGER Back = { .QuadPart = -(LONGLONG)Read };
+							SetFilePointerEx(Buddy->FileHandle, Back, NULL, FILE_CURRENT);
 						}
 						else
 						{
+							if (Result == DERPNET_SEND_QUEUED && Buddy->Pacing)
+							{
+								// paced behind the video, the network thread writes it
+								NetThread_Wake(&Buddy->NetThread);
+							}
 							Buddy->FileProgress += Read;
 
 							if (Buddy->FileLastTime == 0)
@@ -2945,8 +4805,12 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			SelectObject(hdc, oldFont);
 			DeleteObject(redBrush);
 		}
-		// Call original renderer (draws rest of UI)
-		Buddy_RenderWindow(Buddy);
+		// Call original renderer (draws rest of UI); while the decode thread draws, its frame shows up anyway
+		if (BuddyMutex_TryLock(&Buddy->RenderLock))
+		{
+			Buddy_RenderWindow(Buddy);
+			BuddyMutex_Unlock(&Buddy->RenderLock);
+		}
 		EndPaint(Window, &ps);
 		ValidateRect(Window, NULL);
 		return 0;
@@ -2956,7 +4820,7 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 		if (Buddy->State == BUDDY_STATE_CONNECTING)
 		{
 			Buddy_CancelWait(Buddy);
-			DerpNet_Close(&Buddy->Net);
+			Buddy_CloseNet(Buddy);
 		}
 		else if (Buddy->State == BUDDY_STATE_CONNECTED)
 		{
@@ -2966,10 +4830,10 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			}
 
 			uint8_t Data[1] = { BUDDY_PACKET_DISCONNECT };
-			DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, sizeof(Data));
+			Buddy_Send(Buddy, Data, sizeof(Data));
 
 			Buddy_CancelWait(Buddy);
-			DerpNet_Close(&Buddy->Net);
+			Buddy_CloseNet(Buddy);
 
 			if (Buddy->ProgressWindow)
 			{
@@ -2997,10 +4861,9 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			};
 			if (Buddy_GetMousePosition(Buddy, &Packet, GET_X_LPARAM(LParam), GET_Y_LPARAM(LParam)))
 			{
-				if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, &Packet, sizeof(Packet)))
-				{
-					Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending data!");
-				}
+				// only the newest position goes out with the next presented frame or input tick
+				InputEvent Event = { .type = INPUT_EVENT_MOVE, .x = Packet.X, .y = Packet.Y };
+				Buddy_AddInput(Buddy, &Event);
 			}
 		}
 		return 0;
@@ -3027,10 +4890,15 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			}
 			if (Buddy_GetMousePosition(Buddy, &Packet, GET_X_LPARAM(LParam), GET_Y_LPARAM(LParam)))
 			{
-				if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, &Packet, sizeof(Packet)))
+				InputEvent Event =
 				{
-					Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending data!");
-				}
+					.type = INPUT_EVENT_BUTTON,
+					.x = Packet.X,
+					.y = Packet.Y,
+					.button = Packet.Button,
+					.down = (uint8_t)Packet.IsDownOrHorizontalWheel,
+				};
+				Buddy_AddInput(Buddy, &Event);
 			}
 		}
 		return 0;
@@ -3056,10 +4924,15 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			}
 			if (Buddy_GetMousePosition(Buddy, &Packet, GET_X_LPARAM(LParam), GET_Y_LPARAM(LParam)))
 			{
-				if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, &Packet, sizeof(Packet)))
+				InputEvent Event =
 				{
-					Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending data!");
-				}
+					.type = INPUT_EVENT_BUTTON,
+					.x = Packet.X,
+					.y = Packet.Y,
+					.button = Packet.Button,
+					.down = (uint8_t)Packet.IsDownOrHorizontalWheel,
+				};
+				Buddy_AddInput(Buddy, &Event);
 			}
 		}
 		return 0;
@@ -3081,10 +4954,15 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 			};
 			Buddy_GetMousePosition(Buddy, &Packet, Point.x, Point.y);
 
-			if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, &Packet, sizeof(Packet)))
+			InputEvent Event =
 			{
-				Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending data!");
-			}
+				.type = INPUT_EVENT_WHEEL,
+				.x = Packet.X,
+				.y = Packet.Y,
+				.delta = Packet.Button,
+				.down = (uint8_t)Packet.IsDownOrHorizontalWheel,
+			};
+			Buddy_AddInput(Buddy, &Event);
 		}
 		return 0;
 	}
@@ -3094,18 +4972,15 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 	{
 		if (Buddy->State == BUDDY_STATE_CONNECTED)
 		{
-			Buddy_KeyboardPacket Packet = {
-				.Packet = BUDDY_PACKET_KEYBOARD,
-				.VirtualKey = (uint16_t)WParam,
-				.ScanCode = (uint16_t)((LParam >> 16) & 0xFF),
-				.Flags = (uint16_t)(((LParam >> 24) & 1) ? KEYEVENTF_EXTENDEDKEY : 0),
-				.IsDown = 1,
-			};
-
-			if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, &Packet, sizeof(Packet)))
+			InputEvent Event =
 			{
-				Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending keyboard data!");
-			}
+				.type = INPUT_EVENT_KEY,
+				.virtual_key = (uint16_t)WParam,
+				.scan_code = (uint16_t)((LParam >> 16) & 0xFF),
+				.flags = (uint16_t)(((LParam >> 24) & 1) ? KEYEVENTF_EXTENDEDKEY : 0),
+				.down = 1,
+			};
+			Buddy_AddInput(Buddy, &Event);
 		}
 		return 0;
 	}
@@ -3115,18 +4990,15 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 	{
 		if (Buddy->State == BUDDY_STATE_CONNECTED)
 		{
-			Buddy_KeyboardPacket Packet = {
-				.Packet = BUDDY_PACKET_KEYBOARD,
-				.VirtualKey = (uint16_t)WParam,
-				.ScanCode = (uint16_t)((LParam >> 16) & 0xFF),
-				.Flags = (uint16_t)(((LParam >> 24) & 1) ? KEYEVENTF_EXTENDEDKEY : 0),
-				.IsDown = 0,
-			};
-
-			if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, &Packet, sizeof(Packet)))
+			InputEvent Event =
 			{
-				Buddy_Disconnect(Buddy, L"DerpNet disconnect while sending keyboard data!");
-			}
+				.type = INPUT_EVENT_KEY,
+				.virtual_key = (uint16_t)WParam,
+				.scan_code = (uint16_t)((LParam >> 16) & 0xFF),
+				.flags = (uint16_t)(((LParam >> 24) & 1) ? KEYEVENTF_EXTENDEDKEY : 0),
+				.down = 0,
+			};
+			Buddy_AddInput(Buddy, &Event);
 		}
 		return 0;
 	}
@@ -3145,6 +5017,7 @@ static LRESULT CALLBACK Buddy_WindowProc(HWND Window, UINT Message, WPARAM WPara
 				// Changes are already saved and applied by the dialog
 				// Just make sure Buddy->Config is updated
 				LOG_INFO("Settings changed and applied");
+				Buddy_WarmDerp(Buddy, false);
 			}
 			else
 			{
@@ -3564,9 +5437,10 @@ static bool Buddy_StartSharing(ScreenBuddy* Buddy)
 
 			LOG_NET("Attempting DerpNet_Open...");
 			// TODO: Pass port to DerpNet_Open if supported, or set global/struct
-			if (DerpNet_Open(&Buddy->Net, DerpHostName, &Buddy->MyPrivateKey))
+			if (Buddy_OpenDerp(Buddy, &Buddy->ShareWarm, DerpHostName, &Buddy->MyPrivateKey, NULL))
 			{
 				LOG_NET("DerpNet_Open SUCCESS - Connection established!");
+				DerpNet_SetSendBudget(&Buddy->Net, BUDDY_SEND_BUDGET);
 				
 				// Send video configuration to client
 				uint8_t ConfigPacket[1 + sizeof(BuddyVideoConfig)];
@@ -3582,7 +5456,7 @@ static bool Buddy_StartSharing(ScreenBuddy* Buddy)
 					Buddy->VideoConfig.primaries, Buddy->VideoConfig.transfer_function);
 				
 				LOG_INFO("Waiting for remote viewer to connect...");
-				Buddy_StartWait(Buddy);
+				Buddy_StartWait(Buddy, false);
 				return true;
 			}
 			else
@@ -3666,6 +5540,9 @@ static bool Buddy_StartConnection(ScreenBuddy* Buddy)
 	// CONNECT VIA DERP
 	// LAN mode removed; always DERP
 
+	Buddy->ConnectClickUs = BuddyClock_NowUs();
+
+	// only used when no warm connection is ready, that one comes with its own new key
 	DerpKey NewPrivateKey;
 	DerpNet_CreateNewKey(&NewPrivateKey);
 	LOG_HEX("Generated Private Key", &NewPrivateKey, sizeof(NewPrivateKey));
@@ -3682,7 +5559,7 @@ static bool Buddy_StartConnection(ScreenBuddy* Buddy)
 	LOG_NET("TLS: %s", DERPNET_USE_PLAIN_HTTP ? "DISABLED (plain HTTP)" : "ENABLED (HTTPS)");
 
 	LOG_NET("Attempting DerpNet_Open...");
-	if (!DerpNet_Open(&Buddy->Net, DerpHostName, &NewPrivateKey))
+	if (!Buddy_OpenDerp(Buddy, &Buddy->ViewWarm, DerpHostName, &NewPrivateKey, &Buddy->ConnectWarm))
 	{
 		LOG_ERROR("DerpNet_Open FAILED - Could not connect to server!");
 		LOG_ERROR("Host: %s, Port: %s", DerpHostName, DERPNET_USE_PLAIN_HTTP ? "8080" : "8443");
@@ -3693,17 +5570,16 @@ static bool Buddy_StartConnection(ScreenBuddy* Buddy)
 	LOG_NET("DerpNet_Open SUCCESS - Connected to DERP server!");
 
 	LOG_NET("Sending initial connection packet to remote...");
-	if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, NULL, 0))
+	if (!Buddy_Send(Buddy, NULL, 0))
 	{
 		LOG_ERROR("DerpNet_Send FAILED - Could not send initial packet!");
 		Buddy_StopDecoder(Buddy);
 		Buddy_CancelWait(Buddy);
-		DerpNet_Close(&Buddy->Net);
+		Buddy_CloseNet(Buddy);
 		MessageBoxW(Buddy->DialogWindow, L"Failed to send initial connection packet!\n\nThe remote computer may be offline or the connection code may be invalid.", BUDDY_TITLE, MB_ICONERROR);
 		return false;
 	}
 	LOG_NET("Initial packet sent successfully - waiting for response...");
-	Buddy_StartWait(Buddy);
 
 	Buddy->MainWindow = CreateWindowExW(
 		0, BUDDY_CLASS, BUDDY_TITLE, WS_OVERLAPPEDWINDOW,
@@ -3779,463 +5655,947 @@ static bool Buddy_StartConnection(ScreenBuddy* Buddy)
 	IDXGIAdapter_Release(DxgiAdapter);
 	IDXGIDevice_Release(DxgiDevice);
 
+	// only now, the decode thread draws to the swap chain from the first frame on
+	Buddy_StartWait(Buddy, true);
+
 	ShowWindow(Buddy->MainWindow, SW_SHOWDEFAULT);
 	ShowWindow(Buddy->DialogWindow, SW_HIDE);
 	LOG_INFO("Viewing window displayed, ready to receive video");
 	return true;
 }
 
-static void Buddy_NetworkEvent(ScreenBuddy* Buddy)
+// Sharer: turns viewer input into one SendInput call, so a batch reaches the input queue in one
+// piece. Positions are pixels on the captured monitor.
+static void Buddy_InjectInput(ScreenBuddy* Buddy, const InputEvent* Events, uint32_t Count)
 {
-	static DWORD s_LastNetLogTime = 0;
-	static size_t s_BytesRecvSinceLog = 0;
-	static int s_PacketsRecvSinceLog = 0;
-	
-	LOG_DEBUG("NetworkEvent triggered, State=%d, TotalSent=%zu, TotalRecv=%zu", 
-		Buddy->State, Buddy->Net.TotalSent, Buddy->Net.TotalReceived);
-	
-	while (Buddy->State != BUDDY_STATE_DISCONNECTED)
+	MONITORINFO MonitorInfo =
 	{
-		DerpKey RecvKey;
-		uint8_t* RecvData;
-		uint32_t RecvSize;
-		
-		int Recv;
-		   Recv = DerpNet_Recv(&Buddy->Net, &RecvKey, &RecvData, &RecvSize, false);
-		if (Recv < 0)
+		.cbSize = sizeof(MonitorInfo),
+	};
+	BOOL MonitorOk = GetMonitorInfoW(Buddy->Capture.Monitor, &MonitorInfo);
+	Assert(MonitorOk);
+
+	MONITORINFO PrimaryMonitorInfo =
+	{
+		.cbSize = sizeof(PrimaryMonitorInfo),
+	};
+	BOOL PrimaryOk = GetMonitorInfoW(MonitorFromWindow(NULL, MONITOR_DEFAULTTOPRIMARY), &PrimaryMonitorInfo);
+	Assert(PrimaryOk);
+
+	const RECT* R = &MonitorInfo.rcMonitor;
+	const RECT* Primary = &PrimaryMonitorInfo.rcMonitor;
+
+	INPUT Inputs[INPUT_BATCH_MAX_EVENTS];
+	UINT InputCount = 0;
+	for (uint32_t i = 0; i < Count && InputCount < ARRAYSIZE(Inputs); i++)
+	{
+		const InputEvent* Event = &Events[i];
+		INPUT* Input = &Inputs[InputCount];
+
+		if (Event->type == INPUT_EVENT_KEY)
 		{
-			size_t totalSent = Buddy->Net.TotalSent;
-			size_t totalRecv = Buddy->Net.TotalReceived;
-			LOG_ERROR("Network disconnected (sent=%zu, recv=%zu)", totalSent, totalRecv);
-			Buddy_Disconnect(Buddy, L"DERP server disconnected!");
-			break;
+			*Input = (INPUT)
+			{
+				.type = INPUT_KEYBOARD,
+				.ki.wVk = Event->virtual_key,
+				.ki.wScan = Event->scan_code,
+				.ki.dwFlags = Event->flags | (Event->down ? 0 : KEYEVENTF_KEYUP),
+			};
+			InputCount++;
+			continue;
 		}
-		else if (Recv == 0)
+
+		*Input = (INPUT)
+		{
+			.type = INPUT_MOUSE,
+			.mi.dx = (Event->x + R->left) * 65535 / (Primary->right - Primary->left),
+			.mi.dy = (Event->y + R->top) * 65535 / (Primary->bottom - Primary->top),
+			.mi.dwFlags = MOUSEEVENTF_ABSOLUTE,
+		};
+
+		if (Event->type == INPUT_EVENT_MOVE)
 		{
-			// Only log every 5 seconds to avoid spam
-			DWORD Now = GetTickCount();
-			if (Now - s_LastNetLogTime >= 5000)
+			Input->mi.dwFlags |= MOUSEEVENTF_MOVE;
+		}
+		else if (Event->type == INPUT_EVENT_BUTTON)
+		{
+			switch (Event->button)
 			{
-				LOG_DEBUG("Network idle: %d packets, %zu bytes in last 5 sec (Total: sent=%zu, recv=%zu)",
-					s_PacketsRecvSinceLog, s_BytesRecvSinceLog, Buddy->Net.TotalSent, Buddy->Net.TotalReceived);
-				s_BytesRecvSinceLog = 0;
-				s_PacketsRecvSinceLog = 0;
-				s_LastNetLogTime = Now;
+			case 0: Input->mi.dwFlags |= Event->down ? MOUSEEVENTF_LEFTDOWN : MOUSEEVENTF_LEFTUP; break;
+			case 1: Input->mi.dwFlags |= Event->down ? MOUSEEVENTF_RIGHTDOWN : MOUSEEVENTF_RIGHTUP; break;
+			case 2: Input->mi.dwFlags |= Event->down ? MOUSEEVENTF_MIDDLEDOWN : MOUSEEVENTF_MIDDLEUP; break;
+			case 3: Input->mi.dwFlags |= Event->down ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP; Input->mi.mouseData = XBUTTON1; break;
+			case 4: Input->mi.dwFlags |= Event->down ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP; Input->mi.mouseData = XBUTTON2; break;
 			}
-			break;
 		}
-		
-		s_BytesRecvSinceLog += RecvSize;
-		s_PacketsRecvSinceLog++;
-		LOG_NET("RECV: %u bytes, State=%d, Packet#%d", RecvSize, Buddy->State, s_PacketsRecvSinceLog);
+		else if (Event->type == INPUT_EVENT_WHEEL)
+		{
+			Input->mi.mouseData = Event->delta;
+			Input->mi.dwFlags |= (Event->down ? MOUSEEVENTF_HWHEEL : MOUSEEVENTF_WHEEL);
+		}
+		InputCount++;
+	}
+
+	if (InputCount)
+	{
+		SendInput(InputCount, Inputs, sizeof(INPUT));
+	}
+}
+
+// Security confirmation dialog for a viewer that asks to connect
+static bool Buddy_ConfirmViewer(ScreenBuddy* Buddy, const DerpKey* ViewerKey)
+{
+	// Convert public key to hex for display
+	wchar_t keyHex[256];
+	wchar_t* p = keyHex;
+	for (int i = 0; i < 8; i++) {  // Show first 8 bytes (16 hex chars)
+		p += swprintf_s(p, 4, L"%02X", ViewerKey->Bytes[i]);
+		if (i == 3) *p++ = L'-';  // Add separator after 4 bytes
+	}
+	*p++ = L'.';
+	*p++ = L'.';
+	*p++ = L'.';
+	*p = L'\0';
+
+	wchar_t confirmMsg[512];
+	swprintf_s(confirmMsg, 512,
+		L"Someone is trying to connect to your screen!\n\n"
+		L"Connection Key: %ls\n\n"
+		L"Do you want to allow this connection?\n\n"
+		L"Click YES to allow, NO to reject.",
+		keyHex);
+
+	int response = MessageBoxW(Buddy->DialogWindow, confirmMsg,
+		L"Incoming Connection", MB_YESNO | MB_ICONQUESTION | MB_TOPMOST);
+	return response == IDYES;
+}
+
+// Sharer: another viewer asks to connect while one already watches. Accepted, it gets the video
+// config now and the video from the next keyframe on; rejected or over FANOUT_MAX_VIEWERS it is
+// told to go away. Returns false when the session ended meanwhile.
+static bool Buddy_AddViewer(ScreenBuddy* Buddy, DerpKey ViewerKey)
+{
+	LOG_HEX("Another Viewer Public Key", &ViewerKey, sizeof(ViewerKey));
+	bool Accepted = Buddy_ConfirmViewer(Buddy, &ViewerKey);
+	if (Buddy->State != BUDDY_STATE_SHARING || Buddy_Reconnecting(Buddy))
+	{
+		// stopped, or the connection was lost, while the dialog was up
+		return false;
+	}
+
+	NetThread_Lock(&Buddy->NetThread);
+	int Index = Accepted ? Fanout_Add(&Buddy->Viewers, ViewerKey.Bytes, BuddyClock_NowUs()) : -1;
+	bool Ok;
+	if (Index < 0)
+	{
+		uint8_t Data[1] = { BUDDY_PACKET_DISCONNECT };
+		Ok = DerpNet_SendUrgent(&Buddy->Net, &ViewerKey, Data, sizeof(Data));
+	}
+	else
+	{
+		uint8_t ConfigPacket[1 + sizeof(BuddyVideoConfig)];
+		ConfigPacket[0] = BUDDY_PACKET_VIDEO_CONFIG;
+		CopyMemory(&ConfigPacket[1], &Buddy->VideoConfig, sizeof(BuddyVideoConfig));
+		Ok = DerpNet_SendUrgent(&Buddy->Net, &ViewerKey, ConfigPacket, sizeof(ConfigPacket));
+	}
+	uint32_t Count = Buddy->Viewers.count;
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+
+	if (!Ok)
+	{
+		Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
+		return false;
+	}
+	if (!Accepted)
+	{
+		LOG_WARN("User rejected another viewer");
+	}
+	else if (Index < 0)
+	{
+		LOG_WARN("Another viewer refused, %u besides the first already watch", Count);
+	}
+	else
+	{
+		LOG_INFO("Another viewer accepted, %u besides the first now watch", Count);
+	}
+	return true;
+}
+
+// Sharer: a packet from one of the viewers besides RemoteKey
+static void Buddy_ViewerPacket(ScreenBuddy* Buddy, DerpKey ViewerKey, const uint8_t* Data, uint32_t Size)
+{
+	NetThread_Lock(&Buddy->NetThread);
+	if (Size == 1 + 4 && Data[0] == BUDDY_PACKET_FRAME_ACK)
+	{
+		Fanout_OnAck(&Buddy->Viewers, ViewerKey.Bytes, Get32LE(Data + 1));
+	}
+	else if (Size >= 1 && Data[0] == BUDDY_PACKET_DISCONNECT && Fanout_Remove(&Buddy->Viewers, ViewerKey.Bytes))
+	{
+		LOG_INFO("Another viewer left, %u besides the first still watch", Buddy->Viewers.count);
+	}
+	else if (Size == 2 && Data[0] == BUDDY_PACKET_RESUME && Data[1] == SESSION_RESUME_HELLO && Fanout_Remove(&Buddy->Viewers, ViewerKey.Bytes))
+	{
+		// its connection came back after it lost one, it takes the video from the next keyframe again
+		Fanout_Add(&Buddy->Viewers, ViewerKey.Bytes, BuddyClock_NowUs());
+		uint8_t Welcome[] = { BUDDY_PACKET_RESUME, SESSION_RESUME_WELCOME };
+		DerpNet_SendUrgent(&Buddy->Net, &ViewerKey, Welcome, sizeof(Welcome));
+		LOG_INFO("Another viewer is back after a lost connection");
+	}
+	NetThread_Unlock(&Buddy->NetThread);
+}
+
+// Dialog thread, on BUDDY_RESUME_TIMER while the session waits for its connection or for the peer
+static void Buddy_ResumeTick(ScreenBuddy* Buddy)
+{
+	if (SessionResume_Poll(&Buddy->Resume, BuddyClock_NowUs()))
+	{
+		Buddy_Disconnect(Buddy, L"Connection lost and could not be resumed!");
+		return;
+	}
 
-		if (Buddy->State == BUDDY_STATE_CONNECTING || Buddy->State == BUDDY_STATE_CONNECTED)
+	if (Buddy_Reconnecting(Buddy) && DerpWarm_IsReady(&Buddy->ResumeWarm))
+	{
+		if (DerpWarm_Take(&Buddy->ResumeWarm, &Buddy->Net, 0))
 		{
-			if (Buddy->State == BUDDY_STATE_CONNECTING)
+			Buddy_StopReconnect(Buddy);
+
+			SessionResume_OnReconnected(&Buddy->Resume, BuddyClock_NowUs());
+			DerpNet_SetSendBudget(&Buddy->Net, BUDDY_SEND_BUDGET);
+			if (Buddy->Pacing)
 			{
-				LOG_INFO("========================================");
-				LOG_INFO("CONNECTION ESTABLISHED!");
-				LOG_INFO("========================================");
-				LOG_NET("First data received - connection successful!");
-				KillTimer(Buddy->MainWindow, BUDDY_DISCONNECT_TIMER);
-				Buddy_UpdateState(Buddy, BUDDY_STATE_CONNECTED);
-				DragAcceptFiles(Buddy->MainWindow, TRUE);
-				
-				// Hide cursor for remote control
-				if (!Buddy->CursorHidden)
-				{
-					ShowCursor(FALSE);
-					Buddy->CursorHidden = true;
-				}
+				DerpNet_SetSendAllowance(&Buddy->Net, 0);
 			}
+			Buddy->PeersGoneSeen = 0;
+			Buddy->SessionChangesSeen = 0;
+			Buddy->PeerGone = false;
+			Buddy_StartWait(Buddy, Buddy->State == BUDDY_STATE_CONNECTED);
+			LOG_NET("DERP connection back after %.0f ms, %llu attempts", (BuddyClock_NowUs() - Buddy->Resume.lost_us) / 1000.0,
+				(unsigned long long)Buddy->ResumeWarm.open_failures + 1);
+		}
+	}
+
+	if (SessionResume_HelloDue(&Buddy->Resume, BuddyClock_NowUs()))
+	{
+		uint8_t Hello[] = { BUDDY_PACKET_RESUME, SESSION_RESUME_HELLO };
+		if (!Buddy_SendUrgent(Buddy, Hello, sizeof(Hello)))
+		{
+			Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
+		}
+	}
+	else if (Buddy->Resume.state == SESSION_RESUME_ACTIVE)
+	{
+		KillTimer(Buddy->DialogWindow, BUDDY_RESUME_TIMER);
+	}
+}
+
+// HELLO or WELCOME from the peer (see session_resume.h). Whichever end lost its connection closed
+// the direct link and the UDP path with it, so both ends are on the relay after a resume.
+static void Buddy_ResumePacket(ScreenBuddy* Buddy, DerpKey RecvKey, uint8_t Message)
+{
+	uint64_t Resumes = Buddy->Resume.resumes;
+	if (SessionResume_OnMessage(&Buddy->Resume, RecvKey.Bytes, Message, BuddyClock_NowUs()))
+	{
+		uint8_t Welcome[] = { BUDDY_PACKET_RESUME, SESSION_RESUME_WELCOME };
+		if (!Buddy_SendUrgent(Buddy, Welcome, sizeof(Welcome)))
+		{
+			Buddy_LinkLost(Buddy, L"DerpNet disconnect while sending data!");
+			return;
+		}
+	}
+	if (!Buddy->Resume.keyframe_needed)
+	{
+		return;
+	}
+	Buddy->Resume.keyframe_needed = false;
+
+	NetThread_Lock(&Buddy->NetThread);
+	Buddy_CloseDirect(Buddy);
+	Buddy_LeaveUdp(Buddy);
+	UdpTransport_Close(&Buddy->Udp);
+	Buddy->UdpLogged = UDP_STATE_CLOSED;
+	Buddy->UdpRecv = false;
+	Buddy->UdpFrame = NULL;
+	// what was sent meanwhile is gone, the next frame is a keyframe
+	Buddy->DirectLost = true;
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+
+	// a viewer's decode thread already dropped the frame that was cut off, where the message was
+	// in the video channel (see Buddy_NetClassify)
+
+	if (Buddy->Resume.resumes == Resumes)
+	{
+		LOG_WARN("Peer lost its DERP connection unnoticed and is back, sending a keyframe");
+		return;
+	}
+	LOG_NET("Session resumed after %.0f ms (%.0f ms after the connection was back, %llu hellos sent)",
+		Buddy->Resume.last_outage_us / 1000.0, Buddy->Resume.last_rejoin_us / 1000.0, (unsigned long long)Buddy->Resume.hellos_sent);
+	KillTimer(Buddy->DialogWindow, BUDDY_RESUME_TIMER);
+	Buddy_StartTelemetry(Buddy);
+	if (Buddy->State == BUDDY_STATE_SHARING)
+	{
+		SetDlgItemTextW(Buddy->DialogWindow, BUDDY_ID_SHARE_STATUS, L"Connected!");
+	}
+}
+
+// Decode thread, a frame is complete: decoded and shown, then timed and acknowledged to the sharer.
+// The answers are queued for the network thread, which writes them with its next flush.
+static void Buddy_PresentFrame(ScreenBuddy* Buddy)
+{
+	LOG_INFO("Client: Complete video frame received (%u bytes), starting decode", Buddy->DecodeInputExpected);
+	BuddyMutex_Lock(&Buddy->RenderLock);
+	uint64_t LastPresent = Buddy->PresentUs;
+	Buddy_Decode(Buddy, Buddy->DecodeInputBuffer);
+	// timed from the Present call itself; a frame the decoder still holds is not timed at all
+	uint64_t PresentTime = Buddy->PresentUs != LastPresent ? Buddy->PresentUs : 0;
+	BuddyMutex_Unlock(&Buddy->RenderLock);
+
+	IMFMediaBuffer_Release(Buddy->DecodeInputBuffer);
+	Buddy->DecodeInputBuffer = NULL;
+	Buddy->DecodeInputExpected = 0;
+
+	if (PresentTime && Buddy->ConnectClickUs)
+	{
+		LOG_NET("First frame %.0f ms after Connect click (%s DERP connection)",
+			(PresentTime - Buddy->ConnectClickUs) / 1000.0, Buddy->ConnectWarm ? "warm" : "new");
+		Buddy->ConnectClickUs = 0;
+	}
+
+	NetThread_Lock(&Buddy->NetThread);
+	if (PresentTime)
+	{
+		Latency_ViewerOnPresent(&Buddy->Latency, &Buddy->DecodeHeader, PresentTime);
+	}
+	if (PresentTime && Latency_ViewerShouldEcho(&Buddy->Latency, PresentTime))
+	{
+		LatencyEcho Echo =
+		{
+			.sequence = Buddy->DecodeHeader.sequence,
+			.capture_us = Buddy->DecodeHeader.capture_us,
+			.sharer_send_us = Buddy->DecodeHeader.send_us,
+			.viewer_recv_us = Buddy->DecodeRecvTime,
+			.viewer_present_us = PresentTime,
+			.viewer_echo_us = BuddyClock_NowUs(),
+		};
+		uint8_t EchoPacket[1 + LATENCY_ECHO_SIZE];
+		EchoPacket[0] = BUDDY_PACKET_TIMING_ECHO;
+		Latency_PackEcho(EchoPacket + 1, &Echo);
+		DerpNet_QueueUrgent(Buddy_SendNet(Buddy), &Buddy->RemoteKey, EchoPacket, sizeof(EchoPacket));
+	}
+
+	// lets the sharer keep sending, were this not the first viewer (see fanout.h)
+	uint8_t Ack[1 + 4];
+	Ack[0] = BUDDY_PACKET_FRAME_ACK;
+	Set32LE(Ack + 1, Buddy->DecodeHeader.sequence);
+	DerpNet_QueueUrgent(Buddy_SendNet(Buddy), &Buddy->RemoteKey, Ack, sizeof(Ack));
+	NetThread_Unlock(&Buddy->NetThread);
+	NetThread_Wake(&Buddy->NetThread);
+}
+
+// Decode thread: one packet from the video channel, video chunks and the markers sent in order with them
+static void Buddy_VideoPacket(ScreenBuddy* Buddy, const NetPacket* Packet)
+{
+	if (Packet->size < 1 || !RtlEqualMemory(Packet->peer, Buddy->RemoteKey.Bytes, sizeof(Packet->peer)))
+	{
+		return;
+	}
+
+	uint8_t Type = Packet->data[0];
+	const uint8_t* RecvData = Packet->data + 1;
+	uint32_t RecvSize = Packet->size - 1;
 
-			if (RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey)))
+	if (Type == BUDDY_PACKET_RESUME)
+	{
+		// the sharer's stream was cut right before this, the session itself is resumed on the dialog thread
+		Buddy_CutFrame(Buddy);
+		PostMessageW(Buddy->DialogWindow, BUDDY_WM_RESUME, RecvData[0], 0);
+	}
+	else if (Type == BUDDY_PACKET_DIRECT_SWITCH)
+	{
+		Buddy_DirectSwitch(Buddy, RecvData, RecvSize);
+	}
+	else if (Type == BUDDY_PACKET_UDP_SWITCH)
+	{
+		Buddy_UdpSwitch(Buddy, RecvData, RecvSize);
+	}
+	else if (Type == BUDDY_PACKET_VIDEO)
+	{
+		if (Buddy->DecodeInputExpected == 0)
+		{
+			Assert(RecvSize >= LATENCY_VIDEO_HEADER_SIZE);
+			Latency_UnpackVideoHeader(RecvData, &Buddy->DecodeHeader);
+			Buddy->DecodeInputExpected = Buddy->DecodeHeader.size;
+			Buddy->DecodeRecvTime = BuddyClock_NowUs();
+
+			NetThread_Lock(&Buddy->NetThread);
+			uint32_t Skipped = Latency_SequenceObserve(&Buddy->Latency.sequence, Buddy->DecodeHeader.sequence);
+			// the relay dropped them, the sharer hears it in the next pong
+			Buddy->FramesMissing = Buddy->Latency.sequence.lost;
+			NetThread_Unlock(&Buddy->NetThread);
+			if (Skipped)
 			{
-				Assert(RecvSize >= 1);
+				LOG_WARN("Client: %u video frame(s) missing before #%u", Skipped, Buddy->DecodeHeader.sequence);
+			}
 
-				uint8_t Packet = RecvData[0];
-				RecvData += 1;
-				RecvSize -= 1;
+			RecvData += LATENCY_VIDEO_HEADER_SIZE;
+			RecvSize -= LATENCY_VIDEO_HEADER_SIZE;
 
-				if (Packet == BUDDY_PACKET_VIDEO_CONFIG)
-				{
-					// Receive video configuration from server
-					Assert(RecvSize >= sizeof(BuddyVideoConfig));
-					CopyMemory(&Buddy->VideoConfig, RecvData, sizeof(BuddyVideoConfig));
-					Buddy->VideoConfigReceived = true;
-					LOG_INFO("Received video configuration: YUV Matrix=%d, Range=%d, Primaries=%d, Transfer=%d",
-						Buddy->VideoConfig.yuv_matrix, Buddy->VideoConfig.nominal_range,
-						Buddy->VideoConfig.primaries, Buddy->VideoConfig.transfer_function);
-					
-					RecvData += sizeof(BuddyVideoConfig);
-					RecvSize -= sizeof(BuddyVideoConfig);
-					
-					// If there's more data in this packet, continue processing
-					if (RecvSize == 0) continue;
-					
-					// Get next packet type
-					Packet = RecvData[0];
-					RecvData += 1;
-					RecvSize -= 1;
-				}
+			Assert(Buddy->DecodeInputBuffer == NULL);
+			HR(MFCreateMemoryBuffer(Buddy->DecodeInputExpected, &Buddy->DecodeInputBuffer));
+			LOG_INFO("Client: Starting to receive video frame, expected size: %u bytes", Buddy->DecodeInputExpected);
+		}
 
-				if (Packet == BUDDY_PACKET_VIDEO)
-				{
-					if (Buddy->DecodeInputExpected == 0)
-					{
-						Assert(RecvSize >= sizeof(Buddy->DecodeInputExpected));
-						CopyMemory(&Buddy->DecodeInputExpected, RecvData, sizeof(Buddy->DecodeInputExpected));
+		Assert(Buddy->DecodeInputBuffer);
+
+		BYTE* BufferData;
+		DWORD BufferMaxLength;
+		DWORD BufferLength;
+		HR(IMFMediaBuffer_Lock(Buddy->DecodeInputBuffer, &BufferData, &BufferMaxLength, &BufferLength));
+		{
+			Assert(BufferLength + RecvSize <= BufferMaxLength);
+			CopyMemory(BufferData + BufferLength, RecvData, RecvSize);
+		}
+		HR(IMFMediaBuffer_Unlock(Buddy->DecodeInputBuffer));
+
+		BufferLength += RecvSize;
+		HR(IMFMediaBuffer_SetCurrentLength(Buddy->DecodeInputBuffer, BufferLength));
+
+		if (BufferLength == Buddy->DecodeInputExpected)
+		{
+			Buddy_PresentFrame(Buddy);
+		}
+	}
+}
+
+static bool Buddy_DecodeStopping(ScreenBuddy* Buddy)
+{
+	BuddyMutex_Lock(&Buddy->DecodeLock);
+	bool Stopping = Buddy->DecodeStopping;
+	BuddyMutex_Unlock(&Buddy->DecodeLock);
+	return Stopping;
+}
+
+static void Buddy_DecodeMain(void* Arg)
+{
+	ScreenBuddy* Buddy = Arg;
+	uint8_t* Buffer = malloc(NET_THREAD_MAX_PACKET);
+	Assert(Buffer);
+
+	for (;;)
+	{
+		BuddyMutex_Lock(&Buddy->DecodeLock);
+		while (!Buddy->DecodeReady && !Buddy->DecodeStopping)
+		{
+			BuddyCond_Wait(&Buddy->DecodeWake, &Buddy->DecodeLock);
+		}
+		bool Stopping = Buddy->DecodeStopping;
+		Buddy->DecodeReady = false;
+		BuddyMutex_Unlock(&Buddy->DecodeLock);
+		if (Stopping)
+		{
+			break;
+		}
+
+		NetThread_TakeWorkerReady(&Buddy->NetThread);
+		NetPacket Packet;
+		while (!Buddy_DecodeStopping(Buddy) && NetThread_Pop(&Buddy->NetThread, NET_CHANNEL_VIDEO, &Packet, Buffer))
+		{
+			Buddy_VideoPacket(Buddy, &Packet);
+		}
+	}
+	free(Buffer);
+}
+
+// Right after the network thread started. What was left of a frame went with the last connection.
+static void Buddy_StartDecodeThread(ScreenBuddy* Buddy)
+{
+	Buddy_CutFrame(Buddy);
+
+	// packets queued before the thread started are taken in its first pass
+	BuddyMutex_Lock(&Buddy->DecodeLock);
+	Buddy->DecodeReady = true;
+	Buddy->DecodeStopping = false;
+	BuddyMutex_Unlock(&Buddy->DecodeLock);
+
+	BOOL Started = BuddyThread_Start(&Buddy->DecodeThread, &Buddy_DecodeMain, Buddy);
+	Assert(Started);
+	Buddy->DecodeRunning = true;
+}
+
+static void Buddy_StopDecodeThread(ScreenBuddy* Buddy)
+{
+	if (!Buddy->DecodeRunning)
+	{
+		return;
+	}
+	BuddyMutex_Lock(&Buddy->DecodeLock);
+	Buddy->DecodeStopping = true;
+	BuddyCond_Signal(&Buddy->DecodeWake);
+	BuddyMutex_Unlock(&Buddy->DecodeLock);
 
-						RecvData += sizeof(Buddy->DecodeInputExpected);
-						RecvSize -= sizeof(Buddy->DecodeInputExpected);
+	BuddyThread_Join(Buddy->DecodeThread);
+	Buddy->DecodeRunning = false;
+}
 
-						Assert(Buddy->DecodeInputBuffer == NULL);
-						HR(MFCreateMemoryBuffer(Buddy->DecodeInputExpected, &Buddy->DecodeInputBuffer));
-						LOG_INFO("Client: Starting to receive video frame, expected size: %u bytes", Buddy->DecodeInputExpected);
-					}
+// Handles one packet taken from the network thread's channels. Returns false once the
+// connection was closed or changed state, the rest of the batch is not for this session then.
+static bool Buddy_ReceivePacket(ScreenBuddy* Buddy, DerpKey RecvKey, uint8_t* RecvData, uint32_t RecvSize)
+{
+	if (RecvSize == 2 && RecvData[0] == BUDDY_PACKET_RESUME && Buddy->Resume.state != SESSION_RESUME_OFF &&
+		(Buddy->State != BUDDY_STATE_SHARING || RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey))))
+	{
+		// other viewers of a sharer resume in Buddy_ViewerPacket
+		Buddy_ResumePacket(Buddy, RecvKey, RecvData[1]);
+		return !Buddy_Reconnecting(Buddy);
+	}
 
-					Assert(Buddy->DecodeInputBuffer);
+	if (Buddy->State == BUDDY_STATE_CONNECTING || Buddy->State == BUDDY_STATE_CONNECTED)
+	{
+		if (Buddy->State == BUDDY_STATE_CONNECTING)
+		{
+			LOG_INFO("========================================");
+			LOG_INFO("CONNECTION ESTABLISHED!");
+			LOG_INFO("========================================");
+			LOG_NET("First data received - connection successful!");
+			KillTimer(Buddy->MainWindow, BUDDY_DISCONNECT_TIMER);
+			Buddy_UpdateState(Buddy, BUDDY_STATE_CONNECTED);
+			Buddy_StartTelemetry(Buddy);
+			Buddy_StartResume(Buddy);
+			DragAcceptFiles(Buddy->MainWindow, TRUE);
+			InputBatch_Init(&Buddy->Input);
+			
+			// Hide cursor for remote control
+			if (!Buddy->CursorHidden)
+			{
+				ShowCursor(FALSE);
+				Buddy->CursorHidden = true;
+			}
+		}
 
-					BYTE* BufferData;
-					DWORD BufferMaxLength;
-					DWORD BufferLength;
-					HR(IMFMediaBuffer_Lock(Buddy->DecodeInputBuffer, &BufferData, &BufferMaxLength, &BufferLength));
-					{
-						Assert(BufferLength + RecvSize <= BufferMaxLength);
-						CopyMemory(BufferData + BufferLength, RecvData, RecvSize);
-					}
-					HR(IMFMediaBuffer_Unlock(Buddy->DecodeInputBuffer));
+		if (RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey)))
+		{
+			Assert(RecvSize >= 1);
 
-					BufferLength += RecvSize;
-					HR(IMFMediaBuffer_SetCurrentLength(Buddy->DecodeInputBuffer, BufferLength));
+			uint8_t Packet = RecvData[0];
+			RecvData += 1;
+			RecvSize -= 1;
 
-					if (BufferLength == Buddy->DecodeInputExpected)
-					{
-						LOG_INFO("Client: Complete video frame received (%u bytes), starting decode", Buddy->DecodeInputExpected);
-						Buddy_Decode(Buddy, Buddy->DecodeInputBuffer);
+			if (Packet == BUDDY_PACKET_VIDEO_CONFIG)
+			{
+				// Receive video configuration from server, the decode thread reads it on a stream change
+				Assert(RecvSize >= sizeof(BuddyVideoConfig));
+				NetThread_Lock(&Buddy->NetThread);
+				CopyMemory(&Buddy->VideoConfig, RecvData, sizeof(BuddyVideoConfig));
+				Buddy->VideoConfigReceived = true;
+				NetThread_Unlock(&Buddy->NetThread);
+				LOG_INFO("Received video configuration: YUV Matrix=%d, Range=%d, Primaries=%d, Transfer=%d",
+					Buddy->VideoConfig.yuv_matrix, Buddy->VideoConfig.nominal_range,
+					Buddy->VideoConfig.primaries, Buddy->VideoConfig.transfer_function);
+				
+				RecvData += sizeof(BuddyVideoConfig);
+				RecvSize -= sizeof(BuddyVideoConfig);
+				
+				// If there's more data in this packet, continue processing
+				if (RecvSize == 0) return true;
+				
+				// Get next packet type
+				Packet = RecvData[0];
+				RecvData += 1;
+				RecvSize -= 1;
+			}
 
-						IMFMediaBuffer_Release(Buddy->DecodeInputBuffer);
-						Buddy->DecodeInputBuffer = NULL;
-						Buddy->DecodeInputExpected = 0;
-					}
-				}
-				else if (Packet == BUDDY_PACKET_KEYBOARD)
-				{
-					// Keyboard input handled on connect side, ignore on viewing side
-				}
-				else if (Packet == BUDDY_PACKET_DISCONNECT)
-				{
-					Buddy_Disconnect(Buddy, L"Remote computer stopped sharing!");
-					break;
-				}
-				else if (Packet == BUDDY_PACKET_FILE_ACCEPT)
+			if (Packet == BUDDY_PACKET_DIRECT_OFFER)
+			{
+				Buddy_ConnectDirect(Buddy, RecvData, RecvSize);
+			}
+			else if (Packet == BUDDY_PACKET_UDP_CANDIDATES)
+			{
+				Buddy_UdpCandidates(Buddy, RecvData, RecvSize);
+			}
+			else if (Packet == BUDDY_PACKET_KEYBOARD)
+			{
+				// Keyboard input handled on connect side, ignore on viewing side
+			}
+			else if (Packet == BUDDY_PACKET_DISCONNECT)
+			{
+				Buddy_Disconnect(Buddy, L"Remote computer stopped sharing!");
+				return false;
+			}
+			else if (Packet == BUDDY_PACKET_FILE_ACCEPT)
+			{
+				if (Buddy->ProgressWindow)
 				{
-					if (Buddy->ProgressWindow)
-					{
-						SendMessageW(Buddy->ProgressWindow, TDM_SET_MARQUEE_PROGRESS_BAR, FALSE, 0);
-						SendMessageW(Buddy->ProgressWindow, TDM_SET_PROGRESS_BAR_POS, 0, 0);
-						SetTimer(Buddy->MainWindow, BUDDY_FILE_TIMER, 50, NULL);
-					}
+					SendMessageW(Buddy->ProgressWindow, TDM_SET_MARQUEE_PROGRESS_BAR, FALSE, 0);
+					SendMessageW(Buddy->ProgressWindow, TDM_SET_PROGRESS_BAR_POS, 0, 0);
+					SetTimer(Buddy->MainWindow, BUDDY_FILE_TIMER, 50, NULL);
 				}
-				else if (Packet == BUDDY_PACKET_FILE_REJECT)
+			}
+			else if (Packet == BUDDY_PACKET_FILE_REJECT)
+			{
+				if (Buddy->ProgressWindow)
 				{
-					if (Buddy->ProgressWindow)
-					{
-						SendMessageW(Buddy->ProgressWindow, TDM_CLICK_BUTTON, IDCANCEL, 0);
-					}
+					SendMessageW(Buddy->ProgressWindow, TDM_CLICK_BUTTON, IDCANCEL, 0);
 				}
 			}
 		}
-		else if (Buddy->State == BUDDY_STATE_SHARE_STARTED)
+	}
+	else if (Buddy->State == BUDDY_STATE_SHARE_STARTED)
+	{
+		LOG_DEBUG("In SHARE_STARTED state, RecvSize=%u", RecvSize);
+		if (RecvSize == 0)
 		{
-			LOG_DEBUG("In SHARE_STARTED state, RecvSize=%u", RecvSize);
-			if (RecvSize == 0)
+			LOG_INFO("========================================");
+			LOG_INFO("INCOMING CONNECTION REQUEST!");
+			LOG_INFO("========================================");
+			LOG_HEX("Viewer Public Key", &RecvKey, sizeof(RecvKey));
+
+			if (!Buddy_ConfirmViewer(Buddy, &RecvKey))
 			{
-				LOG_INFO("========================================");
-				LOG_INFO("INCOMING CONNECTION REQUEST!");
-				LOG_INFO("========================================");
-				LOG_HEX("Viewer Public Key", &RecvKey, sizeof(RecvKey));
+				LOG_WARN("User rejected incoming connection");
+				// Send disconnect packet to reject
+				uint8_t Data[1] = { BUDDY_PACKET_DISCONNECT };
+				NetThread_Lock(&Buddy->NetThread);
+				DerpNet_Send(&Buddy->Net, &RecvKey, Data, sizeof(Data));
+				NetThread_Unlock(&Buddy->NetThread);
 				
-				// Convert public key to hex for display
-				wchar_t keyHex[256];
-				wchar_t* p = keyHex;
-				for (int i = 0; i < 8; i++) {  // Show first 8 bytes (16 hex chars)
-					p += swprintf_s(p, 4, L"%02X", RecvKey.Bytes[i]);
-					if (i == 3) *p++ = L'-';  // Add separator after 4 bytes
-				}
-				*p++ = L'.';
-				*p++ = L'.';
-				*p++ = L'.';
-				*p = L'\0';
-				
-				// Security confirmation dialog
-				wchar_t confirmMsg[512];
-				swprintf_s(confirmMsg, 512,
-					L"Someone is trying to connect to your screen!\n\n"
-					L"Connection Key: %ls\n\n"
-					L"Do you want to allow this connection?\n\n"
-					L"Click YES to allow, NO to reject.",
-					keyHex);
-				
-				int response = MessageBoxW(Buddy->DialogWindow, confirmMsg, 
-					L"Incoming Connection", MB_YESNO | MB_ICONQUESTION | MB_TOPMOST);
-				
-				if (response != IDYES)
-				{
-					LOG_WARN("User rejected incoming connection");
-					// Send disconnect packet to reject
-					uint8_t Data[1] = { BUDDY_PACKET_DISCONNECT };
-					DerpNet_Send(&Buddy->Net, &RecvKey, Data, sizeof(Data));
-					
-					Buddy_CancelWait(Buddy);
-					DerpNet_Close(&Buddy->Net);
-					Buddy_StopSharing(Buddy);
-					
-					// Stop timeout timer
-					KillTimer(Buddy->DialogWindow, BUDDY_SHARE_TIMEOUT_TIMER);
-					Buddy->ShareTimeoutActive = false;
-					
-					Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
-					break;
-				}
+				Buddy_CancelWait(Buddy);
+				Buddy_CloseNet(Buddy);
+				Buddy_StopSharing(Buddy);
 				
-				LOG_INFO("User accepted connection - starting screen share");
-				Buddy->RemoteKey = RecvKey;
-
-				// Send video configuration to the newly connected viewer
-				uint8_t ConfigPacket[1 + sizeof(BuddyVideoConfig)];
-				ConfigPacket[0] = BUDDY_PACKET_VIDEO_CONFIG;
-				CopyMemory(&ConfigPacket[1], &Buddy->VideoConfig, sizeof(BuddyVideoConfig));
-				if (!DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, ConfigPacket, sizeof(ConfigPacket)))
-				{
-					LOG_ERROR("Failed to send video configuration to viewer");
-					Buddy_CancelWait(Buddy);
-					DerpNet_Close(&Buddy->Net);
-					Buddy_StopSharing(Buddy);
-					Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
-					break;
-				}
-				LOG_INFO("Sent video configuration to viewer: YUV Matrix=%d, Range=%d, Primaries=%d, Transfer=%d",
-					Buddy->VideoConfig.yuv_matrix, Buddy->VideoConfig.nominal_range,
-					Buddy->VideoConfig.primaries, Buddy->VideoConfig.transfer_function);
-
-				// Stop timeout timer - connection accepted
+				// Stop timeout timer
 				KillTimer(Buddy->DialogWindow, BUDDY_SHARE_TIMEOUT_TIMER);
 				Buddy->ShareTimeoutActive = false;
-				SetDlgItemTextW(Buddy->DialogWindow, BUDDY_ID_SHARE_STATUS, L"Connected!");
+				
+				Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
+				return false;
+			}
+			
+			LOG_INFO("User accepted connection - starting screen share");
+			Buddy->RemoteKey = RecvKey;
+			Fanout_Init(&Buddy->Viewers, NULL);
+
+			// Send video configuration to the newly connected viewer
+			uint8_t ConfigPacket[1 + sizeof(BuddyVideoConfig)];
+			ConfigPacket[0] = BUDDY_PACKET_VIDEO_CONFIG;
+			CopyMemory(&ConfigPacket[1], &Buddy->VideoConfig, sizeof(BuddyVideoConfig));
+			if (!Buddy_Send(Buddy, ConfigPacket, sizeof(ConfigPacket)))
+			{
+				LOG_ERROR("Failed to send video configuration to viewer");
+				Buddy_CancelWait(Buddy);
+				Buddy_CloseNet(Buddy);
+				Buddy_StopSharing(Buddy);
+				Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
+				return false;
+			}
+			LOG_INFO("Sent video configuration to viewer: YUV Matrix=%d, Range=%d, Primaries=%d, Transfer=%d",
+				Buddy->VideoConfig.yuv_matrix, Buddy->VideoConfig.nominal_range,
+				Buddy->VideoConfig.primaries, Buddy->VideoConfig.transfer_function);
+
+			// on the same LAN the session moves past the relay once the viewer proved its key,
+			// elsewhere the video may still find a UDP path
+			Buddy_OfferDirect(Buddy);
+			Buddy_OfferUdp(Buddy);
+
+			// Stop timeout timer - connection accepted
+			KillTimer(Buddy->DialogWindow, BUDDY_SHARE_TIMEOUT_TIMER);
+			Buddy->ShareTimeoutActive = false;
+			SetDlgItemTextW(Buddy->DialogWindow, BUDDY_ID_SHARE_STATUS, L"Connected!");
+
+			Buddy_StartRecording(Buddy);
+			Latency_Reset(&Buddy->Latency);
+			Buddy_StartPacing(Buddy);
+			Buddy_StartTelemetry(Buddy);
+			Buddy_StartResume(Buddy);
+
+			LOG_INFO("Starting screen capture...");
+			ScreenCapture_Start(&Buddy->Capture, true, true);
+			Buddy_NextMediaEvent(Buddy);
 
-				LOG_INFO("Starting screen capture...");
-				ScreenCapture_Start(&Buddy->Capture, true, true);
-				Buddy_NextMediaEvent(Buddy);
+			// Enable file transfer from sharing side
+			DragAcceptFiles(Buddy->DialogWindow, TRUE);
 
-				// Enable file transfer from sharing side
-				DragAcceptFiles(Buddy->DialogWindow, TRUE);
+			// Start frame capture timer (30fps = ~33ms)
+			SetTimer(Buddy->DialogWindow, BUDDY_FRAME_TIMER, 33, NULL);
+			LOG_INFO("Frame capture timer started (33ms intervals)");
+
+			Buddy_UpdateState(Buddy, BUDDY_STATE_SHARING);
+			LOG_INFO("State updated to SHARING - Now streaming video!");
+		}
+		else
+		{
+			Buddy_Disconnect(Buddy, L"Received unexpected initial packet!");
+			return false;
+		}
+	}
+	else if (Buddy->State == BUDDY_STATE_SHARING)
+	{
+		if (RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey)))
+		{
+			Assert(RecvSize >= 1);
 
-				// Start frame capture timer (30fps = ~33ms)
-				SetTimer(Buddy->DialogWindow, BUDDY_FRAME_TIMER, 33, NULL);
-				LOG_INFO("Frame capture timer started (33ms intervals)");
+			uint8_t Packet = RecvData[0];
+			RecvData += 1;
+			RecvSize -= 1;
 
-				Buddy_UpdateState(Buddy, BUDDY_STATE_SHARING);
-				LOG_INFO("State updated to SHARING - Now streaming video!");
+			if (Packet == BUDDY_PACKET_DISCONNECT)
+			{
+				Buddy_CancelWait(Buddy);
+				Buddy_CloseNet(Buddy);
+				Buddy_StopSharing(Buddy);
+				Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
+				return false;
 			}
-			else
+			else if (Packet == BUDDY_PACKET_INPUT_BATCH)
 			{
-				Buddy_Disconnect(Buddy, L"Received unexpected initial packet!");
-				break;
+				InputEvent Events[INPUT_BATCH_MAX_EVENTS];
+				int Count = InputBatch_Decode(RecvData, RecvSize, Events, ARRAYSIZE(Events));
+				if (Count > 0)
+				{
+					Buddy_InjectInput(Buddy, Events, (uint32_t)Count);
+				}
+				else
+				{
+					LOG_WARN("Ignoring malformed input batch (%u bytes)", RecvSize);
+				}
 			}
-		}
-		else if (Buddy->State == BUDDY_STATE_SHARING)
-		{
-			if (RtlEqualMemory(&RecvKey, &Buddy->RemoteKey, sizeof(RecvKey)))
+			else if (Packet == BUDDY_PACKET_MOUSE_MOVE || Packet == BUDDY_PACKET_MOUSE_BUTTON || Packet == BUDDY_PACKET_MOUSE_WHEEL)
 			{
-				Assert(RecvSize >= 1);
-
-				uint8_t Packet = RecvData[0];
-				RecvData += 1;
-				RecvSize -= 1;
+				// single events from viewers that do not batch yet
+				Buddy_MousePacket Data;
+				if (1 + RecvSize == sizeof(Data))
+				{
+					CopyMemory(&Data.Packet + 1, RecvData, RecvSize);
 
-				if (Packet == BUDDY_PACKET_DISCONNECT)
+					InputEvent Event =
+					{
+						.type = Packet == BUDDY_PACKET_MOUSE_MOVE ? INPUT_EVENT_MOVE : Packet == BUDDY_PACKET_MOUSE_BUTTON ? INPUT_EVENT_BUTTON : INPUT_EVENT_WHEEL,
+						.x = Data.X,
+						.y = Data.Y,
+						.button = Data.Button,
+						.delta = Data.Button,
+						.down = (uint8_t)Data.IsDownOrHorizontalWheel,
+					};
+					Buddy_InjectInput(Buddy, &Event, 1);
+				}
+			}
+			else if (Packet == BUDDY_PACKET_DIRECT_SWITCH)
+			{
+				Buddy_DirectSwitch(Buddy, RecvData, RecvSize);
+			}
+			else if (Packet == BUDDY_PACKET_UDP_CANDIDATES)
+			{
+				Buddy_UdpCandidates(Buddy, RecvData, RecvSize);
+			}
+			else if (Packet == BUDDY_PACKET_TIMING_ECHO)
+			{
+				if (RecvSize == LATENCY_ECHO_SIZE)
 				{
-					DerpNet_Close(&Buddy->Net);
-					Buddy_StopSharing(Buddy);
-					Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
-					break;
+					LatencyEcho Echo;
+					Latency_UnpackEcho(RecvData, &Echo);
+					Latency_SharerOnEcho(&Buddy->Latency, &Echo, BuddyClock_NowUs());
 				}
-				else if (Packet == BUDDY_PACKET_MOUSE_MOVE || Packet == BUDDY_PACKET_MOUSE_BUTTON || Packet == BUDDY_PACKET_MOUSE_WHEEL)
+			}
+			else if (Packet == BUDDY_PACKET_FILE)
+			{
+				// File transfer - receiving a file
+				wchar_t FileName[BUDDY_FILENAME_MAX];
+
+				if (Buddy->ProgressWindow == NULL)
 				{
-					Buddy_MousePacket Data;
-					if (1 + RecvSize == sizeof(Data))
+					if (RecvSize <= 8)
 					{
-						CopyMemory(&Data.Packet + 1, RecvData, RecvSize);
-
-						MONITORINFO MonitorInfo =
-						{
-							.cbSize = sizeof(MonitorInfo),
-						};
-						BOOL MonitorOk = GetMonitorInfoW(Buddy->Capture.Monitor, &MonitorInfo);
-						Assert(MonitorOk);
-
-						MONITORINFO PrimaryMonitorInfo =
-						{
-							.cbSize = sizeof(PrimaryMonitorInfo),
-						};
-						BOOL PrimaryOk = GetMonitorInfoW(MonitorFromWindow(NULL, MONITOR_DEFAULTTOPRIMARY), &PrimaryMonitorInfo);
-						Assert(PrimaryOk);
+						return true;
+					}
 
-						const RECT* R = &MonitorInfo.rcMonitor;
-						const RECT* Primary = &PrimaryMonitorInfo.rcMonitor;
+					uint64_t FileSize;
+					CopyMemory(&FileSize, RecvData, sizeof(FileSize));
 
-						INPUT Input =
-						{
-							.type = INPUT_MOUSE,
-							.mi.dx = (Data.X + R->left) * 65535 / (Primary->right - Primary->left),
-							.mi.dy = (Data.Y + R->top) * 65535 / (Primary->bottom - Primary->top),
-							.mi.dwFlags = MOUSEEVENTF_ABSOLUTE,
-						};
+					int FileNameLen = MultiByteToWideChar(CP_UTF8, 0, RecvData + 8, RecvSize - sizeof(FileSize), FileName, ARRAYSIZE(FileName));
+					FileName[FileNameLen] = 0;
 
-						if (Packet == BUDDY_PACKET_MOUSE_MOVE)
-						{
-							Input.mi.dwFlags |= MOUSEEVENTF_MOVE;
-							SendInput(1, &Input, sizeof(Input));
-						}
-						else if (Packet == BUDDY_PACKET_MOUSE_BUTTON)
+					OPENFILENAMEW Dialog =
+					{
+						.lStructSize = sizeof(Dialog),
+						.hwndOwner = Buddy->DialogWindow,
+						.lpstrFile = FileName,
+						.nMaxFile = ARRAYSIZE(FileName),
+						.Flags = OFN_ENABLESIZING | OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST,
+					};
+
+					if (GetSaveFileNameW(&Dialog))
+					{
+						HANDLE FileHandle = CreateFileW(FileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+						if (FileHandle == INVALID_HANDLE_VALUE)
 						{
-							switch (Data.Button)
-							{
-							case 0: Input.mi.dwFlags |= Data.IsDownOrHorizontalWheel ? MOUSEEVENTF_LEFTDOWN : MOUSEEVENTF_LEFTUP; break;
-							case 1: Input.mi.dwFlags |= Data.IsDownOrHorizontalWheel ? MOUSEEVENTF_RIGHTDOWN : MOUSEEVENTF_RIGHTUP; break;
-							case 2: Input.mi.dwFlags |= Data.IsDownOrHorizontalWheel ? MOUSEEVENTF_MIDDLEDOWN : MOUSEEVENTF_MIDDLEUP; break;
-							case 3: Input.mi.dwFlags |= Data.IsDownOrHorizontalWheel ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP; Input.mi.mouseData = XBUTTON1; break;
-							case 4: Input.mi.dwFlags |= Data.IsDownOrHorizontalWheel ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP; Input.mi.mouseData = XBUTTON2; break;
-							}
-							SendInput(1, &Input, sizeof(Input));
+							MessageBoxW(Buddy->DialogWindow, L"Cannot create file!", BUDDY_TITLE, MB_ICONERROR);
 						}
-						else if (Packet == BUDDY_PACKET_MOUSE_WHEEL)
+						else
 						{
-							Input.mi.mouseData = Data.Button;
-							Input.mi.dwFlags |= (Data.IsDownOrHorizontalWheel ? MOUSEEVENTF_HWHEEL : MOUSEEVENTF_WHEEL);
-							SendInput(1, &Input, sizeof(Input));
+							Buddy->FileHandle = FileHandle;
+							Buddy->FileSize = FileSize;
 						}
 					}
 				}
-				else if (Packet == BUDDY_PACKET_FILE)
-				{
-					// File transfer - receiving a file
-					wchar_t FileName[BUDDY_FILENAME_MAX];
 
-					if (Buddy->ProgressWindow == NULL)
-					{
-						if (RecvSize <= 8)
-						{
-							break;
-						}
+				if (Buddy->FileHandle)
+				{
+					SHFILEINFOW FileInfo;
+					DWORD_PTR IconOk = SHGetFileInfoW(FileName, 0, &FileInfo, sizeof(FileInfo), SHGFI_ICON | SHGFI_USEFILEATTRIBUTES);
 
-						uint64_t FileSize;
-						CopyMemory(&FileSize, RecvData, sizeof(FileSize));
+					PathStripPathW(FileName);
 
-						int FileNameLen = MultiByteToWideChar(CP_UTF8, 0, RecvData + 8, RecvSize - sizeof(FileSize), FileName, ARRAYSIZE(FileName));
-						FileName[FileNameLen] = 0;
+					Buddy->FileProgress = 0;
+					Buddy->FileLastTime = 0;
+					Buddy->FileLastSize = 0;
 
-						OPENFILENAMEW Dialog =
-						{
-							.lStructSize = sizeof(Dialog),
-							.hwndOwner = Buddy->DialogWindow,
-							.lpstrFile = FileName,
-							.nMaxFile = ARRAYSIZE(FileName),
-							.Flags = OFN_ENABLESIZING | OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST,
-						};
+					uint8_t Data[1] = { BUDDY_PACKET_FILE_ACCEPT };
+					Buddy_SendUrgent(Buddy, Data, sizeof(Data));
 
-						if (GetSaveFileNameW(&Dialog))
-						{
-							HANDLE FileHandle = CreateFileW(FileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-							if (FileHandle == INVALID_HANDLE_VALUE)
-							{
-								MessageBoxW(Buddy->DialogWindow, L"Cannot create file!", BUDDY_TITLE, MB_ICONERROR);
-							}
-							else
-							{
-								Buddy->FileHandle = FileHandle;
-								Buddy->FileSize = FileSize;
-							}
-						}
+					TASKDIALOGCONFIG Config =
+					{
+						.cbSize = sizeof(Config),
+						.hwndParent = Buddy->DialogWindow,
+						.dwFlags = TDF_USE_HICON_MAIN | TDF_ALLOW_DIALOG_CANCELLATION | TDF_SHOW_MARQUEE_PROGRESS_BAR | TDF_CAN_BE_MINIMIZED | TDF_SIZE_TO_CONTENT,
+						.dwCommonButtons = TDCBF_CANCEL_BUTTON,
+						.pszWindowTitle = BUDDY_TITLE,
+						.hMainIcon = IconOk ? FileInfo.hIcon : Buddy->Icon,
+						.pszMainInstruction = FileName,
+						.pszContent = L"Receiving file...",
+						.nDefaultButton = IDCANCEL,
+						.pfCallback = &Buddy_TaskCallback,
+						.lpCallbackData = (LONG_PTR)Buddy,
+					};
+
+					SetTimer(Buddy->DialogWindow, BUDDY_FILE_TIMER, 50, NULL);
+					TaskDialogIndirect(&Config, NULL, NULL, NULL);
+					Buddy->ProgressWindow = NULL;
+
+					if (IconOk)
+					{
+						DestroyIcon(FileInfo.hIcon);
 					}
 
 					if (Buddy->FileHandle)
 					{
-						SHFILEINFOW FileInfo;
-						DWORD_PTR IconOk = SHGetFileInfoW(FileName, 0, &FileInfo, sizeof(FileInfo), SHGFI_ICON | SHGFI_USEFILEATTRIBUTES);
-
-						PathStripPathW(FileName);
+						CloseHandle(Buddy->FileHandle);
+						Buddy->FileHandle = NULL;
 
-						Buddy->FileProgress = 0;
-						Buddy->FileLastTime = 0;
-						Buddy->FileLastSize = 0;
+						DeleteFileW(FileName);
+					}
+				}
+				else
+				{
+					uint8_t Data[1] = { BUDDY_PACKET_FILE_REJECT };
+					Buddy_SendUrgent(Buddy, Data, sizeof(Data));
+				}
+			}
+			else if (Packet == BUDDY_PACKET_FILE_DATA)
+			{
+				if (Buddy->ProgressWindow)
+				{
+					DWORD Written = 0;
+					WriteFile(Buddy->FileHandle, RecvData, RecvSize, &Written, NULL);
 
-						uint8_t Data[1] = { BUDDY_PACKET_FILE_ACCEPT };
-						Buddy_Send(Buddy, Data, sizeof(Data));
+					Buddy->FileProgress += Written;
+					if (Buddy->FileProgress == Buddy->FileSize)
+					{
+						KillTimer(Buddy->DialogWindow, BUDDY_FILE_TIMER);
 
-						TASKDIALOGCONFIG Config =
-						{
-							.cbSize = sizeof(Config),
-							.hwndParent = Buddy->DialogWindow,
-							.dwFlags = TDF_USE_HICON_MAIN | TDF_ALLOW_DIALOG_CANCELLATION | TDF_SHOW_MARQUEE_PROGRESS_BAR | TDF_CAN_BE_MINIMIZED | TDF_SIZE_TO_CONTENT,
-							.dwCommonButtons = TDCBF_CANCEL_BUTTON,
-							.pszWindowTitle = BUDDY_TITLE,
-							.hMainIcon = IconOk ? FileInfo.hIcon : Buddy->Icon,
-							.pszMainInstruction = FileName,
-							.pszContent = L"Receiving file...",
-							.nDefaultButton = IDCANCEL,
-							.pfCallback = &Buddy_TaskCallback,
-							.lpCallbackData = (LONG_PTR)Buddy,
-						};
+						CloseHandle(Buddy->FileHandle);
+						Buddy->FileHandle = NULL;
 
-						Buddy_NextWait(Buddy);
-						SetTimer(Buddy->DialogWindow, BUDDY_FILE_TIMER, 50, NULL);
-						TaskDialogIndirect(&Config, NULL, NULL, NULL);
+						SendMessageW(Buddy->ProgressWindow, TDM_CLICK_BUTTON, IDCANCEL, 0);
 						Buddy->ProgressWindow = NULL;
+					}
+				}
+			}
+		}
+		else if (RecvSize == 0)
+		{
+			return Buddy_AddViewer(Buddy, RecvKey);
+		}
+		else
+		{
+			Buddy_ViewerPacket(Buddy, RecvKey, RecvData, RecvSize);
+		}
+	}
+	return true;
+}
 
-						if (IconOk)
-						{
-							DestroyIcon(FileInfo.hIcon);
-						}
+static void Buddy_NetworkEvent(ScreenBuddy* Buddy)
+{
+	static DWORD s_LastNetLogTime = 0;
+	static size_t s_BytesRecvSinceLog = 0;
+	static int s_PacketsRecvSinceLog = 0;
 
-						if (Buddy->FileHandle)
-						{
-							CloseHandle(Buddy->FileHandle);
-							Buddy->FileHandle = NULL;
+	// control first, input before video so clicks do not wait behind a keyframe; a viewer's
+	// video is taken by the decode thread
+	static const NetChannel Order[] = { NET_CHANNEL_CONTROL, NET_CHANNEL_INPUT, NET_CHANNEL_FILE, NET_CHANNEL_VIDEO };
 
-							DeleteFileW(FileName);
-						}
-					}
-					else
-					{
-						uint8_t Data[1] = { BUDDY_PACKET_FILE_REJECT };
-						DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, sizeof(Data));
-					}
-				}
-				else if (Packet == BUDDY_PACKET_FILE_DATA)
-				{
-					if (Buddy->ProgressWindow)
-					{
-						DWORD Written = 0;
-						WriteFile(Buddy->FileHandle, RecvData, RecvSize, &Written, NULL);
+	LOG_DEBUG("NetworkEvent triggered, State=%d, TotalSent=%zu, TotalRecv=%zu", 
+		Buddy->State, Buddy->Net.TotalSent, Buddy->Net.TotalReceived);
 
-						Buddy->FileProgress += Written;
-						if (Buddy->FileProgress == Buddy->FileSize)
-						{
-							KillTimer(Buddy->DialogWindow, BUDDY_FILE_TIMER);
+	uint32_t Ready = NetThread_TakeReady(&Buddy->NetThread);
 
-							CloseHandle(Buddy->FileHandle);
-							Buddy->FileHandle = NULL;
+	// own buffer per call, a modal dialog inside a handler dispatches the next BUDDY_WM_NET_EVENT
+	uint8_t* Buffer = Ready ? malloc(NET_THREAD_MAX_PACKET) : NULL;
+	bool Active = true;
 
-							SendMessageW(Buddy->ProgressWindow, TDM_CLICK_BUTTON, IDCANCEL, 0);
-							Buddy->ProgressWindow = NULL;
-						}
-					}
-				}
-			}
+	for (size_t i = 0; Active && Buffer && i < ARRAYSIZE(Order); i++)
+	{
+		if (!(Ready & (1u << Order[i])))
+		{
+			continue;
+		}
+		NetPacket Packet;
+		while (Active && Buddy->State != BUDDY_STATE_DISCONNECTED && NetThread_Pop(&Buddy->NetThread, Order[i], &Packet, Buffer))
+		{
+			s_BytesRecvSinceLog += Packet.size;
+			s_PacketsRecvSinceLog++;
+			LOG_NET("RECV: %u bytes, State=%d, Packet#%d", Packet.size, Buddy->State, s_PacketsRecvSinceLog);
+
+			DerpKey RecvKey;
+			CopyMemory(RecvKey.Bytes, Packet.peer, sizeof(RecvKey.Bytes));
+			Active = Buddy_ReceivePacket(Buddy, RecvKey, Buffer, Packet.size);
+		}
+	}
+	free(Buffer);
+
+	if (Active && Buddy->State != BUDDY_STATE_DISCONNECTED && NetThread_IsDisconnected(&Buddy->NetThread))
+	{
+		size_t totalSent = Buddy_TotalSent(Buddy);
+		size_t totalRecv = Buddy_TotalReceived(Buddy);
+		LOG_ERROR("Network disconnected (sent=%zu, recv=%zu)", totalSent, totalRecv);
+		Buddy_LinkLost(Buddy, L"DERP server disconnected!");
+		return;
+	}
+
+	NetThread_Lock(&Buddy->NetThread);
+	bool PeerGone = Buddy->PeerGone;
+	Buddy->PeerGone = false;
+	NetThread_Unlock(&Buddy->NetThread);
+	if (PeerGone && SessionResume_OnPeerGone(&Buddy->Resume, Buddy->RemoteKey.Bytes, BuddyClock_NowUs()))
+	{
+		// the peer reconnects on its own, HELLO tells it this side is still here
+		LOG_WARN("Peer lost its DERP connection, waiting %u s for it to come back", Buddy->Resume.config.grace_ms / 1000);
+		SetTimer(Buddy->DialogWindow, BUDDY_RESUME_TIMER, BUDDY_RESUME_TIMER_MS, NULL);
+		if (Buddy->State == BUDDY_STATE_SHARING)
+		{
+			SetDlgItemTextW(Buddy->DialogWindow, BUDDY_ID_SHARE_STATUS, L"Viewer connection lost, waiting...");
 		}
 	}
+
+	// Only log every 5 seconds to avoid spam
+	DWORD Now = GetTickCount();
+	if (Now - s_LastNetLogTime >= 5000)
+	{
+		LOG_DEBUG("Network: %d packets, %zu bytes in last 5 sec (Total: sent=%zu, recv=%zu)",
+			s_PacketsRecvSinceLog, s_BytesRecvSinceLog, Buddy_TotalSent(Buddy), Buddy_TotalReceived(Buddy));
+		s_BytesRecvSinceLog = 0;
+		s_PacketsRecvSinceLog = 0;
+		s_LastNetLogTime = Now;
+	}
 }
 
 //
@@ -4391,9 +6751,19 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 
 			SetFocus(GetDlgItem(Dialog, BUDDY_ID_SHARE_COPY));
 
+			// a recent latency table answers right away, the probe then only refreshes it for next time
+			uint32_t TableRegion = Buddy_LoadBestDerpRegion(Buddy);
+			Buddy->DerpRegionRefresh = TableRegion != 0;
+
 			Buddy->DialogWindow = Dialog;
 			Buddy->DerpRegionThread = CreateThread(NULL, 0, &Buddy_GetBestDerpRegionThread, Buddy, 0, NULL);
 			Assert(Buddy->DerpRegionThread);
+
+			if (TableRegion)
+			{
+				LOG_INFO("DERP region %u from latency table, refreshing in background", TableRegion);
+				PostMessageW(Dialog, BUDDY_WM_BEST_REGION, TableRegion, BUDDY_REGION_FROM_TABLE);
+			}
 		}
 		else
 		{
@@ -4401,6 +6771,9 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 		}
 		PostMessageW(ShareKey, EM_SETSEL, -1, 0);
 
+		// the handshake with the server is done before the user gets to click Share or Connect
+		Buddy_WarmDerp(Buddy, false);
+
 		// Subclass edit controls to draw white borders
 		HWND shareKeyEdit = GetDlgItem(Dialog, BUDDY_ID_SHARE_KEY);
 		HWND connectKeyEdit = GetDlgItem(Dialog, BUDDY_ID_CONNECT_KEY);
@@ -4635,8 +7008,9 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 			}
 
 			uint8_t Data[1] = { BUDDY_PACKET_DISCONNECT };
-			DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, sizeof(Data));
-			DerpNet_Close(&Buddy->Net);
+			Buddy_Send(Buddy, Data, sizeof(Data));
+			Buddy_CancelWait(Buddy);
+			Buddy_CloseNet(Buddy);
 			Buddy_StopSharing(Buddy);
 		}
 
@@ -4708,8 +7082,24 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 					LOG_INFO("Frame timer fired #%d, calling Buddy_OnFrameCapture", s_FrameTimerCount);
 				}
 				Buddy_OnFrameCapture(&Buddy->Capture, false);
+
+				TelemetrySummary Telemetry;
+				if (Buddy_TelemetryTick(Buddy, &Telemetry))
+				{
+					Buddy_LogTelemetry(Buddy, &Telemetry);
+					if (Telemetry.bitrate != Buddy->EncodeBitrate)
+					{
+						LOG_NET("BITRATE: %u -> %u kbit/s", Buddy->EncodeBitrate / 1000, Telemetry.bitrate / 1000);
+						Buddy_SetBitrate(Buddy, Telemetry.bitrate);
+						Buddy->EncodeBitrate = Telemetry.bitrate;
+					}
+				}
 			}
 		}
+		else if (WParam == BUDDY_RESUME_TIMER)
+		{
+			Buddy_ResumeTick(Buddy);
+		}
 		else if (WParam == BUDDY_SHARE_TIMEOUT_TIMER)
 		{
 			// Check if share has timed out (5 minutes without connection)
@@ -4735,7 +7125,7 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 					Buddy->ShareTimeoutActive = false;
 					
 					Buddy_CancelWait(Buddy);
-					DerpNet_Close(&Buddy->Net);
+					Buddy_CloseNet(Buddy);
 					Buddy_StopSharing(Buddy);
 					Buddy_UpdateState(Buddy, BUDDY_STATE_INITIAL);
 					
@@ -4803,6 +7193,7 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 				LocalFree(BlobOutput.pbData);
 
 				Dialog_ShowShareKey(GetDlgItem(Dialog, BUDDY_ID_SHARE_KEY), Buddy->DerpRegion, &Buddy->MyPublicKey);
+				Buddy_WarmDerp(Buddy, true);
 			}
 		}
 		else if (Control == BUDDY_ID_CONNECT_PASTE)
@@ -4834,14 +7225,14 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 					if (Stop)
 					{
 						uint8_t Data[1] = { BUDDY_PACKET_DISCONNECT };
-						DerpNet_Send(&Buddy->Net, &Buddy->RemoteKey, Data, sizeof(Data));
+						Buddy_Send(Buddy, Data, sizeof(Data));
 					}
 				}
 
 				if (Stop)
 				{
 					Buddy_CancelWait(Buddy);
-					DerpNet_Close(&Buddy->Net);
+					Buddy_CloseNet(Buddy);
 					Buddy_StopSharing(Buddy);
 					
 					// Stop timeout timer
@@ -4883,6 +7274,7 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 				wprintf(L"[BUDDY_DIALOG] Settings dialog returned OK - applying changes\n");
 				// Changes are already saved and applied by the dialog
 				LOG_INFO("Settings changed and applied");
+				Buddy_WarmDerp(Buddy, false);
 			}
 			else
 			{
@@ -4915,8 +7307,20 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 
 	case BUDDY_WM_BEST_REGION:
 	{
-		WaitForSingleObject(Buddy->DerpRegionThread, INFINITE);
-		CloseHandle(Buddy->DerpRegionThread);
+		if (LParam != BUDDY_REGION_FROM_TABLE)
+		{
+			WaitForSingleObject(Buddy->DerpRegionThread, INFINITE);
+			CloseHandle(Buddy->DerpRegionThread);
+			Buddy->DerpRegionThread = NULL;
+
+			if (Buddy->DerpRegionRefresh)
+			{
+				// the share key already uses the region from the table, the new table is for the next start
+				Buddy->DerpRegionRefresh = false;
+				LOG_INFO("DERP latency table refreshed, best region now %u (using %u)", (uint32_t)WParam, Buddy->DerpRegion);
+				return 0;
+			}
+		}
 
 		if (WParam == 0)
 		{
@@ -4932,7 +7336,7 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 		
 		// Update DERP region in the single config object
 		Buddy->Config.derp_region = Buddy->DerpRegion;
-		for (int RegionIndex = 0; RegionIndex < BUDDY_MAX_REGION_COUNT; RegionIndex++)
+		for (int RegionIndex = 0; RegionIndex < ARRAYSIZE(Buddy->Config.derp_regions); RegionIndex++)
 		{
 			lstrcpyW(Buddy->Config.derp_regions[RegionIndex], Buddy->DerpRegions[RegionIndex]);
 		}
@@ -4977,9 +7381,19 @@ static INT_PTR CALLBACK Buddy_DialogProc(HWND Dialog, UINT Message, WPARAM WPara
 
 	case BUDDY_WM_NET_EVENT:
 		Buddy_NetworkEvent(Buddy);
-		if (Buddy->State != BUDDY_STATE_INITIAL && Buddy->State != BUDDY_STATE_DISCONNECTED)
+		Buddy_FlushNet(Buddy);
+		return 0;
+
+	case BUDDY_WM_DIRECT_EVENT:
+		Buddy_DirectEvent(Buddy);
+		return 0;
+
+	case BUDDY_WM_RESUME:
+		// HELLO or WELCOME from the sharer that came in order with the video
+		if (Buddy->State == BUDDY_STATE_CONNECTED && Buddy->Resume.state != SESSION_RESUME_OFF)
 		{
-			Buddy_NextWait(Buddy);
+			Buddy_ResumePacket(Buddy, Buddy->RemoteKey, (uint8_t)WParam);
+			Buddy_FlushNet(Buddy);
 		}
 		return 0;
 
@@ -5389,6 +7803,10 @@ int WinMain(HINSTANCE instance, HINSTANCE previous, LPSTR cmdline, int cmdshow)
 		HR(ID3D11DeviceContext_QueryInterface(Buddy->Context, &IID_ID3D11Multithread, (void**)&Multithread));
 		HR(ID3D11Multithread_SetMultithreadProtected(Multithread, TRUE));
 		ID3D11Multithread_Release(Multithread);
+
+		BuddyMutex_Init(&Buddy->RenderLock);
+		BuddyMutex_Init(&Buddy->DecodeLock);
+		BuddyCond_Init(&Buddy->DecodeWake);
 	}
 
 	// 
@@ -5433,6 +7851,11 @@ int WinMain(HINSTANCE instance, HINSTANCE previous, LPSTR cmdline, int cmdshow)
 	for (;;)
 	{
 		MSG Message;
+		if (!PeekMessageW(&Message, NULL, 0, 0, PM_NOREMOVE))
+		{
+			Buddy_FlushNet(Buddy);
+		}
+
 		BOOL Result = GetMessageW(&Message, NULL, 0, 0);
 		if (Result == 0)
 		{
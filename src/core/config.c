@@ -34,11 +34,13 @@ static void write_json(FILE* f, const BuddyConfig* cfg) {
     char utf8_release_key[64] = {0};
     char utf8_log_directory[MAX_PATH * 3] = {0};
     char utf8_log_filename_format[512] = {0};
+    char utf8_recording_directory[MAX_PATH * 3] = {0};
     char utf8_derp_regions[16][512] = {{0}};
     WideCharToMultiByte(CP_UTF8, 0, cfg->derp_server, -1, utf8_derp_server, sizeof(utf8_derp_server), NULL, NULL);
     WideCharToMultiByte(CP_UTF8, 0, cfg->release_key, -1, utf8_release_key, sizeof(utf8_release_key), NULL, NULL);
     WideCharToMultiByte(CP_UTF8, 0, cfg->log_directory, -1, utf8_log_directory, sizeof(utf8_log_directory), NULL, NULL);
     WideCharToMultiByte(CP_UTF8, 0, cfg->log_filename_format, -1, utf8_log_filename_format, sizeof(utf8_log_filename_format), NULL, NULL);
+    WideCharToMultiByte(CP_UTF8, 0, cfg->recording_directory, -1, utf8_recording_directory, sizeof(utf8_recording_directory), NULL, NULL);
     for (int i = 0; i < 16; i++) {
         if (cfg->derp_regions[i][0] != 0) {
             WideCharToMultiByte(CP_UTF8, 0, cfg->derp_regions[i], -1, utf8_derp_regions[i], 512, NULL, NULL);
@@ -48,6 +50,7 @@ static void write_json(FILE* f, const BuddyConfig* cfg) {
     fprintf(f, "  \"log_level\": %d,\n", cfg->log_level);
     fprintf(f, "  \"framerate\": %d,\n", cfg->framerate);
     fprintf(f, "  \"bitrate\": %d,\n", cfg->bitrate);
+    fprintf(f, "  \"pacing_percent\": %d,\n", cfg->pacing_percent);
     fprintf(f, "  \"use_bt709\": %s,\n", cfg->use_bt709 ? "true" : "false");
     fprintf(f, "  \"use_full_range\": %s,\n", cfg->use_full_range ? "true" : "false");
     fprintf(f, "  \"derp_server\": \"%s\",\n", utf8_derp_server);
@@ -58,6 +61,8 @@ static void write_json(FILE* f, const BuddyConfig* cfg) {
     fprintf(f, "  \"capture_full_screen\": %s,\n", cfg->capture_full_screen ? "true" : "false");
     fprintf(f, "  \"log_directory\": \"%s\",\n", utf8_log_directory);
     fprintf(f, "  \"log_filename_format\": \"%s\",\n", utf8_log_filename_format);
+    fprintf(f, "  \"record_sessions\": %s,\n", cfg->record_sessions ? "true" : "false");
+    fprintf(f, "  \"recording_directory\": \"%s\",\n", utf8_recording_directory);
     fprintf(f, "  \"derp_private_key_hex\": \"%s\",\n", cfg->derp_private_key_hex);
     fprintf(f, "  \"derp_regions\": [\n");
     bool first = true;
@@ -76,6 +81,7 @@ void BuddyConfig_Defaults(BuddyConfig* cfg) {
     cfg->log_level = 2; // info
     cfg->framerate = 30; // Default 30 FPS
     cfg->bitrate = 4 * 1000 * 1000; // Default 4 Mbps
+    cfg->pacing_percent = 50; // keyframes go out over half a frame interval
     cfg->use_bt709 = true;
     cfg->use_full_range = false; // Use limited range (16-235) for proper YUV conversion
     lstrcpyW(cfg->derp_server, L"localhost");
@@ -97,7 +103,10 @@ void BuddyConfig_Defaults(BuddyConfig* cfg) {
     // Default log filename format with date, time, and process ID tokens
     lstrcpyW(cfg->log_filename_format, L"{appname}-{date}_{time}.log");
     
-    // derp_regions and derp_private_key_hex start empty
+    // Recordings are off by default; empty recording_directory means <log_directory>\recordings
+    cfg->record_sessions = false;
+    
+    // derp_regions, derp_private_key_hex and recording_directory start empty
 }
 
 bool BuddyConfig_GetDefaultPath(wchar_t* path, size_t pathChars) {
@@ -237,6 +246,10 @@ bool BuddyConfig_Load(BuddyConfig* cfg, const wchar_t* path) {
     if (n > 0) cfg->bitrate = (int)n;
     LOG_CONFIG_INFO("  bitrate: %d bps (%d Mbps)", cfg->bitrate, cfg->bitrate / 1000000);
 
+    n = JsonObject_GetNumber(root, JsonCSTR("pacing_percent"));
+    if (n > 0 && n <= 100) cfg->pacing_percent = (int)n;
+    LOG_CONFIG_INFO("  pacing_percent: %d%%", cfg->pacing_percent);
+
     n = JsonObject_GetNumber(root, JsonCSTR("derp_server_port"));
     if (n > 0) cfg->derp_server_port = (int)n;
     LOG_CONFIG_INFO("  derp_server_port: %d", cfg->derp_server_port);
@@ -311,6 +324,15 @@ bool BuddyConfig_Load(BuddyConfig* cfg, const wchar_t* path) {
         LOG_CONFIG_INFO("  log_filename_format: %ls", cfg->log_filename_format);
     }
 
+    cfg->record_sessions = JsonObject_GetBoolean(root, JsonCSTR("record_sessions"));
+    LOG_CONFIG_INFO("  record_sessions: %d", cfg->record_sessions);
+    s = JsonObject_GetString(root, JsonCSTR("recording_directory"));
+    if (s) {
+        const JsonHSTRING* hs = (const JsonHSTRING*)s;
+        lstrcpynW(cfg->recording_directory, hs->Ptr, MAX_PATH);
+        LOG_CONFIG_INFO("  recording_directory: %ls", cfg->recording_directory);
+    }
+
     // DERP region settings
     cfg->derp_region = (int)JsonObject_GetNumber(root, JsonCSTR("derp_region"));
     cfg->capture_full_screen = JsonObject_GetBoolean(root, JsonCSTR("capture_full_screen"));
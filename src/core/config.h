@@ -7,6 +7,7 @@ typedef struct {
     int log_level;           // 0=error,1=warn,2=info,3=debug,4=trace
     int framerate;           // frames per second (default 30)
     int bitrate;             // H.264 bitrate in bps (default 4Mbps)
+    int pacing_percent;      // spread each video frame over this percent of the frame interval (default 50)
     bool use_bt709;          // enforce BT.709 primaries/matrix/transfer
     bool use_full_range;     // enforce 0-255 nominal range
     wchar_t derp_server[256];// DERP server hostname or IP
@@ -19,6 +20,8 @@ typedef struct {
     bool capture_full_screen; // Capture full screen or specific window
     wchar_t log_directory[MAX_PATH]; // Directory for log files (default: app directory)
     wchar_t log_filename_format[256]; // Log filename format with tokens: {date}, {time}, {pid}, {appname}
+    bool record_sessions;    // tee the encoded stream of shared sessions to disk
+    wchar_t recording_directory[MAX_PATH]; // Directory for session recordings (empty: <log_directory>\recordings)
 } BuddyConfig;
 
 // Populate defaults (safe values)
@@ -0,0 +1,143 @@
+#include <string.h>
+#include "input_batch.h"
+
+// Payload: [count:1] then per event [type:1] and
+//   move    x:2 y:2
+//   button  x:2 y:2 button:1 down:1
+//   wheel   x:2 y:2 delta:2 horizontal:1
+//   key     virtual_key:2 scan_code:2 flags:2 down:1
+// all little-endian
+static const uint8_t InputBatch_EventSize[INPUT_EVENT_COUNT] = { 5, 7, 8, 8 };
+
+static void InputBatch_Set16(uint8_t* dst, uint16_t value)
+{
+    dst[0] = (uint8_t)(value);
+    dst[1] = (uint8_t)(value >> 8);
+}
+
+static uint16_t InputBatch_Get16(const uint8_t* src)
+{
+    return (uint16_t)(src[0] | (src[1] << 8));
+}
+
+void InputBatch_Init(InputBatch* batch)
+{
+    memset(batch, 0, sizeof(*batch));
+}
+
+bool InputBatch_Add(InputBatch* batch, const InputEvent* event)
+{
+    if (event->type == INPUT_EVENT_MOVE && batch->count && batch->events[batch->count - 1].type == INPUT_EVENT_MOVE)
+    {
+        // only where the pointer ends up matters, unless something happened in between
+        batch->events[batch->count - 1] = *event;
+        batch->events_added++;
+        batch->moves_merged++;
+        return true;
+    }
+
+    if (batch->count == INPUT_BATCH_MAX_EVENTS)
+    {
+        return false;
+    }
+    batch->events[batch->count++] = *event;
+    batch->events_added++;
+    return true;
+}
+
+uint32_t InputBatch_Take(InputBatch* batch, uint8_t* out)
+{
+    if (batch->count == 0)
+    {
+        return 0;
+    }
+
+    uint8_t* at = out;
+    *at++ = (uint8_t)batch->count;
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        const InputEvent* event = &batch->events[i];
+        at[0] = event->type;
+        switch (event->type)
+        {
+        case INPUT_EVENT_MOVE:
+            InputBatch_Set16(at + 1, (uint16_t)event->x);
+            InputBatch_Set16(at + 3, (uint16_t)event->y);
+            break;
+        case INPUT_EVENT_BUTTON:
+            InputBatch_Set16(at + 1, (uint16_t)event->x);
+            InputBatch_Set16(at + 3, (uint16_t)event->y);
+            at[5] = (uint8_t)event->button;
+            at[6] = event->down;
+            break;
+        case INPUT_EVENT_WHEEL:
+            InputBatch_Set16(at + 1, (uint16_t)event->x);
+            InputBatch_Set16(at + 3, (uint16_t)event->y);
+            InputBatch_Set16(at + 5, (uint16_t)event->delta);
+            at[7] = event->down;
+            break;
+        case INPUT_EVENT_KEY:
+            InputBatch_Set16(at + 1, event->virtual_key);
+            InputBatch_Set16(at + 3, event->scan_code);
+            InputBatch_Set16(at + 5, event->flags);
+            at[7] = event->down;
+            break;
+        }
+        at += InputBatch_EventSize[event->type];
+    }
+
+    batch->count = 0;
+    batch->batches++;
+    return (uint32_t)(at - out);
+}
+
+int InputBatch_Decode(const uint8_t* data, uint32_t size, InputEvent* events, uint32_t max_events)
+{
+    if (size < 1 || data[0] == 0 || data[0] > max_events)
+    {
+        return -1;
+    }
+
+    uint32_t count = data[0];
+    const uint8_t* at = data + 1;
+    const uint8_t* end = data + size;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (at == end || at[0] >= INPUT_EVENT_COUNT || (uint32_t)(end - at) < InputBatch_EventSize[at[0]])
+        {
+            return -1;
+        }
+
+        InputEvent* event = &events[i];
+        memset(event, 0, sizeof(*event));
+        event->type = at[0];
+        switch (event->type)
+        {
+        case INPUT_EVENT_MOVE:
+            event->x = (int16_t)InputBatch_Get16(at + 1);
+            event->y = (int16_t)InputBatch_Get16(at + 3);
+            break;
+        case INPUT_EVENT_BUTTON:
+            event->x = (int16_t)InputBatch_Get16(at + 1);
+            event->y = (int16_t)InputBatch_Get16(at + 3);
+            event->button = at[5];
+            event->down = at[6];
+            break;
+        case INPUT_EVENT_WHEEL:
+            event->x = (int16_t)InputBatch_Get16(at + 1);
+            event->y = (int16_t)InputBatch_Get16(at + 3);
+            event->delta = (int16_t)InputBatch_Get16(at + 5);
+            event->down = at[7];
+            break;
+        case INPUT_EVENT_KEY:
+            event->virtual_key = InputBatch_Get16(at + 1);
+            event->scan_code = InputBatch_Get16(at + 3);
+            event->flags = InputBatch_Get16(at + 5);
+            event->down = at[7];
+            break;
+        }
+        at += InputBatch_EventSize[event->type];
+    }
+
+    return at == end ? (int)count : -1;
+}
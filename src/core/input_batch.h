@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Viewer input batching.
+//
+// Mouse moves arrive hundreds of times a second on high polling rate mice, and
+// sending each one as its own packet costs a box seal, a DERP frame and a
+// socket write for a few bytes of payload. The viewer collects input events in
+// an InputBatch instead: a move that follows another move replaces it, so only
+// the newest position per flush tick is sent, while buttons, wheel and keys
+// are kept in order with the moves between them. The batch goes out as one
+// BUDDY_PACKET_INPUT_BATCH packet, and the sharer injects all of it with one
+// SendInput call.
+
+#define INPUT_BATCH_MAX_EVENTS 64
+#define INPUT_BATCH_MAX_EVENT_SIZE 8
+#define INPUT_BATCH_MAX_SIZE (1 + INPUT_BATCH_MAX_EVENTS * INPUT_BATCH_MAX_EVENT_SIZE)
+
+typedef enum {
+    INPUT_EVENT_MOVE,
+    INPUT_EVENT_BUTTON,
+    INPUT_EVENT_WHEEL,
+    INPUT_EVENT_KEY,
+    INPUT_EVENT_COUNT,
+} InputEventType;
+
+typedef struct {
+    uint8_t type;              // InputEventType
+    int16_t x;                 // move, button, wheel: position on the shared screen
+    int16_t y;
+    int16_t button;            // button: 0 left, 1 right, 2 middle, 3/4 X buttons
+    int16_t delta;             // wheel
+    uint16_t virtual_key;      // key
+    uint16_t scan_code;        // key
+    uint16_t flags;            // key: KEYEVENTF_EXTENDEDKEY
+    uint8_t down;              // button, key: pressed; wheel: horizontal
+} InputEvent;
+
+typedef struct {
+    InputEvent events[INPUT_BATCH_MAX_EVENTS];
+    uint32_t count;
+
+    // statistics
+    uint64_t events_added;
+    uint64_t moves_merged;     // moves replaced by a newer one before they were sent
+    uint64_t batches;
+} InputBatch;
+
+void InputBatch_Init(InputBatch* batch);
+
+// Appends an event, a move right after another move replaces it. Returns false when the batch
+// is full, take it and add the event again.
+bool InputBatch_Add(InputBatch* batch, const InputEvent* event);
+
+// Encodes the pending events into out (INPUT_BATCH_MAX_SIZE bytes) and empties the batch.
+// Returns the payload size, 0 when nothing is pending.
+uint32_t InputBatch_Take(InputBatch* batch, uint8_t* out);
+
+// Decodes a payload made by InputBatch_Take. Returns the event count, or -1 when the payload
+// is truncated, has trailing bytes, an unknown event type or more than max_events events.
+int InputBatch_Decode(const uint8_t* data, uint32_t size, InputEvent* events, uint32_t max_events);
@@ -0,0 +1,359 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recorder.h"
+
+typedef struct {
+    FILE* stream;
+    FILE* index;
+} RecorderFileSink;
+
+static void Recorder_Set32LE(uint8_t* dst, uint32_t value)
+{
+    dst[0] = (uint8_t)(value);
+    dst[1] = (uint8_t)(value >> 8);
+    dst[2] = (uint8_t)(value >> 16);
+    dst[3] = (uint8_t)(value >> 24);
+}
+
+static void Recorder_Set64LE(uint8_t* dst, uint64_t value)
+{
+    Recorder_Set32LE(dst, (uint32_t)value);
+    Recorder_Set32LE(dst + 4, (uint32_t)(value >> 32));
+}
+
+static uint32_t Recorder_Get32LE(const uint8_t* src)
+{
+    return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static uint64_t Recorder_Get64LE(const uint8_t* src)
+{
+    return (uint64_t)Recorder_Get32LE(src) | ((uint64_t)Recorder_Get32LE(src + 4) << 32);
+}
+
+// Paths are UTF-8 on every platform; Windows needs the wide CRT to honour that
+static FILE* Recorder_OpenFile(const char* path, const char* mode)
+{
+#if defined(_WIN32)
+    wchar_t wpath[MAX_PATH];
+    wchar_t wmode[8];
+    if (!MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH)) return NULL;
+    if (!MultiByteToWideChar(CP_UTF8, 0, mode, -1, wmode, 8)) return NULL;
+    return _wfopen(wpath, wmode);
+#else
+    return fopen(path, mode);
+#endif
+}
+
+static bool RecorderFileSink_WriteStream(void* user, const void* data, size_t size)
+{
+    RecorderFileSink* sink = user;
+    return fwrite(data, 1, size, sink->stream) == size;
+}
+
+static bool RecorderFileSink_WriteIndex(void* user, const void* data, size_t size)
+{
+    RecorderFileSink* sink = user;
+    // keep the index usable even if the process dies mid-session
+    return fwrite(data, 1, size, sink->index) == size && fflush(sink->index) == 0;
+}
+
+static void RecorderFileSink_Close(void* user)
+{
+    RecorderFileSink* sink = user;
+    fclose(sink->stream);
+    fclose(sink->index);
+    free(sink);
+}
+
+static void Recorder_WriterThread(void* arg)
+{
+    Recorder* rec = arg;
+
+    BuddyMutex_Lock(&rec->lock);
+    for (;;)
+    {
+        while (rec->pending_read == rec->pending_write && !rec->stopping)
+        {
+            BuddyCond_Wait(&rec->wake, &rec->lock);
+        }
+        if (rec->pending_read == rec->pending_write)
+        {
+            break;
+        }
+
+        RecorderPending entry = rec->pending[rec->pending_read % RECORDER_MAX_PENDING];
+        bool failed = rec->sink_failed;
+        BuddyMutex_Unlock(&rec->lock);
+
+        const uint8_t* data = rec->pool + (entry.start % rec->pool_size);
+        uint32_t size = (uint32_t)(entry.end - entry.start);
+        bool ok = true;
+
+        if (!failed)
+        {
+            // the index only ever points at data that made it into the stream
+            ok = rec->sink.write_stream(rec->sink.user, data, size);
+            if (ok && entry.keyframe)
+            {
+                uint8_t record[RECORDER_INDEX_RECORD_SIZE];
+                Recorder_Set64LE(record + 0, rec->stream_offset);
+                Recorder_Set64LE(record + 8, entry.timestamp_us);
+                Recorder_Set32LE(record + 16, rec->frame_number);
+                Recorder_Set32LE(record + 20, size);
+                ok = rec->sink.write_index(rec->sink.user, record, sizeof(record));
+            }
+        }
+
+        BuddyMutex_Lock(&rec->lock);
+        rec->pending_read++;
+        rec->pool_read = entry.end;
+        if (failed || !ok)
+        {
+            rec->sink_failed = true;
+            rec->frames_dropped++;
+            rec->bytes_dropped += size;
+        }
+        else
+        {
+            rec->stream_offset += size;
+            rec->frame_number++;
+            rec->frames_written++;
+            rec->bytes_written += size;
+            rec->keyframes_written += entry.keyframe;
+        }
+    }
+    BuddyMutex_Unlock(&rec->lock);
+}
+
+bool Recorder_OpenSink(Recorder* rec, const RecorderSink* sink, size_t pool_size)
+{
+    if (!rec || !sink || !sink->write_stream || !sink->write_index) return false;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->sink = *sink;
+    rec->pool_size = pool_size ? pool_size : RECORDER_DEFAULT_POOL_SIZE;
+    rec->pool = malloc(rec->pool_size);
+    if (!rec->pool) return false;
+
+    // a recording must start on a keyframe to be decodable
+    rec->waiting_for_keyframe = true;
+
+    uint8_t header[RECORDER_INDEX_HEADER_SIZE];
+    memcpy(header, RECORDER_INDEX_MAGIC, 8);
+    Recorder_Set32LE(header + 8, RECORDER_INDEX_VERSION);
+    Recorder_Set32LE(header + 12, RECORDER_INDEX_RECORD_SIZE);
+    if (!rec->sink.write_index(rec->sink.user, header, sizeof(header)))
+    {
+        free(rec->pool);
+        rec->pool = NULL;
+        return false;
+    }
+
+    BuddyMutex_Init(&rec->lock);
+    BuddyCond_Init(&rec->wake);
+    if (!BuddyThread_Start(&rec->thread, Recorder_WriterThread, rec))
+    {
+        BuddyCond_Destroy(&rec->wake);
+        BuddyMutex_Destroy(&rec->lock);
+        free(rec->pool);
+        rec->pool = NULL;
+        return false;
+    }
+
+    rec->running = true;
+    return true;
+}
+
+bool Recorder_Open(Recorder* rec, const char* path, size_t pool_size)
+{
+    if (!rec || !path) return false;
+
+    char index_path[1024];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int)sizeof(index_path)) return false;
+
+    RecorderFileSink* file = calloc(1, sizeof(*file));
+    if (!file) return false;
+
+    file->stream = Recorder_OpenFile(path, "wb");
+    file->index = Recorder_OpenFile(index_path, "wb");
+    if (!file->stream || !file->index)
+    {
+        if (file->stream) fclose(file->stream);
+        if (file->index) fclose(file->index);
+        free(file);
+        return false;
+    }
+
+    RecorderSink sink = {
+        .user = file,
+        .write_stream = RecorderFileSink_WriteStream,
+        .write_index = RecorderFileSink_WriteIndex,
+        .close = RecorderFileSink_Close,
+    };
+    if (!Recorder_OpenSink(rec, &sink, pool_size))
+    {
+        RecorderFileSink_Close(file);
+        return false;
+    }
+    return true;
+}
+
+static bool Recorder_Drop(Recorder* rec, size_t size)
+{
+    rec->frames_dropped++;
+    rec->bytes_dropped += size;
+    // resume only at the next keyframe so the file never references lost frames
+    rec->waiting_for_keyframe = true;
+    return false;
+}
+
+bool Recorder_Write(Recorder* rec, const void* data, size_t size, uint64_t timestamp_us)
+{
+    if (!rec || !rec->running || !data || size == 0) return false;
+
+    bool keyframe = Recorder_IsKeyframe(data, size);
+
+    BuddyMutex_Lock(&rec->lock);
+
+    if (rec->sink_failed || (rec->waiting_for_keyframe && !keyframe) ||
+        rec->pending_write - rec->pending_read == RECORDER_MAX_PENDING)
+    {
+        bool result = Recorder_Drop(rec, size);
+        BuddyMutex_Unlock(&rec->lock);
+        return result;
+    }
+
+    // frames are stored contiguously; skip the tail of the pool if the frame would wrap
+    size_t pos = (size_t)(rec->pool_write % rec->pool_size);
+    size_t pad = pos + size > rec->pool_size ? rec->pool_size - pos : 0;
+    uint64_t used = rec->pool_write - rec->pool_read;
+    if (size > rec->pool_size || used + pad + size > rec->pool_size)
+    {
+        bool result = Recorder_Drop(rec, size);
+        BuddyMutex_Unlock(&rec->lock);
+        return result;
+    }
+
+    uint64_t start = rec->pool_write + pad;
+    rec->pool_write = start + size;
+    rec->waiting_for_keyframe = false;
+    BuddyMutex_Unlock(&rec->lock);
+
+    // the reserved region is owned by the producer until published below
+    memcpy(rec->pool + (start % rec->pool_size), data, size);
+
+    BuddyMutex_Lock(&rec->lock);
+    RecorderPending* entry = &rec->pending[rec->pending_write % RECORDER_MAX_PENDING];
+    entry->start = start;
+    entry->end = start + size;
+    entry->timestamp_us = timestamp_us;
+    entry->keyframe = keyframe;
+    rec->pending_write++;
+    BuddyCond_Signal(&rec->wake);
+    BuddyMutex_Unlock(&rec->lock);
+
+    return true;
+}
+
+void Recorder_Close(Recorder* rec)
+{
+    if (!rec || !rec->running) return;
+
+    BuddyMutex_Lock(&rec->lock);
+    rec->stopping = true;
+    BuddyCond_Signal(&rec->wake);
+    BuddyMutex_Unlock(&rec->lock);
+
+    BuddyThread_Join(rec->thread);
+
+    if (rec->sink.close)
+    {
+        rec->sink.close(rec->sink.user);
+    }
+
+    BuddyCond_Destroy(&rec->wake);
+    BuddyMutex_Destroy(&rec->lock);
+    free(rec->pool);
+    rec->pool = NULL;
+    rec->running = false;
+}
+
+bool Recorder_IsKeyframe(const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+
+    for (size_t i = 0; i + 3 < size; i++)
+    {
+        if (bytes[i] != 0 || bytes[i + 1] != 0 || bytes[i + 2] != 1)
+        {
+            continue;
+        }
+
+        uint8_t type = bytes[i + 3] & 0x1F;
+        if (type == 5 || type == 7)
+        {
+            return true;  // IDR slice or SPS (which precedes the IDR)
+        }
+        if (type >= 1 && type <= 4)
+        {
+            return false; // first slice is a non-IDR picture
+        }
+        i += 3;
+    }
+    return false;
+}
+
+int Recorder_ReadIndex(const char* index_path, RecorderKeyframe* entries, int max_entries)
+{
+    FILE* f = Recorder_OpenFile(index_path, "rb");
+    if (!f) return -1;
+
+    uint8_t header[RECORDER_INDEX_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, RECORDER_INDEX_MAGIC, 8) != 0 ||
+        Recorder_Get32LE(header + 8) != RECORDER_INDEX_VERSION ||
+        Recorder_Get32LE(header + 12) != RECORDER_INDEX_RECORD_SIZE)
+    {
+        fclose(f);
+        return -1;
+    }
+
+    int count = 0;
+    uint8_t record[RECORDER_INDEX_RECORD_SIZE];
+    while (count < max_entries && fread(record, 1, sizeof(record), f) == sizeof(record))
+    {
+        entries[count].stream_offset = Recorder_Get64LE(record + 0);
+        entries[count].timestamp_us = Recorder_Get64LE(record + 8);
+        entries[count].frame_number = Recorder_Get32LE(record + 16);
+        entries[count].size = Recorder_Get32LE(record + 20);
+        count++;
+    }
+
+    fclose(f);
+    return count;
+}
+
+int Recorder_FindKeyframe(const RecorderKeyframe* entries, int count, uint64_t timestamp_us)
+{
+    // entries are written in stream order, so timestamps are non-decreasing
+    int lo = 0;
+    int hi = count - 1;
+    int found = -1;
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (entries[mid].timestamp_us <= timestamp_us)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
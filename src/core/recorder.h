@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "platform.h"
+
+// Session recorder: tees the encoded H.264 access units to an Annex-B file plus
+// a keyframe side index (<file>.idx). Frames are copied into a bounded pool and
+// written by a background thread; when the pool is full the frame is dropped
+// (and everything up to the next keyframe) instead of stalling the encoder.
+
+#define RECORDER_DEFAULT_POOL_SIZE (8 * 1024 * 1024)
+#define RECORDER_MAX_PENDING 256
+
+// Index file layout (little-endian): 16-byte header, then fixed-size records
+#define RECORDER_INDEX_MAGIC "SBRECIDX"
+#define RECORDER_INDEX_VERSION 1
+#define RECORDER_INDEX_HEADER_SIZE 16
+#define RECORDER_INDEX_RECORD_SIZE 24
+
+// Output callbacks; returning false stops the writer thread
+typedef struct {
+    void* user;
+    bool (*write_stream)(void* user, const void* data, size_t size);
+    bool (*write_index)(void* user, const void* data, size_t size);
+    void (*close)(void* user);
+} RecorderSink;
+
+typedef struct {
+    uint64_t start;          // position in the pool (monotonic byte counter)
+    uint64_t end;
+    uint64_t timestamp_us;
+    bool keyframe;
+} RecorderPending;
+
+typedef struct {
+    uint64_t stream_offset;  // byte offset of the keyframe in the stream file
+    uint64_t timestamp_us;   // presentation time of the keyframe
+    uint32_t frame_number;   // frame index since recording start
+    uint32_t size;           // access unit size in bytes
+} RecorderKeyframe;
+
+typedef struct {
+    RecorderSink sink;
+    bool running;
+
+    // frame pool (single producer: the encoder output path)
+    uint8_t* pool;
+    size_t pool_size;
+    uint64_t pool_write;
+    uint64_t pool_read;
+    RecorderPending pending[RECORDER_MAX_PENDING];
+    uint32_t pending_write;
+    uint32_t pending_read;
+    bool waiting_for_keyframe;
+    bool stopping;
+
+    BuddyMutex lock;
+    BuddyCond wake;
+    BuddyThread thread;
+
+    // writer thread state
+    uint64_t stream_offset;
+    uint32_t frame_number;
+    bool sink_failed;
+
+    // statistics
+    uint64_t frames_written;
+    uint64_t frames_dropped;
+    uint64_t bytes_written;
+    uint64_t bytes_dropped;
+    uint64_t keyframes_written;
+} Recorder;
+
+// Open recorder writing <path> (Annex-B) and <path>.idx; pool_size 0 uses the default
+bool Recorder_Open(Recorder* rec, const char* path, size_t pool_size);
+
+// Open recorder on a custom sink (used by tests to simulate a slow disk)
+bool Recorder_OpenSink(Recorder* rec, const RecorderSink* sink, size_t pool_size);
+
+// Queue one encoded access unit; never blocks on I/O. Returns false if dropped.
+bool Recorder_Write(Recorder* rec, const void* data, size_t size, uint64_t timestamp_us);
+
+// Stop the writer thread after draining queued frames and close the outputs
+void Recorder_Close(Recorder* rec);
+
+// Returns true if the Annex-B access unit starts a decodable sequence (IDR or SPS)
+bool Recorder_IsKeyframe(const void* data, size_t size);
+
+// Read a side index; returns number of keyframes stored in entries, -1 on error
+int Recorder_ReadIndex(const char* index_path, RecorderKeyframe* entries, int max_entries);
+
+// Find the last keyframe at or before timestamp_us; returns -1 if none
+int Recorder_FindKeyframe(const RecorderKeyframe* entries, int count, uint64_t timestamp_us);
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <string.h>
+#include "derp_map.h"
+
+enum {
+    DERP_MAP_VALUE,              // a value must follow
+    DERP_MAP_VALUE_OR_END,       // after '['
+    DERP_MAP_KEY_OR_END,         // after '{'
+    DERP_MAP_KEY,                // after ',' in an object
+    DERP_MAP_COLON,
+    DERP_MAP_NEXT,               // after a value: ',' or the closing bracket
+    DERP_MAP_STRING,
+    DERP_MAP_ESCAPE,
+    DERP_MAP_UNICODE,
+    DERP_MAP_NUMBER,
+    DERP_MAP_LITERAL,
+    DERP_MAP_DONE,
+    DERP_MAP_ERROR,
+};
+
+// What a value is, decided from its container and key before it starts
+enum {
+    DERP_MAP_OTHER,
+    DERP_MAP_ROOT,
+    DERP_MAP_REGIONS,            // root "Regions"
+    DERP_MAP_REGION,             // any member of Regions
+    DERP_MAP_REGION_ID,          // region "RegionID"
+    DERP_MAP_NODES,              // region "Nodes"
+    DERP_MAP_FIRST_NODE,         // Nodes[0]
+    DERP_MAP_HOST_NAME,          // Nodes[0] "HostName"
+    DERP_MAP_KEY_STRING,         // the string being read is a key
+};
+
+// Paths are UTF-8 on every platform; Windows needs the wide CRT to honour that
+static FILE* DerpMap_OpenFile(const char* path, const char* mode)
+{
+#if defined(_WIN32)
+    wchar_t wpath[MAX_PATH];
+    wchar_t wmode[8];
+    if (!MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH)) return NULL;
+    if (!MultiByteToWideChar(CP_UTF8, 0, mode, -1, wmode, 8)) return NULL;
+    return _wfopen(wpath, wmode);
+#else
+    return fopen(path, mode);
+#endif
+}
+
+static bool DerpMap_KeyIs(const DerpMapParser* parser, const char* key)
+{
+    size_t length = strlen(key);
+    return parser->key_length == length && memcmp(parser->key, key, length) == 0;
+}
+
+static uint8_t DerpMap_KeyRole(const DerpMapParser* parser)
+{
+    switch (parser->role[parser->depth - 1])
+    {
+    case DERP_MAP_ROOT:
+        return DerpMap_KeyIs(parser, "Regions") ? DERP_MAP_REGIONS : DERP_MAP_OTHER;
+    case DERP_MAP_REGIONS:
+        return DERP_MAP_REGION;
+    case DERP_MAP_REGION:
+        return DerpMap_KeyIs(parser, "RegionID") ? DERP_MAP_REGION_ID
+            : DerpMap_KeyIs(parser, "Nodes") ? DERP_MAP_NODES : DERP_MAP_OTHER;
+    case DERP_MAP_FIRST_NODE:
+        return DerpMap_KeyIs(parser, "HostName") ? DERP_MAP_HOST_NAME : DERP_MAP_OTHER;
+    default:
+        return DERP_MAP_OTHER;
+    }
+}
+
+static uint8_t DerpMap_ValueRole(DerpMapParser* parser)
+{
+    if (parser->depth == 0)
+    {
+        return DERP_MAP_ROOT;
+    }
+    uint32_t top = parser->depth - 1;
+    if (parser->container[top] == '{')
+    {
+        return parser->key_role;
+    }
+    uint32_t index = parser->index[top]++;
+    return parser->role[top] == DERP_MAP_NODES && index == 0 ? DERP_MAP_FIRST_NODE : DERP_MAP_OTHER;
+}
+
+static void DerpMap_EndValue(DerpMapParser* parser)
+{
+    parser->state = parser->depth ? DERP_MAP_NEXT : DERP_MAP_DONE;
+}
+
+static bool DerpMap_Push(DerpMapParser* parser, uint8_t container, uint8_t role)
+{
+    if (parser->depth == DERP_MAP_MAX_DEPTH)
+    {
+        return false;
+    }
+    parser->container[parser->depth] = container;
+    parser->role[parser->depth] = role;
+    parser->index[parser->depth] = 0;
+    parser->depth++;
+
+    if (role == DERP_MAP_REGION)
+    {
+        parser->has_id = false;
+        parser->id_valid = false;
+        parser->id = 0;
+        parser->has_host = false;
+        parser->host_length = 0;
+    }
+    parser->state = container == '{' ? DERP_MAP_KEY_OR_END : DERP_MAP_VALUE_OR_END;
+    return true;
+}
+
+static bool DerpMap_Pop(DerpMapParser* parser, uint8_t container)
+{
+    if (parser->depth == 0 || parser->container[parser->depth - 1] != container)
+    {
+        return false;
+    }
+    parser->depth--;
+
+    if (parser->role[parser->depth] == DERP_MAP_REGION && container == '{')
+    {
+        if (parser->has_id && parser->id_valid && parser->has_host)
+        {
+            parser->regions++;
+            parser->on_region(parser->context, parser->id, parser->host);
+        }
+        else
+        {
+            parser->regions_skipped++;
+        }
+    }
+    DerpMap_EndValue(parser);
+    return true;
+}
+
+static bool DerpMap_BeginValue(DerpMapParser* parser, char c)
+{
+    uint8_t role = DerpMap_ValueRole(parser);
+    switch (c)
+    {
+    case '{':
+    case '[':
+        return DerpMap_Push(parser, (uint8_t)c, role);
+    case '"':
+        parser->string_role = role;
+        if (role == DERP_MAP_HOST_NAME)
+        {
+            parser->host_length = 0;
+            parser->has_host = false;
+        }
+        parser->state = DERP_MAP_STRING;
+        return true;
+    case 't':
+    case 'f':
+    case 'n':
+        parser->literal = c;
+        parser->literal_at = 1;
+        parser->state = DERP_MAP_LITERAL;
+        return true;
+    default:
+        if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            parser->string_role = role;
+            if (role == DERP_MAP_REGION_ID)
+            {
+                parser->has_id = true;
+                parser->id_valid = c != '-';
+                parser->id = c != '-' ? (uint32_t)(c - '0') : 0;
+            }
+            parser->state = DERP_MAP_NUMBER;
+            return true;
+        }
+        return false;
+    }
+}
+
+static void DerpMap_AppendString(DerpMapParser* parser, char c)
+{
+    if (parser->string_role == DERP_MAP_KEY_STRING)
+    {
+        if (parser->key_length < DERP_MAP_MAX_KEY)
+        {
+            parser->key[parser->key_length++] = c;
+        }
+        else
+        {
+            parser->key_length = DERP_MAP_MAX_KEY + 1;
+        }
+    }
+    else if (parser->string_role == DERP_MAP_HOST_NAME)
+    {
+        if (parser->host_length < DERP_MAP_MAX_HOST - 1)
+        {
+            parser->host[parser->host_length++] = c;
+        }
+        else
+        {
+            parser->host_length = DERP_MAP_MAX_HOST;
+        }
+    }
+}
+
+static void DerpMap_AppendUnicode(DerpMapParser* parser, uint32_t code)
+{
+    if (code < 0x80)
+    {
+        DerpMap_AppendString(parser, (char)code);
+    }
+    else if (code < 0x800)
+    {
+        DerpMap_AppendString(parser, (char)(0xC0 | (code >> 6)));
+        DerpMap_AppendString(parser, (char)(0x80 | (code & 0x3F)));
+    }
+    else
+    {
+        DerpMap_AppendString(parser, (char)(0xE0 | (code >> 12)));
+        DerpMap_AppendString(parser, (char)(0x80 | ((code >> 6) & 0x3F)));
+        DerpMap_AppendString(parser, (char)(0x80 | (code & 0x3F)));
+    }
+}
+
+static bool DerpMap_EndString(DerpMapParser* parser)
+{
+    if (parser->string_role == DERP_MAP_KEY_STRING)
+    {
+        parser->key_role = DerpMap_KeyRole(parser);
+        parser->state = DERP_MAP_COLON;
+        return true;
+    }
+    if (parser->string_role == DERP_MAP_HOST_NAME && parser->host_length > 0 && parser->host_length < DERP_MAP_MAX_HOST)
+    {
+        parser->host[parser->host_length] = 0;
+        parser->has_host = true;
+    }
+    DerpMap_EndValue(parser);
+    return true;
+}
+
+static bool DerpMap_IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int DerpMap_HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// One character; false on a syntax error. *again is set when the character ended a number
+// and must be looked at once more in the new state.
+static bool DerpMap_Step(DerpMapParser* parser, char c, bool* again)
+{
+    switch (parser->state)
+    {
+    case DERP_MAP_VALUE:
+    case DERP_MAP_VALUE_OR_END:
+        if (DerpMap_IsSpace(c))
+        {
+            return true;
+        }
+        if (c == ']' && parser->state == DERP_MAP_VALUE_OR_END)
+        {
+            return DerpMap_Pop(parser, '[');
+        }
+        return DerpMap_BeginValue(parser, c);
+
+    case DERP_MAP_KEY_OR_END:
+    case DERP_MAP_KEY:
+        if (DerpMap_IsSpace(c))
+        {
+            return true;
+        }
+        if (c == '}' && parser->state == DERP_MAP_KEY_OR_END)
+        {
+            return DerpMap_Pop(parser, '{');
+        }
+        if (c != '"')
+        {
+            return false;
+        }
+        parser->string_role = DERP_MAP_KEY_STRING;
+        parser->key_length = 0;
+        parser->state = DERP_MAP_STRING;
+        return true;
+
+    case DERP_MAP_COLON:
+        if (DerpMap_IsSpace(c))
+        {
+            return true;
+        }
+        parser->state = DERP_MAP_VALUE;
+        return c == ':';
+
+    case DERP_MAP_NEXT:
+        if (DerpMap_IsSpace(c))
+        {
+            return true;
+        }
+        if (c == ',')
+        {
+            parser->state = parser->container[parser->depth - 1] == '{' ? DERP_MAP_KEY : DERP_MAP_VALUE;
+            return true;
+        }
+        if (c == '}' || c == ']')
+        {
+            return DerpMap_Pop(parser, (uint8_t)(c == '}' ? '{' : '['));
+        }
+        return false;
+
+    case DERP_MAP_STRING:
+        if (c == '"')
+        {
+            return DerpMap_EndString(parser);
+        }
+        if (c == '\\')
+        {
+            parser->state = DERP_MAP_ESCAPE;
+            return true;
+        }
+        if ((unsigned char)c < 0x20)
+        {
+            return false;
+        }
+        DerpMap_AppendString(parser, c);
+        return true;
+
+    case DERP_MAP_ESCAPE:
+    {
+        static const char from[] = "\"\\/bfnrt";
+        static const char to[] = "\"\\/\b\f\n\r\t";
+        parser->state = DERP_MAP_STRING;
+        if (c == 'u')
+        {
+            parser->unicode = 0;
+            parser->unicode_digits = 0;
+            parser->state = DERP_MAP_UNICODE;
+            return true;
+        }
+        const char* at = c ? strchr(from, c) : NULL;
+        if (!at)
+        {
+            return false;
+        }
+        DerpMap_AppendString(parser, to[at - from]);
+        return true;
+    }
+
+    case DERP_MAP_UNICODE:
+    {
+        int digit = DerpMap_HexDigit(c);
+        if (digit < 0)
+        {
+            return false;
+        }
+        parser->unicode = parser->unicode * 16 + (uint32_t)digit;
+        if (++parser->unicode_digits == 4)
+        {
+            DerpMap_AppendUnicode(parser, parser->unicode);
+            parser->state = DERP_MAP_STRING;
+        }
+        return true;
+    }
+
+    case DERP_MAP_NUMBER:
+        if (c >= '0' && c <= '9')
+        {
+            if (parser->string_role == DERP_MAP_REGION_ID)
+            {
+                uint32_t digit = (uint32_t)(c - '0');
+                if (parser->id > (UINT32_MAX - digit) / 10)
+                {
+                    parser->id_valid = false;
+                }
+                parser->id = parser->id * 10 + digit;
+            }
+            return true;
+        }
+        if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+        {
+            // not a region id, but still a number
+            if (parser->string_role == DERP_MAP_REGION_ID)
+            {
+                parser->id_valid = false;
+            }
+            return true;
+        }
+        DerpMap_EndValue(parser);
+        *again = true;
+        return true;
+
+    case DERP_MAP_LITERAL:
+    {
+        const char* word = parser->literal == 't' ? "true" : parser->literal == 'f' ? "false" : "null";
+        if (c != word[parser->literal_at])
+        {
+            return false;
+        }
+        if (word[++parser->literal_at] == 0)
+        {
+            DerpMap_EndValue(parser);
+        }
+        return true;
+    }
+
+    case DERP_MAP_DONE:
+        return DerpMap_IsSpace(c);
+
+    default:
+        return false;
+    }
+}
+
+void DerpMapParser_Init(DerpMapParser* parser, DerpMapRegion* on_region, void* context)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->on_region = on_region;
+    parser->context = context;
+    parser->state = DERP_MAP_VALUE;
+}
+
+bool DerpMapParser_Feed(DerpMapParser* parser, const void* data, size_t size)
+{
+    const char* bytes = data;
+    for (size_t i = 0; i < size && parser->state != DERP_MAP_ERROR; i++)
+    {
+        bool again = false;
+        if (!DerpMap_Step(parser, bytes[i], &again) || (again && !DerpMap_Step(parser, bytes[i], &again)))
+        {
+            parser->state = DERP_MAP_ERROR;
+            parser->bytes += i;
+            return false;
+        }
+    }
+    if (parser->state == DERP_MAP_ERROR)
+    {
+        return false;
+    }
+    parser->bytes += size;
+    return true;
+}
+
+bool DerpMapParser_Finish(const DerpMapParser* parser)
+{
+    return parser->state == DERP_MAP_DONE;
+}
+
+bool DerpMap_ParseFile(DerpMapParser* parser, const char* path)
+{
+    FILE* f = DerpMap_OpenFile(path, "rb");
+    if (!f)
+    {
+        return false;
+    }
+
+    char buffer[16 * 1024];
+    bool ok = true;
+    size_t read;
+    while (ok && (read = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    {
+        ok = DerpMapParser_Feed(parser, buffer, read);
+    }
+    ok = ok && !ferror(f);
+    fclose(f);
+    return ok && DerpMapParser_Finish(parser);
+}
+
+// Layout: "derp-map 1 <fetched_at>", "etag <value>", "last-modified <value>", each on its own line
+bool DerpMap_SaveCacheInfo(const DerpMapCacheInfo* info, const char* path)
+{
+    FILE* f = DerpMap_OpenFile(path, "wb");
+    if (!f)
+    {
+        return false;
+    }
+    fprintf(f, "derp-map 1 %llu\n", (unsigned long long)info->fetched_at);
+    fprintf(f, "etag %s\n", info->etag);
+    fprintf(f, "last-modified %s\n", info->last_modified);
+    bool ok = fflush(f) == 0 && !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static bool DerpMap_ReadField(FILE* f, const char* name, char* value, size_t value_size)
+{
+    char line[256];
+    size_t name_length = strlen(name);
+    if (!fgets(line, sizeof(line), f) || strncmp(line, name, name_length) != 0 || line[name_length] != ' ')
+    {
+        return false;
+    }
+
+    const char* start = line + name_length + 1;
+    size_t length = strcspn(start, "\r\n");
+    if (length >= value_size)
+    {
+        return false;
+    }
+    memcpy(value, start, length);
+    value[length] = 0;
+    return true;
+}
+
+bool DerpMap_LoadCacheInfo(DerpMapCacheInfo* info, const char* path)
+{
+    FILE* f = DerpMap_OpenFile(path, "rb");
+    if (!f)
+    {
+        return false;
+    }
+
+    DerpMapCacheInfo loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    unsigned version = 0;
+    unsigned long long fetched_at = 0;
+    bool ok = fscanf(f, "derp-map %u %llu", &version, &fetched_at) == 2 && version == 1 && fgetc(f) == '\n'
+        && DerpMap_ReadField(f, "etag", loaded.etag, sizeof(loaded.etag))
+        && DerpMap_ReadField(f, "last-modified", loaded.last_modified, sizeof(loaded.last_modified));
+    fclose(f);
+
+    if (ok)
+    {
+        loaded.fetched_at = fetched_at;
+        *info = loaded;
+    }
+    return ok;
+}
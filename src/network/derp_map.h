@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// DERP map reader and on-disk cache.
+//
+// The map (https://login.tailscale.com/derpmap/default) is a JSON document of
+// every region and its nodes; only the region ids and the host name of each
+// region's first node are needed. The parser is a streaming JSON lexer with a
+// fixed-size state: bytes are fed as they come off the socket or the cache
+// file, in chunks of any size, and every region is reported as soon as its
+// object closes. Nothing is allocated and the map may be any size.
+//
+//   { "Regions": { "<key>": { "RegionID": 1, "Nodes": [ { "HostName": "derp1.example.com", ... }, ... ], ... }, ... }, ... }
+//
+// The cache keeps the last map next to the config with its ETag and
+// Last-Modified, so a start within DERP_MAP_CACHE_FRESH of the last fetch
+// needs no network at all and later starts revalidate with a conditional
+// request that normally comes back as 304 Not Modified.
+
+#define DERP_MAP_MAX_DEPTH 32
+#define DERP_MAP_MAX_HOST 128            // longer host names are skipped
+#define DERP_MAP_MAX_KEY 16              // longer keys are never one of the keys looked for
+#define DERP_MAP_CACHE_FRESH (12 * 3600) // seconds a cached map is used without revalidating
+
+// Called for each region whose object had a RegionID and a first node with a HostName
+typedef void DerpMapRegion(void* context, uint32_t region_id, const char* host_name);
+
+typedef struct {
+    DerpMapRegion* on_region;
+    void* context;
+
+    // lexer
+    uint8_t state;
+    uint8_t after_string;        // state to go to when the current string ends
+    uint8_t string_role;         // role of the string being read, or the key marker
+    uint8_t unicode_digits;
+    uint32_t unicode;
+    char literal;                // first letter of true/false/null being read
+    uint8_t literal_at;
+
+    // open containers, [0] is the root value
+    uint32_t depth;
+    uint8_t container[DERP_MAP_MAX_DEPTH];  // '{' or '['
+    uint8_t role[DERP_MAP_MAX_DEPTH];       // what the container is, see derp_map.c
+    uint32_t index[DERP_MAP_MAX_DEPTH];     // next array index
+    uint8_t key_role;                        // role of the value after the current key
+
+    char key[DERP_MAP_MAX_KEY];
+    uint32_t key_length;                     // DERP_MAP_MAX_KEY + 1 once too long
+
+    // region being read
+    bool has_id;
+    bool id_valid;
+    uint32_t id;
+    char host[DERP_MAP_MAX_HOST];
+    uint32_t host_length;                    // DERP_MAP_MAX_HOST once too long
+    bool has_host;
+
+    // statistics
+    uint64_t bytes;
+    uint32_t regions;
+    uint32_t regions_skipped;    // region objects without an id or a host name
+} DerpMapParser;
+
+// Conditional request state of the cached map
+typedef struct {
+    char etag[128];
+    char last_modified[64];
+    uint64_t fetched_at;         // unix time the map was last downloaded or revalidated
+} DerpMapCacheInfo;
+
+void DerpMapParser_Init(DerpMapParser* parser, DerpMapRegion* on_region, void* context);
+
+// Feeds the next bytes; false on a syntax error, the parser then refuses further input
+bool DerpMapParser_Feed(DerpMapParser* parser, const void* data, size_t size);
+
+// True when one complete JSON value was read and nothing but whitespace followed
+bool DerpMapParser_Finish(const DerpMapParser* parser);
+
+// Streams a file through the parser; true when the file holds one complete document. UTF-8 path.
+bool DerpMap_ParseFile(DerpMapParser* parser, const char* path);
+
+// Cache info file; load returns false when missing or malformed. UTF-8 path.
+bool DerpMap_LoadCacheInfo(DerpMapCacheInfo* info, const char* path);
+bool DerpMap_SaveCacheInfo(const DerpMapCacheInfo* info, const char* path);
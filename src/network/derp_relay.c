@@ -0,0 +1,694 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // memmem, EPOLLEXCLUSIVE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// only the key and box helpers are used, the rest of derpnet.h stays unreferenced
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "derp_relay.h"
+
+#define DERP_RELAY_MAX_FRAME (1 << 16)
+#define DERP_RELAY_MAX_REQUEST 4096
+#define DERP_RELAY_READ_SIZE (256 * 1024)
+#define DERP_RELAY_TABLE_SIZE 4096        // hash buckets, power of two
+#define DERP_RELAY_EVENTS 256
+#define DERP_RELAY_READS_PER_EVENT 16     // then the client goes to the back of the ready list
+#define DERP_RELAY_CLIENT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+#define DERP_FRAME_SERVER_KEY 1
+#define DERP_FRAME_CLIENT_INFO 2
+#define DERP_FRAME_SERVER_INFO 3
+#define DERP_FRAME_SEND_PACKET 4
+#define DERP_FRAME_RECV_PACKET 5
+#define DERP_FRAME_PEER_GONE 8
+#define DERP_FRAME_PING 0x12
+#define DERP_FRAME_PONG 0x13
+
+#define DERP_PEER_GONE_NOT_HERE 1
+
+typedef enum {
+    DERP_RELAY_STATE_HTTP,          // waiting for the end of the upgrade request
+    DERP_RELAY_STATE_CLIENT_INFO,   // ServerKey sent, waiting for ClientInfo
+    DERP_RELAY_STATE_FORWARD,       // registered, SendPacket frames are forwarded
+} DerpRelayState;
+
+typedef struct DerpRelayWorker DerpRelayWorker;
+typedef struct DerpRelayClient DerpRelayClient;
+
+struct DerpRelayClient {
+    int fd;
+    DerpRelayState state;
+    uint8_t public_key[32];
+    DerpRelayClient* next_in_bucket;  // guarded by the table lock
+    DerpRelayClient* prev;            // worker's client list, owner thread only
+    DerpRelayClient* next;
+
+    // tail of an incomplete frame from the last read, owner thread only
+    uint8_t* partial;
+    size_t partial_size;
+
+    // bytes the socket did not take yet, written by any worker
+    pthread_mutex_t out_lock;
+    uint8_t* out;
+    size_t out_start;
+    size_t out_end;
+    size_t out_capacity;
+    bool broken;                      // write failed, owner closes on its next event
+};
+
+struct DerpRelayWorker {
+    DerpRelay* relay;
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    DerpRelayClient* clients;
+    uint8_t* scratch;
+
+    // updated by this worker only, summed by DerpRelay_GetStats
+    uint64_t frames_forwarded;
+    uint64_t bytes_forwarded;
+    uint64_t frames_dropped;
+    uint64_t pongs_received;
+};
+
+struct DerpRelay {
+    int listen_fd;
+    uint16_t port;
+    size_t max_queue;
+    bool ignore_pings;
+    DerpKey secret;
+    DerpKey public_key;
+    volatile bool stopping;
+    uint64_t clients;
+
+    // public key -> client, read locked while forwarding so a client cannot be freed under a sender
+    pthread_rwlock_t table_lock;
+    DerpRelayClient* table[DERP_RELAY_TABLE_SIZE];
+
+    uint32_t worker_count;
+    DerpRelayWorker* workers;
+};
+
+static bool DerpRelay_SetNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static DerpRelayClient** DerpRelay_Bucket(DerpRelay* relay, const uint8_t public_key[32])
+{
+    // keys are uniformly random, any four bytes make a good hash
+    return &relay->table[Get32LE(public_key) & (DERP_RELAY_TABLE_SIZE - 1)];
+}
+
+static DerpRelayClient* DerpRelay_Lookup(DerpRelay* relay, const uint8_t public_key[32])
+{
+    for (DerpRelayClient* client = *DerpRelay_Bucket(relay, public_key); client; client = client->next_in_bucket)
+    {
+        if (memcmp(client->public_key, public_key, 32) == 0) return client;
+    }
+    return NULL;
+}
+
+static void DerpRelay_Register(DerpRelay* relay, DerpRelayClient* client)
+{
+    // newest connection for a key wins, like a reconnecting derper client
+    pthread_rwlock_wrlock(&relay->table_lock);
+    DerpRelayClient** bucket = DerpRelay_Bucket(relay, client->public_key);
+    client->next_in_bucket = *bucket;
+    *bucket = client;
+    pthread_rwlock_unlock(&relay->table_lock);
+    __atomic_fetch_add(&relay->clients, 1, __ATOMIC_RELAXED);
+}
+
+static void DerpRelay_Unregister(DerpRelay* relay, DerpRelayClient* client)
+{
+    pthread_rwlock_wrlock(&relay->table_lock);
+    for (DerpRelayClient** link = DerpRelay_Bucket(relay, client->public_key); *link; link = &(*link)->next_in_bucket)
+    {
+        if (*link == client)
+        {
+            *link = client->next_in_bucket;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&relay->table_lock);
+    __atomic_fetch_sub(&relay->clients, 1, __ATOMIC_RELAXED);
+}
+
+// Writes what the socket takes right away and keeps the rest for EPOLLOUT.
+// Returns false when the frame was dropped because the client is too far behind.
+static bool DerpRelay_Queue(DerpRelay* relay, DerpRelayClient* client, const struct iovec* parts, int count)
+{
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += parts[i].iov_len;
+
+    pthread_mutex_lock(&client->out_lock);
+    size_t pending = client->out_end - client->out_start;
+    if (client->broken || pending + total > relay->max_queue)
+    {
+        pthread_mutex_unlock(&client->out_lock);
+        return false;
+    }
+
+    size_t skip = 0;
+    if (pending == 0)
+    {
+        struct msghdr message = { .msg_iov = (struct iovec*)parts, .msg_iovlen = (size_t)count };
+        ssize_t sent = sendmsg(client->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            client->broken = true;
+            pthread_mutex_unlock(&client->out_lock);
+            return false;
+        }
+        skip = sent > 0 ? (size_t)sent : 0;
+        client->out_start = client->out_end = 0;
+    }
+
+    if (skip < total)
+    {
+        size_t needed = pending + total - skip;
+        if (client->out_start != 0)
+        {
+            memmove(client->out, client->out + client->out_start, pending);
+            client->out_start = 0;
+            client->out_end = pending;
+        }
+        if (needed > client->out_capacity)
+        {
+            size_t capacity = client->out_capacity ? client->out_capacity * 2 : DERP_RELAY_MAX_FRAME;
+            while (capacity < needed) capacity *= 2;
+            uint8_t* out = realloc(client->out, capacity);
+            if (!out)
+            {
+                pthread_mutex_unlock(&client->out_lock);
+                return false;
+            }
+            client->out = out;
+            client->out_capacity = capacity;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            size_t size = parts[i].iov_len;
+            if (skip >= size)
+            {
+                skip -= size;
+                continue;
+            }
+            memcpy(client->out + client->out_end, (const uint8_t*)parts[i].iov_base + skip, size - skip);
+            client->out_end += size - skip;
+            skip = 0;
+        }
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    return true;
+}
+
+static bool DerpRelay_Flush(DerpRelayClient* client)
+{
+    pthread_mutex_lock(&client->out_lock);
+    while (!client->broken && client->out_start < client->out_end)
+    {
+        ssize_t sent = send(client->fd, client->out + client->out_start, client->out_end - client->out_start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) client->broken = true;
+            break;
+        }
+        client->out_start += (size_t)sent;
+    }
+    if (client->out_start == client->out_end)
+    {
+        client->out_start = client->out_end = 0;
+    }
+    bool ok = !client->broken;
+    pthread_mutex_unlock(&client->out_lock);
+    return ok;
+}
+
+static bool DerpRelay_SendFrame(DerpRelay* relay, DerpRelayClient* client, uint8_t type, const uint8_t* body, uint32_t size)
+{
+    uint8_t header[5];
+    header[0] = type;
+    Set32BE(header + 1, size);
+    struct iovec parts[2] = { { header, sizeof(header) }, { (void*)body, size } };
+    return DerpRelay_Queue(relay, client, parts, 2);
+}
+
+static void DerpRelay_Forward(DerpRelayWorker* worker, DerpRelayClient* client, const uint8_t* body, uint32_t size)
+{
+    DerpRelay* relay = worker->relay;
+
+    // SendPacket [dst key][nonce][box] -> RecvPacket [src key][nonce][box]
+    uint8_t header[5];
+    header[0] = DERP_FRAME_RECV_PACKET;
+    Set32BE(header + 1, size);
+    struct iovec parts[3] =
+    {
+        { header, sizeof(header) },
+        { client->public_key, 32 },
+        { (void*)(body + 32), size - 32 },
+    };
+
+    pthread_rwlock_rdlock(&relay->table_lock);
+    DerpRelayClient* target = DerpRelay_Lookup(relay, body);
+    bool forwarded = target && DerpRelay_Queue(relay, target, parts, 3);
+    pthread_rwlock_unlock(&relay->table_lock);
+
+    if (!target)
+    {
+        // like derper, the sender learns that the peer is not connected here
+        uint8_t gone[32 + 1];
+        memcpy(gone, body, 32);
+        gone[32] = DERP_PEER_GONE_NOT_HERE;
+        DerpRelay_SendFrame(relay, client, DERP_FRAME_PEER_GONE, gone, sizeof(gone));
+    }
+
+    if (forwarded)
+    {
+        __atomic_store_n(&worker->frames_forwarded, worker->frames_forwarded + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&worker->bytes_forwarded, worker->bytes_forwarded + size - 32, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_store_n(&worker->frames_dropped, worker->frames_dropped + 1, __ATOMIC_RELAXED);
+    }
+}
+
+// ClientInfo: [client key][nonce][box of json], answered with ServerInfo: [nonce][box of json]
+static bool DerpRelay_OnClientInfo(DerpRelay* relay, DerpRelayClient* client, uint8_t* body, uint32_t size)
+{
+    if (size < 32 + 24 + 16 || size > 1024) return false;
+
+    uint8_t* key = body;
+    uint8_t* nonce = key + 32;
+    uint8_t* auth = nonce + 24;
+    uint8_t* json = auth + 16;
+    if (!DerpNet__BoxUnseal(json, json, size - (32 + 24 + 16), auth, nonce, relay->secret.Bytes, key)) return false;
+    memcpy(client->public_key, key, 32);
+
+    // registered before ServerInfo goes out, so peers can reach this client once its DerpNet_Open returns
+    DerpRelay_Register(relay, client);
+    client->state = DERP_RELAY_STATE_FORWARD;
+
+    static const char server_info[] = "{\"version\": 2}";
+    uint8_t reply[24 + 16 + sizeof(server_info) - 1];
+    DerpNet__BoxSeal(reply, reply + 24, reply + 24 + 16, (const uint8_t*)server_info, sizeof(server_info) - 1, relay->secret.Bytes, key);
+    return DerpRelay_SendFrame(relay, client, DERP_FRAME_SERVER_INFO, reply, sizeof(reply));
+}
+
+// Handles every complete frame in data, returns how many bytes were consumed or SIZE_MAX on a protocol error
+static size_t DerpRelay_Process(DerpRelayWorker* worker, DerpRelayClient* client, uint8_t* data, size_t size)
+{
+    DerpRelay* relay = worker->relay;
+    size_t offset = 0;
+
+    if (client->state == DERP_RELAY_STATE_HTTP)
+    {
+        // request headers end with an empty line, fast start means no HTTP response
+        uint8_t* end = memmem(data, size, "\r\n\r\n", 4);
+        if (!end) return size > DERP_RELAY_MAX_REQUEST ? SIZE_MAX : 0;
+        offset = (size_t)(end - data) + 4;
+
+        static const uint8_t magic[8] = { 0x44, 0x45, 0x52, 0x50, 0xf0, 0x9f, 0x94, 0x91 };
+        uint8_t server_key[8 + 32];
+        memcpy(server_key, magic, 8);
+        memcpy(server_key + 8, relay->public_key.Bytes, 32);
+        if (!DerpRelay_SendFrame(relay, client, DERP_FRAME_SERVER_KEY, server_key, sizeof(server_key))) return SIZE_MAX;
+        client->state = DERP_RELAY_STATE_CLIENT_INFO;
+    }
+
+    while (size - offset >= 5)
+    {
+        uint8_t type = data[offset];
+        uint32_t body_size = Get32BE(data + offset + 1);
+        if (body_size > DERP_RELAY_MAX_FRAME) return SIZE_MAX;
+        if (size - offset < 5 + body_size) break;
+        uint8_t* body = data + offset + 5;
+
+        if (client->state == DERP_RELAY_STATE_CLIENT_INFO)
+        {
+            if (type != DERP_FRAME_CLIENT_INFO || !DerpRelay_OnClientInfo(relay, client, body, body_size)) return SIZE_MAX;
+        }
+        else if (type == DERP_FRAME_SEND_PACKET && body_size >= 32)
+        {
+            DerpRelay_Forward(worker, client, body, body_size);
+        }
+        else if (type == DERP_FRAME_PING && body_size == 8 && !relay->ignore_pings)
+        {
+            if (!DerpRelay_SendFrame(relay, client, DERP_FRAME_PONG, body, 8)) return SIZE_MAX;
+        }
+        else if (type == DERP_FRAME_PONG && body_size == 8)
+        {
+            __atomic_store_n(&worker->pongs_received, worker->pongs_received + 1, __ATOMIC_RELAXED);
+        }
+        offset += 5 + body_size;
+    }
+    return offset;
+}
+
+// Edge triggered, so reads until the socket is empty or the read budget is used up, in which case the
+// client is re-armed so one busy sender cannot starve the other clients of its worker.
+// Returns false when the client should be closed.
+static bool DerpRelay_OnReadable(DerpRelayWorker* worker, DerpRelayClient* client)
+{
+    for (int reads = 0;; reads++)
+    {
+        if (reads == DERP_RELAY_READS_PER_EVENT)
+        {
+            // modifying an edge triggered registration reports the socket again if it is still readable
+            struct epoll_event event = { .events = DERP_RELAY_CLIENT_EVENTS, .data.ptr = client };
+            return epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == 0;
+        }
+
+        uint8_t* buffer = worker->scratch;
+        size_t size = client->partial_size;
+        if (size) memcpy(buffer, client->partial, size);  // partial is NULL while nothing is left over
+
+        ssize_t received = recv(client->fd, buffer + size, DERP_RELAY_READ_SIZE - size, 0);
+        if (received == 0) return false;
+        if (received < 0)
+        {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        size += (size_t)received;
+
+        size_t used = DerpRelay_Process(worker, client, buffer, size);
+        if (used == SIZE_MAX) return false;
+
+        size_t left = size - used;
+        if (left == 0)
+        {
+            free(client->partial);
+            client->partial = NULL;
+            client->partial_size = 0;
+            continue;
+        }
+        if (left > client->partial_size)
+        {
+            uint8_t* partial = realloc(client->partial, left);
+            if (!partial) return false;
+            client->partial = partial;
+        }
+        memmove(client->partial, buffer + used, left);
+        client->partial_size = left;
+    }
+}
+
+static void DerpRelay_Close(DerpRelayWorker* worker, DerpRelayClient* client)
+{
+    if (client->state == DERP_RELAY_STATE_FORWARD)
+    {
+        // after this no forwarder can hold a pointer to the client
+        DerpRelay_Unregister(worker->relay, client);
+    }
+    if (client->prev) client->prev->next = client->next;
+    else worker->clients = client->next;
+    if (client->next) client->next->prev = client->prev;
+
+    close(client->fd);
+    pthread_mutex_destroy(&client->out_lock);
+    free(client->partial);
+    free(client->out);
+    free(client);
+}
+
+static void DerpRelay_Accept(DerpRelayWorker* worker)
+{
+    DerpRelay* relay = worker->relay;
+    for (;;)
+    {
+        int fd = accept(relay->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        DerpRelayClient* client = calloc(1, sizeof(DerpRelayClient));
+        if (!client || !DerpRelay_SetNonBlocking(fd))
+        {
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        pthread_mutex_init(&client->out_lock, NULL);
+
+        struct epoll_event event = { .events = DERP_RELAY_CLIENT_EVENTS, .data.ptr = client };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            pthread_mutex_destroy(&client->out_lock);
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->next = worker->clients;
+        if (worker->clients) worker->clients->prev = client;
+        worker->clients = client;
+    }
+}
+
+static void* DerpRelay_WorkerRun(void* arg)
+{
+    DerpRelayWorker* worker = arg;
+    DerpRelay* relay = worker->relay;
+    struct epoll_event events[DERP_RELAY_EVENTS];
+
+    while (!relay->stopping)
+    {
+        int count = epoll_wait(worker->epoll_fd, events, DERP_RELAY_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            if (ptr == relay)
+            {
+                DerpRelay_Accept(worker);
+                continue;
+            }
+            if (ptr == worker)
+            {
+                continue;   // woken by DerpRelay_Stop
+            }
+
+            DerpRelayClient* client = ptr;
+            uint32_t flags = events[i].events;
+            bool ok = true;
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                ok = DerpRelay_OnReadable(worker, client);
+            }
+            if (ok && (flags & EPOLLOUT))
+            {
+                ok = DerpRelay_Flush(client);
+            }
+            if (!ok || __atomic_load_n(&client->broken, __ATOMIC_RELAXED))
+            {
+                DerpRelay_Close(worker, client);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void DerpRelay_Free(DerpRelay* relay)
+{
+    for (uint32_t i = 0; i < relay->worker_count; i++)
+    {
+        DerpRelayWorker* worker = &relay->workers[i];
+        while (worker->clients)
+        {
+            DerpRelay_Close(worker, worker->clients);
+        }
+        if (worker->epoll_fd >= 0) close(worker->epoll_fd);
+        if (worker->wake_fd >= 0) close(worker->wake_fd);
+        free(worker->scratch);
+    }
+    if (relay->listen_fd >= 0) close(relay->listen_fd);
+    pthread_rwlock_destroy(&relay->table_lock);
+    free(relay->workers);
+    free(relay);
+}
+
+static void DerpRelay_Join(DerpRelay* relay, uint32_t started)
+{
+    relay->stopping = true;
+    for (uint32_t i = 0; i < started; i++)
+    {
+        uint64_t one = 1;
+        ssize_t written = write(relay->workers[i].wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+    for (uint32_t i = 0; i < started; i++)
+    {
+        pthread_join(relay->workers[i].thread, NULL);
+    }
+}
+
+DerpRelay* DerpRelay_Start(const DerpRelayConfig* config)
+{
+    DerpRelay* relay = calloc(1, sizeof(DerpRelay));
+    if (!relay) return NULL;
+    relay->listen_fd = -1;
+    relay->max_queue = config->max_queue ? config->max_queue : DERP_RELAY_DEFAULT_MAX_QUEUE;
+    relay->ignore_pings = config->ignore_pings;
+    pthread_rwlock_init(&relay->table_lock, NULL);
+    DerpNet_CreateNewKey(&relay->secret);
+    DerpNet_GetPublicKey(&relay->secret, &relay->public_key);
+
+    relay->worker_count = config->threads;
+    if (relay->worker_count == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        relay->worker_count = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    relay->workers = calloc(relay->worker_count, sizeof(DerpRelayWorker));
+    if (!relay->workers)
+    {
+        relay->worker_count = 0;
+        DerpRelay_Free(relay);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < relay->worker_count; i++)
+    {
+        relay->workers[i].epoll_fd = -1;
+        relay->workers[i].wake_fd = -1;
+    }
+
+    relay->listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int reuse = 1;
+    setsockopt(relay->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(config->port) };
+    addr.sin_addr.s_addr = htonl(config->any_address ? INADDR_ANY : INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (relay->listen_fd < 0 ||
+        bind(relay->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(relay->listen_fd, (struct sockaddr*)&addr, &addr_len) != 0 ||
+        listen(relay->listen_fd, SOMAXCONN) != 0 ||
+        !DerpRelay_SetNonBlocking(relay->listen_fd))
+    {
+        DerpRelay_Free(relay);
+        return NULL;
+    }
+    relay->port = ntohs(addr.sin_port);
+
+    for (uint32_t i = 0; i < relay->worker_count; i++)
+    {
+        DerpRelayWorker* worker = &relay->workers[i];
+        worker->relay = relay;
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->scratch = malloc(DERP_RELAY_READ_SIZE);
+
+        // every worker waits on the listener, EPOLLEXCLUSIVE wakes only one of them per connection
+        struct epoll_event listen_event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = relay };
+        struct epoll_event wake_event = { .events = EPOLLIN, .data.ptr = worker };
+        if (worker->epoll_fd < 0 || worker->wake_fd < 0 || !worker->scratch ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, relay->listen_fd, &listen_event) != 0 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &wake_event) != 0)
+        {
+            DerpRelay_Free(relay);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < relay->worker_count; i++)
+    {
+        if (pthread_create(&relay->workers[i].thread, NULL, DerpRelay_WorkerRun, &relay->workers[i]) != 0)
+        {
+            DerpRelay_Join(relay, i);
+            DerpRelay_Free(relay);
+            return NULL;
+        }
+    }
+    return relay;
+}
+
+uint16_t DerpRelay_GetPort(const DerpRelay* relay)
+{
+    return relay->port;
+}
+
+void DerpRelay_GetStats(DerpRelay* relay, DerpRelayStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->clients = __atomic_load_n(&relay->clients, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < relay->worker_count; i++)
+    {
+        DerpRelayWorker* worker = &relay->workers[i];
+        stats->frames_forwarded += __atomic_load_n(&worker->frames_forwarded, __ATOMIC_RELAXED);
+        stats->bytes_forwarded += __atomic_load_n(&worker->bytes_forwarded, __ATOMIC_RELAXED);
+        stats->frames_dropped += __atomic_load_n(&worker->frames_dropped, __ATOMIC_RELAXED);
+        stats->pongs_received += __atomic_load_n(&worker->pongs_received, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t DerpRelay_PingClients(DerpRelay* relay, const uint8_t data[8])
+{
+    uint32_t count = 0;
+    pthread_rwlock_rdlock(&relay->table_lock);
+    for (uint32_t i = 0; i < DERP_RELAY_TABLE_SIZE; i++)
+    {
+        for (DerpRelayClient* client = relay->table[i]; client; client = client->next_in_bucket)
+        {
+            count += DerpRelay_SendFrame(relay, client, DERP_FRAME_PING, data, 8);
+        }
+    }
+    pthread_rwlock_unlock(&relay->table_lock);
+    return count;
+}
+
+uint32_t DerpRelay_DropClients(DerpRelay* relay)
+{
+    uint32_t count = 0;
+    pthread_rwlock_rdlock(&relay->table_lock);
+    for (uint32_t i = 0; i < DERP_RELAY_TABLE_SIZE; i++)
+    {
+        for (DerpRelayClient* client = relay->table[i]; client; client = client->next_in_bucket)
+        {
+            // the owner sees the hangup on its epoll and frees the client there
+            shutdown(client->fd, SHUT_RDWR);
+            count++;
+        }
+    }
+    pthread_rwlock_unlock(&relay->table_lock);
+    return count;
+}
+
+void DerpRelay_Stop(DerpRelay* relay)
+{
+    DerpRelay_Join(relay, relay->worker_count);
+    DerpRelay_Free(relay);
+}
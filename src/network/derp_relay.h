@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Local stand-in for a DERP server, for load and latency tests on Linux (epoll).
+//
+// Speaks the plain HTTP subset DerpNet uses: HTTP Upgrade with fast start,
+// ServerKey, ClientInfo, ServerInfo, then SendPacket -> RecvPacket forwarding
+// by public key, Ping answered with Pong, and PeerGone sent back for a packet
+// to a peer that is not connected. Every worker thread runs its own
+// epoll loop and owns the clients it accepted; a frame for a client on another
+// worker is appended to that client's output queue under its lock and written
+// right away if the socket takes it, otherwise by the owner on EPOLLOUT. Frames
+// for unknown peers, or for peers whose queue is over the limit, are dropped
+// like derper does for slow clients.
+
+#define DERP_RELAY_DEFAULT_MAX_QUEUE (4u << 20)
+
+typedef struct DerpRelay DerpRelay;
+
+typedef struct {
+    uint16_t port;           // 0 picks a free port, see DerpRelay_GetPort
+    uint32_t threads;        // worker threads, 0 = one per CPU
+    bool any_address;        // listen on all interfaces instead of 127.0.0.1
+    size_t max_queue;        // bytes queued per client before its frames are dropped, 0 = default
+    bool ignore_pings;       // no Pong answers, stands in for a connection that went silent
+} DerpRelayConfig;
+
+typedef struct {
+    uint64_t clients;        // currently connected and past the handshake
+    uint64_t frames_forwarded;
+    uint64_t bytes_forwarded;
+    uint64_t frames_dropped; // unknown destination or destination queue full
+    uint64_t pongs_received; // answers to DerpRelay_PingClients
+} DerpRelayStats;
+
+// Returns NULL if the port cannot be bound
+DerpRelay* DerpRelay_Start(const DerpRelayConfig* config);
+
+uint16_t DerpRelay_GetPort(const DerpRelay* relay);
+
+void DerpRelay_GetStats(DerpRelay* relay, DerpRelayStats* stats);
+
+// Sends a Ping frame with data to every connected client, like derper probing its clients.
+// Returns how many it was queued for.
+uint32_t DerpRelay_PingClients(DerpRelay* relay, const uint8_t data[8]);
+
+// Cuts every client connection like a derper restart or a blip in front of it, while the
+// relay keeps accepting new ones. Returns how many were cut.
+uint32_t DerpRelay_DropClients(DerpRelay* relay);
+
+// Closes every client connection and frees the relay
+void DerpRelay_Stop(DerpRelay* relay);
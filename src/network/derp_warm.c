@@ -0,0 +1,315 @@
+#include <string.h>
+#include "derp_warm.h"
+
+// Lock held
+static void DerpWarm_SetTarget(DerpWarm* warm, const char* server, const uint8_t* key)
+{
+    size_t length = strlen(server);
+    if (length >= sizeof(warm->server))
+    {
+        length = 0;              // a truncated host name would only fail to resolve
+    }
+    memcpy(warm->server, server, length);
+    warm->server[length] = 0;
+
+    warm->has_key = key != NULL;
+    if (key)
+    {
+        memcpy(warm->key, key, sizeof(warm->key));
+    }
+    else
+    {
+        memset(warm->key, 0, sizeof(warm->key));
+    }
+}
+
+// Lock held: schedules the next open. A connection that answered a ping resets the backoff, so a
+// server that drops a proven connection is reconnected at once, but one that keeps failing or
+// keeps dropping fresh connections is retried less and less often.
+static void DerpWarm_Backoff(DerpWarm* warm, uint64_t now)
+{
+    warm->retry_us = now + (uint64_t)warm->backoff_ms * 1000;
+    uint32_t next = warm->backoff_ms ? 2 * warm->backoff_ms : DERP_WARM_MIN_BACKOFF_MS;
+    warm->backoff_ms = next < warm->config.max_backoff_ms ? next : warm->config.max_backoff_ms;
+}
+
+// Lock held
+static void DerpWarm_Drop(DerpWarm* warm, uint64_t now)
+{
+    warm->config.close(warm->config.context, warm->config.net);
+    warm->connected = false;
+    warm->deaths++;
+    DerpWarm_Backoff(warm, now);
+}
+
+// Lock held: opens a connection with the lock released. Returns with the lock held again.
+static void DerpWarm_Open(DerpWarm* warm)
+{
+    const DerpWarmConfig* config = &warm->config;
+
+    char server[DERP_WARM_MAX_SERVER];
+    uint8_t key[DERP_WARM_KEY_SIZE];
+    bool has_key = warm->has_key;
+    uint32_t generation = warm->generation;
+    memcpy(server, warm->server, sizeof(server));
+    memcpy(key, warm->key, sizeof(key));
+
+    warm->opening = true;
+    BuddyMutex_Unlock(&warm->lock);
+
+    uint64_t start = BuddyClock_NowUs();
+    bool ok = config->open(config->context, config->net, server, has_key ? key : NULL);
+    uint64_t end = BuddyClock_NowUs();
+
+    BuddyMutex_Lock(&warm->lock);
+    warm->opening = false;
+
+    if (generation != warm->generation || warm->stopping || warm->paused)
+    {
+        // reset, stopped or taken while opening; the next pass opens for the current target
+        if (ok)
+        {
+            config->close(config->context, config->net);
+        }
+    }
+    else if (ok)
+    {
+        warm->connected = true;
+        warm->opens++;
+        warm->last_open_us = end - start;
+        warm->ready_us = end;
+        warm->pong_id = warm->ping_id;
+        warm->next_ping_us = end + (uint64_t)config->ping_ms * 1000;
+    }
+    else
+    {
+        warm->open_failures++;
+        DerpWarm_Backoff(warm, end);
+    }
+    BuddyCond_Broadcast(&warm->changed);
+}
+
+// Lock held: reads what arrived, sends the next ping when due, drops a connection that failed
+// either or left the last ping unanswered for too long. Returns when to look again.
+static uint64_t DerpWarm_KeepAlive(DerpWarm* warm, uint64_t now)
+{
+    const DerpWarmConfig* config = &warm->config;
+
+    uint64_t pong = warm->pong_id;
+    bool alive = config->poll(config->context, config->net, &pong) >= 0;
+    if (pong > warm->pong_id && pong <= warm->ping_id)
+    {
+        warm->pong_id = pong;
+        warm->backoff_ms = 0;
+    }
+
+    bool waiting = warm->pong_id != warm->ping_id;
+    if (alive && waiting && now - warm->ping_sent_us >= (uint64_t)config->pong_timeout_ms * 1000)
+    {
+        alive = false;
+    }
+    if (alive && !waiting && now >= warm->next_ping_us)
+    {
+        warm->ping_id++;
+        warm->pings++;
+        warm->ping_sent_us = now;
+        warm->next_ping_us = now + (uint64_t)config->ping_ms * 1000;
+        alive = config->ping(config->context, config->net, warm->ping_id);
+        waiting = true;
+    }
+
+    if (!alive)
+    {
+        DerpWarm_Drop(warm, now);
+        BuddyCond_Broadcast(&warm->changed);
+        return warm->retry_us;
+    }
+    if (!waiting)
+    {
+        return warm->next_ping_us;
+    }
+    // the socket is not watched, so the pong is looked for again at the next ping or the timeout
+    uint64_t deadline = warm->ping_sent_us + (uint64_t)config->pong_timeout_ms * 1000;
+    return warm->next_ping_us < deadline ? warm->next_ping_us : deadline;
+}
+
+static void DerpWarm_Main(void* arg)
+{
+    DerpWarm* warm = arg;
+
+    BuddyMutex_Lock(&warm->lock);
+    while (!warm->stopping)
+    {
+        uint64_t now = BuddyClock_NowUs();
+        uint64_t wake_us = UINT64_MAX;
+
+        if (warm->paused || warm->server[0] == 0)
+        {
+            // nothing to do until resumed or given a server
+        }
+        else if (warm->connected)
+        {
+            wake_us = DerpWarm_KeepAlive(warm, now);
+        }
+        else if (now >= warm->retry_us)
+        {
+            DerpWarm_Open(warm);
+            continue;
+        }
+        else
+        {
+            wake_us = warm->retry_us;
+        }
+
+        if (wake_us == UINT64_MAX)
+        {
+            BuddyCond_Wait(&warm->changed, &warm->lock);
+        }
+        else
+        {
+            now = BuddyClock_NowUs();
+            if (wake_us > now)
+            {
+                uint64_t wait_ms = (wake_us - now + 999) / 1000;
+                BuddyCond_WaitTimeout(&warm->changed, &warm->lock, wait_ms < UINT32_MAX ? (uint32_t)wait_ms : UINT32_MAX - 1);
+            }
+        }
+    }
+    BuddyMutex_Unlock(&warm->lock);
+}
+
+bool DerpWarm_Start(DerpWarm* warm, const DerpWarmConfig* config, const char* server, const uint8_t* key)
+{
+    memset(warm, 0, sizeof(*warm));
+    warm->config = *config;
+    if (warm->config.ping_ms == 0) warm->config.ping_ms = DERP_WARM_DEFAULT_PING_MS;
+    if (warm->config.pong_timeout_ms == 0) warm->config.pong_timeout_ms = DERP_WARM_DEFAULT_PONG_TIMEOUT_MS;
+    if (warm->config.max_backoff_ms == 0) warm->config.max_backoff_ms = DERP_WARM_DEFAULT_MAX_BACKOFF_MS;
+    DerpWarm_SetTarget(warm, server, key);
+
+    BuddyMutex_Init(&warm->lock);
+    BuddyCond_Init(&warm->changed);
+    warm->running = true;
+    if (!BuddyThread_Start(&warm->thread, DerpWarm_Main, warm))
+    {
+        warm->running = false;
+        BuddyCond_Destroy(&warm->changed);
+        BuddyMutex_Destroy(&warm->lock);
+        return false;
+    }
+    return true;
+}
+
+void DerpWarm_Stop(DerpWarm* warm)
+{
+    if (!warm->running)
+    {
+        return;
+    }
+
+    BuddyMutex_Lock(&warm->lock);
+    warm->stopping = true;
+    BuddyCond_Broadcast(&warm->changed);
+    BuddyMutex_Unlock(&warm->lock);
+    BuddyThread_Join(warm->thread);
+
+    if (warm->connected)
+    {
+        warm->config.close(warm->config.context, warm->config.net);
+        warm->connected = false;
+    }
+    warm->running = false;
+    BuddyCond_Destroy(&warm->changed);
+    BuddyMutex_Destroy(&warm->lock);
+}
+
+void DerpWarm_Reset(DerpWarm* warm, const char* server, const uint8_t* key)
+{
+    if (!warm->running)
+    {
+        return;
+    }
+
+    BuddyMutex_Lock(&warm->lock);
+    DerpWarm_SetTarget(warm, server, key);
+    warm->generation++;
+    if (warm->connected)
+    {
+        warm->config.close(warm->config.context, warm->config.net);
+        warm->connected = false;
+    }
+    warm->retry_us = 0;
+    warm->backoff_ms = 0;
+    BuddyCond_Broadcast(&warm->changed);
+    BuddyMutex_Unlock(&warm->lock);
+}
+
+bool DerpWarm_Take(DerpWarm* warm, void* net, uint32_t wait_ms)
+{
+    if (!warm->running)
+    {
+        return false;
+    }
+
+    bool taken = false;
+    BuddyMutex_Lock(&warm->lock);
+
+    uint64_t deadline = BuddyClock_NowUs() + (uint64_t)wait_ms * 1000;
+    while (warm->opening && !warm->paused)
+    {
+        uint64_t now = BuddyClock_NowUs();
+        if (now >= deadline)
+        {
+            break;
+        }
+        BuddyCond_WaitTimeout(&warm->changed, &warm->lock, (uint32_t)((deadline - now + 999) / 1000));
+    }
+
+    warm->paused = true;
+    if (warm->connected)
+    {
+        // a connection that died since the last keepalive is not worth handing out
+        uint64_t pong = warm->pong_id;
+        if (warm->config.poll(warm->config.context, warm->config.net, &pong) < 0)
+        {
+            DerpWarm_Drop(warm, BuddyClock_NowUs());
+        }
+        else
+        {
+            memcpy(net, warm->config.net, warm->config.net_size);
+            warm->connected = false;
+            warm->takes++;
+            taken = true;
+        }
+    }
+    BuddyCond_Broadcast(&warm->changed);
+    BuddyMutex_Unlock(&warm->lock);
+    return taken;
+}
+
+void DerpWarm_Resume(DerpWarm* warm)
+{
+    if (!warm->running)
+    {
+        return;
+    }
+
+    BuddyMutex_Lock(&warm->lock);
+    warm->paused = false;
+    warm->retry_us = 0;
+    BuddyCond_Broadcast(&warm->changed);
+    BuddyMutex_Unlock(&warm->lock);
+}
+
+bool DerpWarm_IsReady(DerpWarm* warm)
+{
+    if (!warm->running)
+    {
+        return false;
+    }
+
+    BuddyMutex_Lock(&warm->lock);
+    bool ready = warm->connected;
+    BuddyMutex_Unlock(&warm->lock);
+    return ready;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "platform.h"
+
+// Pre-opened DERP connection.
+//
+// Opening a DERP connection takes DNS, the TCP connect, TLS, the HTTP upgrade
+// and the ServerKey/ClientInfo/ServerInfo exchange, several round trips that
+// used to sit between the click on Share or Connect and the first frame. A
+// warm connection is opened on a background thread ahead of time and kept
+// alive with DERP pings. One that fails a read or leaves a ping unanswered
+// past the pong timeout is closed and opened again, with a growing backoff
+// while the server cannot be reached.
+//
+// DerpWarm_Take hands the live connection to the session and stops warming
+// until DerpWarm_Resume, so the session and a warm connection never hold the
+// same key on the server at once (the server keeps only the newest).
+//
+// Like NetThread the module does not touch DerpNet itself, the callbacks do,
+// so it does not depend on how DerpNet is configured in the caller's TU.
+
+#define DERP_WARM_MAX_SERVER 256
+#define DERP_WARM_KEY_SIZE 32
+#define DERP_WARM_DEFAULT_PING_MS 15000          // well inside NAT and proxy idle timeouts
+#define DERP_WARM_DEFAULT_PONG_TIMEOUT_MS 5000
+#define DERP_WARM_DEFAULT_MAX_BACKOFF_MS 30000
+#define DERP_WARM_MIN_BACKOFF_MS 250
+
+// Warm thread, no locks held: opens a connection to server into net. May block.
+// key is the secret to open with, NULL when every connection gets a new one.
+typedef bool DerpWarmOpen(void* context, void* net, const char* server, const uint8_t* key);
+
+// Closes a connection open succeeded on
+typedef void DerpWarmClose(void* context, void* net);
+
+// Module lock held, must not block: queues a ping carrying id and writes it. False when disconnected.
+typedef bool DerpWarmPing(void* context, void* net, uint64_t id);
+
+// Module lock held, must not block: reads and drops whatever arrived. -1 when disconnected,
+// otherwise 0 and *pong set to the id of the latest pong received (left alone when none came).
+typedef int DerpWarmPoll(void* context, void* net, uint64_t* pong);
+
+typedef struct {
+    void* net;                   // connection storage the callbacks work on
+    size_t net_size;             // bytes DerpWarm_Take copies out of it
+    uint32_t ping_ms;            // 0 = DERP_WARM_DEFAULT_PING_MS
+    uint32_t pong_timeout_ms;    // 0 = DERP_WARM_DEFAULT_PONG_TIMEOUT_MS
+    uint32_t max_backoff_ms;     // 0 = DERP_WARM_DEFAULT_MAX_BACKOFF_MS
+    DerpWarmOpen* open;
+    DerpWarmClose* close;
+    DerpWarmPing* ping;
+    DerpWarmPoll* poll;
+    void* context;
+} DerpWarmConfig;
+
+typedef struct {
+    DerpWarmConfig config;
+    BuddyThread thread;
+    BuddyMutex lock;
+    BuddyCond changed;           // connection state, server or flags below changed
+    bool running;
+    bool stopping;
+    bool paused;                 // taken, nothing is opened until DerpWarm_Resume
+    bool opening;                // open callback in progress
+    bool connected;              // config.net holds a live connection
+
+    char server[DERP_WARM_MAX_SERVER];
+    uint8_t key[DERP_WARM_KEY_SIZE];
+    bool has_key;
+    uint32_t generation;         // bumped by DerpWarm_Reset, an open for an older one is thrown away
+
+    uint64_t ping_id;            // last ping sent
+    uint64_t pong_id;            // last ping answered
+    uint64_t ping_sent_us;
+    uint64_t next_ping_us;
+    uint64_t ready_us;           // when the current connection finished opening
+    uint64_t retry_us;           // next open attempt
+    uint32_t backoff_ms;
+
+    // statistics
+    uint64_t opens;              // successful opens
+    uint64_t open_failures;
+    uint64_t deaths;             // warm connections that failed a read or a ping
+    uint64_t pings;
+    uint64_t takes;              // connections handed out
+    uint64_t last_open_us;       // duration of the last successful open
+} DerpWarm;
+
+// Starts the thread, which opens the first connection right away. NULL key = new key per connection.
+bool DerpWarm_Start(DerpWarm* warm, const DerpWarmConfig* config, const char* server, const uint8_t* key);
+
+// Stops the thread and closes the warm connection. Waits for an open in progress to return.
+void DerpWarm_Stop(DerpWarm* warm);
+
+// Closes the warm connection and opens one to server with key instead (settings or key changed)
+void DerpWarm_Reset(DerpWarm* warm, const char* server, const uint8_t* key);
+
+// Pauses warming and hands over the connection: true when a live one was copied to net
+// (config.net_size bytes), which the caller then owns. An open in progress is waited for up to
+// wait_ms. On false the caller opens its own connection. Either way call DerpWarm_Resume once the
+// caller's connection is closed.
+bool DerpWarm_Take(DerpWarm* warm, void* net, uint32_t wait_ms);
+
+// Starts warming again after DerpWarm_Take
+void DerpWarm_Resume(DerpWarm* warm);
+
+// True while a live connection is waiting to be taken
+bool DerpWarm_IsReady(DerpWarm* warm);
@@ -1,223 +1,486 @@
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <stdlib.h>
 #include <string.h>
+
+// only the key, box and connect race helpers are used, the rest of derpnet.h stays unreferenced
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1
+#define DERPNET_STATIC
+#include "external/derpnet.h"
 #include "direct_connection.h"
 
-#pragma comment(lib, "ws2_32.lib")
+#if defined(_WIN32)
+typedef SOCKET DirectSocket;
+typedef WSAPOLLFD DirectPollFd;
+#define DIRECT_SEND_FLAGS 0
+#else
+typedef int DirectSocket;
+typedef struct pollfd DirectPollFd;
+#define DIRECT_SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define DIRECT_MAGIC "BUDDYDC1"
+#define DIRECT_MAGIC_SIZE 8
+#define DIRECT_CHALLENGE_SIZE 16
+#define DIRECT_HELLO_SIZE (DIRECT_MAGIC_SIZE + DIRECT_KEY_SIZE + DIRECT_CHALLENGE_SIZE)
+#define DIRECT_ANSWER_SIZE (DIRECT_CHALLENGE_SIZE + 1)
+#define DIRECT_PROOF_SIZE (24 + 16 + DIRECT_ANSWER_SIZE)
+#define DIRECT_ACCEPT_SLICE_MS 100    // how often the worker looks at the stop flag while accepting
 
-// Frame format: [4 bytes size] [encrypted data]
-#define FRAME_HEADER_SIZE 4
+enum {
+    DIRECT_ROLE_ACCEPT,
+    DIRECT_ROLE_CONNECT,
+};
 
-bool DirectConnection_Init(DirectConnection* conn, const uint8_t* my_private_key, const uint8_t* peer_public_key)
+// >0 when ready, 0 when deadline passed, <0 on error
+static int DirectConnection_Wait(uintptr_t s, short events, uint64_t deadline_us)
 {
-    if (!conn || !my_private_key || !peer_public_key) return false;
-    
-    memset(conn, 0, sizeof(*conn));
-    conn->socket = INVALID_SOCKET;
-    memcpy(conn->my_private_key, my_private_key, 32);
-    memcpy(conn->peer_public_key, peer_public_key, 32);
-    
-    // Compute simple encryption nonce from key material (placeholder for ECDH)
-    // Real implementation would use proper Curve25519 ECDH
-    for (int i = 0; i < 32; i++)
+    for (;;)
+    {
+        uint64_t now = BuddyClock_NowUs();
+        int timeout_ms = deadline_us > now ? (int)((deadline_us - now + 999) / 1000) : 0;
+
+        DirectPollFd poll_fd = { .fd = (DirectSocket)s, .events = events };
+#if defined(_WIN32)
+        int result = WSAPoll(&poll_fd, 1, timeout_ms);
+#else
+        int result = poll(&poll_fd, 1, timeout_ms);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+#endif
+        return result;
+    }
+}
+
+static bool DirectConnection_WouldBlock(void)
+{
+#if defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Handshake messages are tiny, but the socket is non-blocking so a silent peer cannot hold the
+// worker past the deadline
+static bool DirectConnection_SendAll(uintptr_t s, const uint8_t* data, size_t size, uint64_t deadline_us)
+{
+    while (size != 0)
+    {
+        int sent = send((DirectSocket)s, (const char*)data, (int)size, DIRECT_SEND_FLAGS);
+        if (sent > 0)
+        {
+            data += sent;
+            size -= (size_t)sent;
+        }
+        else if (sent < 0 && DirectConnection_WouldBlock() && DirectConnection_Wait(s, POLLOUT, deadline_us) > 0)
+        {
+            continue;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool DirectConnection_RecvAll(uintptr_t s, uint8_t* data, size_t size, uint64_t deadline_us)
+{
+    while (size != 0)
     {
-        conn->shared_secret[i] = my_private_key[i] ^ peer_public_key[i];
+        int received = recv((DirectSocket)s, (char*)data, (int)size, 0);
+        if (received > 0)
+        {
+            data += received;
+            size -= (size_t)received;
+        }
+        else if (received < 0 && DirectConnection_WouldBlock() && DirectConnection_Wait(s, POLLIN, deadline_us) > 0)
+        {
+            continue;
+        }
+        else
+        {
+            return false;
+        }
     }
-    
     return true;
 }
 
-bool DirectConnection_Connect(DirectConnection* conn, const char* peer_ip, uint16_t peer_port)
+// Both ends send hello (magic, public key, challenge), check the peer's key, then prove the shared
+// key by sealing the peer's challenge together with their own role. The role keeps a proof from
+// being reflected back to its sender over a second connection.
+static bool DirectConnection_Handshake(uintptr_t s, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], uint8_t role)
 {
-    if (!conn || !peer_ip) return false;
-    
-    conn->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (conn->socket == INVALID_SOCKET)
+    uint64_t deadline_us = BuddyClock_NowUs() + (uint64_t)DIRECT_HANDSHAKE_TIMEOUT_MS * 1000;
+
+    DerpKey my_secret;
+    DerpKey my_public;
+    memcpy(my_secret.Bytes, secret, sizeof(my_secret.Bytes));
+    DerpNet_GetPublicKey(&my_secret, &my_public);
+
+    uint8_t hello[DIRECT_HELLO_SIZE];
+    uint8_t* challenge = hello + DIRECT_MAGIC_SIZE + DIRECT_KEY_SIZE;
+    memcpy(hello, DIRECT_MAGIC, DIRECT_MAGIC_SIZE);
+    memcpy(hello + DIRECT_MAGIC_SIZE, my_public.Bytes, DIRECT_KEY_SIZE);
+    DerpNet__GetRandom(challenge, DIRECT_CHALLENGE_SIZE);
+
+    uint8_t peer_hello[DIRECT_HELLO_SIZE];
+    if (!DirectConnection_SendAll(s, hello, sizeof(hello), deadline_us) ||
+        !DirectConnection_RecvAll(s, peer_hello, sizeof(peer_hello), deadline_us))
     {
         return false;
     }
-    
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(peer_port),
-    };
-    
-    if (inet_pton(AF_INET, peer_ip, &addr.sin_addr) != 1)
+    if (memcmp(peer_hello, DIRECT_MAGIC, DIRECT_MAGIC_SIZE) != 0 ||
+        memcmp(peer_hello + DIRECT_MAGIC_SIZE, peer, DIRECT_KEY_SIZE) != 0)
     {
-        closesocket(conn->socket);
-        conn->socket = INVALID_SOCKET;
         return false;
     }
-    
-    if (connect(conn->socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+
+    uint8_t answer[DIRECT_ANSWER_SIZE];
+    memcpy(answer, peer_hello + DIRECT_MAGIC_SIZE + DIRECT_KEY_SIZE, DIRECT_CHALLENGE_SIZE);
+    answer[DIRECT_CHALLENGE_SIZE] = role;
+
+    uint8_t proof[DIRECT_PROOF_SIZE];
+    DerpNet__BoxSeal(proof, proof + 24, proof + 24 + 16, answer, sizeof(answer), secret, peer);
+
+    uint8_t peer_proof[DIRECT_PROOF_SIZE];
+    if (!DirectConnection_SendAll(s, proof, sizeof(proof), deadline_us) ||
+        !DirectConnection_RecvAll(s, peer_proof, sizeof(peer_proof), deadline_us))
     {
-        closesocket(conn->socket);
-        conn->socket = INVALID_SOCKET;
         return false;
     }
-    
-    conn->connected = true;
-    return true;
+
+    uint8_t opened[DIRECT_ANSWER_SIZE];
+    if (!DerpNet__BoxUnseal(opened, peer_proof + 24 + 16, sizeof(opened), peer_proof + 24, peer_proof, secret, peer))
+    {
+        return false;
+    }
+
+    uint8_t expected[DIRECT_ANSWER_SIZE];
+    memcpy(expected, challenge, DIRECT_CHALLENGE_SIZE);
+    expected[DIRECT_CHALLENGE_SIZE] = role == DIRECT_ROLE_ACCEPT ? DIRECT_ROLE_CONNECT : DIRECT_ROLE_ACCEPT;
+    return memcmp(opened, expected, sizeof(expected)) == 0;
 }
 
-bool DirectConnection_Accept(DirectConnection* conn, SOCKET listen_socket)
+// Runs the handshake on a freshly connected socket, which is left in blocking mode when it passed
+static bool DirectConnection_Authenticate(uintptr_t s, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], uint8_t role, DirectStats* stats)
 {
-    if (!conn || listen_socket == INVALID_SOCKET) return false;
-    
-    struct sockaddr_in client_addr;
-    int addr_len = sizeof(client_addr);
-    
-    conn->socket = accept(listen_socket, (struct sockaddr*)&client_addr, &addr_len);
-    if (conn->socket == INVALID_SOCKET) return false;
-    
-    conn->connected = true;
+    uint64_t start = BuddyClock_NowUs();
+    DerpNet__SetBlocking(s, false);
+    if (!DirectConnection_Handshake(s, secret, peer, role))
+    {
+        stats->rejected++;
+        return false;
+    }
+    DerpNet__SetBlocking(s, true);
+    stats->handshake_us = BuddyClock_NowUs() - start;
     return true;
 }
 
-bool DirectConnection_Send(DirectConnection* conn, const void* data, size_t size)
+uintptr_t DirectConnection_Listen(uint16_t port)
 {
-    if (!conn || !conn->connected || !data || size == 0) return false;
+    uintptr_t listener = (uintptr_t)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == DIRECT_INVALID_SOCKET)
+    {
+        return DIRECT_INVALID_SOCKET;
+    }
 
-    // TODO: Add encryption here - for now using plain TCP on LAN
-    // Send frame: [4 byte size][data]
-    uint32_t net_size = htonl((uint32_t)size);
-    
-    int sent = send(conn->socket, (char*)&net_size, 4, 0);
-    if (sent != 4) return false;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(port),
+    };
 
-    sent = send(conn->socket, (const char*)data, (int)size, 0);
-    if (sent != (int)size) return false;
-    
-    conn->total_sent += size;
-    return true;
+    // non-blocking, so a connection reset between the poll and accept cannot block the worker
+    if (bind((DirectSocket)listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen((DirectSocket)listener, SOMAXCONN) != 0)
+    {
+        DerpNet__CloseSocket(listener);
+        return DIRECT_INVALID_SOCKET;
+    }
+    DerpNet__SetBlocking(listener, false);
+    return listener;
+}
+
+uint16_t DirectConnection_GetListenerPort(uintptr_t listener)
+{
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    if (listener == DIRECT_INVALID_SOCKET || getsockname((DirectSocket)listener, (struct sockaddr*)&addr, &size) != 0)
+    {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
 }
 
-int DirectConnection_Recv(DirectConnection* conn, void* buffer, size_t buffer_size)
+void DirectConnection_CloseSocket(uintptr_t socket)
 {
-    if (!conn || !conn->connected || !buffer || buffer_size == 0) return -1;
-    
-    // Read frame size
-    uint32_t net_size;
-    int received = recv(conn->socket, (char*)&net_size, 4, MSG_WAITALL);
-    if (received != 4) return received == 0 ? 0 : -1;
-    
-    uint32_t frame_size = ntohl(net_size);
-    if (frame_size == 0 || frame_size > sizeof(conn->recv_buffer)) return -1;
-    
-    // Read data frame
-    received = recv(conn->socket, (char*)conn->recv_buffer, frame_size, MSG_WAITALL);
-    if (received != (int)frame_size) return -1;
+    if (socket != DIRECT_INVALID_SOCKET)
+    {
+        DerpNet__CloseSocket(socket);
+    }
+}
 
-    // TODO: Add decryption here - for now using plain TCP on LAN
-    if (frame_size > buffer_size) return -1;
+uint32_t DirectConnection_LocalAddresses(uint8_t addresses[][4], uint32_t max)
+{
+    uint32_t count = 0;
 
-    memcpy(buffer, conn->recv_buffer, frame_size);
-    
-    conn->total_received += frame_size;
-    return (int)frame_size;
+    char host[256];
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* info = NULL;
+    if (gethostname(host, sizeof(host)) == 0 && getaddrinfo(host, NULL, &hints, &info) == 0)
+    {
+        for (const struct addrinfo* a = info; a && count < max; a = a->ai_next)
+        {
+            const uint8_t* ip = (const uint8_t*)&((const struct sockaddr_in*)a->ai_addr)->sin_addr;
+            bool seen = ip[0] == 127;   // loopback goes last, below
+            for (uint32_t i = 0; i < count && !seen; i++)
+            {
+                seen = memcmp(addresses[i], ip, 4) == 0;
+            }
+            if (!seen)
+            {
+                memcpy(addresses[count++], ip, 4);
+            }
+        }
+        freeaddrinfo(info);
+    }
+
+    // both ends on one machine; on another machine the handshake rejects whoever listens there
+    if (count < max)
+    {
+        static const uint8_t loopback[4] = { 127, 0, 0, 1 };
+        memcpy(addresses[count++], loopback, 4);
+    }
+    return count;
 }
 
-bool DirectConnection_HasData(DirectConnection* conn)
+size_t DirectOffer_Pack(const DirectOffer* offer, uint8_t out[DIRECT_OFFER_MAX_SIZE])
 {
-    if (!conn || !conn->connected) return false;
-    
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(conn->socket, &readfds);
-    
-    struct timeval timeout = {0, 0};
-    return select(0, &readfds, NULL, NULL, &timeout) > 0;
+    uint32_t count = offer->count < DIRECT_MAX_ADDRESSES ? offer->count : DIRECT_MAX_ADDRESSES;
+    out[0] = (uint8_t)offer->port;
+    out[1] = (uint8_t)(offer->port >> 8);
+    out[2] = (uint8_t)count;
+    memcpy(out + 3, offer->addresses, 4 * count);
+    return 3 + 4 * (size_t)count;
 }
 
-void DirectConnection_Close(DirectConnection* conn)
+bool DirectOffer_Unpack(DirectOffer* offer, const uint8_t* data, size_t size)
 {
-    if (!conn) return;
-    
-    if (conn->socket != INVALID_SOCKET)
+    if (size < 3 || data[2] == 0 || data[2] > DIRECT_MAX_ADDRESSES || size != 3 + 4 * (size_t)data[2])
     {
-        closesocket(conn->socket);
-        conn->socket = INVALID_SOCKET;
+        return false;
     }
-    
-    conn->connected = false;
+    memset(offer, 0, sizeof(*offer));
+    offer->port = (uint16_t)(data[0] | (data[1] << 8));
+    offer->count = data[2];
+    memcpy(offer->addresses, data + 3, 4 * (size_t)offer->count);
+    return offer->port != 0;
 }
 
-SOCKET DirectConnection_CreateListener(uint16_t port)
+uintptr_t DirectConnection_Accept(uintptr_t listener, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], uint32_t timeout_ms, DirectStats* stats)
 {
-    SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listen_socket == INVALID_SOCKET)
+    uint64_t start = BuddyClock_NowUs();
+    uint64_t deadline_us = start + (uint64_t)timeout_ms * 1000;
+
+    while (DirectConnection_Wait(listener, POLLIN, deadline_us) > 0)
     {
-        // Error: cannot create socket
-        return INVALID_SOCKET;
+        uintptr_t s = (uintptr_t)accept((DirectSocket)listener, NULL, NULL);
+        if (s == DIRECT_INVALID_SOCKET)
+        {
+            continue;
+        }
+        stats->connect_us = BuddyClock_NowUs() - start;
+        if (DirectConnection_Authenticate(s, secret, peer, DIRECT_ROLE_ACCEPT, stats))
+        {
+            return s;
+        }
+        DerpNet__CloseSocket(s);
     }
-    
-    // Allow address reuse (important for quick restart after crash)
-    BOOL reuse = TRUE;
-    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse)) == SOCKET_ERROR)
+    return DIRECT_INVALID_SOCKET;
+}
+
+uintptr_t DirectConnection_Connect(const DirectOffer* offer, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], DirectStats* stats)
+{
+    struct sockaddr_in addrs[DIRECT_MAX_ADDRESSES];
+    struct addrinfo infos[DIRECT_MAX_ADDRESSES];
+    uint32_t index[DIRECT_MAX_ADDRESSES];     // offer position of each remaining candidate
+    uint32_t count = offer->count < DIRECT_MAX_ADDRESSES ? offer->count : DIRECT_MAX_ADDRESSES;
+    for (uint32_t i = 0; i < count; i++)
     {
-        // Error: cannot set SO_REUSEADDR
-        int err = WSAGetLastError();
-        closesocket(listen_socket);
-        WSASetLastError(err);  // Restore error after closesocket
-        return INVALID_SOCKET;
+        index[i] = i;
     }
-    
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = INADDR_ANY,
-        .sin_port = htons(port),
-    };
-    
-    if (bind(listen_socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
-    {
-        // Error: cannot bind to port (might be in use or blocked)
-        int err = WSAGetLastError();
-        
-        // If permission denied and trying specific port, try dynamic port (0 = any available)
-        if (err == WSAEACCES && port != 0)
+
+    // a connection that fails the handshake (someone else listening on that address) drops the
+    // address and the rest are raced again
+    while (count != 0)
+    {
+        memset(infos, 0, sizeof(infos));
+        for (uint32_t i = 0; i < count; i++)
+        {
+            memset(&addrs[i], 0, sizeof(addrs[i]));
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_port = htons(offer->port);
+            memcpy(&addrs[i].sin_addr, offer->addresses[index[i]], 4);
+
+            infos[i].ai_family = AF_INET;
+            infos[i].ai_socktype = SOCK_STREAM;
+            infos[i].ai_protocol = IPPROTO_TCP;
+            infos[i].ai_addr = (struct sockaddr*)&addrs[i];
+            infos[i].ai_addrlen = sizeof(addrs[i]);
+            infos[i].ai_next = i + 1 < count ? &infos[i + 1] : NULL;
+        }
+
+        uint64_t start = BuddyClock_NowUs();
+        const struct addrinfo* connected = NULL;
+        uint32_t attempts, failures, winner;
+        uintptr_t s = DerpNet__ConnectRace(infos, DIRECT_CONNECT_TIMEOUT_MS, &connected, &attempts, &failures, &winner);
+        stats->connect_us += BuddyClock_NowUs() - start;
+        stats->attempts += attempts;
+        stats->failures += failures;
+        if (s == DIRECT_INVALID_SOCKET)
+        {
+            break;
+        }
+
+        // one family, so race order is offer order
+        uint32_t position = (uint32_t)(connected - infos);
+        stats->winner = index[position];
+        if (DirectConnection_Authenticate(s, secret, peer, DIRECT_ROLE_CONNECT, stats))
+        {
+            return s;
+        }
+        DerpNet__CloseSocket(s);
+
+        count--;
+        memmove(index + position, index + position + 1, (count - position) * sizeof(index[0]));
+    }
+    return DIRECT_INVALID_SOCKET;
+}
+
+static void DirectConnection_Main(void* arg)
+{
+    DirectConnection* conn = arg;
+    uintptr_t s = DIRECT_INVALID_SOCKET;
+
+    if (conn->accepting)
+    {
+        uint64_t start = BuddyClock_NowUs();
+        uint64_t deadline_us = start + (uint64_t)conn->timeout_ms * 1000;
+        for (;;)
         {
-            addr.sin_port = 0;  // Let OS choose any available port
-            if (bind(listen_socket, (struct sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR)
+            BuddyMutex_Lock(&conn->lock);
+            bool stopping = conn->stopping;
+            BuddyMutex_Unlock(&conn->lock);
+
+            uint64_t now = BuddyClock_NowUs();
+            if (stopping || now >= deadline_us)
+            {
+                break;
+            }
+
+            uint64_t left_ms = (deadline_us - now) / 1000;
+            s = DirectConnection_Accept(conn->listener, conn->secret, conn->peer, left_ms < DIRECT_ACCEPT_SLICE_MS ? (uint32_t)left_ms : DIRECT_ACCEPT_SLICE_MS, &conn->stats);
+            if (s != DIRECT_INVALID_SOCKET)
             {
-                // Success with dynamic port - WSA error cleared
-                goto bind_success;
+                conn->stats.connect_us = BuddyClock_NowUs() - start - conn->stats.handshake_us;
+                break;
             }
-            // If still fails, restore original error
-            err = WSAGetLastError();
         }
-        
-        closesocket(listen_socket);
-        WSASetLastError(err);  // Restore error after closesocket
-        return INVALID_SOCKET;
+
+        // one peer per offer, whoever connects later is refused
+        DirectConnection_CloseSocket(conn->listener);
+        conn->listener = DIRECT_INVALID_SOCKET;
+    }
+    else
+    {
+        s = DirectConnection_Connect(&conn->offer, conn->secret, conn->peer, &conn->stats);
     }
-    
-bind_success:
-    if (listen(listen_socket, SOMAXCONN) == SOCKET_ERROR)
+
+    BuddyMutex_Lock(&conn->lock);
+    conn->socket = s;
+    conn->done = true;
+    BuddyMutex_Unlock(&conn->lock);
+
+    if (conn->on_done)
     {
-        // Error: cannot listen
-        int err = WSAGetLastError();
-        closesocket(listen_socket);
-        WSASetLastError(err);  // Restore error after closesocket
-        return INVALID_SOCKET;
+        conn->on_done(conn->context);
     }
-    
-    return listen_socket;
 }
 
-uint16_t DirectConnection_GetListenerPort(SOCKET listen_socket)
+static bool DirectConnection_Start(DirectConnection* conn, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], DirectConnectionDone* on_done, void* context)
 {
-    if (listen_socket == INVALID_SOCKET) return 0;
-    
-    struct sockaddr_in addr;
-    int addr_len = sizeof(addr);
-    
-    if (getsockname(listen_socket, (struct sockaddr*)&addr, &addr_len) == SOCKET_ERROR)
+    memcpy(conn->secret, secret, DIRECT_KEY_SIZE);
+    memcpy(conn->peer, peer, DIRECT_KEY_SIZE);
+    conn->socket = DIRECT_INVALID_SOCKET;
+    conn->on_done = on_done;
+    conn->context = context;
+
+    BuddyMutex_Init(&conn->lock);
+    conn->running = true;
+    if (!BuddyThread_Start(&conn->thread, DirectConnection_Main, conn))
     {
-        return 0;
+        conn->running = false;
+        BuddyMutex_Destroy(&conn->lock);
+        DirectConnection_CloseSocket(conn->listener);
+        conn->listener = DIRECT_INVALID_SOCKET;
+        return false;
     }
-    
-    return ntohs(addr.sin_port);
+    return true;
+}
+
+bool DirectConnection_StartAccept(DirectConnection* conn, uintptr_t listener, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], uint32_t timeout_ms, DirectConnectionDone* on_done, void* context)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->accepting = true;
+    conn->listener = listener;
+    conn->timeout_ms = timeout_ms ? timeout_ms : DIRECT_DEFAULT_ACCEPT_MS;
+    return DirectConnection_Start(conn, secret, peer, on_done, context);
+}
+
+bool DirectConnection_StartConnect(DirectConnection* conn, const DirectOffer* offer, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], DirectConnectionDone* on_done, void* context)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->listener = DIRECT_INVALID_SOCKET;
+    conn->offer = *offer;
+    return DirectConnection_Start(conn, secret, peer, on_done, context);
+}
+
+uintptr_t DirectConnection_Take(DirectConnection* conn)
+{
+    if (!conn->running)
+    {
+        return DIRECT_INVALID_SOCKET;
+    }
+
+    BuddyMutex_Lock(&conn->lock);
+    uintptr_t s = conn->done ? conn->socket : DIRECT_INVALID_SOCKET;
+    conn->socket = DIRECT_INVALID_SOCKET;
+    BuddyMutex_Unlock(&conn->lock);
+    return s;
+}
+
+void DirectConnection_Stop(DirectConnection* conn)
+{
+    if (!conn->running)
+    {
+        return;
+    }
+
+    BuddyMutex_Lock(&conn->lock);
+    conn->stopping = true;
+    BuddyMutex_Unlock(&conn->lock);
+    BuddyThread_Join(conn->thread);
+
+    DirectConnection_CloseSocket(conn->listener);
+    conn->listener = DIRECT_INVALID_SOCKET;
+    DirectConnection_CloseSocket(conn->socket);
+    conn->socket = DIRECT_INVALID_SOCKET;
+    conn->running = false;
+    BuddyMutex_Destroy(&conn->lock);
 }
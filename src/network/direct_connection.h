@@ -1,53 +1,103 @@
 #pragma once
 
-#include <windows.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "platform.h"
 
-// Direct TCP connection with NaCl Box encryption (same as DERP)
-// Provides encrypted peer-to-peer connection over LAN
+// Encrypted LAN connection that bypasses the DERP relay.
+//
+// When both peers share a LAN every frame would otherwise hairpin through the
+// relay. The sharer listens on a TCP port and sends the viewer a DirectOffer
+// over the DERP session: the port and its IPv4 interface addresses. The viewer
+// races connects to all of them, the staggered race DerpNet_Open uses, so an
+// address on another subnet costs the stagger and not a SYN timeout.
+//
+// Before the socket is used both ends prove they hold the session keys. Each
+// sends its public key and a random challenge, then the other's challenge and
+// its own role sealed with the Curve25519 + XSalsa20-Poly1305 box for the
+// shared key. A connection from anyone else, to a stale listener on a reused
+// address, or one that reflects a proof back, fails and is dropped.
+//
+// The authenticated socket is handed to DerpNet_OpenDirect. The session then
+// writes the same sealed frames it writes to the relay, straight to the peer,
+// through the same non-blocking send queue, and switches over only once the
+// handshake confirmed the link.
+//
+// Accepting and connecting run on a worker thread, so the UI thread never
+// waits on the network.
+
+#define DIRECT_INVALID_SOCKET ((uintptr_t)-1)
+#define DIRECT_MAX_ADDRESSES 8
+#define DIRECT_OFFER_MAX_SIZE (2 + 1 + 4 * DIRECT_MAX_ADDRESSES)
+#define DIRECT_KEY_SIZE 32
+#define DIRECT_CONNECT_TIMEOUT_MS 1000      // a LAN peer answers well inside this
+#define DIRECT_HANDSHAKE_TIMEOUT_MS 1000
+#define DIRECT_DEFAULT_ACCEPT_MS 10000      // the listener is closed when nobody proved the keys by then
 
 typedef struct {
-    SOCKET socket;
-    uint8_t my_private_key[32];
-    uint8_t peer_public_key[32];
-    uint8_t shared_secret[32];
-    size_t total_sent;
-    size_t total_received;
-    uint8_t recv_buffer[65536];
-    size_t recv_buffer_size;
-    bool connected;
-} DirectConnection;
+    uint16_t port;
+    uint32_t count;
+    uint8_t addresses[DIRECT_MAX_ADDRESSES][4];   // IPv4, network order, in preference order
+} DirectOffer;
+
+typedef struct {
+    uint32_t attempts;           // connect: addresses tried in the race
+    uint32_t failures;           // connect: of those, refused or unreachable
+    uint32_t winner;             // connect: index of the offer address that connected
+    uint32_t rejected;           // connections that failed the handshake
+    uint64_t connect_us;         // connect: race, accept: until the first connection came in
+    uint64_t handshake_us;
+} DirectStats;
 
-// Initialize direct connection context
-bool DirectConnection_Init(DirectConnection* conn, const uint8_t* my_private_key, const uint8_t* peer_public_key);
+// Worker thread: the link is up (DirectConnection_Take returns it) or failed, called once
+typedef void DirectConnectionDone(void* context);
+
+typedef struct {
+    BuddyThread thread;
+    BuddyMutex lock;
+    bool running;
+    bool stopping;               // guarded by lock
+    bool done;                   // guarded by lock
+    bool accepting;
+    uintptr_t listener;          // accepting side, owned
+    uintptr_t socket;            // authenticated socket once done, guarded by lock
+    DirectOffer offer;           // connecting side
+    uint8_t secret[DIRECT_KEY_SIZE];
+    uint8_t peer[DIRECT_KEY_SIZE];
+    uint32_t timeout_ms;
+    DirectConnectionDone* on_done;
+    void* context;
+    DirectStats stats;           // valid once done
+} DirectConnection;
 
-// Connect to peer via TCP (client mode)
-bool DirectConnection_Connect(DirectConnection* conn, const char* peer_ip, uint16_t peer_port);
+// TCP listener on all interfaces, port 0 picks a free port. DIRECT_INVALID_SOCKET on failure.
+uintptr_t DirectConnection_Listen(uint16_t port);
 
-// Accept incoming connection (server mode)
-bool DirectConnection_Accept(DirectConnection* conn, SOCKET listen_socket);
+uint16_t DirectConnection_GetListenerPort(uintptr_t listener);
 
-// Create TCP listen socket (returns INVALID_SOCKET on failure)
-// If port is blocked, automatically tries dynamic port allocation
-SOCKET DirectConnection_CreateListener(uint16_t port);
+void DirectConnection_CloseSocket(uintptr_t socket);
 
-// Get the actual port number a listener is bound to
-uint16_t DirectConnection_GetListenerPort(SOCKET listen_socket);
+// IPv4 addresses of this machine, LAN ones first and loopback last, returns the count
+uint32_t DirectConnection_LocalAddresses(uint8_t addresses[][4], uint32_t max);
 
-// Send encrypted data to peer
-// Returns: true on success, false on error
-bool DirectConnection_Send(DirectConnection* conn, const void* data, size_t size);
+// Wire format: port (LE16), count, count IPv4 addresses. Pack returns bytes written.
+size_t DirectOffer_Pack(const DirectOffer* offer, uint8_t out[DIRECT_OFFER_MAX_SIZE]);
+bool DirectOffer_Unpack(DirectOffer* offer, const uint8_t* data, size_t size);
 
-// Receive and decrypt data from peer
-// Returns: number of bytes received, 0 if no data, -1 on error
-int DirectConnection_Recv(DirectConnection* conn, void* buffer, size_t buffer_size);
+// Blocking halves the worker runs, for tests. Accept waits up to timeout_ms for a connection that
+// passes the handshake, Connect races the offer addresses. Both return the authenticated socket in
+// blocking mode, or DIRECT_INVALID_SOCKET.
+uintptr_t DirectConnection_Accept(uintptr_t listener, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], uint32_t timeout_ms, DirectStats* stats);
+uintptr_t DirectConnection_Connect(const DirectOffer* offer, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], DirectStats* stats);
 
-// Check if data is available to receive (non-blocking)
-bool DirectConnection_HasData(DirectConnection* conn);
+// Starts the worker thread. StartAccept takes ownership of listener and keeps accepting for
+// timeout_ms (0 = DIRECT_DEFAULT_ACCEPT_MS).
+bool DirectConnection_StartAccept(DirectConnection* conn, uintptr_t listener, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], uint32_t timeout_ms, DirectConnectionDone* on_done, void* context);
+bool DirectConnection_StartConnect(DirectConnection* conn, const DirectOffer* offer, const uint8_t secret[DIRECT_KEY_SIZE], const uint8_t peer[DIRECT_KEY_SIZE], DirectConnectionDone* on_done, void* context);
 
-// Close connection and cleanup
-void DirectConnection_Close(DirectConnection* conn);
+// Hands the authenticated socket to the caller, DIRECT_INVALID_SOCKET when not done or failed
+uintptr_t DirectConnection_Take(DirectConnection* conn);
 
-// Create listening socket for incoming LAN connections
-SOCKET DirectConnection_CreateListener(uint16_t port);
+// Stops and joins the worker, closes the listener and a socket nobody took. Safe to call twice.
+void DirectConnection_Stop(DirectConnection* conn);
@@ -0,0 +1,172 @@
+#include <string.h>
+#include "fanout.h"
+
+static uint32_t Fanout_Limit(uint32_t value, uint32_t fallback)
+{
+    return value ? value : fallback;
+}
+
+void Fanout_Init(Fanout* fanout, const FanoutConfig* config)
+{
+    memset(fanout, 0, sizeof(*fanout));
+    if (config)
+    {
+        fanout->config = *config;
+    }
+    uint32_t frames = Fanout_Limit(fanout->config.max_in_flight, FANOUT_MAX_IN_FLIGHT);
+    fanout->config.max_in_flight = frames < FANOUT_MAX_IN_FLIGHT ? frames : FANOUT_MAX_IN_FLIGHT;
+    fanout->config.max_in_flight_bytes = Fanout_Limit(fanout->config.max_in_flight_bytes, FANOUT_DEFAULT_IN_FLIGHT_BYTES);
+    fanout->config.keyframe_interval_ms = Fanout_Limit(fanout->config.keyframe_interval_ms, FANOUT_DEFAULT_KEYFRAME_INTERVAL_MS);
+}
+
+int Fanout_Find(const Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE])
+{
+    for (int i = 0; i < FANOUT_MAX_VIEWERS; i++)
+    {
+        if (fanout->viewers[i].active && memcmp(fanout->viewers[i].key, key, FANOUT_KEY_SIZE) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Fanout_Add(Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE], uint64_t now_us)
+{
+    int index = Fanout_Find(fanout, key);
+    if (index < 0)
+    {
+        for (int i = 0; i < FANOUT_MAX_VIEWERS && index < 0; i++)
+        {
+            index = fanout->viewers[i].active ? -1 : i;
+        }
+        if (index < 0)
+        {
+            return -1;
+        }
+        fanout->count++;
+    }
+
+    // a viewer that connects again starts over, its decoder did too
+    FanoutViewer* viewer = &fanout->viewers[index];
+    memset(viewer, 0, sizeof(*viewer));
+    memcpy(viewer->key, key, FANOUT_KEY_SIZE);
+    viewer->active = true;
+    viewer->waiting_keyframe = true;
+    viewer->joined_us = now_us;
+    return index;
+}
+
+bool Fanout_Remove(Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE])
+{
+    int index = Fanout_Find(fanout, key);
+    if (index < 0)
+    {
+        return false;
+    }
+    memset(&fanout->viewers[index], 0, sizeof(fanout->viewers[index]));
+    fanout->count--;
+    return true;
+}
+
+static bool Fanout_Behind(const Fanout* fanout, const FanoutViewer* viewer, uint32_t size)
+{
+    if (viewer->in_flight == 0)
+    {
+        // a frame larger than the byte limit still goes to a viewer that caught up
+        return false;
+    }
+    return viewer->in_flight >= fanout->config.max_in_flight || viewer->in_flight_bytes + size > fanout->config.max_in_flight_bytes;
+}
+
+uint32_t Fanout_Select(Fanout* fanout, uint32_t sequence, uint32_t size, bool keyframe, uint8_t out[FANOUT_MAX_VIEWERS])
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < FANOUT_MAX_VIEWERS; i++)
+    {
+        FanoutViewer* viewer = &fanout->viewers[i];
+        if (!viewer->active)
+        {
+            continue;
+        }
+        if (Fanout_Behind(fanout, viewer, size))
+        {
+            // the frames after this one reference it, the viewer resumes at a keyframe
+            viewer->waiting_keyframe = true;
+            viewer->frames_skipped++;
+            continue;
+        }
+        if (viewer->waiting_keyframe && !keyframe)
+        {
+            viewer->frames_skipped++;
+            continue;
+        }
+
+        viewer->waiting_keyframe = false;
+        uint32_t slot = (viewer->head + viewer->in_flight) % FANOUT_MAX_IN_FLIGHT;
+        viewer->sequences[slot] = sequence;
+        viewer->sizes[slot] = size;
+        viewer->in_flight++;
+        viewer->in_flight_bytes += size;
+        viewer->frames_sent++;
+        viewer->bytes_sent += size;
+        out[count++] = (uint8_t)i;
+    }
+    return count;
+}
+
+void Fanout_Unsent(Fanout* fanout, uint32_t index)
+{
+    FanoutViewer* viewer = &fanout->viewers[index];
+    if (!viewer->active || viewer->in_flight == 0)
+    {
+        return;
+    }
+    uint32_t slot = (viewer->head + viewer->in_flight - 1) % FANOUT_MAX_IN_FLIGHT;
+    viewer->in_flight--;
+    viewer->in_flight_bytes -= viewer->sizes[slot];
+    viewer->frames_sent--;
+    viewer->bytes_sent -= viewer->sizes[slot];
+    viewer->frames_skipped++;
+    viewer->waiting_keyframe = true;
+}
+
+void Fanout_OnAck(Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE], uint32_t sequence)
+{
+    int index = Fanout_Find(fanout, key);
+    if (index < 0)
+    {
+        return;
+    }
+
+    // acknowledgments are cumulative, one that got lost is covered by the next
+    FanoutViewer* viewer = &fanout->viewers[index];
+    while (viewer->in_flight != 0 && (int32_t)(sequence - viewer->sequences[viewer->head]) >= 0)
+    {
+        viewer->in_flight_bytes -= viewer->sizes[viewer->head];
+        viewer->head = (viewer->head + 1) % FANOUT_MAX_IN_FLIGHT;
+        viewer->in_flight--;
+    }
+}
+
+bool Fanout_KeyframeNeeded(Fanout* fanout, uint64_t now_us)
+{
+    bool waiting = false;
+    for (uint32_t i = 0; i < FANOUT_MAX_VIEWERS; i++)
+    {
+        const FanoutViewer* viewer = &fanout->viewers[i];
+        // one still behind would skip the keyframe too
+        waiting = waiting || (viewer->active && viewer->waiting_keyframe && !Fanout_Behind(fanout, viewer, 0));
+    }
+    if (!waiting)
+    {
+        return false;
+    }
+    if (fanout->keyframe_asked_us != 0 && now_us - fanout->keyframe_asked_us < (uint64_t)fanout->config.keyframe_interval_ms * 1000)
+    {
+        return false;
+    }
+    fanout->keyframe_asked_us = now_us;
+    fanout->keyframes_asked++;
+    return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Which viewers of a share get an encoded frame.
+//
+// A share can have several viewers. The frame is encoded once, and the sharer seals it for every
+// viewer this picks (DerpNet keeps a shared key per peer, see DERPNET_SHARED_KEYS). All of them
+// leave on the one relay connection, and the relay drops frames for a viewer whose connection is
+// behind, which would leave that viewer decoding on a broken reference and, worse, keep the sharer
+// filling the relay for it. So every viewer acknowledges each frame it decoded, and the sharer
+// keeps a small window per viewer: a viewer with FANOUT_MAX_IN_FLIGHT frames or max_in_flight_bytes
+// not acknowledged yet is skipped until it caught up, and then gets nothing but a keyframe. Viewers
+// that keep up get every frame, whatever the slow one does.
+//
+// A viewer that joins, or skipped a frame, needs a keyframe. Encoding one for it makes every viewer
+// pay its size, so KeyframeNeeded asks for one at most every keyframe_interval_ms; a viewer on a link
+// too slow for the stream then sees a picture every interval instead of the stream turning into
+// keyframes for everyone.
+//
+// All times come from the caller. The sharer holds its network lock around all calls.
+
+#define FANOUT_MAX_VIEWERS 8
+#define FANOUT_KEY_SIZE 32
+#define FANOUT_MAX_IN_FLIGHT 8                       // frames sent and not acknowledged
+#define FANOUT_DEFAULT_IN_FLIGHT_BYTES (2u << 20)    // half the relay's queue per client
+#define FANOUT_DEFAULT_KEYFRAME_INTERVAL_MS 1000
+
+typedef struct {
+    uint32_t max_in_flight;           // frames, 0 = FANOUT_MAX_IN_FLIGHT, never more
+    uint32_t max_in_flight_bytes;     // 0 = FANOUT_DEFAULT_IN_FLIGHT_BYTES
+    uint32_t keyframe_interval_ms;    // 0 = FANOUT_DEFAULT_KEYFRAME_INTERVAL_MS
+} FanoutConfig;
+
+typedef struct {
+    uint8_t key[FANOUT_KEY_SIZE];
+    bool active;
+    bool waiting_keyframe;            // joined or missed a frame, gets the next keyframe first
+
+    // frames sent and not acknowledged yet, oldest first
+    uint32_t sequences[FANOUT_MAX_IN_FLIGHT];
+    uint32_t sizes[FANOUT_MAX_IN_FLIGHT];
+    uint32_t head;
+    uint32_t in_flight;
+    uint64_t in_flight_bytes;
+
+    uint64_t joined_us;
+    uint64_t frames_sent;
+    uint64_t frames_skipped;          // behind, or waiting for a keyframe
+    uint64_t bytes_sent;
+} FanoutViewer;
+
+typedef struct {
+    FanoutConfig config;
+    FanoutViewer viewers[FANOUT_MAX_VIEWERS];
+    uint32_t count;                   // active viewers
+    uint64_t keyframe_asked_us;       // 0 = never
+    uint64_t keyframes_asked;
+} Fanout;
+
+void Fanout_Init(Fanout* fanout, const FanoutConfig* config);
+
+// Index of the viewer, a new one waits for a keyframe. -1 when all FANOUT_MAX_VIEWERS are taken.
+int Fanout_Add(Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE], uint64_t now_us);
+bool Fanout_Remove(Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE]);
+int Fanout_Find(const Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE]);
+
+// Picks the viewers frame sequence goes to and counts it as in flight for them. Writes their
+// indices to out, returns how many.
+uint32_t Fanout_Select(Fanout* fanout, uint32_t sequence, uint32_t size, bool keyframe, uint8_t out[FANOUT_MAX_VIEWERS]);
+
+// The frame Select just picked viewer index for could not be sent to it, the sharer's queue had no
+// room: it is not in flight after all, and the viewer resumes at a keyframe.
+void Fanout_Unsent(Fanout* fanout, uint32_t index);
+
+// The viewer decoded frame sequence: it and every frame before it are no longer in flight
+void Fanout_OnAck(Fanout* fanout, const uint8_t key[FANOUT_KEY_SIZE], uint32_t sequence);
+
+// True when a viewer waits for a keyframe and none was asked for within the interval
+bool Fanout_KeyframeNeeded(Fanout* fanout, uint64_t now_us);
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+static void Latency_Set32(uint8_t* dst, uint32_t value)
+{
+    dst[0] = (uint8_t)(value);
+    dst[1] = (uint8_t)(value >> 8);
+    dst[2] = (uint8_t)(value >> 16);
+    dst[3] = (uint8_t)(value >> 24);
+}
+
+static void Latency_Set64(uint8_t* dst, uint64_t value)
+{
+    Latency_Set32(dst, (uint32_t)value);
+    Latency_Set32(dst + 4, (uint32_t)(value >> 32));
+}
+
+static uint32_t Latency_Get32(const uint8_t* src)
+{
+    return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static uint64_t Latency_Get64(const uint8_t* src)
+{
+    return (uint64_t)Latency_Get32(src) | ((uint64_t)Latency_Get32(src + 4) << 32);
+}
+
+void Latency_PackVideoHeader(uint8_t* out, const LatencyVideoHeader* header)
+{
+    Latency_Set32(out + 0, header->size);
+    Latency_Set32(out + 4, header->sequence);
+    Latency_Set64(out + 8, header->capture_us);
+    Latency_Set64(out + 16, header->send_us);
+    Latency_Set64(out + 24, (uint64_t)header->offset_us);
+    out[32] = header->flags;
+}
+
+void Latency_UnpackVideoHeader(const uint8_t* in, LatencyVideoHeader* header)
+{
+    header->size = Latency_Get32(in + 0);
+    header->sequence = Latency_Get32(in + 4);
+    header->capture_us = Latency_Get64(in + 8);
+    header->send_us = Latency_Get64(in + 16);
+    header->offset_us = (int64_t)Latency_Get64(in + 24);
+    header->flags = in[32];
+}
+
+void Latency_PackEcho(uint8_t* out, const LatencyEcho* echo)
+{
+    Latency_Set32(out + 0, echo->sequence);
+    Latency_Set64(out + 4, echo->capture_us);
+    Latency_Set64(out + 12, echo->sharer_send_us);
+    Latency_Set64(out + 20, echo->viewer_recv_us);
+    Latency_Set64(out + 28, echo->viewer_present_us);
+    Latency_Set64(out + 36, echo->viewer_echo_us);
+}
+
+void Latency_UnpackEcho(const uint8_t* in, LatencyEcho* echo)
+{
+    echo->sequence = Latency_Get32(in + 0);
+    echo->capture_us = Latency_Get64(in + 4);
+    echo->sharer_send_us = Latency_Get64(in + 12);
+    echo->viewer_recv_us = Latency_Get64(in + 20);
+    echo->viewer_present_us = Latency_Get64(in + 28);
+    echo->viewer_echo_us = Latency_Get64(in + 36);
+}
+
+bool Latency_SyncAddSample(LatencyClockSync* sync, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3)
+{
+    // the two clocks are unrelated, so only differences taken on one clock are meaningful
+    int64_t sharer_elapsed = (int64_t)(t3 - t0);
+    int64_t viewer_elapsed = (int64_t)(t2 - t1);
+    int64_t rtt = sharer_elapsed - viewer_elapsed;
+    if (sharer_elapsed < 0 || viewer_elapsed < 0 || rtt < 0)
+    {
+        return false;
+    }
+
+    // offset = ((t1 - t0) + (t2 - t3)) / 2, assuming symmetric one-way delays
+    int64_t forward = (int64_t)(t1 - t0);
+    int64_t backward = (int64_t)(t2 - t3);
+    LatencySyncSample sample = {
+        .offset_us = (forward + backward) / 2,
+        .rtt_us = rtt,
+    };
+
+    sync->samples[sync->next] = sample;
+    sync->next = (sync->next + 1) % LATENCY_SYNC_WINDOW;
+    if (sync->count < LATENCY_SYNC_WINDOW) sync->count++;
+
+    // the sample with the least queueing delay has the smallest asymmetry error
+    const LatencySyncSample* best = &sync->samples[0];
+    for (uint32_t i = 1; i < sync->count; i++)
+    {
+        if (sync->samples[i].rtt_us < best->rtt_us) best = &sync->samples[i];
+    }
+    sync->offset_us = best->offset_us;
+    sync->rtt_us = best->rtt_us;
+    sync->valid = true;
+    return true;
+}
+
+void Latency_StatsAdd(LatencyStats* stats, int64_t sample_us)
+{
+    stats->samples[stats->next] = sample_us;
+    stats->next = (stats->next + 1) % LATENCY_STATS_WINDOW;
+    if (stats->count < LATENCY_STATS_WINDOW) stats->count++;
+    stats->total++;
+}
+
+static int Latency_CompareInt64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t Latency_Rank(const int64_t* sorted, uint32_t count, double percentile)
+{
+    // nearest-rank: smallest value with at least percentile% of samples <= it
+    uint32_t rank = (uint32_t)(percentile / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+int64_t Latency_StatsPercentile(const LatencyStats* stats, double percentile)
+{
+    if (stats->count == 0) return 0;
+
+    int64_t sorted[LATENCY_STATS_WINDOW];
+    memcpy(sorted, stats->samples, stats->count * sizeof(sorted[0]));
+    qsort(sorted, stats->count, sizeof(sorted[0]), Latency_CompareInt64);
+    return Latency_Rank(sorted, stats->count, percentile);
+}
+
+void Latency_StatsSummary(const LatencyStats* stats, LatencySummary* summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    if (stats->count == 0) return;
+
+    int64_t sorted[LATENCY_STATS_WINDOW];
+    memcpy(sorted, stats->samples, stats->count * sizeof(sorted[0]));
+    qsort(sorted, stats->count, sizeof(sorted[0]), Latency_CompareInt64);
+
+    summary->p50_us = Latency_Rank(sorted, stats->count, 50.0);
+    summary->p95_us = Latency_Rank(sorted, stats->count, 95.0);
+    summary->p99_us = Latency_Rank(sorted, stats->count, 99.0);
+    summary->count = stats->count;
+}
+
+uint32_t Latency_SequenceObserve(LatencySequence* seq, uint32_t sequence)
+{
+    seq->received++;
+    if (!seq->started)
+    {
+        seq->started = true;
+        seq->expected = sequence + 1;
+        return 0;
+    }
+
+    // signed distance handles wrap-around of the 32-bit counter
+    int32_t gap = (int32_t)(sequence - seq->expected);
+    if (gap < 0)
+    {
+        seq->late++;
+        return 0;
+    }
+    seq->lost += (uint32_t)gap;
+    seq->expected = sequence + 1;
+    return (uint32_t)gap;
+}
+
+void Latency_Reset(LatencyTracker* tracker)
+{
+    memset(tracker, 0, sizeof(*tracker));
+}
+
+void Latency_SharerStampFrame(LatencyTracker* tracker, LatencyVideoHeader* header, uint32_t size, uint64_t capture_us, uint64_t send_us)
+{
+    header->size = size;
+    header->sequence = tracker->next_sequence++;
+    header->capture_us = capture_us;
+    header->send_us = send_us;
+    header->offset_us = tracker->sync.offset_us;
+    header->flags = tracker->sync.valid ? LATENCY_FLAG_OFFSET_VALID : 0;
+}
+
+bool Latency_SharerOnEcho(LatencyTracker* tracker, const LatencyEcho* echo, uint64_t now_us)
+{
+    if (!Latency_SyncAddSample(&tracker->sync, echo->sharer_send_us, echo->viewer_recv_us, echo->viewer_echo_us, now_us))
+    {
+        return false;
+    }
+
+    // bring the viewer's present time back onto the sharer clock
+    int64_t latency = (int64_t)(echo->viewer_present_us - echo->capture_us) - tracker->sync.offset_us;
+    if (latency < 0)
+    {
+        return false;
+    }
+    Latency_StatsAdd(&tracker->glass, latency);
+    return true;
+}
+
+bool Latency_ViewerOnPresent(LatencyTracker* tracker, const LatencyVideoHeader* header, uint64_t present_us)
+{
+    if (!(header->flags & LATENCY_FLAG_OFFSET_VALID))
+    {
+        return false;
+    }
+
+    int64_t latency = (int64_t)(present_us - header->capture_us) - header->offset_us;
+    if (latency < 0)
+    {
+        return false;
+    }
+    Latency_StatsAdd(&tracker->glass, latency);
+    return true;
+}
+
+bool Latency_ViewerShouldEcho(LatencyTracker* tracker, uint64_t now_us)
+{
+    if (tracker->last_echo_us != 0 && now_us - tracker->last_echo_us < LATENCY_ECHO_INTERVAL_US)
+    {
+        return false;
+    }
+    tracker->last_echo_us = now_us;
+    return true;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Glass-to-glass latency measurement.
+//
+// The sharer stamps every video frame with a sequence number, its capture time
+// and the time the first chunk was sent (sharer clock). The viewer periodically
+// echoes those values back together with its receive, present and echo-send
+// times (viewer clock). From each echo the sharer derives an NTP-style clock
+// offset sample; the offset with the lowest round trip in a sliding window is
+// used and sent back in later frame headers so both sides can convert
+// capture->present into one time base.
+
+#define LATENCY_VIDEO_HEADER_SIZE 33   // size, sequence, capture, send, offset, flags
+#define LATENCY_ECHO_SIZE 44           // sequence + 5 timestamps
+#define LATENCY_SYNC_WINDOW 16
+#define LATENCY_STATS_WINDOW 512
+#define LATENCY_ECHO_INTERVAL_US 200000
+
+#define LATENCY_FLAG_OFFSET_VALID 0x01
+
+// Follows BUDDY_PACKET_VIDEO in the first chunk of every frame
+typedef struct {
+    uint32_t size;           // encoded frame size in bytes
+    uint32_t sequence;       // frame counter, wraps
+    uint64_t capture_us;     // sharer clock
+    uint64_t send_us;        // sharer clock, first chunk handed to the network
+    int64_t offset_us;       // sharer's estimate of (viewer clock - sharer clock)
+    uint8_t flags;           // LATENCY_FLAG_*
+} LatencyVideoHeader;
+
+// Viewer -> sharer timing report for one presented frame
+typedef struct {
+    uint32_t sequence;
+    uint64_t capture_us;         // sharer clock, copied from the frame header
+    uint64_t sharer_send_us;     // sharer clock, copied from the frame header
+    uint64_t viewer_recv_us;     // viewer clock, first chunk received
+    uint64_t viewer_present_us;  // viewer clock, frame presented
+    uint64_t viewer_echo_us;     // viewer clock, echo sent
+} LatencyEcho;
+
+typedef struct {
+    int64_t offset_us;
+    int64_t rtt_us;
+} LatencySyncSample;
+
+// Minimum-RTT filtered clock offset estimator
+typedef struct {
+    LatencySyncSample samples[LATENCY_SYNC_WINDOW];
+    uint32_t count;
+    uint32_t next;
+    int64_t offset_us;       // viewer clock - sharer clock
+    int64_t rtt_us;          // round trip of the sample offset_us came from
+    bool valid;
+} LatencyClockSync;
+
+// Sliding window of latency samples for percentile queries
+typedef struct {
+    int64_t samples[LATENCY_STATS_WINDOW];
+    uint32_t count;
+    uint32_t next;
+    uint64_t total;
+} LatencyStats;
+
+typedef struct {
+    int64_t p50_us;
+    int64_t p95_us;
+    int64_t p99_us;
+    uint32_t count;
+} LatencySummary;
+
+// Detects lost and reordered frames from header sequence numbers
+typedef struct {
+    uint32_t expected;
+    bool started;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t late;
+} LatencySequence;
+
+// Per-session state kept by either side
+typedef struct {
+    LatencyClockSync sync;
+    LatencyStats glass;          // capture -> present
+    LatencySequence sequence;    // viewer: incoming frame sequence
+    uint32_t next_sequence;      // sharer: next frame sequence number
+    uint64_t last_echo_us;       // viewer: when the last echo was sent
+} LatencyTracker;
+
+// Serialize/parse the video frame header (little-endian)
+void Latency_PackVideoHeader(uint8_t* out, const LatencyVideoHeader* header);
+void Latency_UnpackVideoHeader(const uint8_t* in, LatencyVideoHeader* header);
+
+// Serialize/parse an echo payload (little-endian)
+void Latency_PackEcho(uint8_t* out, const LatencyEcho* echo);
+void Latency_UnpackEcho(const uint8_t* in, LatencyEcho* echo);
+
+// Add one exchange: t0 sharer send, t1 viewer receive, t2 viewer send, t3 sharer receive.
+// Returns false if the timestamps are inconsistent (negative round trip).
+bool Latency_SyncAddSample(LatencyClockSync* sync, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3);
+
+// Record a latency sample (microseconds)
+void Latency_StatsAdd(LatencyStats* stats, int64_t sample_us);
+
+// Nearest-rank percentile over the window; 0 if empty
+int64_t Latency_StatsPercentile(const LatencyStats* stats, double percentile);
+
+// p50/p95/p99 in one pass
+void Latency_StatsSummary(const LatencyStats* stats, LatencySummary* summary);
+
+// Track an incoming sequence number; returns number of frames skipped before it
+uint32_t Latency_SequenceObserve(LatencySequence* seq, uint32_t sequence);
+
+// Reset all state at the start of a session
+void Latency_Reset(LatencyTracker* tracker);
+
+// Sharer: fill the header for the next frame and advance the sequence
+void Latency_SharerStampFrame(LatencyTracker* tracker, LatencyVideoHeader* header, uint32_t size, uint64_t capture_us, uint64_t send_us);
+
+// Sharer: process an echo received at now_us; returns true if a latency sample was recorded
+bool Latency_SharerOnEcho(LatencyTracker* tracker, const LatencyEcho* echo, uint64_t now_us);
+
+// Viewer: record the latency of a presented frame; returns true if a sample was recorded
+bool Latency_ViewerOnPresent(LatencyTracker* tracker, const LatencyVideoHeader* header, uint64_t present_us);
+
+// Viewer: returns true (and arms the interval) when an echo should be sent at now_us
+bool Latency_ViewerShouldEcho(LatencyTracker* tracker, uint64_t now_us);
@@ -0,0 +1,469 @@
+#include <string.h>
+#include "net_thread.h"
+
+#if defined(_WIN32)
+// windows.h comes from platform.h
+#else
+#include <fcntl.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+#endif
+
+#define NET_QUEUE_HEADER (4 + NET_THREAD_PEER_SIZE)
+#define NET_QUEUE_WRAP UINT32_MAX
+#define NET_QUEUE_MAX_ENTRY NetQueue_EntrySize(NET_THREAD_MAX_PACKET)
+
+static uint32_t NetQueue_EntrySize(uint32_t size)
+{
+    return (NET_QUEUE_HEADER + size + 3) & ~3u;
+}
+
+static bool NetQueue_Fits(const NetQueue* queue, uint32_t entry)
+{
+    uint32_t free_bytes = queue->capacity - queue->used;
+    uint32_t to_end = queue->capacity - queue->tail;
+    if (entry <= to_end)
+    {
+        return entry <= free_bytes;
+    }
+    // the tail end is skipped and the entry goes to the front
+    return to_end <= free_bytes && entry <= free_bytes - to_end;
+}
+
+static bool NetQueue_Push(NetQueue* queue, const NetPacket* packet)
+{
+    uint32_t entry = NetQueue_EntrySize(packet->size);
+    if (!NetQueue_Fits(queue, entry))
+    {
+        return false;
+    }
+
+    if (entry > queue->capacity - queue->tail)
+    {
+        uint32_t wrap = NET_QUEUE_WRAP;
+        memcpy(queue->data + queue->tail, &wrap, sizeof(wrap));
+        queue->used += queue->capacity - queue->tail;
+        queue->tail = 0;
+    }
+
+    uint8_t* at = queue->data + queue->tail;
+    memcpy(at, &packet->size, 4);
+    memcpy(at + 4, packet->peer, NET_THREAD_PEER_SIZE);
+    memcpy(at + NET_QUEUE_HEADER, packet->data, packet->size);
+
+    queue->tail += entry;
+    if (queue->tail == queue->capacity)
+    {
+        queue->tail = 0;
+    }
+    queue->used += entry;
+    queue->packets++;
+    queue->total_packets++;
+    queue->total_bytes += packet->size;
+    return true;
+}
+
+static bool NetQueue_Pop(NetQueue* queue, NetPacket* packet, uint8_t* buffer)
+{
+    if (queue->packets == 0)
+    {
+        return false;
+    }
+
+    uint32_t size;
+    memcpy(&size, queue->data + queue->head, 4);
+    if (size == NET_QUEUE_WRAP)
+    {
+        queue->used -= queue->capacity - queue->head;
+        queue->head = 0;
+        memcpy(&size, queue->data, 4);
+    }
+
+    const uint8_t* at = queue->data + queue->head;
+    memcpy(packet->peer, at + 4, NET_THREAD_PEER_SIZE);
+    memcpy(buffer, at + NET_QUEUE_HEADER, size);
+    packet->data = buffer;
+    packet->size = size;
+
+    uint32_t entry = NetQueue_EntrySize(size);
+    queue->head += entry;
+    if (queue->head == queue->capacity)
+    {
+        queue->head = 0;
+    }
+    queue->used -= entry;
+    queue->packets--;
+
+    if (queue->packets == 0)
+    {
+        // start over at the front so the next burst does not wrap
+        queue->head = queue->tail = queue->used = 0;
+    }
+    return true;
+}
+
+// Called with queue_lock held: every channel can take the largest possible packet,
+// so the next recv never has to be thrown away
+static bool NetThread_HasRoom(const NetThread* thread)
+{
+    for (int i = 0; i < NET_CHANNEL_COUNT; i++)
+    {
+        if (!NetQueue_Fits(&thread->channels[i], NET_QUEUE_MAX_ENTRY))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Blocks until the socket may have news, wait_ms passed or NetThread_Wake/NetThread_Stop wakes us.
+// Returns false on timeout.
+static bool NetThread_WaitSocket(NetThread* thread, uint32_t wait_ms)
+{
+#if defined(_WIN32)
+    HANDLE handles[2] = { thread->config.socket_event, thread->wake_event };
+    return WaitForMultipleObjects(2, handles, FALSE, wait_ms == NET_THREAD_WAIT_FOREVER ? INFINITE : wait_ms) != WAIT_TIMEOUT;
+#else
+    struct pollfd fds[2] =
+    {
+        { .fd = thread->config.socket_fd, .events = POLLIN },
+        { .fd = thread->wake_fds[0], .events = POLLIN },
+    };
+    int timeout = wait_ms == NET_THREAD_WAIT_FOREVER || wait_ms > INT32_MAX ? -1 : (int)wait_ms;
+    int ready = poll(fds, 2, timeout);
+    if (ready > 0 && (fds[0].revents & POLLIN))
+    {
+#if defined(__linux__)
+        // DerpNet.EventFd is edge triggered: take the edges off its ready list, the read
+        // pass below drains the socket, so nothing is lost
+        struct epoll_event events[4];
+        epoll_wait(thread->config.socket_fd, events, 4, 0);
+#endif
+    }
+    if (ready > 0 && (fds[1].revents & POLLIN))
+    {
+        uint8_t wake[16];
+        ssize_t got = read(thread->wake_fds[0], wake, sizeof(wake));
+        (void)got;
+    }
+    return ready != 0;
+#endif
+}
+
+static void NetThread_Main(void* arg)
+{
+    NetThread* thread = arg;
+    const NetThreadConfig* config = &thread->config;
+    bool pending = true;       // start with a read pass, data may have arrived before Start
+    uint32_t wait_ms = NET_THREAD_WAIT_FOREVER;
+
+    for (;;)
+    {
+        bool timeout = false;
+        if (!pending)
+        {
+            timeout = !NetThread_WaitSocket(thread, wait_ms);
+        }
+
+        BuddyMutex_Lock(&thread->queue_lock);
+        if (pending && !thread->stopping && !NetThread_HasRoom(thread))
+        {
+            // a consumer is behind, leave the rest in the socket until it catches up
+            thread->waiting_for_space = true;
+            while (!thread->stopping && !NetThread_HasRoom(thread))
+            {
+                BuddyCond_Wait(&thread->space, &thread->queue_lock);
+            }
+            thread->waiting_for_space = false;
+        }
+        bool stopping = thread->stopping;
+        thread->wakeups++;
+        thread->timeouts += timeout;
+        BuddyMutex_Unlock(&thread->queue_lock);
+
+        if (stopping)
+        {
+            break;
+        }
+
+#if defined(_WIN32)
+        // reset before reading, whatever arrives after this signals again
+        ResetEvent(config->socket_event);
+#endif
+
+        bool notify = false;
+        bool notify_worker = false;
+        bool disconnected = false;
+        pending = false;
+
+        BuddyMutex_Lock(&thread->net_lock);
+        for (;;)
+        {
+            NetPacket packet;
+            int got = config->recv(config->context, &packet);
+            if (got < 0)
+            {
+                disconnected = true;
+                break;
+            }
+            if (got == 0)
+            {
+                break;
+            }
+
+            int channel = config->classify(config->context, &packet);
+
+            BuddyMutex_Lock(&thread->queue_lock);
+            if (channel >= 0 && channel < NET_CHANNEL_COUNT && packet.size <= NET_THREAD_MAX_PACKET)
+            {
+                NetQueue_Push(&thread->channels[channel], &packet);
+                if (config->worker_channels & (1u << channel))
+                {
+                    if (!thread->worker_signaled)
+                    {
+                        thread->worker_signaled = true;
+                        thread->worker_notifications++;
+                        notify_worker = true;
+                    }
+                }
+                else if (!thread->signaled)
+                {
+                    thread->signaled = true;
+                    thread->notifications++;
+                    notify = true;
+                }
+            }
+            else
+            {
+                thread->dropped++;
+            }
+            bool room = NetThread_HasRoom(thread);
+            if (!room)
+            {
+                thread->stalls++;
+            }
+            BuddyMutex_Unlock(&thread->queue_lock);
+
+            if (!room)
+            {
+                pending = true;
+                break;
+            }
+        }
+
+        if (!disconnected && config->flush && !config->flush(config->context))
+        {
+            disconnected = true;
+        }
+        wait_ms = config->wait ? config->wait(config->context) : NET_THREAD_WAIT_FOREVER;
+        BuddyMutex_Unlock(&thread->net_lock);
+
+        if (notify && config->notify)
+        {
+            config->notify(config->context, NET_THREAD_DATA);
+        }
+        if (notify_worker && config->notify)
+        {
+            config->notify(config->context, NET_THREAD_WORKER_DATA);
+        }
+
+        if (disconnected)
+        {
+            BuddyMutex_Lock(&thread->queue_lock);
+            thread->disconnected = true;
+            BuddyMutex_Unlock(&thread->queue_lock);
+
+            if (config->notify)
+            {
+                config->notify(config->context, NET_THREAD_DISCONNECTED);
+            }
+            break;
+        }
+    }
+}
+
+bool NetThread_Start(NetThread* thread, const NetThreadConfig* config)
+{
+    memset(thread, 0, sizeof(*thread));
+    thread->config = *config;
+
+    for (int i = 0; i < NET_CHANNEL_COUNT; i++)
+    {
+        uint32_t capacity = config->channel_bytes[i] ? config->channel_bytes[i] : NET_THREAD_DEFAULT_CHANNEL_BYTES;
+        capacity = (capacity + 3) & ~3u;
+        if (capacity < NET_QUEUE_MAX_ENTRY)
+        {
+            capacity = NET_QUEUE_MAX_ENTRY;
+        }
+        thread->channels[i].capacity = capacity;
+        thread->channels[i].data = malloc(capacity);
+        if (!thread->channels[i].data)
+        {
+            goto fail;
+        }
+    }
+
+#if defined(_WIN32)
+    thread->wake_event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!thread->wake_event)
+    {
+        goto fail;
+    }
+#else
+    thread->wake_fds[0] = thread->wake_fds[1] = -1;
+    if (pipe(thread->wake_fds) != 0)
+    {
+        goto fail;
+    }
+    fcntl(thread->wake_fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    BuddyMutex_Init(&thread->net_lock);
+    BuddyMutex_Init(&thread->queue_lock);
+    BuddyCond_Init(&thread->space);
+
+    if (!BuddyThread_Start(&thread->thread, NetThread_Main, thread))
+    {
+        BuddyCond_Destroy(&thread->space);
+        BuddyMutex_Destroy(&thread->queue_lock);
+        BuddyMutex_Destroy(&thread->net_lock);
+        goto fail;
+    }
+    thread->running = true;
+    return true;
+
+fail:
+#if defined(_WIN32)
+    if (thread->wake_event) CloseHandle(thread->wake_event);
+#else
+    if (thread->wake_fds[0] >= 0) close(thread->wake_fds[0]);
+    if (thread->wake_fds[1] >= 0) close(thread->wake_fds[1]);
+#endif
+    for (int i = 0; i < NET_CHANNEL_COUNT; i++)
+    {
+        free(thread->channels[i].data);
+    }
+    memset(thread, 0, sizeof(*thread));
+    return false;
+}
+
+void NetThread_Stop(NetThread* thread)
+{
+    if (!thread->running) return;
+
+    BuddyMutex_Lock(&thread->queue_lock);
+    thread->stopping = true;
+    BuddyCond_Broadcast(&thread->space);
+    BuddyMutex_Unlock(&thread->queue_lock);
+
+    NetThread_Wake(thread);
+    BuddyThread_Join(thread->thread);
+
+#if defined(_WIN32)
+    CloseHandle(thread->wake_event);
+#else
+    close(thread->wake_fds[0]);
+    close(thread->wake_fds[1]);
+#endif
+    BuddyCond_Destroy(&thread->space);
+    BuddyMutex_Destroy(&thread->queue_lock);
+    BuddyMutex_Destroy(&thread->net_lock);
+    for (int i = 0; i < NET_CHANNEL_COUNT; i++)
+    {
+        free(thread->channels[i].data);
+        thread->channels[i].data = NULL;
+        thread->channels[i].packets = 0;
+    }
+    thread->running = false;
+}
+
+void NetThread_Wake(NetThread* thread)
+{
+    if (!thread->running) return;
+
+#if defined(_WIN32)
+    SetEvent(thread->wake_event);
+#else
+    uint8_t wake = 1;
+    ssize_t written = write(thread->wake_fds[1], &wake, 1);
+    (void)written;
+#endif
+}
+
+void NetThread_Lock(NetThread* thread)
+{
+    if (thread->running)
+    {
+        BuddyMutex_Lock(&thread->net_lock);
+    }
+}
+
+void NetThread_Unlock(NetThread* thread)
+{
+    if (thread->running)
+    {
+        BuddyMutex_Unlock(&thread->net_lock);
+    }
+}
+
+// Called with queue_lock held
+static uint32_t NetThread_ReadyMask(const NetThread* thread, uint32_t channels)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < NET_CHANNEL_COUNT; i++)
+    {
+        if ((channels & (1u << i)) && thread->channels[i].packets)
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+uint32_t NetThread_TakeReady(NetThread* thread)
+{
+    if (!thread->running) return 0;
+
+    BuddyMutex_Lock(&thread->queue_lock);
+    thread->signaled = false;
+    uint32_t mask = NetThread_ReadyMask(thread, ~thread->config.worker_channels);
+    BuddyMutex_Unlock(&thread->queue_lock);
+    return mask;
+}
+
+uint32_t NetThread_TakeWorkerReady(NetThread* thread)
+{
+    if (!thread->running) return 0;
+
+    BuddyMutex_Lock(&thread->queue_lock);
+    thread->worker_signaled = false;
+    uint32_t mask = NetThread_ReadyMask(thread, thread->config.worker_channels);
+    BuddyMutex_Unlock(&thread->queue_lock);
+    return mask;
+}
+
+bool NetThread_Pop(NetThread* thread, NetChannel channel, NetPacket* packet, uint8_t* buffer)
+{
+    if (!thread->running) return false;
+
+    BuddyMutex_Lock(&thread->queue_lock);
+    bool ok = NetQueue_Pop(&thread->channels[channel], packet, buffer);
+    if (ok && thread->waiting_for_space)
+    {
+        BuddyCond_Signal(&thread->space);
+    }
+    BuddyMutex_Unlock(&thread->queue_lock);
+    return ok;
+}
+
+bool NetThread_IsDisconnected(NetThread* thread)
+{
+    if (!thread->running) return false;
+
+    BuddyMutex_Lock(&thread->queue_lock);
+    bool disconnected = thread->disconnected;
+    BuddyMutex_Unlock(&thread->queue_lock);
+    return disconnected;
+}
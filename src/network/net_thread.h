@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "platform.h"
+
+// Network I/O thread with per-channel receive queues.
+//
+// The thread owns the receive side of one connection: it waits on the socket,
+// reads and unseals everything that arrived (through the recv callback, so the
+// module does not depend on how DerpNet is configured in the caller's TU),
+// writes out what the send queue still holds and sorts each packet into a
+// channel queue picked by the classify callback. Consumers pop packets from the
+// channels on their own threads; notify fires once when the channels go from
+// drained to having data again, not once per packet, and once more when the
+// connection drops. A modal dialog or a slow paint on the UI thread therefore
+// only delays the consumer, the socket keeps being read until a channel fills
+// up, and then the thread stops reading so TCP pushes back on the sender.
+//
+// A channel can also have a worker of its own (worker_channels), e.g. video
+// decoded off the UI thread: its packets fire NET_THREAD_WORKER_DATA instead,
+// so the main consumer is not woken for them at all.
+//
+// Anything else that touches the connection (sends, queue size checks) must
+// hold NetThread_Lock while the thread is running.
+
+typedef enum {
+    NET_CHANNEL_CONTROL,       // connection setup, config, disconnect, timing
+    NET_CHANNEL_INPUT,         // mouse and keyboard
+    NET_CHANNEL_FILE,          // file offers, answers and data
+    NET_CHANNEL_VIDEO,         // encoded video chunks
+    NET_CHANNEL_COUNT,
+} NetChannel;
+
+#define NET_THREAD_MAX_PACKET 65536        // larger packets are dropped
+#define NET_THREAD_DEFAULT_CHANNEL_BYTES (1u << 20)
+#define NET_THREAD_PEER_SIZE 32
+
+typedef struct {
+    uint8_t peer[NET_THREAD_PEER_SIZE];   // sender public key
+    const uint8_t* data;
+    uint32_t size;
+} NetPacket;
+
+typedef enum {
+    NET_THREAD_DATA,           // at least one channel has packets, call NetThread_TakeReady
+    NET_THREAD_DISCONNECTED,   // recv or flush failed, the thread has stopped reading
+    NET_THREAD_WORKER_DATA,    // a worker channel has packets, call NetThread_TakeWorkerReady
+} NetThreadEvent;
+
+// Network thread, connection lock held: 1 = packet stored in *packet (valid until the
+// next call), 0 = nothing buffered, -1 = disconnected. Must not block.
+typedef int NetThreadRecv(void* context, NetPacket* packet);
+
+// Network thread, connection lock held, after every read pass: writes out queued sends
+// without waiting. Returns false when disconnected.
+typedef bool NetThreadFlush(void* context);
+
+// Network thread, connection lock held, after flush: milliseconds until flush has more to write
+// on its own (paced sends), NET_THREAD_WAIT_FOREVER when only the socket can make progress
+#define NET_THREAD_WAIT_FOREVER UINT32_MAX
+typedef uint32_t NetThreadWait(void* context);
+
+// Network thread, connection lock held: NetChannel for the packet, NET_CHANNEL_COUNT drops it
+typedef int NetThreadClassify(void* context, const NetPacket* packet);
+
+// Network thread, no locks held. Must not block (post a message and return).
+typedef void NetThreadNotify(void* context, NetThreadEvent event);
+
+typedef struct {
+#if defined(_WIN32)
+    void* socket_event;        // DerpNet.SocketEvent
+#else
+    int socket_fd;             // DerpNet.EventFd (epoll, edge triggered) or any pollable fd
+#endif
+    uint32_t channel_bytes[NET_CHANNEL_COUNT];   // queue sizes, 0 = NET_THREAD_DEFAULT_CHANNEL_BYTES
+    uint32_t worker_channels;  // mask (1 << NetChannel) of channels popped by a worker, see above
+    NetThreadRecv* recv;
+    NetThreadFlush* flush;     // optional
+    NetThreadWait* wait;       // optional, without it the thread waits for the socket only
+    NetThreadClassify* classify;
+    NetThreadNotify* notify;   // optional
+    void* context;
+} NetThreadConfig;
+
+// Packets are stored back to back as [size:4][peer:32][data], an entry that does not fit
+// before the end starts over at the front (size NET_QUEUE_WRAP marks the skipped tail)
+typedef struct {
+    uint8_t* data;
+    uint32_t capacity;
+    uint32_t head;             // next entry to pop
+    uint32_t tail;             // where the next entry goes
+    uint32_t used;             // bytes between head and tail, including skipped tails
+    uint32_t packets;
+    uint64_t total_packets;
+    uint64_t total_bytes;
+} NetQueue;
+
+typedef struct {
+    NetThreadConfig config;
+    BuddyThread thread;
+    BuddyMutex net_lock;       // held by the thread while it reads or flushes
+    BuddyMutex queue_lock;     // guards channels and the flags below
+    BuddyCond space;           // the thread waits here while a channel is full
+    bool running;
+    bool stopping;
+    bool signaled;             // NET_THREAD_DATA posted and not yet taken
+    bool worker_signaled;      // NET_THREAD_WORKER_DATA posted and not yet taken
+    bool waiting_for_space;
+    bool disconnected;
+    NetQueue channels[NET_CHANNEL_COUNT];
+#if defined(_WIN32)
+    void* wake_event;
+#else
+    int wake_fds[2];
+#endif
+
+    // statistics, written by the thread under queue_lock
+    uint64_t wakeups;          // socket waits that returned
+    uint64_t timeouts;         // waits cut short by the wait callback
+    uint64_t notifications;    // NET_THREAD_DATA events sent
+    uint64_t worker_notifications;   // NET_THREAD_WORKER_DATA events sent
+    uint64_t dropped;          // unclassified or oversized packets
+    uint64_t stalls;           // read passes stopped because a channel was full
+} NetThread;
+
+bool NetThread_Start(NetThread* thread, const NetThreadConfig* config);
+
+// Wakes the thread and waits for it to exit. Packets still queued are discarded.
+void NetThread_Stop(NetThread* thread);
+
+// Serializes the caller with the thread's reads and flushes. Does nothing while the thread is
+// not running, so code shared with the connect path can lock unconditionally. Never call
+// NetThread_Stop with the lock held, the thread needs it to finish its read pass.
+void NetThread_Lock(NetThread* thread);
+void NetThread_Unlock(NetThread* thread);
+
+// Makes the thread run a read and flush pass now, e.g. after the caller queued paced sends
+// while the thread was waiting without a timeout.
+void NetThread_Wake(NetThread* thread);
+
+// Re-arms NET_THREAD_DATA and returns a bit mask (1 << NetChannel) of channels with packets,
+// worker channels left out. Drain every channel in the mask after this, packets that arrive
+// meanwhile notify again.
+uint32_t NetThread_TakeReady(NetThread* thread);
+
+// The same for NET_THREAD_WORKER_DATA and the worker channels
+uint32_t NetThread_TakeWorkerReady(NetThread* thread);
+
+// Copies the oldest packet of a channel into buffer (NET_THREAD_MAX_PACKET bytes) and points
+// packet->data at it. Returns false when the channel is empty. Callable from any thread.
+bool NetThread_Pop(NetThread* thread, NetChannel channel, NetPacket* packet, uint8_t* buffer);
+
+// True once the thread saw the connection drop; queued packets can still be popped
+bool NetThread_IsDisconnected(NetThread* thread);
@@ -0,0 +1,217 @@
+#include <string.h>
+#include "pacer.h"
+
+static uint64_t Pacer_Min(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+static uint64_t Pacer_Depth(const Pacer* pacer)
+{
+    uint64_t depth = pacer->rate * PACER_MIN_BURST_US / 1000000;
+    return depth > pacer->config.burst_bytes ? depth : pacer->config.burst_bytes;
+}
+
+static void Pacer_Refill(Pacer* pacer, uint64_t now_us)
+{
+    if (now_us <= pacer->refill_us)
+    {
+        return;
+    }
+
+    uint64_t add = pacer->rate * (now_us - pacer->refill_us) / 1000000;
+    uint64_t depth = Pacer_Depth(pacer);
+    if (pacer->tokens + add >= depth)
+    {
+        pacer->tokens = depth;
+        pacer->refill_us = now_us;
+    }
+    else if (add)
+    {
+        // keep the fraction of a token that did not make it yet
+        pacer->tokens += add;
+        pacer->refill_us += add * 1000000 / pacer->rate;
+    }
+}
+
+static void Pacer_Push(Pacer* pacer, uint64_t now_us, uint64_t bytes)
+{
+    if (bytes == 0)
+    {
+        return;
+    }
+
+    if (pacer->count == PACER_MAX_CHUNKS)
+    {
+        // out of slots, the newest chunk grows and its bytes are timed from when it was queued
+        pacer->chunks[(pacer->head + pacer->count - 1) % PACER_MAX_CHUNKS].bytes += (uint32_t)bytes;
+    }
+    else
+    {
+        PacerChunk* chunk = &pacer->chunks[(pacer->head + pacer->count) % PACER_MAX_CHUNKS];
+        chunk->queued_us = now_us;
+        chunk->bytes = (uint32_t)bytes;
+        pacer->count++;
+    }
+    pacer->queued_bytes += bytes;
+}
+
+static void Pacer_Pop(Pacer* pacer, uint64_t now_us, uint64_t bytes)
+{
+    while (bytes && pacer->count)
+    {
+        PacerChunk* chunk = &pacer->chunks[pacer->head];
+        if (bytes < chunk->bytes)
+        {
+            chunk->bytes -= (uint32_t)bytes;
+            pacer->queued_bytes -= bytes;
+            return;
+        }
+
+        bytes -= chunk->bytes;
+        pacer->queued_bytes -= chunk->bytes;
+
+        uint64_t delay_us = now_us > chunk->queued_us ? now_us - chunk->queued_us : 0;
+        pacer->delay_total_us += delay_us;
+        pacer->delay_count++;
+        if (delay_us > pacer->delay_max_us)
+        {
+            pacer->delay_max_us = delay_us;
+        }
+
+        pacer->head = (pacer->head + 1) % PACER_MAX_CHUNKS;
+        pacer->count--;
+    }
+}
+
+void Pacer_Init(Pacer* pacer, const PacerConfig* config, uint64_t now_us)
+{
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->config = *config;
+    if (pacer->config.frame_fraction == 0 || pacer->config.frame_fraction > 100)
+    {
+        pacer->config.frame_fraction = PACER_DEFAULT_FRAME_FRACTION;
+    }
+    if (pacer->config.burst_bytes == 0)
+    {
+        pacer->config.burst_bytes = PACER_DEFAULT_BURST;
+    }
+    if (pacer->config.frame_interval_us == 0)
+    {
+        pacer->config.frame_interval_us = 1000000 / 60;
+    }
+
+    pacer->bandwidth = config->initial_rate > PACER_MIN_RATE ? config->initial_rate : PACER_MIN_RATE;
+    pacer->rate = pacer->bandwidth;
+    pacer->tokens = pacer->config.burst_bytes;
+    pacer->refill_us = now_us;
+    pacer->sample_start_us = now_us;
+    pacer->last_sent_us = now_us;
+}
+
+void Pacer_QueueFrame(Pacer* pacer, uint64_t now_us, uint32_t bytes)
+{
+    // tokens earned so far were earned at the old rate
+    Pacer_Refill(pacer, now_us);
+    if (pacer->queued_bytes == 0)
+    {
+        // the queue was idle until now, that time does not count for the bandwidth sample
+        pacer->last_sent_us = now_us;
+    }
+    Pacer_Push(pacer, now_us, bytes);
+    pacer->frames++;
+
+    // whatever is queued goes out over the spread window, but not faster than the link plus headroom
+    uint64_t spread_us = (uint64_t)pacer->config.frame_interval_us * pacer->config.frame_fraction / 100;
+    uint64_t needed = pacer->queued_bytes * 1000000 / (spread_us ? spread_us : 1);
+    uint64_t ceiling = pacer->bandwidth * PACER_HEADROOM_PERCENT / 100;
+    pacer->rate = needed < PACER_MIN_RATE ? PACER_MIN_RATE : Pacer_Min(needed, ceiling);
+}
+
+uint64_t Pacer_Allowance(Pacer* pacer, uint64_t now_us)
+{
+    Pacer_Refill(pacer, now_us);
+    pacer->offered = pacer->tokens;
+    return pacer->tokens;
+}
+
+void Pacer_OnSent(Pacer* pacer, uint64_t now_us, uint64_t sent, uint64_t still_queued)
+{
+    pacer->tokens -= Pacer_Min(sent, pacer->tokens);
+    if (sent)
+    {
+        pacer->writes++;
+        pacer->bytes_sent += sent;
+        if (sent > pacer->max_burst)
+        {
+            pacer->max_burst = sent;
+        }
+    }
+
+    // bandwidth sample: bytes per second of time the queue had something to send
+    if (pacer->queued_bytes && now_us > pacer->last_sent_us)
+    {
+        pacer->sample_busy_us += now_us - pacer->last_sent_us;
+    }
+    if (still_queued && sent < pacer->offered)
+    {
+        pacer->sample_blocked = true;
+    }
+    pacer->sample_bytes += sent;
+    pacer->last_sent_us = now_us;
+    pacer->offered = 0;
+
+    if (now_us - pacer->sample_start_us >= PACER_SAMPLE_US)
+    {
+        if (pacer->sample_busy_us >= PACER_SAMPLE_US / 10 && pacer->sample_bytes)
+        {
+            uint64_t measured = pacer->sample_bytes * 1000000 / pacer->sample_busy_us;
+            if (pacer->sample_blocked)
+            {
+                // the socket set the pace, that is the link
+                pacer->bandwidth = measured;
+            }
+            else if (measured > pacer->bandwidth)
+            {
+                // the link took everything offered, it may do more: probe carefully, socket
+                // buffers take a lot before they push back
+                pacer->bandwidth = Pacer_Min(measured, pacer->bandwidth * (100 + PACER_PROBE_PERCENT) / 100);
+            }
+            if (pacer->bandwidth < PACER_MIN_RATE)
+            {
+                pacer->bandwidth = PACER_MIN_RATE;
+            }
+        }
+        pacer->sample_start_us = now_us;
+        pacer->sample_busy_us = 0;
+        pacer->sample_bytes = 0;
+        pacer->sample_blocked = false;
+    }
+
+    // the send queue is the truth for what is still waiting
+    if (still_queued < pacer->queued_bytes)
+    {
+        Pacer_Pop(pacer, now_us, pacer->queued_bytes - still_queued);
+    }
+    else
+    {
+        Pacer_Push(pacer, now_us, still_queued - pacer->queued_bytes);
+    }
+}
+
+uint64_t Pacer_NextSendUs(const Pacer* pacer, uint64_t now_us)
+{
+    if (pacer->queued_bytes == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    // tiny writes cost a TLS record and a send call each, wait for a useful amount
+    uint64_t want = Pacer_Min(pacer->queued_bytes, PACER_MIN_WRITE);
+    if (pacer->tokens >= want)
+    {
+        return 0;
+    }
+    uint64_t due_us = pacer->refill_us + ((want - pacer->tokens) * 1000000 + pacer->rate - 1) / pacer->rate;
+    return due_us > now_us ? due_us - now_us : 0;
+}
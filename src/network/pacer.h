@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Token bucket pacer for outgoing video.
+//
+// An encoded keyframe is several 65 KB chunks that used to reach the socket
+// back to back. The burst fills relay and socket buffers, and every input or
+// control packet behind it waits until the whole frame has drained. The pacer
+// decides how many queued bytes may be written at any moment: tokens accrue
+// at the pacing rate up to a small bucket, each written byte takes one.
+//
+// The rate is set per frame, so that the queued bytes go out over a fraction
+// of the frame interval, but never faster than PACER_HEADROOM_PERCENT of the
+// estimated bandwidth. The estimate comes from how fast the socket took paced
+// bytes: while the socket pushed back it is the measured rate, otherwise it
+// creeps up by at most PACER_PROBE_PERCENT per sample, since a socket that
+// takes everything only shows that the link is not slower than the rate.
+// Urgent packets are not paced, the send queue writes them ahead of
+// everything the pacer holds back.
+//
+// All times come from the caller, so the same code runs on a virtual clock in
+// tests.
+
+#define PACER_DEFAULT_FRAME_FRACTION 50      // percent of the frame interval one frame is spread over
+#define PACER_DEFAULT_BURST 16384            // bucket depth in bytes
+#define PACER_MIN_BURST_US 2000              // the bucket holds at least this long at the pacing rate,
+                                             // so a late timer does not lower the rate
+#define PACER_MIN_WRITE 4096                 // wait for at least this many tokens before writing again
+#define PACER_MIN_RATE (64 * 1024)           // bytes per second the estimate never drops below
+#define PACER_HEADROOM_PERCENT 150
+#define PACER_PROBE_PERCENT 12
+#define PACER_SAMPLE_US 100000               // bandwidth sample period
+#define PACER_MAX_CHUNKS 256                 // queued chunks tracked for queue delay
+
+typedef struct {
+    uint32_t frame_interval_us;  // 1000000 / framerate
+    uint32_t frame_fraction;     // percent, 0 = PACER_DEFAULT_FRAME_FRACTION
+    uint32_t burst_bytes;        // 0 = PACER_DEFAULT_BURST
+    uint64_t initial_rate;       // bytes per second until the first sample, e.g. twice the encoder bitrate
+} PacerConfig;
+
+typedef struct {
+    uint64_t queued_us;
+    uint32_t bytes;              // not sent yet
+} PacerChunk;
+
+typedef struct {
+    PacerConfig config;
+    uint64_t bandwidth;          // estimate, bytes per second
+    uint64_t rate;               // current pacing rate, bytes per second
+    uint64_t tokens;
+    uint64_t refill_us;          // tokens are up to date at this time
+    uint64_t offered;            // last Pacer_Allowance result
+
+    // bytes handed to the send queue and not written yet, oldest first
+    PacerChunk chunks[PACER_MAX_CHUNKS];
+    uint32_t head;
+    uint32_t count;
+    uint64_t queued_bytes;
+
+    // current bandwidth sample
+    uint64_t sample_start_us;
+    uint64_t sample_busy_us;     // time with bytes queued
+    uint64_t sample_bytes;
+    bool sample_blocked;         // socket took less than offered at least once
+    uint64_t last_sent_us;
+
+    // statistics
+    uint64_t frames;
+    uint64_t bytes_sent;
+    uint64_t writes;
+    uint64_t max_burst;          // most bytes written by one Pacer_OnSent
+    uint64_t delay_total_us;     // queue delay summed over sent chunks
+    uint64_t delay_max_us;
+    uint64_t delay_count;
+} Pacer;
+
+void Pacer_Init(Pacer* pacer, const PacerConfig* config, uint64_t now_us);
+
+// bytes of one encoded frame (wire size, all chunks) were just queued for sending;
+// picks the pacing rate for everything queued so far
+void Pacer_QueueFrame(Pacer* pacer, uint64_t now_us, uint32_t bytes);
+
+// bytes that may be written now
+uint64_t Pacer_Allowance(Pacer* pacer, uint64_t now_us);
+
+// sent = paced bytes the socket took since the last call, still_queued = bytes left in the send
+// queue. Queued bytes the pacer was not told about (file data) are tracked from here on, bytes
+// that went out without it (blocking sends) are taken off.
+void Pacer_OnSent(Pacer* pacer, uint64_t now_us, uint64_t sent, uint64_t still_queued);
+
+// microseconds until the next write is worth doing, UINT64_MAX when nothing is queued
+uint64_t Pacer_NextSendUs(const Pacer* pacer, uint64_t now_us);
@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <string.h>
+#include "region_probe.h"
+
+#if defined(_WIN32)
+// windows.h comes from platform.h, it leaves winsock out with WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET RegionSocket;
+typedef WSAPOLLFD RegionPollFd;
+#define REGION_PROBE_BAD_SOCKET INVALID_SOCKET
+#define REGION_PROBE_SEND_FLAGS 0
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+typedef int RegionSocket;
+typedef struct pollfd RegionPollFd;
+#define REGION_PROBE_BAD_SOCKET (-1)
+#if defined(MSG_NOSIGNAL)
+#define REGION_PROBE_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define REGION_PROBE_SEND_FLAGS 0
+#endif
+#endif
+
+typedef enum {
+    REGION_PROBE_IDLE,
+    REGION_PROBE_CONNECTING,
+    REGION_PROBE_AWAITING_REPLY,
+} RegionProbeState;
+
+typedef struct {
+    RegionSocket socket;
+    RegionProbeState state;
+    uint64_t start_us;
+} RegionProbeSlot;
+
+typedef struct {
+    RegionProbe* probe;
+    const RegionProbeConfig* config;
+    BuddyMutex lock;
+    uint32_t next;
+} RegionProbeResolver;
+
+static void RegionProbe_Close(RegionSocket s)
+{
+#if defined(_WIN32)
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+static bool RegionProbe_SetNonBlocking(RegionSocket s)
+{
+#if defined(_WIN32)
+    u_long non_blocking = 1;
+    return ioctlsocket(s, FIONBIO, &non_blocking) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+static bool RegionProbe_ConnectPending(void)
+{
+#if defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+static int RegionProbe_Poll(RegionPollFd* fds, uint32_t count, int timeout_ms)
+{
+#if defined(_WIN32)
+    return WSAPoll(fds, count, timeout_ms);
+#else
+    return poll(fds, count, timeout_ms);
+#endif
+}
+
+static bool RegionProbe_Connected(RegionSocket s)
+{
+    int error = 0;
+    socklen_t size = sizeof(error);
+    return getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&error, &size) == 0 && error == 0;
+}
+
+// Paths are UTF-8 on every platform; Windows needs the wide CRT to honour that
+static FILE* RegionProbe_OpenFile(const char* path, const char* mode)
+{
+#if defined(_WIN32)
+    wchar_t wpath[MAX_PATH];
+    wchar_t wmode[8];
+    if (!MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH)) return NULL;
+    if (!MultiByteToWideChar(CP_UTF8, 0, mode, -1, wmode, 8)) return NULL;
+    return _wfopen(wpath, wmode);
+#else
+    return fopen(path, mode);
+#endif
+}
+
+void RegionProbe_Init(RegionProbe* probe)
+{
+    memset(probe, 0, sizeof(*probe));
+}
+
+bool RegionProbe_Add(RegionProbe* probe, uint32_t id, const char* host)
+{
+    size_t length = host ? strlen(host) : 0;
+    if (probe->count == REGION_PROBE_MAX_REGIONS || length == 0 || length >= REGION_PROBE_MAX_HOST)
+    {
+        return false;
+    }
+
+    RegionProbeEntry* entry = &probe->entries[probe->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->id = id;
+    memcpy(entry->host, host, length + 1);
+    entry->median_us = REGION_PROBE_UNREACHABLE;
+    return true;
+}
+
+bool RegionProbe_Resolve(void* context, const char* host, uint16_t port, uint8_t* address, uint32_t* address_size)
+{
+    (void)context;
+
+    char service[8];
+    snprintf(service, sizeof(service), "%u", (unsigned)port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo* result = NULL;
+    if (getaddrinfo(host, service, &hints, &result) != 0 || !result)
+    {
+        return false;
+    }
+
+    bool ok = result->ai_addrlen <= REGION_PROBE_MAX_ADDRESS;
+    if (ok)
+    {
+        memcpy(address, result->ai_addr, result->ai_addrlen);
+        *address_size = (uint32_t)result->ai_addrlen;
+    }
+    freeaddrinfo(result);
+    return ok;
+}
+
+static void RegionProbe_ResolveWorker(void* arg)
+{
+    RegionProbeResolver* resolver = arg;
+    RegionProbe* probe = resolver->probe;
+    const RegionProbeConfig* config = resolver->config;
+    RegionProbeResolve* resolve = config->resolve ? config->resolve : &RegionProbe_Resolve;
+
+    for (;;)
+    {
+        BuddyMutex_Lock(&resolver->lock);
+        uint32_t index = resolver->next++;
+        BuddyMutex_Unlock(&resolver->lock);
+        if (index >= probe->count)
+        {
+            break;
+        }
+
+        RegionProbeEntry* entry = &probe->entries[index];
+        uint32_t size = 0;
+        uint64_t start = BuddyClock_NowUs();
+        if (!resolve(config->context, entry->host, config->port, entry->address, &size) || size > REGION_PROBE_MAX_ADDRESS)
+        {
+            size = 0;
+        }
+        entry->address_size = size;
+        entry->resolve_us = (uint32_t)(BuddyClock_NowUs() - start);
+    }
+}
+
+static void RegionProbe_ResolveAll(RegionProbe* probe, const RegionProbeConfig* config)
+{
+    RegionProbeResolver resolver = { .probe = probe, .config = config };
+    BuddyMutex_Init(&resolver.lock);
+
+    uint32_t thread_count = config->resolve_threads ? config->resolve_threads : REGION_PROBE_DEFAULT_RESOLVE_THREADS;
+    if (thread_count > probe->count)
+    {
+        thread_count = probe->count;
+    }
+
+    // the caller resolves too, a thread that fails to start only makes it slower
+    BuddyThread threads[REGION_PROBE_MAX_REGIONS];
+    uint32_t started = 0;
+    while (started + 1 < thread_count && BuddyThread_Start(&threads[started], &RegionProbe_ResolveWorker, &resolver))
+    {
+        started++;
+    }
+    RegionProbe_ResolveWorker(&resolver);
+    for (uint32_t i = 0; i < started; i++)
+    {
+        BuddyThread_Join(threads[i]);
+    }
+
+    BuddyMutex_Destroy(&resolver.lock);
+
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        if (probe->entries[i].address_size == 0)
+        {
+            probe->resolve_failures++;
+        }
+    }
+}
+
+static void RegionProbe_AddSample(RegionProbeEntry* entry, uint64_t start_us, uint64_t now_us)
+{
+    uint64_t sample = now_us > start_us ? now_us - start_us : 0;
+    if (entry->sample_count < REGION_PROBE_MAX_SAMPLES)
+    {
+        entry->samples_us[entry->sample_count++] = sample < REGION_PROBE_UNREACHABLE ? (uint32_t)sample : REGION_PROBE_UNREACHABLE - 1;
+    }
+}
+
+// Connected: either the sample is done, or the request goes out and the reply ends it
+static bool RegionProbe_OnConnected(RegionProbeEntry* entry, RegionProbeSlot* slot, const RegionProbeConfig* config, uint64_t now_us)
+{
+    if (!config->request_size)
+    {
+        RegionProbe_AddSample(entry, slot->start_us, now_us);
+        slot->state = REGION_PROBE_IDLE;
+        return true;
+    }
+
+    if (send(slot->socket, (const char*)config->request, (int)config->request_size, REGION_PROBE_SEND_FLAGS) != (int)config->request_size)
+    {
+        return false;
+    }
+    slot->start_us = now_us;
+    slot->state = REGION_PROBE_AWAITING_REPLY;
+    return true;
+}
+
+static void RegionProbe_Round(RegionProbe* probe, const RegionProbeConfig* config, uint32_t timeout_ms)
+{
+    RegionProbeSlot slots[REGION_PROBE_MAX_REGIONS];
+    uint32_t pending = 0;
+
+    // every region starts its handshake at the same time, so they all see the same local conditions
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        RegionProbeEntry* entry = &probe->entries[i];
+        RegionProbeSlot* slot = &slots[i];
+        slot->socket = REGION_PROBE_BAD_SOCKET;
+        slot->state = REGION_PROBE_IDLE;
+        if (entry->address_size == 0)
+        {
+            continue;
+        }
+
+        const struct sockaddr* address = (const struct sockaddr*)entry->address;
+        RegionSocket s = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+        if (s == REGION_PROBE_BAD_SOCKET)
+        {
+            probe->sample_failures++;
+            continue;
+        }
+        slot->socket = s;
+        if (!RegionProbe_SetNonBlocking(s))
+        {
+            probe->sample_failures++;
+            continue;
+        }
+
+        slot->start_us = BuddyClock_NowUs();
+        if (connect(s, address, (socklen_t)entry->address_size) == 0)
+        {
+            // loopback may connect right away
+            slot->state = REGION_PROBE_CONNECTING;
+            if (!RegionProbe_OnConnected(entry, slot, config, BuddyClock_NowUs()))
+            {
+                slot->state = REGION_PROBE_IDLE;
+                probe->sample_failures++;
+            }
+        }
+        else if (RegionProbe_ConnectPending())
+        {
+            slot->state = REGION_PROBE_CONNECTING;
+        }
+        else
+        {
+            probe->sample_failures++;
+        }
+        pending += slot->state != REGION_PROBE_IDLE;
+    }
+
+    uint64_t deadline = BuddyClock_NowUs() + (uint64_t)timeout_ms * 1000;
+    while (pending)
+    {
+        uint64_t now = BuddyClock_NowUs();
+        if (now >= deadline)
+        {
+            break;
+        }
+
+        RegionPollFd poll_fds[REGION_PROBE_MAX_REGIONS];
+        uint32_t poll_region[REGION_PROBE_MAX_REGIONS];
+        uint32_t poll_count = 0;
+        for (uint32_t i = 0; i < probe->count; i++)
+        {
+            if (slots[i].state != REGION_PROBE_IDLE)
+            {
+                poll_fds[poll_count].fd = slots[i].socket;
+                poll_fds[poll_count].events = slots[i].state == REGION_PROBE_CONNECTING ? POLLOUT : POLLIN;
+                poll_fds[poll_count].revents = 0;
+                poll_region[poll_count] = i;
+                poll_count++;
+            }
+        }
+
+        int ready = RegionProbe_Poll(poll_fds, poll_count, (int)((deadline - now + 999) / 1000));
+        if (ready < 0)
+        {
+            break;
+        }
+        now = BuddyClock_NowUs();
+
+        for (uint32_t index = 0; index < poll_count; index++)
+        {
+            if (poll_fds[index].revents == 0)
+            {
+                continue;
+            }
+
+            RegionProbeEntry* entry = &probe->entries[poll_region[index]];
+            RegionProbeSlot* slot = &slots[poll_region[index]];
+            bool ok;
+            if (slot->state == REGION_PROBE_CONNECTING)
+            {
+                ok = RegionProbe_Connected(slot->socket) && RegionProbe_OnConnected(entry, slot, config, now);
+            }
+            else
+            {
+                char reply;
+                ok = recv(slot->socket, &reply, 1, 0) == 1;
+                if (ok)
+                {
+                    RegionProbe_AddSample(entry, slot->start_us, now);
+                    slot->state = REGION_PROBE_IDLE;
+                }
+            }
+
+            if (!ok)
+            {
+                slot->state = REGION_PROBE_IDLE;
+                probe->sample_failures++;
+            }
+            pending -= slot->state == REGION_PROBE_IDLE;
+        }
+    }
+
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        if (slots[i].state != REGION_PROBE_IDLE)
+        {
+            // timed out
+            probe->sample_failures++;
+        }
+        if (slots[i].socket != REGION_PROBE_BAD_SOCKET)
+        {
+            RegionProbe_Close(slots[i].socket);
+        }
+    }
+}
+
+void RegionProbe_Run(RegionProbe* probe, const RegionProbeConfig* config)
+{
+    probe->rounds = config->samples ? config->samples : REGION_PROBE_DEFAULT_SAMPLES;
+    if (probe->rounds > REGION_PROBE_MAX_SAMPLES)
+    {
+        probe->rounds = REGION_PROBE_MAX_SAMPLES;
+    }
+    uint32_t timeout_ms = config->timeout_ms ? config->timeout_ms : REGION_PROBE_DEFAULT_TIMEOUT_MS;
+
+    probe->resolve_failures = 0;
+    probe->sample_failures = 0;
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        probe->entries[i].sample_count = 0;
+        probe->entries[i].median_us = REGION_PROBE_UNREACHABLE;
+    }
+
+    uint64_t start = BuddyClock_NowUs();
+    RegionProbe_ResolveAll(probe, config);
+    uint64_t resolved = BuddyClock_NowUs();
+    probe->resolve_wall_us = resolved - start;
+
+    for (uint32_t round = 0; round < probe->rounds; round++)
+    {
+        RegionProbe_Round(probe, config, timeout_ms);
+    }
+    probe->probe_wall_us = BuddyClock_NowUs() - resolved;
+
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        RegionProbeEntry* entry = &probe->entries[i];
+        if (entry->sample_count && entry->sample_count * 2 >= probe->rounds)
+        {
+            entry->median_us = RegionProbe_Median(entry->samples_us, entry->sample_count);
+        }
+    }
+}
+
+uint32_t RegionProbe_Median(const uint32_t* samples, uint32_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    uint32_t sorted[REGION_PROBE_MAX_SAMPLES];
+    if (count > REGION_PROBE_MAX_SAMPLES)
+    {
+        count = REGION_PROBE_MAX_SAMPLES;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t value = samples[i];
+        uint32_t at = i;
+        while (at && sorted[at - 1] > value)
+        {
+            sorted[at] = sorted[at - 1];
+            at--;
+        }
+        sorted[at] = value;
+    }
+
+    if (count & 1)
+    {
+        return sorted[count / 2];
+    }
+    return (uint32_t)(((uint64_t)sorted[count / 2 - 1] + sorted[count / 2]) / 2);
+}
+
+uint32_t RegionProbe_Best(const RegionProbe* probe)
+{
+    uint32_t best = 0;
+    uint32_t best_us = REGION_PROBE_UNREACHABLE;
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        const RegionProbeEntry* entry = &probe->entries[i];
+        if (entry->median_us < best_us || (entry->median_us == best_us && best && entry->id < best))
+        {
+            best = entry->id;
+            best_us = entry->median_us;
+        }
+    }
+    return best_us == REGION_PROBE_UNREACHABLE ? 0 : best;
+}
+
+void RegionProbe_ToTable(const RegionProbe* probe, RegionLatencyTable* table, uint64_t now_unix)
+{
+    table->measured_at = now_unix;
+    table->count = 0;
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        const RegionProbeEntry* entry = &probe->entries[i];
+        if (entry->median_us == REGION_PROBE_UNREACHABLE)
+        {
+            continue;
+        }
+
+        // insertion keeps the table sorted by median, fastest first
+        uint32_t at = table->count++;
+        while (at && table->entries[at - 1].median_us > entry->median_us)
+        {
+            table->entries[at] = table->entries[at - 1];
+            at--;
+        }
+        RegionLatency* latency = &table->entries[at];
+        latency->id = entry->id;
+        latency->median_us = entry->median_us;
+        memcpy(latency->host, entry->host, sizeof(latency->host));
+    }
+}
+
+uint32_t RegionProbe_TableBest(const RegionLatencyTable* table, uint64_t now_unix, uint64_t max_age)
+{
+    if (now_unix > table->measured_at + max_age)
+    {
+        return 0;
+    }
+
+    uint32_t best = 0;
+    uint32_t best_us = REGION_PROBE_UNREACHABLE;
+    for (uint32_t i = 0; i < table->count; i++)
+    {
+        if (table->entries[i].median_us < best_us)
+        {
+            best = table->entries[i].id;
+            best_us = table->entries[i].median_us;
+        }
+    }
+    return best;
+}
+
+// Layout: "derp-latency 1 <measured_at>" then one "<id> <median_us> <host>" line per region
+bool RegionProbe_SaveTable(const RegionLatencyTable* table, const char* path)
+{
+    FILE* f = RegionProbe_OpenFile(path, "wb");
+    if (!f)
+    {
+        return false;
+    }
+
+    fprintf(f, "derp-latency 1 %llu\n", (unsigned long long)table->measured_at);
+    for (uint32_t i = 0; i < table->count; i++)
+    {
+        fprintf(f, "%u %u %s\n", table->entries[i].id, table->entries[i].median_us, table->entries[i].host);
+    }
+    bool ok = fflush(f) == 0 && !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+bool RegionProbe_LoadTable(RegionLatencyTable* table, const char* path)
+{
+    FILE* f = RegionProbe_OpenFile(path, "rb");
+    if (!f)
+    {
+        return false;
+    }
+
+    RegionLatencyTable loaded;
+    memset(&loaded, 0, sizeof(loaded));
+
+    unsigned version = 0;
+    unsigned long long measured_at = 0;
+    bool ok = fscanf(f, "derp-latency %u %llu", &version, &measured_at) == 2 && version == 1;
+    loaded.measured_at = measured_at;
+
+    while (ok)
+    {
+        unsigned id, median_us;
+        char host[REGION_PROBE_MAX_HOST];
+        int fields = fscanf(f, "%u %u %127s", &id, &median_us, host);
+        if (fields == EOF)
+        {
+            break;
+        }
+        if (fields != 3 || loaded.count == REGION_PROBE_MAX_REGIONS || median_us == REGION_PROBE_UNREACHABLE)
+        {
+            ok = false;
+            break;
+        }
+
+        RegionLatency* latency = &loaded.entries[loaded.count++];
+        latency->id = id;
+        latency->median_us = median_us;
+        memcpy(latency->host, host, sizeof(host));
+    }
+    fclose(f);
+
+    if (ok)
+    {
+        *table = loaded;
+    }
+    return ok;
+}
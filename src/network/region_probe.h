@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "platform.h"
+
+// DERP region selection.
+//
+// All region hostnames are resolved at once on a small pool of resolver
+// threads, so one slow or dead DNS name costs its own timeout and not the sum
+// of all of them. Then every resolved region is probed for several rounds; a
+// round opens one non-blocking connection per region at the same time and
+// times the handshake: the TCP connect, or, when a request is configured, the
+// request until the first reply byte. A region is ranked by the median of its
+// samples, so one slow SYN retransmit or a scheduling hiccup does not decide
+// where the session goes, and it only qualifies when at least half of its
+// rounds answered.
+//
+// The result is kept as a small latency table next to the config. The next
+// start picks the best region from the table right away and refreshes the
+// table in the background.
+
+#define REGION_PROBE_MAX_REGIONS 256
+#define REGION_PROBE_MAX_HOST 128
+#define REGION_PROBE_MAX_ADDRESS 28            // sizeof(struct sockaddr_in6)
+#define REGION_PROBE_MAX_SAMPLES 16
+#define REGION_PROBE_DEFAULT_SAMPLES 3
+#define REGION_PROBE_DEFAULT_TIMEOUT_MS 1000   // per round
+#define REGION_PROBE_DEFAULT_RESOLVE_THREADS 16
+#define REGION_PROBE_UNREACHABLE UINT32_MAX
+#define REGION_PROBE_TABLE_MAX_AGE (7 * 24 * 3600)  // seconds a saved table is trusted for picking
+
+// Resolves host to a socket address for port; called on the resolver threads, must be thread safe.
+// The default is RegionProbe_Resolve, tests map hosts to local listeners and add delays.
+typedef bool RegionProbeResolve(void* context, const char* host, uint16_t port, uint8_t* address, uint32_t* address_size);
+
+typedef struct {
+    uint16_t port;                   // 443
+    uint32_t samples;                // rounds, 0 = REGION_PROBE_DEFAULT_SAMPLES
+    uint32_t timeout_ms;             // per round, 0 = REGION_PROBE_DEFAULT_TIMEOUT_MS
+    uint32_t resolve_threads;        // 0 = REGION_PROBE_DEFAULT_RESOLVE_THREADS, 1 resolves serially
+    const void* request;             // optional: sent once connected, the sample ends at the first reply byte
+    uint32_t request_size;
+    RegionProbeResolve* resolve;     // NULL = RegionProbe_Resolve
+    void* context;
+} RegionProbeConfig;
+
+typedef struct {
+    uint32_t id;                     // DERP region id
+    char host[REGION_PROBE_MAX_HOST];
+
+    uint8_t address[REGION_PROBE_MAX_ADDRESS];
+    uint32_t address_size;           // 0 = not resolved
+    uint32_t resolve_us;
+
+    uint32_t samples_us[REGION_PROBE_MAX_SAMPLES];
+    uint32_t sample_count;           // rounds that answered
+    uint32_t median_us;              // REGION_PROBE_UNREACHABLE when under half of the rounds answered
+} RegionProbeEntry;
+
+typedef struct {
+    RegionProbeEntry entries[REGION_PROBE_MAX_REGIONS];
+    uint32_t count;
+    uint32_t rounds;
+
+    // statistics of the last run
+    uint64_t resolve_wall_us;        // whole resolve phase
+    uint64_t probe_wall_us;          // all rounds
+    uint32_t resolve_failures;
+    uint32_t sample_failures;        // connects that failed or timed out
+} RegionProbe;
+
+typedef struct {
+    uint32_t id;
+    uint32_t median_us;
+    char host[REGION_PROBE_MAX_HOST];
+} RegionLatency;
+
+// Latency table, persisted between runs
+typedef struct {
+    uint64_t measured_at;            // unix time of the probe run
+    RegionLatency entries[REGION_PROBE_MAX_REGIONS];
+    uint32_t count;
+} RegionLatencyTable;
+
+void RegionProbe_Init(RegionProbe* probe);
+
+// Adds a region to probe; false when full or host is empty or too long
+bool RegionProbe_Add(RegionProbe* probe, uint32_t id, const char* host);
+
+// Resolves all regions concurrently, then takes config->samples handshake samples of each.
+// Blocks for about one resolve timeout plus samples * timeout_ms at most; run it on a worker thread.
+// Sockets must be initialized (WSAStartup) by the caller on Windows.
+void RegionProbe_Run(RegionProbe* probe, const RegionProbeConfig* config);
+
+// Region with the lowest median, 0 when no region qualified
+uint32_t RegionProbe_Best(const RegionProbe* probe);
+
+// Median of count samples (average of the middle two for an even count), 0 for none
+uint32_t RegionProbe_Median(const uint32_t* samples, uint32_t count);
+
+// Default resolver: first address getaddrinfo returns
+bool RegionProbe_Resolve(void* context, const char* host, uint16_t port, uint8_t* address, uint32_t* address_size);
+
+// Reachable regions of the last run, fastest first
+void RegionProbe_ToTable(const RegionProbe* probe, RegionLatencyTable* table, uint64_t now_unix);
+
+// Fastest region of a table measured no longer than max_age seconds before now_unix, 0 when none
+uint32_t RegionProbe_TableBest(const RegionLatencyTable* table, uint64_t now_unix, uint64_t max_age);
+
+// Text file, UTF-8 path; load returns false when the file is missing or malformed
+bool RegionProbe_SaveTable(const RegionLatencyTable* table, const char* path);
+bool RegionProbe_LoadTable(RegionLatencyTable* table, const char* path);
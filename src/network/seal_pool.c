@@ -0,0 +1,150 @@
+#include <string.h>
+#include "seal_pool.h"
+
+static bool SealPool_CanClaim(const SealPool* pool)
+{
+    // a chunk may only start once the slot it reuses was emitted
+    return pool->next < pool->count && pool->next < pool->emitted + SEAL_POOL_WINDOW;
+}
+
+// Called with lock held, returns with lock held
+static void SealPool_Execute(SealPool* pool)
+{
+    uint32_t index = pool->next++;
+    SealPoolJob* job = pool->job;
+    void* context = pool->context;
+
+    BuddyMutex_Unlock(&pool->lock);
+    job(context, index);
+    BuddyMutex_Lock(&pool->lock);
+
+    pool->finished[index % SEAL_POOL_WINDOW] = true;
+    pool->chunks++;
+}
+
+static void SealPool_WorkerThread(void* arg)
+{
+    SealPool* pool = arg;
+
+    BuddyMutex_Lock(&pool->lock);
+    while (!pool->stopping)
+    {
+        if (SealPool_CanClaim(pool))
+        {
+            SealPool_Execute(pool);
+            BuddyCond_Signal(&pool->done);
+        }
+        else
+        {
+            BuddyCond_Wait(&pool->work, &pool->lock);
+        }
+    }
+    BuddyMutex_Unlock(&pool->lock);
+}
+
+bool SealPool_Start(SealPool* pool, uint32_t threads)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (threads == 0)
+    {
+        threads = BuddyCpu_Count();
+    }
+    if (threads > SEAL_POOL_MAX_THREADS)
+    {
+        threads = SEAL_POOL_MAX_THREADS;
+    }
+
+    BuddyMutex_Init(&pool->lock);
+    BuddyCond_Init(&pool->work);
+    BuddyCond_Init(&pool->done);
+    pool->running = true;
+
+    for (uint32_t i = 0; i + 1 < threads; i++)
+    {
+        if (!BuddyThread_Start(&pool->threads[i], SealPool_WorkerThread, pool))
+        {
+            SealPool_Stop(pool);
+            return false;
+        }
+        pool->thread_count++;
+    }
+    return true;
+}
+
+bool SealPool_Run(SealPool* pool, uint32_t count, SealPoolJob* job, SealPoolEmit* emit, void* context)
+{
+    bool ok = true;
+
+    BuddyMutex_Lock(&pool->lock);
+    pool->job = job;
+    pool->context = context;
+    pool->count = count;
+    pool->next = 0;
+    pool->emitted = 0;
+    memset(pool->finished, 0, sizeof(pool->finished));
+    pool->runs++;
+    BuddyCond_Broadcast(&pool->work);
+
+    while (pool->emitted < pool->count)
+    {
+        uint32_t slot = pool->emitted % SEAL_POOL_WINDOW;
+        if (pool->finished[slot])
+        {
+            pool->finished[slot] = false;
+            uint32_t index = pool->emitted;
+
+            // emit outside the lock so workers keep sealing while the socket write runs
+            BuddyMutex_Unlock(&pool->lock);
+            ok = ok && emit(context, index);
+            BuddyMutex_Lock(&pool->lock);
+
+            if (!ok)
+            {
+                // nothing more goes out, only wait for the chunks already handed out
+                pool->count = pool->next;
+            }
+
+            pool->emitted++;
+            if (SealPool_CanClaim(pool))
+            {
+                BuddyCond_Broadcast(&pool->work);
+            }
+        }
+        else if (SealPool_CanClaim(pool))
+        {
+            // help instead of sleeping, this also makes a pool without workers a plain loop
+            SealPool_Execute(pool);
+            pool->chunks_by_caller++;
+        }
+        else
+        {
+            BuddyCond_Wait(&pool->done, &pool->lock);
+        }
+    }
+
+    pool->count = 0;
+    pool->job = NULL;
+    pool->context = NULL;
+    BuddyMutex_Unlock(&pool->lock);
+    return ok;
+}
+
+void SealPool_Stop(SealPool* pool)
+{
+    if (!pool->running) return;
+
+    BuddyMutex_Lock(&pool->lock);
+    pool->stopping = true;
+    BuddyCond_Broadcast(&pool->work);
+    BuddyMutex_Unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->thread_count; i++)
+    {
+        BuddyThread_Join(pool->threads[i]);
+    }
+    BuddyCond_Destroy(&pool->done);
+    BuddyCond_Destroy(&pool->work);
+    BuddyMutex_Destroy(&pool->lock);
+    pool->running = false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "platform.h"
+
+// Worker pool for sealing the chunks of one large video frame in parallel.
+//
+// SealPool_Run hands out chunk indices to the workers (the calling thread takes
+// chunks too while it waits) and calls emit on the calling thread in index
+// order, each chunk as soon as it and every chunk before it are done, so the
+// first bytes of a keyframe reach the socket while later chunks are still being
+// sealed. At most SEAL_POOL_WINDOW chunks past the last emitted one are in
+// flight, which lets the caller seal into SEAL_POOL_WINDOW reusable slots
+// (slot = index % SEAL_POOL_WINDOW). Nonces are picked by the caller before
+// the run, so the order the workers finish in never changes what is sent.
+
+#define SEAL_POOL_MAX_THREADS 16
+#define SEAL_POOL_WINDOW 16
+
+// Runs on any pool thread, chunks of one run may execute concurrently
+typedef void SealPoolJob(void* context, uint32_t index);
+
+// Runs on the thread that called SealPool_Run, in index order; returning false
+// stops emitting (chunks already started still finish before Run returns)
+typedef bool SealPoolEmit(void* context, uint32_t index);
+
+typedef struct {
+    BuddyMutex lock;
+    BuddyCond work;          // workers wait here for chunks
+    BuddyCond done;          // the running caller waits here for completions
+    BuddyThread threads[SEAL_POOL_MAX_THREADS - 1];
+    uint32_t thread_count;   // workers, not counting the caller
+    bool running;
+    bool stopping;
+
+    // current run, guarded by lock
+    SealPoolJob* job;
+    void* context;
+    uint32_t count;
+    uint32_t next;           // next chunk to hand out
+    uint32_t emitted;        // chunks before this one were emitted
+    bool finished[SEAL_POOL_WINDOW];
+
+    // statistics
+    uint64_t runs;
+    uint64_t chunks;
+    uint64_t chunks_by_caller;
+} SealPool;
+
+// threads counts the caller too: 1 seals everything on the calling thread, 0 = one per CPU
+bool SealPool_Start(SealPool* pool, uint32_t threads);
+
+// Runs job for chunks 0..count-1 and emits them in order. Not reentrant: one run at a time.
+// Returns false if emit returned false.
+bool SealPool_Run(SealPool* pool, uint32_t count, SealPoolJob* job, SealPoolEmit* emit, void* context);
+
+void SealPool_Stop(SealPool* pool);
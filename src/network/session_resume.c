@@ -0,0 +1,122 @@
+#include <string.h>
+#include "session_resume.h"
+
+void SessionResume_Init(SessionResume* resume, const SessionResumeConfig* config, const uint8_t peer[SESSION_RESUME_KEY_SIZE])
+{
+    memset(resume, 0, sizeof(*resume));
+    resume->config = *config;
+    if (resume->config.grace_ms == 0)
+    {
+        resume->config.grace_ms = SESSION_RESUME_DEFAULT_GRACE_MS;
+    }
+    if (resume->config.hello_ms == 0)
+    {
+        resume->config.hello_ms = SESSION_RESUME_DEFAULT_HELLO_MS;
+    }
+    memcpy(resume->peer, peer, sizeof(resume->peer));
+    resume->state = SESSION_RESUME_ACTIVE;
+}
+
+void SessionResume_Stop(SessionResume* resume)
+{
+    resume->state = SESSION_RESUME_OFF;
+}
+
+// The session stopped at now_us, the grace period starts
+static void SessionResume_Lose(SessionResume* resume, uint64_t now_us)
+{
+    resume->lost_us = now_us;
+    resume->deadline_us = now_us + (uint64_t)resume->config.grace_ms * 1000;
+}
+
+bool SessionResume_OnLinkLost(SessionResume* resume, uint64_t now_us)
+{
+    switch (resume->state)
+    {
+    case SESSION_RESUME_ACTIVE:
+        SessionResume_Lose(resume, now_us);
+        break;
+    case SESSION_RESUME_WAITING:
+        // lost again before the peer answered, still the same grace period
+        break;
+    case SESSION_RESUME_RECONNECTING:
+        return true;
+    default:
+        return false;
+    }
+    resume->state = SESSION_RESUME_RECONNECTING;
+    return true;
+}
+
+void SessionResume_OnReconnected(SessionResume* resume, uint64_t now_us)
+{
+    if (resume->state == SESSION_RESUME_RECONNECTING)
+    {
+        resume->state = SESSION_RESUME_WAITING;
+        resume->reconnected_us = now_us;
+        resume->next_hello_us = now_us;
+    }
+}
+
+bool SessionResume_OnPeerGone(SessionResume* resume, const uint8_t key[SESSION_RESUME_KEY_SIZE], uint64_t now_us)
+{
+    if (resume->state != SESSION_RESUME_ACTIVE || memcmp(key, resume->peer, sizeof(resume->peer)) != 0)
+    {
+        return false;
+    }
+    SessionResume_Lose(resume, now_us);
+    resume->reconnected_us = now_us;
+    resume->next_hello_us = now_us;
+    resume->state = SESSION_RESUME_WAITING;
+    return true;
+}
+
+bool SessionResume_HelloDue(SessionResume* resume, uint64_t now_us)
+{
+    if (resume->state != SESSION_RESUME_WAITING || now_us < resume->next_hello_us)
+    {
+        return false;
+    }
+    resume->next_hello_us = now_us + (uint64_t)resume->config.hello_ms * 1000;
+    resume->hellos_sent++;
+    return true;
+}
+
+bool SessionResume_OnMessage(SessionResume* resume, const uint8_t key[SESSION_RESUME_KEY_SIZE], uint8_t message, uint64_t now_us)
+{
+    if (resume->state == SESSION_RESUME_OFF || resume->state == SESSION_RESUME_EXPIRED ||
+        (message != SESSION_RESUME_HELLO && message != SESSION_RESUME_WELCOME))
+    {
+        return false;
+    }
+    if (memcmp(key, resume->peer, sizeof(resume->peer)) != 0)
+    {
+        // sealed with another key: not the peer, whatever it says
+        resume->strangers++;
+        return false;
+    }
+
+    if (resume->state == SESSION_RESUME_WAITING)
+    {
+        resume->state = SESSION_RESUME_ACTIVE;
+        resume->keyframe_needed = true;
+        resume->resumes++;
+        resume->last_outage_us = now_us - resume->lost_us;
+        resume->last_rejoin_us = now_us - resume->reconnected_us;
+    }
+    else if (resume->state == SESSION_RESUME_ACTIVE && message == SESSION_RESUME_HELLO)
+    {
+        // the peer lost its connection without this side noticing, what was sent meanwhile is gone
+        resume->keyframe_needed = true;
+    }
+    return message == SESSION_RESUME_HELLO;
+}
+
+bool SessionResume_Poll(SessionResume* resume, uint64_t now_us)
+{
+    if ((resume->state == SESSION_RESUME_RECONNECTING || resume->state == SESSION_RESUME_WAITING) && now_us >= resume->deadline_us)
+    {
+        resume->state = SESSION_RESUME_EXPIRED;
+    }
+    return resume->state == SESSION_RESUME_EXPIRED;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Keeps a session across a lost DERP connection.
+//
+// A dropped relay connection used to end the session: encoder or decoder, capture and socket were
+// torn down, and the viewer had to enter the code and be approved again. Both ends know the other's
+// public key from the start and everything on the relay is sealed between the two keys, so after a
+// reconnect a packet from the peer's key is the peer; nothing has to be approved again.
+//
+// The side whose connection failed keeps its codecs and capture and reconnects with the same key.
+// The caller does that with a backoff capped at SESSION_RESUME_MAX_BACKOFF_MS, so it is back within
+// a second of the relay. Once connected it sends HELLO to the peer every hello interval until the
+// peer answers. The side whose connection survived learns of the loss from the relay's PeerGone and
+// sends HELLO too. A HELLO is answered with WELCOME, and either one from the peer's key resumes the
+// session. Everything sent in between is gone, so keyframe_needed is set and the sharer's next frame
+// is a keyframe. Without a resume inside the grace period the session expires and ends like before.
+//
+// All times come from the caller, so tests run on a virtual clock.
+
+#define SESSION_RESUME_KEY_SIZE 32
+#define SESSION_RESUME_HELLO 1                   // message byte: back on the relay, answer please
+#define SESSION_RESUME_WELCOME 2                 // message byte: answer to HELLO
+#define SESSION_RESUME_DEFAULT_GRACE_MS 30000
+#define SESSION_RESUME_DEFAULT_HELLO_MS 200
+#define SESSION_RESUME_MAX_BACKOFF_MS 400        // reconnect attempts while the relay is away
+
+typedef enum {
+    SESSION_RESUME_OFF,          // no session
+    SESSION_RESUME_ACTIVE,
+    SESSION_RESUME_RECONNECTING, // own connection lost, a new one is being opened
+    SESSION_RESUME_WAITING,      // connected, the peer has not answered yet
+    SESSION_RESUME_EXPIRED,      // grace period over, end the session
+} SessionResumeState;
+
+typedef struct {
+    uint32_t grace_ms;           // 0 = SESSION_RESUME_DEFAULT_GRACE_MS
+    uint32_t hello_ms;           // 0 = SESSION_RESUME_DEFAULT_HELLO_MS
+} SessionResumeConfig;
+
+typedef struct {
+    SessionResumeConfig config;
+    SessionResumeState state;
+    uint8_t peer[SESSION_RESUME_KEY_SIZE];
+
+    uint64_t lost_us;            // when the session stopped
+    uint64_t deadline_us;        // lost_us + grace
+    uint64_t reconnected_us;     // own connection back, or lost_us when only the peer's was lost
+    uint64_t next_hello_us;
+    bool keyframe_needed;        // cleared by the caller
+
+    // statistics
+    uint64_t resumes;
+    uint64_t last_outage_us;     // lost to resumed
+    uint64_t last_rejoin_us;     // reconnected to resumed
+    uint64_t hellos_sent;
+    uint64_t strangers;          // messages from another key, ignored
+} SessionResume;
+
+void SessionResume_Init(SessionResume* resume, const SessionResumeConfig* config, const uint8_t peer[SESSION_RESUME_KEY_SIZE]);
+void SessionResume_Stop(SessionResume* resume);
+
+// Own connection failed. Returns false when there is no session to keep (off or expired).
+bool SessionResume_OnLinkLost(SessionResume* resume, uint64_t now_us);
+
+// The new connection is open, HELLO is due right away
+void SessionResume_OnReconnected(SessionResume* resume, uint64_t now_us);
+
+// The relay said key is not connected. Returns true when that was the peer and the session now waits for it.
+bool SessionResume_OnPeerGone(SessionResume* resume, const uint8_t key[SESSION_RESUME_KEY_SIZE], uint64_t now_us);
+
+// True when a HELLO is to be sent to the peer now
+bool SessionResume_HelloDue(SessionResume* resume, uint64_t now_us);
+
+// HELLO or WELCOME from key. Returns true when a WELCOME is to be sent back.
+bool SessionResume_OnMessage(SessionResume* resume, const uint8_t key[SESSION_RESUME_KEY_SIZE], uint8_t message, uint64_t now_us);
+
+// Expires the session once the grace period passed without a resume. Returns true when expired.
+bool SessionResume_Poll(SessionResume* resume, uint64_t now_us);
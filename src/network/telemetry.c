@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include "telemetry.h"
+
+static void Telemetry_Set32(uint8_t* dst, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) dst[i] = (uint8_t)(value >> (8 * i));
+}
+
+static void Telemetry_Set64(uint8_t* dst, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) dst[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t Telemetry_Get32(const uint8_t* src)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)src[i] << (8 * i);
+    return value;
+}
+
+static uint64_t Telemetry_Get64(const uint8_t* src)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)src[i] << (8 * i);
+    return value;
+}
+
+void Telemetry_RttReset(TelemetryRtt* rtt)
+{
+    memset(rtt, 0, sizeof(*rtt));
+}
+
+bool Telemetry_RttAdd(TelemetryRtt* rtt, int64_t sample_us)
+{
+    if (sample_us < 0 || sample_us > TELEMETRY_MAX_RTT_US)
+    {
+        return false;
+    }
+
+    rtt->samples[rtt->next] = sample_us;
+    rtt->next = (rtt->next + 1) % TELEMETRY_RTT_WINDOW;
+    if (rtt->count < TELEMETRY_RTT_WINDOW)
+    {
+        rtt->count++;
+    }
+
+    // the sample that left the window may have been the minimum
+    rtt->min_us = rtt->samples[0];
+    for (uint32_t i = 1; i < rtt->count; i++)
+    {
+        rtt->min_us = rtt->samples[i] < rtt->min_us ? rtt->samples[i] : rtt->min_us;
+    }
+
+    if (rtt->total == 0)
+    {
+        rtt->avg_us = sample_us;
+        rtt->var_us = sample_us / 2;
+    }
+    else
+    {
+        int64_t error = sample_us - rtt->avg_us;
+        rtt->var_us += ((error < 0 ? -error : error) - rtt->var_us) / 4;
+        rtt->avg_us += error / 8;
+    }
+    rtt->last_us = sample_us;
+    rtt->total++;
+    return true;
+}
+
+static int Telemetry_CompareInt64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int64_t Telemetry_RttPercentile(const TelemetryRtt* rtt, double percentile)
+{
+    if (rtt->count == 0) return 0;
+
+    int64_t sorted[TELEMETRY_RTT_WINDOW];
+    memcpy(sorted, rtt->samples, rtt->count * sizeof(sorted[0]));
+    qsort(sorted, rtt->count, sizeof(sorted[0]), Telemetry_CompareInt64);
+
+    // nearest-rank, like Latency_StatsPercentile
+    uint32_t rank = (uint32_t)(percentile / 100.0 * rtt->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > rtt->count) rank = rtt->count;
+    return sorted[rank - 1];
+}
+
+void Telemetry_Init(Telemetry* telemetry, const TelemetryConfig* config, uint64_t now_us)
+{
+    memset(telemetry, 0, sizeof(*telemetry));
+    telemetry->config = *config;
+    if (telemetry->config.min_bitrate == 0)
+    {
+        telemetry->config.min_bitrate = telemetry->config.max_bitrate / 8;
+    }
+    if (telemetry->config.ping_interval_us == 0)
+    {
+        telemetry->config.ping_interval_us = TELEMETRY_PING_INTERVAL_US;
+    }
+    telemetry->bitrate = telemetry->config.max_bitrate;
+    telemetry->next_ping_us = now_us;
+    telemetry->tick_us = now_us;
+}
+
+bool Telemetry_PingDue(Telemetry* telemetry, uint64_t now_us, uint8_t out[TELEMETRY_PING_SIZE])
+{
+    if (now_us < telemetry->next_ping_us)
+    {
+        return false;
+    }
+    telemetry->next_ping_us = now_us + telemetry->config.ping_interval_us;
+
+    Telemetry_Set32(out, telemetry->next_ping_id++);
+    Telemetry_Set64(out + 4, now_us);
+    telemetry->pings_sent++;
+    return true;
+}
+
+void Telemetry_Answer(const uint8_t ping[TELEMETRY_PING_SIZE], uint64_t missing, uint8_t out[TELEMETRY_PONG_SIZE])
+{
+    memcpy(out, ping, TELEMETRY_PING_SIZE);
+    Telemetry_Set64(out + TELEMETRY_PING_SIZE, missing);
+}
+
+bool Telemetry_OnPong(Telemetry* telemetry, const uint8_t pong[TELEMETRY_PONG_SIZE], uint64_t now_us)
+{
+    // an id never sent is not from an answer to us
+    uint32_t id = Telemetry_Get32(pong);
+    if (id - telemetry->next_ping_id < 0x80000000u)
+    {
+        return false;
+    }
+    telemetry->pongs_received++;
+
+    uint64_t missing = Telemetry_Get64(pong + TELEMETRY_PING_SIZE);
+    telemetry->peer_missing = missing > telemetry->peer_missing ? missing : telemetry->peer_missing;
+
+    uint64_t sent_us = Telemetry_Get64(pong + 4);
+    return Telemetry_RttAdd(&telemetry->rtt, (int64_t)(now_us - sent_us));
+}
+
+void Telemetry_OnReceive(Telemetry* telemetry, uint32_t channel, uint32_t bytes)
+{
+    if (channel < TELEMETRY_CHANNELS)
+    {
+        telemetry->channel_bytes[channel] += bytes;
+    }
+}
+
+void Telemetry_OnQueue(Telemetry* telemetry, uint64_t bytes)
+{
+    telemetry->queue_bytes = bytes;
+    telemetry->queue_max = bytes > telemetry->queue_max ? bytes : telemetry->queue_max;
+}
+
+bool Telemetry_Tick(Telemetry* telemetry, uint64_t now_us, TelemetrySummary* summary)
+{
+    uint64_t elapsed = now_us - telemetry->tick_us;
+    if (now_us < telemetry->tick_us || elapsed < TELEMETRY_TICK_US)
+    {
+        return false;
+    }
+
+    const TelemetryRtt* rtt = &telemetry->rtt;
+    memset(summary, 0, sizeof(*summary));
+    summary->rtt_min_us = rtt->min_us;
+    summary->rtt_avg_us = rtt->avg_us;
+    summary->rtt_p95_us = Telemetry_RttPercentile(rtt, 95.0);
+    summary->rtt_count = rtt->count;
+    summary->pings_lost = telemetry->pings_sent - telemetry->pongs_received;
+    summary->queue_bytes = telemetry->queue_bytes;
+    summary->queue_max = telemetry->queue_max;
+    for (uint32_t i = 0; i < TELEMETRY_CHANNELS; i++)
+    {
+        summary->goodput[i] = telemetry->channel_bytes[i] * 1000000 / elapsed;
+        telemetry->channel_bytes[i] = 0;
+    }
+    summary->peer_missing = telemetry->peer_missing;
+
+    // half a second of video waiting in the send queue is a link slower than the bitrate
+    bool queued = telemetry->queue_max > (uint64_t)telemetry->bitrate / 8 / 2;
+    bool delayed = rtt->count != 0 && rtt->last_us > rtt->min_us + TELEMETRY_QUEUE_DELAY_US;
+    bool dropped = telemetry->peer_missing > telemetry->peer_missing_tick;
+
+    const TelemetryConfig* config = &telemetry->config;
+    uint64_t bitrate = telemetry->bitrate;
+    if (queued || delayed || dropped)
+    {
+        bitrate = bitrate * (100 - TELEMETRY_RATE_DECREASE_PERCENT) / 100;
+        telemetry->decreases++;
+    }
+    else
+    {
+        bitrate += (uint64_t)config->max_bitrate * TELEMETRY_RATE_INCREASE_PERCENT / 100;
+    }
+    bitrate = bitrate < config->min_bitrate ? config->min_bitrate : bitrate;
+    bitrate = bitrate > config->max_bitrate ? config->max_bitrate : bitrate;
+    telemetry->bitrate = (uint32_t)bitrate;
+    summary->bitrate = telemetry->bitrate;
+
+    telemetry->peer_missing_tick = telemetry->peer_missing;
+    telemetry->queue_max = telemetry->queue_bytes;
+    telemetry->tick_us = now_us;
+    return true;
+}
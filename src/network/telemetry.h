@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Round trip probes and the network numbers both ends of a session show.
+//
+// Frame echoes (latency.h) give a round trip only while video flows and only to the sharer. Here
+// each side pings the other once a second on the urgent path. The ping carries the sender's clock
+// and the answer echoes it, so a round trip needs neither clock sync nor a table of pings in
+// flight. The answer also carries how many video frames the answering side found missing: over a
+// relay that keeps the order of everything it forwards, a missing frame is one the relay dropped
+// for a client that fell behind, and nothing else tells the sharer about it.
+//
+// From the round trips: the minimum over the last TELEMETRY_RTT_WINDOW samples, a smoothed average
+// (RFC 6298 SRTT) and the 95th percentile of the window. Received bytes are counted per channel and
+// turned into goodput on every tick, the send queue is sampled by the caller.
+//
+// Once per tick the target bitrate moves. It drops by TELEMETRY_RATE_DECREASE_PERCENT when the
+// latest round trip is TELEMETRY_QUEUE_DELAY_US above the minimum (a queue builds up somewhere on
+// the path; the average would keep saying so for seconds after it drained), when the peer reports
+// frames missing that were not missing at the last tick, or when the send queue held more than
+// half a second at the current bitrate. Otherwise it climbs by TELEMETRY_RATE_INCREASE_PERCENT of
+// the maximum, so a short congestion costs a few seconds of picture quality, not the rest of the
+// session.
+//
+// All times come from the caller, so tests run on a virtual clock.
+
+#define TELEMETRY_PING_SIZE 12                  // id, sender clock
+#define TELEMETRY_PONG_SIZE 20                  // id, sender clock echoed, frames missing
+#define TELEMETRY_PING_INTERVAL_US 1000000
+#define TELEMETRY_TICK_US 1000000
+#define TELEMETRY_RTT_WINDOW 64
+#define TELEMETRY_MAX_RTT_US 30000000           // an answer later than this is not a sample
+#define TELEMETRY_CHANNELS 4                    // NET_CHANNEL_COUNT
+#define TELEMETRY_QUEUE_DELAY_US 60000
+#define TELEMETRY_RATE_DECREASE_PERCENT 15
+#define TELEMETRY_RATE_INCREASE_PERCENT 5
+
+typedef struct {
+    uint32_t max_bitrate;        // bits per second the encoder was set up with
+    uint32_t min_bitrate;        // 0 = max_bitrate / 8
+    uint32_t ping_interval_us;   // 0 = TELEMETRY_PING_INTERVAL_US
+} TelemetryConfig;
+
+typedef struct {
+    int64_t samples[TELEMETRY_RTT_WINDOW];
+    uint32_t count;
+    uint32_t next;
+    int64_t min_us;              // over the window
+    int64_t avg_us;              // smoothed, gain 1/8
+    int64_t var_us;              // smoothed mean deviation, gain 1/4
+    int64_t last_us;
+    uint64_t total;              // samples ever
+} TelemetryRtt;
+
+// What a tick shows
+typedef struct {
+    int64_t rtt_min_us;
+    int64_t rtt_avg_us;
+    int64_t rtt_p95_us;
+    uint32_t rtt_count;          // samples in the window, 0 = no round trip yet
+    uint64_t pings_lost;         // sent and not answered, the last one may still be on its way
+    uint64_t queue_bytes;        // send queue at the last sample
+    uint64_t queue_max;          // largest sample since the tick before
+    uint64_t goodput[TELEMETRY_CHANNELS];  // bytes per second received on each channel
+    uint64_t peer_missing;       // video frames the peer found missing, whole session
+    uint32_t bitrate;            // target after this tick
+} TelemetrySummary;
+
+typedef struct {
+    TelemetryConfig config;
+    TelemetryRtt rtt;
+
+    uint32_t next_ping_id;
+    uint64_t next_ping_us;
+    uint64_t pings_sent;
+    uint64_t pongs_received;
+
+    uint64_t peer_missing;       // latest report
+    uint64_t peer_missing_tick;  // at the last tick
+
+    uint64_t channel_bytes[TELEMETRY_CHANNELS];  // received since the last tick
+    uint64_t queue_bytes;
+    uint64_t queue_max;
+    uint64_t tick_us;
+
+    uint32_t bitrate;
+    uint32_t decreases;
+} Telemetry;
+
+void Telemetry_RttReset(TelemetryRtt* rtt);
+
+// Adds one round trip, returns false if it is negative or over TELEMETRY_MAX_RTT_US
+bool Telemetry_RttAdd(TelemetryRtt* rtt, int64_t sample_us);
+
+// Nearest rank over the window, 0 if empty
+int64_t Telemetry_RttPercentile(const TelemetryRtt* rtt, double percentile);
+
+void Telemetry_Init(Telemetry* telemetry, const TelemetryConfig* config, uint64_t now_us);
+
+// Writes a ping to out and returns true when one is due at now_us
+bool Telemetry_PingDue(Telemetry* telemetry, uint64_t now_us, uint8_t out[TELEMETRY_PING_SIZE]);
+
+// The answer to a peer's ping, with the video frames this side found missing
+void Telemetry_Answer(const uint8_t ping[TELEMETRY_PING_SIZE], uint64_t missing, uint8_t out[TELEMETRY_PONG_SIZE]);
+
+// The peer's answer to one of our pings; returns true if it gave a round trip sample
+bool Telemetry_OnPong(Telemetry* telemetry, const uint8_t pong[TELEMETRY_PONG_SIZE], uint64_t now_us);
+
+void Telemetry_OnReceive(Telemetry* telemetry, uint32_t channel, uint32_t bytes);
+void Telemetry_OnQueue(Telemetry* telemetry, uint64_t bytes);
+
+// Once TELEMETRY_TICK_US passed since the last tick: fills summary, moves the target bitrate and
+// returns true. Returns false before that.
+bool Telemetry_Tick(Telemetry* telemetry, uint64_t now_us, TelemetrySummary* summary);
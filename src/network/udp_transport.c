@@ -0,0 +1,1122 @@
+#include <string.h>
+
+// only the box, replay and socket helpers are used, the rest of derpnet.h stays unreferenced
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "udp_transport.h"
+
+#if defined(_WIN32)
+#include <mstcpip.h>
+typedef SOCKET UdpSocket;
+typedef int UdpAddressSize;
+#else
+typedef int UdpSocket;
+typedef socklen_t UdpAddressSize;
+#endif
+
+#define UDP_NONCE_SIZE 24
+#define UDP_AUTH_SIZE 16
+#define UDP_SEAL_OVERHEAD (UDP_NONCE_SIZE + UDP_AUTH_SIZE)
+#define UDP_DATA_HEADER_SIZE 14
+#define UDP_MAX_PLAIN (UDP_DATA_HEADER_SIZE + UDP_SHARD_SIZE)
+#define UDP_MAX_DATAGRAM (UDP_SEAL_OVERHEAD + UDP_MAX_PLAIN)
+#define UDP_NACK_ALL 0xffff
+#define UDP_SOCKET_BUFFER (4 << 20)   // a keyframe burst fits
+
+#define UDP_STUN_COOKIE 0x2112a442u
+#define UDP_STUN_HEADER_SIZE 20
+
+// plaintext types, above every packet type the session sends on the relay
+enum {
+    UDP_PROBE = 0x81,          // sent time (LE64), answered with the same
+    UDP_PROBE_ACK = 0x82,
+    UDP_DATA = 0x83,           // frame (LE32), shard (LE16), data shards (LE16), frame size (LE32), flags, payload
+    UDP_NACK = 0x84,           // frame (LE32), count (LE16), count shard indices (LE16), UDP_NACK_ALL for all
+    UDP_LOST = 0x85,           // frame (LE32) the receiver gave up
+};
+
+enum {
+    UDP_FLAG_KEYFRAME = 1,
+};
+
+static void UdpTransport_Put16(uint8_t* out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static uint16_t UdpTransport_Get16(const uint8_t* in)
+{
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static uint64_t UdpTransport_Ms(uint32_t value, uint32_t fallback)
+{
+    return (uint64_t)(value ? value : fallback) * 1000;
+}
+
+static bool UdpTransport_SameEndpoint(const UdpEndpoint* a, const UdpEndpoint* b)
+{
+    return memcmp(a->ip, b->ip, 4) == 0 && a->port == b->port;
+}
+
+static uint32_t UdpTransport_ShardCount(uint32_t size)
+{
+    return (size + UDP_SHARD_SIZE - 1) / UDP_SHARD_SIZE;
+}
+
+static uint32_t UdpTransport_GroupCount(uint32_t data_count)
+{
+    return (data_count + UDP_FEC_GROUP - 1) / UDP_FEC_GROUP;
+}
+
+// only the last data shard is short, parity is as long as the first shard of its group
+static uint32_t UdpTransport_ShardSize(uint32_t size, uint32_t index)
+{
+    uint32_t offset = index * UDP_SHARD_SIZE;
+    return size - offset < UDP_SHARD_SIZE ? size - offset : UDP_SHARD_SIZE;
+}
+
+static bool UdpTransport_DefaultSend(void* context, uintptr_t socket, const UdpEndpoint* to, const uint8_t* data, size_t size)
+{
+    (void)context;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(to->port) };
+    memcpy(&addr.sin_addr, to->ip, 4);
+    return sendto((UdpSocket)socket, (const char*)data, (int)size, 0, (struct sockaddr*)&addr, sizeof(addr)) == (int)size;
+}
+
+static void UdpTransport_Send(UdpTransport* t, const UdpEndpoint* to, const uint8_t* data, size_t size)
+{
+    UdpSendFunction* send = t->config.send ? t->config.send : &UdpTransport_DefaultSend;
+    if (send(t->config.send_context, t->socket, to, data, size))
+    {
+        t->stats.datagrams_sent++;
+        t->stats.bytes_sent += size;
+    }
+    else
+    {
+        t->stats.send_failures++;
+    }
+}
+
+static void UdpTransport_SendSealed(UdpTransport* t, const UdpEndpoint* to, const uint8_t* plain, size_t size)
+{
+    uint8_t datagram[UDP_MAX_DATAGRAM];
+    memcpy(datagram, t->nonce_prefix, sizeof(t->nonce_prefix));
+    Set64LE(datagram + 16, t->nonce_counter++);
+    DerpNet__BoxSealEx(datagram, datagram + UDP_NONCE_SIZE, datagram + UDP_SEAL_OVERHEAD, plain, size, t->shared_key);
+    UdpTransport_Send(t, to, datagram, UDP_SEAL_OVERHEAD + size);
+}
+
+static void UdpTransport_SendProbe(UdpTransport* t, const UdpEndpoint* to, uint8_t type, uint64_t time_us)
+{
+    uint8_t plain[9] = { type };
+    Set64LE(plain + 1, time_us);
+    UdpTransport_SendSealed(t, to, plain, sizeof(plain));
+}
+
+static void UdpTransport_SendLost(UdpTransport* t, uint32_t id)
+{
+    uint8_t plain[5] = { UDP_LOST };
+    Set32LE(plain + 1, id);
+    UdpTransport_SendSealed(t, &t->peer, plain, sizeof(plain));
+}
+
+// Connected, the peer's datagrams came from another address. One address is probed at a time,
+// another one only after that probe went unanswered for UDP_PATH_PROBE_MS.
+static void UdpTransport_ProbePath(UdpTransport* t, const UdpEndpoint* to, uint64_t now_us)
+{
+    if (t->path_probe_us != 0 && now_us - t->path_probe_us < UDP_PATH_PROBE_MS * 1000)
+    {
+        return;
+    }
+    t->path = *to;
+    t->path_probe_us = now_us;
+    UdpTransport_SendProbe(t, to, UDP_PROBE, now_us);
+}
+
+//
+// candidates
+//
+
+static bool UdpTransport_AddLocal(UdpTransport* t, const UdpEndpoint* endpoint, uint8_t type)
+{
+    for (uint32_t i = 0; i < t->local_count; i++)
+    {
+        if (UdpTransport_SameEndpoint(&t->local[i].endpoint, endpoint))
+        {
+            return false;
+        }
+    }
+    if (t->local_count == UDP_MAX_CANDIDATES)
+    {
+        return false;
+    }
+    t->local[t->local_count++] = (UdpCandidate){ .endpoint = *endpoint, .type = type };
+    return true;
+}
+
+static void UdpTransport_AddRemote(UdpTransport* t, const UdpEndpoint* endpoint, uint64_t now_us)
+{
+    for (uint32_t i = 0; i < t->remote_count; i++)
+    {
+        if (UdpTransport_SameEndpoint(&t->remote[i], endpoint))
+        {
+            return;
+        }
+    }
+    if (t->remote_count < UDP_MAX_REMOTE)
+    {
+        t->remote[t->remote_count++] = *endpoint;
+    }
+    if (t->state == UDP_STATE_IDLE)
+    {
+        t->state = UDP_STATE_PUNCHING;
+        t->punch_start_us = now_us;
+        t->next_probe_us = now_us;
+    }
+}
+
+bool UdpTransport_AddHostCandidate(UdpTransport* t, const uint8_t ip[4])
+{
+    UdpEndpoint endpoint = { .port = t->port };
+    memcpy(endpoint.ip, ip, 4);
+    return UdpTransport_AddLocal(t, &endpoint, UDP_CANDIDATE_HOST);
+}
+
+size_t UdpTransport_PackCandidates(UdpTransport* t, uint8_t out[UDP_CANDIDATES_MAX_SIZE])
+{
+    out[0] = (uint8_t)t->local_count;
+    uint8_t* at = out + 1;
+    for (uint32_t i = 0; i < t->local_count; i++, at += 7)
+    {
+        at[0] = t->local[i].type;
+        memcpy(at + 1, t->local[i].endpoint.ip, 4);
+        UdpTransport_Put16(at + 5, t->local[i].endpoint.port);
+    }
+    t->candidates_changed = false;
+    return (size_t)(at - out);
+}
+
+bool UdpTransport_AddRemoteCandidates(UdpTransport* t, const uint8_t* data, size_t size, uint64_t now_us)
+{
+    if (t->state == UDP_STATE_CLOSED || size < 1 || data[0] == 0 || data[0] > UDP_MAX_CANDIDATES || size != 1 + 7 * (size_t)data[0])
+    {
+        return false;
+    }
+    for (const uint8_t* at = data + 1; at != data + size; at += 7)
+    {
+        UdpEndpoint endpoint = { .port = UdpTransport_Get16(at + 5) };
+        memcpy(endpoint.ip, at + 1, 4);
+        if (endpoint.port != 0)
+        {
+            UdpTransport_AddRemote(t, &endpoint, now_us);
+        }
+    }
+    return true;
+}
+
+//
+// STUN binding request (RFC 5389), only for the mapped address
+//
+
+static void UdpTransport_SendStun(UdpTransport* t)
+{
+    uint8_t request[UDP_STUN_HEADER_SIZE] = { 0x00, 0x01, 0x00, 0x00 };
+    Set32BE(request + 4, UDP_STUN_COOKIE);
+    memcpy(request + 8, t->stun_txid, sizeof(t->stun_txid));
+    UdpTransport_Send(t, &t->stun_server, request, sizeof(request));
+}
+
+bool UdpTransport_StartStun(UdpTransport* t, const UdpEndpoint* server, uint64_t now_us)
+{
+    if (t->state == UDP_STATE_CLOSED)
+    {
+        return false;
+    }
+    t->stun_server = *server;
+    DerpNet__GetRandom(t->stun_txid, sizeof(t->stun_txid));
+    t->stun_attempts = 1;
+    t->next_stun_us = now_us + UDP_STUN_INTERVAL_MS * 1000;
+    UdpTransport_SendStun(t);
+    return true;
+}
+
+static bool UdpTransport_OnStun(UdpTransport* t, const UdpEndpoint* from, const uint8_t* data, size_t size)
+{
+    if (size < UDP_STUN_HEADER_SIZE || Get32BE(data + 4) != UDP_STUN_COOKIE)
+    {
+        return false;
+    }
+    if (t->stun_attempts == 0 || data[0] != 0x01 || data[1] != 0x01 || !UdpTransport_SameEndpoint(from, &t->stun_server) ||
+        memcmp(data + 8, t->stun_txid, sizeof(t->stun_txid)) != 0)
+    {
+        // a STUN message, just not the answer we wait for
+        return true;
+    }
+
+    size_t length = (size_t)(data[2] << 8 | data[3]);
+    const uint8_t* at = data + UDP_STUN_HEADER_SIZE;
+    const uint8_t* end = at + (length < size - UDP_STUN_HEADER_SIZE ? length : size - UDP_STUN_HEADER_SIZE);
+    while (end - at >= 4)
+    {
+        uint16_t type = (uint16_t)(at[0] << 8 | at[1]);
+        size_t attribute_size = (size_t)(at[2] << 8 | at[3]);
+        const uint8_t* value = at + 4;
+        if ((size_t)(end - value) < attribute_size)
+        {
+            break;
+        }
+
+        // XOR-MAPPED-ADDRESS, or the plain MAPPED-ADDRESS of older servers, IPv4 only
+        if ((type == 0x0020 || type == 0x0001) && attribute_size >= 8 && value[1] == 0x01)
+        {
+            bool xored = type == 0x0020;
+            UdpEndpoint mapped = { .port = (uint16_t)((value[2] << 8 | value[3]) ^ (xored ? UDP_STUN_COOKIE >> 16 : 0)) };
+            for (int i = 0; i < 4; i++)
+            {
+                mapped.ip[i] = value[4 + i] ^ (xored ? data[4 + i] : 0);
+            }
+            t->stun_attempts = 0;
+            if (UdpTransport_AddLocal(t, &mapped, UDP_CANDIDATE_REFLEXIVE))
+            {
+                t->candidates_changed = true;
+            }
+            break;
+        }
+        at = value + ((attribute_size + 3) & ~(size_t)3);
+    }
+    return true;
+}
+
+//
+// sending frames
+//
+
+static void UdpTransport_SendShard(UdpTransport* t, const UdpSentFrame* frame, uint32_t index)
+{
+    uint32_t data_count = UdpTransport_ShardCount(frame->size);
+
+    uint8_t plain[UDP_MAX_PLAIN];
+    plain[0] = UDP_DATA;
+    Set32LE(plain + 1, frame->id);
+    UdpTransport_Put16(plain + 5, (uint16_t)index);
+    UdpTransport_Put16(plain + 7, (uint16_t)data_count);
+    Set32LE(plain + 9, frame->size);
+    plain[13] = frame->keyframe ? UDP_FLAG_KEYFRAME : 0;
+
+    uint8_t* payload = plain + UDP_DATA_HEADER_SIZE;
+    uint32_t payload_size;
+    if (index < data_count)
+    {
+        payload_size = UdpTransport_ShardSize(frame->size, index);
+        memcpy(payload, frame->data + (size_t)index * UDP_SHARD_SIZE, payload_size);
+    }
+    else
+    {
+        uint32_t first = (index - data_count) * UDP_FEC_GROUP;
+        uint32_t last = first + UDP_FEC_GROUP < data_count ? first + UDP_FEC_GROUP : data_count;
+        payload_size = UdpTransport_ShardSize(frame->size, first);
+        memset(payload, 0, payload_size);
+        for (uint32_t shard = first; shard < last; shard++)
+        {
+            const uint8_t* data = frame->data + (size_t)shard * UDP_SHARD_SIZE;
+            uint32_t size = UdpTransport_ShardSize(frame->size, shard);
+            for (uint32_t i = 0; i < size; i++)
+            {
+                payload[i] ^= data[i];
+            }
+        }
+    }
+    UdpTransport_SendSealed(t, &t->peer, plain, UDP_DATA_HEADER_SIZE + payload_size);
+}
+
+bool UdpTransport_SendFrame(UdpTransport* t, const uint8_t* head, uint32_t head_size, const uint8_t* data, uint32_t size, bool keyframe)
+{
+    uint32_t total = head_size + size;
+    if (t->state != UDP_STATE_CONNECTED || total == 0 || total > UDP_MAX_FRAME_SIZE)
+    {
+        return false;
+    }
+
+    UdpSentFrame* frame = &t->sent[t->next_send_id % UDP_SEND_HISTORY];
+    if (frame->capacity < total)
+    {
+        uint8_t* grown = realloc(frame->data, total);
+        if (!grown)
+        {
+            return false;
+        }
+        frame->data = grown;
+        frame->capacity = total;
+    }
+    frame->id = t->next_send_id++;
+    frame->size = total;
+    frame->keyframe = keyframe;
+    memcpy(frame->data, head, head_size);
+    memcpy(frame->data + head_size, data, size);
+
+    // parity right behind its group, a burst loss hits one group and not its parity as well
+    uint32_t data_count = UdpTransport_ShardCount(total);
+    for (uint32_t index = 0; index < data_count; index++)
+    {
+        UdpTransport_SendShard(t, frame, index);
+        if ((index + 1) % UDP_FEC_GROUP == 0 || index + 1 == data_count)
+        {
+            UdpTransport_SendShard(t, frame, data_count + index / UDP_FEC_GROUP);
+        }
+    }
+    t->stats.frames_sent++;
+    return true;
+}
+
+static void UdpTransport_OnNack(UdpTransport* t, const uint8_t* plain, size_t size)
+{
+    if (size < 7)
+    {
+        return;
+    }
+    uint32_t id = Get32LE(plain + 1);
+    uint16_t count = UdpTransport_Get16(plain + 5);
+
+    const UdpSentFrame* frame = &t->sent[id % UDP_SEND_HISTORY];
+    if (id == 0 || frame->id != id)
+    {
+        // already out of the history, the receiver will give it up and wants a keyframe after it
+        t->keyframe_needed = true;
+        return;
+    }
+
+    uint32_t data_count = UdpTransport_ShardCount(frame->size);
+    uint32_t shard_count = data_count + UdpTransport_GroupCount(data_count);
+    if (count == UDP_NACK_ALL)
+    {
+        for (uint32_t index = 0; index < shard_count; index++)
+        {
+            UdpTransport_SendShard(t, frame, index);
+        }
+        t->stats.shards_retransmitted += shard_count;
+        return;
+    }
+
+    for (uint32_t i = 0; i < count && 7 + 2 * (size_t)i + 2 <= size; i++)
+    {
+        uint16_t index = UdpTransport_Get16(plain + 7 + 2 * i);
+        if (index < shard_count)
+        {
+            UdpTransport_SendShard(t, frame, index);
+            t->stats.shards_retransmitted++;
+        }
+    }
+}
+
+//
+// receiving frames
+//
+
+static void UdpTransport_Release(UdpRecvFrame* frame)
+{
+    frame->id = 0;
+    frame->data_count = 0;
+}
+
+// what PopFrame returned is the caller's until it calls into the transport again
+static void UdpTransport_ReleasePopped(UdpTransport* t)
+{
+    if (t->popped)
+    {
+        UdpTransport_Release(t->popped);
+        t->popped = NULL;
+    }
+}
+
+static bool UdpTransport_Reserve(UdpRecvFrame* frame, uint32_t data_count)
+{
+    if (frame->capacity >= data_count)
+    {
+        return true;
+    }
+    size_t groups = UdpTransport_GroupCount(data_count);
+    uint8_t* data = realloc(frame->data, (data_count + groups) * (size_t)UDP_SHARD_SIZE + data_count + groups);
+    if (!data)
+    {
+        return false;
+    }
+    frame->data = data;
+    frame->capacity = data_count;
+    return true;
+}
+
+// the buffers of a slot: data shards, one parity shard per group, then the have flags
+static void UdpTransport_Layout(UdpRecvFrame* frame)
+{
+    size_t groups = UdpTransport_GroupCount(frame->capacity);
+    frame->parity = frame->data + (size_t)frame->capacity * UDP_SHARD_SIZE;
+    frame->have = frame->parity + groups * UDP_SHARD_SIZE;
+}
+
+// Gives up the frame that is next and moves on to the one after it. Decoding resumes at a keyframe,
+// which the sender is asked for.
+static void UdpTransport_GiveUp(UdpTransport* t)
+{
+    UdpRecvFrame* frame = &t->recv[t->next_recv_id % UDP_RECV_WINDOW];
+    bool complete = frame->id == t->next_recv_id && frame->data_count != 0 && frame->missing == 0;
+    if (complete)
+    {
+        t->stats.frames_skipped++;
+    }
+    else
+    {
+        t->stats.frames_lost++;
+        t->waiting_keyframe = true;
+        if (t->state == UDP_STATE_CONNECTED)
+        {
+            UdpTransport_SendLost(t, t->next_recv_id);
+        }
+    }
+    if (frame->id == t->next_recv_id)
+    {
+        UdpTransport_Release(frame);
+    }
+    t->next_recv_id++;
+}
+
+// Gives up every frame before next at once. Only the ids the window can hold are looked at, the
+// rest never had a slot; one keyframe request covers them all.
+static void UdpTransport_GiveUpTo(UdpTransport* t, uint32_t next)
+{
+    uint32_t count = next - t->next_recv_id;
+    uint32_t held = count < UDP_RECV_WINDOW ? count : UDP_RECV_WINDOW;
+    uint64_t lost = count - held;
+    for (uint32_t id = t->next_recv_id; id - t->next_recv_id < held; id++)
+    {
+        UdpRecvFrame* frame = &t->recv[id % UDP_RECV_WINDOW];
+        if (frame->id == id && frame->data_count != 0 && frame->missing == 0)
+        {
+            t->stats.frames_skipped++;
+        }
+        else
+        {
+            lost++;
+        }
+        if (frame->id == id)
+        {
+            UdpTransport_Release(frame);
+        }
+    }
+    t->next_recv_id = next;
+
+    if (lost != 0)
+    {
+        t->stats.frames_lost += lost;
+        t->waiting_keyframe = true;
+        if (t->state == UDP_STATE_CONNECTED)
+        {
+            UdpTransport_SendLost(t, next - 1);
+        }
+    }
+}
+
+// one missing data shard and the parity of its group: the XOR of the rest is the missing one
+static void UdpTransport_Recover(UdpTransport* t, UdpRecvFrame* frame, uint32_t group)
+{
+    uint32_t first = group * UDP_FEC_GROUP;
+    uint32_t last = first + UDP_FEC_GROUP < frame->data_count ? first + UDP_FEC_GROUP : frame->data_count;
+    if (!frame->have[frame->data_count + group])
+    {
+        return;
+    }
+
+    uint32_t lost = UINT32_MAX;
+    for (uint32_t shard = first; shard < last; shard++)
+    {
+        if (!frame->have[shard])
+        {
+            if (lost != UINT32_MAX)
+            {
+                return;
+            }
+            lost = shard;
+        }
+    }
+    if (lost == UINT32_MAX)
+    {
+        return;
+    }
+
+    uint8_t* out = frame->data + (size_t)lost * UDP_SHARD_SIZE;
+    uint32_t out_size = UdpTransport_ShardSize(frame->size, lost);
+    memcpy(out, frame->parity + (size_t)group * UDP_SHARD_SIZE, out_size);
+    for (uint32_t shard = first; shard < last; shard++)
+    {
+        const uint8_t* data = frame->data + (size_t)shard * UDP_SHARD_SIZE;
+        uint32_t size = UdpTransport_ShardSize(frame->size, shard);
+        size = size < out_size ? size : out_size;
+        for (uint32_t i = 0; shard != lost && i < size; i++)
+        {
+            out[i] ^= data[i];
+        }
+    }
+    frame->have[lost] = 1;
+    frame->missing--;
+    t->stats.shards_recovered++;
+}
+
+static void UdpTransport_OnData(UdpTransport* t, const uint8_t* plain, size_t size, uint64_t now_us)
+{
+    if (size < UDP_DATA_HEADER_SIZE)
+    {
+        return;
+    }
+    uint32_t id = Get32LE(plain + 1);
+    uint32_t index = UdpTransport_Get16(plain + 5);
+    uint32_t data_count = UdpTransport_Get16(plain + 7);
+    uint32_t frame_size = Get32LE(plain + 9);
+    bool keyframe = (plain[13] & UDP_FLAG_KEYFRAME) != 0;
+    const uint8_t* payload = plain + UDP_DATA_HEADER_SIZE;
+    uint32_t payload_size = (uint32_t)(size - UDP_DATA_HEADER_SIZE);
+
+    if (frame_size == 0 || frame_size > UDP_MAX_FRAME_SIZE || data_count != UdpTransport_ShardCount(frame_size) ||
+        index >= data_count + UdpTransport_GroupCount(data_count))
+    {
+        t->stats.rejected++;
+        return;
+    }
+    uint32_t first = index < data_count ? index : (index - data_count) * UDP_FEC_GROUP;
+    if (payload_size != UdpTransport_ShardSize(frame_size, first))
+    {
+        t->stats.rejected++;
+        return;
+    }
+    if (id < t->next_recv_id)
+    {
+        // a retransmit that came late, or a frame already given up
+        return;
+    }
+
+    // far behind the sender: what does not fit the window is given up
+    if (id - t->next_recv_id >= UDP_RECV_WINDOW)
+    {
+        UdpTransport_GiveUpTo(t, id - UDP_RECV_WINDOW + 1);
+    }
+
+    // frames between the newest one so far and this one had no shard arrive yet
+    if (id > t->highest_id)
+    {
+        for (uint32_t gap = t->highest_id + 1 > t->next_recv_id ? t->highest_id + 1 : t->next_recv_id; gap < id; gap++)
+        {
+            UdpRecvFrame* missing = &t->recv[gap % UDP_RECV_WINDOW];
+            if (missing->id != gap)
+            {
+                *missing = (UdpRecvFrame){ .id = gap, .capacity = missing->capacity, .data = missing->data, .first_us = now_us, .last_us = now_us };
+            }
+        }
+        t->highest_id = id;
+        t->highest_us = now_us;
+    }
+
+    UdpRecvFrame* frame = &t->recv[id % UDP_RECV_WINDOW];
+    if (frame->id != id || frame->data_count == 0)
+    {
+        uint64_t first_us = frame->id == id ? frame->first_us : now_us;
+        uint64_t nack_us = frame->id == id ? frame->nack_us : 0;
+        if (!UdpTransport_Reserve(frame, data_count))
+        {
+            return;
+        }
+        frame->id = id;
+        frame->size = frame_size;
+        frame->data_count = (uint16_t)data_count;
+        frame->missing = (uint16_t)data_count;
+        frame->keyframe = keyframe;
+        frame->first_us = first_us;
+        frame->nack_us = nack_us;
+        UdpTransport_Layout(frame);
+        memset(frame->have, 0, data_count + UdpTransport_GroupCount(data_count));
+    }
+    else if (frame->size != frame_size)
+    {
+        t->stats.rejected++;
+        return;
+    }
+    frame->last_us = now_us;
+
+    if (frame->have[index])
+    {
+        return;
+    }
+    frame->have[index] = 1;
+    if (index < data_count)
+    {
+        memcpy(frame->data + (size_t)index * UDP_SHARD_SIZE, payload, payload_size);
+        frame->missing--;
+    }
+    else
+    {
+        memcpy(frame->parity + (size_t)(index - data_count) * UDP_SHARD_SIZE, payload, payload_size);
+    }
+
+    if (frame->missing != 0)
+    {
+        UdpTransport_Recover(t, frame, (index < data_count ? index : first) / UDP_FEC_GROUP);
+    }
+}
+
+// the data shards nobody can rebuild: all missing ones of a group without parity, all but one with it
+static void UdpTransport_SendNack(UdpTransport* t, UdpRecvFrame* frame, uint64_t now_us)
+{
+    uint8_t plain[7 + 2 * UDP_NACK_MAX];
+    plain[0] = UDP_NACK;
+    Set32LE(plain + 1, frame->id);
+    uint32_t count = 0;
+
+    if (frame->data_count == 0)
+    {
+        // not one shard arrived, not even how many there are
+        count = UDP_NACK_ALL;
+    }
+    for (uint32_t group = 0; count != UDP_NACK_ALL && group < UdpTransport_GroupCount(frame->data_count); group++)
+    {
+        uint32_t first = group * UDP_FEC_GROUP;
+        uint32_t last = first + UDP_FEC_GROUP < frame->data_count ? first + UDP_FEC_GROUP : frame->data_count;
+        bool parity = frame->have[frame->data_count + group] != 0;
+        for (uint32_t shard = first; shard < last; shard++)
+        {
+            if (frame->have[shard])
+            {
+                continue;
+            }
+            if (parity)
+            {
+                parity = false;
+                continue;
+            }
+            if (count == UDP_NACK_MAX)
+            {
+                count = UDP_NACK_ALL;
+                break;
+            }
+            UdpTransport_Put16(plain + 7 + 2 * count++, (uint16_t)shard);
+        }
+    }
+
+    UdpTransport_Put16(plain + 5, (uint16_t)count);
+    UdpTransport_SendSealed(t, &t->peer, plain, 7 + (count == UDP_NACK_ALL ? 0 : 2 * (size_t)count));
+    t->stats.nacks_sent++;
+
+    // the retransmit needs a round trip to come back
+    uint64_t interval = t->stats.rtt_us + t->stats.rtt_us / 2;
+    frame->nack_us = now_us + (interval > UDP_NACK_MIN_INTERVAL_MS * 1000 ? interval : UDP_NACK_MIN_INTERVAL_MS * 1000);
+}
+
+static bool UdpTransport_Incomplete(const UdpRecvFrame* frame)
+{
+    return frame->data_count == 0 || frame->missing != 0;
+}
+
+static void UdpTransport_PollFrames(UdpTransport* t, uint64_t now_us)
+{
+    uint64_t deadline = UdpTransport_Ms(t->config.frame_deadline_ms, UDP_FRAME_DEADLINE_MS);
+
+    for (;;)
+    {
+        UdpRecvFrame* next = &t->recv[t->next_recv_id % UDP_RECV_WINDOW];
+        if (next->id != t->next_recv_id)
+        {
+            break;
+        }
+        // while waiting for a keyframe a frame known not to be one is not worth waiting for
+        bool skip = t->waiting_keyframe && next->data_count != 0 && !next->keyframe;
+        if (!skip && (!UdpTransport_Incomplete(next) || now_us - next->first_us < deadline))
+        {
+            break;
+        }
+        UdpTransport_GiveUp(t);
+    }
+
+    if (t->state != UDP_STATE_CONNECTED)
+    {
+        return;
+    }
+    for (uint32_t id = t->next_recv_id; id <= t->highest_id && id - t->next_recv_id < UDP_RECV_WINDOW; id++)
+    {
+        UdpRecvFrame* frame = &t->recv[id % UDP_RECV_WINDOW];
+        if (frame->id == id && UdpTransport_Incomplete(frame) && now_us >= frame->nack_us &&
+            now_us - frame->last_us >= UDP_NACK_DELAY_MS * 1000 && !(t->waiting_keyframe && frame->data_count != 0 && !frame->keyframe))
+        {
+            UdpTransport_SendNack(t, frame, now_us);
+        }
+    }
+}
+
+bool UdpTransport_PopFrame(UdpTransport* t, const uint8_t** data, uint32_t* size)
+{
+    UdpTransport_ReleasePopped(t);
+
+    for (;;)
+    {
+        UdpRecvFrame* frame = &t->recv[t->next_recv_id % UDP_RECV_WINDOW];
+        if (frame->id != t->next_recv_id || UdpTransport_Incomplete(frame))
+        {
+            return false;
+        }
+        t->next_recv_id++;
+        if (t->waiting_keyframe && !frame->keyframe)
+        {
+            UdpTransport_Release(frame);
+            t->stats.frames_skipped++;
+            continue;
+        }
+
+        t->waiting_keyframe = false;
+        t->popped = frame;
+        t->stats.frames_delivered++;
+        *data = frame->data;
+        *size = frame->size;
+        return true;
+    }
+}
+
+//
+// datagrams
+//
+
+static bool UdpTransport_Unseal(UdpTransport* t, const uint8_t* datagram, size_t size, uint8_t* plain)
+{
+    // a datagram of ours reflected back would open with the same key
+    if (memcmp(datagram, t->nonce_prefix, sizeof(t->nonce_prefix)) == 0)
+    {
+        return false;
+    }
+
+    DerpNetReplay replay = { .Highest = t->replay_highest, .Seen = t->replay_seen };
+    memcpy(replay.Prefix, t->replay_prefix, sizeof(replay.Prefix));
+    if (!DerpNet__ReplayCheck(&replay, datagram) ||
+        !DerpNet__BoxUnsealEx(plain, datagram + UDP_SEAL_OVERHEAD, size - UDP_SEAL_OVERHEAD, datagram + UDP_NONCE_SIZE, datagram, t->shared_key))
+    {
+        return false;
+    }
+    DerpNet__ReplayUpdate(&replay, datagram);
+    memcpy(t->replay_prefix, replay.Prefix, sizeof(replay.Prefix));
+    t->replay_highest = replay.Highest;
+    t->replay_seen = replay.Seen;
+    return true;
+}
+
+void UdpTransport_OnDatagram(UdpTransport* t, const UdpEndpoint* from, const uint8_t* data, size_t size, uint64_t now_us)
+{
+    if (t->state == UDP_STATE_CLOSED)
+    {
+        return;
+    }
+    UdpTransport_ReleasePopped(t);
+    t->stats.datagrams_received++;
+    t->stats.bytes_received += size;
+
+    if (UdpTransport_OnStun(t, from, data, size))
+    {
+        return;
+    }
+
+    uint8_t plain[UDP_MAX_PLAIN];
+    if (size <= UDP_SEAL_OVERHEAD || size > UDP_MAX_DATAGRAM || !UdpTransport_Unseal(t, data, size, plain))
+    {
+        t->stats.rejected++;
+        return;
+    }
+    size -= UDP_SEAL_OVERHEAD;
+
+    uint8_t type = plain[0];
+    if (type == UDP_PROBE && size == 9)
+    {
+        // answered where it came from, which is how a peer behind NAT becomes reachable
+        UdpTransport_SendProbe(t, from, UDP_PROBE_ACK, Get64LE(plain + 1));
+        if (t->state == UDP_STATE_IDLE || t->state == UDP_STATE_PUNCHING)
+        {
+            UdpTransport_AddRemote(t, from, now_us);
+        }
+    }
+    else if (type == UDP_PROBE_ACK && size == 9)
+    {
+        uint64_t sent_us = Get64LE(plain + 1);
+        if (sent_us <= now_us)
+        {
+            uint64_t rtt = now_us - sent_us;
+            t->stats.rtt_us = t->stats.rtt_us ? (7 * t->stats.rtt_us + rtt) / 8 : rtt;
+        }
+        if (t->state == UDP_STATE_IDLE || t->state == UDP_STATE_PUNCHING)
+        {
+            t->state = UDP_STATE_CONNECTED;
+            t->stats.connect_us = now_us - (t->punch_start_us ? t->punch_start_us : now_us);
+            t->peer = *from;
+            t->next_probe_us = now_us + UDP_KEEPALIVE_MS * 1000;
+        }
+        else if (t->state == UDP_STATE_CONNECTED && t->path_probe_us != 0 && sent_us == t->path_probe_us &&
+                 UdpTransport_SameEndpoint(from, &t->path))
+        {
+            // the peer answered at the new address, datagrams go there from now on
+            t->peer = *from;
+            t->path_probe_us = 0;
+            t->stats.path_changes++;
+        }
+    }
+    else if (type == UDP_DATA)
+    {
+        UdpTransport_OnData(t, plain, size, now_us);
+    }
+    else if (type == UDP_NACK)
+    {
+        UdpTransport_OnNack(t, plain, size);
+    }
+    else if (type == UDP_LOST && size == 5)
+    {
+        t->keyframe_needed = true;
+    }
+    else
+    {
+        t->stats.rejected++;
+        return;
+    }
+
+    t->last_recv_us = now_us;
+    if (t->state == UDP_STATE_CONNECTED && !UdpTransport_SameEndpoint(from, &t->peer))
+    {
+        // the peer's NAT may have moved it to another port, followed once it answers there
+        UdpTransport_ProbePath(t, from, now_us);
+    }
+}
+
+int UdpTransport_Receive(UdpTransport* t, uint64_t now_us)
+{
+    if (t->state == UDP_STATE_CLOSED)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    for (;;)
+    {
+        uint8_t datagram[UDP_MAX_DATAGRAM + 1];
+        struct sockaddr_in addr;
+        UdpAddressSize addr_size = sizeof(addr);
+        int got = recvfrom((UdpSocket)t->socket, (char*)datagram, sizeof(datagram), 0, (struct sockaddr*)&addr, &addr_size);
+        if (got < 0)
+        {
+#if defined(_WIN32)
+            int error = WSAGetLastError();
+            if (error == WSAEWOULDBLOCK)
+            {
+                return count;
+            }
+            if (error == WSAECONNRESET || error == WSAEMSGSIZE)
+            {
+                continue;
+            }
+#else
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return count;
+            }
+            if (errno == EINTR || errno == ECONNREFUSED)
+            {
+                continue;
+            }
+#endif
+            return -1;
+        }
+        if (addr.sin_family != AF_INET)
+        {
+            continue;
+        }
+
+        UdpEndpoint from = { .port = ntohs(addr.sin_port) };
+        memcpy(from.ip, &addr.sin_addr, 4);
+        UdpTransport_OnDatagram(t, &from, datagram, (size_t)got, now_us);
+        count++;
+    }
+}
+
+void UdpTransport_Poll(UdpTransport* t, uint64_t now_us)
+{
+    UdpTransport_ReleasePopped(t);
+    if (t->stun_attempts != 0 && now_us >= t->next_stun_us)
+    {
+        if (t->stun_attempts == UDP_STUN_ATTEMPTS)
+        {
+            // no STUN there, the host candidates are all we have
+            t->stun_attempts = 0;
+        }
+        else
+        {
+            t->stun_attempts++;
+            t->next_stun_us = now_us + UDP_STUN_INTERVAL_MS * 1000;
+            UdpTransport_SendStun(t);
+        }
+    }
+
+    if (t->state == UDP_STATE_PUNCHING)
+    {
+        if (now_us - t->punch_start_us >= UdpTransport_Ms(t->config.punch_timeout_ms, UDP_PUNCH_TIMEOUT_MS))
+        {
+            t->state = UDP_STATE_FAILED;
+        }
+        else if (now_us >= t->next_probe_us)
+        {
+            for (uint32_t i = 0; i < t->remote_count; i++)
+            {
+                UdpTransport_SendProbe(t, &t->remote[i], UDP_PROBE, now_us);
+            }
+            t->next_probe_us = now_us + UDP_PUNCH_INTERVAL_MS * 1000;
+        }
+    }
+    else if (t->state == UDP_STATE_CONNECTED)
+    {
+        if (now_us - t->last_recv_us >= UdpTransport_Ms(t->config.dead_ms, UDP_DEAD_MS))
+        {
+            t->state = UDP_STATE_LOST;
+        }
+        else if (now_us >= t->next_probe_us)
+        {
+            UdpTransport_SendProbe(t, &t->peer, UDP_PROBE, now_us);
+            t->next_probe_us = now_us + UDP_KEEPALIVE_MS * 1000;
+        }
+    }
+
+    if (t->state != UDP_STATE_CLOSED)
+    {
+        UdpTransport_PollFrames(t, now_us);
+    }
+}
+
+uint32_t UdpTransport_NextPollMs(const UdpTransport* t, uint64_t now_us)
+{
+    uint64_t wake = UINT64_MAX;
+#define UDP_WAKE(at) do { uint64_t at_ = (at); wake = at_ < wake ? at_ : wake; } while (0)
+
+    if (t->stun_attempts != 0)
+    {
+        UDP_WAKE(t->next_stun_us);
+    }
+    if (t->state == UDP_STATE_PUNCHING)
+    {
+        UDP_WAKE(t->next_probe_us);
+        UDP_WAKE(t->punch_start_us + UdpTransport_Ms(t->config.punch_timeout_ms, UDP_PUNCH_TIMEOUT_MS));
+    }
+    else if (t->state == UDP_STATE_CONNECTED)
+    {
+        UDP_WAKE(t->next_probe_us);
+        UDP_WAKE(t->last_recv_us + UdpTransport_Ms(t->config.dead_ms, UDP_DEAD_MS));
+    }
+
+    if (t->state != UDP_STATE_CLOSED)
+    {
+        uint64_t deadline = UdpTransport_Ms(t->config.frame_deadline_ms, UDP_FRAME_DEADLINE_MS);
+        for (uint32_t i = 0; i < UDP_RECV_WINDOW; i++)
+        {
+            const UdpRecvFrame* frame = &t->recv[i];
+            if (frame->id >= t->next_recv_id && UdpTransport_Incomplete(frame))
+            {
+                uint64_t nack = frame->last_us + UDP_NACK_DELAY_MS * 1000;
+                UDP_WAKE(nack > frame->nack_us ? nack : frame->nack_us);
+                UDP_WAKE(frame->first_us + deadline);
+            }
+        }
+    }
+#undef UDP_WAKE
+
+    if (wake == UINT64_MAX)
+    {
+        return UINT32_MAX;
+    }
+    return wake <= now_us ? 0 : (uint32_t)((wake - now_us + 999) / 1000);
+}
+
+//
+// socket
+//
+
+bool UdpTransport_Open(UdpTransport* t, const UdpTransportConfig* config, uint16_t port)
+{
+    memset(t, 0, sizeof(*t));
+    t->socket = (uintptr_t)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (t->socket == UDP_INVALID_SOCKET)
+    {
+        return false;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(port),
+    };
+    UdpAddressSize addr_size = sizeof(addr);
+    if (bind((UdpSocket)t->socket, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname((UdpSocket)t->socket, (struct sockaddr*)&addr, &addr_size) != 0)
+    {
+        DerpNet__CloseSocket(t->socket);
+        t->socket = UDP_INVALID_SOCKET;
+        return false;
+    }
+    DerpNet__SetBlocking(t->socket, false);
+
+    // best effort, the defaults only hold a few packets of a keyframe
+    int buffer = UDP_SOCKET_BUFFER;
+    setsockopt((UdpSocket)t->socket, SOL_SOCKET, SO_SNDBUF, (const char*)&buffer, sizeof(buffer));
+    setsockopt((UdpSocket)t->socket, SOL_SOCKET, SO_RCVBUF, (const char*)&buffer, sizeof(buffer));
+#if defined(_WIN32)
+    // a probe to a candidate nobody listens on would otherwise fail the next recvfrom
+    BOOL report = FALSE;
+    DWORD returned;
+    WSAIoctl((UdpSocket)t->socket, SIO_UDP_CONNRESET, &report, sizeof(report), NULL, 0, &returned, NULL, NULL);
+#endif
+
+    t->config = *config;
+    t->port = ntohs(addr.sin_port);
+    DerpNet__GetSharedKey(t->shared_key, config->secret, config->peer);
+    DerpNet__GetRandom(t->nonce_prefix, sizeof(t->nonce_prefix));
+    t->next_send_id = 1;
+    t->next_recv_id = 1;
+    t->state = UDP_STATE_IDLE;
+    return true;
+}
+
+void UdpTransport_Close(UdpTransport* t)
+{
+    if (t->state == UDP_STATE_CLOSED)
+    {
+        return;
+    }
+    DerpNet__CloseSocket(t->socket);
+    for (uint32_t i = 0; i < UDP_SEND_HISTORY; i++)
+    {
+        free(t->sent[i].data);
+    }
+    for (uint32_t i = 0; i < UDP_RECV_WINDOW; i++)
+    {
+        free(t->recv[i].data);
+    }
+    memset(t, 0, sizeof(*t));
+    t->socket = UDP_INVALID_SOCKET;
+}
+
+bool UdpTransport_Watch(UdpTransport* t, uintptr_t event)
+{
+#if defined(_WIN32)
+    return WSAEventSelect((UdpSocket)t->socket, (WSAEVENT)event, FD_READ) == 0;
+#elif defined(__linux__)
+    // edge triggered like the DERP socket, Receive reads until the socket is empty
+    struct epoll_event watch = { .events = EPOLLIN | EPOLLET };
+    watch.data.fd = (int)t->socket;
+    return epoll_ctl((int)event, EPOLL_CTL_ADD, (int)t->socket, &watch) == 0;
+#else
+    (void)t;
+    (void)event;
+    return false;
+#endif
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Video over UDP, straight between the peers, with FEC and selective retransmit.
+//
+// Everything on the relay or the direct TCP link waits behind whatever TCP is retransmitting. Video
+// does not need that: a lost datagram is either rebuilt from parity or asked for again, and a frame
+// that cannot be completed in time is given up for the next keyframe.
+//
+// Setting up the path. Each end binds a UDP socket and sends its candidates over the DERP session:
+// its interface addresses with the bound port, plus the address a STUN server saw (the DERP server's
+// STUN port) once it answered. With the peer's candidates both ends send probes to all of them at
+// the same time, so each NAT has an outgoing mapping by the time the other end's probes arrive. A
+// probe is answered to the address it came from, which need not be a candidate (peer reflexive).
+// The first answer connects. When the peer's datagrams later come from another address (its NAT
+// moved it), that address is probed and datagrams go there once the peer answers from it, so a
+// copy of a datagram raced in from somewhere else cannot steer the video away from the peer.
+// Without an answer by punch_timeout_ms the transport has failed, and once connected, nothing heard
+// from the peer for dead_ms (probes keep the NAT mappings open) means it was lost. In both cases
+// the session stays on, or goes back to, DERP.
+//
+// Frames. A frame is cut into UDP_SHARD_SIZE shards; after every UDP_FEC_GROUP data shards one
+// parity shard, the XOR of the group, follows, so any one lost shard of a group is rebuilt where
+// it is received. The receiver delivers frames in order. When shards of a frame stop coming with
+// some missing, it names them in a NACK and the sender sends them again from its history of the
+// last frames. A frame still incomplete frame_deadline_ms after its first shard is given up: the
+// receiver tells the sender, which asks the encoder for a keyframe, and drops frames until that
+// keyframe arrives instead of decoding on a broken reference.
+//
+// Datagrams are sealed with the session's shared key (the same Curve25519 + XSalsa20-Poly1305 box
+// as DERP frames) under their own nonce prefix, and checked against a replay window that keeps
+// the first prefix the peer used for the whole session (see DerpNetReplay). Types are
+// 0x80 and up, so a relay packet replayed at the socket opens to nothing the transport accepts,
+// and a datagram of our own reflected back carries our prefix and is dropped.
+//
+// Nothing here blocks or runs a thread. The owner calls Receive when the socket is readable and
+// Poll when NextPollMs ran out, both with the current time, and holds its own lock around all calls.
+
+#define UDP_INVALID_SOCKET ((uintptr_t)-1)
+#define UDP_KEY_SIZE 32
+#define UDP_MAX_CANDIDATES 8                 // each side announces at most this many
+#define UDP_MAX_REMOTE (2 * UDP_MAX_CANDIDATES)  // announced and peer reflexive ones
+#define UDP_CANDIDATES_MAX_SIZE (1 + 7 * UDP_MAX_CANDIDATES)
+#define UDP_SHARD_SIZE 1200                  // whole datagram stays below 1280, the smallest IPv6 MTU
+#define UDP_FEC_GROUP 8                      // 12.5% parity
+#define UDP_MAX_FRAME_SIZE (4u << 20)
+#define UDP_SEND_HISTORY 16                  // frames kept for retransmits
+#define UDP_RECV_WINDOW 16                   // frames being reassembled
+#define UDP_NACK_MAX 256                     // shard indices in one NACK, more asks for the whole frame
+#define UDP_STUN_PORT 3478
+
+#define UDP_PUNCH_INTERVAL_MS 20
+#define UDP_PUNCH_TIMEOUT_MS 5000
+#define UDP_KEEPALIVE_MS 1000
+#define UDP_DEAD_MS 4000
+#define UDP_FRAME_DEADLINE_MS 300
+#define UDP_NACK_DELAY_MS 5                  // quiet time after the last shard before asking, covers reordering
+#define UDP_NACK_MIN_INTERVAL_MS 15
+#define UDP_STUN_INTERVAL_MS 250
+#define UDP_PATH_PROBE_MS 250                // an unanswered probe of a new peer address gives way after this
+#define UDP_STUN_ATTEMPTS 4
+
+typedef enum {
+    UDP_STATE_CLOSED,
+    UDP_STATE_IDLE,         // socket open, no candidates from the peer yet
+    UDP_STATE_PUNCHING,
+    UDP_STATE_CONNECTED,
+    UDP_STATE_FAILED,       // no answer from any candidate in time
+    UDP_STATE_LOST,         // was connected, the peer went quiet
+} UdpState;
+
+typedef enum {
+    UDP_CANDIDATE_HOST,
+    UDP_CANDIDATE_REFLEXIVE,
+} UdpCandidateType;
+
+typedef struct {
+    uint8_t ip[4];          // IPv4, network order
+    uint16_t port;
+} UdpEndpoint;
+
+typedef struct {
+    UdpEndpoint endpoint;
+    uint8_t type;           // UdpCandidateType
+} UdpCandidate;
+
+// Sends one datagram, false when it did not leave. The default is sendto; tests put a shim here
+// that loses and reorders datagrams.
+typedef bool UdpSendFunction(void* context, uintptr_t socket, const UdpEndpoint* to, const uint8_t* data, size_t size);
+
+typedef struct {
+    uint8_t secret[UDP_KEY_SIZE];
+    uint8_t peer[UDP_KEY_SIZE];
+    uint32_t punch_timeout_ms;    // 0 = UDP_PUNCH_TIMEOUT_MS, same for the others
+    uint32_t dead_ms;
+    uint32_t frame_deadline_ms;
+    UdpSendFunction* send;        // NULL = sendto
+    void* send_context;
+} UdpTransportConfig;
+
+typedef struct {
+    uint64_t connect_us;          // first remote candidate to connected
+    uint64_t rtt_us;              // smoothed, from probe answers
+    uint64_t datagrams_sent;
+    uint64_t datagrams_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t send_failures;       // socket buffer full, left to FEC and retransmits
+    uint64_t rejected;            // failed to open, replayed or reflected
+    uint64_t path_changes;        // the peer answered at a new address and was followed there
+    uint64_t frames_sent;
+    uint64_t frames_delivered;
+    uint64_t frames_lost;         // given up by the receiver
+    uint64_t frames_skipped;      // dropped while waiting for a keyframe
+    uint64_t shards_recovered;    // rebuilt from parity
+    uint64_t nacks_sent;
+    uint64_t shards_retransmitted;
+} UdpTransportStats;
+
+typedef struct {
+    uint32_t id;
+    uint32_t size;
+    uint32_t capacity;
+    bool keyframe;
+    uint8_t* data;
+} UdpSentFrame;
+
+typedef struct {
+    uint32_t id;                  // 0 = slot free
+    uint32_t size;
+    uint32_t capacity;            // shards the buffers hold
+    uint16_t data_count;
+    uint16_t missing;             // data shards not there yet
+    bool keyframe;
+    uint8_t* data;                // data_count shards, the last one short
+    uint8_t* parity;              // one shard per group
+    uint8_t* have;                // data shards then parity shards, 1 once received
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t nack_us;             // no NACK before this
+} UdpRecvFrame;
+
+typedef struct {
+    UdpState state;
+    uintptr_t socket;
+    uint16_t port;
+    UdpTransportConfig config;
+    uint8_t shared_key[32];
+
+    uint8_t nonce_prefix[16];
+    uint64_t nonce_counter;
+    uint8_t replay_prefix[16];    // the peer's nonce window, as DerpNetReplay keeps it
+    uint64_t replay_highest;
+    uint64_t replay_seen;
+
+    UdpCandidate local[UDP_MAX_CANDIDATES];
+    uint32_t local_count;
+    bool candidates_changed;      // a reflexive candidate was added, announce them again
+
+    UdpEndpoint remote[UDP_MAX_REMOTE];
+    uint32_t remote_count;
+    UdpEndpoint peer;             // where datagrams go once connected
+    UdpEndpoint path;             // another address the peer's datagrams came from, probed before use
+    uint64_t path_probe_us;       // when it was probed, 0 = no probe out
+    uint64_t punch_start_us;
+    uint64_t next_probe_us;
+    uint64_t last_recv_us;
+
+    UdpEndpoint stun_server;
+    uint8_t stun_txid[12];
+    uint32_t stun_attempts;       // 0 = no request outstanding
+    uint64_t next_stun_us;
+
+    // sending side
+    uint32_t next_send_id;
+    bool keyframe_needed;         // the receiver lost a frame, cleared by the owner
+    UdpSentFrame sent[UDP_SEND_HISTORY];
+
+    // receiving side
+    uint32_t next_recv_id;        // the frame delivered next
+    uint32_t highest_id;          // newest frame a shard was seen of
+    uint64_t highest_us;
+    bool waiting_keyframe;
+    UdpRecvFrame recv[UDP_RECV_WINDOW];
+    UdpRecvFrame* popped;         // released on the next call that can touch the window
+
+    UdpTransportStats stats;
+} UdpTransport;
+
+// Binds a non-blocking socket on all interfaces, port 0 picks a free one
+bool UdpTransport_Open(UdpTransport* t, const UdpTransportConfig* config, uint16_t port);
+void UdpTransport_Close(UdpTransport* t);
+
+// Signals event when a datagram arrives: the WSAEVENT on Windows, an epoll descriptor on Linux
+bool UdpTransport_Watch(UdpTransport* t, uintptr_t event);
+
+// Announce this interface address with the bound port
+bool UdpTransport_AddHostCandidate(UdpTransport* t, const uint8_t ip[4]);
+
+// Wire format: count, then per candidate its type, IPv4 and port (LE16). Pack returns bytes written.
+size_t UdpTransport_PackCandidates(UdpTransport* t, uint8_t out[UDP_CANDIDATES_MAX_SIZE]);
+
+// The peer's candidates, from the DERP session. The first ones start punching.
+bool UdpTransport_AddRemoteCandidates(UdpTransport* t, const uint8_t* data, size_t size, uint64_t now_us);
+
+// Asks server for the address this socket is seen from, the answer becomes a reflexive candidate
+bool UdpTransport_StartStun(UdpTransport* t, const UdpEndpoint* server, uint64_t now_us);
+
+// Reads what the socket holds, returns the datagrams read or -1 when the socket failed
+int UdpTransport_Receive(UdpTransport* t, uint64_t now_us);
+
+// One datagram as it came from the socket, for Receive and for tests that deliver their own
+void UdpTransport_OnDatagram(UdpTransport* t, const UdpEndpoint* from, const uint8_t* data, size_t size, uint64_t now_us);
+
+// Probes, keepalives, NACKs, deadlines and state changes
+void UdpTransport_Poll(UdpTransport* t, uint64_t now_us);
+
+// Milliseconds until Poll has something to do, UINT32_MAX when only a datagram can change that
+uint32_t UdpTransport_NextPollMs(const UdpTransport* t, uint64_t now_us);
+
+// Sends head and data as one frame. Needs CONNECTED, false otherwise or when the frame is too big.
+bool UdpTransport_SendFrame(UdpTransport* t, const uint8_t* head, uint32_t head_size, const uint8_t* data, uint32_t size, bool keyframe);
+
+// The next complete frame in order, valid until the next PopFrame, OnDatagram, Receive or Poll
+bool UdpTransport_PopFrame(UdpTransport* t, const uint8_t** data, uint32_t* size);
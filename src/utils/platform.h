@@ -0,0 +1,192 @@
+#pragma once
+
+// Minimal threading and clock primitives shared by the portable modules
+// (recorder, latency, ...) so they build with MSVC and on POSIX test hosts.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+typedef CRITICAL_SECTION BuddyMutex;
+typedef CONDITION_VARIABLE BuddyCond;
+typedef HANDLE BuddyThread;
+
+typedef void (*BuddyThreadProc)(void* arg);
+
+typedef struct {
+    BuddyThreadProc proc;
+    void* arg;
+} BuddyThreadStart_;
+
+static inline DWORD WINAPI BuddyThread_Trampoline_(LPVOID param)
+{
+    BuddyThreadStart_ start = *(BuddyThreadStart_*)param;
+    HeapFree(GetProcessHeap(), 0, param);
+    start.proc(start.arg);
+    return 0;
+}
+
+static inline void BuddyMutex_Init(BuddyMutex* m) { InitializeCriticalSection(m); }
+static inline void BuddyMutex_Destroy(BuddyMutex* m) { DeleteCriticalSection(m); }
+static inline void BuddyMutex_Lock(BuddyMutex* m) { EnterCriticalSection(m); }
+static inline void BuddyMutex_Unlock(BuddyMutex* m) { LeaveCriticalSection(m); }
+static inline bool BuddyMutex_TryLock(BuddyMutex* m) { return TryEnterCriticalSection(m) != 0; }
+
+static inline void BuddyCond_Init(BuddyCond* c) { InitializeConditionVariable(c); }
+static inline void BuddyCond_Destroy(BuddyCond* c) { (void)c; }
+static inline void BuddyCond_Wait(BuddyCond* c, BuddyMutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static inline void BuddyCond_Signal(BuddyCond* c) { WakeConditionVariable(c); }
+static inline void BuddyCond_Broadcast(BuddyCond* c) { WakeAllConditionVariable(c); }
+
+// Wait with timeout; returns false when the timeout elapsed
+static inline bool BuddyCond_WaitTimeout(BuddyCond* c, BuddyMutex* m, uint32_t timeout_ms)
+{
+    return SleepConditionVariableCS(c, m, timeout_ms) != 0;
+}
+
+static inline bool BuddyThread_Start(BuddyThread* thread, BuddyThreadProc proc, void* arg)
+{
+    BuddyThreadStart_* start = HeapAlloc(GetProcessHeap(), 0, sizeof(*start));
+    if (!start) return false;
+    start->proc = proc;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, BuddyThread_Trampoline_, start, 0, NULL);
+    if (!*thread)
+    {
+        HeapFree(GetProcessHeap(), 0, start);
+        return false;
+    }
+    return true;
+}
+
+static inline void BuddyThread_Join(BuddyThread thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static inline void BuddyThread_Sleep(uint32_t ms) { Sleep(ms); }
+
+// Logical processors available to the process
+static inline uint32_t BuddyCpu_Count(void)
+{
+    DWORD count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    return count ? (uint32_t)count : 1;
+}
+
+// Monotonic clock in microseconds
+static inline uint64_t BuddyClock_NowUs(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000ULL +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000ULL / (uint64_t)freq.QuadPart;
+}
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+typedef pthread_mutex_t BuddyMutex;
+typedef pthread_cond_t BuddyCond;
+typedef pthread_t BuddyThread;
+
+typedef void (*BuddyThreadProc)(void* arg);
+
+typedef struct {
+    BuddyThreadProc proc;
+    void* arg;
+} BuddyThreadStart_;
+
+static inline void* BuddyThread_Trampoline_(void* param)
+{
+    BuddyThreadStart_ start = *(BuddyThreadStart_*)param;
+    free(param);
+    start.proc(start.arg);
+    return NULL;
+}
+
+static inline void BuddyMutex_Init(BuddyMutex* m) { pthread_mutex_init(m, NULL); }
+static inline void BuddyMutex_Destroy(BuddyMutex* m) { pthread_mutex_destroy(m); }
+static inline void BuddyMutex_Lock(BuddyMutex* m) { pthread_mutex_lock(m); }
+static inline void BuddyMutex_Unlock(BuddyMutex* m) { pthread_mutex_unlock(m); }
+static inline bool BuddyMutex_TryLock(BuddyMutex* m) { return pthread_mutex_trylock(m) == 0; }
+
+static inline void BuddyCond_Init(BuddyCond* c)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(c, &attr);
+    pthread_condattr_destroy(&attr);
+}
+static inline void BuddyCond_Destroy(BuddyCond* c) { pthread_cond_destroy(c); }
+static inline void BuddyCond_Wait(BuddyCond* c, BuddyMutex* m) { pthread_cond_wait(c, m); }
+static inline void BuddyCond_Signal(BuddyCond* c) { pthread_cond_signal(c); }
+static inline void BuddyCond_Broadcast(BuddyCond* c) { pthread_cond_broadcast(c); }
+
+// Wait with timeout; returns false when the timeout elapsed
+static inline bool BuddyCond_WaitTimeout(BuddyCond* c, BuddyMutex* m, uint32_t timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(c, m, &ts) != ETIMEDOUT;
+}
+
+static inline bool BuddyThread_Start(BuddyThread* thread, BuddyThreadProc proc, void* arg)
+{
+    BuddyThreadStart_* start = malloc(sizeof(*start));
+    if (!start) return false;
+    start->proc = proc;
+    start->arg = arg;
+    if (pthread_create(thread, NULL, BuddyThread_Trampoline_, start) != 0)
+    {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+static inline void BuddyThread_Join(BuddyThread thread) { pthread_join(thread, NULL); }
+
+static inline void BuddyThread_Sleep(uint32_t ms)
+{
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+// Logical processors available to the process
+static inline uint32_t BuddyCpu_Count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+}
+
+// Monotonic clock in microseconds
+static inline uint64_t BuddyClock_NowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+#endif
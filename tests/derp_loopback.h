@@ -0,0 +1,193 @@
+// In-process stand-in for a DERP server, used by tests that need two DerpNet
+// endpoints without a network. Each endpoint gets one end of a connected
+// socket pair; SendPacket frames written by one side are forwarded to the
+// other side as RecvPacket frames carrying the sender's public key.
+//
+// Include after external/derpnet.h (built with DERPNET_STATIC).
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+
+#if defined(_WIN32)
+typedef int derp_socklen;
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+typedef socklen_t derp_socklen;
+#define closesocket close
+#endif
+
+typedef struct DerpLoopback DerpLoopback;
+
+typedef struct {
+    DerpLoopback* owner;
+    int from;                // index of the sending endpoint
+} DerpLoopbackRoute;
+
+struct DerpLoopback {
+    uintptr_t client[2];     // Net->Socket for endpoint 0 and 1
+    uintptr_t server[2];     // relay side of each connection
+    DerpKey public_key[2];
+    DerpLoopbackRoute route[2];
+    BuddyThread thread[2];
+    volatile uint64_t frames_forwarded;
+};
+
+static bool DerpLoopback_SocketPair(uintptr_t out[2])
+{
+#if defined(_WIN32)
+    // no AF_UNIX socketpair on older Windows, connect over loopback TCP instead
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) return false;
+
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    derp_socklen addr_len = sizeof(addr);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &addr_len) != 0 ||
+        listen(listener, 1) != 0)
+    {
+        closesocket(listener);
+        return false;
+    }
+
+    SOCKET a = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (a == INVALID_SOCKET || connect(a, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        if (a != INVALID_SOCKET) closesocket(a);
+        closesocket(listener);
+        return false;
+    }
+    SOCKET b = accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (b == INVALID_SOCKET)
+    {
+        closesocket(a);
+        return false;
+    }
+    out[0] = (uintptr_t)a;
+    out[1] = (uintptr_t)b;
+    return true;
+#else
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+    out[0] = (uintptr_t)fds[0];
+    out[1] = (uintptr_t)fds[1];
+    return true;
+#endif
+}
+
+static bool DerpLoopback_ReadAll(uintptr_t sock, uint8_t* data, size_t size)
+{
+    while (size != 0)
+    {
+        int read = recv(sock, (char*)data, (int)size, 0);
+        if (read <= 0) return false;
+        data += read;
+        size -= (size_t)read;
+    }
+    return true;
+}
+
+static bool DerpLoopback_WriteAll(uintptr_t sock, const uint8_t* data, size_t size)
+{
+    while (size != 0)
+    {
+        int written = send(sock, (const char*)data, (int)size, DERPNET_SEND_FLAGS);
+        if (written <= 0) return false;
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static void DerpLoopback_Forward(void* arg)
+{
+    DerpLoopbackRoute* route = arg;
+    DerpLoopback* loop = route->owner;
+    uintptr_t in = loop->server[route->from];
+    uintptr_t out = loop->server[1 - route->from];
+
+    uint8_t* frame = malloc(5 + (1 << 17));
+    for (;;)
+    {
+        if (!DerpLoopback_ReadAll(in, frame, 5)) break;
+        uint32_t size = Get32BE(frame + 1);
+        if (size > (1 << 17) || !DerpLoopback_ReadAll(in, frame + 5, size)) break;
+
+        // SendPacket [dst key][nonce][box] -> RecvPacket [src key][nonce][box]
+        if (frame[0] != 4 || size < 32) continue;
+        frame[0] = 5;
+        memcpy(frame + 5, loop->public_key[route->from].Bytes, 32);
+        if (!DerpLoopback_WriteAll(out, frame, 5 + size)) break;
+        loop->frames_forwarded++;
+    }
+    free(frame);
+}
+
+// Prepare a DerpNet as if DerpNet_Open had completed the handshake
+static void DerpLoopback_Attach(DerpNet* net, uintptr_t sock, const DerpKey* secret)
+{
+    memset(net, 0, sizeof(*net));
+    net->Socket = sock;
+#if !defined(_WIN32)
+    net->EventFd = -1;
+#endif
+    memcpy(net->UserPrivateKey, secret->Bytes, sizeof(net->UserPrivateKey));
+}
+
+static bool DerpLoopback_Start(DerpLoopback* loop, DerpNet* net0, const DerpKey* secret0, DerpNet* net1, const DerpKey* secret1)
+{
+    memset(loop, 0, sizeof(*loop));
+
+#if defined(_WIN32)
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+    uintptr_t pair0[2], pair1[2];
+    if (!DerpLoopback_SocketPair(pair0)) return false;
+    if (!DerpLoopback_SocketPair(pair1))
+    {
+        closesocket(pair0[0]);
+        closesocket(pair0[1]);
+        return false;
+    }
+    loop->client[0] = pair0[0];
+    loop->server[0] = pair0[1];
+    loop->client[1] = pair1[0];
+    loop->server[1] = pair1[1];
+
+    DerpNet_GetPublicKey(secret0, &loop->public_key[0]);
+    DerpNet_GetPublicKey(secret1, &loop->public_key[1]);
+    DerpLoopback_Attach(net0, loop->client[0], secret0);
+    DerpLoopback_Attach(net1, loop->client[1], secret1);
+
+    for (int i = 0; i < 2; i++)
+    {
+        loop->route[i].owner = loop;
+        loop->route[i].from = i;
+        BuddyThread_Start(&loop->thread[i], DerpLoopback_Forward, &loop->route[i]);
+    }
+    return true;
+}
+
+static void DerpLoopback_Stop(DerpLoopback* loop)
+{
+    // closing the client ends makes both forwarders see EOF
+    for (int i = 0; i < 2; i++)
+    {
+        shutdown(loop->client[i], 2);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        BuddyThread_Join(loop->thread[i]);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        closesocket(loop->client[i]);
+        closesocket(loop->server[i]);
+    }
+}
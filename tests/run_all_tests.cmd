@@ -11,7 +11,7 @@ set PASSED_TESTS=0
 set FAILED_TESTS=0
 
 :: Test 1: Basic System Tests
-echo [1/3] Running Basic System Tests...
+echo [1/4] Running Basic System Tests...
 call build_tests.cmd
 if !ERRORLEVEL! EQU 0 (
   set /a PASSED_TESTS+=1
@@ -24,7 +24,7 @@ set /a TOTAL_TESTS+=1
 echo.
 
 :: Test 2: Feature Tests
-echo [2/3] Running Feature Tests...
+echo [2/4] Running Feature Tests...
 call build_feature_tests.cmd
 if !ERRORLEVEL! EQU 0 (
   set /a PASSED_TESTS+=1
@@ -37,7 +37,7 @@ set /a TOTAL_TESTS+=1
 echo.
 
 :: Test 3: Server Tests
-echo [3/3] Running Server Tests...
+echo [3/4] Running Server Tests...
 call build_server_tests.cmd
 if !ERRORLEVEL! EQU 0 (
   set /a PASSED_TESTS+=1
@@ -49,6 +49,36 @@ if !ERRORLEVEL! EQU 0 (
 set /a TOTAL_TESTS+=1
 echo.
 
+:: Test 4: Module Tests, one script per module
+echo [4/4] Running Module Tests...
+set MODULE_TESTS=
+set MODULE_TESTS=%MODULE_TESTS% test_recorder
+set MODULE_TESTS=%MODULE_TESTS% test_latency
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_sendv
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_coalesce
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_recv_ring
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_backpressure
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_crypto
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_nonce
+set MODULE_TESTS=%MODULE_TESTS% test_seal_pool
+set MODULE_TESTS=%MODULE_TESTS% test_derpnet_priority
+set MODULE_TESTS=%MODULE_TESTS% test_input_batch
+set MODULE_TESTS=%MODULE_TESTS% test_pacer
+set MODULE_TESTS=%MODULE_TESTS% test_derp_map
+set MODULE_TESTS=%MODULE_TESTS% test_telemetry
+for %%T in (%MODULE_TESTS%) do (
+  call %%T.cmd
+  if !ERRORLEVEL! EQU 0 (
+    set /a PASSED_TESTS+=1
+    echo PASSED: %%T
+  ) else (
+    set /a FAILED_TESTS+=1
+    echo FAILED: %%T
+  )
+  set /a TOTAL_TESTS+=1
+  echo.
+)
+
 :: Summary
 echo ========================================
 echo   Test Suite Summary
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Builds and runs the platform-independent unit tests with the host C compiler.
+# The Windows suites (run_all_tests.cmd) cover everything that needs Win32/MF.
+set -e
+
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+CFLAGS="${CFLAGS:--std=c11 -O2 -Wall -Wextra -D_GNU_SOURCE}"
+INCLUDES="-I. -I../src/core -I../src/network -I../src/utils -I.."
+OUT=build_portable
+mkdir -p "$OUT"
+
+FAILED=0
+
+run_test() {
+	name=$1
+	shift
+	echo "=== $name ==="
+	if $CC $CFLAGS $INCLUDES "$name.c" "$@" -o "$OUT/$name" -lpthread -lm && (cd "$OUT" && "./$name"); then
+		echo "PASSED: $name"
+	else
+		echo "FAILED: $name"
+		FAILED=1
+	fi
+	echo
+}
+
+run_test test_recorder ../src/core/recorder.c
+run_test test_input_batch ../src/core/input_batch.c
+run_test test_latency ../src/network/latency.c
+run_test test_pacer ../src/network/pacer.c
+run_test test_telemetry ../src/network/telemetry.c
+run_test test_derpnet_sendv
+run_test test_derpnet_coalesce
+run_test test_derpnet_recv_ring
+run_test test_derpnet_backpressure
+run_test test_derpnet_priority
+run_test test_derpnet_crypto
+run_test test_derpnet_nonce
+run_test test_seal_pool ../src/network/seal_pool.c
+run_test test_derpnet_connect ../src/network/derp_relay.c
+run_test test_derpnet_posix ../src/network/latency.c ../src/network/derp_relay.c
+run_test test_derp_relay ../src/network/latency.c ../src/network/derp_relay.c
+run_test test_net_thread ../src/network/net_thread.c ../src/network/latency.c ../src/network/derp_relay.c
+run_test test_region_probe ../src/network/region_probe.c
+run_test test_derp_map ../src/network/derp_map.c
+run_test test_derp_warm ../src/network/derp_warm.c ../src/network/derp_relay.c
+run_test test_direct_connection ../src/network/direct_connection.c ../src/network/latency.c ../src/network/derp_relay.c
+run_test test_udp_transport ../src/network/udp_transport.c ../src/network/latency.c
+run_test test_fanout ../src/network/fanout.c ../src/network/derp_relay.c
+run_test test_session_resume ../src/network/session_resume.c ../src/network/derp_warm.c ../src/network/derp_relay.c
+
+exit $FAILED
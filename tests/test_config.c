@@ -24,6 +24,7 @@ int main(void) {
     cfg.log_level = 3;
     cfg.framerate = 45;
     cfg.bitrate = 8 * 1000000;
+    cfg.pacing_percent = 75;
     cfg.use_bt709 = false;
     cfg.use_full_range = false;
         lstrcpyW(cfg.derp_server, L"127.0.0.1");
@@ -34,6 +35,8 @@ int main(void) {
     cfg.capture_full_screen = false;
     lstrcpyW(cfg.derp_regions[0], L"custom-derp.local");
     strcpy(cfg.derp_private_key_hex, "aabbcc");
+    cfg.record_sessions = true;
+    lstrcpyW(cfg.recording_directory, L"C:/Recordings");
 
     wchar_t path[MAX_PATH];
     if (!BuddyConfig_GetDefaultPath(path, MAX_PATH)) {
@@ -56,6 +59,7 @@ int main(void) {
     int same = (loaded.log_level == cfg.log_level &&
                 loaded.framerate == cfg.framerate &&
                 loaded.bitrate == cfg.bitrate &&
+                loaded.pacing_percent == cfg.pacing_percent &&
                 loaded.use_bt709 == cfg.use_bt709 &&
                 loaded.use_full_range == cfg.use_full_range &&
                 loaded.cursor_sticky == cfg.cursor_sticky &&
@@ -66,7 +70,9 @@ int main(void) {
                 loaded.derp_region == cfg.derp_region &&
                 loaded.capture_full_screen == cfg.capture_full_screen &&
                 wcscmp(loaded.derp_regions[0], cfg.derp_regions[0]) == 0 &&
-                strcmp(loaded.derp_private_key_hex, cfg.derp_private_key_hex) == 0);
+                strcmp(loaded.derp_private_key_hex, cfg.derp_private_key_hex) == 0 &&
+                loaded.record_sessions == cfg.record_sessions &&
+                wcscmp(loaded.recording_directory, cfg.recording_directory) == 0);
     print_result("round_trip", same);
 
     // Cleanup
@@ -0,0 +1,331 @@
+// Unit tests and benchmark for the streaming DERP map parser and its on-disk cache (derp_map.c)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_map.h"
+
+#define MAX_FOUND 4096
+
+typedef struct {
+    uint32_t count;
+    uint32_t ids[MAX_FOUND];
+    char hosts[MAX_FOUND][DERP_MAP_MAX_HOST];
+} Found;
+
+static void Found_Region(void* context, uint32_t region_id, const char* host_name)
+{
+    Found* found = context;
+    if (found->count < MAX_FOUND)
+    {
+        found->ids[found->count] = region_id;
+        snprintf(found->hosts[found->count], DERP_MAP_MAX_HOST, "%s", host_name);
+        found->count++;
+    }
+}
+
+static bool Parse(const char* json, size_t size, size_t chunk, Found* found, DerpMapParser* parser)
+{
+    memset(found, 0, sizeof(*found));
+    DerpMapParser_Init(parser, Found_Region, found);
+    for (size_t at = 0; at < size; at += chunk)
+    {
+        size_t n = size - at < chunk ? size - at : chunk;
+        if (!DerpMapParser_Feed(parser, json + at, n))
+        {
+            return false;
+        }
+    }
+    return DerpMapParser_Finish(parser);
+}
+
+// Map shaped like /derpmap/default: two nodes per region, coordinates, flags, a node RegionID
+static char* MakeMap(uint32_t regions, size_t* size)
+{
+    size_t capacity = 1024 + (size_t)regions * 512;
+    char* json = malloc(capacity);
+    size_t at = (size_t)snprintf(json, capacity, "{\"Regions\":{");
+    for (uint32_t id = 1; id <= regions; id++)
+    {
+        at += (size_t)snprintf(json + at, capacity - at,
+            "%s\"%u\":{\"RegionID\":%u,\"RegionCode\":\"r%u\",\"RegionName\":\"Region %u\",\"Latitude\":40.7128,\"Longitude\":-74.006e0,"
+            "\"Nodes\":[{\"Name\":\"%ua\",\"RegionID\":%u,\"HostName\":\"derp%ua.example.com\",\"IPv4\":\"192.0.2.%u\",\"IPv6\":\"2001:db8::%x\",\"CanPort80\":true},"
+            "{\"Name\":\"%ub\",\"RegionID\":%u,\"HostName\":\"derp%ub.example.com\",\"STUNOnly\":false}],\"Avoid\":null}",
+            id == 1 ? "" : ",", id, id, id, id, id, id, id, id % 256, id, id, id, id);
+    }
+    at += (size_t)snprintf(json + at, capacity - at, "},\"omitDefaultRegions\":false}\n");
+    *size = at;
+    return json;
+}
+
+TEST(extracts_region_id_and_first_host)
+{
+    static const char json[] =
+        "{\n"
+        "  \"Regions\": {\n"
+        "    \"1\": { \"RegionID\": 1, \"RegionCode\": \"nyc\", \"Nodes\": [\n"
+        "        { \"Name\": \"1f\", \"RegionID\": 99, \"HostName\": \"derp1f.tailscale.com\" },\n"
+        "        { \"Name\": \"1g\", \"HostName\": \"derp1g.tailscale.com\" } ] },\n"
+        "    \"2\": { \"Nodes\": [ { \"HostName\": \"derp2.tailscale.com\" } ], \"RegionID\": 2 },\n"
+        "    \"3\": { \"RegionID\": 3, \"Nodes\": [] },\n"
+        "    \"4\": { \"RegionCode\": \"none\", \"Nodes\": [ { \"HostName\": \"derp4.tailscale.com\" } ] },\n"
+        "    \"5\": { \"RegionID\": 5.5, \"Nodes\": [ { \"HostName\": \"derp5.tailscale.com\" } ] }\n"
+        "  },\n"
+        "  \"Other\": { \"Regions\": { \"9\": { \"RegionID\": 9, \"Nodes\": [ { \"HostName\": \"nested\" } ] } } },\n"
+        "  \"Flags\": [ true, false, null, -1.5e+3, [ {} ] ]\n"
+        "}\n";
+
+    static Found found;
+    DerpMapParser parser;
+    TEST_ASSERT_TRUE(Parse(json, sizeof(json) - 1, sizeof(json), &found, &parser));
+    TEST_ASSERT_EQUAL(2, found.count);
+    TEST_ASSERT_EQUAL(1, found.ids[0]);
+    TEST_ASSERT_TRUE(strcmp(found.hosts[0], "derp1f.tailscale.com") == 0);
+    TEST_ASSERT_EQUAL(2, found.ids[1]);
+    TEST_ASSERT_TRUE(strcmp(found.hosts[1], "derp2.tailscale.com") == 0);
+    TEST_ASSERT_EQUAL(2, parser.regions);
+    TEST_ASSERT_EQUAL(3, parser.regions_skipped);
+}
+
+TEST(chunk_size_does_not_matter)
+{
+    size_t size;
+    char* json = MakeMap(50, &size);
+
+    static Found whole, split;
+    DerpMapParser parser;
+    TEST_ASSERT_TRUE(Parse(json, size, size, &whole, &parser));
+    TEST_ASSERT_EQUAL(50, whole.count);
+
+    size_t chunks[] = { 1, 2, 3, 7, 64, 4096 };
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        TEST_ASSERT_TRUE(Parse(json, size, chunks[i], &split, &parser));
+        TEST_ASSERT_EQUAL(whole.count, split.count);
+        TEST_ASSERT_TRUE(memcmp(whole.ids, split.ids, sizeof(whole.ids)) == 0);
+        TEST_ASSERT_TRUE(memcmp(whole.hosts, split.hosts, sizeof(whole.hosts)) == 0);
+        TEST_ASSERT_EQUAL(size, parser.bytes);
+    }
+    free(json);
+}
+
+TEST(escapes_in_keys_and_host_names)
+{
+    static const char json[] =
+        "{\"Re\\u0067ions\":{\"7\":{\"RegionID\":7,\"Nodes\":[{\"Host\\u004eame\":\"derp\\u0037.example.com\"}]},"
+        "\"8\":{\"RegionID\":8,\"Nodes\":[{\"HostName\":\"caf\\u00e9.example\\/x\"}]}}}";
+
+    static Found found;
+    DerpMapParser parser;
+    TEST_ASSERT_TRUE(Parse(json, sizeof(json) - 1, 5, &found, &parser));
+    TEST_ASSERT_EQUAL(2, found.count);
+    TEST_ASSERT_TRUE(strcmp(found.hosts[0], "derp7.example.com") == 0);
+    TEST_ASSERT_TRUE(strcmp(found.hosts[1], "caf\xc3\xa9.example/x") == 0);
+}
+
+TEST(oversized_host_and_id_are_skipped)
+{
+    char json[512];
+    char host[DERP_MAP_MAX_HOST + 8];
+    memset(host, 'h', sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    snprintf(json, sizeof(json),
+        "{\"Regions\":{\"1\":{\"RegionID\":1,\"Nodes\":[{\"HostName\":\"%s\"}]},"
+        "\"2\":{\"RegionID\":99999999999,\"Nodes\":[{\"HostName\":\"derp2\"}]},"
+        "\"3\":{\"RegionID\":-3,\"Nodes\":[{\"HostName\":\"derp3\"}]},"
+        "\"4\":{\"RegionID\":4294967295,\"Nodes\":[{\"HostName\":\"derp4\"}]}}}", host);
+
+    static Found found;
+    DerpMapParser parser;
+    TEST_ASSERT_TRUE(Parse(json, strlen(json), 3, &found, &parser));
+    TEST_ASSERT_EQUAL(1, found.count);
+    TEST_ASSERT_TRUE(found.ids[0] == 4294967295u);
+    TEST_ASSERT_EQUAL(3, parser.regions_skipped);
+}
+
+TEST(malformed_documents_fail)
+{
+    size_t size;
+    char* json = MakeMap(3, &size);
+
+    // every truncation is incomplete, some fail earlier
+    static Found found;
+    DerpMapParser parser;
+    for (size_t cut = 0; cut + 1 < size; cut++)
+    {
+        TEST_ASSERT_FALSE(Parse(json, cut, 7, &found, &parser));
+    }
+    TEST_ASSERT_TRUE(Parse(json, size, 7, &found, &parser));
+    free(json);
+
+    const char* bad[] =
+    {
+        "{\"Regions\":{}}x",
+        "{\"Regions\":{]}",
+        "{\"Regions\" {}}",
+        "{\"Regions\":{},}",
+        "[1,]",
+        "{\"a\":\"\\q\"}",
+        "{\"a\":\"\\u12g4\"}",
+        "{\"a\":tru}",
+        "{\"a\":\"line\nbreak\"}",
+        "{'a':1}",
+        "",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        TEST_ASSERT_FALSE(Parse(bad[i], strlen(bad[i]), 4, &found, &parser));
+    }
+
+    // nesting deeper than the parser tracks
+    char deep[DERP_MAP_MAX_DEPTH * 2 + 4];
+    memset(deep, '[', DERP_MAP_MAX_DEPTH + 1);
+    memset(deep + DERP_MAP_MAX_DEPTH + 1, ']', DERP_MAP_MAX_DEPTH + 1);
+    TEST_ASSERT_FALSE(Parse(deep, 2 * (DERP_MAP_MAX_DEPTH + 1), 16, &found, &parser));
+
+    // a refused parser stays refused
+    DerpMapParser_Init(&parser, Found_Region, &found);
+    TEST_ASSERT_FALSE(DerpMapParser_Feed(&parser, "}", 1));
+    TEST_ASSERT_FALSE(DerpMapParser_Feed(&parser, "{}", 2));
+    TEST_ASSERT_FALSE(DerpMapParser_Finish(&parser));
+}
+
+// the old reader kept the first 64 KB of the download and parsed that as a whole document
+TEST(maps_larger_than_the_old_64kb_buffer)
+{
+    size_t size;
+    char* json = MakeMap(2000, &size);
+    TEST_ASSERT_TRUE(size > 64 * 1024);
+
+    static Found found;
+    DerpMapParser parser;
+    TEST_ASSERT_TRUE(Parse(json, size, 16 * 1024, &found, &parser));
+    TEST_ASSERT_EQUAL(2000, found.count);
+    TEST_ASSERT_EQUAL(2000, found.ids[1999]);
+    TEST_ASSERT_TRUE(strcmp(found.hosts[1999], "derp2000a.example.com") == 0);
+
+    // truncated at 64 KB the document is incomplete
+    TEST_ASSERT_FALSE(Parse(json, 64 * 1024, 16 * 1024, &found, &parser));
+    free(json);
+}
+
+TEST(cache_file_and_info_roundtrip)
+{
+    const char* map_path = "test_derp_map_cache.json";
+    const char* info_path = "test_derp_map_cache.info";
+
+    size_t size;
+    char* json = MakeMap(30, &size);
+    FILE* f = fopen(map_path, "wb");
+    fwrite(json, 1, size, f);
+    fclose(f);
+
+    static Found found;
+    DerpMapParser parser;
+    memset(&found, 0, sizeof(found));
+    DerpMapParser_Init(&parser, Found_Region, &found);
+    TEST_ASSERT_TRUE(DerpMap_ParseFile(&parser, map_path));
+    TEST_ASSERT_EQUAL(30, found.count);
+
+    // a half written cache file is not a map
+    f = fopen(map_path, "wb");
+    fwrite(json, 1, size / 2, f);
+    fclose(f);
+    DerpMapParser_Init(&parser, Found_Region, &found);
+    TEST_ASSERT_FALSE(DerpMap_ParseFile(&parser, map_path));
+    remove(map_path);
+    DerpMapParser_Init(&parser, Found_Region, &found);
+    TEST_ASSERT_FALSE(DerpMap_ParseFile(&parser, map_path));
+    free(json);
+
+    DerpMapCacheInfo info = { .etag = "W/\"5f1d-abc\"", .last_modified = "Wed, 21 Oct 2026 07:28:00 GMT", .fetched_at = 1790000000 };
+    TEST_ASSERT_TRUE(DerpMap_SaveCacheInfo(&info, info_path));
+    DerpMapCacheInfo loaded;
+    TEST_ASSERT_TRUE(DerpMap_LoadCacheInfo(&loaded, info_path));
+    TEST_ASSERT_TRUE(strcmp(loaded.etag, info.etag) == 0);
+    TEST_ASSERT_TRUE(strcmp(loaded.last_modified, info.last_modified) == 0);
+    TEST_ASSERT_TRUE(loaded.fetched_at == 1790000000);
+
+    // empty validators survive too
+    DerpMapCacheInfo empty = { .fetched_at = 1 };
+    TEST_ASSERT_TRUE(DerpMap_SaveCacheInfo(&empty, info_path));
+    TEST_ASSERT_TRUE(DerpMap_LoadCacheInfo(&loaded, info_path));
+    TEST_ASSERT_EQUAL(0, loaded.etag[0]);
+    TEST_ASSERT_EQUAL(0, loaded.last_modified[0]);
+
+    f = fopen(info_path, "wb");
+    fputs("derp-map 1 5\netag x\n", f);
+    fclose(f);
+    TEST_ASSERT_FALSE(DerpMap_LoadCacheInfo(&loaded, info_path));
+    remove(info_path);
+    TEST_ASSERT_FALSE(DerpMap_LoadCacheInfo(&loaded, info_path));
+}
+
+// Parser throughput, and what a start costs when the map comes from the cache file: a real map is
+// about 30 regions. Before the cache every start downloaded the map before any region was known.
+TEST(benchmark_parse_throughput_and_cached_start)
+{
+    size_t size;
+    char* json = MakeMap(4000, &size);
+    static Found found;
+    DerpMapParser parser;
+
+    uint64_t start = BuddyClock_NowUs();
+    uint32_t passes = 0;
+    while (BuddyClock_NowUs() - start < 300000)
+    {
+        Parse(json, size, 16 * 1024, &found, &parser);
+        passes++;
+    }
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    double mb_per_s = (double)size * passes / seconds / (1024 * 1024);
+    free(json);
+
+    const char* map_path = "test_derp_map_bench.json";
+    json = MakeMap(30, &size);
+    FILE* f = fopen(map_path, "wb");
+    fwrite(json, 1, size, f);
+    fclose(f);
+    free(json);
+
+    uint64_t best_us = UINT64_MAX;
+    for (int i = 0; i < 50; i++)
+    {
+        memset(&found, 0, sizeof(found));
+        uint64_t t = BuddyClock_NowUs();
+        DerpMapParser_Init(&parser, Found_Region, &found);
+        DerpMap_ParseFile(&parser, map_path);
+        t = BuddyClock_NowUs() - t;
+        best_us = t < best_us ? t : best_us;
+    }
+    remove(map_path);
+
+    printf("\n    parser: %.0f MB/s, state %zu bytes\n", mb_per_s, sizeof(DerpMapParser));
+    printf("    cached 30-region map (%zu bytes): regions ready in %.3f ms\n", size, best_us / 1000.0);
+    printf("    ");
+
+    TEST_ASSERT_EQUAL(30, found.count);
+    TEST_ASSERT_TRUE(mb_per_s > 20);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DERP Map Parser Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(extracts_region_id_and_first_host);
+    RUN_TEST(chunk_size_does_not_matter);
+    RUN_TEST(escapes_in_keys_and_host_names);
+    RUN_TEST(oversized_host_and_id_are_skipped);
+    RUN_TEST(malformed_documents_fail);
+    RUN_TEST(maps_larger_than_the_old_64kb_buffer);
+    RUN_TEST(cache_file_and_info_roundtrip);
+    RUN_TEST(benchmark_parse_throughput_and_cached_start);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
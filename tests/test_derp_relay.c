@@ -0,0 +1,495 @@
+// Tests and benchmark for the epoll DERP relay with many raw peer connections
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "latency.h"
+
+#define PAIR_COUNT 1000
+#define BENCH_FRAME_SIZE 16384
+#define BENCH_BYTES_PER_PAIR (8u << 20)
+#define PING_COUNT 5000
+
+// Minimal blocking DERP client: enough protocol to register a key and move frames,
+// without the 800 KB of buffers a DerpNet carries, so thousands fit in one process.
+typedef struct {
+    int fd;
+    DerpKey secret;
+    DerpKey public_key;
+} Peer;
+
+static bool ReadAll(int fd, void* data, size_t size)
+{
+    uint8_t* bytes = data;
+    while (size != 0)
+    {
+        ssize_t got = recv(fd, bytes, size, 0);
+        if (got <= 0) return false;
+        bytes += got;
+        size -= (size_t)got;
+    }
+    return true;
+}
+
+static bool WriteAll(int fd, const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    while (size != 0)
+    {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+// Reads one frame into body (at most capacity bytes), returns its type or -1
+static int ReadFrame(int fd, uint8_t* body, uint32_t capacity, uint32_t* size)
+{
+    uint8_t header[5];
+    if (!ReadAll(fd, header, sizeof(header))) return -1;
+    *size = Get32BE(header + 1);
+    if (*size > capacity || !ReadAll(fd, body, *size)) return -1;
+    return header[0];
+}
+
+static bool Peer_Connect(Peer* peer, uint16_t port)
+{
+    DerpNet_CreateNewKey(&peer->secret);
+    DerpNet_GetPublicKey(&peer->secret, &peer->public_key);
+
+    peer->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (peer->fd < 0 || connect(peer->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) return false;
+
+    int no_delay = 1;
+    setsockopt(peer->fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    static const char request[] = "GET /derp HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: DERP\r\nDerp-Fast-Start: 1\r\n\r\n";
+    if (!WriteAll(peer->fd, request, sizeof(request) - 1)) return false;
+
+    uint8_t body[128];
+    uint32_t size;
+    if (ReadFrame(peer->fd, body, sizeof(body), &size) != 1 || size != 8 + 32) return false;
+    const uint8_t* server_key = body + 8;
+
+    static const char info[] = "{\"version\": 2}";
+    uint8_t frame[5 + 32 + 24 + 16 + sizeof(info) - 1];
+    frame[0] = 2;
+    Set32BE(frame + 1, sizeof(frame) - 5);
+    memcpy(frame + 5, peer->public_key.Bytes, 32);
+    DerpNet__BoxSeal(frame + 5 + 32, frame + 5 + 32 + 24, frame + 5 + 32 + 24 + 16, (const uint8_t*)info, sizeof(info) - 1, peer->secret.Bytes, server_key);
+    if (!WriteAll(peer->fd, frame, sizeof(frame))) return false;
+
+    return ReadFrame(peer->fd, body, sizeof(body), &size) == 3;
+}
+
+static bool Peer_Send(Peer* peer, const DerpKey* to, const uint8_t* data, uint32_t size)
+{
+    uint8_t header[5 + 32];
+    header[0] = 4;
+    Set32BE(header + 1, 32 + size);
+    memcpy(header + 5, to->Bytes, 32);
+    return WriteAll(peer->fd, header, sizeof(header)) && WriteAll(peer->fd, data, size);
+}
+
+// Returns the payload size, or -1 if the next frame is not a RecvPacket
+static int Peer_Recv(Peer* peer, DerpKey* from, uint8_t* data, uint32_t capacity)
+{
+    uint8_t header[5 + 32];
+    if (!ReadAll(peer->fd, header, sizeof(header)) || header[0] != 5) return -1;
+    uint32_t size = Get32BE(header + 1) - 32;
+    if (size > capacity || !ReadAll(peer->fd, data, size)) return -1;
+    memcpy(from->Bytes, header + 5, 32);
+    return (int)size;
+}
+
+static void Peer_Close(Peer* peer)
+{
+    close(peer->fd);
+}
+
+static DerpRelay* StartRelay(uint32_t threads, size_t max_queue)
+{
+    DerpRelayConfig config = { .threads = threads, .max_queue = max_queue };
+    return DerpRelay_Start(&config);
+}
+
+// Forwarding runs on the worker threads, so counters settle shortly after the sends
+static DerpRelayStats WaitForFrames(DerpRelay* relay, uint64_t frames)
+{
+    DerpRelayStats stats;
+    for (int i = 0; i < 5000; i++)
+    {
+        DerpRelay_GetStats(relay, &stats);
+        if (stats.frames_forwarded + stats.frames_dropped >= frames) break;
+        BuddyThread_Sleep(1);
+    }
+    return stats;
+}
+
+TEST(forwards_between_many_pairs)
+{
+    DerpRelay* relay = StartRelay(4, 0);
+    TEST_ASSERT_NOT_NULL(relay);
+    uint16_t port = DerpRelay_GetPort(relay);
+
+    Peer* peers = calloc(2 * PAIR_COUNT, sizeof(Peer));
+    uint32_t connected = 0;
+    while (connected < 2 * PAIR_COUNT && Peer_Connect(&peers[connected], port)) connected++;
+    TEST_ASSERT_EQUAL(2 * PAIR_COUNT, connected);
+
+    DerpRelayStats stats;
+    DerpRelay_GetStats(relay, &stats);
+    TEST_ASSERT_EQUAL(2 * PAIR_COUNT, stats.clients);
+
+    // every even peer sends its index to the odd peer next to it
+    for (uint32_t i = 0; i < PAIR_COUNT; i++)
+    {
+        uint32_t message[4] = { i, ~i, i * 3, 0x5a5a5a5a };
+        TEST_ASSERT_TRUE(Peer_Send(&peers[2 * i], &peers[2 * i + 1].public_key, (uint8_t*)message, sizeof(message)));
+    }
+
+    uint32_t correct = 0;
+    for (uint32_t i = 0; i < PAIR_COUNT; i++)
+    {
+        DerpKey from;
+        uint32_t message[4];
+        int size = Peer_Recv(&peers[2 * i + 1], &from, (uint8_t*)message, sizeof(message));
+        if (size == sizeof(message) && message[0] == i && message[1] == ~i &&
+            memcmp(from.Bytes, peers[2 * i].public_key.Bytes, 32) == 0)
+        {
+            correct++;
+        }
+    }
+    TEST_ASSERT_EQUAL(PAIR_COUNT, correct);
+
+    stats = WaitForFrames(relay, PAIR_COUNT);
+    TEST_ASSERT_EQUAL(PAIR_COUNT, stats.frames_forwarded);
+    TEST_ASSERT_EQUAL(PAIR_COUNT * 16, stats.bytes_forwarded);
+    TEST_ASSERT_EQUAL(0, stats.frames_dropped);
+
+    for (uint32_t i = 0; i < connected; i++) Peer_Close(&peers[i]);
+    free(peers);
+    DerpRelay_Stop(relay);
+}
+
+TEST(unknown_destination_is_dropped)
+{
+    DerpRelay* relay = StartRelay(2, 0);
+    TEST_ASSERT_NOT_NULL(relay);
+    Peer a, b;
+    TEST_ASSERT_TRUE(Peer_Connect(&a, DerpRelay_GetPort(relay)));
+    TEST_ASSERT_TRUE(Peer_Connect(&b, DerpRelay_GetPort(relay)));
+
+    DerpKey nobody;
+    DerpNet_CreateNewKey(&nobody);
+    uint8_t payload[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    TEST_ASSERT_TRUE(Peer_Send(&a, &nobody, payload, sizeof(payload)));
+    TEST_ASSERT_TRUE(Peer_Send(&a, &b.public_key, payload, sizeof(payload)));
+
+    // the connection survives the dropped frame, the next one still arrives
+    DerpKey from;
+    uint8_t received[8];
+    TEST_ASSERT_EQUAL(sizeof(payload), Peer_Recv(&b, &from, received, sizeof(received)));
+    TEST_ASSERT_TRUE(memcmp(received, payload, sizeof(payload)) == 0);
+
+    DerpRelayStats stats = WaitForFrames(relay, 2);
+    TEST_ASSERT_EQUAL(1, stats.frames_forwarded);
+    TEST_ASSERT_EQUAL(1, stats.frames_dropped);
+
+    // the sender is told, like derper does: PeerGone with the key and "not here"
+    uint8_t gone[64];
+    uint32_t size;
+    TEST_ASSERT_EQUAL(8, ReadFrame(a.fd, gone, sizeof(gone), &size));
+    TEST_ASSERT_EQUAL(33, size);
+    TEST_ASSERT_TRUE(memcmp(gone, nobody.Bytes, 32) == 0);
+    TEST_ASSERT_EQUAL(1, gone[32]);
+
+    Peer_Close(&a);
+    Peer_Close(&b);
+    DerpRelay_Stop(relay);
+}
+
+TEST(derpnet_answers_server_pings_and_counts_peer_gone)
+{
+    DerpRelay* relay = StartRelay(1, 0);
+    TEST_ASSERT_NOT_NULL(relay);
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", DerpRelay_GetPort(relay));
+
+    DerpKey secret, nobody;
+    DerpNet_CreateNewKey(&secret);
+    DerpNet_CreateNewKey(&nobody);
+    DerpNet* net = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_Open(net, address, &secret));
+
+    uint8_t probe[8] = { 9, 8, 7, 6, 5, 4, 3, 2 };
+    TEST_ASSERT_EQUAL(1, DerpRelay_PingClients(relay, probe));
+    uint8_t payload[4] = { 0 };
+    TEST_ASSERT_TRUE(DerpNet_Send(net, &nobody, payload, sizeof(payload)));
+
+    // Recv answers while it reads, the answer leaves with the next write
+    DerpRelayStats stats = { 0 };
+    for (int i = 0; i < 5000 && (stats.pongs_received == 0 || net->PeersGone == 0); i++)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t data_size;
+        TEST_ASSERT_TRUE(DerpNet_Recv(net, &from, &data, &data_size, false) == 0);
+        TEST_ASSERT_TRUE(DerpNet_OnWritable(net));
+        DerpRelay_GetStats(relay, &stats);
+        BuddyThread_Sleep(1);
+    }
+    TEST_ASSERT_EQUAL(1, net->ServerPings);
+    TEST_ASSERT_EQUAL(1, stats.pongs_received);
+    TEST_ASSERT_EQUAL(1, net->PeersGone);
+    TEST_ASSERT_TRUE(memcmp(net->LastPeerGone, nobody.Bytes, 32) == 0);
+
+    DerpNet_Close(net);
+    free(net);
+    DerpRelay_Stop(relay);
+}
+
+TEST(disconnected_peer_is_unregistered)
+{
+    DerpRelay* relay = StartRelay(2, 0);
+    TEST_ASSERT_NOT_NULL(relay);
+    Peer a, b;
+    TEST_ASSERT_TRUE(Peer_Connect(&a, DerpRelay_GetPort(relay)));
+    TEST_ASSERT_TRUE(Peer_Connect(&b, DerpRelay_GetPort(relay)));
+    Peer_Close(&b);
+
+    DerpRelayStats stats;
+    for (int i = 0; i < 5000; i++)
+    {
+        DerpRelay_GetStats(relay, &stats);
+        if (stats.clients == 1) break;
+        BuddyThread_Sleep(1);
+    }
+    TEST_ASSERT_EQUAL(1, stats.clients);
+
+    uint8_t payload[4] = { 0 };
+    TEST_ASSERT_TRUE(Peer_Send(&a, &b.public_key, payload, sizeof(payload)));
+    stats = WaitForFrames(relay, 1);
+    TEST_ASSERT_EQUAL(0, stats.frames_forwarded);
+    TEST_ASSERT_EQUAL(1, stats.frames_dropped);
+
+    Peer_Close(&a);
+    DerpRelay_Stop(relay);
+}
+
+TEST(slow_reader_queue_is_bounded)
+{
+    // a receiver that never reads: once its socket buffers and the queue fill up, frames are dropped
+    DerpRelay* relay = StartRelay(2, 256 * 1024);
+    TEST_ASSERT_NOT_NULL(relay);
+    Peer a, b;
+    TEST_ASSERT_TRUE(Peer_Connect(&a, DerpRelay_GetPort(relay)));
+    TEST_ASSERT_TRUE(Peer_Connect(&b, DerpRelay_GetPort(relay)));
+
+    uint8_t* chunk = calloc(1, BENCH_FRAME_SIZE);
+    uint32_t sent = 0;
+    DerpRelayStats stats = { 0 };
+    while (sent < 4096 && stats.frames_dropped == 0)
+    {
+        TEST_ASSERT_TRUE(Peer_Send(&a, &b.public_key, chunk, BENCH_FRAME_SIZE));
+        sent++;
+        if (sent % 64 == 0) stats = WaitForFrames(relay, sent);
+    }
+    stats = WaitForFrames(relay, sent);
+    TEST_ASSERT_TRUE(stats.frames_dropped > 0);
+    TEST_ASSERT_EQUAL(sent, stats.frames_forwarded + stats.frames_dropped);
+
+    // the reader catches up and gets an unbroken stream of whole frames
+    DerpKey from;
+    for (uint64_t i = 0; i < stats.frames_forwarded; i++)
+    {
+        TEST_ASSERT_EQUAL(BENCH_FRAME_SIZE, Peer_Recv(&b, &from, chunk, BENCH_FRAME_SIZE));
+    }
+
+    free(chunk);
+    Peer_Close(&a);
+    Peer_Close(&b);
+    DerpRelay_Stop(relay);
+}
+
+typedef struct {
+    Peer* from;
+    Peer* to;
+    size_t bytes;
+    size_t received;
+    BuddyThread sender;
+    BuddyThread receiver;
+} Stream;
+
+static void Stream_Send(void* arg)
+{
+    Stream* stream = arg;
+    uint8_t* chunk = calloc(1, BENCH_FRAME_SIZE);
+    for (size_t sent = 0; sent < stream->bytes; sent += BENCH_FRAME_SIZE)
+    {
+        if (!Peer_Send(stream->from, &stream->to->public_key, chunk, BENCH_FRAME_SIZE)) break;
+    }
+    free(chunk);
+}
+
+static void Stream_Receive(void* arg)
+{
+    Stream* stream = arg;
+    uint8_t* chunk = malloc(BENCH_FRAME_SIZE);
+    while (stream->received < stream->bytes)
+    {
+        DerpKey from;
+        int size = Peer_Recv(stream->to, &from, chunk, BENCH_FRAME_SIZE);
+        if (size < 0) break;
+        stream->received += (size_t)size;
+    }
+    free(chunk);
+}
+
+// Aggregate MB/s with `pairs` streams running at once, each pushing BENCH_BYTES_PER_PAIR
+static double MeasureThroughput(uint32_t threads, uint32_t pairs, bool* complete)
+{
+    // queue limit above the stream size, this measures forwarding and not the drop policy
+    DerpRelay* relay = StartRelay(threads, 2 * BENCH_BYTES_PER_PAIR);
+    Peer* peers = calloc(2 * pairs, sizeof(Peer));
+    Stream* streams = calloc(pairs, sizeof(Stream));
+    for (uint32_t i = 0; i < 2 * pairs; i++) Peer_Connect(&peers[i], DerpRelay_GetPort(relay));
+
+    uint64_t start = BuddyClock_NowUs();
+    for (uint32_t i = 0; i < pairs; i++)
+    {
+        streams[i] = (Stream){ .from = &peers[2 * i], .to = &peers[2 * i + 1], .bytes = BENCH_BYTES_PER_PAIR };
+        BuddyThread_Start(&streams[i].receiver, Stream_Receive, &streams[i]);
+        BuddyThread_Start(&streams[i].sender, Stream_Send, &streams[i]);
+    }
+    size_t total = 0;
+    for (uint32_t i = 0; i < pairs; i++)
+    {
+        BuddyThread_Join(streams[i].sender);
+        BuddyThread_Join(streams[i].receiver);
+        total += streams[i].received;
+    }
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    *complete = total == (size_t)pairs * BENCH_BYTES_PER_PAIR;
+
+    for (uint32_t i = 0; i < 2 * pairs; i++) Peer_Close(&peers[i]);
+    free(streams);
+    free(peers);
+    DerpRelay_Stop(relay);
+    return total / (1024.0 * 1024.0) / (seconds > 0 ? seconds : 1e-6);
+}
+
+typedef struct {
+    Peer* peer;
+    uint32_t count;
+} Echo;
+
+static void Echo_Run(void* arg)
+{
+    Echo* echo = arg;
+    uint8_t packet[64];
+    for (uint32_t i = 0; i < echo->count; i++)
+    {
+        DerpKey from;
+        int size = Peer_Recv(echo->peer, &from, packet, sizeof(packet));
+        if (size < 0 || !Peer_Send(echo->peer, &from, packet, (uint32_t)size)) break;
+    }
+}
+
+TEST(benchmark_relay_pairs_throughput_and_latency)
+{
+    uint32_t cpus = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cpus < 4 ? cpus : 4;
+    bool complete[3];
+    double one = MeasureThroughput(threads, 1, &complete[0]);
+    double eight = MeasureThroughput(threads, 8, &complete[1]);
+    double sixty_four = MeasureThroughput(threads, 64, &complete[2]);
+
+    // round trip of mouse sized packets between one pair while PAIR_COUNT other pairs stay connected
+    DerpRelay* relay = StartRelay(threads, 0);
+    Peer* peers = calloc(2 * PAIR_COUNT + 2, sizeof(Peer));
+    uint32_t connected = 0;
+    while (connected < 2 * PAIR_COUNT + 2 && Peer_Connect(&peers[connected], DerpRelay_GetPort(relay))) connected++;
+    Peer* a = &peers[connected - 2];
+    Peer* b = &peers[connected - 1];
+
+    Echo echo = { .peer = b, .count = PING_COUNT };
+    BuddyThread thread;
+    BuddyThread_Start(&thread, Echo_Run, &echo);
+
+    LatencyStats* latency = calloc(1, sizeof(LatencyStats));
+    uint8_t packet[10] = { 0 };
+    uint32_t returned = 0;
+    for (uint32_t i = 0; i < PING_COUNT; i++)
+    {
+        uint64_t sent = BuddyClock_NowUs();
+        if (!Peer_Send(a, &b->public_key, packet, sizeof(packet))) break;
+        DerpKey from;
+        if (Peer_Recv(a, &from, packet, sizeof(packet)) < 0) break;
+        Latency_StatsAdd(latency, (int64_t)(BuddyClock_NowUs() - sent));
+        returned++;
+    }
+    BuddyThread_Join(thread);
+
+    LatencySummary summary;
+    Latency_StatsSummary(latency, &summary);
+    free(latency);
+    for (uint32_t i = 0; i < connected; i++) Peer_Close(&peers[i]);
+    free(peers);
+    DerpRelay_Stop(relay);
+
+    printf("\n    %-36s %10.1f MB/s\n", "1 pair (16 KB frames)", one);
+    printf("    %-36s %10.1f MB/s\n", "8 pairs", eight);
+    printf("    %-36s %10.1f MB/s\n", "64 pairs", sixty_four);
+    printf("    %-36s %7lld / %lld / %lld us (p50/p95/p99, %u threads)\n", "round trip, 1000 pairs connected",
+        (long long)summary.p50_us, (long long)summary.p95_us, (long long)summary.p99_us, threads);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(complete[0] && complete[1] && complete[2]);
+    TEST_ASSERT_EQUAL(2 * PAIR_COUNT + 2, connected);
+    TEST_ASSERT_EQUAL(PING_COUNT, returned);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DERP Relay Tests\n");
+    printf("========================================\n\n");
+
+    // two sockets per pair on the client side plus the same on the relay side
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    TEST_INIT();
+
+    RUN_TEST(forwards_between_many_pairs);
+    RUN_TEST(unknown_destination_is_dropped);
+    RUN_TEST(derpnet_answers_server_pings_and_counts_peer_gone);
+    RUN_TEST(disconnected_peer_is_unregistered);
+    RUN_TEST(slow_reader_queue_is_bounded);
+    RUN_TEST(benchmark_relay_pairs_throughput_and_latency);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
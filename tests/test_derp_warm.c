@@ -0,0 +1,487 @@
+// Tests and benchmark for the pre-opened DERP connection (derp_warm.c), kept alive against the
+// local epoll relay
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // local relay speaks plain HTTP, like the Docker derper on 8080
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "derp_warm.h"
+
+#define BENCH_ROUNDS 7
+#define BENCH_OPEN_DELAY_MS 60     // DNS, connect, TLS and the DERP handshake to a server ~15 ms away
+
+typedef struct {
+    DerpWarm warm;
+    DerpNet* net;                  // warm storage
+    uint32_t open_delay_ms;        // added to every open
+} Harness;
+
+static bool Harness_Open(void* context, void* net, const char* server, const uint8_t* key)
+{
+    Harness* harness = context;
+    if (harness->open_delay_ms)
+    {
+        BuddyThread_Sleep(harness->open_delay_ms);
+    }
+    DerpKey secret;
+    if (key)
+    {
+        memcpy(secret.Bytes, key, sizeof(secret.Bytes));
+    }
+    else
+    {
+        DerpNet_CreateNewKey(&secret);
+    }
+    return DerpNet_Open(net, server, &secret);
+}
+
+static void Harness_Close(void* context, void* net)
+{
+    (void)context;
+    DerpNet_Close(net);
+}
+
+static bool Harness_Ping(void* context, void* net, uint64_t id)
+{
+    (void)context;
+    uint8_t data[8];
+    Set64LE(data, id);
+    return DerpNet_SendPing(net, data);
+}
+
+static int Harness_Poll(void* context, void* net, uint64_t* pong)
+{
+    (void)context;
+    DerpNet* derp = net;
+    for (;;)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        int got = DerpNet_Recv(derp, &from, &data, &size, false);
+        if (got < 0) return -1;
+        if (got == 0) break;
+    }
+    if (derp->PongsReceived)
+    {
+        *pong = Get64LE(derp->LastPong);
+    }
+    return 0;
+}
+
+static Harness* Harness_Start(const char* server, const DerpKey* key, uint32_t ping_ms, uint32_t pong_timeout_ms, uint32_t open_delay_ms)
+{
+    Harness* harness = calloc(1, sizeof(Harness));
+    harness->net = malloc(sizeof(DerpNet));
+    harness->open_delay_ms = open_delay_ms;
+    DerpWarmConfig config =
+    {
+        .net = harness->net,
+        .net_size = sizeof(DerpNet),
+        .ping_ms = ping_ms,
+        .pong_timeout_ms = pong_timeout_ms,
+        .open = Harness_Open,
+        .close = Harness_Close,
+        .ping = Harness_Ping,
+        .poll = Harness_Poll,
+        .context = harness,
+    };
+    if (!DerpWarm_Start(&harness->warm, &config, server, key ? key->Bytes : NULL))
+    {
+        free(harness->net);
+        free(harness);
+        return NULL;
+    }
+    return harness;
+}
+
+static void Harness_Stop(Harness* harness)
+{
+    DerpWarm_Stop(&harness->warm);
+    free(harness->net);
+    free(harness);
+}
+
+// Copy of the counters, taken under the module lock
+static DerpWarm Harness_Read(Harness* harness)
+{
+    BuddyMutex_Lock(&harness->warm.lock);
+    DerpWarm copy = harness->warm;
+    BuddyMutex_Unlock(&harness->warm.lock);
+    return copy;
+}
+
+// Waits until at least opens connections were opened and one is ready
+static bool Harness_WaitReady(Harness* harness, uint64_t opens, uint32_t timeout_ms)
+{
+    for (uint32_t i = 0; i < timeout_ms; i++)
+    {
+        DerpWarm state = Harness_Read(harness);
+        if (state.connected && state.opens >= opens) return true;
+        BuddyThread_Sleep(1);
+    }
+    return false;
+}
+
+static DerpRelay* Relay_Start(uint16_t port, bool ignore_pings, char* address, size_t address_size)
+{
+    DerpRelayConfig config = { .port = port, .threads = 1, .ignore_pings = ignore_pings };
+    DerpRelay* relay = DerpRelay_Start(&config);
+    if (relay)
+    {
+        snprintf(address, address_size, "127.0.0.1:%u", DerpRelay_GetPort(relay));
+    }
+    return relay;
+}
+
+static uint64_t Relay_Clients(DerpRelay* relay)
+{
+    DerpRelayStats stats;
+    DerpRelay_GetStats(relay, &stats);
+    return stats.clients;
+}
+
+static bool Relay_WaitClients(DerpRelay* relay, uint64_t clients)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        if (Relay_Clients(relay) == clients) return true;
+        BuddyThread_Sleep(1);
+    }
+    return false;
+}
+
+// Receives one packet within two seconds
+static bool Net_RecvOne(DerpNet* net, DerpKey* from, uint32_t* size)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        uint8_t* data;
+        int got = DerpNet_Recv(net, from, &data, size, false);
+        if (got > 0) return true;
+        if (got < 0) return false;
+        BuddyThread_Sleep(1);
+    }
+    return false;
+}
+
+// The session's connection works both ways: peer -> session and session -> peer
+static bool Session_Exchange(DerpNet* session, const char* server)
+{
+    DerpKey session_secret, session_public, peer_secret, peer_public, from;
+    memcpy(session_secret.Bytes, session->UserPrivateKey, 32);
+    DerpNet_GetPublicKey(&session_secret, &session_public);
+    DerpNet_CreateNewKey(&peer_secret);
+    DerpNet_GetPublicKey(&peer_secret, &peer_public);
+
+    DerpNet* peer = malloc(sizeof(DerpNet));
+    bool ok = DerpNet_Open(peer, server, &peer_secret);
+    uint32_t size = 0;
+    ok = ok && DerpNet_Send(peer, &session_public, "hello", 5);
+    ok = ok && Net_RecvOne(session, &from, &size) && size == 5 && memcmp(&from, &peer_public, 32) == 0;
+    ok = ok && DerpNet_Send(session, &peer_public, "hi", 2);
+    ok = ok && Net_RecvOne(peer, &from, &size) && size == 2 && memcmp(&from, &session_public, 32) == 0;
+    DerpNet_Close(peer);
+    free(peer);
+    return ok;
+}
+
+TEST(taken_connection_carries_packets_and_warming_pauses)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, false, address, sizeof(address));
+    TEST_ASSERT_NOT_NULL(relay);
+
+    DerpKey key;
+    DerpNet_CreateNewKey(&key);
+    Harness* harness = Harness_Start(address, &key, 0, 0, 0);
+    TEST_ASSERT_NOT_NULL(harness);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 1, 2000));
+    TEST_ASSERT_TRUE(DerpWarm_IsReady(&harness->warm));
+
+    DerpNet* session = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 0));
+    TEST_ASSERT_FALSE(DerpWarm_IsReady(&harness->warm));
+    TEST_ASSERT_TRUE(memcmp(session->UserPrivateKey, key.Bytes, 32) == 0);
+    TEST_ASSERT_TRUE(Session_Exchange(session, address));
+
+    // nothing opens a second connection with the session's key while the session runs
+    BuddyThread_Sleep(100);
+    DerpWarm state = Harness_Read(harness);
+    TEST_ASSERT_EQUAL(1, state.opens);
+    TEST_ASSERT_EQUAL(1, state.takes);
+    TEST_ASSERT_EQUAL(1, Relay_Clients(relay));
+
+    DerpNet_Close(session);
+    DerpWarm_Resume(&harness->warm);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 2, 2000));
+    TEST_ASSERT_TRUE(Relay_WaitClients(relay, 1));
+
+    Harness_Stop(harness);
+    TEST_ASSERT_TRUE(Relay_WaitClients(relay, 0));
+    free(session);
+    DerpRelay_Stop(relay);
+}
+
+TEST(pings_keep_the_connection_and_pongs_answer)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, false, address, sizeof(address));
+    Harness* harness = Harness_Start(address, NULL, 20, 200, 0);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 1, 2000));
+
+    BuddyThread_Sleep(300);
+    DerpWarm state = Harness_Read(harness);
+    TEST_ASSERT_TRUE(state.pings >= 5);
+    TEST_ASSERT_TRUE(state.pong_id + 1 >= state.ping_id);
+    TEST_ASSERT_EQUAL(0, state.deaths);
+    TEST_ASSERT_EQUAL(1, state.opens);
+    BuddyMutex_Lock(&harness->warm.lock);
+    size_t pongs = harness->net->PongsReceived;
+    BuddyMutex_Unlock(&harness->warm.lock);
+    TEST_ASSERT_TRUE(pongs >= 4);
+
+    Harness_Stop(harness);
+    DerpRelay_Stop(relay);
+}
+
+TEST(dead_connection_is_reopened_when_the_relay_comes_back)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, false, address, sizeof(address));
+    uint16_t port = DerpRelay_GetPort(relay);
+    Harness* harness = Harness_Start(address, NULL, 20, 200, 0);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 1, 2000));
+
+    // a relay restart closes every connection, the next keepalive notices
+    DerpRelay_Stop(relay);
+    relay = Relay_Start(port, false, address, sizeof(address));
+    TEST_ASSERT_NOT_NULL(relay);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 2, 3000));
+    DerpWarm state = Harness_Read(harness);
+    TEST_ASSERT_TRUE(state.deaths >= 1);
+
+    DerpNet* session = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 0));
+    TEST_ASSERT_TRUE(Session_Exchange(session, address));
+    DerpNet_Close(session);
+    free(session);
+
+    Harness_Stop(harness);
+    DerpRelay_Stop(relay);
+}
+
+TEST(silent_connection_is_dropped_after_the_pong_timeout)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, true, address, sizeof(address));
+    Harness* harness = Harness_Start(address, NULL, 20, 50, 0);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 1, 2000));
+
+    // never answered: dropped after ping + timeout, reopened after 0, 250, 500 ms of backoff
+    BuddyThread_Sleep(1000);
+    DerpWarm state = Harness_Read(harness);
+    TEST_ASSERT_TRUE(state.deaths >= 2);
+    TEST_ASSERT_TRUE(state.opens >= 3);
+    TEST_ASSERT_TRUE(state.opens <= 5);
+    TEST_ASSERT_TRUE(state.backoff_ms >= 2 * DERP_WARM_MIN_BACKOFF_MS);
+
+    Harness_Stop(harness);
+    DerpRelay_Stop(relay);
+}
+
+TEST(unreachable_server_is_retried_with_backoff)
+{
+    // grab a free port and close it again, nothing listens there
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, false, address, sizeof(address));
+    DerpRelay_Stop(relay);
+
+    Harness* harness = Harness_Start(address, NULL, 0, 0, 0);
+    BuddyThread_Sleep(1200);
+    DerpWarm state = Harness_Read(harness);
+    TEST_ASSERT_EQUAL(0, state.opens);
+    TEST_ASSERT_TRUE(state.open_failures >= 3);    // at 0, 250 and 750 ms
+    TEST_ASSERT_TRUE(state.open_failures <= 4);
+    TEST_ASSERT_TRUE(state.backoff_ms >= 4 * DERP_WARM_MIN_BACKOFF_MS);
+
+    uint64_t start = BuddyClock_NowUs();
+    DerpNet* session = malloc(sizeof(DerpNet));
+    TEST_ASSERT_FALSE(DerpWarm_Take(&harness->warm, session, 500));
+    TEST_ASSERT_TRUE(BuddyClock_NowUs() - start < 100000);
+    free(session);
+
+    Harness_Stop(harness);
+}
+
+TEST(take_waits_for_an_open_in_progress)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, false, address, sizeof(address));
+    DerpNet* session = malloc(sizeof(DerpNet));
+
+    Harness* harness = Harness_Start(address, NULL, 0, 0, 200);
+    BuddyThread_Sleep(20);
+    uint64_t start = BuddyClock_NowUs();
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 1000));
+    uint64_t waited = BuddyClock_NowUs() - start;
+    TEST_ASSERT_TRUE(waited >= 100000 && waited < 1000000);
+    TEST_ASSERT_TRUE(Session_Exchange(session, address));
+    DerpNet_Close(session);
+    Harness_Stop(harness);
+
+    // without waiting the caller opens its own, the one in progress is closed once it finishes
+    harness = Harness_Start(address, NULL, 0, 0, 200);
+    BuddyThread_Sleep(20);
+    TEST_ASSERT_FALSE(DerpWarm_Take(&harness->warm, session, 0));
+    BuddyThread_Sleep(400);
+    DerpWarm state = Harness_Read(harness);
+    TEST_ASSERT_EQUAL(0, state.opens);
+    TEST_ASSERT_FALSE(state.connected);
+    TEST_ASSERT_TRUE(Relay_WaitClients(relay, 0));
+    Harness_Stop(harness);
+
+    free(session);
+    DerpRelay_Stop(relay);
+}
+
+TEST(reset_moves_to_another_server_and_key)
+{
+    char first[32], second[32];
+    DerpRelay* relay1 = Relay_Start(0, false, first, sizeof(first));
+    DerpRelay* relay2 = Relay_Start(0, false, second, sizeof(second));
+
+    DerpKey key1, key2;
+    DerpNet_CreateNewKey(&key1);
+    DerpNet_CreateNewKey(&key2);
+    Harness* harness = Harness_Start(first, &key1, 0, 0, 0);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 1, 2000));
+    TEST_ASSERT_TRUE(Relay_WaitClients(relay1, 1));
+
+    DerpWarm_Reset(&harness->warm, second, key2.Bytes);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 2, 2000));
+    TEST_ASSERT_TRUE(Relay_WaitClients(relay1, 0));
+    TEST_ASSERT_TRUE(Relay_WaitClients(relay2, 1));
+
+    DerpNet* session = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 0));
+    TEST_ASSERT_TRUE(memcmp(session->UserPrivateKey, key2.Bytes, 32) == 0);
+    DerpNet_Close(session);
+
+    // without a key every connection gets its own
+    DerpWarm_Reset(&harness->warm, second, NULL);
+    DerpWarm_Resume(&harness->warm);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 3, 2000));
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 0));
+    uint8_t previous[32];
+    memcpy(previous, session->UserPrivateKey, 32);
+    DerpNet_Close(session);
+    DerpWarm_Resume(&harness->warm);
+    TEST_ASSERT_TRUE(Harness_WaitReady(harness, 4, 2000));
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 0));
+    TEST_ASSERT_TRUE(memcmp(session->UserPrivateKey, previous, 32) != 0);
+    TEST_ASSERT_TRUE(memcmp(session->UserPrivateKey, key2.Bytes, 32) != 0);
+    DerpNet_Close(session);
+
+    free(session);
+    Harness_Stop(harness);
+    DerpRelay_Stop(relay1);
+    DerpRelay_Stop(relay2);
+}
+
+static int Compare_U64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Click to the first packet at the peer, the part of click -> first frame the connection owns.
+// Every open pays BENCH_OPEN_DELAY_MS on top of the local handshake, as a remote server would.
+TEST(benchmark_click_to_first_packet)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, false, address, sizeof(address));
+    Harness* harness = Harness_Start(address, NULL, 0, 0, BENCH_OPEN_DELAY_MS);
+
+    DerpKey peer_secret, peer_public, from;
+    DerpNet_CreateNewKey(&peer_secret);
+    DerpNet_GetPublicKey(&peer_secret, &peer_public);
+    DerpNet* peer = malloc(sizeof(DerpNet));
+    DerpNet* session = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_Open(peer, address, &peer_secret));
+
+    // warming stays paused while the cold opens run
+    TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 2000));
+    DerpNet_Close(session);
+
+    uint64_t cold[BENCH_ROUNDS], warm[BENCH_ROUNDS];
+    uint32_t size;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        // cold: open on click, like Buddy_StartConnection did
+        uint64_t start = BuddyClock_NowUs();
+        DerpKey secret;
+        DerpNet_CreateNewKey(&secret);
+        TEST_ASSERT_TRUE(Harness_Open(harness, session, address, secret.Bytes));
+        TEST_ASSERT_TRUE(DerpNet_Send(session, &peer_public, "", 0));
+        TEST_ASSERT_TRUE(Net_RecvOne(peer, &from, &size));
+        cold[round] = BuddyClock_NowUs() - start;
+        DerpNet_Close(session);
+
+        // warm: the connection is waiting when the click comes
+        DerpWarm_Resume(&harness->warm);
+        TEST_ASSERT_TRUE(Harness_WaitReady(harness, (uint64_t)round + 2, 2000));
+        start = BuddyClock_NowUs();
+        TEST_ASSERT_TRUE(DerpWarm_Take(&harness->warm, session, 0));
+        TEST_ASSERT_TRUE(DerpNet_Send(session, &peer_public, "", 0));
+        TEST_ASSERT_TRUE(Net_RecvOne(peer, &from, &size));
+        warm[round] = BuddyClock_NowUs() - start;
+        DerpNet_Close(session);
+    }
+
+    qsort(cold, BENCH_ROUNDS, sizeof(cold[0]), Compare_U64);
+    qsort(warm, BENCH_ROUNDS, sizeof(warm[0]), Compare_U64);
+    printf("\n    click -> first packet at peer, median of %d (open costs +%d ms):\n", BENCH_ROUNDS, BENCH_OPEN_DELAY_MS);
+    printf("      open on click:   %7.2f ms\n", cold[BENCH_ROUNDS / 2] / 1000.0);
+    printf("      warm connection: %7.2f ms\n", warm[BENCH_ROUNDS / 2] / 1000.0);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(warm[BENCH_ROUNDS / 2] * 4 < cold[BENCH_ROUNDS / 2]);
+
+    DerpNet_Close(peer);
+    free(peer);
+    free(session);
+    Harness_Stop(harness);
+    DerpRelay_Stop(relay);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Warm DERP Connection Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(taken_connection_carries_packets_and_warming_pauses);
+    RUN_TEST(pings_keep_the_connection_and_pongs_answer);
+    RUN_TEST(dead_connection_is_reopened_when_the_relay_comes_back);
+    RUN_TEST(silent_connection_is_dropped_after_the_pong_timeout);
+    RUN_TEST(unreachable_server_is_retried_with_backoff);
+    RUN_TEST(take_waits_for_an_open_in_progress);
+    RUN_TEST(reset_moves_to_another_server_and_key);
+    RUN_TEST(benchmark_click_to_first_packet);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,384 @@
+// Unit tests and stall benchmark for the non-blocking DerpNet send queue (TrySend/TryQueue/TryReserve/OnWritable)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define SEND_BUDGET (256 * 1024)
+
+typedef struct {
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];
+    DerpLoopback loop;
+} Pair;
+
+static bool Pair_Start(Pair* pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&pair->secret[i]);
+        DerpNet_GetPublicKey(&pair->secret[i], &pair->public_key[i]);
+        pair->net[i] = malloc(sizeof(DerpNet));
+    }
+    return DerpLoopback_Start(&pair->loop, pair->net[0], &pair->secret[0], pair->net[1], &pair->secret[1]);
+}
+
+static void Pair_Stop(Pair* pair)
+{
+    DerpLoopback_Stop(&pair->loop);
+    free(pair->net[0]);
+    free(pair->net[1]);
+}
+
+// Throttled peer: reads one frame, then sleeps, like a viewer behind a slow link.
+// Stops once it has seen `expected` frames or a frame with the stop sequence.
+typedef struct {
+    DerpNet* net;
+    uint32_t delay_ms;
+    volatile bool paused;
+    volatile bool done;
+    uint32_t count;
+    uint32_t last_sequence;
+    bool in_order;
+    BuddyThread thread;
+} SlowReceiver;
+
+#define STOP_SEQUENCE 0xffffffffu
+
+static void SlowReceiver_Run(void* arg)
+{
+    SlowReceiver* rx = arg;
+    rx->in_order = true;
+    for (;;)
+    {
+        while (rx->paused) BuddyThread_Sleep(1);
+
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(rx->net, &from, &data, &size, true) != 1) break;
+
+        uint32_t sequence;
+        memcpy(&sequence, data, sizeof(sequence));
+        if (sequence == STOP_SEQUENCE) break;
+        if (rx->count != 0 && sequence <= rx->last_sequence) rx->in_order = false;
+        rx->last_sequence = sequence;
+        rx->count++;
+
+        if (rx->delay_ms) BuddyThread_Sleep(rx->delay_ms);
+    }
+    rx->done = true;
+}
+
+static void SlowReceiver_Start(SlowReceiver* rx, DerpNet* net, uint32_t delay_ms, bool paused)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->net = net;
+    rx->delay_ms = delay_ms;
+    rx->paused = paused;
+    BuddyThread_Start(&rx->thread, SlowReceiver_Run, rx);
+}
+
+static void SendStop(Pair* pair)
+{
+    uint32_t stop = STOP_SEQUENCE;
+    DerpNet_Send(pair->net[0], &pair->public_key[1], &stop, sizeof(stop));
+}
+
+// Waits in select like the event loop does on FD_WRITE, then lets DerpNet write what it can
+static bool DrainQueue(DerpNet* net)
+{
+    while (DerpNet_GetQueuedBytes(net) != 0)
+    {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(net->Socket, &set);
+        if (select((int)(net->Socket + 1), NULL, &set, NULL, NULL) < 0) return false;
+        if (!DerpNet_OnWritable(net)) return false;
+    }
+    return true;
+}
+
+TEST(try_send_returns_would_block_instead_of_waiting)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+    DerpNet_SetSendBudget(net, SEND_BUDGET);
+
+    // peer is not reading at all, socket buffers fill up and then the queue hits the budget
+    SlowReceiver rx;
+    SlowReceiver_Start(&rx, pair.net[1], 0, true);
+
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    uint32_t accepted = 0, would_block = 0;
+    uint64_t worst_us = 0;
+    for (uint32_t i = 0; i < 200; i++)
+    {
+        memset(chunk, (int)i, VIDEO_CHUNK_SIZE);
+        memcpy(chunk, &accepted, sizeof(accepted));
+
+        uint64_t start = BuddyClock_NowUs();
+        DerpNetSendResult result = DerpNet_TrySend(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE);
+        uint64_t elapsed = BuddyClock_NowUs() - start;
+        if (elapsed > worst_us) worst_us = elapsed;
+
+        TEST_ASSERT_TRUE(result != DERPNET_SEND_DISCONNECTED);
+        if (result == DERPNET_SEND_QUEUED) accepted++;
+        else would_block++;
+
+        TEST_ASSERT_TRUE(DerpNet_GetQueuedBytes(net) <= SEND_BUDGET);
+    }
+    TEST_ASSERT_TRUE(would_block > 0);
+    TEST_ASSERT_TRUE(DerpNet_GetQueuedBytes(net) > SEND_BUDGET - (1 << 16));
+    // a blocked peer must not stall the caller; generous bound for slow CI machines
+    TEST_ASSERT_TRUE(worst_us < 100 * 1000);
+
+    // peer catches up, writable events drain the queue, everything accepted arrives in order
+    rx.paused = false;
+    TEST_ASSERT_TRUE(DrainQueue(net));
+    TEST_ASSERT_EQUAL(0, DerpNet_GetQueuedBytes(net));
+    SendStop(&pair);
+    BuddyThread_Join(rx.thread);
+
+    TEST_ASSERT_EQUAL(accepted, rx.count);
+    TEST_ASSERT_TRUE(rx.in_order);
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+TEST(try_reserve_takes_whole_frames_or_none)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+    DerpNet_SetSendBudget(net, SEND_BUDGET);
+
+    SlowReceiver rx;
+    SlowReceiver_Start(&rx, pair.net[1], 0, true);
+
+    // a frame of three chunks goes into the queue whole, or is refused before any chunk of it is
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    size_t frame_size = 3 * (DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE);
+    uint32_t sequence = 0, frames = 0, refused = 0;
+    uint64_t worst_us = 0;
+    for (uint32_t i = 0; i < 50; i++)
+    {
+        uint64_t start = BuddyClock_NowUs();
+        DerpNetSendResult result = DerpNet_TryReserve(net, frame_size);
+        TEST_ASSERT_TRUE(result != DERPNET_SEND_DISCONNECTED);
+        if (result == DERPNET_SEND_WOULD_BLOCK)
+        {
+            refused++;
+            continue;
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            memcpy(chunk, &sequence, sizeof(sequence));
+            DerpNetIoVec iov = { chunk, VIDEO_CHUNK_SIZE };
+            TEST_ASSERT_TRUE(DerpNet_QueueV(net, &pair.public_key[1], &iov, 1));
+            sequence++;
+        }
+        uint64_t elapsed = BuddyClock_NowUs() - start;
+        if (elapsed > worst_us) worst_us = elapsed;
+        frames++;
+        TEST_ASSERT_TRUE(DerpNet_GetQueuedBytes(net) <= SEND_BUDGET);
+    }
+    TEST_ASSERT_TRUE(refused > 0);
+    TEST_ASSERT_TRUE(worst_us < 100 * 1000);
+
+    // single messages are refused the same way, without waiting
+    memcpy(chunk, &sequence, sizeof(sequence));
+    DerpNetIoVec iov = { chunk, VIDEO_CHUNK_SIZE };
+    while (DerpNet_TryQueueV(net, &pair.public_key[1], &iov, 1) == DERPNET_SEND_QUEUED)
+    {
+        sequence++;
+        memcpy(chunk, &sequence, sizeof(sequence));
+    }
+    TEST_ASSERT_TRUE(DerpNet_GetQueuedBytes(net) <= SEND_BUDGET);
+
+    rx.paused = false;
+    TEST_ASSERT_TRUE(DrainQueue(net));
+    SendStop(&pair);
+    BuddyThread_Join(rx.thread);
+    TEST_ASSERT_EQUAL(sequence, rx.count);
+    TEST_ASSERT_TRUE(rx.count >= frames * 3);
+    TEST_ASSERT_TRUE(rx.in_order);
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+TEST(blocking_send_keeps_order_after_try_send)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    SlowReceiver rx;
+    SlowReceiver_Start(&rx, pair.net[1], 1, true);
+
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    uint32_t sequence = 0;
+    while (DerpNet_GetQueuedBytes(net) == 0 || sequence < 20)
+    {
+        memcpy(chunk, &sequence, sizeof(sequence));
+        if (DerpNet_TrySend(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE) != DERPNET_SEND_QUEUED) break;
+        sequence++;
+    }
+    TEST_ASSERT_TRUE(DerpNet_GetQueuedBytes(net) != 0);
+
+    // a click goes out with DerpNet_Send, it waits for the backlog and stays behind it
+    rx.paused = false;
+    memcpy(chunk, &sequence, sizeof(sequence));
+    TEST_ASSERT_TRUE(DerpNet_Send(net, &pair.public_key[1], chunk, 16));
+    TEST_ASSERT_EQUAL(0, DerpNet_GetQueuedBytes(net));
+    sequence++;
+
+    SendStop(&pair);
+    BuddyThread_Join(rx.thread);
+    TEST_ASSERT_EQUAL(sequence, rx.count);
+    TEST_ASSERT_TRUE(rx.in_order);
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+TEST(send_budget_is_clamped)
+{
+    DerpNet* net = calloc(1, sizeof(DerpNet));
+
+    DerpNet_SetSendBudget(net, 1);
+    TEST_ASSERT_EQUAL(1 << 16, net->SendBudget);
+    DerpNet_SetSendBudget(net, (size_t)1 << 40);
+    TEST_ASSERT_EQUAL(DERPNET_SEND_QUEUE_SIZE, net->SendBudget);
+
+    free(net);
+}
+
+TEST(closed_relay_reports_disconnected)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    // relay goes away, its forwarder sees EOF and exits
+    shutdown(pair.loop.server[0], 2);
+
+    uint8_t packet[10] = { 0 };
+    DerpNetSendResult result = DERPNET_SEND_QUEUED;
+    for (int i = 0; i < 100 && result == DERPNET_SEND_QUEUED; i++)
+    {
+        result = DerpNet_TrySend(net, &pair.public_key[1], packet, sizeof(packet));
+    }
+    TEST_ASSERT_EQUAL(DERPNET_SEND_DISCONNECTED, result);
+    TEST_ASSERT_FALSE(DerpNet_OnWritable(net));
+
+    Pair_Stop(&pair);
+}
+
+typedef struct {
+    double worst_stall_ms;
+    double delivered_mb_per_sec;
+    uint32_t dropped;
+} BenchResult;
+
+// Sharer event loop at 60 passes per second producing one video chunk per pass,
+// peer drains at roughly half that rate. Blocking sends stall the loop, TrySend drops instead.
+static BenchResult RunBenchmark(bool use_try_send)
+{
+    Pair pair;
+    Pair_Start(&pair);
+    DerpNet* net = pair.net[0];
+    DerpNet_SetSendBudget(net, SEND_BUDGET);
+
+    SlowReceiver rx;
+    SlowReceiver_Start(&rx, pair.net[1], 33, false);
+
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x5a, VIDEO_CHUNK_SIZE);
+
+    BenchResult result = { 0 };
+    uint32_t passes = 120, sequence = 0;
+    uint64_t start = BuddyClock_NowUs();
+    for (uint32_t pass = 0; pass < passes; pass++)
+    {
+        uint64_t pass_start = BuddyClock_NowUs();
+        memcpy(chunk, &sequence, sizeof(sequence));
+        if (use_try_send)
+        {
+            DerpNet_OnWritable(net);
+            if (DerpNet_TrySend(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE) == DERPNET_SEND_QUEUED) sequence++;
+            else result.dropped++;
+        }
+        else
+        {
+            DerpNet_Send(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE);
+            sequence++;
+        }
+        double stall = (BuddyClock_NowUs() - pass_start) / 1000.0;
+        if (stall > result.worst_stall_ms) result.worst_stall_ms = stall;
+
+        // rest of the pass is the message loop idling until the next frame
+        uint64_t next = start + (uint64_t)(pass + 1) * 1000 * 1000 / 60;
+        uint64_t now = BuddyClock_NowUs();
+        if (now < next) BuddyThread_Sleep((uint32_t)((next - now) / 1000));
+    }
+    DrainQueue(net);
+    SendStop(&pair);
+    BuddyThread_Join(rx.thread);
+
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    result.delivered_mb_per_sec = (double)rx.count * VIDEO_CHUNK_SIZE / (1024.0 * 1024.0) / seconds;
+
+    free(chunk);
+    Pair_Stop(&pair);
+    return result;
+}
+
+TEST(benchmark_event_loop_stall_on_slow_peer)
+{
+    BenchResult blocking = RunBenchmark(false);
+    BenchResult try_send = RunBenchmark(true);
+
+    printf("\n    %-22s %16s %10s %8s\n", "sender", "worst stall (ms)", "MB/s", "dropped");
+    printf("    %-22s %16.1f %10.2f %8u\n", "DerpNet_Send", blocking.worst_stall_ms, blocking.delivered_mb_per_sec, blocking.dropped);
+    printf("    %-22s %16.1f %10.2f %8u\n", "DerpNet_TrySend", try_send.worst_stall_ms, try_send.delivered_mb_per_sec, try_send.dropped);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(try_send.dropped > 0);
+    TEST_ASSERT_TRUE(try_send.worst_stall_ms < blocking.worst_stall_ms);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Send Backpressure Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(try_send_returns_would_block_instead_of_waiting);
+    RUN_TEST(try_reserve_takes_whole_frames_or_none);
+    RUN_TEST(blocking_send_keeps_order_after_try_send);
+    RUN_TEST(send_budget_is_clamped);
+    RUN_TEST(closed_relay_reports_disconnected);
+    RUN_TEST(benchmark_event_loop_stall_on_slow_peer);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,263 @@
+// Unit tests and benchmarks for DerpNet send coalescing (Queue/Flush)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+
+#define MOUSE_PACKET_SIZE 10       // sizeof(Buddy_MousePacket)
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+
+typedef struct {
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];
+    DerpLoopback loop;
+} Pair;
+
+static bool Pair_Start(Pair* pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&pair->secret[i]);
+        DerpNet_GetPublicKey(&pair->secret[i], &pair->public_key[i]);
+        pair->net[i] = malloc(sizeof(DerpNet));
+    }
+    return DerpLoopback_Start(&pair->loop, pair->net[0], &pair->secret[0], pair->net[1], &pair->secret[1]);
+}
+
+static void Pair_Stop(Pair* pair)
+{
+    DerpLoopback_Stop(&pair->loop);
+    free(pair->net[0]);
+    free(pair->net[1]);
+}
+
+// Drains the receiving side on its own thread so large bursts cannot deadlock the sender
+typedef struct {
+    DerpNet* net;
+    uint32_t expected;
+    uint32_t count;
+    size_t bytes;
+    bool in_order;
+    BuddyThread thread;
+} Receiver;
+
+static void Receiver_Run(void* arg)
+{
+    Receiver* rx = arg;
+    rx->in_order = true;
+    while (rx->count < rx->expected)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(rx->net, &from, &data, &size, true) < 0) break;
+
+        uint32_t sequence;
+        memcpy(&sequence, data, sizeof(sequence));
+        if (sequence != rx->count) rx->in_order = false;
+        rx->count++;
+        rx->bytes += size;
+    }
+}
+
+static void Receiver_Start(Receiver* rx, DerpNet* net, uint32_t expected)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->net = net;
+    rx->expected = expected;
+    BuddyThread_Start(&rx->thread, Receiver_Run, rx);
+}
+
+static void MakePacket(uint8_t* packet, size_t size, uint32_t sequence)
+{
+    memset(packet, (int)sequence, size);
+    memcpy(packet, &sequence, sizeof(sequence));
+}
+
+TEST(queued_frames_leave_in_one_write)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 50);
+
+    uint8_t packet[MOUSE_PACKET_SIZE];
+    for (uint32_t i = 0; i < 50; i++)
+    {
+        MakePacket(packet, sizeof(packet), i);
+        TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], packet, sizeof(packet)));
+    }
+    TEST_ASSERT_EQUAL(0, net->SendCalls);
+    TEST_ASSERT_EQUAL(0, net->TotalSent);
+
+    TEST_ASSERT_TRUE(DerpNet_Flush(net));
+    TEST_ASSERT_EQUAL(1, net->SendCalls);
+    TEST_ASSERT_EQUAL(50 * (1 + 4 + 32 + 24 + 16 + MOUSE_PACKET_SIZE), net->TotalSent);
+    TEST_ASSERT_EQUAL(0, net->SendQueueSize);
+
+    // nothing queued, nothing written
+    TEST_ASSERT_TRUE(DerpNet_Flush(net));
+    TEST_ASSERT_EQUAL(1, net->SendCalls);
+
+    BuddyThread_Join(rx.thread);
+    TEST_ASSERT_EQUAL(50, rx.count);
+    TEST_ASSERT_TRUE(rx.in_order);
+
+    Pair_Stop(&pair);
+}
+
+TEST(urgent_send_flushes_queue_in_order)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 4);
+
+    uint8_t packet[MOUSE_PACKET_SIZE];
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        MakePacket(packet, sizeof(packet), i);
+        TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], packet, sizeof(packet)));
+    }
+
+    // a click must not overtake the moves queued before it, and goes out right away
+    MakePacket(packet, sizeof(packet), 3);
+    TEST_ASSERT_TRUE(DerpNet_Send(net, &pair.public_key[1], packet, sizeof(packet)));
+    TEST_ASSERT_EQUAL(1, net->SendCalls);
+    TEST_ASSERT_EQUAL(0, net->SendQueueSize);
+
+    BuddyThread_Join(rx.thread);
+    TEST_ASSERT_EQUAL(4, rx.count);
+    TEST_ASSERT_TRUE(rx.in_order);
+
+    Pair_Stop(&pair);
+}
+
+TEST(full_queue_flushes_automatically)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    uint32_t count = 3 * DERPNET_SEND_QUEUE_SIZE / VIDEO_CHUNK_SIZE;
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], count);
+
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        MakePacket(chunk, VIDEO_CHUNK_SIZE, i);
+        TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE));
+        TEST_ASSERT_TRUE(net->SendQueueSize <= DERPNET_SEND_QUEUE_SIZE);
+    }
+    TEST_ASSERT_TRUE(net->SendCalls >= 2);
+    TEST_ASSERT_TRUE(DerpNet_Flush(net));
+
+    BuddyThread_Join(rx.thread);
+    TEST_ASSERT_EQUAL(count, rx.count);
+    TEST_ASSERT_TRUE(rx.in_order);
+    TEST_ASSERT_EQUAL((size_t)count * VIDEO_CHUNK_SIZE, rx.bytes);
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+typedef struct {
+    double calls_per_iteration;
+    double rate;              // packets or MB per second
+} BenchResult;
+
+// Each iteration is one event loop pass producing `per_iteration` packets
+static BenchResult RunBenchmark(size_t packet_size, uint32_t per_iteration, uint32_t iterations, bool coalesce)
+{
+    Pair pair;
+    Pair_Start(&pair);
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], per_iteration * iterations);
+
+    uint8_t* packet = malloc(packet_size);
+    uint32_t sequence = 0;
+    uint64_t start = BuddyClock_NowUs();
+    for (uint32_t it = 0; it < iterations; it++)
+    {
+        for (uint32_t i = 0; i < per_iteration; i++)
+        {
+            MakePacket(packet, packet_size, sequence++);
+            if (coalesce)
+            {
+                DerpNet_Queue(net, &pair.public_key[1], packet, packet_size);
+            }
+            else
+            {
+                DerpNet_Send(net, &pair.public_key[1], packet, packet_size);
+            }
+        }
+        DerpNet_Flush(net);
+    }
+    BuddyThread_Join(rx.thread);
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+
+    BenchResult result;
+    result.calls_per_iteration = (double)net->SendCalls / iterations;
+    result.rate = packet_size >= 1024 ? rx.bytes / (1024.0 * 1024.0) / seconds : rx.count / seconds;
+
+    free(packet);
+    Pair_Stop(&pair);
+    return result;
+}
+
+TEST(benchmark_syscalls_and_throughput)
+{
+    // 200 KB keyframe split into video chunks
+    BenchResult key_send = RunBenchmark(VIDEO_CHUNK_SIZE, 4, 100, false);
+    BenchResult key_queue = RunBenchmark(VIDEO_CHUNK_SIZE, 4, 100, true);
+    // burst of mouse moves handled in one message loop pass
+    BenchResult mouse_send = RunBenchmark(MOUSE_PACKET_SIZE, 32, 1000, false);
+    BenchResult mouse_queue = RunBenchmark(MOUSE_PACKET_SIZE, 32, 1000, true);
+
+    printf("\n    %-30s %12s %14s\n", "workload", "calls/iter", "throughput");
+    printf("    %-30s %12.2f %9.1f MB/s\n", "keyframe 4x65000, Send", key_send.calls_per_iteration, key_send.rate);
+    printf("    %-30s %12.2f %9.1f MB/s\n", "keyframe 4x65000, Queue+Flush", key_queue.calls_per_iteration, key_queue.rate);
+    printf("    %-30s %12.2f %9.0f pkt/s\n", "32 mouse moves, Send", mouse_send.calls_per_iteration, mouse_send.rate);
+    printf("    %-30s %12.2f %9.0f pkt/s\n", "32 mouse moves, Queue+Flush", mouse_queue.calls_per_iteration, mouse_queue.rate);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(key_queue.calls_per_iteration < key_send.calls_per_iteration);
+    TEST_ASSERT_TRUE(mouse_queue.calls_per_iteration <= 1.01);
+    TEST_ASSERT_TRUE(mouse_send.calls_per_iteration >= 32);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Send Coalescing Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(queued_frames_leave_in_one_write);
+    RUN_TEST(urgent_send_flushes_queue_in_order);
+    RUN_TEST(full_queue_flushes_automatically);
+    RUN_TEST(benchmark_syscalls_and_throughput);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,370 @@
+// Tests and benchmark for the connect race in DerpNet_Open (RFC 8305 style) against local
+// listeners, some of which refuse or silently drop connection attempts
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1
+#define DERPNET_CONNECT_TIMEOUT_MS 1000   // keeps the all-blackholed case short
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+
+#define MAX_ADDRESSES 8
+
+// Listens on 127.0.0.1. A blackhole listener never accepts and its one-entry queue is already
+// taken, so the kernel drops further SYNs and a connect hangs like one to a dead address.
+typedef struct {
+    int fd;
+    int filler;
+    uint16_t port;
+} Listener;
+
+static bool Listener_Open(Listener* listener, bool blackhole)
+{
+    listener->filler = -1;
+    listener->fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t size = sizeof(address);
+    if (listener->fd < 0 || bind(listener->fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener->fd, blackhole ? 0 : 64) != 0 || getsockname(listener->fd, (struct sockaddr*)&address, &size) != 0)
+    {
+        return false;
+    }
+    listener->port = ntohs(address.sin_port);
+
+    if (blackhole)
+    {
+        listener->filler = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(listener->filler, (struct sockaddr*)&address, sizeof(address)) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void Listener_Close(Listener* listener)
+{
+    if (listener->filler >= 0) close(listener->filler);
+    close(listener->fd);
+}
+
+// a port nothing listens on, connects are refused right away
+static uint16_t ClosedPort(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t size = sizeof(address);
+    bind(fd, (struct sockaddr*)&address, sizeof(address));
+    getsockname(fd, (struct sockaddr*)&address, &size);
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+// what getaddrinfo would return for a name with these 127.0.0.1 ports, in this order
+typedef struct {
+    struct addrinfo info[MAX_ADDRESSES];
+    struct sockaddr_in address[MAX_ADDRESSES];
+} AddressList;
+
+static struct addrinfo* AddressList_Make(AddressList* list, const uint16_t* ports, int count)
+{
+    memset(list, 0, sizeof(*list));
+    for (int i = 0; i < count; i++)
+    {
+        list->address[i] = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(ports[i]), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        list->info[i].ai_family = AF_INET;
+        list->info[i].ai_socktype = SOCK_STREAM;
+        list->info[i].ai_protocol = IPPROTO_TCP;
+        list->info[i].ai_addr = (struct sockaddr*)&list->address[i];
+        list->info[i].ai_addrlen = sizeof(list->address[i]);
+        list->info[i].ai_next = i + 1 < count ? &list->info[i + 1] : NULL;
+    }
+    return &list->info[0];
+}
+
+static int OpenDescriptors(void)
+{
+    int count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir) return -1;
+    while (readdir(dir)) count++;
+    closedir(dir);
+    return count;
+}
+
+static uint16_t PeerPort(uintptr_t socket)
+{
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    getpeername((int)socket, (struct sockaddr*)&address, &size);
+    return ntohs(address.sin_port);
+}
+
+static bool IsBlocking(uintptr_t socket)
+{
+    return !(fcntl((int)socket, F_GETFL, 0) & O_NONBLOCK);
+}
+
+TEST(families_alternate_starting_with_the_preferred_one)
+{
+    AddressList list;
+    uint16_t ports[6] = { 1, 2, 3, 4, 5, 6 };
+    struct addrinfo* info = AddressList_Make(&list, ports, 6);
+    int families[6] = { AF_INET6, AF_INET6, AF_INET6, AF_INET, AF_INET, AF_INET6 };
+    for (int i = 0; i < 6; i++) list.info[i].ai_family = families[i];
+
+    const struct addrinfo* order[DERPNET_CONNECT_MAX_ADDRESSES];
+    TEST_ASSERT_EQUAL(6, DerpNet__ConnectOrder(info, order));
+    // v6 v4 v6 v4 v6 v6, each family keeps its getaddrinfo order
+    const int expected[6] = { 0, 3, 1, 4, 2, 5 };
+    for (int i = 0; i < 6; i++)
+    {
+        TEST_ASSERT_EQUAL(expected[i], (int)(order[i] - info));
+    }
+
+    // a single family is left as it is
+    for (int i = 0; i < 6; i++) list.info[i].ai_family = AF_INET;
+    TEST_ASSERT_EQUAL(6, DerpNet__ConnectOrder(info, order));
+    for (int i = 0; i < 6; i++)
+    {
+        TEST_ASSERT_EQUAL(i, (int)(order[i] - info));
+    }
+}
+
+TEST(first_address_connects_without_starting_others)
+{
+    Listener good[2];
+    TEST_ASSERT_TRUE(Listener_Open(&good[0], false));
+    TEST_ASSERT_TRUE(Listener_Open(&good[1], false));
+
+    AddressList list;
+    uint16_t ports[2] = { good[0].port, good[1].port };
+    static DerpNet net;
+    memset(&net, 0, sizeof(net));
+    const struct addrinfo* connected = NULL;
+    uintptr_t socket = DerpNet__Connect(&net, AddressList_Make(&list, ports, 2), &connected);
+
+    TEST_ASSERT_TRUE(socket != DERPNET_INVALID_SOCKET);
+    TEST_ASSERT_TRUE(connected == &list.info[0]);
+    TEST_ASSERT_EQUAL(good[0].port, PeerPort(socket));
+    TEST_ASSERT_TRUE(IsBlocking(socket));
+    TEST_ASSERT_EQUAL(1, net.ConnectAttempts);
+    TEST_ASSERT_EQUAL(0, net.ConnectFailures);
+    TEST_ASSERT_EQUAL(0, net.ConnectWinner);
+    TEST_ASSERT_TRUE(net.ConnectUs < DERPNET_CONNECT_STAGGER_MS * 1000);
+
+    close((int)socket);
+    Listener_Close(&good[0]);
+    Listener_Close(&good[1]);
+}
+
+TEST(blackholed_first_address_loses_after_the_stagger)
+{
+    Listener dead, good;
+    TEST_ASSERT_TRUE(Listener_Open(&dead, true));
+    TEST_ASSERT_TRUE(Listener_Open(&good, false));
+
+    AddressList list;
+    uint16_t ports[2] = { dead.port, good.port };
+    static DerpNet net;
+    memset(&net, 0, sizeof(net));
+    const struct addrinfo* connected = NULL;
+    uintptr_t socket = DerpNet__Connect(&net, AddressList_Make(&list, ports, 2), &connected);
+
+    TEST_ASSERT_TRUE(socket != DERPNET_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(good.port, PeerPort(socket));
+    TEST_ASSERT_EQUAL(2, net.ConnectAttempts);
+    TEST_ASSERT_EQUAL(1, net.ConnectWinner);
+    // second attempt starts after the stagger, not after a TCP timeout
+    TEST_ASSERT_TRUE(net.ConnectUs >= DERPNET_CONNECT_STAGGER_MS * 1000);
+    TEST_ASSERT_TRUE(net.ConnectUs < 2 * DERPNET_CONNECT_STAGGER_MS * 1000);
+
+    close((int)socket);
+    Listener_Close(&dead);
+    Listener_Close(&good);
+}
+
+TEST(refused_address_fails_over_without_waiting)
+{
+    Listener good;
+    TEST_ASSERT_TRUE(Listener_Open(&good, false));
+
+    AddressList list;
+    uint16_t ports[3] = { ClosedPort(), ClosedPort(), good.port };
+    static DerpNet net;
+    memset(&net, 0, sizeof(net));
+    const struct addrinfo* connected = NULL;
+    uintptr_t socket = DerpNet__Connect(&net, AddressList_Make(&list, ports, 3), &connected);
+
+    TEST_ASSERT_TRUE(socket != DERPNET_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(good.port, PeerPort(socket));
+    TEST_ASSERT_EQUAL(3, net.ConnectAttempts);
+    TEST_ASSERT_EQUAL(2, net.ConnectFailures);
+    TEST_ASSERT_EQUAL(2, net.ConnectWinner);
+    TEST_ASSERT_TRUE(net.ConnectUs < DERPNET_CONNECT_STAGGER_MS * 1000);
+
+    close((int)socket);
+    Listener_Close(&good);
+}
+
+TEST(losing_attempts_are_closed)
+{
+    Listener dead[3], good;
+    for (int i = 0; i < 3; i++) TEST_ASSERT_TRUE(Listener_Open(&dead[i], true));
+    TEST_ASSERT_TRUE(Listener_Open(&good, false));
+
+    AddressList list;
+    uint16_t ports[5] = { dead[0].port, dead[1].port, dead[2].port, good.port, dead[0].port };
+    static DerpNet net;
+    memset(&net, 0, sizeof(net));
+    int before = OpenDescriptors();
+    const struct addrinfo* connected = NULL;
+    uintptr_t socket = DerpNet__Connect(&net, AddressList_Make(&list, ports, 5), &connected);
+
+    TEST_ASSERT_TRUE(socket != DERPNET_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(3, net.ConnectWinner);
+    TEST_ASSERT_EQUAL(4, net.ConnectAttempts);
+    // three pending attempts closed, only the winner stays open
+    TEST_ASSERT_EQUAL(before + 1, OpenDescriptors());
+
+    close((int)socket);
+    for (int i = 0; i < 3; i++) Listener_Close(&dead[i]);
+    Listener_Close(&good);
+}
+
+TEST(all_addresses_dead_gives_up_at_the_timeout)
+{
+    Listener dead[2];
+    for (int i = 0; i < 2; i++) TEST_ASSERT_TRUE(Listener_Open(&dead[i], true));
+
+    AddressList list;
+    uint16_t ports[2] = { dead[0].port, dead[1].port };
+    static DerpNet net;
+    memset(&net, 0, sizeof(net));
+    int before = OpenDescriptors();
+    const struct addrinfo* connected = NULL;
+    uintptr_t socket = DerpNet__Connect(&net, AddressList_Make(&list, ports, 2), &connected);
+
+    TEST_ASSERT_TRUE(socket == DERPNET_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(2, net.ConnectAttempts);
+    TEST_ASSERT_TRUE(net.ConnectUs >= DERPNET_CONNECT_TIMEOUT_MS * 1000);
+    TEST_ASSERT_TRUE(net.ConnectUs < (DERPNET_CONNECT_TIMEOUT_MS + 500) * 1000);
+    TEST_ASSERT_EQUAL(before, OpenDescriptors());
+
+    // all refused fails at once
+    uint16_t closed[2] = { ClosedPort(), ClosedPort() };
+    memset(&net, 0, sizeof(net));
+    socket = DerpNet__Connect(&net, AddressList_Make(&list, closed, 2), &connected);
+    TEST_ASSERT_TRUE(socket == DERPNET_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(2, net.ConnectFailures);
+    TEST_ASSERT_TRUE(net.ConnectUs < 100 * 1000);
+
+    for (int i = 0; i < 2; i++) Listener_Close(&dead[i]);
+}
+
+TEST(open_through_relay_records_connect_metrics)
+{
+    DerpRelayConfig config = { .threads = 1 };
+    DerpRelay* relay = DerpRelay_Start(&config);
+    TEST_ASSERT_NOT_NULL(relay);
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", DerpRelay_GetPort(relay));
+
+    DerpKey secret;
+    DerpNet_CreateNewKey(&secret);
+    DerpNet* net = malloc(sizeof(*net));
+    TEST_ASSERT_TRUE(DerpNet_Open(net, address, &secret));
+    TEST_ASSERT_EQUAL(1, net->ConnectAttempts);
+    TEST_ASSERT_EQUAL(0, net->ConnectFailures);
+    TEST_ASSERT_EQUAL(0, net->ConnectWinner);
+    TEST_ASSERT_TRUE(net->ConnectUs > 0 && net->ConnectUs < DERPNET_CONNECT_STAGGER_MS * 1000);
+    // the handshake after the race ran on a blocking socket
+    TEST_ASSERT_TRUE(IsBlocking(net->Socket));
+    DerpNet_Close(net);
+
+    snprintf(address, sizeof(address), "127.0.0.1:%u", ClosedPort());
+    TEST_ASSERT_FALSE(DerpNet_Open(net, address, &secret));
+    TEST_ASSERT_EQUAL(1, net->ConnectFailures);
+
+    free(net);
+    DerpRelay_Stop(relay);
+}
+
+TEST(benchmark_connect_with_a_dead_first_address)
+{
+    Listener dead, good;
+    TEST_ASSERT_TRUE(Listener_Open(&dead, true));
+    TEST_ASSERT_TRUE(Listener_Open(&good, false));
+
+    // the old DerpNet_Open: blocking connect to the first address only, cut short here at 2 s
+    // (the kernel would keep retrying the SYN for about two minutes)
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval limit = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(dead.port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    uint64_t start = BuddyClock_NowUs();
+    int result = connect(fd, (struct sockaddr*)&address, sizeof(address));
+    uint64_t serial_us = BuddyClock_NowUs() - start;
+    close(fd);
+    TEST_ASSERT_TRUE(result != 0);
+
+    AddressList list;
+    uint16_t ports[2] = { dead.port, good.port };
+    static DerpNet net;
+    memset(&net, 0, sizeof(net));
+    const struct addrinfo* connected = NULL;
+    uintptr_t socket = DerpNet__Connect(&net, AddressList_Make(&list, ports, 2), &connected);
+    TEST_ASSERT_TRUE(socket != DERPNET_INVALID_SOCKET);
+    close((int)socket);
+    uint64_t race_us = net.ConnectUs;
+
+    uint16_t healthy[2] = { good.port, dead.port };
+    uint64_t healthy_us = 0;
+    for (int round = 0; round < 5; round++)
+    {
+        memset(&net, 0, sizeof(net));
+        socket = DerpNet__Connect(&net, AddressList_Make(&list, healthy, 2), &connected);
+        TEST_ASSERT_TRUE(socket != DERPNET_INVALID_SOCKET);
+        healthy_us += net.ConnectUs;
+        close((int)socket);
+    }
+
+    printf("\n    connect with the first address blackholed:\n");
+    printf("      first address only (old):    nothing after %8.1f ms\n", serial_us / 1000.0);
+    printf("      race, %u ms stagger:         connected in %8.1f ms\n", DERPNET_CONNECT_STAGGER_MS, race_us / 1000.0);
+    printf("      race, first address healthy: connected in %8.3f ms\n    ", healthy_us / 5 / 1000.0);
+
+    Listener_Close(&dead);
+    Listener_Close(&good);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Connect Race Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(families_alternate_starting_with_the_preferred_one);
+    RUN_TEST(first_address_connects_without_starting_others);
+    RUN_TEST(blackholed_first_address_loses_after_the_stagger);
+    RUN_TEST(refused_address_fails_over_without_waiting);
+    RUN_TEST(losing_attempts_are_closed);
+    RUN_TEST(all_addresses_dead_gives_up_at_the_timeout);
+    RUN_TEST(open_through_relay_records_connect_metrics);
+    RUN_TEST(benchmark_connect_with_a_dead_first_address);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,413 @@
+// Unit tests and benchmark for DerpNet counter nonces and the receive replay window
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+
+#define MOUSE_PACKET_SIZE 10       // sizeof(Buddy_MousePacket)
+#define NONCE_COUNT 100000
+
+static void MakeNonce(uint8_t nonce[24], uint8_t prefix, uint64_t counter)
+{
+    memset(nonce, prefix, 16);
+    Set64LE(nonce + 16, counter);
+}
+
+// check + update exactly like DerpNet_Recv does for an authenticated packet
+static bool Accept(DerpNetReplay* replay, uint8_t prefix, uint64_t counter)
+{
+    uint8_t nonce[24];
+    MakeNonce(nonce, prefix, counter);
+    if (!DerpNet__ReplayCheck(replay, nonce)) return false;
+    DerpNet__ReplayUpdate(replay, nonce);
+    return true;
+}
+
+static int CompareNonce(const void* a, const void* b)
+{
+    return memcmp(a, b, 24);
+}
+
+TEST(nonces_unique_within_and_across_sessions)
+{
+    DerpNet* net = calloc(2, sizeof(DerpNet));
+    uint8_t* nonces = malloc(2 * NONCE_COUNT * 24);
+
+    for (int n = 0; n < 2; n++)
+    {
+        for (size_t i = 0; i < NONCE_COUNT; i++)
+        {
+            DerpNet__NextNonce(&net[n], nonces + (n * NONCE_COUNT + i) * 24);
+        }
+    }
+
+    // one prefix per session, counter starts at 1 and counts up
+    TEST_ASSERT_TRUE(memcmp(nonces, nonces + (NONCE_COUNT - 1) * 24, 16) == 0);
+    TEST_ASSERT_EQUAL(1, Get64LE(nonces + 16));
+    TEST_ASSERT_EQUAL(NONCE_COUNT, Get64LE(nonces + (NONCE_COUNT - 1) * 24 + 16));
+    TEST_ASSERT_TRUE(memcmp(net[0].NoncePrefix, net[1].NoncePrefix, 16) != 0);
+
+    qsort(nonces, 2 * NONCE_COUNT, 24, CompareNonce);
+    size_t duplicates = 0;
+    for (size_t i = 1; i < 2 * NONCE_COUNT; i++)
+    {
+        if (memcmp(nonces + (i - 1) * 24, nonces + i * 24, 24) == 0) duplicates++;
+    }
+    TEST_ASSERT_EQUAL(0, duplicates);
+
+    // DerpNet_Open clears the counter, so a reconnect draws a new prefix
+    uint8_t before[16], nonce[24];
+    memcpy(before, net[0].NoncePrefix, 16);
+    net[0].NonceCounter = 0;
+    DerpNet__NextNonce(&net[0], nonce);
+    TEST_ASSERT_TRUE(memcmp(before, nonce, 16) != 0);
+    TEST_ASSERT_EQUAL(1, Get64LE(nonce + 16));
+
+    free(nonces);
+    free(net);
+}
+
+TEST(replay_window_accepts_once)
+{
+    DerpNetReplay replay;
+    memset(&replay, 0, sizeof(replay));
+
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 1));
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 2));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 2));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 1));
+
+    // gap, then the skipped counters arrive late, each only once
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 10));
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 5));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 5));
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 3));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 10));
+}
+
+TEST(replay_window_edges)
+{
+    DerpNetReplay replay;
+    memset(&replay, 0, sizeof(replay));
+
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 100));
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 100 - 63));   // oldest slot still in window
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 100 - 63));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 100 - 64));  // too old to tell, rejected
+
+    // moving by exactly 64 clears every old bit
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 164));
+    TEST_ASSERT_EQUAL(1, replay.Seen);
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 101));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 100));
+
+    // jump far ahead, then counters near 2^64
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 0xfffffffffffffff0ull));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 164));
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 0xffffffffffffffffull));
+    TEST_ASSERT_TRUE(Accept(&replay, 1, 0xfffffffffffffff1ull));
+    TEST_ASSERT_FALSE(Accept(&replay, 1, 0xfffffffffffffff0ull));
+}
+
+TEST(replay_window_new_prefix_waits_for_reset)
+{
+    DerpNet* net = calloc(1, sizeof(DerpNet));
+    DerpKey sender;
+    memset(sender.Bytes, 1, sizeof(sender.Bytes));
+    DerpNetReplay* replay = DerpNet__AddReplay(net, sender.Bytes);
+
+    TEST_ASSERT_TRUE(Accept(replay, 1, 500));
+    // sender reconnected: its counter starts from 1 again under a new prefix, taken only once the
+    // caller knows it came back
+    TEST_ASSERT_FALSE(Accept(replay, 2, 1));
+    DerpNet_ResetReplay(net, &sender);
+    TEST_ASSERT_TRUE(DerpNet__FindReplay(net, sender.Bytes) == replay);
+    TEST_ASSERT_TRUE(Accept(replay, 2, 1));
+    TEST_ASSERT_TRUE(Accept(replay, 2, 2));
+    TEST_ASSERT_FALSE(Accept(replay, 2, 1));
+    TEST_ASSERT_FALSE(Accept(replay, 1, 501));
+    TEST_ASSERT_EQUAL(2, replay->Highest);
+
+    free(net);
+}
+
+TEST(replay_window_never_switches_between_sessions)
+{
+    DerpNetReplay replay;
+    memset(&replay, 0, sizeof(replay));
+
+    // session 1 recorded by the relay, then session 2 under way after the sender came back
+    for (uint64_t counter = 1; counter <= 10; counter++)
+    {
+        TEST_ASSERT_TRUE(Accept(&replay, 1, counter));
+    }
+    memset(&replay, 0, sizeof(replay));
+    for (uint64_t counter = 1; counter <= 10; counter++)
+    {
+        TEST_ASSERT_TRUE(Accept(&replay, 2, counter));
+    }
+
+    // alternating a recorded earlier packet with replays of current ones gets nothing through
+    for (uint64_t counter = 1; counter <= 10; counter++)
+    {
+        TEST_ASSERT_FALSE(Accept(&replay, 1, counter));
+        TEST_ASSERT_FALSE(Accept(&replay, 2, counter));
+    }
+
+    // nor does a per-packet random nonce, its prefix is just another one
+    uint8_t nonce[24];
+    DerpNet__GetRandom(nonce, sizeof(nonce));
+    TEST_ASSERT_FALSE(DerpNet__ReplayCheck(&replay, nonce));
+
+    // the session itself goes on
+    TEST_ASSERT_TRUE(Accept(&replay, 2, 11));
+    TEST_ASSERT_FALSE(Accept(&replay, 3, 1));
+    TEST_ASSERT_TRUE(Accept(&replay, 2, 12));
+}
+
+TEST(replay_table_is_per_sender)
+{
+    DerpNet* net = calloc(1, sizeof(DerpNet));
+    uint8_t key[DERPNET_REPLAY_PEERS + 1][32];
+    for (int i = 0; i <= DERPNET_REPLAY_PEERS; i++)
+    {
+        memset(key[i], i + 1, 32);
+    }
+
+    // unknown senders are not added until a packet from them authenticates
+    TEST_ASSERT_TRUE(DerpNet__FindReplay(net, key[0]) == NULL);
+
+    DerpNetReplay* first = DerpNet__AddReplay(net, key[0]);
+    TEST_ASSERT_TRUE(Accept(first, 1, 7));
+    DerpNetReplay* second = DerpNet__AddReplay(net, key[1]);
+    TEST_ASSERT_TRUE(Accept(second, 1, 7));   // same nonce from another sender is fine
+    TEST_ASSERT_TRUE(DerpNet__FindReplay(net, key[0]) == first);
+    TEST_ASSERT_FALSE(Accept(DerpNet__FindReplay(net, key[0]), 1, 7));
+
+    // table is full after DERPNET_REPLAY_PEERS senders, the oldest entry is reused
+    for (int i = 2; i <= DERPNET_REPLAY_PEERS; i++)
+    {
+        DerpNet__AddReplay(net, key[i]);
+    }
+    TEST_ASSERT_TRUE(DerpNet__FindReplay(net, key[0]) == NULL);
+    TEST_ASSERT_TRUE(DerpNet__FindReplay(net, key[1]) == second);
+
+    free(net);
+}
+
+TEST(shared_keys_cached_per_peer)
+{
+    DerpKey secret;
+    DerpNet_CreateNewKey(&secret);
+    DerpNet* net = calloc(1, sizeof(DerpNet));
+    memcpy(net->UserPrivateKey, secret.Bytes, 32);
+
+    DerpKey peer[DERPNET_SHARED_KEYS + 1];
+    for (int i = 0; i <= DERPNET_SHARED_KEYS; i++)
+    {
+        DerpKey peer_secret;
+        DerpNet_CreateNewKey(&peer_secret);
+        DerpNet_GetPublicKey(&peer_secret, &peer[i]);
+    }
+
+    // sealing for every viewer in turn computes each key once
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < DERPNET_SHARED_KEYS; i++)
+        {
+            uint8_t expected[32];
+            DerpNet__GetSharedKey(expected, secret.Bytes, peer[i].Bytes);
+            TEST_ASSERT_TRUE(memcmp(DerpNet__SharedKey(net, &peer[i]), expected, 32) == 0);
+        }
+    }
+    TEST_ASSERT_EQUAL(DERPNET_SHARED_KEYS, net->SharedKeyMisses);
+
+    // one more peer replaces the least recently used one
+    DerpNet__SharedKey(net, &peer[1]);
+    DerpNet__SharedKey(net, &peer[DERPNET_SHARED_KEYS]);
+    TEST_ASSERT_EQUAL(DERPNET_SHARED_KEYS + 1, net->SharedKeyMisses);
+    TEST_ASSERT_TRUE(DerpNet__FindSharedKey(net, peer[0].Bytes) == NULL);
+    TEST_ASSERT_TRUE(DerpNet__FindSharedKey(net, peer[1].Bytes) != NULL);
+
+    free(net);
+}
+
+TEST(replayed_frames_dropped_over_loopback)
+{
+    DerpKey secret_a, secret_b, public_a, public_b;
+    DerpNet_CreateNewKey(&secret_a);
+    DerpNet_CreateNewKey(&secret_b);
+    DerpNet_GetPublicKey(&secret_a, &public_a);
+    DerpNet_GetPublicKey(&secret_b, &public_b);
+
+    DerpNet* a = malloc(sizeof(DerpNet));
+    DerpNet* b = malloc(sizeof(DerpNet));
+    DerpLoopback loop;
+    TEST_ASSERT_TRUE(DerpLoopback_Start(&loop, a, &secret_a, b, &secret_b));
+
+    uint8_t shared[32];
+    DerpNet__GetSharedKey(shared, secret_a.Bytes, public_b.Bytes);
+
+    // the relay resending a captured frame looks like the same nonce arriving twice
+    uint8_t nonce[24];
+    DerpNet__NextNonce(a, nonce);
+    uint8_t packet[MOUSE_PACKET_SIZE] = { 1 };
+    TEST_ASSERT_TRUE(DerpNet_SendEx(a, &public_b, shared, nonce, packet, sizeof(packet)));
+    TEST_ASSERT_TRUE(DerpNet_SendEx(a, &public_b, shared, nonce, packet, sizeof(packet)));
+    packet[0] = 2;
+    TEST_ASSERT_TRUE(DerpNet_Send(a, &public_b, packet, sizeof(packet)));
+
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(1, data[0]);
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(2, data[0]);
+    TEST_ASSERT_EQUAL(1, b->ReplayDrops);
+    TEST_ASSERT_TRUE(memcmp(from.Bytes, public_a.Bytes, 32) == 0);
+
+    // a forged frame with a future counter does not authenticate and must not move the window
+    uint8_t future[24];
+    memcpy(future, a->NoncePrefix, 16);
+    Set64LE(future + 16, a->NonceCounter + 1000);
+    uint8_t wrong_key[32] = { 0 };
+    TEST_ASSERT_TRUE(DerpNet_SendEx(a, &public_b, wrong_key, future, packet, sizeof(packet)));
+    packet[0] = 3;
+    TEST_ASSERT_TRUE(DerpNet_Send(a, &public_b, packet, sizeof(packet)));
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(3, data[0]);
+    TEST_ASSERT_EQUAL(1, b->ReplayDrops);
+
+    // a new session of the sender is noticed but dropped, until the receiver resets its entry
+    a->NonceCounter = 0;
+    packet[0] = 4;
+    TEST_ASSERT_TRUE(DerpNet_Send(a, &public_b, packet, sizeof(packet)));
+    uint64_t start = BuddyClock_NowUs();
+    while (b->SessionChanges == 0 && BuddyClock_NowUs() - start < 2000000)
+    {
+        TEST_ASSERT_EQUAL(0, DerpNet_Recv(b, &from, &data, &size, false));
+        BuddyThread_Sleep(1);
+    }
+    TEST_ASSERT_EQUAL(1, b->SessionChanges);
+    TEST_ASSERT_EQUAL(2, b->ReplayDrops);
+    TEST_ASSERT_TRUE(memcmp(b->LastSessionChange, public_a.Bytes, 32) == 0);
+
+    DerpNet_ResetReplay(b, &public_a);
+    packet[0] = 5;
+    TEST_ASSERT_TRUE(DerpNet_Send(a, &public_b, packet, sizeof(packet)));
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(5, data[0]);
+
+    DerpLoopback_Stop(&loop);
+    free(a);
+    free(b);
+}
+
+typedef struct {
+    double ns_per_packet;
+    double nonce_ns;
+} BenchResult;
+
+// Seals mouse-sized packets into the send queue the way DerpNet_QueueV does, with either
+// the old per-packet OS random nonce or the counter nonce. Queue is reset instead of written
+// so only the CPU cost of the send path is measured.
+static BenchResult RunBenchmark(bool counter, uint32_t packets)
+{
+    DerpKey secret, peer_secret, peer;
+    DerpNet_CreateNewKey(&secret);
+    DerpNet_CreateNewKey(&peer_secret);
+    DerpNet_GetPublicKey(&peer_secret, &peer);
+
+    DerpNet* net = calloc(1, sizeof(DerpNet));
+    memcpy(net->UserPrivateKey, secret.Bytes, 32);
+    const uint8_t* shared_key = DerpNet__SharedKey(net, &peer);
+
+    uint8_t packet[MOUSE_PACKET_SIZE] = { 0 };
+    DerpNetIoVec iov = { packet, sizeof(packet) };
+    uint8_t nonce[24];
+
+    uint64_t start = BuddyClock_NowUs();
+    for (uint32_t i = 0; i < packets; i++)
+    {
+        if (counter)
+        {
+            DerpNet__NextNonce(net, nonce);
+        }
+        else
+        {
+            DerpNet__GetRandom(nonce, sizeof(nonce));
+        }
+        DerpNet__QueueFrame(net, &peer, shared_key, nonce, &iov, 1);
+        if (net->SendQueueSize > sizeof(net->SendQueue) / 2) net->SendQueueSize = 0;
+    }
+    uint64_t total_us = BuddyClock_NowUs() - start;
+
+    start = BuddyClock_NowUs();
+    for (uint32_t i = 0; i < packets; i++)
+    {
+        if (counter)
+        {
+            DerpNet__NextNonce(net, nonce);
+        }
+        else
+        {
+            DerpNet__GetRandom(nonce, sizeof(nonce));
+        }
+    }
+    uint64_t nonce_us = BuddyClock_NowUs() - start;
+
+    BenchResult result;
+    result.ns_per_packet = total_us * 1000.0 / packets;
+    result.nonce_ns = nonce_us * 1000.0 / packets;
+    free(net);
+    return result;
+}
+
+TEST(benchmark_send_path_nonce)
+{
+    uint32_t packets = 200000;
+    BenchResult random_nonce = RunBenchmark(false, packets);
+    BenchResult counter_nonce = RunBenchmark(true, packets);
+
+    printf("\n    %-24s %14s %14s\n", "nonce", "ns/packet", "nonce ns");
+    printf("    %-24s %14.1f %14.1f\n", "OS random per packet", random_nonce.ns_per_packet, random_nonce.nonce_ns);
+    printf("    %-24s %14.1f %14.1f\n", "prefix + counter", counter_nonce.ns_per_packet, counter_nonce.nonce_ns);
+    printf("    (10-byte mouse packets sealed into the send queue, no socket writes)\n    ");
+
+    TEST_ASSERT_TRUE(counter_nonce.nonce_ns < random_nonce.nonce_ns);
+    TEST_ASSERT_TRUE(counter_nonce.ns_per_packet < random_nonce.ns_per_packet);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Nonce and Replay Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(nonces_unique_within_and_across_sessions);
+    RUN_TEST(replay_window_accepts_once);
+    RUN_TEST(replay_window_edges);
+    RUN_TEST(replay_window_new_prefix_waits_for_reset);
+    RUN_TEST(replay_window_never_switches_between_sessions);
+    RUN_TEST(replay_table_is_per_sender);
+    RUN_TEST(shared_keys_cached_per_peer);
+    RUN_TEST(replayed_frames_dropped_over_loopback);
+    RUN_TEST(benchmark_send_path_nonce);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,33 @@
+@echo off
+setlocal
+
+for /f "usebackq tokens=*" %%i in (`"%ProgramFiles(x86)%\Microsoft Visual Studio\Installer\vswhere.exe" -latest -products * -requires Microsoft.VisualStudio.Component.VC.Tools.x86.x64 -property installationPath`) do (
+  set VSINSTALLPATH=%%i
+)
+
+if not defined VSINSTALLPATH (
+  echo Error: Visual Studio not found
+  exit /b 1
+)
+
+call "%VSINSTALLPATH%\VC\Auxiliary\Build\vcvarsall.bat" x64 >nul 2>&1
+
+echo Building DerpNet Nonce and Replay Tests...
+pushd "%~dp0"
+
+cl.exe /nologo /W3 /O2 /I .. /I ..\src\utils test_derpnet_nonce.c /Fe:test_derpnet_nonce.exe /link /SUBSYSTEM:CONSOLE
+
+if %ERRORLEVEL% NEQ 0 (
+  echo Build failed!
+  popd
+  exit /b 1
+)
+
+echo.
+echo Running DerpNet nonce and replay tests...
+echo.
+test_derpnet_nonce.exe
+set RESULT=%ERRORLEVEL%
+del test_derpnet_nonce.obj >nul 2>&1
+popd
+exit /b %RESULT%
@@ -0,0 +1,260 @@
+// Tests and benchmark for DerpNet_Open/Send/Recv on the POSIX socket layer against a local relay
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // local relay speaks plain HTTP, like the Docker derper on 8080
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "latency.h"
+
+#define MOUSE_PACKET_SIZE 10       // sizeof(Buddy_MousePacket)
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define THROUGHPUT_BYTES (256u << 20)
+#define PING_COUNT 5000
+
+typedef struct {
+    DerpRelay* relay;
+    char address[32];          // "127.0.0.1:port" for DerpNet_Open
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];
+} Session;
+
+static bool Session_Open(Session* session)
+{
+    // the bulk benchmark counts every byte, so the relay must never drop for a receiver that is
+    // briefly behind (on a single CPU it can fall several MB back while the sender has the core)
+    DerpRelayConfig config = { .threads = 2, .max_queue = THROUGHPUT_BYTES };
+    session->relay = DerpRelay_Start(&config);
+    if (!session->relay) return false;
+    snprintf(session->address, sizeof(session->address), "127.0.0.1:%u", DerpRelay_GetPort(session->relay));
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&session->secret[i]);
+        DerpNet_GetPublicKey(&session->secret[i], &session->public_key[i]);
+        session->net[i] = malloc(sizeof(DerpNet));
+        if (!DerpNet_Open(session->net[i], session->address, &session->secret[i])) return false;
+    }
+    return true;
+}
+
+static void Session_Close(Session* session)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_Close(session->net[i]);
+        free(session->net[i]);
+    }
+    DerpRelay_Stop(session->relay);
+}
+
+TEST(open_send_recv_through_relay)
+{
+    Session session;
+    TEST_ASSERT_TRUE(Session_Open(&session));
+    DerpNet* a = session.net[0];
+    DerpNet* b = session.net[1];
+
+    uint8_t hello[] = "hello";
+    TEST_ASSERT_TRUE(DerpNet_Send(a, &session.public_key[1], hello, sizeof(hello)));
+
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(sizeof(hello), size);
+    TEST_ASSERT_TRUE(memcmp(data, hello, sizeof(hello)) == 0);
+    TEST_ASSERT_TRUE(memcmp(from.Bytes, session.public_key[0].Bytes, 32) == 0);
+
+    // nothing pending, non-blocking Recv returns 0
+    TEST_ASSERT_EQUAL(0, DerpNet_Recv(b, &from, &data, &size, false));
+
+    // max size payload both ways
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    for (size_t i = 0; i < VIDEO_CHUNK_SIZE; i++) chunk[i] = (uint8_t)(i * 7);
+    TEST_ASSERT_TRUE(DerpNet_Send(b, &session.public_key[0], chunk, VIDEO_CHUNK_SIZE));
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(a, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(VIDEO_CHUNK_SIZE, size);
+    TEST_ASSERT_TRUE(memcmp(data, chunk, VIDEO_CHUNK_SIZE) == 0);
+    free(chunk);
+
+    Session_Close(&session);
+}
+
+TEST(open_fails_without_server)
+{
+    // bind a port and close it again, nothing listens there afterwards
+    DerpRelayConfig config = { 0 };
+    DerpRelay* relay = DerpRelay_Start(&config);
+    TEST_ASSERT_NOT_NULL(relay);
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", DerpRelay_GetPort(relay));
+    DerpRelay_Stop(relay);
+
+    DerpKey secret;
+    DerpNet_CreateNewKey(&secret);
+    DerpNet* net = malloc(sizeof(DerpNet));
+    TEST_ASSERT_FALSE(DerpNet_Open(net, address, &secret));
+    TEST_ASSERT_TRUE(net->Socket == DERPNET_INVALID_SOCKET);
+    free(net);
+}
+
+#if defined(__linux__)
+TEST(event_fd_signals_incoming_data)
+{
+    Session session;
+    TEST_ASSERT_TRUE(Session_Open(&session));
+    DerpNet* b = session.net[1];
+    TEST_ASSERT_TRUE(b->EventFd >= 0);
+
+    // consume the initial writable edge
+    struct epoll_event events[4];
+    epoll_wait(b->EventFd, events, 4, 0);
+    TEST_ASSERT_EQUAL(0, epoll_wait(b->EventFd, events, 4, 0));
+
+    uint8_t packet[MOUSE_PACKET_SIZE] = { 42 };
+    TEST_ASSERT_TRUE(DerpNet_Send(session.net[0], &session.public_key[1], packet, sizeof(packet)));
+
+    TEST_ASSERT_EQUAL(1, epoll_wait(b->EventFd, events, 4, 5000));
+    TEST_ASSERT_TRUE(events[0].events & EPOLLIN);
+
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &data, &size, false));
+    TEST_ASSERT_EQUAL(42, data[0]);
+
+    Session_Close(&session);
+}
+#endif
+
+typedef struct {
+    DerpNet* net;
+    size_t expected;
+    size_t received;
+} Drain;
+
+static void Drain_Run(void* arg)
+{
+    Drain* drain = arg;
+    while (drain->received < drain->expected)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(drain->net, &from, &data, &size, true) < 0) break;
+        drain->received += size;
+    }
+}
+
+typedef struct {
+    DerpNet* net;
+    const DerpKey* peer;
+    uint32_t count;
+} Echo;
+
+static void Echo_Run(void* arg)
+{
+    Echo* echo = arg;
+    for (uint32_t i = 0; i < echo->count; i++)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(echo->net, &from, &data, &size, true) < 0) break;
+        if (!DerpNet_Send(echo->net, echo->peer, data, size)) break;
+    }
+}
+
+TEST(benchmark_relay_throughput_and_latency)
+{
+    Session session;
+    TEST_ASSERT_TRUE(Session_Open(&session));
+    DerpNet* a = session.net[0];
+    DerpNet* b = session.net[1];
+
+    // one-way bulk: video sized chunks, queued and flushed in groups like a keyframe
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x5a, VIDEO_CHUNK_SIZE);
+    size_t chunks = THROUGHPUT_BYTES / VIDEO_CHUNK_SIZE;
+
+    Drain drain = { .net = b, .expected = chunks * VIDEO_CHUNK_SIZE };
+    BuddyThread thread;
+    BuddyThread_Start(&thread, Drain_Run, &drain);
+
+    uint64_t start = BuddyClock_NowUs();
+    for (size_t i = 0; i < chunks; i++)
+    {
+        DerpNet_Queue(a, &session.public_key[1], chunk, VIDEO_CHUNK_SIZE);
+        if (i % 4 == 3) DerpNet_Flush(a);
+    }
+    DerpNet_Flush(a);
+    BuddyThread_Join(thread);
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    double mb_per_sec = drain.received / (1024.0 * 1024.0) / (seconds > 0 ? seconds : 1e-6);
+    free(chunk);
+
+    // round trip of mouse sized packets, b echoes every packet back to a
+    Echo echo = { .net = b, .peer = &session.public_key[0], .count = PING_COUNT };
+    BuddyThread_Start(&thread, Echo_Run, &echo);
+
+    LatencyStats* stats = calloc(1, sizeof(LatencyStats));
+    uint8_t packet[MOUSE_PACKET_SIZE] = { 0 };
+    uint32_t returned = 0;
+    for (uint32_t i = 0; i < PING_COUNT; i++)
+    {
+        uint64_t sent = BuddyClock_NowUs();
+        if (!DerpNet_Send(a, &session.public_key[1], packet, sizeof(packet))) break;
+
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(a, &from, &data, &size, true) < 0) break;
+        Latency_StatsAdd(stats, (int64_t)(BuddyClock_NowUs() - sent));
+        returned++;
+    }
+    BuddyThread_Join(thread);
+
+    LatencySummary summary;
+    Latency_StatsSummary(stats, &summary);
+    free(stats);
+
+    printf("\n    %-32s %10.1f MB/s\n", "relay throughput (65000 B chunks)", mb_per_sec);
+    printf("    %-32s %7lld / %lld / %lld us (p50/p95/p99, %u packets)\n", "round trip (10 B packets)",
+        (long long)summary.p50_us, (long long)summary.p95_us, (long long)summary.p99_us, returned);
+    printf("    ");
+
+    TEST_ASSERT_EQUAL(chunks * VIDEO_CHUNK_SIZE, drain.received);
+    TEST_ASSERT_EQUAL(PING_COUNT, returned);
+
+    Session_Close(&session);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet POSIX Transport Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(open_send_recv_through_relay);
+    RUN_TEST(open_fails_without_server);
+#if defined(__linux__)
+    RUN_TEST(event_fd_signals_incoming_data);
+#endif
+    RUN_TEST(benchmark_relay_throughput_and_latency);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,473 @@
+// Unit tests and input latency benchmark for urgent messages in the DerpNet send queue
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define SEND_BUDGET (384 * 1024)   // BUDDY_SEND_BUDGET
+#define INPUT_SIZE 16              // Buddy_MousePacket
+#define URGENT_SEQUENCE 0x80000000u
+#define STOP_SEQUENCE 0xffffffffu
+#define MAX_RECORDED 4096
+
+typedef struct {
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];
+    DerpLoopback loop;
+} Pair;
+
+static bool Pair_Start(Pair* pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&pair->secret[i]);
+        DerpNet_GetPublicKey(&pair->secret[i], &pair->public_key[i]);
+        pair->net[i] = malloc(sizeof(DerpNet));
+    }
+    return DerpLoopback_Start(&pair->loop, pair->net[0], &pair->secret[0], pair->net[1], &pair->secret[1]);
+}
+
+static void Pair_Stop(Pair* pair)
+{
+    DerpLoopback_Stop(&pair->loop);
+    free(pair->net[0]);
+    free(pair->net[1]);
+}
+
+// Peer that records the order packets arrive in, and for urgent packets how long they took.
+// Sleeps delay_ms after every large packet, like a viewer behind a slow link.
+typedef struct {
+    DerpNet* net;
+    uint32_t delay_ms;
+    volatile bool paused;
+    uint32_t count;
+    uint32_t order[MAX_RECORDED];
+    uint32_t urgent_count;
+    double urgent_ms[MAX_RECORDED];
+    BuddyThread thread;
+} Receiver;
+
+static void Receiver_Run(void* arg)
+{
+    Receiver* rx = arg;
+    for (;;)
+    {
+        while (rx->paused) BuddyThread_Sleep(1);
+
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(rx->net, &from, &data, &size, true) != 1) break;
+
+        uint32_t sequence;
+        memcpy(&sequence, data, sizeof(sequence));
+        if (sequence == STOP_SEQUENCE) break;
+        if (rx->count < MAX_RECORDED) rx->order[rx->count] = sequence;
+        rx->count++;
+
+        if (sequence & URGENT_SEQUENCE)
+        {
+            uint64_t sent_us;
+            memcpy(&sent_us, data + 4, sizeof(sent_us));
+            if (rx->urgent_count < MAX_RECORDED) rx->urgent_ms[rx->urgent_count++] = (BuddyClock_NowUs() - sent_us) / 1000.0;
+        }
+        else if (rx->delay_ms && size > INPUT_SIZE)
+        {
+            BuddyThread_Sleep(rx->delay_ms);
+        }
+    }
+}
+
+static void Receiver_Start(Receiver* rx, DerpNet* net, uint32_t delay_ms, bool paused)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->net = net;
+    rx->delay_ms = delay_ms;
+    rx->paused = paused;
+    BuddyThread_Start(&rx->thread, Receiver_Run, rx);
+}
+
+static void Receiver_Finish(Receiver* rx, Pair* pair)
+{
+    uint32_t stop = STOP_SEQUENCE;
+    DerpNet_Send(pair->net[0], &pair->public_key[1], &stop, sizeof(stop));
+    BuddyThread_Join(rx->thread);
+}
+
+// Waits in select like the event loop does on FD_WRITE, then lets DerpNet write what it can
+static bool DrainQueue(DerpNet* net)
+{
+    while (DerpNet_GetQueuedBytes(net) != 0)
+    {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(net->Socket, &set);
+        if (select((int)(net->Socket + 1), NULL, &set, NULL, NULL) < 0) return false;
+        if (!DerpNet_OnWritable(net)) return false;
+    }
+    return true;
+}
+
+static void MakeInput(uint8_t packet[INPUT_SIZE], uint32_t sequence)
+{
+    uint64_t now = BuddyClock_NowUs();
+    memset(packet, 0, INPUT_SIZE);
+    memcpy(packet, &sequence, sizeof(sequence));
+    memcpy(packet + 4, &now, sizeof(now));
+}
+
+static uint32_t FindSequence(const Receiver* rx, uint32_t sequence)
+{
+    for (uint32_t i = 0; i < rx->count && i < MAX_RECORDED; i++)
+    {
+        if (rx->order[i] == sequence) return i;
+    }
+    return UINT32_MAX;
+}
+
+TEST(urgent_goes_ahead_of_queued_video)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+    DerpNet_SetSendBudget(net, SEND_BUDGET);
+
+    // peer is not reading, socket buffers fill up and the rest stays in the send queue
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 0, true);
+
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x5a, VIDEO_CHUNK_SIZE);
+    uint32_t chunks = 0;
+    for (;;)
+    {
+        memcpy(chunk, &chunks, sizeof(chunks));
+        if (DerpNet_TrySend(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE) != DERPNET_SEND_QUEUED) break;
+        chunks++;
+    }
+    // queued chunks that have not started going out, the one partially written stays in front
+    uint32_t waiting = (uint32_t)(DerpNet_GetQueuedBytes(net) / (DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE));
+    TEST_ASSERT_TRUE(waiting >= 2);
+
+    uint8_t input[INPUT_SIZE];
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        MakeInput(input, URGENT_SEQUENCE | i);
+        TEST_ASSERT_TRUE(DerpNet_QueueUrgent(net, &pair.public_key[1], input, sizeof(input)));
+    }
+
+    rx.paused = false;
+    TEST_ASSERT_TRUE(DrainQueue(net));
+    Receiver_Finish(&rx, &pair);
+
+    // everything arrives once, urgent messages keep their own order and skip the waiting chunks
+    TEST_ASSERT_EQUAL(chunks + 3, rx.count);
+    TEST_ASSERT_EQUAL(0, pair.net[1]->ReplayDrops);
+    uint32_t first = FindSequence(&rx, URGENT_SEQUENCE);
+    TEST_ASSERT_TRUE(first <= chunks - waiting);
+    TEST_ASSERT_EQUAL(first + 1, FindSequence(&rx, URGENT_SEQUENCE | 1));
+    TEST_ASSERT_EQUAL(first + 2, FindSequence(&rx, URGENT_SEQUENCE | 2));
+
+    // chunks themselves stay in order around them
+    uint32_t expected = 0;
+    for (uint32_t i = 0; i < rx.count; i++)
+    {
+        if (rx.order[i] & URGENT_SEQUENCE) continue;
+        TEST_ASSERT_EQUAL(expected, rx.order[i]);
+        expected++;
+    }
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+TEST(urgent_keeps_frames_whole_across_compaction)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 0, true);
+
+    // odd chunk sizes, so the socket stops in the middle of a frame and compaction moves the queue
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x33, VIDEO_CHUNK_SIZE);
+    uint32_t sent = 0, urgent = 0;
+    uint8_t input[INPUT_SIZE];
+    for (uint32_t round = 0; round < 200; round++)
+    {
+        for (uint32_t i = 0; i < 3; i++)
+        {
+            memcpy(chunk, &sent, sizeof(sent));
+            TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], chunk, 20000 + 7919 * ((round + i) % 5)));
+            sent++;
+        }
+        MakeInput(input, URGENT_SEQUENCE | urgent++);
+        TEST_ASSERT_TRUE(DerpNet_SendUrgent(net, &pair.public_key[1], input, sizeof(input)));
+        if (round == 5) rx.paused = false;
+    }
+    TEST_ASSERT_TRUE(DrainQueue(net));
+    Receiver_Finish(&rx, &pair);
+
+    TEST_ASSERT_EQUAL(sent + urgent, rx.count);
+    TEST_ASSERT_EQUAL(0, pair.net[1]->ReplayDrops);
+    uint32_t next_chunk = 0, next_urgent = 0;
+    for (uint32_t i = 0; i < rx.count; i++)
+    {
+        if (rx.order[i] & URGENT_SEQUENCE) TEST_ASSERT_EQUAL(URGENT_SEQUENCE | next_urgent++, rx.order[i]);
+        else TEST_ASSERT_EQUAL(next_chunk++, rx.order[i]);
+    }
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+TEST(paced_writes_hold_back_everything_but_urgent)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 0, false);
+
+    // no allowance: queued chunks stay queued
+    const uint32_t chunks = 4;
+    const size_t frame = DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE;
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x77, VIDEO_CHUNK_SIZE);
+    DerpNet_SetSendAllowance(net, 0);
+    for (uint32_t i = 0; i < chunks; i++)
+    {
+        memcpy(chunk, &i, sizeof(i));
+        TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE));
+    }
+    TEST_ASSERT_TRUE(DerpNet_OnWritable(net));
+    TEST_ASSERT_EQUAL(0, net->TotalSent);
+    TEST_ASSERT_EQUAL(chunks * frame, DerpNet_GetQueuedBytes(net));
+
+    // urgent frames go out anyway and use none of it
+    uint8_t input[INPUT_SIZE];
+    MakeInput(input, URGENT_SEQUENCE);
+    TEST_ASSERT_TRUE(DerpNet_SendUrgent(net, &pair.public_key[1], input, sizeof(input)));
+    TEST_ASSERT_EQUAL(DERPNET_FRAME_OVERHEAD + INPUT_SIZE, net->TotalSent);
+    TEST_ASSERT_EQUAL(0, net->SendAllowance);
+
+    // one and a half chunks of allowance write at most that much, stopping inside a frame
+    size_t allowance = frame + frame / 2;
+    size_t before = net->TotalSent;
+    DerpNet_SetSendAllowance(net, allowance);
+    TEST_ASSERT_TRUE(DerpNet_OnWritable(net));
+    TEST_ASSERT_TRUE(net->TotalSent - before <= allowance);
+    TEST_ASSERT_EQUAL(allowance - net->SendAllowance, net->TotalSent - before);
+    TEST_ASSERT_TRUE(DerpNet_GetQueuedBytes(net) >= chunks * frame - allowance);
+
+    DerpNet_SetSendAllowance(net, DERPNET_UNPACED);
+    TEST_ASSERT_TRUE(DrainQueue(net));
+    Receiver_Finish(&rx, &pair);
+
+    TEST_ASSERT_EQUAL(chunks + 1, rx.count);
+    TEST_ASSERT_EQUAL(0, pair.net[1]->ReplayDrops);
+    TEST_ASSERT_EQUAL(URGENT_SEQUENCE, rx.order[0]);
+    for (uint32_t i = 0; i < chunks; i++)
+    {
+        TEST_ASSERT_EQUAL(i, rx.order[1 + i]);
+    }
+
+    free(chunk);
+    Pair_Stop(&pair);
+}
+
+TEST(urgent_stays_inside_replay_window)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 0, true);
+
+    // small frames only, none of them is written before the urgent one is queued
+    uint8_t packet[100] = { 0 };
+    uint32_t count = 200;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        memcpy(packet, &i, sizeof(i));
+        TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], packet, sizeof(packet)));
+    }
+    uint8_t input[INPUT_SIZE];
+    MakeInput(input, URGENT_SEQUENCE);
+    TEST_ASSERT_TRUE(DerpNet_QueueUrgent(net, &pair.public_key[1], input, sizeof(input)));
+
+    rx.paused = false;
+    TEST_ASSERT_TRUE(DerpNet_Flush(net));
+    Receiver_Finish(&rx, &pair);
+
+    // it overtakes only the frames with recent counters, none of them is dropped as too old
+    TEST_ASSERT_EQUAL(count + 1, rx.count);
+    TEST_ASSERT_EQUAL(0, pair.net[1]->ReplayDrops);
+    TEST_ASSERT_EQUAL(count - DERPNET_URGENT_MAX_OVERTAKE, FindSequence(&rx, URGENT_SEQUENCE));
+
+    Pair_Stop(&pair);
+}
+
+TEST(urgent_never_overtakes_caller_nonces)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    DerpNet* net = pair.net[0];
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 0, true);
+
+    uint8_t packet[100] = { 0 };
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        memcpy(packet, &i, sizeof(i));
+        TEST_ASSERT_TRUE(DerpNet_Queue(net, &pair.public_key[1], packet, sizeof(packet)));
+    }
+
+    // sealed outside with a nonce of the caller's choosing, its place in the window is unknown;
+    // a random one is not under the sender's prefix, so the receiver drops it as another session
+    uint8_t shared_key[32], nonce[24];
+    DerpNet_PrepareSeal(net, &pair.public_key[1], shared_key, nonce);
+    DerpNet__GetRandom(nonce, sizeof(nonce));
+    uint32_t sequence = 4;
+    memcpy(packet, &sequence, sizeof(sequence));
+    uint8_t frame[DERPNET_FRAME_OVERHEAD + sizeof(packet)];
+    DerpNetIoVec iov = { packet, sizeof(packet) };
+    size_t frame_size = DerpNet_SealFrameV(frame, &pair.public_key[1], shared_key, nonce, &iov, 1);
+    TEST_ASSERT_TRUE(DerpNet_QueueSealed(net, frame, frame_size));
+
+    uint8_t input[INPUT_SIZE];
+    MakeInput(input, URGENT_SEQUENCE);
+    size_t queued = net->SendQueueSize;
+    TEST_ASSERT_TRUE(DerpNet_QueueUrgent(net, &pair.public_key[1], input, sizeof(input)));
+    TEST_ASSERT_EQUAL(queued + DERPNET_FRAME_OVERHEAD + sizeof(input), net->SendUrgentEnd);
+
+    rx.paused = false;
+    TEST_ASSERT_TRUE(DerpNet_Flush(net));
+    Receiver_Finish(&rx, &pair);
+
+    TEST_ASSERT_EQUAL(5, rx.count);
+    TEST_ASSERT_EQUAL(4, FindSequence(&rx, URGENT_SEQUENCE));
+    TEST_ASSERT_EQUAL(1, pair.net[1]->ReplayDrops);
+    TEST_ASSERT_EQUAL(1, pair.net[1]->SessionChanges);
+
+    Pair_Stop(&pair);
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    double p50_ms;
+    double p99_ms;
+    double video_mb_per_sec;
+} BenchResult;
+
+// Sharer loop keeps the send queue at the budget with video chunks while the peer drains about
+// 30 MB/s, and sends a small input/control packet every 10 ms. The blocking path waits for the
+// whole video backlog, the urgent path only for the chunk on the wire and the socket buffers.
+static BenchResult RunBenchmark(bool urgent)
+{
+    Pair pair;
+    Pair_Start(&pair);
+    DerpNet* net = pair.net[0];
+    DerpNet_SetSendBudget(net, SEND_BUDGET);
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], 2, false);
+
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x5a, VIDEO_CHUNK_SIZE);
+
+    uint32_t sequence = 0, inputs = 0;
+    uint64_t start = BuddyClock_NowUs();
+    uint64_t next_input = start + 10 * 1000;
+    while (inputs < 100)
+    {
+        DerpNet_OnWritable(net);
+        memcpy(chunk, &sequence, sizeof(sequence));
+        while (DerpNet_TrySend(net, &pair.public_key[1], chunk, VIDEO_CHUNK_SIZE) == DERPNET_SEND_QUEUED)
+        {
+            sequence++;
+            memcpy(chunk, &sequence, sizeof(sequence));
+        }
+
+        if (BuddyClock_NowUs() >= next_input)
+        {
+            uint8_t input[INPUT_SIZE];
+            MakeInput(input, URGENT_SEQUENCE | inputs++);
+            if (urgent) DerpNet_SendUrgent(net, &pair.public_key[1], input, sizeof(input));
+            else DerpNet_Send(net, &pair.public_key[1], input, sizeof(input));
+            next_input += 10 * 1000;
+        }
+        BuddyThread_Sleep(1);
+    }
+    DrainQueue(net);
+    Receiver_Finish(&rx, &pair);
+
+    BenchResult result = { 0 };
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    result.video_mb_per_sec = (double)(rx.count - rx.urgent_count) * VIDEO_CHUNK_SIZE / (1024.0 * 1024.0) / seconds;
+    qsort(rx.urgent_ms, rx.urgent_count, sizeof(double), CompareDouble);
+    if (rx.urgent_count)
+    {
+        result.p50_ms = rx.urgent_ms[rx.urgent_count / 2];
+        result.p99_ms = rx.urgent_ms[(rx.urgent_count * 99) / 100];
+    }
+
+    free(chunk);
+    Pair_Stop(&pair);
+    return result;
+}
+
+TEST(benchmark_input_latency_under_video_load)
+{
+    BenchResult blocking = RunBenchmark(false);
+    BenchResult urgent = RunBenchmark(true);
+
+    printf("\n    %-22s %10s %10s %10s\n", "input sent with", "p50 (ms)", "p99 (ms)", "video MB/s");
+    printf("    %-22s %10.1f %10.1f %10.2f\n", "DerpNet_Send", blocking.p50_ms, blocking.p99_ms, blocking.video_mb_per_sec);
+    printf("    %-22s %10.1f %10.1f %10.2f\n", "DerpNet_SendUrgent", urgent.p50_ms, urgent.p99_ms, urgent.video_mb_per_sec);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(urgent.p50_ms < blocking.p50_ms);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Urgent Send Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(urgent_goes_ahead_of_queued_video);
+    RUN_TEST(urgent_keeps_frames_whole_across_compaction);
+    RUN_TEST(paced_writes_hold_back_everything_but_urgent);
+    RUN_TEST(urgent_stays_inside_replay_window);
+    RUN_TEST(urgent_never_overtakes_caller_nonces);
+    RUN_TEST(benchmark_input_latency_under_video_load);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,313 @@
+// Unit tests and move benchmark for the DerpNet receive buffer (consume without memmove)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+
+#define FRAME_OVERHEAD (1 + 4 + 32 + 24 + 16)
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define MAX_PACKET_SIZE ((1 << 16) - FRAME_OVERHEAD)
+
+typedef struct {
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];
+    DerpLoopback loop;
+} Pair;
+
+static bool Pair_Start(Pair* pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&pair->secret[i]);
+        DerpNet_GetPublicKey(&pair->secret[i], &pair->public_key[i]);
+        pair->net[i] = malloc(sizeof(DerpNet));
+    }
+    return DerpLoopback_Start(&pair->loop, pair->net[0], &pair->secret[0], pair->net[1], &pair->secret[1]);
+}
+
+static void Pair_Stop(Pair* pair)
+{
+    DerpLoopback_Stop(&pair->loop);
+    free(pair->net[0]);
+    free(pair->net[1]);
+}
+
+// Packet sizes cycle through a mix of input, video and file sized payloads
+static size_t PacketSize(const size_t* sizes, size_t count, uint32_t sequence)
+{
+    return sizes[sequence % count];
+}
+
+static void MakePacket(uint8_t* packet, size_t size, uint32_t sequence)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        packet[i] = (uint8_t)(sequence * 31 + i);
+    }
+    if (size >= sizeof(sequence)) memcpy(packet, &sequence, sizeof(sequence));
+}
+
+static bool CheckPacket(const uint8_t* packet, size_t size, uint32_t sequence)
+{
+    if (size >= sizeof(sequence) && memcmp(packet, &sequence, sizeof(sequence)) != 0) return false;
+    for (size_t i = sizeof(sequence); i < size; i++)
+    {
+        if (packet[i] != (uint8_t)(sequence * 31 + i)) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    DerpNet* net;
+    const size_t* sizes;
+    size_t size_count;
+    uint32_t expected;
+    uint32_t count;
+    size_t bytes;
+    size_t memmove_estimate;   // what consume-by-memmove would have moved for the same reads
+    bool ok;
+    BuddyThread thread;
+} Receiver;
+
+static void Receiver_Run(void* arg)
+{
+    Receiver* rx = arg;
+    rx->ok = true;
+    while (rx->count < rx->expected)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(rx->net, &from, &data, &size, true) != 1)
+        {
+            rx->ok = false;
+            break;
+        }
+
+        DerpNet* net = rx->net;
+        if (size != PacketSize(rx->sizes, rx->size_count, rx->count) || !CheckPacket(data, size, rx->count))
+        {
+            rx->ok = false;
+        }
+
+        // the frame must be a view into the receive buffer, not a copy
+        if (data < net->Buffer || data + size > net->Buffer + sizeof(net->Buffer))
+        {
+            rx->ok = false;
+        }
+
+        // old TlsConsume moved everything after the header, then everything after the frame
+        size_t after_frame = net->BufferReceived - (net->BufferStart + net->LastFrameSize);
+        rx->memmove_estimate += (after_frame + net->LastFrameSize) + after_frame;
+
+        rx->count++;
+        rx->bytes += size;
+    }
+}
+
+static void Receiver_Start(Receiver* rx, DerpNet* net, const size_t* sizes, size_t size_count, uint32_t expected)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->net = net;
+    rx->sizes = sizes;
+    rx->size_count = size_count;
+    rx->expected = expected;
+    BuddyThread_Start(&rx->thread, Receiver_Run, rx);
+}
+
+// Sends `count` packets, queued so many frames arrive in one read
+static void SendPackets(Pair* pair, const size_t* sizes, size_t size_count, uint32_t count)
+{
+    uint8_t* packet = malloc(MAX_PACKET_SIZE);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        size_t size = PacketSize(sizes, size_count, i);
+        MakePacket(packet, size, i);
+        DerpNet_Queue(pair->net[0], &pair->public_key[1], packet, size);
+    }
+    DerpNet_Flush(pair->net[0]);
+    free(packet);
+}
+
+TEST(small_frames_consumed_without_moving)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+
+    static const size_t sizes[] = { 10, 13, 4, 0, 49 };
+    uint32_t count = 2000;
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], sizes, 5, count);
+    SendPackets(&pair, sizes, 5, count);
+    BuddyThread_Join(rx.thread);
+
+    DerpNet* net = pair.net[1];
+    TEST_ASSERT_TRUE(rx.ok);
+    TEST_ASSERT_EQUAL(count, rx.count);
+
+    // everything fits in the buffer, so nothing was ever moved
+    TEST_ASSERT_TRUE(net->TotalReceived < sizeof(net->Buffer));
+    TEST_ASSERT_EQUAL(0, net->TotalMoved);
+
+    Pair_Stop(&pair);
+}
+
+TEST(frames_crossing_buffer_end_stay_contiguous)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+
+    // odd sizes so frames keep landing across the end of the buffer at different offsets
+    static const size_t sizes[] = { VIDEO_CHUNK_SIZE, 1, 40001, 10, MAX_PACKET_SIZE, 7777 };
+    uint32_t count = 600;
+
+    Receiver rx;
+    Receiver_Start(&rx, pair.net[1], sizes, 6, count);
+    SendPackets(&pair, sizes, 6, count);
+    BuddyThread_Join(rx.thread);
+
+    DerpNet* net = pair.net[1];
+    TEST_ASSERT_TRUE(rx.ok);
+    TEST_ASSERT_EQUAL(count, rx.count);
+
+    // compaction only moves the partial frame left at the end, never more than one max frame
+    TEST_ASSERT_TRUE(net->TotalReceived > 4 * sizeof(net->Buffer));
+    size_t compactions = net->TotalReceived / (sizeof(net->Buffer) - (1 << 16)) + 1;
+    TEST_ASSERT_TRUE(net->TotalMoved <= compactions * (1 << 16));
+
+    Pair_Stop(&pair);
+}
+
+TEST(frame_stays_valid_until_next_recv)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+
+    static const size_t sizes[] = { 100 };
+    SendPackets(&pair, sizes, 1, 3);
+
+    // all three frames sit in the socket, so the first read picks them up together
+    while (pair.loop.frames_forwarded != 3) BuddyThread_Sleep(1);
+
+    DerpNet* net = pair.net[1];
+    DerpKey from;
+    uint8_t* first;
+    uint32_t first_size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(net, &from, &first, &first_size, true));
+    TEST_ASSERT_TRUE(memcmp(from.Bytes, pair.public_key[0].Bytes, 32) == 0);
+
+    // a non-blocking call with a frame already buffered returns it without disturbing the first
+    uint8_t copy[100];
+    memcpy(copy, first, sizeof(copy));
+    uint8_t* second;
+    uint32_t second_size;
+    int got = 0;
+    while (got == 0) got = DerpNet_Recv(net, &from, &second, &second_size, false);
+    TEST_ASSERT_EQUAL(1, got);
+    TEST_ASSERT_TRUE(second > first);
+    TEST_ASSERT_TRUE(CheckPacket(second, second_size, 1));
+    TEST_ASSERT_TRUE(memcmp(copy, first, sizeof(copy)) == 0);
+
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(net, &from, &second, &second_size, true));
+    TEST_ASSERT_TRUE(CheckPacket(second, second_size, 2));
+
+    // buffer drained, offsets reset so the next read starts at the front
+    TEST_ASSERT_EQUAL(0, DerpNet_Recv(net, &from, &second, &second_size, false));
+    TEST_ASSERT_EQUAL(0, net->BufferStart);
+    TEST_ASSERT_EQUAL(0, net->BufferReceived);
+
+    Pair_Stop(&pair);
+}
+
+typedef struct {
+    double moved_per_byte;
+    double memmove_per_byte;
+    double mb_per_sec;
+} BenchResult;
+
+static BenchResult RunBenchmark(const size_t* sizes, size_t size_count, uint32_t count)
+{
+    Pair pair;
+    Pair_Start(&pair);
+
+    Receiver rx;
+    uint64_t start = BuddyClock_NowUs();
+    Receiver_Start(&rx, pair.net[1], sizes, size_count, count);
+
+    // several bursts, like a keyframe followed by input and file traffic
+    uint32_t burst = 64;
+    uint8_t* packet = malloc(MAX_PACKET_SIZE);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        size_t size = PacketSize(sizes, size_count, i);
+        MakePacket(packet, size, i);
+        DerpNet_Queue(pair.net[0], &pair.public_key[1], packet, size);
+        if (i % burst == burst - 1) DerpNet_Flush(pair.net[0]);
+    }
+    DerpNet_Flush(pair.net[0]);
+    free(packet);
+
+    BuddyThread_Join(rx.thread);
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+
+    DerpNet* net = pair.net[1];
+    BenchResult result;
+    result.moved_per_byte = (double)net->TotalMoved / (double)net->TotalReceived;
+    result.memmove_per_byte = (double)rx.memmove_estimate / (double)net->TotalReceived;
+    result.mb_per_sec = rx.bytes / (1024.0 * 1024.0) / (seconds > 0 ? seconds : 1e-6);
+
+    Pair_Stop(&pair);
+    return result;
+}
+
+TEST(benchmark_bytes_moved_per_received_byte)
+{
+    static const size_t input[] = { 10, 10, 10, 6 };
+    static const size_t mixed[] = { VIDEO_CHUNK_SIZE, 10, 10, 30000, 10, 4096 };
+    static const size_t video[] = { VIDEO_CHUNK_SIZE };
+
+    BenchResult r_input = RunBenchmark(input, 4, 50000);
+    BenchResult r_mixed = RunBenchmark(mixed, 6, 6000);
+    BenchResult r_video = RunBenchmark(video, 1, 2000);
+
+    printf("\n    %-26s %14s %14s %10s\n", "workload", "moved/B", "memmove est/B", "MB/s");
+    printf("    %-26s %14.4f %14.2f %10.1f\n", "mouse/keyboard packets", r_input.moved_per_byte, r_input.memmove_per_byte, r_input.mb_per_sec);
+    printf("    %-26s %14.4f %14.2f %10.1f\n", "mixed video/input/file", r_mixed.moved_per_byte, r_mixed.memmove_per_byte, r_mixed.mb_per_sec);
+    printf("    %-26s %14.4f %14.2f %10.1f\n", "video chunks", r_video.moved_per_byte, r_video.memmove_per_byte, r_video.mb_per_sec);
+    printf("    (estimate replays memmove-on-consume against the same reads)\n    ");
+
+    TEST_ASSERT_TRUE(r_input.moved_per_byte < 0.05);
+    TEST_ASSERT_TRUE(r_mixed.moved_per_byte < 0.5);
+    TEST_ASSERT_TRUE(r_video.moved_per_byte < 0.5);
+    TEST_ASSERT_TRUE(r_input.moved_per_byte < r_input.memmove_per_byte);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Receive Buffer Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(small_frames_consumed_without_moving);
+    RUN_TEST(frames_crossing_buffer_end_stay_contiguous);
+    RUN_TEST(frame_stays_valid_until_next_recv);
+    RUN_TEST(benchmark_bytes_moved_per_received_byte);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,240 @@
+// Unit tests and copy benchmark for DerpNet_SendV (scatter-gather sealing)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+
+#define CHUNK_SIZE 65000         // BUDDY_SEND_BUFFER_SIZE in ScreenBuddy.c
+#define BENCH_BYTES (32u << 20)
+
+static void FillPattern(uint8_t* data, size_t size, uint32_t seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        data[i] = (uint8_t)(seed >> 24);
+    }
+}
+
+TEST(gather_seal_matches_contiguous_seal)
+{
+    uint8_t key[32], nonce[24];
+    FillPattern(key, sizeof(key), 1);
+    FillPattern(nonce, sizeof(nonce), 2);
+
+    static uint8_t plain[4096];
+    static uint8_t expected[4096];
+    static uint8_t actual[4096];
+    FillPattern(plain, sizeof(plain), 3);
+
+    // split points around the 32-byte first block and 64-byte block edges
+    static const size_t splits[][4] = {
+        { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 31, 1, 0, 0 }, { 32, 0, 32, 0 },
+        { 33, 63, 64, 65 }, { 1, 1, 1, 1 }, { 5, 200, 7, 1000 }, { 96, 64, 128, 3 },
+    };
+    static const size_t totals[] = { 0, 1, 33, 100, 255, 1024, 1279, 4096 };
+
+    for (size_t t = 0; t < sizeof(totals) / sizeof(totals[0]); t++)
+    {
+        uint8_t expected_auth[16];
+        DerpNet__BoxSealEx(nonce, expected_auth, expected, plain, totals[t], key);
+
+        for (size_t s = 0; s < sizeof(splits) / sizeof(splits[0]); s++)
+        {
+            DerpNetIoVec iov[5];
+            size_t count = 0, offset = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                size_t size = splits[s][i];
+                if (offset + size > totals[t]) size = totals[t] - offset;
+                iov[count].Data = plain + offset;
+                iov[count].Size = size;
+                count++;
+                offset += size;
+            }
+            iov[count].Data = plain + offset;
+            iov[count].Size = totals[t] - offset;
+            count++;
+
+            uint8_t auth[16];
+            memset(actual, 0, sizeof(actual));
+            DerpNet__BoxSealV(nonce, auth, actual, iov, count, key);
+            TEST_ASSERT_TRUE(memcmp(auth, expected_auth, sizeof(auth)) == 0);
+            TEST_ASSERT_TRUE(memcmp(actual, expected, totals[t]) == 0);
+        }
+
+        uint8_t opened[4096];
+        TEST_ASSERT_TRUE(DerpNet__BoxUnsealEx(opened, expected, totals[t], expected_auth, nonce, key));
+        TEST_ASSERT_TRUE(memcmp(opened, plain, totals[t]) == 0);
+    }
+}
+
+TEST(sendv_roundtrip_over_loopback)
+{
+    DerpKey secret_a, secret_b, public_a, public_b;
+    DerpNet_CreateNewKey(&secret_a);
+    DerpNet_CreateNewKey(&secret_b);
+    DerpNet_GetPublicKey(&secret_a, &public_a);
+    DerpNet_GetPublicKey(&secret_b, &public_b);
+
+    DerpNet* a = malloc(sizeof(DerpNet));
+    DerpNet* b = malloc(sizeof(DerpNet));
+    DerpLoopback loop;
+    TEST_ASSERT_TRUE(DerpLoopback_Start(&loop, a, &secret_a, b, &secret_b));
+
+    // packet type byte + encoder output, exactly like a video chunk
+    uint8_t header[1] = { 3 };
+    uint8_t* data = malloc(CHUNK_SIZE - 1);
+    FillPattern(data, CHUNK_SIZE - 1, 7);
+
+    DerpNetIoVec iov[2] = { { header, sizeof(header) }, { data, CHUNK_SIZE - 1 } };
+    TEST_ASSERT_TRUE(DerpNet_SendV(a, &public_b, iov, 2));
+
+    // an empty segment in the middle must not disturb the keystream
+    DerpNetIoVec iov2[3] = { { header, sizeof(header) }, { data, 0 }, { data, 100 } };
+    TEST_ASSERT_TRUE(DerpNet_SendV(a, &public_b, iov2, 3));
+
+    DerpKey from;
+    uint8_t* received;
+    uint32_t received_size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &received, &received_size, true));
+    TEST_ASSERT_EQUAL(CHUNK_SIZE, received_size);
+    TEST_ASSERT_TRUE(memcmp(from.Bytes, public_a.Bytes, 32) == 0);
+    TEST_ASSERT_EQUAL(3, received[0]);
+    TEST_ASSERT_TRUE(memcmp(received + 1, data, CHUNK_SIZE - 1) == 0);
+
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(b, &from, &received, &received_size, true));
+    TEST_ASSERT_EQUAL(101, received_size);
+    TEST_ASSERT_TRUE(memcmp(received + 1, data, 100) == 0);
+
+    // one pass over the payload: the seal writes each byte once, nothing else copies
+    TEST_ASSERT_EQUAL(CHUNK_SIZE + 101, a->TotalCopied);
+
+    DerpLoopback_Stop(&loop);
+    free(data);
+    free(a);
+    free(b);
+}
+
+typedef struct {
+    DerpNet* net;
+    size_t expected;
+    size_t received;
+} BenchReceiver;
+
+static void BenchReceiver_Run(void* arg)
+{
+    BenchReceiver* rx = arg;
+    while (rx->received < rx->expected)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(rx->net, &from, &data, &size, true) < 0) break;
+        rx->received += size;
+    }
+}
+
+typedef struct {
+    double copies_per_byte;
+    double mb_per_sec;
+} BenchResult;
+
+// Streams BENCH_BYTES of "encoder output" in video-sized chunks, either the old
+// way (join header and data into a send buffer, then DerpNet_Send) or with SendV
+static BenchResult RunBenchmark(bool use_sendv)
+{
+    DerpKey secret_a, secret_b, public_b;
+    DerpNet_CreateNewKey(&secret_a);
+    DerpNet_CreateNewKey(&secret_b);
+    DerpNet_GetPublicKey(&secret_b, &public_b);
+
+    DerpNet* a = malloc(sizeof(DerpNet));
+    DerpNet* b = malloc(sizeof(DerpNet));
+    DerpLoopback loop;
+    DerpLoopback_Start(&loop, a, &secret_a, b, &secret_b);
+
+    size_t frame_size = 4 * CHUNK_SIZE;
+    uint8_t* frame = malloc(frame_size);
+    uint8_t* send_buffer = malloc(CHUNK_SIZE);
+    FillPattern(frame, frame_size, 11);
+
+    size_t chunks = BENCH_BYTES / CHUNK_SIZE;
+    BenchReceiver rx = { .net = b, .expected = chunks * CHUNK_SIZE };
+    BuddyThread thread;
+    BuddyThread_Start(&thread, BenchReceiver_Run, &rx);
+
+    uint8_t header = 3;
+    size_t caller_copied = 0;
+    uint64_t start = BuddyClock_NowUs();
+    for (size_t i = 0; i < chunks; i++)
+    {
+        const uint8_t* data = frame + (i % 4) * CHUNK_SIZE;
+        if (use_sendv)
+        {
+            DerpNetIoVec iov[2] = { { &header, 1 }, { data, CHUNK_SIZE - 1 } };
+            DerpNet_SendV(a, &public_b, iov, 2);
+        }
+        else
+        {
+            send_buffer[0] = header;
+            memcpy(send_buffer + 1, data, CHUNK_SIZE - 1);
+            caller_copied += CHUNK_SIZE;
+            DerpNet_Send(a, &public_b, send_buffer, CHUNK_SIZE);
+        }
+    }
+    BuddyThread_Join(thread);
+    uint64_t elapsed = BuddyClock_NowUs() - start;
+
+    BenchResult result;
+    result.copies_per_byte = (double)(caller_copied + a->TotalCopied) / (double)rx.received;
+    result.mb_per_sec = rx.received / (1024.0 * 1024.0) / (elapsed ? elapsed / 1e6 : 1e-6);
+
+    DerpLoopback_Stop(&loop);
+    free(send_buffer);
+    free(frame);
+    free(a);
+    free(b);
+    return result;
+}
+
+TEST(benchmark_bytes_copied_per_sent_byte)
+{
+    BenchResult joined = RunBenchmark(false);
+    BenchResult gathered = RunBenchmark(true);
+
+    printf("\n    %-28s %8s %10s\n", "path", "copies/B", "MB/s");
+    printf("    %-28s %8.2f %10.1f\n", "memcpy + DerpNet_Send", joined.copies_per_byte, joined.mb_per_sec);
+    printf("    %-28s %8.2f %10.1f\n", "DerpNet_SendV", gathered.copies_per_byte, gathered.mb_per_sec);
+    printf("    (TLS builds add one more copy per byte into the Schannel record)\n    ");
+
+    TEST_ASSERT_TRUE(joined.copies_per_byte > 1.99);
+    TEST_ASSERT_TRUE(gathered.copies_per_byte < 1.01);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DerpNet Scatter-Gather Send Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(gather_seal_matches_contiguous_seal);
+    RUN_TEST(sendv_roundtrip_over_loopback);
+    RUN_TEST(benchmark_bytes_copied_per_sent_byte);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
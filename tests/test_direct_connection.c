@@ -0,0 +1,574 @@
+// Tests and benchmark for the encrypted LAN connection (direct_connection.c): handshake, address
+// race, DerpNet_OpenDirect, and loopback throughput of the direct link against the local relay
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // local relay speaks plain HTTP, like the Docker derper on 8080
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "direct_connection.h"
+#include "latency.h"
+
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define THROUGHPUT_BYTES (256u << 20)
+#define TEST_ACCEPT_MS 3000
+#define MOUSE_PACKET_SIZE 10       // sizeof(Buddy_MousePacket)
+#define PING_COUNT 5000
+
+typedef struct {
+    DerpKey secret;
+    DerpKey public_key;
+} Peer;
+
+static void Peer_Init(Peer* peer)
+{
+    DerpNet_CreateNewKey(&peer->secret);
+    DerpNet_GetPublicKey(&peer->secret, &peer->public_key);
+}
+
+// accepting side on its worker thread, the test waits for its callback
+typedef struct {
+    DirectConnection conn;
+    BuddyMutex lock;
+    BuddyCond changed;
+    bool done;
+} Acceptor;
+
+static void Acceptor_Done(void* context)
+{
+    Acceptor* acceptor = context;
+    BuddyMutex_Lock(&acceptor->lock);
+    acceptor->done = true;
+    BuddyCond_Broadcast(&acceptor->changed);
+    BuddyMutex_Unlock(&acceptor->lock);
+}
+
+static bool Acceptor_Start(Acceptor* acceptor, uintptr_t listener, const Peer* self, const Peer* peer)
+{
+    BuddyMutex_Init(&acceptor->lock);
+    BuddyCond_Init(&acceptor->changed);
+    acceptor->done = false;
+    return DirectConnection_StartAccept(&acceptor->conn, listener, self->secret.Bytes, peer->public_key.Bytes, TEST_ACCEPT_MS, Acceptor_Done, acceptor);
+}
+
+// waits for the worker, returns the socket it authenticated and stops it
+static uintptr_t Acceptor_Finish(Acceptor* acceptor)
+{
+    BuddyMutex_Lock(&acceptor->lock);
+    while (!acceptor->done)
+    {
+        BuddyCond_Wait(&acceptor->changed, &acceptor->lock);
+    }
+    BuddyMutex_Unlock(&acceptor->lock);
+
+    uintptr_t s = DirectConnection_Take(&acceptor->conn);
+    DirectConnection_Stop(&acceptor->conn);
+    BuddyCond_Destroy(&acceptor->changed);
+    BuddyMutex_Destroy(&acceptor->lock);
+    return s;
+}
+
+// listener on one loopback address only, so another 127.x address with the same port stays free
+static uintptr_t Listen_On(const char* ip, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+    {
+        close(fd);
+        return DIRECT_INVALID_SOCKET;
+    }
+    return (uintptr_t)fd;
+}
+
+static void Offer_Add(DirectOffer* offer, const char* ip)
+{
+    inet_pton(AF_INET, ip, offer->addresses[offer->count++]);
+}
+
+typedef struct {
+    DerpNet* net;
+    size_t expected;
+    size_t received;
+} Drain;
+
+static void Drain_Run(void* arg)
+{
+    Drain* drain = arg;
+    while (drain->received < drain->expected)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(drain->net, &from, &data, &size, true) < 0) break;
+        drain->received += size;
+    }
+}
+
+// video sized chunks queued and flushed in groups like a keyframe, returns MB/s
+static double Throughput(DerpNet* from, DerpNet* to, const DerpKey* target, size_t* received)
+{
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    memset(chunk, 0x5a, VIDEO_CHUNK_SIZE);
+    size_t chunks = THROUGHPUT_BYTES / VIDEO_CHUNK_SIZE;
+
+    Drain drain = { .net = to, .expected = chunks * VIDEO_CHUNK_SIZE };
+    BuddyThread thread;
+    BuddyThread_Start(&thread, Drain_Run, &drain);
+
+    uint64_t start = BuddyClock_NowUs();
+    for (size_t i = 0; i < chunks; i++)
+    {
+        DerpNet_Queue(from, target, chunk, VIDEO_CHUNK_SIZE);
+        if (i % 4 == 3) DerpNet_Flush(from);
+    }
+    DerpNet_Flush(from);
+    BuddyThread_Join(thread);
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    free(chunk);
+
+    *received = drain.received;
+    return drain.received / (1024.0 * 1024.0) / (seconds > 0 ? seconds : 1e-6);
+}
+
+typedef struct {
+    DerpNet* net;
+    const DerpKey* peer;
+    uint32_t count;
+} Echo;
+
+static void Echo_Run(void* arg)
+{
+    Echo* echo = arg;
+    for (uint32_t i = 0; i < echo->count; i++)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(echo->net, &from, &data, &size, true) < 0) break;
+        if (!DerpNet_Send(echo->net, echo->peer, data, size)) break;
+    }
+}
+
+// round trip of mouse sized packets, to echoes every packet back; returns packets that came back
+static uint32_t RoundTrip(DerpNet* from, DerpNet* to, const DerpKey* from_key, const DerpKey* to_key, LatencySummary* summary)
+{
+    Echo echo = { .net = to, .peer = from_key, .count = PING_COUNT };
+    BuddyThread thread;
+    BuddyThread_Start(&thread, Echo_Run, &echo);
+
+    LatencyStats* stats = calloc(1, sizeof(LatencyStats));
+    uint8_t packet[MOUSE_PACKET_SIZE] = { 0 };
+    uint32_t returned = 0;
+    for (uint32_t i = 0; i < PING_COUNT; i++)
+    {
+        uint64_t sent = BuddyClock_NowUs();
+        if (!DerpNet_Send(from, to_key, packet, sizeof(packet))) break;
+
+        DerpKey key;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(from, &key, &data, &size, true) < 0) break;
+        Latency_StatsAdd(stats, (int64_t)(BuddyClock_NowUs() - sent));
+        returned++;
+    }
+    BuddyThread_Join(thread);
+
+    Latency_StatsSummary(stats, summary);
+    free(stats);
+    return returned;
+}
+
+// authenticated pair over loopback, [0] accepted by a, [1] connected by b
+static bool Link_Open(const Peer* a, const Peer* b, uintptr_t sockets[2], DirectStats* stats)
+{
+    uintptr_t listener = DirectConnection_Listen(0);
+    if (listener == DIRECT_INVALID_SOCKET) return false;
+
+    DirectOffer offer = { .port = DirectConnection_GetListenerPort(listener) };
+    Offer_Add(&offer, "127.0.0.1");
+
+    Acceptor acceptor;
+    if (!Acceptor_Start(&acceptor, listener, a, b)) return false;
+    memset(stats, 0, sizeof(*stats));
+    sockets[1] = DirectConnection_Connect(&offer, b->secret.Bytes, a->public_key.Bytes, stats);
+    sockets[0] = Acceptor_Finish(&acceptor);
+    return sockets[0] != DIRECT_INVALID_SOCKET && sockets[1] != DIRECT_INVALID_SOCKET;
+}
+
+TEST(offer_round_trips_and_rejects_bad_sizes)
+{
+    DirectOffer offer = { .port = 51234 };
+    Offer_Add(&offer, "192.168.1.20");
+    Offer_Add(&offer, "10.0.0.7");
+    Offer_Add(&offer, "127.0.0.1");
+
+    uint8_t packed[DIRECT_OFFER_MAX_SIZE];
+    size_t size = DirectOffer_Pack(&offer, packed);
+    TEST_ASSERT_EQUAL(3 + 3 * 4, size);
+
+    DirectOffer unpacked;
+    TEST_ASSERT_TRUE(DirectOffer_Unpack(&unpacked, packed, size));
+    TEST_ASSERT_EQUAL(51234, unpacked.port);
+    TEST_ASSERT_EQUAL(3, unpacked.count);
+    TEST_ASSERT_TRUE(memcmp(unpacked.addresses, offer.addresses, 3 * 4) == 0);
+
+    TEST_ASSERT_FALSE(DirectOffer_Unpack(&unpacked, packed, size - 1));
+    TEST_ASSERT_FALSE(DirectOffer_Unpack(&unpacked, packed, 2));
+    packed[2] = 0;
+    TEST_ASSERT_FALSE(DirectOffer_Unpack(&unpacked, packed, 3));
+    packed[2] = DIRECT_MAX_ADDRESSES + 1;
+    TEST_ASSERT_FALSE(DirectOffer_Unpack(&unpacked, packed, 3 + 4 * (DIRECT_MAX_ADDRESSES + 1)));
+}
+
+TEST(local_addresses_end_with_loopback)
+{
+    uint8_t addresses[DIRECT_MAX_ADDRESSES][4];
+    uint32_t count = DirectConnection_LocalAddresses(addresses, DIRECT_MAX_ADDRESSES);
+    TEST_ASSERT_TRUE(count >= 1);
+    TEST_ASSERT_EQUAL(127, addresses[count - 1][0]);
+    for (uint32_t i = 0; i + 1 < count; i++)
+    {
+        TEST_ASSERT_TRUE(addresses[i][0] != 127);
+    }
+}
+
+TEST(handshake_authenticates_both_ends)
+{
+    Peer a, b;
+    Peer_Init(&a);
+    Peer_Init(&b);
+
+    uintptr_t sockets[2];
+    DirectStats stats;
+    TEST_ASSERT_TRUE(Link_Open(&a, &b, sockets, &stats));
+    TEST_ASSERT_EQUAL(1, stats.attempts);
+    TEST_ASSERT_EQUAL(0, stats.failures);
+    TEST_ASSERT_EQUAL(0, stats.rejected);
+    TEST_ASSERT_TRUE(stats.handshake_us < DIRECT_HANDSHAKE_TIMEOUT_MS * 1000);
+
+    // both handed back in blocking mode for DerpNet
+    TEST_ASSERT_EQUAL(0, fcntl((int)sockets[0], F_GETFL) & O_NONBLOCK);
+    TEST_ASSERT_EQUAL(0, fcntl((int)sockets[1], F_GETFL) & O_NONBLOCK);
+
+    DirectConnection_CloseSocket(sockets[0]);
+    DirectConnection_CloseSocket(sockets[1]);
+}
+
+TEST(wrong_key_is_rejected_by_both_ends)
+{
+    Peer a, b, stranger;
+    Peer_Init(&a);
+    Peer_Init(&b);
+    Peer_Init(&stranger);
+
+    // a expects b, the stranger connects with its own key
+    uintptr_t listener = DirectConnection_Listen(0);
+    TEST_ASSERT_TRUE(listener != DIRECT_INVALID_SOCKET);
+    DirectOffer offer = { .port = DirectConnection_GetListenerPort(listener) };
+    Offer_Add(&offer, "127.0.0.1");
+
+    Acceptor acceptor;
+    TEST_ASSERT_TRUE(Acceptor_Start(&acceptor, listener, &a, &b));
+    DirectStats stats = { 0 };
+    uintptr_t s = DirectConnection_Connect(&offer, stranger.secret.Bytes, a.public_key.Bytes, &stats);
+    TEST_ASSERT_TRUE(s == DIRECT_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(1, stats.rejected);
+
+    // presenting b's public key is not enough without b's secret to answer the challenge
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(offer.port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    TEST_ASSERT_EQUAL(0, connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+    uint8_t hello[8 + 32 + 16] = "BUDDYDC1";
+    memcpy(hello + 8, b.public_key.Bytes, 32);
+    TEST_ASSERT_EQUAL(sizeof(hello), send(fd, hello, sizeof(hello), 0));
+    uint8_t reply[sizeof(hello) + 24 + 16 + 17];
+    TEST_ASSERT_EQUAL(sizeof(reply), recv(fd, reply, sizeof(reply), MSG_WAITALL));
+    uint8_t forged[24 + 16 + 17] = { 0 };
+    TEST_ASSERT_EQUAL(sizeof(forged), send(fd, forged, sizeof(forged), 0));
+    TEST_ASSERT_EQUAL(0, recv(fd, reply, 1, 0));
+    close(fd);
+
+    // b expecting someone other than a rejects a's listener
+    Peer other;
+    Peer_Init(&other);
+    memset(&stats, 0, sizeof(stats));
+    s = DirectConnection_Connect(&offer, b.secret.Bytes, other.public_key.Bytes, &stats);
+    TEST_ASSERT_TRUE(s == DIRECT_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(1, stats.rejected);
+
+    // the listener is still there for the right peer afterwards
+    memset(&stats, 0, sizeof(stats));
+    s = DirectConnection_Connect(&offer, b.secret.Bytes, a.public_key.Bytes, &stats);
+    TEST_ASSERT_TRUE(s != DIRECT_INVALID_SOCKET);
+    uintptr_t accepted = Acceptor_Finish(&acceptor);
+    TEST_ASSERT_TRUE(accepted != DIRECT_INVALID_SOCKET);
+    TEST_ASSERT_TRUE(acceptor.conn.stats.rejected >= 2);
+
+    DirectConnection_CloseSocket(s);
+    DirectConnection_CloseSocket(accepted);
+}
+
+TEST(refused_and_impostor_addresses_fail_over)
+{
+    Peer a, b, impostor;
+    Peer_Init(&a);
+    Peer_Init(&b);
+    Peer_Init(&impostor);
+
+    // a on 127.0.0.1, an impostor with its own key on 127.0.0.3, nobody on 127.0.0.2
+    uintptr_t listener = Listen_On("127.0.0.1", 0);
+    TEST_ASSERT_TRUE(listener != DIRECT_INVALID_SOCKET);
+    uint16_t port = DirectConnection_GetListenerPort(listener);
+    uintptr_t impostor_listener = Listen_On("127.0.0.3", port);
+    TEST_ASSERT_TRUE(impostor_listener != DIRECT_INVALID_SOCKET);
+
+    DirectOffer offer = { .port = port };
+    Offer_Add(&offer, "127.0.0.2");
+    Offer_Add(&offer, "127.0.0.3");
+    Offer_Add(&offer, "127.0.0.1");
+
+    Acceptor acceptor, impostor_acceptor;
+    TEST_ASSERT_TRUE(Acceptor_Start(&acceptor, listener, &a, &b));
+    TEST_ASSERT_TRUE(Acceptor_Start(&impostor_acceptor, impostor_listener, &impostor, &b));
+
+    DirectStats stats = { 0 };
+    uintptr_t s = DirectConnection_Connect(&offer, b.secret.Bytes, a.public_key.Bytes, &stats);
+    TEST_ASSERT_TRUE(s != DIRECT_INVALID_SOCKET);
+    TEST_ASSERT_EQUAL(2, stats.winner);
+    TEST_ASSERT_EQUAL(1, stats.rejected);
+    TEST_ASSERT_TRUE(stats.failures >= 1);
+    // refusals and the rejected handshake do not wait for the stagger
+    TEST_ASSERT_TRUE(stats.connect_us < DERPNET_CONNECT_STAGGER_MS * 1000);
+
+    uintptr_t accepted = Acceptor_Finish(&acceptor);
+    TEST_ASSERT_TRUE(accepted != DIRECT_INVALID_SOCKET);
+    DirectStats impostor_stats = impostor_acceptor.conn.stats;
+    DirectConnection_Stop(&impostor_acceptor.conn);
+    TEST_ASSERT_EQUAL(1, impostor_stats.rejected);
+
+    DirectConnection_CloseSocket(s);
+    DirectConnection_CloseSocket(accepted);
+}
+
+TEST(stop_ends_accept_without_waiting_for_timeout)
+{
+    Peer a, b;
+    Peer_Init(&a);
+    Peer_Init(&b);
+
+    DirectConnection conn;
+    uintptr_t listener = DirectConnection_Listen(0);
+    TEST_ASSERT_TRUE(DirectConnection_StartAccept(&conn, listener, a.secret.Bytes, b.public_key.Bytes, 60000, NULL, NULL));
+
+    uint64_t start = BuddyClock_NowUs();
+    DirectConnection_Stop(&conn);
+    TEST_ASSERT_TRUE(BuddyClock_NowUs() - start < 1000 * 1000);
+    TEST_ASSERT_TRUE(DirectConnection_Take(&conn) == DIRECT_INVALID_SOCKET);
+    DirectConnection_Stop(&conn);
+}
+
+TEST(open_direct_carries_sealed_packets_both_ways)
+{
+    Peer a, b;
+    Peer_Init(&a);
+    Peer_Init(&b);
+
+    uintptr_t sockets[2];
+    DirectStats stats;
+    TEST_ASSERT_TRUE(Link_Open(&a, &b, sockets, &stats));
+
+    DerpNet* net_a = malloc(sizeof(DerpNet));
+    DerpNet* net_b = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_OpenDirect(net_a, sockets[0], &a.secret, &b.public_key, NULL));
+    TEST_ASSERT_TRUE(DerpNet_OpenDirect(net_b, sockets[1], &b.secret, &a.public_key, NULL));
+
+    uint8_t hello[] = "hello";
+    TEST_ASSERT_TRUE(DerpNet_Send(net_a, &b.public_key, hello, sizeof(hello)));
+
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(net_b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(sizeof(hello), size);
+    TEST_ASSERT_TRUE(memcmp(data, hello, sizeof(hello)) == 0);
+    TEST_ASSERT_TRUE(memcmp(from.Bytes, a.public_key.Bytes, 32) == 0);
+    TEST_ASSERT_EQUAL(0, DerpNet_Recv(net_b, &from, &data, &size, false));
+
+    // max size payload back
+    uint8_t* chunk = malloc(VIDEO_CHUNK_SIZE);
+    for (size_t i = 0; i < VIDEO_CHUNK_SIZE; i++) chunk[i] = (uint8_t)(i * 7);
+    TEST_ASSERT_TRUE(DerpNet_Send(net_b, &a.public_key, chunk, VIDEO_CHUNK_SIZE));
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(net_a, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(VIDEO_CHUNK_SIZE, size);
+    TEST_ASSERT_TRUE(memcmp(data, chunk, VIDEO_CHUNK_SIZE) == 0);
+    TEST_ASSERT_TRUE(memcmp(from.Bytes, b.public_key.Bytes, 32) == 0);
+    free(chunk);
+
+    // a frame sealed for someone else does not open, the link only speaks for the two keys
+    Peer stranger;
+    Peer_Init(&stranger);
+    TEST_ASSERT_TRUE(DerpNet_Send(net_a, &stranger.public_key, hello, sizeof(hello)));
+    TEST_ASSERT_TRUE(DerpNet_Send(net_a, &b.public_key, hello, 1));
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(net_b, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(1, size);
+
+    // closing one end is seen by the other
+    DerpNet_Close(net_a);
+    TEST_ASSERT_EQUAL(-1, DerpNet_Recv(net_b, &from, &data, &size, true));
+    DerpNet_Close(net_b);
+    free(net_a);
+    free(net_b);
+}
+
+TEST(direct_link_shares_relay_event_fd)
+{
+    Peer a, b;
+    Peer_Init(&a);
+    Peer_Init(&b);
+
+    DerpRelayConfig config = { .threads = 1 };
+    DerpRelay* relay = DerpRelay_Start(&config);
+    TEST_ASSERT_NOT_NULL(relay);
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", DerpRelay_GetPort(relay));
+
+    DerpNet* relay_a = malloc(sizeof(DerpNet));
+    DerpNet* relay_b = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_Open(relay_a, address, &a.secret));
+    TEST_ASSERT_TRUE(DerpNet_Open(relay_b, address, &b.secret));
+
+    uintptr_t sockets[2];
+    DirectStats stats;
+    TEST_ASSERT_TRUE(Link_Open(&a, &b, sockets, &stats));
+    DerpNet* direct_a = malloc(sizeof(DerpNet));
+    DerpNet* direct_b = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_OpenDirect(direct_a, sockets[0], &a.secret, &b.public_key, relay_a));
+    TEST_ASSERT_TRUE(DerpNet_OpenDirect(direct_b, sockets[1], &b.secret, &a.public_key, NULL));
+    TEST_ASSERT_EQUAL(relay_a->EventFd, direct_a->EventFd);
+
+    // consume the initial writable edges
+    struct epoll_event events[4];
+    while (epoll_wait(relay_a->EventFd, events, 4, 0) > 0) {}
+
+    uint8_t packet[10] = { 42 };
+    TEST_ASSERT_TRUE(DerpNet_Send(direct_b, &a.public_key, packet, sizeof(packet)));
+    TEST_ASSERT_TRUE(epoll_wait(relay_a->EventFd, events, 4, 5000) >= 1);
+    TEST_ASSERT_TRUE(events[0].events & EPOLLIN);
+    TEST_ASSERT_EQUAL((int)direct_a->Socket, events[0].data.fd);
+
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(direct_a, &from, &data, &size, false));
+    TEST_ASSERT_EQUAL(42, data[0]);
+
+    // closing the direct link leaves the relay's epoll fd working
+    DerpNet_Close(direct_a);
+    while (epoll_wait(relay_a->EventFd, events, 4, 0) > 0) {}
+    packet[0] = 43;
+    TEST_ASSERT_TRUE(DerpNet_Send(relay_b, &a.public_key, packet, sizeof(packet)));
+    TEST_ASSERT_TRUE(epoll_wait(relay_a->EventFd, events, 4, 5000) >= 1);
+    TEST_ASSERT_EQUAL((int)relay_a->Socket, events[0].data.fd);
+    TEST_ASSERT_EQUAL(1, DerpNet_Recv(relay_a, &from, &data, &size, true));
+    TEST_ASSERT_EQUAL(43, data[0]);
+
+    DerpNet_Close(direct_b);
+    DerpNet_Close(relay_a);
+    DerpNet_Close(relay_b);
+    free(direct_a);
+    free(direct_b);
+    free(relay_a);
+    free(relay_b);
+    DerpRelay_Stop(relay);
+}
+
+TEST(benchmark_direct_link_against_relay)
+{
+    Peer a, b;
+    Peer_Init(&a);
+    Peer_Init(&b);
+
+    // the relay must never drop for a receiver that is briefly behind, every byte is counted
+    DerpRelayConfig config = { .threads = 2, .max_queue = THROUGHPUT_BYTES };
+    DerpRelay* relay = DerpRelay_Start(&config);
+    TEST_ASSERT_NOT_NULL(relay);
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", DerpRelay_GetPort(relay));
+
+    DerpNet* net_a = malloc(sizeof(DerpNet));
+    DerpNet* net_b = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_Open(net_a, address, &a.secret));
+    TEST_ASSERT_TRUE(DerpNet_Open(net_b, address, &b.secret));
+    size_t relay_received;
+    double relay_mb = Throughput(net_a, net_b, &b.public_key, &relay_received);
+    LatencySummary relay_rtt;
+    uint32_t relay_returned = RoundTrip(net_a, net_b, &a.public_key, &b.public_key, &relay_rtt);
+    DerpNet_Close(net_a);
+    DerpNet_Close(net_b);
+    DerpRelay_Stop(relay);
+
+    uint64_t start = BuddyClock_NowUs();
+    uintptr_t sockets[2];
+    DirectStats stats;
+    TEST_ASSERT_TRUE(Link_Open(&a, &b, sockets, &stats));
+    double setup_ms = (BuddyClock_NowUs() - start) / 1000.0;
+    TEST_ASSERT_TRUE(DerpNet_OpenDirect(net_a, sockets[0], &a.secret, &b.public_key, NULL));
+    TEST_ASSERT_TRUE(DerpNet_OpenDirect(net_b, sockets[1], &b.secret, &a.public_key, NULL));
+    size_t direct_received;
+    double direct_mb = Throughput(net_a, net_b, &b.public_key, &direct_received);
+    LatencySummary direct_rtt;
+    uint32_t direct_returned = RoundTrip(net_a, net_b, &a.public_key, &b.public_key, &direct_rtt);
+    DerpNet_Close(net_a);
+    DerpNet_Close(net_b);
+    free(net_a);
+    free(net_b);
+
+    printf("\n    %-34s %10.1f MB/s\n", "relay throughput (65000 B chunks)", relay_mb);
+    printf("    %-34s %10.1f MB/s (%.2fx)\n", "direct throughput (65000 B chunks)", direct_mb, direct_mb / (relay_mb > 0 ? relay_mb : 1e-6));
+    printf("    %-34s %7lld / %lld us (p50/p95, %u packets)\n", "relay round trip (10 B packets)",
+        (long long)relay_rtt.p50_us, (long long)relay_rtt.p95_us, relay_returned);
+    printf("    %-34s %7lld / %lld us (p50/p95, %u packets)\n", "direct round trip (10 B packets)",
+        (long long)direct_rtt.p50_us, (long long)direct_rtt.p95_us, direct_returned);
+    printf("    %-34s %10.2f ms (handshake %.2f ms)\n", "direct link setup", setup_ms, stats.handshake_us / 1000.0);
+    printf("    ");
+
+    size_t expected = (THROUGHPUT_BYTES / VIDEO_CHUNK_SIZE) * VIDEO_CHUNK_SIZE;
+    TEST_ASSERT_EQUAL(expected, relay_received);
+    TEST_ASSERT_EQUAL(expected, direct_received);
+    TEST_ASSERT_EQUAL(PING_COUNT, relay_returned);
+    TEST_ASSERT_EQUAL(PING_COUNT, direct_returned);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Direct LAN Connection Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(offer_round_trips_and_rejects_bad_sizes);
+    RUN_TEST(local_addresses_end_with_loopback);
+    RUN_TEST(handshake_authenticates_both_ends);
+    RUN_TEST(wrong_key_is_rejected_by_both_ends);
+    RUN_TEST(refused_and_impostor_addresses_fail_over);
+    RUN_TEST(stop_ends_accept_without_waiting_for_timeout);
+    RUN_TEST(open_direct_carries_sealed_packets_both_ways);
+    RUN_TEST(direct_link_shares_relay_event_fd);
+    RUN_TEST(benchmark_direct_link_against_relay);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,527 @@
+// Tests and benchmark for multi-viewer fan-out (fanout.c): per viewer windows, keyframe waits,
+// a slow viewer next to fast ones on the local relay, and sharer CPU per added viewer
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // local relay speaks plain HTTP, like the Docker derper on 8080
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "fanout.h"
+
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define FRAME_HEADER_SIZE 9        // sequence, size, keyframe
+#define FRAME_END 0xff             // one byte packet: the stream is over
+#define KEYFRAME_SIZE (256 * 1024)
+#define FRAME_SIZE (24 * 1024)
+#define KEYFRAME_INTERVAL 60
+
+static void Key_Make(uint8_t key[FANOUT_KEY_SIZE], uint8_t value)
+{
+    memset(key, value, FANOUT_KEY_SIZE);
+}
+
+TEST(new_viewer_waits_for_a_keyframe)
+{
+    Fanout fanout;
+    Fanout_Init(&fanout, NULL);
+    uint8_t a[FANOUT_KEY_SIZE], b[FANOUT_KEY_SIZE];
+    Key_Make(a, 1);
+    Key_Make(b, 2);
+    uint8_t out[FANOUT_MAX_VIEWERS];
+
+    TEST_ASSERT_EQUAL(0, Fanout_Add(&fanout, a, 1000));
+    TEST_ASSERT_TRUE(Fanout_KeyframeNeeded(&fanout, 1000));
+    TEST_ASSERT_EQUAL(0, Fanout_Select(&fanout, 1, FRAME_SIZE, false, out));
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 2, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_EQUAL(0, out[0]);
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 3, FRAME_SIZE, false, out));
+
+    // the second viewer joins mid stream, the first one keeps getting every frame
+    TEST_ASSERT_EQUAL(1, Fanout_Add(&fanout, b, 2000));
+    TEST_ASSERT_EQUAL(2, fanout.count);
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 4, FRAME_SIZE, false, out));
+    TEST_ASSERT_EQUAL(0, out[0]);
+    TEST_ASSERT_EQUAL(2, Fanout_Select(&fanout, 5, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_EQUAL(1, fanout.viewers[1].frames_skipped);
+    TEST_ASSERT_EQUAL(4, fanout.viewers[0].frames_sent);
+}
+
+TEST(add_remove_and_full_set)
+{
+    Fanout fanout;
+    Fanout_Init(&fanout, NULL);
+    uint8_t key[FANOUT_KEY_SIZE];
+    for (int i = 0; i < FANOUT_MAX_VIEWERS; i++)
+    {
+        Key_Make(key, (uint8_t)(i + 1));
+        TEST_ASSERT_EQUAL(i, Fanout_Add(&fanout, key, 0));
+    }
+    Key_Make(key, 100);
+    TEST_ASSERT_EQUAL(-1, Fanout_Add(&fanout, key, 0));
+
+    // the same viewer again keeps its slot and starts over
+    Key_Make(key, 3);
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    Fanout_Select(&fanout, 1, KEYFRAME_SIZE, true, out);
+    TEST_ASSERT_EQUAL(1, fanout.viewers[2].in_flight);
+    TEST_ASSERT_EQUAL(2, Fanout_Add(&fanout, key, 0));
+    TEST_ASSERT_EQUAL(0, fanout.viewers[2].in_flight);
+    TEST_ASSERT_TRUE(fanout.viewers[2].waiting_keyframe);
+    TEST_ASSERT_EQUAL(FANOUT_MAX_VIEWERS, fanout.count);
+
+    TEST_ASSERT_TRUE(Fanout_Remove(&fanout, key));
+    TEST_ASSERT_FALSE(Fanout_Remove(&fanout, key));
+    TEST_ASSERT_EQUAL(-1, Fanout_Find(&fanout, key));
+    Key_Make(key, 100);
+    TEST_ASSERT_EQUAL(2, Fanout_Add(&fanout, key, 0));
+}
+
+TEST(viewer_without_acks_is_skipped_and_resumes_at_a_keyframe)
+{
+    FanoutConfig config = { .max_in_flight = 4 };
+    Fanout fanout;
+    Fanout_Init(&fanout, &config);
+    uint8_t fast[FANOUT_KEY_SIZE], slow[FANOUT_KEY_SIZE];
+    Key_Make(fast, 1);
+    Key_Make(slow, 2);
+    Fanout_Add(&fanout, fast, 0);
+    Fanout_Add(&fanout, slow, 0);
+
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    TEST_ASSERT_EQUAL(2, Fanout_Select(&fanout, 1, KEYFRAME_SIZE, true, out));
+    Fanout_OnAck(&fanout, fast, 1);
+    for (uint32_t sequence = 2; sequence <= 10; sequence++)
+    {
+        Fanout_Select(&fanout, sequence, FRAME_SIZE, false, out);
+        Fanout_OnAck(&fanout, fast, sequence);
+    }
+    TEST_ASSERT_EQUAL(10, fanout.viewers[0].frames_sent);
+    TEST_ASSERT_EQUAL(0, fanout.viewers[0].frames_skipped);
+    TEST_ASSERT_EQUAL(4, fanout.viewers[1].frames_sent);
+    TEST_ASSERT_EQUAL(6, fanout.viewers[1].frames_skipped);
+    TEST_ASSERT_TRUE(fanout.viewers[1].waiting_keyframe);
+
+    // still behind: a keyframe would be skipped too, nobody is asked for one
+    TEST_ASSERT_FALSE(Fanout_KeyframeNeeded(&fanout, 1000));
+
+    // acknowledgments are cumulative, the lost ones do not matter
+    Fanout_OnAck(&fanout, slow, 3);
+    TEST_ASSERT_EQUAL(1, fanout.viewers[1].in_flight);
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 11, FRAME_SIZE, false, out));
+    TEST_ASSERT_TRUE(Fanout_KeyframeNeeded(&fanout, 2000));
+    TEST_ASSERT_EQUAL(2, Fanout_Select(&fanout, 12, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_FALSE(fanout.viewers[1].waiting_keyframe);
+    TEST_ASSERT_EQUAL(2, Fanout_Select(&fanout, 13, FRAME_SIZE, false, out));
+}
+
+TEST(byte_window_holds_back_a_viewer_behind_on_keyframes)
+{
+    FanoutConfig config = { .max_in_flight_bytes = 2 * KEYFRAME_SIZE };
+    Fanout fanout;
+    Fanout_Init(&fanout, &config);
+    uint8_t key[FANOUT_KEY_SIZE];
+    Key_Make(key, 1);
+    Fanout_Add(&fanout, key, 0);
+
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 1, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 2, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_EQUAL(0, Fanout_Select(&fanout, 3, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_EQUAL(2 * KEYFRAME_SIZE, fanout.viewers[0].in_flight_bytes);
+
+    // a frame larger than the whole window still goes once the viewer caught up
+    Fanout_OnAck(&fanout, key, 2);
+    TEST_ASSERT_EQUAL(0, fanout.viewers[0].in_flight_bytes);
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 4, 3 * KEYFRAME_SIZE, true, out));
+}
+
+TEST(unsent_frame_is_taken_back_and_waits_for_a_keyframe)
+{
+    Fanout fanout;
+    Fanout_Init(&fanout, NULL);
+    uint8_t key[FANOUT_KEY_SIZE];
+    Key_Make(key, 1);
+    Fanout_Add(&fanout, key, 0);
+
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 1, KEYFRAME_SIZE, true, out));
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 2, FRAME_SIZE, false, out));
+    Fanout_Unsent(&fanout, out[0]);
+    TEST_ASSERT_EQUAL(1, fanout.viewers[0].in_flight);
+    TEST_ASSERT_EQUAL(KEYFRAME_SIZE, fanout.viewers[0].in_flight_bytes);
+    TEST_ASSERT_EQUAL(1, fanout.viewers[0].frames_sent);
+    TEST_ASSERT_EQUAL(1, fanout.viewers[0].frames_skipped);
+
+    // the frames after the unsent one reference it, the viewer gets nothing until a keyframe
+    TEST_ASSERT_TRUE(Fanout_KeyframeNeeded(&fanout, 1000));
+    TEST_ASSERT_EQUAL(0, Fanout_Select(&fanout, 3, FRAME_SIZE, false, out));
+    TEST_ASSERT_EQUAL(1, Fanout_Select(&fanout, 4, KEYFRAME_SIZE, true, out));
+    Fanout_OnAck(&fanout, key, 4);
+    TEST_ASSERT_EQUAL(0, fanout.viewers[0].in_flight);
+}
+
+TEST(keyframes_are_asked_for_at_most_once_per_interval)
+{
+    FanoutConfig config = { .keyframe_interval_ms = 500 };
+    Fanout fanout;
+    Fanout_Init(&fanout, &config);
+    uint8_t key[FANOUT_KEY_SIZE];
+    Key_Make(key, 1);
+
+    TEST_ASSERT_FALSE(Fanout_KeyframeNeeded(&fanout, 1000000));
+    Fanout_Add(&fanout, key, 1000000);
+    TEST_ASSERT_TRUE(Fanout_KeyframeNeeded(&fanout, 1000000));
+    TEST_ASSERT_FALSE(Fanout_KeyframeNeeded(&fanout, 1100000));
+    TEST_ASSERT_TRUE(Fanout_KeyframeNeeded(&fanout, 1500000));
+    TEST_ASSERT_EQUAL(2, fanout.keyframes_asked);
+
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    Fanout_Select(&fanout, 1, KEYFRAME_SIZE, true, out);
+    TEST_ASSERT_FALSE(Fanout_KeyframeNeeded(&fanout, 3000000));
+}
+
+TEST(sequence_wraps_around)
+{
+    Fanout fanout;
+    Fanout_Init(&fanout, NULL);
+    uint8_t key[FANOUT_KEY_SIZE];
+    Key_Make(key, 1);
+    Fanout_Add(&fanout, key, 0);
+
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    uint32_t sequence = UINT32_MAX - 1;
+    Fanout_Select(&fanout, sequence++, KEYFRAME_SIZE, true, out);
+    Fanout_Select(&fanout, sequence++, FRAME_SIZE, false, out);
+    Fanout_Select(&fanout, sequence++, FRAME_SIZE, false, out);
+    TEST_ASSERT_EQUAL(3, fanout.viewers[0].in_flight);
+
+    // an old acknowledgment frees nothing past it
+    Fanout_OnAck(&fanout, key, UINT32_MAX - 3);
+    TEST_ASSERT_EQUAL(3, fanout.viewers[0].in_flight);
+    Fanout_OnAck(&fanout, key, UINT32_MAX);
+    TEST_ASSERT_EQUAL(1, fanout.viewers[0].in_flight);
+    Fanout_OnAck(&fanout, key, 0);
+    TEST_ASSERT_EQUAL(0, fanout.viewers[0].in_flight);
+}
+
+//
+// over the local relay
+//
+
+// one viewer on its own thread: reassembles frames, checks that each one continues the chain its
+// decoder is on, and acknowledges it after decode_ms
+typedef struct {
+    DerpNet* net;
+    DerpKey secret;
+    DerpKey public_key;
+    const DerpKey* sharer;
+    uint32_t decode_ms;
+    BuddyThread thread;
+
+    uint32_t frames;
+    uint32_t keyframes;
+    uint32_t broken;          // frame that does not follow the last one and is no keyframe
+    uint64_t bytes;
+} Viewer;
+
+static void Viewer_Run(void* arg)
+{
+    Viewer* viewer = arg;
+    uint32_t expected = 0;
+    uint32_t received = 0;
+    uint32_t sequence = 0;
+    uint32_t last = 0;
+    bool keyframe = false;
+    bool decoding = false;
+
+    for (;;)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(viewer->net, &from, &data, &size, true) < 0 || (size == 1 && data[0] == FRAME_END))
+        {
+            break;
+        }
+
+        if (expected == 0)
+        {
+            if (size < FRAME_HEADER_SIZE)
+            {
+                continue;
+            }
+            sequence = Get32LE(data);
+            expected = Get32LE(data + 4);
+            keyframe = data[8] != 0;
+            received = 0;
+            data += FRAME_HEADER_SIZE;
+            size -= FRAME_HEADER_SIZE;
+        }
+        received += size;
+        viewer->bytes += size;
+        if (received < expected)
+        {
+            continue;
+        }
+
+        if (!keyframe && (!decoding || sequence != last + 1))
+        {
+            viewer->broken++;
+        }
+        decoding = true;
+        last = sequence;
+        viewer->frames++;
+        viewer->keyframes += keyframe;
+        expected = 0;
+
+        if (viewer->decode_ms)
+        {
+            BuddyThread_Sleep(viewer->decode_ms);
+        }
+        uint8_t ack[4];
+        Set32LE(ack, sequence);
+        if (!DerpNet_Send(viewer->net, viewer->sharer, ack, sizeof(ack)))
+        {
+            break;
+        }
+    }
+}
+
+typedef struct {
+    DerpRelay* relay;
+    DerpNet* net;
+    DerpKey secret;
+    DerpKey public_key;
+    Viewer viewers[FANOUT_MAX_VIEWERS];
+    uint32_t viewer_count;
+    Fanout fanout;
+    uint8_t* frame;
+} Share;
+
+static bool Share_Open(Share* share, uint32_t viewers, uint32_t slow_decode_ms)
+{
+    memset(share, 0, sizeof(*share));
+    DerpRelayConfig config = { .threads = 2 };
+    share->relay = DerpRelay_Start(&config);
+    if (!share->relay)
+    {
+        return false;
+    }
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", DerpRelay_GetPort(share->relay));
+
+    DerpNet_CreateNewKey(&share->secret);
+    DerpNet_GetPublicKey(&share->secret, &share->public_key);
+    share->net = malloc(sizeof(DerpNet));
+    if (!DerpNet_Open(share->net, address, &share->secret))
+    {
+        return false;
+    }
+    Fanout_Init(&share->fanout, NULL);
+
+    share->frame = malloc(KEYFRAME_SIZE);
+    for (uint32_t i = 0; i < KEYFRAME_SIZE; i++)
+    {
+        share->frame[i] = (uint8_t)(i * 31);
+    }
+
+    for (uint32_t i = 0; i < viewers; i++)
+    {
+        Viewer* viewer = &share->viewers[i];
+        DerpNet_CreateNewKey(&viewer->secret);
+        DerpNet_GetPublicKey(&viewer->secret, &viewer->public_key);
+        viewer->net = malloc(sizeof(DerpNet));
+        viewer->sharer = &share->public_key;
+        viewer->decode_ms = i == 0 ? slow_decode_ms : 0;
+        if (!DerpNet_Open(viewer->net, address, &viewer->secret) || !BuddyThread_Start(&viewer->thread, Viewer_Run, viewer))
+        {
+            return false;
+        }
+        share->viewer_count++;
+        Fanout_Add(&share->fanout, viewer->public_key.Bytes, BuddyClock_NowUs());
+    }
+    return true;
+}
+
+static void Share_TakeAcks(Share* share)
+{
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    while (DerpNet_Recv(share->net, &from, &data, &size, false) > 0)
+    {
+        if (size == 4)
+        {
+            Fanout_OnAck(&share->fanout, from.Bytes, Get32LE(data));
+        }
+    }
+}
+
+// what the sharer does per encoded frame: picks the viewers, seals every chunk for each, writes
+static bool Share_SendFrame(Share* share, uint32_t sequence, bool keyframe)
+{
+    uint32_t size = keyframe ? KEYFRAME_SIZE : FRAME_SIZE;
+    uint8_t header[FRAME_HEADER_SIZE];
+    Set32LE(header, sequence);
+    Set32LE(header + 4, size);
+    header[8] = keyframe;
+
+    uint8_t out[FANOUT_MAX_VIEWERS];
+    uint32_t count = Fanout_Select(&share->fanout, sequence, size, keyframe, out);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const DerpKey* key = &share->viewers[out[i]].public_key;
+        uint32_t offset = 0;
+        while (offset < size)
+        {
+            uint32_t chunk = size - offset < VIDEO_CHUNK_SIZE - FRAME_HEADER_SIZE ? size - offset : VIDEO_CHUNK_SIZE - FRAME_HEADER_SIZE;
+            DerpNetIoVec iov[] =
+            {
+                { header, offset == 0 ? FRAME_HEADER_SIZE : 0 },
+                { share->frame + offset, chunk },
+            };
+            if (!DerpNet_QueueV(share->net, key, iov, 2))
+            {
+                return false;
+            }
+            offset += chunk;
+        }
+    }
+    return DerpNet_Flush(share->net);
+}
+
+static uint64_t ThreadCpuUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// frames at interval_us, a keyframe every KEYFRAME_INTERVAL frames and whenever the fan-out asks;
+// returns the sharer's CPU time
+static uint64_t Share_Stream(Share* share, uint32_t frames, uint32_t interval_us)
+{
+    uint64_t cpu = 0;
+    uint64_t next = BuddyClock_NowUs();
+    for (uint32_t sequence = 1; sequence <= frames; sequence++)
+    {
+        while (BuddyClock_NowUs() < next)
+        {
+            BuddyThread_Sleep(1);
+        }
+        next += interval_us;
+
+        uint64_t start = ThreadCpuUs();
+        Share_TakeAcks(share);
+        bool keyframe = sequence % KEYFRAME_INTERVAL == 1 || Fanout_KeyframeNeeded(&share->fanout, BuddyClock_NowUs());
+        if (!Share_SendFrame(share, sequence, keyframe))
+        {
+            break;
+        }
+        cpu += ThreadCpuUs() - start;
+    }
+    return cpu;
+}
+
+static void Share_Close(Share* share)
+{
+    uint8_t end = FRAME_END;
+    for (uint32_t i = 0; i < share->viewer_count; i++)
+    {
+        DerpNet_Send(share->net, &share->viewers[i].public_key, &end, sizeof(end));
+    }
+    for (uint32_t i = 0; i < share->viewer_count; i++)
+    {
+        BuddyThread_Join(share->viewers[i].thread);
+        DerpNet_Close(share->viewers[i].net);
+        free(share->viewers[i].net);
+    }
+    DerpNet_Close(share->net);
+    free(share->net);
+    free(share->frame);
+    DerpRelay_Stop(share->relay);
+}
+
+TEST(slow_viewer_does_not_hold_back_the_others)
+{
+    Share share;
+    TEST_ASSERT_TRUE(Share_Open(&share, 3, 40));
+    Share_Stream(&share, 180, 8000);
+    Share_Close(&share);
+
+    // the fast ones got every frame as one unbroken chain
+    for (uint32_t i = 1; i < 3; i++)
+    {
+        TEST_ASSERT_EQUAL(180, share.viewers[i].frames);
+        TEST_ASSERT_EQUAL(0, share.viewers[i].broken);
+        TEST_ASSERT_EQUAL(0, share.fanout.viewers[i].frames_skipped);
+    }
+
+    // the slow one got what it could take, each run of frames starting at a keyframe
+    Viewer* slow = &share.viewers[0];
+    TEST_ASSERT_TRUE(slow->frames > 0 && slow->frames < 180);
+    TEST_ASSERT_EQUAL(0, slow->broken);
+    TEST_ASSERT_TRUE(share.fanout.viewers[0].frames_skipped > 0);
+    TEST_ASSERT_EQUAL(slow->frames, share.fanout.viewers[0].frames_sent);
+}
+
+TEST(benchmark_sharer_cpu_per_viewer)
+{
+    static const uint32_t counts[] = { 1, 2, 4, 8 };
+    const uint32_t frames = 240;
+    printf("\n    %-8s %12s %14s %14s\n", "viewers", "cpu us/frame", "per viewer us", "frames each");
+    double base = 0;
+    for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        Share share;
+        TEST_ASSERT_TRUE(Share_Open(&share, counts[c], 0));
+        uint64_t cpu = Share_Stream(&share, frames, 4000);
+        size_t misses = share.net->SharedKeyMisses;
+        Share_Close(&share);
+
+        uint32_t fewest = frames;
+        for (uint32_t i = 0; i < counts[c]; i++)
+        {
+            fewest = share.viewers[i].frames < fewest ? share.viewers[i].frames : fewest;
+        }
+        double per_frame = (double)cpu / frames;
+        if (c == 0)
+        {
+            base = per_frame;
+        }
+        printf("    %-8u %12.1f %14.1f %14u\n", counts[c], per_frame, counts[c] > 1 ? (per_frame - base) / (counts[c] - 1) : per_frame, fewest);
+
+        // every viewer's key computed once for sealing, once more when its first ack came in
+        TEST_ASSERT_TRUE(misses <= 2 * counts[c]);
+        TEST_ASSERT_TRUE(fewest >= frames * 9 / 10);
+    }
+    printf("    ");
+}
+
+int main(void)
+{
+    TEST_INIT();
+
+    RUN_TEST(new_viewer_waits_for_a_keyframe);
+    RUN_TEST(add_remove_and_full_set);
+    RUN_TEST(viewer_without_acks_is_skipped_and_resumes_at_a_keyframe);
+    RUN_TEST(byte_window_holds_back_a_viewer_behind_on_keyframes);
+    RUN_TEST(unsent_frame_is_taken_back_and_waits_for_a_keyframe);
+    RUN_TEST(keyframes_are_asked_for_at_most_once_per_interval);
+    RUN_TEST(sequence_wraps_around);
+    RUN_TEST(slow_viewer_does_not_hold_back_the_others);
+    RUN_TEST(benchmark_sharer_cpu_per_viewer);
+
+    TEST_SUMMARY();
+    return g_test_ctx.failed > 0 ? 1 : 0;
+}
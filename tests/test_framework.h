@@ -1,8 +1,10 @@
 #pragma once
 
+#if defined(_WIN32)
 #define UNICODE
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#endif
 #include <stdio.h>
 #include <stdbool.h>
 
@@ -0,0 +1,267 @@
+// Unit tests for viewer input batching: move coalescing, wire format and decoder checks
+#include <stdio.h>
+#include <string.h>
+#include "test_framework.h"
+#include "input_batch.h"
+
+#define MOUSE_PACKET_SIZE 10       // sizeof(Buddy_MousePacket), one packet per event before batching
+#define FRAME_OVERHEAD 77          // DERPNET_FRAME_OVERHEAD + BUDDY_PACKET_* byte
+
+static InputEvent Move(int16_t x, int16_t y)
+{
+    InputEvent event = { .type = INPUT_EVENT_MOVE, .x = x, .y = y };
+    return event;
+}
+
+static InputEvent Button(int16_t x, int16_t y, int16_t button, uint8_t down)
+{
+    InputEvent event = { .type = INPUT_EVENT_BUTTON, .x = x, .y = y, .button = button, .down = down };
+    return event;
+}
+
+TEST(consecutive_moves_keep_newest_position)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+
+    for (int16_t i = 0; i < 100; i++)
+    {
+        InputEvent event = Move(i, (int16_t)(2 * i));
+        TEST_ASSERT_TRUE(InputBatch_Add(&batch, &event));
+    }
+    TEST_ASSERT_EQUAL(1, batch.count);
+    TEST_ASSERT_EQUAL(99, batch.events[0].x);
+    TEST_ASSERT_EQUAL(198, batch.events[0].y);
+    TEST_ASSERT_EQUAL(100, batch.events_added);
+    TEST_ASSERT_EQUAL(99, batch.moves_merged);
+}
+
+TEST(moves_around_clicks_are_kept_in_order)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+
+    // drag: move, press, move, move, release, move
+    InputEvent events[] =
+    {
+        Move(10, 10), Button(10, 10, 0, 1), Move(20, 20), Move(30, 30), Button(30, 30, 0, 0), Move(40, 40),
+    };
+    for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+    {
+        TEST_ASSERT_TRUE(InputBatch_Add(&batch, &events[i]));
+    }
+
+    TEST_ASSERT_EQUAL(5, batch.count);
+    TEST_ASSERT_EQUAL(INPUT_EVENT_MOVE, batch.events[0].type);
+    TEST_ASSERT_EQUAL(INPUT_EVENT_BUTTON, batch.events[1].type);
+    TEST_ASSERT_EQUAL(INPUT_EVENT_MOVE, batch.events[2].type);
+    TEST_ASSERT_EQUAL(30, batch.events[2].x);
+    TEST_ASSERT_EQUAL(INPUT_EVENT_BUTTON, batch.events[3].type);
+    TEST_ASSERT_EQUAL(0, batch.events[3].down);
+    TEST_ASSERT_EQUAL(40, batch.events[4].x);
+}
+
+TEST(full_batch_refuses_until_taken)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+
+    InputEvent key = { .type = INPUT_EVENT_KEY, .virtual_key = 'A', .down = 1 };
+    for (uint32_t i = 0; i < INPUT_BATCH_MAX_EVENTS; i++)
+    {
+        TEST_ASSERT_TRUE(InputBatch_Add(&batch, &key));
+    }
+    TEST_ASSERT_FALSE(InputBatch_Add(&batch, &key));
+
+    // a move can still replace a trailing move in a full batch
+    InputBatch_Init(&batch);
+    for (uint32_t i = 0; i + 1 < INPUT_BATCH_MAX_EVENTS; i++)
+    {
+        TEST_ASSERT_TRUE(InputBatch_Add(&batch, &key));
+    }
+    InputEvent move = Move(1, 1);
+    TEST_ASSERT_TRUE(InputBatch_Add(&batch, &move));
+    move.x = 2;
+    TEST_ASSERT_TRUE(InputBatch_Add(&batch, &move));
+    TEST_ASSERT_EQUAL(INPUT_BATCH_MAX_EVENTS, batch.count);
+
+    uint8_t wire[INPUT_BATCH_MAX_SIZE];
+    uint32_t size = InputBatch_Take(&batch, wire);
+    TEST_ASSERT_TRUE(size > 0 && size <= INPUT_BATCH_MAX_SIZE);
+    TEST_ASSERT_EQUAL(0, batch.count);
+    TEST_ASSERT_EQUAL(1, batch.batches);
+    TEST_ASSERT_TRUE(InputBatch_Add(&batch, &key));
+}
+
+TEST(empty_batch_takes_nothing)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+    uint8_t wire[INPUT_BATCH_MAX_SIZE];
+    TEST_ASSERT_EQUAL(0, InputBatch_Take(&batch, wire));
+    TEST_ASSERT_EQUAL(0, batch.batches);
+}
+
+TEST(roundtrip_every_event_type)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+
+    InputEvent in[] =
+    {
+        Move(-5, 32767),
+        Button(100, 200, 4, 1),
+        { .type = INPUT_EVENT_WHEEL, .x = 7, .y = -8, .delta = -120, .down = 1 },
+        { .type = INPUT_EVENT_KEY, .virtual_key = 0x25, .scan_code = 0x4B, .flags = 1, .down = 0 },
+        Move(-32768, 0),
+    };
+    uint32_t count = sizeof(in) / sizeof(in[0]);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_TRUE(InputBatch_Add(&batch, &in[i]));
+    }
+
+    uint8_t wire[INPUT_BATCH_MAX_SIZE];
+    uint32_t size = InputBatch_Take(&batch, wire);
+    TEST_ASSERT_EQUAL(1 + 5 + 7 + 8 + 8 + 5, size);
+
+    // little-endian on the wire regardless of host
+    TEST_ASSERT_EQUAL(5, wire[0]);
+    TEST_ASSERT_EQUAL(INPUT_EVENT_MOVE, wire[1]);
+    TEST_ASSERT_EQUAL(0xFB, wire[2]);
+    TEST_ASSERT_EQUAL(0xFF, wire[3]);
+    TEST_ASSERT_EQUAL(0xFF, wire[4]);
+    TEST_ASSERT_EQUAL(0x7F, wire[5]);
+
+    InputEvent out[INPUT_BATCH_MAX_EVENTS];
+    TEST_ASSERT_EQUAL((int)count, InputBatch_Decode(wire, size, out, INPUT_BATCH_MAX_EVENTS));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL(in[i].type, out[i].type);
+        TEST_ASSERT_EQUAL(in[i].x, out[i].x);
+        TEST_ASSERT_EQUAL(in[i].y, out[i].y);
+        TEST_ASSERT_EQUAL(in[i].button, out[i].button);
+        TEST_ASSERT_EQUAL(in[i].delta, out[i].delta);
+        TEST_ASSERT_EQUAL(in[i].virtual_key, out[i].virtual_key);
+        TEST_ASSERT_EQUAL(in[i].scan_code, out[i].scan_code);
+        TEST_ASSERT_EQUAL(in[i].flags, out[i].flags);
+        TEST_ASSERT_EQUAL(in[i].down, out[i].down);
+    }
+}
+
+TEST(decoder_rejects_malformed_payloads)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+    InputEvent events[] = { Move(1, 2), Button(1, 2, 0, 1) };
+    InputBatch_Add(&batch, &events[0]);
+    InputBatch_Add(&batch, &events[1]);
+
+    uint8_t wire[INPUT_BATCH_MAX_SIZE + 1];
+    uint32_t size = InputBatch_Take(&batch, wire);
+    InputEvent out[INPUT_BATCH_MAX_EVENTS];
+    TEST_ASSERT_EQUAL(2, InputBatch_Decode(wire, size, out, INPUT_BATCH_MAX_EVENTS));
+
+    // every truncation fails
+    for (uint32_t cut = 0; cut < size; cut++)
+    {
+        TEST_ASSERT_EQUAL(-1, InputBatch_Decode(wire, cut, out, INPUT_BATCH_MAX_EVENTS));
+    }
+
+    // trailing garbage
+    wire[size] = 0;
+    TEST_ASSERT_EQUAL(-1, InputBatch_Decode(wire, size + 1, out, INPUT_BATCH_MAX_EVENTS));
+
+    // more events than the caller has room for
+    TEST_ASSERT_EQUAL(-1, InputBatch_Decode(wire, size, out, 1));
+
+    // unknown event type
+    wire[1] = INPUT_EVENT_COUNT;
+    TEST_ASSERT_EQUAL(-1, InputBatch_Decode(wire, size, out, INPUT_BATCH_MAX_EVENTS));
+
+    // zero events
+    uint8_t empty[1] = { 0 };
+    TEST_ASSERT_EQUAL(-1, InputBatch_Decode(empty, sizeof(empty), out, INPUT_BATCH_MAX_EVENTS));
+}
+
+static void Flush(InputBatch* batch, uint32_t* packets, uint64_t* bytes)
+{
+    uint8_t wire[INPUT_BATCH_MAX_SIZE];
+    uint32_t size = InputBatch_Take(batch, wire);
+    if (size)
+    {
+        (*packets)++;
+        *bytes += FRAME_OVERHEAD + size;
+    }
+}
+
+// 1000 Hz mouse moving for one second with a click every 100 ms and a key every 250 ms.
+// Like the viewer, moves wait for the next presented frame at 60 fps, clicks and keys go at once.
+TEST(benchmark_packets_per_second_for_1000hz_mouse)
+{
+    InputBatch batch;
+    InputBatch_Init(&batch);
+
+    uint32_t events = 0, packets = 0;
+    uint64_t bytes = 0;
+    uint32_t frame = 0;
+    for (uint32_t ms = 0; ms < 1000; ms++)
+    {
+        InputEvent move = Move((int16_t)(ms % 640), (int16_t)((ms * 3) % 480));
+        InputBatch_Add(&batch, &move);
+        events++;
+
+        if (ms % 100 == 50)
+        {
+            InputEvent press = Button(move.x, move.y, 0, 1);
+            InputEvent release = Button(move.x, move.y, 0, 0);
+            InputBatch_Add(&batch, &press);
+            InputBatch_Add(&batch, &release);
+            events += 2;
+            Flush(&batch, &packets, &bytes);
+        }
+        if (ms % 250 == 0)
+        {
+            InputEvent key = { .type = INPUT_EVENT_KEY, .virtual_key = 'W', .down = 1 };
+            InputBatch_Add(&batch, &key);
+            events++;
+            Flush(&batch, &packets, &bytes);
+        }
+
+        if (ms + 1 >= (frame + 1) * 1000 / 60)
+        {
+            Flush(&batch, &packets, &bytes);
+            frame++;
+        }
+    }
+    Flush(&batch, &packets, &bytes);
+
+    uint64_t unbatched_bytes = (uint64_t)events * (FRAME_OVERHEAD + MOUSE_PACKET_SIZE - 1);
+    printf("\n    %-26s %10s %12s\n", "", "packets/s", "wire bytes/s");
+    printf("    %-26s %10u %12llu\n", "one packet per event", events, (unsigned long long)unbatched_bytes);
+    printf("    %-26s %10u %12llu\n", "batched", packets, (unsigned long long)bytes);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(packets <= 60 + 10 + 4 + 1);
+    TEST_ASSERT_TRUE(bytes * 10 < unbatched_bytes);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Input Batching Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(consecutive_moves_keep_newest_position);
+    RUN_TEST(moves_around_clicks_are_kept_in_order);
+    RUN_TEST(full_batch_refuses_until_taken);
+    RUN_TEST(empty_batch_takes_nothing);
+    RUN_TEST(roundtrip_every_event_type);
+    RUN_TEST(decoder_rejects_malformed_payloads);
+    RUN_TEST(benchmark_packets_per_second_for_1000hz_mouse);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,261 @@
+// Unit tests for frame timing headers, clock offset estimation and latency percentiles
+#include <stdio.h>
+#include <string.h>
+#include "test_framework.h"
+#include "latency.h"
+
+// viewer clock = sharer clock + k_ViewerOffset
+static const int64_t k_ViewerOffset = -3600LL * 1000000LL + 12345;
+
+static uint64_t ToViewer(uint64_t sharer_us) { return (uint64_t)((int64_t)sharer_us + k_ViewerOffset); }
+
+TEST(video_header_roundtrip)
+{
+    LatencyVideoHeader in = {
+        .size = 0x01020304,
+        .sequence = 0xFFFFFFFE,
+        .capture_us = 0x1122334455667788ULL,
+        .send_us = 0x1122334455667799ULL,
+        .offset_us = -42,
+        .flags = LATENCY_FLAG_OFFSET_VALID,
+    };
+    uint8_t wire[LATENCY_VIDEO_HEADER_SIZE];
+    Latency_PackVideoHeader(wire, &in);
+
+    // little-endian on the wire regardless of host
+    TEST_ASSERT_EQUAL(0x04, wire[0]);
+    TEST_ASSERT_EQUAL(0x01, wire[3]);
+    TEST_ASSERT_EQUAL(0x88, wire[8]);
+    TEST_ASSERT_EQUAL(0xFF, wire[31]);
+
+    LatencyVideoHeader out;
+    Latency_UnpackVideoHeader(wire, &out);
+    TEST_ASSERT_EQUAL(in.size, out.size);
+    TEST_ASSERT_EQUAL(in.sequence, out.sequence);
+    TEST_ASSERT_TRUE(in.capture_us == out.capture_us);
+    TEST_ASSERT_TRUE(in.send_us == out.send_us);
+    TEST_ASSERT_EQUAL(-42, out.offset_us);
+    TEST_ASSERT_EQUAL(LATENCY_FLAG_OFFSET_VALID, out.flags);
+}
+
+TEST(echo_roundtrip)
+{
+    LatencyEcho in = { 7, 100, 200, 300, 400, 500 };
+    uint8_t wire[LATENCY_ECHO_SIZE];
+    Latency_PackEcho(wire, &in);
+
+    LatencyEcho out;
+    Latency_UnpackEcho(wire, &out);
+    TEST_ASSERT_EQUAL(7, out.sequence);
+    TEST_ASSERT_EQUAL(100, out.capture_us);
+    TEST_ASSERT_EQUAL(200, out.sharer_send_us);
+    TEST_ASSERT_EQUAL(300, out.viewer_recv_us);
+    TEST_ASSERT_EQUAL(400, out.viewer_present_us);
+    TEST_ASSERT_EQUAL(500, out.viewer_echo_us);
+}
+
+TEST(offset_exact_with_symmetric_delay)
+{
+    LatencyClockSync sync = { 0 };
+    uint64_t t0 = 5000000;
+    uint64_t t1 = ToViewer(t0 + 10000);   // 10 ms each way
+    uint64_t t2 = t1 + 2000;              // viewer holds it 2 ms
+    uint64_t t3 = t0 + 10000 + 2000 + 10000;
+
+    TEST_ASSERT_TRUE(Latency_SyncAddSample(&sync, t0, t1, t2, t3));
+    TEST_ASSERT_TRUE(sync.valid);
+    TEST_ASSERT_EQUAL(k_ViewerOffset, sync.offset_us);
+    TEST_ASSERT_EQUAL(20000, sync.rtt_us);
+}
+
+TEST(offset_prefers_lowest_rtt_sample)
+{
+    LatencyClockSync sync = { 0 };
+    uint64_t base = 1000000;
+
+    // queued samples: 40 ms extra on the forward path skews the offset by +20 ms
+    for (int i = 0; i < 5; i++)
+    {
+        uint64_t t0 = base + (uint64_t)i * 100000;
+        uint64_t t1 = ToViewer(t0 + 5000 + 40000);
+        uint64_t t2 = t1 + 1000;
+        uint64_t t3 = t0 + 5000 + 40000 + 1000 + 5000;
+        TEST_ASSERT_TRUE(Latency_SyncAddSample(&sync, t0, t1, t2, t3));
+    }
+    TEST_ASSERT_EQUAL(k_ViewerOffset + 20000, sync.offset_us);
+
+    // one clean exchange wins and pins the estimate
+    uint64_t t0 = base + 900000;
+    uint64_t t1 = ToViewer(t0 + 5000);
+    uint64_t t2 = t1 + 1000;
+    uint64_t t3 = t0 + 11000;
+    TEST_ASSERT_TRUE(Latency_SyncAddSample(&sync, t0, t1, t2, t3));
+    TEST_ASSERT_EQUAL(k_ViewerOffset, sync.offset_us);
+    TEST_ASSERT_EQUAL(10000, sync.rtt_us);
+
+    // the clean sample ages out after a full window of noisy ones
+    for (int i = 0; i < LATENCY_SYNC_WINDOW; i++)
+    {
+        uint64_t s0 = base + 2000000 + (uint64_t)i * 100000;
+        uint64_t s1 = ToViewer(s0 + 45000);
+        TEST_ASSERT_TRUE(Latency_SyncAddSample(&sync, s0, s1, s1 + 1000, s0 + 51000));
+    }
+    TEST_ASSERT_EQUAL(k_ViewerOffset + 20000, sync.offset_us);
+}
+
+TEST(offset_rejects_inconsistent_samples)
+{
+    LatencyClockSync sync = { 0 };
+    // viewer claims it held the packet longer than the whole round trip
+    TEST_ASSERT_FALSE(Latency_SyncAddSample(&sync, 1000, 50000, 90000, 2000));
+    // echo "arrived" before the frame was sent
+    TEST_ASSERT_FALSE(Latency_SyncAddSample(&sync, 5000, 100, 200, 4000));
+    TEST_ASSERT_FALSE(sync.valid);
+}
+
+TEST(percentiles_nearest_rank)
+{
+    static LatencyStats stats;
+    memset(&stats, 0, sizeof(stats));
+    TEST_ASSERT_EQUAL(0, Latency_StatsPercentile(&stats, 50.0));
+
+    // insert 100..1 so the sort is exercised
+    for (int i = 100; i >= 1; i--) Latency_StatsAdd(&stats, i * 1000);
+
+    LatencySummary summary;
+    Latency_StatsSummary(&stats, &summary);
+    TEST_ASSERT_EQUAL(100, summary.count);
+    TEST_ASSERT_EQUAL(50000, summary.p50_us);
+    TEST_ASSERT_EQUAL(95000, summary.p95_us);
+    TEST_ASSERT_EQUAL(99000, summary.p99_us);
+    TEST_ASSERT_EQUAL(1000, Latency_StatsPercentile(&stats, 0.0));
+    TEST_ASSERT_EQUAL(100000, Latency_StatsPercentile(&stats, 100.0));
+}
+
+TEST(percentiles_use_sliding_window)
+{
+    static LatencyStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    for (int i = 0; i < LATENCY_STATS_WINDOW; i++) Latency_StatsAdd(&stats, 1000000);
+    for (int i = 0; i < LATENCY_STATS_WINDOW; i++) Latency_StatsAdd(&stats, 5000);
+
+    LatencySummary summary;
+    Latency_StatsSummary(&stats, &summary);
+    TEST_ASSERT_EQUAL(LATENCY_STATS_WINDOW, summary.count);
+    TEST_ASSERT_EQUAL(5000, summary.p99_us);
+    TEST_ASSERT_EQUAL(2 * LATENCY_STATS_WINDOW, stats.total);
+}
+
+TEST(sequence_gaps_and_wraparound)
+{
+    LatencySequence seq = { 0 };
+    TEST_ASSERT_EQUAL(0, Latency_SequenceObserve(&seq, 0xFFFFFFFD));
+    TEST_ASSERT_EQUAL(0, Latency_SequenceObserve(&seq, 0xFFFFFFFE));
+    TEST_ASSERT_EQUAL(1, Latency_SequenceObserve(&seq, 0x00000000));  // lost 0xFFFFFFFF
+    TEST_ASSERT_EQUAL(2, Latency_SequenceObserve(&seq, 0x00000003));  // lost 1, 2
+    TEST_ASSERT_EQUAL(0, Latency_SequenceObserve(&seq, 0x00000002));  // late
+    TEST_ASSERT_EQUAL(0, Latency_SequenceObserve(&seq, 0x00000004));
+    TEST_ASSERT_EQUAL(3, seq.lost);
+    TEST_ASSERT_EQUAL(1, seq.late);
+    TEST_ASSERT_EQUAL(6, seq.received);
+}
+
+TEST(end_to_end_glass_latency_both_sides)
+{
+    LatencyTracker sharer, viewer;
+    Latency_Reset(&sharer);
+    Latency_Reset(&viewer);
+
+    const uint64_t one_way = 15000;
+    const uint64_t encode = 8000;
+    const uint64_t decode_present = 12000;
+    uint64_t now = 10000000;
+    bool viewer_samples = false;
+
+    for (int frame = 0; frame < 30; frame++, now += 33333)
+    {
+        uint64_t capture = now;
+        uint64_t send = capture + encode;
+
+        LatencyVideoHeader header;
+        Latency_SharerStampFrame(&sharer, &header, 1000, capture, send);
+        TEST_ASSERT_EQUAL((uint32_t)frame, header.sequence);
+
+        uint8_t wire[LATENCY_VIDEO_HEADER_SIZE];
+        Latency_PackVideoHeader(wire, &header);
+        LatencyVideoHeader received;
+        Latency_UnpackVideoHeader(wire, &received);
+
+        uint64_t recv = ToViewer(send + one_way);
+        uint64_t present = recv + decode_present;
+        TEST_ASSERT_EQUAL(0, Latency_SequenceObserve(&viewer.sequence, received.sequence));
+        viewer_samples |= Latency_ViewerOnPresent(&viewer, &received, present);
+
+        if (Latency_ViewerShouldEcho(&viewer, present))
+        {
+            LatencyEcho echo = {
+                .sequence = received.sequence,
+                .capture_us = received.capture_us,
+                .sharer_send_us = received.send_us,
+                .viewer_recv_us = recv,
+                .viewer_present_us = present,
+                .viewer_echo_us = present + 100,
+            };
+            uint8_t echo_wire[LATENCY_ECHO_SIZE];
+            Latency_PackEcho(echo_wire, &echo);
+            LatencyEcho echo_in;
+            Latency_UnpackEcho(echo_wire, &echo_in);
+
+            uint64_t echo_arrival = send + one_way + decode_present + 100 + one_way;
+            TEST_ASSERT_TRUE(Latency_SharerOnEcho(&sharer, &echo_in, echo_arrival));
+        }
+    }
+
+    const int64_t expected = (int64_t)(encode + one_way + decode_present);
+    LatencySummary summary;
+
+    Latency_StatsSummary(&sharer.glass, &summary);
+    TEST_ASSERT_TRUE(summary.count >= 2);
+    TEST_ASSERT_EQUAL(expected, summary.p50_us);
+    TEST_ASSERT_EQUAL(expected, summary.p99_us);
+
+    // the viewer starts measuring once the sharer has an offset to share
+    TEST_ASSERT_TRUE(viewer_samples);
+    Latency_StatsSummary(&viewer.glass, &summary);
+    TEST_ASSERT_EQUAL(expected, summary.p50_us);
+    TEST_ASSERT_EQUAL(expected, summary.p95_us);
+    TEST_ASSERT_EQUAL(0, viewer.sequence.lost);
+}
+
+TEST(echo_interval)
+{
+    LatencyTracker tracker;
+    Latency_Reset(&tracker);
+    TEST_ASSERT_TRUE(Latency_ViewerShouldEcho(&tracker, 1000000));
+    TEST_ASSERT_FALSE(Latency_ViewerShouldEcho(&tracker, 1000000 + LATENCY_ECHO_INTERVAL_US - 1));
+    TEST_ASSERT_TRUE(Latency_ViewerShouldEcho(&tracker, 1000000 + LATENCY_ECHO_INTERVAL_US));
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Frame Timing / Latency Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(video_header_roundtrip);
+    RUN_TEST(echo_roundtrip);
+    RUN_TEST(offset_exact_with_symmetric_delay);
+    RUN_TEST(offset_prefers_lowest_rtt_sample);
+    RUN_TEST(offset_rejects_inconsistent_samples);
+    RUN_TEST(percentiles_nearest_rank);
+    RUN_TEST(percentiles_use_sliding_window);
+    RUN_TEST(sequence_gaps_and_wraparound);
+    RUN_TEST(end_to_end_glass_latency_both_sides);
+    RUN_TEST(echo_interval);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,698 @@
+// Tests and benchmark for the network I/O thread and its channel queues (net_thread.c),
+// driving a real DerpNet connection through the local epoll relay
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // local relay speaks plain HTTP, like the Docker derper on 8080
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "latency.h"
+#include "net_thread.h"
+
+// first byte of every packet, same values as BUDDY_PACKET_* in ScreenBuddy.c
+enum {
+    PACKET_VIDEO = 0,
+    PACKET_DISCONNECT = 1,
+    PACKET_MOUSE_MOVE = 2,
+    PACKET_FILE_DATA = 8,
+    PACKET_TIMING_ECHO = 11,
+    PACKET_UNKNOWN = 0xee,
+};
+
+#define MOUSE_PACKET_SIZE 10       // sizeof(Buddy_MousePacket)
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define BENCH_BURST_CHUNKS 32      // one ~2 MB keyframe
+#define BENCH_BURST_MS 60          // one keyframe per period, the consumer keeps up on average
+#define BENCH_VIDEO_CHUNKS (40 * BENCH_BURST_CHUNKS)
+#define BENCH_MOUSE_EVERY 4        // one mouse packet per this many video chunks
+#define BENCH_DECODE_MS 1          // consumer time per video chunk, stands in for decode + paint
+
+typedef struct {
+    DerpRelay* relay;
+    char address[32];
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];               // net[0] sends, net[1] is read by the thread
+
+    NetThread thread;
+    BuddyMutex lock;
+    BuddyCond cond;
+    uint32_t data_events;
+    uint32_t disconnect_events;
+    uint32_t worker_events;
+
+    // pacing: every flush may write this many bytes past urgent frames (0 = unpaced), and the
+    // thread comes back for another flush after wait_ms
+    size_t pace_bytes;
+    uint32_t wait_ms;
+} Session;
+
+static int Session_Recv(void* context, NetPacket* packet)
+{
+    Session* session = context;
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    int got = DerpNet_Recv(session->net[1], &from, &data, &size, false);
+    if (got > 0)
+    {
+        memcpy(packet->peer, from.Bytes, sizeof(packet->peer));
+        packet->data = data;
+        packet->size = size;
+    }
+    return got;
+}
+
+static bool Session_Flush(void* context)
+{
+    Session* session = context;
+    if (session->pace_bytes)
+    {
+        DerpNet_SetSendAllowance(session->net[1], session->pace_bytes);
+    }
+    return DerpNet_OnWritable(session->net[1]);
+}
+
+static uint32_t Session_Wait(void* context)
+{
+    Session* session = context;
+    return session->wait_ms;
+}
+
+static int Session_Classify(void* context, const NetPacket* packet)
+{
+    (void)context;
+    if (packet->size == 0) return NET_CHANNEL_CONTROL;
+    switch (packet->data[0])
+    {
+    case PACKET_VIDEO: return NET_CHANNEL_VIDEO;
+    case PACKET_MOUSE_MOVE: return NET_CHANNEL_INPUT;
+    case PACKET_FILE_DATA: return NET_CHANNEL_FILE;
+    case PACKET_DISCONNECT:
+    case PACKET_TIMING_ECHO: return NET_CHANNEL_CONTROL;
+    default: return NET_CHANNEL_COUNT;
+    }
+}
+
+static void Session_Notify(void* context, NetThreadEvent event)
+{
+    Session* session = context;
+    BuddyMutex_Lock(&session->lock);
+    if (event == NET_THREAD_DATA) session->data_events++;
+    else if (event == NET_THREAD_WORKER_DATA) session->worker_events++;
+    else session->disconnect_events++;
+    BuddyCond_Broadcast(&session->cond);
+    BuddyMutex_Unlock(&session->lock);
+}
+
+static bool Session_OpenWorker(Session* session, uint32_t video_bytes, uint32_t worker_channels)
+{
+    memset(session, 0, sizeof(*session));
+    session->wait_ms = NET_THREAD_WAIT_FOREVER;
+    BuddyMutex_Init(&session->lock);
+    BuddyCond_Init(&session->cond);
+
+    // the relay must not drop what a slow consumer leaves queued, or the benchmark never finishes
+    DerpRelayConfig relay_config = { .threads = 2, .max_queue = 2 * (size_t)BENCH_VIDEO_CHUNKS * VIDEO_CHUNK_SIZE };
+    session->relay = DerpRelay_Start(&relay_config);
+    if (!session->relay) return false;
+    snprintf(session->address, sizeof(session->address), "127.0.0.1:%u", DerpRelay_GetPort(session->relay));
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&session->secret[i]);
+        DerpNet_GetPublicKey(&session->secret[i], &session->public_key[i]);
+        session->net[i] = malloc(sizeof(DerpNet));
+        if (!DerpNet_Open(session->net[i], session->address, &session->secret[i])) return false;
+    }
+
+    NetThreadConfig config =
+    {
+        .socket_fd = session->net[1]->EventFd,
+        .channel_bytes = { [NET_CHANNEL_VIDEO] = video_bytes },
+        .worker_channels = worker_channels,
+        .recv = Session_Recv,
+        .flush = Session_Flush,
+        .wait = Session_Wait,
+        .classify = Session_Classify,
+        .notify = Session_Notify,
+        .context = session,
+    };
+    return NetThread_Start(&session->thread, &config);
+}
+
+static bool Session_Open(Session* session, uint32_t video_bytes)
+{
+    return Session_OpenWorker(session, video_bytes, 0);
+}
+
+static void Session_Close(Session* session)
+{
+    NetThread_Stop(&session->thread);
+    for (int i = 0; i < 2; i++)
+    {
+        if (session->net[i])
+        {
+            DerpNet_Close(session->net[i]);
+            free(session->net[i]);
+        }
+    }
+    if (session->relay) DerpRelay_Stop(session->relay);
+    BuddyCond_Destroy(&session->cond);
+    BuddyMutex_Destroy(&session->lock);
+}
+
+static bool Session_Send(Session* session, uint8_t type, uint32_t value, uint32_t size)
+{
+    uint8_t packet[VIDEO_CHUNK_SIZE];
+    memset(packet, 0, size);
+    packet[0] = type;
+    if (size >= 5) memcpy(packet + 1, &value, 4);
+    return DerpNet_Send(session->net[0], &session->public_key[1], packet, size);
+}
+
+// Waits until the given channel holds count packets or the thread disconnects
+static bool Session_WaitPackets(Session* session, NetChannel channel, uint32_t count)
+{
+    for (int i = 0; i < 5000; i++)
+    {
+        BuddyMutex_Lock(&session->thread.queue_lock);
+        uint32_t packets = session->thread.channels[channel].packets;
+        BuddyMutex_Unlock(&session->thread.queue_lock);
+        if (packets >= count) return true;
+        BuddyThread_Sleep(1);
+    }
+    return false;
+}
+
+static uint32_t Packet_Value(const NetPacket* packet)
+{
+    uint32_t value;
+    memcpy(&value, packet->data + 1, 4);
+    return value;
+}
+
+TEST(packets_are_sorted_into_channels_in_order)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 0));
+
+    for (uint32_t i = 0; i < 30; i++)
+    {
+        TEST_ASSERT_TRUE(Session_Send(session, PACKET_VIDEO, i, 1000));
+        TEST_ASSERT_TRUE(Session_Send(session, PACKET_MOUSE_MOVE, i, MOUSE_PACKET_SIZE));
+        if (i % 10 == 0) TEST_ASSERT_TRUE(Session_Send(session, PACKET_FILE_DATA, i, 100));
+    }
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_TIMING_ECHO, 7, 20));
+    TEST_ASSERT_TRUE(DerpNet_Send(session->net[0], &session->public_key[1], NULL, 0));
+    TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_CONTROL, 2));
+
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+
+    uint32_t ready = NetThread_TakeReady(&session->thread);
+    TEST_ASSERT_EQUAL(0xf, ready);
+
+    for (uint32_t i = 0; i < 30; i++)
+    {
+        TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_VIDEO, &packet, buffer));
+        TEST_ASSERT_EQUAL(1000, packet.size);
+        TEST_ASSERT_EQUAL(i, Packet_Value(&packet));
+        TEST_ASSERT_TRUE(memcmp(packet.peer, session->public_key[0].Bytes, 32) == 0);
+
+        TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_INPUT, &packet, buffer));
+        TEST_ASSERT_EQUAL(MOUSE_PACKET_SIZE, packet.size);
+        TEST_ASSERT_EQUAL(i, Packet_Value(&packet));
+    }
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_FILE, &packet, buffer));
+        TEST_ASSERT_EQUAL(i * 10, Packet_Value(&packet));
+    }
+    TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_CONTROL, &packet, buffer));
+    TEST_ASSERT_EQUAL(PACKET_TIMING_ECHO, packet.data[0]);
+
+    // the connection request: an empty packet still comes through with its sender
+    TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_CONTROL, &packet, buffer));
+    TEST_ASSERT_EQUAL(0, packet.size);
+    TEST_ASSERT_TRUE(memcmp(packet.peer, session->public_key[0].Bytes, 32) == 0);
+
+    for (int i = 0; i < NET_CHANNEL_COUNT; i++)
+    {
+        TEST_ASSERT_FALSE(NetThread_Pop(&session->thread, (NetChannel)i, &packet, buffer));
+    }
+    TEST_ASSERT_EQUAL(0, session->thread.dropped);
+
+    free(buffer);
+    Session_Close(session);
+    free(session);
+}
+
+TEST(notify_once_per_batch_until_taken)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 0));
+
+    for (uint32_t i = 0; i < 200; i++)
+    {
+        TEST_ASSERT_TRUE(Session_Send(session, PACKET_MOUSE_MOVE, i, MOUSE_PACKET_SIZE));
+    }
+    TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_INPUT, 200));
+
+    // nothing was taken yet, so 200 packets made exactly one notification
+    TEST_ASSERT_EQUAL(1, session->data_events);
+
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+    TEST_ASSERT_EQUAL(1u << NET_CHANNEL_INPUT, NetThread_TakeReady(&session->thread));
+    while (NetThread_Pop(&session->thread, NET_CHANNEL_INPUT, &packet, buffer)) {}
+
+    // re-armed: the next packet notifies again
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_TIMING_ECHO, 1, 20));
+    BuddyMutex_Lock(&session->lock);
+    while (session->data_events < 2)
+    {
+        TEST_ASSERT_TRUE(BuddyCond_WaitTimeout(&session->cond, &session->lock, 5000));
+    }
+    BuddyMutex_Unlock(&session->lock);
+    TEST_ASSERT_EQUAL(1u << NET_CHANNEL_CONTROL, NetThread_TakeReady(&session->thread));
+
+    free(buffer);
+    Session_Close(session);
+    free(session);
+}
+
+// Waits until the session saw count events of one kind
+static bool Session_WaitEvents(Session* session, const uint32_t* events, uint32_t count)
+{
+    bool ok = true;
+    BuddyMutex_Lock(&session->lock);
+    while (ok && *events < count)
+    {
+        ok = BuddyCond_WaitTimeout(&session->cond, &session->lock, 5000);
+    }
+    BuddyMutex_Unlock(&session->lock);
+    return ok;
+}
+
+TEST(worker_channel_wakes_only_its_worker)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_OpenWorker(session, 0, 1u << NET_CHANNEL_VIDEO));
+
+    for (uint32_t i = 0; i < 20; i++)
+    {
+        TEST_ASSERT_TRUE(Session_Send(session, PACKET_VIDEO, i, 1000));
+    }
+    TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_VIDEO, 20));
+    TEST_ASSERT_TRUE(Session_WaitEvents(session, &session->worker_events, 1));
+
+    // video alone never wakes the main consumer, and its mask leaves the channel out
+    TEST_ASSERT_EQUAL(0, session->data_events);
+    TEST_ASSERT_EQUAL(1, session->worker_events);
+    TEST_ASSERT_EQUAL(0, NetThread_TakeReady(&session->thread));
+
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_MOUSE_MOVE, 1, MOUSE_PACKET_SIZE));
+    TEST_ASSERT_TRUE(Session_WaitEvents(session, &session->data_events, 1));
+    TEST_ASSERT_EQUAL(1u << NET_CHANNEL_INPUT, NetThread_TakeReady(&session->thread));
+
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+    TEST_ASSERT_EQUAL(1u << NET_CHANNEL_VIDEO, NetThread_TakeWorkerReady(&session->thread));
+    for (uint32_t i = 0; i < 20; i++)
+    {
+        TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_VIDEO, &packet, buffer));
+        TEST_ASSERT_EQUAL(i, Packet_Value(&packet));
+    }
+
+    // re-armed on its own: more video notifies the worker again, the main consumer still not
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_VIDEO, 20, 1000));
+    TEST_ASSERT_TRUE(Session_WaitEvents(session, &session->worker_events, 2));
+    TEST_ASSERT_EQUAL(1, session->data_events);
+
+    free(buffer);
+    Session_Close(session);
+    free(session);
+}
+
+TEST(unknown_packets_are_dropped)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 0));
+
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_UNKNOWN, 0, 50));
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_DISCONNECT, 0, 1));
+    TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_CONTROL, 1));
+
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+    TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_CONTROL, &packet, buffer));
+    TEST_ASSERT_EQUAL(PACKET_DISCONNECT, packet.data[0]);
+    TEST_ASSERT_EQUAL(1, session->thread.dropped);
+
+    free(buffer);
+    Session_Close(session);
+    free(session);
+}
+
+TEST(full_channel_stops_reading_without_losing_packets)
+{
+    // room for a few chunks only, the sender gets far ahead of the consumer
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 4 * VIDEO_CHUNK_SIZE));
+
+    const uint32_t count = 100;
+    uint8_t* chunk = calloc(1, VIDEO_CHUNK_SIZE);
+    chunk[0] = PACKET_VIDEO;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        chunk[1] = (uint8_t)i;
+        DerpNet_Queue(session->net[0], &session->public_key[1], chunk, VIDEO_CHUNK_SIZE);
+    }
+    free(chunk);
+    TEST_ASSERT_TRUE(DerpNet_Flush(session->net[0]));
+    TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_VIDEO, 3));
+    BuddyThread_Sleep(50);
+
+    // the thread stalled instead of reading into a full queue
+    BuddyMutex_Lock(&session->thread.queue_lock);
+    uint32_t queued = session->thread.channels[NET_CHANNEL_VIDEO].packets;
+    uint64_t stalls = session->thread.stalls;
+    BuddyMutex_Unlock(&session->thread.queue_lock);
+    TEST_ASSERT_TRUE(queued < count);
+    TEST_ASSERT_TRUE(stalls >= 1);
+
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bool got = false;
+        for (int wait = 0; wait < 5000 && !got; wait++)
+        {
+            got = NetThread_Pop(&session->thread, NET_CHANNEL_VIDEO, &packet, buffer);
+            if (!got) BuddyThread_Sleep(1);
+        }
+        TEST_ASSERT_TRUE(got);
+        TEST_ASSERT_EQUAL(VIDEO_CHUNK_SIZE, packet.size);
+        TEST_ASSERT_EQUAL((uint8_t)i, packet.data[1]);
+    }
+    TEST_ASSERT_EQUAL(0, session->thread.dropped);
+
+    free(buffer);
+    Session_Close(session);
+    free(session);
+}
+
+TEST(disconnect_is_reported_after_queued_packets)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 0));
+
+    TEST_ASSERT_TRUE(Session_Send(session, PACKET_DISCONNECT, 0, 1));
+    TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_CONTROL, 1));
+
+    DerpRelay_Stop(session->relay);
+    session->relay = NULL;
+
+    BuddyMutex_Lock(&session->lock);
+    while (session->disconnect_events == 0)
+    {
+        TEST_ASSERT_TRUE(BuddyCond_WaitTimeout(&session->cond, &session->lock, 5000));
+    }
+    BuddyMutex_Unlock(&session->lock);
+
+    TEST_ASSERT_TRUE(NetThread_IsDisconnected(&session->thread));
+    uint8_t buffer[64];
+    NetPacket packet;
+    TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_CONTROL, &packet, buffer));
+    TEST_ASSERT_EQUAL(PACKET_DISCONNECT, packet.data[0]);
+    TEST_ASSERT_EQUAL(1, session->disconnect_events);
+
+    Session_Close(session);
+    free(session);
+}
+
+TEST(sends_under_lock_while_thread_reads)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 0));
+
+    // net[1] is owned by the thread: it echoes each mouse packet back while the thread reads
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+    const uint32_t count = 500;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_TRUE(Session_Send(session, PACKET_MOUSE_MOVE, i, MOUSE_PACKET_SIZE));
+        TEST_ASSERT_TRUE(Session_WaitPackets(session, NET_CHANNEL_INPUT, 1));
+        TEST_ASSERT_TRUE(NetThread_Pop(&session->thread, NET_CHANNEL_INPUT, &packet, buffer));
+
+        NetThread_Lock(&session->thread);
+        bool sent = DerpNet_Send(session->net[1], &session->public_key[0], packet.data, packet.size);
+        NetThread_Unlock(&session->thread);
+        TEST_ASSERT_TRUE(sent);
+
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        TEST_ASSERT_EQUAL(1, DerpNet_Recv(session->net[0], &from, &data, &size, true));
+        uint32_t value;
+        memcpy(&value, data + 1, 4);
+        TEST_ASSERT_EQUAL(i, value);
+    }
+
+    free(buffer);
+    Session_Close(session);
+    free(session);
+}
+
+TEST(wait_callback_drives_paced_flushes)
+{
+    Session* session = malloc(sizeof(Session));
+    TEST_ASSERT_TRUE(Session_Open(session, 0));
+
+    // a keyframe queued behind a zero allowance stays queued while the thread waits for the socket
+    const uint32_t count = 6;
+    uint8_t* chunk = calloc(1, VIDEO_CHUNK_SIZE);
+    NetThread_Lock(&session->thread);
+    DerpNet_SetSendAllowance(session->net[1], 0);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        chunk[0] = PACKET_VIDEO;
+        memcpy(chunk + 1, &i, 4);
+        TEST_ASSERT_TRUE(DerpNet_Queue(session->net[1], &session->public_key[0], chunk, VIDEO_CHUNK_SIZE));
+    }
+    TEST_ASSERT_TRUE(DerpNet_OnWritable(session->net[1]));
+    NetThread_Unlock(&session->thread);
+
+    BuddyThread_Sleep(20);
+    DerpKey from;
+    uint8_t* data;
+    uint32_t size;
+    TEST_ASSERT_EQUAL(0, DerpNet_Recv(session->net[0], &from, &data, &size, false));
+
+    // one chunk per pass, nothing arrives on the socket, so at least some passes come from the timeout
+    NetThread_Lock(&session->thread);
+    session->pace_bytes = DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE;
+    session->wait_ms = 2;
+    NetThread_Unlock(&session->thread);
+    NetThread_Wake(&session->thread);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL(1, DerpNet_Recv(session->net[0], &from, &data, &size, true));
+        uint32_t value;
+        memcpy(&value, data + 1, 4);
+        TEST_ASSERT_EQUAL(i, value);
+    }
+
+    BuddyMutex_Lock(&session->thread.queue_lock);
+    uint64_t timeouts = session->thread.timeouts;
+    BuddyMutex_Unlock(&session->thread.queue_lock);
+    TEST_ASSERT_TRUE(timeouts > 0);
+
+    free(chunk);
+    Session_Close(session);
+    free(session);
+}
+
+// Benchmark: a sender streams keyframe sized bursts of video chunks with a mouse packet every
+// few chunks, the viewer spends BENCH_DECODE_MS on every video chunk. Inline = old path,
+// packets are handled in arrival order on the thread that reads; threaded = net thread reads,
+// consumer takes input before video.
+
+typedef struct {
+    Session* session;
+    uint32_t chunks;
+} Streamer;
+
+static void Streamer_Run(void* arg)
+{
+    Streamer* streamer = arg;
+    static uint8_t chunk[VIDEO_CHUNK_SIZE];
+    chunk[0] = PACKET_VIDEO;
+    uint64_t start = BuddyClock_NowUs();
+    for (uint32_t i = 0; i < streamer->chunks; i++)
+    {
+        if (i % BENCH_BURST_CHUNKS == 0)
+        {
+            uint64_t due = start + (uint64_t)(i / BENCH_BURST_CHUNKS) * BENCH_BURST_MS * 1000;
+            uint64_t now = BuddyClock_NowUs();
+            if (due > now) BuddyThread_Sleep((uint32_t)((due - now) / 1000));
+        }
+        if (!DerpNet_Send(streamer->session->net[0], &streamer->session->public_key[1], chunk, sizeof(chunk))) break;
+        if (i % BENCH_MOUSE_EVERY == 0)
+        {
+            uint8_t mouse[MOUSE_PACKET_SIZE] = { PACKET_MOUSE_MOVE };
+            uint64_t now = BuddyClock_NowUs();
+            memcpy(mouse + 2, &now, sizeof(now));
+            if (!DerpNet_Send(streamer->session->net[0], &streamer->session->public_key[1], mouse, sizeof(mouse))) break;
+        }
+    }
+}
+
+// sleeps rather than spins: the decoder mostly waits on the GPU, and the CPU stays free for the
+// reader, the relay and the sender even on a single core
+static void Decode_Chunk(void)
+{
+    BuddyThread_Sleep(BENCH_DECODE_MS);
+}
+
+static void Bench_InputSample(LatencyStats* stats, const uint8_t* data)
+{
+    uint64_t sent;
+    memcpy(&sent, data + 2, sizeof(sent));
+    Latency_StatsAdd(stats, (int64_t)(BuddyClock_NowUs() - sent));
+}
+
+static double Bench_Inline(LatencyStats* stats)
+{
+    Session* session = malloc(sizeof(Session));
+    Session_Open(session, 0);
+    NetThread_Stop(&session->thread);
+
+    Streamer streamer = { session, BENCH_VIDEO_CHUNKS };
+    BuddyThread thread;
+    uint64_t start = BuddyClock_NowUs();
+    BuddyThread_Start(&thread, Streamer_Run, &streamer);
+
+    uint32_t chunks = 0;
+    while (chunks < BENCH_VIDEO_CHUNKS)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        if (DerpNet_Recv(session->net[1], &from, &data, &size, true) < 0) break;
+        if (data[0] == PACKET_VIDEO)
+        {
+            Decode_Chunk();
+            chunks++;
+        }
+        else
+        {
+            Bench_InputSample(stats, data);
+        }
+    }
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    BuddyThread_Join(thread);
+    Session_Close(session);
+    free(session);
+    return chunks * (double)VIDEO_CHUNK_SIZE / (1024.0 * 1024.0) / seconds;
+}
+
+static double Bench_Threaded(LatencyStats* stats)
+{
+    Session* session = malloc(sizeof(Session));
+    Session_Open(session, 0);
+
+    Streamer streamer = { session, BENCH_VIDEO_CHUNKS };
+    BuddyThread thread;
+    uint64_t start = BuddyClock_NowUs();
+    BuddyThread_Start(&thread, Streamer_Run, &streamer);
+
+    uint8_t* buffer = malloc(NET_THREAD_MAX_PACKET);
+    NetPacket packet;
+    uint32_t chunks = 0;
+    while (chunks < BENCH_VIDEO_CHUNKS && !NetThread_IsDisconnected(&session->thread))
+    {
+        BuddyMutex_Lock(&session->lock);
+        if (!(NetThread_TakeReady(&session->thread)))
+        {
+            BuddyCond_WaitTimeout(&session->cond, &session->lock, 10);
+        }
+        BuddyMutex_Unlock(&session->lock);
+
+        // input first, then one chunk of video at a time so input never waits behind a backlog
+        for (;;)
+        {
+            while (NetThread_Pop(&session->thread, NET_CHANNEL_INPUT, &packet, buffer))
+            {
+                Bench_InputSample(stats, packet.data);
+            }
+            if (!NetThread_Pop(&session->thread, NET_CHANNEL_VIDEO, &packet, buffer)) break;
+            Decode_Chunk();
+            chunks++;
+        }
+    }
+    double seconds = (BuddyClock_NowUs() - start) / 1e6;
+    BuddyThread_Join(thread);
+    free(buffer);
+    Session_Close(session);
+    free(session);
+    return chunks * (double)VIDEO_CHUNK_SIZE / (1024.0 * 1024.0) / seconds;
+}
+
+TEST(benchmark_input_latency_behind_video)
+{
+    LatencyStats* inline_stats = calloc(1, sizeof(LatencyStats));
+    LatencyStats* threaded_stats = calloc(1, sizeof(LatencyStats));
+    double inline_mb = Bench_Inline(inline_stats);
+    double threaded_mb = Bench_Threaded(threaded_stats);
+
+    LatencySummary inline_summary, threaded_summary;
+    Latency_StatsSummary(inline_stats, &inline_summary);
+    Latency_StatsSummary(threaded_stats, &threaded_summary);
+
+    printf("\n    %-34s %8s %24s\n", "", "MB/s", "input p50/p95/p99 us");
+    printf("    %-34s %8.1f %8lld/%7lld/%7lld\n", "recv + handle on one thread", inline_mb,
+        (long long)inline_summary.p50_us, (long long)inline_summary.p95_us, (long long)inline_summary.p99_us);
+    printf("    %-34s %8.1f %8lld/%7lld/%7lld\n", "net thread + channel queues", threaded_mb,
+        (long long)threaded_summary.p50_us, (long long)threaded_summary.p95_us, (long long)threaded_summary.p99_us);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(threaded_summary.count > 0);
+    TEST_ASSERT_TRUE(threaded_summary.p50_us <= inline_summary.p50_us);
+    free(inline_stats);
+    free(threaded_stats);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Network I/O Thread Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(packets_are_sorted_into_channels_in_order);
+    RUN_TEST(notify_once_per_batch_until_taken);
+    RUN_TEST(worker_channel_wakes_only_its_worker);
+    RUN_TEST(unknown_packets_are_dropped);
+    RUN_TEST(full_channel_stops_reading_without_losing_packets);
+    RUN_TEST(disconnect_is_reported_after_queued_packets);
+    RUN_TEST(sends_under_lock_while_thread_reads);
+    RUN_TEST(wait_callback_drives_paced_flushes);
+    RUN_TEST(benchmark_input_latency_behind_video);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
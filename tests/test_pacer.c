@@ -0,0 +1,299 @@
+// Unit tests and benchmark for the video pacer, all on a virtual clock
+#include <stdio.h>
+#include <string.h>
+#include "test_framework.h"
+#include "pacer.h"
+
+#define FRAME_INTERVAL_US 16666    // 60 fps
+#define SPREAD_US (FRAME_INTERVAL_US * PACER_DEFAULT_FRAME_FRACTION / 100)
+
+static void Start(Pacer* pacer, uint64_t initial_rate)
+{
+    PacerConfig config = { .frame_interval_us = FRAME_INTERVAL_US, .initial_rate = initial_rate };
+    Pacer_Init(pacer, &config, 0);
+}
+
+TEST(bucket_starts_full_and_refills_at_rate)
+{
+    Pacer pacer;
+    Start(&pacer, 1000000);
+
+    TEST_ASSERT_EQUAL(PACER_DEFAULT_BURST, Pacer_Allowance(&pacer, 0));
+    Pacer_OnSent(&pacer, 0, PACER_DEFAULT_BURST, 100000);
+    TEST_ASSERT_EQUAL(0, Pacer_Allowance(&pacer, 0));
+
+    // 1 byte per microsecond, fractions carry over between calls
+    TEST_ASSERT_EQUAL(1000, Pacer_Allowance(&pacer, 1000));
+    TEST_ASSERT_EQUAL(1500, Pacer_Allowance(&pacer, 1500));
+    Pacer_OnSent(&pacer, 1500, 1500, 100000);
+    TEST_ASSERT_EQUAL(250, Pacer_Allowance(&pacer, 1750));
+
+    // never more than the bucket, however long it was idle
+    TEST_ASSERT_EQUAL(PACER_DEFAULT_BURST, Pacer_Allowance(&pacer, 5000000));
+    TEST_ASSERT_EQUAL(PACER_DEFAULT_BURST, pacer.max_burst);
+}
+
+TEST(frame_rate_follows_bandwidth_and_spread)
+{
+    Pacer pacer;
+
+    // frames are spread over the window
+    Start(&pacer, 1000000);
+    Pacer_QueueFrame(&pacer, 0, 4000);
+    TEST_ASSERT_EQUAL(4000ull * 1000000 / SPREAD_US, pacer.rate);
+    Start(&pacer, 1000000);
+    Pacer_QueueFrame(&pacer, 0, 10000);
+    TEST_ASSERT_EQUAL(10000ull * 1000000 / SPREAD_US, pacer.rate);
+
+    // but not slower than the floor
+    Start(&pacer, 1000000);
+    Pacer_QueueFrame(&pacer, 0, 100);
+    TEST_ASSERT_EQUAL(PACER_MIN_RATE, pacer.rate);
+
+    // keyframe: never more than the headroom over the estimate
+    Start(&pacer, 1000000);
+    Pacer_QueueFrame(&pacer, 0, 400000);
+    TEST_ASSERT_EQUAL(1000000ull * PACER_HEADROOM_PERCENT / 100, pacer.rate);
+
+    // the window covers whatever is still queued from earlier frames too
+    Start(&pacer, 1000000);
+    Pacer_QueueFrame(&pacer, 0, 6000);
+    Pacer_QueueFrame(&pacer, 1000, 6000);
+    TEST_ASSERT_EQUAL(12000ull * 1000000 / SPREAD_US, pacer.rate);
+
+    // on a fast link the keyframe takes the whole window, and the bucket grows with the rate
+    Start(&pacer, 100000000);
+    Pacer_QueueFrame(&pacer, 0, 400000);
+    TEST_ASSERT_EQUAL(400000ull * 1000000 / SPREAD_US, pacer.rate);
+    TEST_ASSERT_EQUAL(pacer.rate * PACER_MIN_BURST_US / 1000000, Pacer_Allowance(&pacer, 1000000));
+}
+
+TEST(next_send_waits_for_a_useful_write)
+{
+    Pacer pacer;
+    Start(&pacer, 1000000);
+    TEST_ASSERT_TRUE(Pacer_NextSendUs(&pacer, 0) == UINT64_MAX);
+
+    Pacer_QueueFrame(&pacer, 0, 50000);
+    TEST_ASSERT_EQUAL(0, Pacer_NextSendUs(&pacer, 0));
+
+    uint64_t allowance = Pacer_Allowance(&pacer, 0);
+    Pacer_OnSent(&pacer, 0, allowance, 50000 - allowance);
+    uint64_t full_write_us = (PACER_MIN_WRITE * 1000000ull + pacer.rate - 1) / pacer.rate;
+    TEST_ASSERT_EQUAL(full_write_us, Pacer_NextSendUs(&pacer, 0));
+    TEST_ASSERT_EQUAL(full_write_us - 1000, Pacer_NextSendUs(&pacer, 1000));
+
+    // a short tail does not wait for a full write's worth
+    Pacer_OnSent(&pacer, 1000, 0, 100);
+    TEST_ASSERT_EQUAL((100 * 1000000ull + pacer.rate - 1) / pacer.rate, Pacer_NextSendUs(&pacer, 0));
+
+    Pacer_OnSent(&pacer, 2000, 0, 0);
+    TEST_ASSERT_TRUE(Pacer_NextSendUs(&pacer, 2000) == UINT64_MAX);
+}
+
+TEST(queue_delay_is_measured_per_chunk)
+{
+    Pacer pacer;
+    Start(&pacer, 1000000);
+
+    Pacer_QueueFrame(&pacer, 0, 10000);
+    Pacer_QueueFrame(&pacer, 0, 30000);
+    uint64_t now = 0;
+    uint64_t queued = 40000;
+    while (queued)
+    {
+        uint64_t sent = Pacer_Allowance(&pacer, now);
+        sent = sent < queued ? sent : queued;
+        queued -= sent;
+        Pacer_OnSent(&pacer, now, sent, queued);
+        now += 1000;
+    }
+    // the small frame left with the first burst, the keyframe tail at 1.5 bytes per microsecond
+    TEST_ASSERT_EQUAL(2, pacer.delay_count);
+    TEST_ASSERT_EQUAL(16000, pacer.delay_max_us);
+    TEST_ASSERT_EQUAL(16000, pacer.delay_total_us);
+    TEST_ASSERT_EQUAL(40000, pacer.bytes_sent);
+
+    // bytes queued behind the pacer's back (file data) are picked up from the send queue
+    Pacer_OnSent(&pacer, 100000, 0, 700);
+    TEST_ASSERT_EQUAL(700, pacer.queued_bytes);
+    Pacer_OnSent(&pacer, 105000, 700, 0);
+    TEST_ASSERT_EQUAL(3, pacer.delay_count);
+    TEST_ASSERT_EQUAL(21000, pacer.delay_total_us);
+}
+
+TEST(bandwidth_estimate_follows_the_socket)
+{
+    Pacer pacer;
+    Start(&pacer, 1000000);
+
+    // the socket takes 500 bytes per millisecond while a backlog waits: the estimate comes down
+    uint64_t now = 0;
+    uint64_t queued = 0;
+    for (int ms = 0; ms < 1000; ms++, now += 1000)
+    {
+        if (ms % 16 == 0)
+        {
+            Pacer_QueueFrame(&pacer, now, 20000);
+            queued += 20000;
+        }
+        uint64_t sent = Pacer_Allowance(&pacer, now);
+        sent = sent < 500 ? sent : 500;
+        sent = sent < queued ? sent : queued;
+        queued -= sent;
+        Pacer_OnSent(&pacer, now, sent, queued);
+    }
+    TEST_ASSERT_TRUE(pacer.bandwidth > 450000 && pacer.bandwidth < 650000);
+
+    // the socket takes everything offered: the estimate goes up with the paced rate
+    for (int ms = 0; ms < 1000; ms++, now += 1000)
+    {
+        if (ms % 16 == 0)
+        {
+            Pacer_QueueFrame(&pacer, now, 20000);
+            queued += 20000;
+        }
+        uint64_t sent = Pacer_Allowance(&pacer, now);
+        sent = sent < queued ? sent : queued;
+        queued -= sent;
+        Pacer_OnSent(&pacer, now, sent, queued);
+    }
+    TEST_ASSERT_TRUE(pacer.bandwidth > 1000000);
+
+    // never below the floor
+    Start(&pacer, 1);
+    TEST_ASSERT_EQUAL(PACER_MIN_RATE, pacer.bandwidth);
+}
+
+// Benchmark: a 60 fps stream of 10 KB frames with a 400 KB keyframe every second, over a
+// 4 MB/s link whose bottleneck buffers up to 256 KB before the socket pushes back. An input
+// packet is written every millisecond and waits behind whatever the link has buffered.
+
+#define LINK_RATE 4000000
+#define LINK_BUFFER (256 * 1024)
+#define TICK_US 250
+#define KEYFRAME_BYTES 400000
+#define FRAME_BYTES 10000
+#define BENCH_SECONDS 6
+
+typedef struct {
+    uint64_t max_write;        // largest write to the socket
+    uint64_t max_buffered;     // most bytes waiting in the link
+    double input_avg_ms;       // input delay behind the link buffer, last keyframe second
+    double input_max_ms;
+    double keyframe_ms;        // last keyframe: queued until its last byte was delivered
+} LinkResult;
+
+static void Simulate(bool paced, LinkResult* result)
+{
+    Pacer pacer;
+    PacerConfig config = { .frame_interval_us = FRAME_INTERVAL_US, .initial_rate = 2 * FRAME_BYTES * 60 };
+    Pacer_Init(&pacer, &config, 0);
+    memset(result, 0, sizeof(*result));
+
+    uint64_t queued = 0;       // DERP send queue
+    uint64_t buffered = 0;     // written, not delivered yet
+    uint64_t written = 0, delivered = 0;
+    uint64_t keyframe_end = 0, keyframe_start = 0;
+    double input_total = 0;
+    uint32_t inputs = 0;
+    uint32_t frame = 0;
+
+    for (uint64_t now = 0; now < BENCH_SECONDS * 1000000ull; now += TICK_US)
+    {
+        // the link delivers
+        uint64_t deliver = (uint64_t)LINK_RATE * TICK_US / 1000000;
+        deliver = deliver < buffered ? deliver : buffered;
+        buffered -= deliver;
+        delivered += deliver;
+        if (keyframe_end && delivered >= keyframe_end)
+        {
+            result->keyframe_ms = (now - keyframe_start) / 1000.0;
+            keyframe_end = 0;
+        }
+
+        // the encoder
+        if (now >= (uint64_t)frame * FRAME_INTERVAL_US)
+        {
+            uint32_t bytes = frame % 60 == 30 ? KEYFRAME_BYTES : FRAME_BYTES;
+            if (bytes == KEYFRAME_BYTES)
+            {
+                keyframe_start = now;
+                keyframe_end = written + queued + bytes;
+            }
+            queued += bytes;
+            if (paced) Pacer_QueueFrame(&pacer, now, bytes);
+            frame++;
+        }
+
+        // the socket, through the pacer or not
+        uint64_t room = LINK_BUFFER - buffered;
+        uint64_t offer = paced ? Pacer_Allowance(&pacer, now) : queued;
+        uint64_t write = offer < queued ? offer : queued;
+        write = write < room ? write : room;
+        queued -= write;
+        buffered += write;
+        written += write;
+        if (paced) Pacer_OnSent(&pacer, now, write, queued);
+
+        if (write > result->max_write) result->max_write = write;
+        if (buffered > result->max_buffered) result->max_buffered = buffered;
+
+        // input goes ahead of the send queue, but not ahead of what the link already holds
+        if (now % 1000 == 0 && now >= (BENCH_SECONDS - 1) * 1000000ull)
+        {
+            double delay_ms = buffered * 1000.0 / LINK_RATE;
+            input_total += delay_ms;
+            inputs++;
+            if (delay_ms > result->input_max_ms) result->input_max_ms = delay_ms;
+        }
+    }
+    result->input_avg_ms = input_total / inputs;
+
+    if (paced)
+    {
+        printf("    pacer: bandwidth %.2f MB/s, %llu writes, queue delay avg %.1f ms max %.1f ms\n",
+            pacer.bandwidth / 1e6, (unsigned long long)pacer.writes,
+            pacer.delay_total_us / 1000.0 / pacer.delay_count, pacer.delay_max_us / 1000.0);
+    }
+}
+
+TEST(benchmark_keyframe_burst_on_a_4mb_link)
+{
+    LinkResult unpaced, paced;
+    printf("\n");
+    Simulate(false, &unpaced);
+    Simulate(true, &paced);
+
+    printf("    %-10s %10s %12s %14s %14s %12s\n", "", "max write", "max in link", "input avg ms", "input max ms", "keyframe ms");
+    printf("    %-10s %10llu %12llu %14.1f %14.1f %12.1f\n", "unpaced",
+        (unsigned long long)unpaced.max_write, (unsigned long long)unpaced.max_buffered,
+        unpaced.input_avg_ms, unpaced.input_max_ms, unpaced.keyframe_ms);
+    printf("    %-10s %10llu %12llu %14.1f %14.1f %12.1f\n", "paced",
+        (unsigned long long)paced.max_write, (unsigned long long)paced.max_buffered,
+        paced.input_avg_ms, paced.input_max_ms, paced.keyframe_ms);
+    printf("    ");
+
+    TEST_ASSERT_TRUE(paced.max_write * 4 < unpaced.max_write);
+    TEST_ASSERT_TRUE(paced.input_max_ms * 3 < unpaced.input_max_ms * 2);
+    TEST_ASSERT_TRUE(paced.keyframe_ms < 2 * unpaced.keyframe_ms);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Pacer Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(bucket_starts_full_and_refills_at_rate);
+    RUN_TEST(frame_rate_follows_bandwidth_and_spread);
+    RUN_TEST(next_send_waits_for_a_useful_write);
+    RUN_TEST(queue_delay_is_measured_per_chunk);
+    RUN_TEST(bandwidth_estimate_follows_the_socket);
+    RUN_TEST(benchmark_keyframe_burst_on_a_4mb_link);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,290 @@
+// Unit tests for the session recorder (Annex-B tee + keyframe index)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test_framework.h"
+#include "recorder.h"
+
+static const uint8_t k_IdrFrame[] = { 0, 0, 0, 1, 0x67, 0x42, 0, 0, 0, 1, 0x68, 0xCE, 0, 0, 1, 0x65, 0x88, 0x84, 0x21 };
+static const uint8_t k_PFrame[] = { 0, 0, 0, 1, 0x41, 0x9A, 0x02, 0x03 };
+
+// Memory sink that can be held closed to simulate a disk that fell behind, or fail like a full one
+typedef struct {
+    BuddyMutex lock;
+    BuddyCond cond;
+    bool blocked;
+    bool failing;
+    bool in_write;
+    uint8_t* stream;
+    size_t stream_size;
+    size_t stream_capacity;
+    size_t index_size;
+} MemorySink;
+
+static bool MemorySink_WriteStream(void* user, const void* data, size_t size)
+{
+    MemorySink* sink = user;
+    BuddyMutex_Lock(&sink->lock);
+    sink->in_write = true;
+    BuddyCond_Broadcast(&sink->cond);
+    while (sink->blocked)
+    {
+        BuddyCond_Wait(&sink->cond, &sink->lock);
+    }
+    if (sink->failing)
+    {
+        BuddyMutex_Unlock(&sink->lock);
+        return false;
+    }
+    if (sink->stream_size + size > sink->stream_capacity)
+    {
+        sink->stream_capacity = (sink->stream_size + size) * 2;
+        sink->stream = realloc(sink->stream, sink->stream_capacity);
+    }
+    memcpy(sink->stream + sink->stream_size, data, size);
+    sink->stream_size += size;
+    BuddyMutex_Unlock(&sink->lock);
+    return true;
+}
+
+static bool MemorySink_WriteIndex(void* user, const void* data, size_t size)
+{
+    MemorySink* sink = user;
+    (void)data;
+    sink->index_size += size;
+    return true;
+}
+
+static void MemorySink_Init(MemorySink* sink, RecorderSink* out)
+{
+    memset(sink, 0, sizeof(*sink));
+    BuddyMutex_Init(&sink->lock);
+    BuddyCond_Init(&sink->cond);
+    out->user = sink;
+    out->write_stream = MemorySink_WriteStream;
+    out->write_index = MemorySink_WriteIndex;
+    out->close = NULL;
+}
+
+static void MemorySink_Free(MemorySink* sink)
+{
+    free(sink->stream);
+    BuddyCond_Destroy(&sink->cond);
+    BuddyMutex_Destroy(&sink->lock);
+}
+
+static size_t ReadWholeFile(const char* path, uint8_t* buffer, size_t capacity)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return 0;
+    size_t size = fread(buffer, 1, capacity, f);
+    fclose(f);
+    return size;
+}
+
+TEST(keyframe_detection)
+{
+    static const uint8_t idr3[] = { 0, 0, 1, 0x65, 0x88 };
+    static const uint8_t aud_then_p[] = { 0, 0, 0, 1, 0x09, 0xF0, 0, 0, 0, 1, 0x41, 0x9A };
+    static const uint8_t garbage[] = { 1, 2, 3, 4, 5 };
+
+    TEST_ASSERT_TRUE(Recorder_IsKeyframe(k_IdrFrame, sizeof(k_IdrFrame)));
+    TEST_ASSERT_TRUE(Recorder_IsKeyframe(idr3, sizeof(idr3)));
+    TEST_ASSERT_FALSE(Recorder_IsKeyframe(k_PFrame, sizeof(k_PFrame)));
+    TEST_ASSERT_FALSE(Recorder_IsKeyframe(aud_then_p, sizeof(aud_then_p)));
+    TEST_ASSERT_FALSE(Recorder_IsKeyframe(garbage, sizeof(garbage)));
+    TEST_ASSERT_FALSE(Recorder_IsKeyframe(garbage, 0));
+}
+
+TEST(file_roundtrip_and_index)
+{
+    const char* path = "test_recorder_out.h264";
+    Recorder rec;
+    TEST_ASSERT_TRUE(Recorder_Open(&rec, path, 64 * 1024));
+
+    // leading P-frames cannot be decoded and must not reach the file
+    TEST_ASSERT_FALSE(Recorder_Write(&rec, k_PFrame, sizeof(k_PFrame), 0));
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, k_IdrFrame, sizeof(k_IdrFrame), 1000));
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, k_PFrame, sizeof(k_PFrame), 2000));
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, k_PFrame, sizeof(k_PFrame), 3000));
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, k_IdrFrame, sizeof(k_IdrFrame), 4000));
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, k_PFrame, sizeof(k_PFrame), 5000));
+    Recorder_Close(&rec);
+
+    TEST_ASSERT_EQUAL(5, rec.frames_written);
+    TEST_ASSERT_EQUAL(1, rec.frames_dropped);
+    TEST_ASSERT_EQUAL(2, rec.keyframes_written);
+
+    uint8_t stream[256];
+    size_t expected = 2 * sizeof(k_IdrFrame) + 3 * sizeof(k_PFrame);
+    TEST_ASSERT_EQUAL(expected, ReadWholeFile(path, stream, sizeof(stream)));
+    TEST_ASSERT_TRUE(memcmp(stream, k_IdrFrame, sizeof(k_IdrFrame)) == 0);
+
+    RecorderKeyframe keys[8];
+    int count = Recorder_ReadIndex("test_recorder_out.h264.idx", keys, 8);
+    TEST_ASSERT_EQUAL(2, count);
+    TEST_ASSERT_EQUAL(0, keys[0].stream_offset);
+    TEST_ASSERT_EQUAL(1000, keys[0].timestamp_us);
+    TEST_ASSERT_EQUAL(0, keys[0].frame_number);
+    TEST_ASSERT_EQUAL(sizeof(k_IdrFrame), keys[0].size);
+    TEST_ASSERT_EQUAL(sizeof(k_IdrFrame) + 2 * sizeof(k_PFrame), keys[1].stream_offset);
+    TEST_ASSERT_EQUAL(4000, keys[1].timestamp_us);
+    TEST_ASSERT_EQUAL(3, keys[1].frame_number);
+
+    // the indexed offset points at the keyframe bytes in the stream file
+    TEST_ASSERT_TRUE(memcmp(stream + keys[1].stream_offset, k_IdrFrame, sizeof(k_IdrFrame)) == 0);
+
+    remove(path);
+    remove("test_recorder_out.h264.idx");
+}
+
+TEST(find_keyframe)
+{
+    RecorderKeyframe keys[3] = {
+        { .stream_offset = 0, .timestamp_us = 1000 },
+        { .stream_offset = 500, .timestamp_us = 5000 },
+        { .stream_offset = 900, .timestamp_us = 9000 },
+    };
+
+    TEST_ASSERT_EQUAL(-1, Recorder_FindKeyframe(keys, 3, 999));
+    TEST_ASSERT_EQUAL(0, Recorder_FindKeyframe(keys, 3, 1000));
+    TEST_ASSERT_EQUAL(0, Recorder_FindKeyframe(keys, 3, 4999));
+    TEST_ASSERT_EQUAL(1, Recorder_FindKeyframe(keys, 3, 5000));
+    TEST_ASSERT_EQUAL(2, Recorder_FindKeyframe(keys, 3, 100000));
+    TEST_ASSERT_EQUAL(-1, Recorder_FindKeyframe(keys, 0, 100000));
+}
+
+TEST(stalled_sink_drops_instead_of_blocking)
+{
+    MemorySink mem;
+    RecorderSink sink;
+    MemorySink_Init(&mem, &sink);
+    mem.blocked = true;
+
+    uint8_t key[1024];
+    uint8_t delta[1024];
+    memset(key, 0xAA, sizeof(key));
+    memset(delta, 0xBB, sizeof(delta));
+    memcpy(key, k_IdrFrame, sizeof(k_IdrFrame));
+    memcpy(delta, k_PFrame, sizeof(k_PFrame));
+
+    Recorder rec;
+    TEST_ASSERT_TRUE(Recorder_OpenSink(&rec, &sink, 4 * 1024));
+
+    // writer thread takes the first frame and then hangs in the "disk"
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, key, sizeof(key), 0));
+    BuddyMutex_Lock(&mem.lock);
+    while (!mem.in_write) BuddyCond_Wait(&mem.cond, &mem.lock);
+    BuddyMutex_Unlock(&mem.lock);
+
+    // pool holds 4 frames; the rest must be dropped without waiting on the sink
+    int accepted = 1;
+    for (int i = 1; i < 50; i++)
+    {
+        accepted += Recorder_Write(&rec, delta, sizeof(delta), (uint64_t)i) ? 1 : 0;
+    }
+    TEST_ASSERT_EQUAL(4, accepted);
+    TEST_ASSERT_EQUAL(46, rec.frames_dropped);
+
+    // after a drop, deltas are refused until the next keyframe
+    BuddyMutex_Lock(&mem.lock);
+    mem.blocked = false;
+    BuddyCond_Broadcast(&mem.cond);
+    BuddyMutex_Unlock(&mem.lock);
+
+    bool resumed = false;
+    for (int i = 0; i < 1000 && !resumed; i++)
+    {
+        TEST_ASSERT_FALSE(Recorder_Write(&rec, delta, sizeof(delta), 100));
+        resumed = Recorder_Write(&rec, key, sizeof(key), 100);
+        if (!resumed) BuddyThread_Sleep(1);
+    }
+    TEST_ASSERT_TRUE(resumed);
+    Recorder_Close(&rec);
+
+    TEST_ASSERT_EQUAL(5, rec.frames_written);
+    TEST_ASSERT_EQUAL(5 * sizeof(key), mem.stream_size);
+    TEST_ASSERT_TRUE(memcmp(mem.stream + 4 * sizeof(key), key, sizeof(key)) == 0);
+    TEST_ASSERT_EQUAL(RECORDER_INDEX_HEADER_SIZE + 2 * RECORDER_INDEX_RECORD_SIZE, mem.index_size);
+
+    MemorySink_Free(&mem);
+}
+
+TEST(failed_stream_write_adds_no_index_entry)
+{
+    MemorySink mem;
+    RecorderSink sink;
+    MemorySink_Init(&mem, &sink);
+    mem.failing = true;
+
+    Recorder rec;
+    TEST_ASSERT_TRUE(Recorder_OpenSink(&rec, &sink, 4 * 1024));
+    TEST_ASSERT_TRUE(Recorder_Write(&rec, k_IdrFrame, sizeof(k_IdrFrame), 0));
+    Recorder_Close(&rec);
+
+    // the keyframe never reached the stream, so the index must not point at it
+    TEST_ASSERT_EQUAL(0, rec.frames_written);
+    TEST_ASSERT_EQUAL(1, rec.frames_dropped);
+    TEST_ASSERT_EQUAL(0, mem.stream_size);
+    TEST_ASSERT_EQUAL(RECORDER_INDEX_HEADER_SIZE, mem.index_size);
+
+    MemorySink_Free(&mem);
+}
+
+TEST(pool_wraparound_preserves_bytes)
+{
+    MemorySink mem;
+    RecorderSink sink;
+    MemorySink_Init(&mem, &sink);
+
+    Recorder rec;
+    TEST_ASSERT_TRUE(Recorder_OpenSink(&rec, &sink, 3000));
+
+    // frame sizes that do not divide the pool force the wrap padding path
+    uint8_t* expected = malloc(200 * 1000);
+    size_t expected_size = 0;
+    uint8_t frame[1000];
+    for (int i = 0; i < 200; i++)
+    {
+        size_t size = 300 + (size_t)(i * 37) % 700;
+        memcpy(frame, k_IdrFrame, sizeof(k_IdrFrame));
+        for (size_t j = sizeof(k_IdrFrame); j < size; j++) frame[j] = (uint8_t)(i + j);
+
+        if (Recorder_Write(&rec, frame, size, (uint64_t)i))
+        {
+            memcpy(expected + expected_size, frame, size);
+            expected_size += size;
+        }
+        else
+        {
+            BuddyThread_Sleep(1);
+        }
+    }
+    Recorder_Close(&rec);
+
+    TEST_ASSERT_TRUE(rec.frames_written > 0);
+    TEST_ASSERT_EQUAL(expected_size, mem.stream_size);
+    TEST_ASSERT_TRUE(memcmp(expected, mem.stream, expected_size) == 0);
+
+    free(expected);
+    MemorySink_Free(&mem);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Session Recorder Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(keyframe_detection);
+    RUN_TEST(file_roundtrip_and_index);
+    RUN_TEST(find_keyframe);
+    RUN_TEST(stalled_sink_drops_instead_of_blocking);
+    RUN_TEST(failed_stream_write_adds_no_index_entry);
+    RUN_TEST(pool_wraparound_preserves_bytes);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
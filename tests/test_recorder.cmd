@@ -0,0 +1,33 @@
+@echo off
+setlocal
+
+for /f "usebackq tokens=*" %%i in (`"%ProgramFiles(x86)%\Microsoft Visual Studio\Installer\vswhere.exe" -latest -products * -requires Microsoft.VisualStudio.Component.VC.Tools.x86.x64 -property installationPath`) do (
+  set VSINSTALLPATH=%%i
+)
+
+if not defined VSINSTALLPATH (
+  echo Error: Visual Studio not found
+  exit /b 1
+)
+
+call "%VSINSTALLPATH%\VC\Auxiliary\Build\vcvarsall.bat" x64 >nul 2>&1
+
+echo Building Recorder Tests...
+pushd "%~dp0"
+
+cl.exe /nologo /W3 /O2 /I ..\src\core /I ..\src\utils ..\src\core\recorder.c test_recorder.c /Fe:test_recorder.exe /link /SUBSYSTEM:CONSOLE
+
+if %ERRORLEVEL% NEQ 0 (
+  echo Build failed!
+  popd
+  exit /b 1
+)
+
+echo.
+echo Running recorder tests...
+echo.
+test_recorder.exe
+set RESULT=%ERRORLEVEL%
+del test_recorder.obj recorder.obj >nul 2>&1
+popd
+exit /b %RESULT%
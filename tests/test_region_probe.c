@@ -0,0 +1,442 @@
+// Tests and benchmark for DERP region selection (region_probe.c): concurrent DNS, median of
+// several handshake samples and the saved latency table, against local listeners that reply
+// after injected delays
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "test_framework.h"
+#include "platform.h"
+#include "region_probe.h"
+
+#define MAX_DELAYS 8
+
+// Accepts connections on 127.0.0.1 and answers each request with one byte after a delay;
+// connection n waits delays_ms[n % delay_count]
+typedef struct {
+    int fd;
+    uint16_t port;
+    uint32_t delays_ms[MAX_DELAYS];
+    uint32_t delay_count;
+    uint32_t connections;
+    volatile bool stopping;
+    BuddyThread thread;
+} Listener;
+
+static void Listener_Run(void* arg)
+{
+    Listener* listener = arg;
+    while (!listener->stopping)
+    {
+        struct pollfd p = { .fd = listener->fd, .events = POLLIN };
+        if (poll(&p, 1, 20) <= 0)
+        {
+            continue;
+        }
+        int fd = accept(listener->fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        char request[64];
+        struct pollfd c = { .fd = fd, .events = POLLIN };
+        if (poll(&c, 1, 500) > 0 && recv(fd, request, sizeof(request), 0) > 0)
+        {
+            uint32_t n = listener->connections++;
+            BuddyThread_Sleep(listener->delay_count ? listener->delays_ms[n % listener->delay_count] : 0);
+            send(fd, "!", 1, MSG_NOSIGNAL);
+        }
+        close(fd);
+    }
+}
+
+static bool Listener_Start(Listener* listener, const uint32_t* delays_ms, uint32_t delay_count)
+{
+    memset(listener, 0, sizeof(*listener));
+    for (uint32_t i = 0; i < delay_count; i++)
+    {
+        listener->delays_ms[i] = delays_ms[i];
+    }
+    listener->delay_count = delay_count;
+
+    listener->fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t size = sizeof(address);
+    if (listener->fd < 0 || bind(listener->fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener->fd, 64) != 0 || getsockname(listener->fd, (struct sockaddr*)&address, &size) != 0)
+    {
+        return false;
+    }
+    listener->port = ntohs(address.sin_port);
+    return BuddyThread_Start(&listener->thread, &Listener_Run, listener);
+}
+
+static void Listener_Stop(Listener* listener)
+{
+    listener->stopping = true;
+    BuddyThread_Join(listener->thread);
+    close(listener->fd);
+}
+
+// a port nothing listens on
+static uint16_t ClosedPort(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t size = sizeof(address);
+    bind(fd, (struct sockaddr*)&address, sizeof(address));
+    getsockname(fd, (struct sockaddr*)&address, &size);
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+// Test DNS: "region-<n>" resolves to 127.0.0.1:ports[n] after resolve_ms, anything else fails
+typedef struct {
+    uint16_t ports[REGION_PROBE_MAX_REGIONS];
+    uint32_t resolve_ms;
+} Dns;
+
+static bool Dns_Resolve(void* context, const char* host, uint16_t port, uint8_t* address, uint32_t* address_size)
+{
+    Dns* dns = context;
+    (void)port;
+
+    BuddyThread_Sleep(dns->resolve_ms);
+    unsigned n;
+    if (sscanf(host, "region-%u", &n) != 1 || n >= REGION_PROBE_MAX_REGIONS || dns->ports[n] == 0)
+    {
+        return false;
+    }
+
+    struct sockaddr_in in = { .sin_family = AF_INET, .sin_port = htons(dns->ports[n]), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    memcpy(address, &in, sizeof(in));
+    *address_size = sizeof(in);
+    return true;
+}
+
+static void AddRegion(RegionProbe* probe, uint32_t id)
+{
+    char host[32];
+    snprintf(host, sizeof(host), "region-%u", id);
+    RegionProbe_Add(probe, id, host);
+}
+
+static const RegionProbeEntry* Entry(const RegionProbe* probe, uint32_t id)
+{
+    for (uint32_t i = 0; i < probe->count; i++)
+    {
+        if (probe->entries[i].id == id)
+        {
+            return &probe->entries[i];
+        }
+    }
+    return NULL;
+}
+
+TEST(median_of_odd_and_even_counts)
+{
+    uint32_t odd[] = { 900, 10, 30, 20, 5000 };
+    TEST_ASSERT_EQUAL(30, RegionProbe_Median(odd, 5));
+
+    uint32_t even[] = { 40, 10, 30, 20 };
+    TEST_ASSERT_EQUAL(25, RegionProbe_Median(even, 4));
+
+    uint32_t one[] = { 7 };
+    TEST_ASSERT_EQUAL(7, RegionProbe_Median(one, 1));
+    TEST_ASSERT_EQUAL(0, RegionProbe_Median(one, 0));
+}
+
+TEST(add_rejects_empty_and_long_hosts)
+{
+    RegionProbe probe;
+    RegionProbe_Init(&probe);
+
+    char long_host[REGION_PROBE_MAX_HOST + 1];
+    memset(long_host, 'a', sizeof(long_host) - 1);
+    long_host[sizeof(long_host) - 1] = 0;
+
+    TEST_ASSERT_FALSE(RegionProbe_Add(&probe, 1, ""));
+    TEST_ASSERT_FALSE(RegionProbe_Add(&probe, 1, NULL));
+    TEST_ASSERT_FALSE(RegionProbe_Add(&probe, 1, long_host));
+    TEST_ASSERT_TRUE(RegionProbe_Add(&probe, 1, "derp1.example.com"));
+    TEST_ASSERT_EQUAL(1, probe.count);
+
+    for (uint32_t i = 1; i < REGION_PROBE_MAX_REGIONS; i++)
+    {
+        TEST_ASSERT_TRUE(RegionProbe_Add(&probe, i + 1, "derp.example.com"));
+    }
+    TEST_ASSERT_FALSE(RegionProbe_Add(&probe, 999, "derp.example.com"));
+}
+
+TEST(hostnames_resolve_concurrently)
+{
+    static Dns dns;
+    memset(&dns, 0, sizeof(dns));
+    dns.resolve_ms = 100;
+
+    Listener listener;
+    TEST_ASSERT_TRUE(Listener_Start(&listener, NULL, 0));
+
+    RegionProbe probe;
+    RegionProbe_Init(&probe);
+    for (uint32_t id = 1; id <= 16; id++)
+    {
+        dns.ports[id] = listener.port;
+        AddRegion(&probe, id);
+    }
+
+    RegionProbeConfig config = { .port = 443, .samples = 1, .timeout_ms = 500, .resolve = Dns_Resolve, .context = &dns };
+    RegionProbe_Run(&probe, &config);
+    Listener_Stop(&listener);
+
+    // 16 x 100 ms serially, one wave on 16 resolver threads
+    TEST_ASSERT_TRUE(probe.resolve_wall_us < 800000);
+    TEST_ASSERT_EQUAL(0, probe.resolve_failures);
+    for (uint32_t i = 0; i < probe.count; i++)
+    {
+        TEST_ASSERT_TRUE(probe.entries[i].address_size > 0);
+        TEST_ASSERT_TRUE(probe.entries[i].resolve_us >= 100000);
+    }
+}
+
+TEST(lowest_median_wins_over_one_fast_sample)
+{
+    static Dns dns;
+    memset(&dns, 0, sizeof(dns));
+
+    // region 1: one lucky 1 ms reply, otherwise 60 ms
+    // region 2: steady 20 ms with one 300 ms outlier
+    // region 3: steady 40 ms
+    uint32_t delays1[] = { 1, 60, 60, 60, 60 };
+    uint32_t delays2[] = { 20, 300, 20, 20, 20 };
+    uint32_t delays3[] = { 40 };
+    Listener listeners[3];
+    TEST_ASSERT_TRUE(Listener_Start(&listeners[0], delays1, 5));
+    TEST_ASSERT_TRUE(Listener_Start(&listeners[1], delays2, 5));
+    TEST_ASSERT_TRUE(Listener_Start(&listeners[2], delays3, 1));
+
+    RegionProbe probe;
+    RegionProbe_Init(&probe);
+    for (uint32_t id = 1; id <= 3; id++)
+    {
+        dns.ports[id] = listeners[id - 1].port;
+        AddRegion(&probe, id);
+    }
+
+    static const char request[] = "PING";
+    RegionProbeConfig config =
+    {
+        .port = 443,
+        .samples = 5,
+        .timeout_ms = 1000,
+        .request = request,
+        .request_size = sizeof(request) - 1,
+        .resolve = Dns_Resolve,
+        .context = &dns,
+    };
+    RegionProbe_Run(&probe, &config);
+    for (int i = 0; i < 3; i++)
+    {
+        Listener_Stop(&listeners[i]);
+    }
+
+    TEST_ASSERT_EQUAL(5, Entry(&probe, 1)->sample_count);
+    TEST_ASSERT_EQUAL(5, Entry(&probe, 2)->sample_count);
+    TEST_ASSERT_EQUAL(5, Entry(&probe, 3)->sample_count);
+    TEST_ASSERT_TRUE(Entry(&probe, 1)->median_us >= 60000);
+    TEST_ASSERT_TRUE(Entry(&probe, 2)->median_us >= 20000 && Entry(&probe, 2)->median_us < 40000);
+    TEST_ASSERT_TRUE(Entry(&probe, 3)->median_us >= 40000);
+    TEST_ASSERT_EQUAL(2, RegionProbe_Best(&probe));
+}
+
+TEST(unreachable_regions_are_skipped)
+{
+    static Dns dns;
+    memset(&dns, 0, sizeof(dns));
+
+    Listener listener;
+    TEST_ASSERT_TRUE(Listener_Start(&listener, NULL, 0));
+
+    RegionProbe probe;
+    RegionProbe_Init(&probe);
+    dns.ports[1] = ClosedPort();          // refused
+    dns.ports[3] = listener.port;         // the only one that works
+    AddRegion(&probe, 1);
+    AddRegion(&probe, 2);                 // does not resolve
+    AddRegion(&probe, 3);
+
+    // plain TCP handshake timing, no request
+    RegionProbeConfig config = { .port = 443, .samples = 3, .timeout_ms = 300, .resolve = Dns_Resolve, .context = &dns };
+    RegionProbe_Run(&probe, &config);
+
+    TEST_ASSERT_EQUAL(1, probe.resolve_failures);
+    TEST_ASSERT_EQUAL(0, Entry(&probe, 1)->sample_count);
+    TEST_ASSERT_EQUAL(REGION_PROBE_UNREACHABLE, Entry(&probe, 1)->median_us);
+    TEST_ASSERT_EQUAL(REGION_PROBE_UNREACHABLE, Entry(&probe, 2)->median_us);
+    TEST_ASSERT_EQUAL(3, Entry(&probe, 3)->sample_count);
+    TEST_ASSERT_EQUAL(3, probe.sample_failures);
+    TEST_ASSERT_EQUAL(3, RegionProbe_Best(&probe));
+
+    // nothing reachable
+    dns.ports[3] = dns.ports[1];
+    RegionProbe_Run(&probe, &config);
+    Listener_Stop(&listener);
+    TEST_ASSERT_EQUAL(0, RegionProbe_Best(&probe));
+}
+
+TEST(region_must_answer_half_the_rounds)
+{
+    static Dns dns;
+    memset(&dns, 0, sizeof(dns));
+
+    // region 1 answers fast once and then stalls past the round timeout
+    uint32_t delays1[] = { 1, 400, 400 };
+    uint32_t delays2[] = { 30 };
+    Listener listeners[2];
+    TEST_ASSERT_TRUE(Listener_Start(&listeners[0], delays1, 3));
+    TEST_ASSERT_TRUE(Listener_Start(&listeners[1], delays2, 1));
+
+    RegionProbe probe;
+    RegionProbe_Init(&probe);
+    for (uint32_t id = 1; id <= 2; id++)
+    {
+        dns.ports[id] = listeners[id - 1].port;
+        AddRegion(&probe, id);
+    }
+
+    RegionProbeConfig config =
+    {
+        .port = 443, .samples = 3, .timeout_ms = 150,
+        .request = "x", .request_size = 1,
+        .resolve = Dns_Resolve, .context = &dns,
+    };
+    RegionProbe_Run(&probe, &config);
+    for (int i = 0; i < 2; i++)
+    {
+        Listener_Stop(&listeners[i]);
+    }
+
+    TEST_ASSERT_EQUAL(1, Entry(&probe, 1)->sample_count);
+    TEST_ASSERT_EQUAL(REGION_PROBE_UNREACHABLE, Entry(&probe, 1)->median_us);
+    TEST_ASSERT_EQUAL(2, RegionProbe_Best(&probe));
+}
+
+TEST(latency_table_roundtrip_and_age)
+{
+    RegionProbe probe;
+    RegionProbe_Init(&probe);
+    RegionProbe_Add(&probe, 4, "derp4.example.com");
+    RegionProbe_Add(&probe, 9, "derp9.example.com");
+    RegionProbe_Add(&probe, 12, "derp12.example.com");
+    probe.entries[0].median_us = 35000;
+    probe.entries[1].median_us = REGION_PROBE_UNREACHABLE;
+    probe.entries[2].median_us = 12000;
+
+    RegionLatencyTable table;
+    RegionProbe_ToTable(&probe, &table, 1700000000);
+    TEST_ASSERT_EQUAL(2, table.count);
+    TEST_ASSERT_EQUAL(12, table.entries[0].id);
+    TEST_ASSERT_EQUAL(4, table.entries[1].id);
+
+    const char* path = "test_region_probe_table.txt";
+    TEST_ASSERT_TRUE(RegionProbe_SaveTable(&table, path));
+
+    RegionLatencyTable loaded;
+    TEST_ASSERT_TRUE(RegionProbe_LoadTable(&loaded, path));
+    TEST_ASSERT_EQUAL(2, loaded.count);
+    TEST_ASSERT_TRUE(loaded.measured_at == 1700000000);
+    TEST_ASSERT_EQUAL(12, loaded.entries[0].id);
+    TEST_ASSERT_EQUAL(12000, loaded.entries[0].median_us);
+    TEST_ASSERT_TRUE(strcmp(loaded.entries[0].host, "derp12.example.com") == 0);
+    TEST_ASSERT_TRUE(strcmp(loaded.entries[1].host, "derp4.example.com") == 0);
+
+    TEST_ASSERT_EQUAL(12, RegionProbe_TableBest(&loaded, 1700000000 + 3600, REGION_PROBE_TABLE_MAX_AGE));
+    TEST_ASSERT_EQUAL(0, RegionProbe_TableBest(&loaded, 1700000000 + REGION_PROBE_TABLE_MAX_AGE + 1, REGION_PROBE_TABLE_MAX_AGE));
+
+    // malformed files leave the table alone
+    FILE* f = fopen(path, "wb");
+    fputs("derp-latency 1 1700000000\n4 notanumber derp4\n", f);
+    fclose(f);
+    TEST_ASSERT_FALSE(RegionProbe_LoadTable(&loaded, path));
+    TEST_ASSERT_EQUAL(2, loaded.count);
+    remove(path);
+    TEST_ASSERT_FALSE(RegionProbe_LoadTable(&loaded, path));
+}
+
+// 32 regions behind a 50 ms DNS and 3 listeners with 5, 15 and 30 ms replies, resolved on one
+// thread (what the old code did, one GetAddrInfoExW after the other) vs the resolver pool
+TEST(benchmark_selection_time_serial_vs_parallel_dns)
+{
+    static Dns dns;
+    memset(&dns, 0, sizeof(dns));
+    dns.resolve_ms = 50;
+
+    uint32_t delays[3][1] = { { 5 }, { 15 }, { 30 } };
+    Listener listeners[3];
+    for (int i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_TRUE(Listener_Start(&listeners[i], delays[i], 1));
+    }
+
+    static RegionProbe probe;
+    RegionProbe_Init(&probe);
+    for (uint32_t id = 1; id <= 32; id++)
+    {
+        dns.ports[id] = listeners[id % 3].port;
+        AddRegion(&probe, id);
+    }
+
+    printf("\n    %-22s %12s %12s %8s\n", "", "resolve ms", "probe ms", "best");
+    uint64_t resolve_us[2];
+    uint32_t best[2];
+    for (int parallel = 0; parallel < 2; parallel++)
+    {
+        RegionProbeConfig config =
+        {
+            .port = 443, .samples = 3, .timeout_ms = 500,
+            .resolve_threads = parallel ? 0 : 1,
+            .request = "x", .request_size = 1,
+            .resolve = Dns_Resolve, .context = &dns,
+        };
+        RegionProbe_Run(&probe, &config);
+        resolve_us[parallel] = probe.resolve_wall_us;
+        best[parallel] = RegionProbe_Best(&probe);
+        printf("    %-22s %12.1f %12.1f %8u\n", parallel ? "resolver pool (16)" : "serial resolve",
+            probe.resolve_wall_us / 1000.0, probe.probe_wall_us / 1000.0, best[parallel]);
+    }
+    printf("    ");
+    for (int i = 0; i < 3; i++)
+    {
+        Listener_Stop(&listeners[i]);
+    }
+
+    TEST_ASSERT_TRUE(resolve_us[1] * 4 < resolve_us[0]);
+    TEST_ASSERT_EQUAL(0, best[0] % 3);
+    TEST_ASSERT_EQUAL(0, best[1] % 3);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  DERP Region Probe Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(median_of_odd_and_even_counts);
+    RUN_TEST(add_rejects_empty_and_long_hosts);
+    RUN_TEST(hostnames_resolve_concurrently);
+    RUN_TEST(lowest_median_wins_over_one_fast_sample);
+    RUN_TEST(unreachable_regions_are_skipped);
+    RUN_TEST(region_must_answer_half_the_rounds);
+    RUN_TEST(latency_table_roundtrip_and_age);
+    RUN_TEST(benchmark_selection_time_serial_vs_parallel_dns);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
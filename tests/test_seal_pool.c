@@ -0,0 +1,410 @@
+// Unit tests and benchmark for parallel chunk sealing with ordered emission (seal_pool.c)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// derpnet.h pulls in winsock2.h, which must come before windows.h
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // loopback relay speaks the DERP framing without TLS, like the Docker derper
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "derp_loopback.h"
+#include "seal_pool.h"
+
+#define VIDEO_CHUNK_SIZE 65000     // BUDDY_SEND_BUFFER_SIZE
+#define KEYFRAME_SIZE (1u << 20)   // 1080p IDR frame at a high bitrate
+#define BENCH_FRAMES 40
+
+// Records what the pool did, for the ordering and window tests
+typedef struct {
+    uint32_t count;
+    uint32_t delay_ms[64];
+    uint32_t fail_at;              // emit returns false for this index
+    volatile uint32_t started[64];
+    volatile uint32_t finished[64];
+    uint32_t emit_order[64];
+    uint32_t emit_count;
+    uint32_t max_ahead;            // highest index started minus chunks emitted at that time
+    BuddyMutex lock;
+} Trace;
+
+static void Trace_Job(void* context, uint32_t index)
+{
+    Trace* trace = context;
+    BuddyMutex_Lock(&trace->lock);
+    trace->started[index] = 1;
+    uint32_t ahead = index - trace->emit_count;
+    if (ahead > trace->max_ahead) trace->max_ahead = ahead;
+    BuddyMutex_Unlock(&trace->lock);
+
+    if (trace->delay_ms[index]) BuddyThread_Sleep(trace->delay_ms[index]);
+    trace->finished[index] = 1;
+}
+
+static bool Trace_Emit(void* context, uint32_t index)
+{
+    Trace* trace = context;
+    BuddyMutex_Lock(&trace->lock);
+    bool ready = trace->finished[index] != 0;
+    for (uint32_t i = 0; i < index; i++) ready = ready && trace->finished[i];
+    trace->emit_order[trace->emit_count++] = ready ? index : UINT32_MAX;
+    BuddyMutex_Unlock(&trace->lock);
+    return index != trace->fail_at;
+}
+
+static void Trace_Init(Trace* trace, uint32_t count)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->count = count;
+    trace->fail_at = UINT32_MAX;
+    BuddyMutex_Init(&trace->lock);
+}
+
+TEST(emits_in_order_when_chunks_finish_out_of_order)
+{
+    SealPool pool;
+    TEST_ASSERT_TRUE(SealPool_Start(&pool, 4));
+
+    // early chunks are the slow ones, so they finish last
+    Trace trace;
+    Trace_Init(&trace, 12);
+    for (uint32_t i = 0; i < 4; i++) trace.delay_ms[i] = 20 - 5 * i;
+
+    TEST_ASSERT_TRUE(SealPool_Run(&pool, trace.count, Trace_Job, Trace_Emit, &trace));
+    TEST_ASSERT_EQUAL(trace.count, trace.emit_count);
+    for (uint32_t i = 0; i < trace.count; i++)
+    {
+        TEST_ASSERT_EQUAL(i, trace.emit_order[i]);
+    }
+    TEST_ASSERT_EQUAL(trace.count, pool.chunks);
+
+    // the pool is reusable, a run with nothing to do returns right away
+    Trace_Init(&trace, 0);
+    TEST_ASSERT_TRUE(SealPool_Run(&pool, 0, Trace_Job, Trace_Emit, &trace));
+    TEST_ASSERT_EQUAL(0, trace.emit_count);
+
+    SealPool_Stop(&pool);
+}
+
+TEST(single_thread_runs_on_caller)
+{
+    SealPool pool;
+    TEST_ASSERT_TRUE(SealPool_Start(&pool, 1));
+    TEST_ASSERT_EQUAL(0, pool.thread_count);
+
+    Trace trace;
+    Trace_Init(&trace, 40);
+    TEST_ASSERT_TRUE(SealPool_Run(&pool, trace.count, Trace_Job, Trace_Emit, &trace));
+    TEST_ASSERT_EQUAL(40, trace.emit_count);
+    TEST_ASSERT_EQUAL(39, trace.emit_order[39]);
+    TEST_ASSERT_EQUAL(40, pool.chunks_by_caller);
+
+    SealPool_Stop(&pool);
+}
+
+TEST(window_bounds_chunks_in_flight)
+{
+    SealPool pool;
+    TEST_ASSERT_TRUE(SealPool_Start(&pool, 8));
+
+    // chunk 0 stalls, the others may run ahead only as far as the window
+    Trace trace;
+    Trace_Init(&trace, 64);
+    trace.delay_ms[0] = 50;
+
+    TEST_ASSERT_TRUE(SealPool_Run(&pool, trace.count, Trace_Job, Trace_Emit, &trace));
+    TEST_ASSERT_EQUAL(64, trace.emit_count);
+    TEST_ASSERT_TRUE(trace.max_ahead < SEAL_POOL_WINDOW);
+    for (uint32_t i = 0; i < trace.count; i++)
+    {
+        TEST_ASSERT_EQUAL(i, trace.emit_order[i]);
+    }
+
+    SealPool_Stop(&pool);
+}
+
+TEST(emit_failure_stops_after_chunks_in_flight)
+{
+    SealPool pool;
+    TEST_ASSERT_TRUE(SealPool_Start(&pool, 4));
+
+    Trace trace;
+    Trace_Init(&trace, 64);
+    trace.fail_at = 5;
+    for (uint32_t i = 0; i < trace.count; i++) trace.delay_ms[i] = 1;
+
+    TEST_ASSERT_FALSE(SealPool_Run(&pool, trace.count, Trace_Job, Trace_Emit, &trace));
+    TEST_ASSERT_EQUAL(6, trace.emit_count);
+
+    // nothing past the window was started and whatever started has finished
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < trace.count; i++)
+    {
+        started += trace.started[i];
+        TEST_ASSERT_EQUAL(trace.started[i], trace.finished[i]);
+    }
+    TEST_ASSERT_TRUE(started < 6 + SEAL_POOL_WINDOW);
+
+    // next run starts clean
+    Trace_Init(&trace, 8);
+    TEST_ASSERT_TRUE(SealPool_Run(&pool, trace.count, Trace_Job, Trace_Emit, &trace));
+    TEST_ASSERT_EQUAL(8, trace.emit_count);
+
+    SealPool_Stop(&pool);
+}
+
+// Same chunking as Buddy_OutputFromEncoder: the first chunk carries the video header,
+// later chunks one packet type byte, each sealed into its own slot with its own nonce
+typedef struct {
+    DerpNet* net;
+    const DerpKey* target;
+    const uint8_t* header;
+    uint32_t header_size;
+    const uint8_t* data;
+    uint32_t size;
+    uint8_t shared_key[32];
+    uint8_t nonce[SEAL_POOL_WINDOW][24];
+    uint8_t* slots;                // SEAL_POOL_WINDOW frames of DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE
+    size_t slot_size[SEAL_POOL_WINDOW];
+    uint64_t first_emit_us;
+} FrameSend;
+
+static uint32_t FrameSend_ChunkCount(const FrameSend* send)
+{
+    uint32_t first = VIDEO_CHUNK_SIZE - send->header_size;
+    if (send->size <= first) return 1;
+    return 1 + (send->size - first + (VIDEO_CHUNK_SIZE - 1) - 1) / (VIDEO_CHUNK_SIZE - 1);
+}
+
+static void FrameSend_Chunk(const FrameSend* send, uint32_t index, DerpNetIoVec chunk[2])
+{
+    uint32_t first = VIDEO_CHUNK_SIZE - send->header_size;
+    uint32_t offset = index == 0 ? 0 : first + (index - 1) * (VIDEO_CHUNK_SIZE - 1);
+    uint32_t limit = index == 0 ? first : VIDEO_CHUNK_SIZE - 1;
+    uint32_t size = send->size - offset < limit ? send->size - offset : limit;
+
+    chunk[0] = (DerpNetIoVec){ send->header, index == 0 ? send->header_size : 1 };
+    chunk[1] = (DerpNetIoVec){ send->data + offset, size };
+}
+
+static void FrameSend_Seal(void* context, uint32_t index)
+{
+    FrameSend* send = context;
+    uint32_t slot = index % SEAL_POOL_WINDOW;
+    DerpNetIoVec chunk[2];
+    FrameSend_Chunk(send, index, chunk);
+    send->slot_size[slot] = DerpNet_SealFrameV(send->slots + slot * (DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE),
+        send->target, send->shared_key, send->nonce[slot], chunk, 2);
+}
+
+static bool FrameSend_Emit(void* context, uint32_t index)
+{
+    FrameSend* send = context;
+    uint32_t slot = index % SEAL_POOL_WINDOW;
+    if (index == 0) send->first_emit_us = BuddyClock_NowUs();
+
+    // nonce for the chunk that will reuse this slot, picked in send order on this thread
+    uint32_t count = FrameSend_ChunkCount(send);
+    if (index + SEAL_POOL_WINDOW < count)
+    {
+        DerpNet_NextNonce(send->net, send->nonce[slot]);
+    }
+    return DerpNet_QueueSealed(send->net, send->slots + slot * (DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE), send->slot_size[slot]) &&
+        DerpNet_OnWritable(send->net);
+}
+
+static bool FrameSend_Run(FrameSend* send, SealPool* pool)
+{
+    uint32_t count = FrameSend_ChunkCount(send);
+    DerpNet_PrepareSeal(send->net, send->target, send->shared_key, send->nonce[0]);
+    for (uint32_t i = 1; i < count && i < SEAL_POOL_WINDOW; i++)
+    {
+        DerpNet_NextNonce(send->net, send->nonce[i]);
+    }
+    return SealPool_Run(pool, count, FrameSend_Seal, FrameSend_Emit, send) && DerpNet_Flush(send->net);
+}
+
+typedef struct {
+    DerpKey secret[2];
+    DerpKey public_key[2];
+    DerpNet* net[2];
+    DerpLoopback loop;
+} Pair;
+
+static bool Pair_Start(Pair* pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DerpNet_CreateNewKey(&pair->secret[i]);
+        DerpNet_GetPublicKey(&pair->secret[i], &pair->public_key[i]);
+        pair->net[i] = malloc(sizeof(DerpNet));
+    }
+    return DerpLoopback_Start(&pair->loop, pair->net[0], &pair->secret[0], pair->net[1], &pair->secret[1]);
+}
+
+static void Pair_Stop(Pair* pair)
+{
+    DerpLoopback_Stop(&pair->loop);
+    free(pair->net[0]);
+    free(pair->net[1]);
+}
+
+// Reassembles frames on the receiving side and checks every byte
+typedef struct {
+    DerpNet* net;
+    const uint8_t* expected;
+    uint32_t size;
+    uint32_t frames;
+    uint32_t frames_ok;
+    BuddyThread thread;
+} Receiver;
+
+static void Receiver_Run(void* arg)
+{
+    Receiver* rx = arg;
+    for (uint32_t frame = 0; frame < rx->frames; frame++)
+    {
+        uint32_t received = 0;
+        bool ok = true;
+        while (received < rx->size)
+        {
+            DerpKey from;
+            uint8_t* data;
+            uint32_t size;
+            if (DerpNet_Recv(rx->net, &from, &data, &size, true) < 0) return;
+
+            // skip the packet type byte, and on the first chunk the fake video header
+            uint32_t skip = received == 0 ? 8 : 1;
+            if (size < skip || received + (size - skip) > rx->size) return;
+            ok = ok && memcmp(data + skip, rx->expected + received, size - skip) == 0;
+            received += size - skip;
+        }
+        rx->frames_ok += ok;
+    }
+}
+
+static uint8_t* MakeFrame(uint32_t size)
+{
+    uint8_t* data = malloc(size);
+    uint32_t state = 12345;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        state = state * 1103515245 + 12345;
+        data[i] = (uint8_t)(state >> 16);
+    }
+    return data;
+}
+
+TEST(sealed_chunks_arrive_in_order_through_loopback)
+{
+    Pair pair;
+    TEST_ASSERT_TRUE(Pair_Start(&pair));
+    SealPool pool;
+    TEST_ASSERT_TRUE(SealPool_Start(&pool, 4));
+
+    uint8_t* data = MakeFrame(KEYFRAME_SIZE);
+    uint8_t header[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    FrameSend send = {
+        .net = pair.net[0], .target = &pair.public_key[1],
+        .header = header, .header_size = sizeof(header), .data = data, .size = KEYFRAME_SIZE,
+        .slots = malloc(SEAL_POOL_WINDOW * (DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE)),
+    };
+
+    Receiver rx = { .net = pair.net[1], .expected = data, .size = KEYFRAME_SIZE, .frames = 3 };
+    BuddyThread_Start(&rx.thread, Receiver_Run, &rx);
+
+    // three frames in a row: more chunks than the window, and the nonce counter keeps going across runs
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_TRUE(FrameSend_Run(&send, &pool));
+    }
+    BuddyThread_Join(rx.thread);
+
+    TEST_ASSERT_EQUAL(3, rx.frames_ok);
+    TEST_ASSERT_EQUAL(0, pair.net[1]->ReplayDrops);
+    TEST_ASSERT_EQUAL(3 * FrameSend_ChunkCount(&send), pool.chunks);
+
+    free(send.slots);
+    free(data);
+    SealPool_Stop(&pool);
+    Pair_Stop(&pair);
+}
+
+TEST(benchmark_keyframe_seal_scaling)
+{
+    uint32_t cpus = BuddyCpu_Count();
+    uint32_t max_threads = cpus < 8 ? (cpus < 4 ? 4 : cpus) : 8;
+
+    uint8_t* data = MakeFrame(KEYFRAME_SIZE);
+    uint8_t header[8] = { 0 };
+
+    printf("\n    %u CPUs, %u KB keyframe in %u byte chunks\n", cpus, KEYFRAME_SIZE >> 10, VIDEO_CHUNK_SIZE);
+    printf("    %-10s %14s %16s %10s\n", "threads", "ms/keyframe", "first chunk us", "speedup");
+
+    double serial_ms = 0;
+    bool all_ok = true;
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        Pair pair;
+        Pair_Start(&pair);
+        SealPool pool;
+        SealPool_Start(&pool, threads);
+
+        FrameSend send = {
+            .net = pair.net[0], .target = &pair.public_key[1],
+            .header = header, .header_size = sizeof(header), .data = data, .size = KEYFRAME_SIZE,
+            .slots = malloc(SEAL_POOL_WINDOW * (DERPNET_FRAME_OVERHEAD + VIDEO_CHUNK_SIZE)),
+        };
+        Receiver rx = { .net = pair.net[1], .expected = data, .size = KEYFRAME_SIZE, .frames = BENCH_FRAMES };
+        BuddyThread_Start(&rx.thread, Receiver_Run, &rx);
+
+        // time from encoder output to the last chunk queued, and to the first chunk on the socket
+        uint64_t total_us = 0;
+        uint64_t first_us = 0;
+        for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        {
+            uint64_t start = BuddyClock_NowUs();
+            all_ok = FrameSend_Run(&send, &pool) && all_ok;
+            total_us += BuddyClock_NowUs() - start;
+            first_us += send.first_emit_us - start;
+        }
+        BuddyThread_Join(rx.thread);
+        all_ok = all_ok && rx.frames_ok == BENCH_FRAMES;
+
+        double ms = total_us / 1000.0 / BENCH_FRAMES;
+        if (threads == 1) serial_ms = ms;
+        printf("    %-10u %14.2f %16.0f %9.2fx\n", threads, ms, (double)first_us / BENCH_FRAMES, serial_ms / ms);
+
+        free(send.slots);
+        SealPool_Stop(&pool);
+        Pair_Stop(&pair);
+    }
+    printf("    ");
+    free(data);
+
+    TEST_ASSERT_TRUE(all_ok);
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  Parallel Seal Pool Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(emits_in_order_when_chunks_finish_out_of_order);
+    RUN_TEST(single_thread_runs_on_caller);
+    RUN_TEST(window_bounds_chunks_in_flight);
+    RUN_TEST(emit_failure_stops_after_chunks_in_flight);
+    RUN_TEST(sealed_chunks_arrive_in_order_through_loopback);
+    RUN_TEST(benchmark_keyframe_seal_scaling);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,574 @@
+// Tests for resuming a session after a lost DERP connection (session_resume.c): the state machine
+// on a virtual clock, then two ends on the local epoll relay while it cuts or drops every connection
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1   // local relay speaks plain HTTP, like the Docker derper on 8080
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include "test_framework.h"
+#include "platform.h"
+#include "derp_relay.h"
+#include "derp_warm.h"
+#include "session_resume.h"
+
+#define MS 1000
+
+static const uint8_t PeerKey[SESSION_RESUME_KEY_SIZE] = { 1, 2, 3 };
+static const uint8_t OtherKey[SESSION_RESUME_KEY_SIZE] = { 9, 9, 9 };
+
+static void Start(SessionResume* resume)
+{
+    SessionResumeConfig config = { .grace_ms = 5000, .hello_ms = 200 };
+    SessionResume_Init(resume, &config, PeerKey);
+}
+
+TEST(lost_link_reconnects_and_resumes_on_welcome)
+{
+    SessionResume resume;
+    Start(&resume);
+    TEST_ASSERT_EQUAL(SESSION_RESUME_ACTIVE, resume.state);
+    TEST_ASSERT_FALSE(SessionResume_HelloDue(&resume, 0));
+
+    TEST_ASSERT_TRUE(SessionResume_OnLinkLost(&resume, 1000 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_RECONNECTING, resume.state);
+    TEST_ASSERT_FALSE(SessionResume_HelloDue(&resume, 1000 * MS));   // nothing to send it on
+
+    SessionResume_OnReconnected(&resume, 1800 * MS);
+    TEST_ASSERT_EQUAL(SESSION_RESUME_WAITING, resume.state);
+    TEST_ASSERT_TRUE(SessionResume_HelloDue(&resume, 1800 * MS));
+    TEST_ASSERT_FALSE(SessionResume_HelloDue(&resume, 1999 * MS));
+    TEST_ASSERT_TRUE(SessionResume_HelloDue(&resume, 2000 * MS));
+    TEST_ASSERT_EQUAL(2, resume.hellos_sent);
+
+    // the answer needs no answer, the session is back and starts from a keyframe
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, PeerKey, SESSION_RESUME_WELCOME, 2050 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_ACTIVE, resume.state);
+    TEST_ASSERT_TRUE(resume.keyframe_needed);
+    TEST_ASSERT_EQUAL(1, resume.resumes);
+    TEST_ASSERT_EQUAL(1050 * MS, resume.last_outage_us);
+    TEST_ASSERT_EQUAL(250 * MS, resume.last_rejoin_us);
+    TEST_ASSERT_FALSE(SessionResume_HelloDue(&resume, 3000 * MS));
+}
+
+TEST(peer_gone_waits_and_its_hello_is_answered)
+{
+    SessionResume resume;
+    Start(&resume);
+
+    // somebody else leaving says nothing about this session
+    TEST_ASSERT_FALSE(SessionResume_OnPeerGone(&resume, OtherKey, 100 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_ACTIVE, resume.state);
+
+    TEST_ASSERT_TRUE(SessionResume_OnPeerGone(&resume, PeerKey, 100 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_WAITING, resume.state);
+    TEST_ASSERT_FALSE(SessionResume_OnPeerGone(&resume, PeerKey, 150 * MS));
+    TEST_ASSERT_TRUE(SessionResume_HelloDue(&resume, 100 * MS));
+
+    TEST_ASSERT_TRUE(SessionResume_OnMessage(&resume, PeerKey, SESSION_RESUME_HELLO, 900 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_ACTIVE, resume.state);
+    TEST_ASSERT_TRUE(resume.keyframe_needed);
+    TEST_ASSERT_EQUAL(800 * MS, resume.last_outage_us);
+
+    // the peer's welcome to our hello crossed with it: nothing more to do
+    resume.keyframe_needed = false;
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, PeerKey, SESSION_RESUME_WELCOME, 910 * MS));
+    TEST_ASSERT_FALSE(resume.keyframe_needed);
+    TEST_ASSERT_EQUAL(1, resume.resumes);
+}
+
+TEST(hello_while_active_is_answered_with_a_keyframe)
+{
+    // the peer reconnected before anything told this side it had been gone
+    SessionResume resume;
+    Start(&resume);
+    TEST_ASSERT_TRUE(SessionResume_OnMessage(&resume, PeerKey, SESSION_RESUME_HELLO, 100 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_ACTIVE, resume.state);
+    TEST_ASSERT_TRUE(resume.keyframe_needed);
+    TEST_ASSERT_EQUAL(0, resume.resumes);
+}
+
+TEST(only_the_peer_key_resumes)
+{
+    SessionResume resume;
+    Start(&resume);
+    SessionResume_OnLinkLost(&resume, 0);
+    SessionResume_OnReconnected(&resume, 100 * MS);
+
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, OtherKey, SESSION_RESUME_HELLO, 200 * MS));
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, OtherKey, SESSION_RESUME_WELCOME, 200 * MS));
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, PeerKey, 7, 200 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_WAITING, resume.state);
+    TEST_ASSERT_EQUAL(2, resume.strangers);
+    TEST_ASSERT_FALSE(resume.keyframe_needed);
+
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, PeerKey, SESSION_RESUME_WELCOME, 300 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_ACTIVE, resume.state);
+}
+
+TEST(grace_period_expires_once_across_losses)
+{
+    SessionResume resume;
+    Start(&resume);
+    SessionResume_OnLinkLost(&resume, 1000 * MS);
+    SessionResume_OnReconnected(&resume, 3000 * MS);
+
+    // lost again while waiting: the grace period still counts from the first loss
+    TEST_ASSERT_TRUE(SessionResume_OnLinkLost(&resume, 4000 * MS));
+    TEST_ASSERT_FALSE(SessionResume_Poll(&resume, 5999 * MS));
+    TEST_ASSERT_TRUE(SessionResume_Poll(&resume, 6000 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_EXPIRED, resume.state);
+
+    // nothing brings it back
+    TEST_ASSERT_FALSE(SessionResume_OnLinkLost(&resume, 6001 * MS));
+    SessionResume_OnReconnected(&resume, 6001 * MS);
+    TEST_ASSERT_FALSE(SessionResume_OnMessage(&resume, PeerKey, SESSION_RESUME_HELLO, 6001 * MS));
+    TEST_ASSERT_EQUAL(SESSION_RESUME_EXPIRED, resume.state);
+
+    // and a stopped session has nothing to keep
+    SessionResume_Stop(&resume);
+    TEST_ASSERT_FALSE(SessionResume_OnLinkLost(&resume, 7000 * MS));
+    TEST_ASSERT_FALSE(SessionResume_Poll(&resume, 99000 * MS));
+}
+
+// One end of a session on the relay: its connection, the resume state and the warm connection
+// that reconnects it with its own key, the way ScreenBuddy does
+typedef struct {
+    DerpNet* net;
+    DerpNet* warm_net;
+    DerpWarm warm;
+    bool warming;
+    DerpKey secret;
+    DerpKey public_key;
+    DerpKey peer;
+    SessionResume resume;
+    size_t peers_gone_seen;
+    uint32_t data_received;
+    bool closed;
+} End;
+
+static bool End_WarmOpen(void* context, void* net, const char* server, const uint8_t* key)
+{
+    (void)context;
+    DerpKey secret;
+    memcpy(secret.Bytes, key, sizeof(secret.Bytes));
+    return DerpNet_Open(net, server, &secret);
+}
+
+static void End_WarmClose(void* context, void* net)
+{
+    (void)context;
+    DerpNet_Close(net);
+}
+
+static bool End_WarmPing(void* context, void* net, uint64_t id)
+{
+    (void)context;
+    uint8_t data[8];
+    Set64LE(data, id);
+    return DerpNet_SendPing(net, data);
+}
+
+static int End_WarmPoll(void* context, void* net, uint64_t* pong)
+{
+    (void)context;
+    DerpNet* derp = net;
+    for (;;)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        int got = DerpNet_Recv(derp, &from, &data, &size, false);
+        if (got < 0) return -1;
+        if (got == 0) break;
+    }
+    if (derp->PongsReceived)
+    {
+        *pong = Get64LE(derp->LastPong);
+    }
+    return 0;
+}
+
+static void End_Init(End* end, const char* server)
+{
+    memset(end, 0, sizeof(*end));
+    end->net = malloc(sizeof(DerpNet));
+    end->warm_net = malloc(sizeof(DerpNet));
+    DerpNet_CreateNewKey(&end->secret);
+    DerpNet_GetPublicKey(&end->secret, &end->public_key);
+    TEST_ASSERT_TRUE(DerpNet_Open(end->net, server, &end->secret));
+}
+
+static void End_Pair(End* a, End* b, uint32_t grace_ms)
+{
+    SessionResumeConfig config = { .grace_ms = grace_ms, .hello_ms = 100 };
+    a->peer = b->public_key;
+    b->peer = a->public_key;
+    SessionResume_Init(&a->resume, &config, a->peer.Bytes);
+    SessionResume_Init(&b->resume, &config, b->peer.Bytes);
+}
+
+static void End_Send(End* end, uint8_t message)
+{
+    DerpNet_SendUrgent(end->net, &end->peer, &message, 1);
+}
+
+// Connection gone: closed, and the same key reconnects in the background with a short backoff
+static void End_LinkLost(End* end, const char* server)
+{
+    DerpNet_Close(end->net);
+    if (!SessionResume_OnLinkLost(&end->resume, BuddyClock_NowUs()))
+    {
+        end->closed = true;
+        return;
+    }
+    DerpWarmConfig config =
+    {
+        .net = end->warm_net,
+        .net_size = sizeof(DerpNet),
+        .max_backoff_ms = SESSION_RESUME_MAX_BACKOFF_MS,
+        .open = End_WarmOpen,
+        .close = End_WarmClose,
+        .ping = End_WarmPing,
+        .poll = End_WarmPoll,
+    };
+    end->warming = DerpWarm_Start(&end->warm, &config, server, end->secret.Bytes);
+}
+
+// One pass of what ScreenBuddy's network thread and resume timer do
+static void End_Pump(End* end, const char* server)
+{
+    if (end->closed)
+    {
+        return;
+    }
+    uint64_t now = BuddyClock_NowUs();
+    if (SessionResume_Poll(&end->resume, now))
+    {
+        if (end->warming)
+        {
+            DerpWarm_Stop(&end->warm);
+            end->warming = false;
+        }
+        end->closed = true;
+        return;
+    }
+
+    if (end->resume.state == SESSION_RESUME_RECONNECTING)
+    {
+        if (DerpWarm_IsReady(&end->warm) && DerpWarm_Take(&end->warm, end->net, 0))
+        {
+            DerpWarm_Stop(&end->warm);
+            end->warming = false;
+            SessionResume_OnReconnected(&end->resume, now);
+        }
+        return;
+    }
+
+    for (;;)
+    {
+        DerpKey from;
+        uint8_t* data;
+        uint32_t size;
+        int got = DerpNet_Recv(end->net, &from, &data, &size, false);
+        if (got < 0)
+        {
+            End_LinkLost(end, server);
+            return;
+        }
+        if (got == 0)
+        {
+            break;
+        }
+        if (size == 1 && SessionResume_OnMessage(&end->resume, from.Bytes, data[0], now))
+        {
+            End_Send(end, SESSION_RESUME_WELCOME);
+        }
+        else if (size > 1)
+        {
+            end->data_received++;
+        }
+    }
+    if (end->net->PeersGone != end->peers_gone_seen)
+    {
+        end->peers_gone_seen = end->net->PeersGone;
+        SessionResume_OnPeerGone(&end->resume, end->net->LastPeerGone, now);
+    }
+    if (SessionResume_HelloDue(&end->resume, now))
+    {
+        End_Send(end, SESSION_RESUME_HELLO);
+    }
+}
+
+static void End_Free(End* end)
+{
+    if (end->warming)
+    {
+        DerpWarm_Stop(&end->warm);
+    }
+    if (!end->closed && end->resume.state != SESSION_RESUME_RECONNECTING)
+    {
+        DerpNet_Close(end->net);
+    }
+    free(end->net);
+    free(end->warm_net);
+}
+
+// Pumps both ends until both are active again, returns false after timeout_ms
+static bool Ends_WaitActive(End* a, End* b, const char* server, uint32_t timeout_ms)
+{
+    for (uint32_t i = 0; i < timeout_ms; i++)
+    {
+        End_Pump(a, server);
+        End_Pump(b, server);
+        if (a->resume.state == SESSION_RESUME_ACTIVE && b->resume.state == SESSION_RESUME_ACTIVE)
+        {
+            return true;
+        }
+        BuddyThread_Sleep(1);
+    }
+    return false;
+}
+
+// Pumps both ends until neither is active, returns false after timeout_ms
+static bool Ends_WaitLost(End* a, End* b, const char* server, uint32_t timeout_ms)
+{
+    for (uint32_t i = 0; i < timeout_ms; i++)
+    {
+        End_Pump(a, server);
+        End_Pump(b, server);
+        if (a->resume.state != SESSION_RESUME_ACTIVE && b->resume.state != SESSION_RESUME_ACTIVE)
+        {
+            return true;
+        }
+        BuddyThread_Sleep(1);
+    }
+    return false;
+}
+
+// Pumps both ends for ms milliseconds
+static void Ends_Pump(End* a, End* b, const char* server, uint32_t ms)
+{
+    for (uint32_t i = 0; i < ms; i++)
+    {
+        End_Pump(a, server);
+        End_Pump(b, server);
+        BuddyThread_Sleep(1);
+    }
+}
+
+// The session carries data again: a -> b
+static bool Ends_Exchange(End* a, End* b, const char* server)
+{
+    uint32_t before = b->data_received;
+    if (!DerpNet_Send(a->net, &a->peer, "frame", 5))
+    {
+        return false;
+    }
+    for (int i = 0; i < 2000 && b->data_received == before; i++)
+    {
+        End_Pump(b, server);
+        BuddyThread_Sleep(1);
+    }
+    return b->data_received == before + 1;
+}
+
+static DerpRelay* Relay_Start(uint16_t port, char* address, size_t address_size)
+{
+    DerpRelayConfig config = { .port = port, .threads = 1 };
+    DerpRelay* relay = DerpRelay_Start(&config);
+    if (relay)
+    {
+        snprintf(address, address_size, "127.0.0.1:%u", DerpRelay_GetPort(relay));
+    }
+    return relay;
+}
+
+TEST(cut_connections_resume_both_ends_with_the_same_keys)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, address, sizeof(address));
+    TEST_ASSERT_NOT_NULL(relay);
+    End sharer, viewer;
+    End_Init(&sharer, address);
+    End_Init(&viewer, address);
+    End_Pair(&sharer, &viewer, 5000);
+    TEST_ASSERT_TRUE(Ends_Exchange(&sharer, &viewer, address));
+
+    TEST_ASSERT_EQUAL(2, DerpRelay_DropClients(relay));
+    uint64_t cut = BuddyClock_NowUs();
+    TEST_ASSERT_TRUE(Ends_WaitLost(&sharer, &viewer, address, 1000));
+    TEST_ASSERT_TRUE(Ends_WaitActive(&sharer, &viewer, address, 3000));
+    uint64_t resumed_us = BuddyClock_NowUs() - cut;
+    printf("\n    resumed %.1f ms after the relay cut both connections\n    ", resumed_us / 1000.0);
+    TEST_ASSERT_TRUE(resumed_us < 1000 * MS);
+
+    TEST_ASSERT_EQUAL(1, sharer.resume.resumes);
+    TEST_ASSERT_EQUAL(1, viewer.resume.resumes);
+    TEST_ASSERT_TRUE(sharer.resume.keyframe_needed);
+    TEST_ASSERT_TRUE(Ends_Exchange(&sharer, &viewer, address));
+    TEST_ASSERT_TRUE(Ends_Exchange(&viewer, &sharer, address));
+    TEST_ASSERT_TRUE(memcmp(sharer.net->UserPrivateKey, sharer.secret.Bytes, 32) == 0);
+
+    End_Free(&sharer);
+    End_Free(&viewer);
+    DerpRelay_Stop(relay);
+}
+
+TEST(relay_outage_resumes_within_a_second_of_recovery)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, address, sizeof(address));
+    uint16_t port = DerpRelay_GetPort(relay);
+    End sharer, viewer;
+    End_Init(&sharer, address);
+    End_Init(&viewer, address);
+    End_Pair(&sharer, &viewer, 10000);
+
+    // gone for two seconds, long enough for the backoff to reach its cap
+    DerpRelay_Stop(relay);
+    Ends_Pump(&sharer, &viewer, address, 2000);
+    TEST_ASSERT_EQUAL(SESSION_RESUME_RECONNECTING, sharer.resume.state);
+    TEST_ASSERT_EQUAL(SESSION_RESUME_RECONNECTING, viewer.resume.state);
+    BuddyMutex_Lock(&sharer.warm.lock);
+    uint64_t failures = sharer.warm.open_failures;
+    BuddyMutex_Unlock(&sharer.warm.lock);
+    TEST_ASSERT_TRUE(failures >= 3);
+
+    relay = Relay_Start(port, address, sizeof(address));
+    TEST_ASSERT_NOT_NULL(relay);
+    uint64_t back = BuddyClock_NowUs();
+    TEST_ASSERT_TRUE(Ends_WaitActive(&sharer, &viewer, address, 3000));
+    uint64_t resumed_us = BuddyClock_NowUs() - back;
+    printf("\n    resumed %.1f ms after the relay came back (outage %.0f ms)\n    ",
+        resumed_us / 1000.0, sharer.resume.last_outage_us / 1000.0);
+    TEST_ASSERT_TRUE(resumed_us < 1000 * MS);
+    TEST_ASSERT_TRUE(Ends_Exchange(&sharer, &viewer, address));
+
+    End_Free(&sharer);
+    End_Free(&viewer);
+    DerpRelay_Stop(relay);
+}
+
+TEST(one_end_lost_is_noticed_by_the_other_through_peer_gone)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, address, sizeof(address));
+    End sharer, viewer;
+    End_Init(&sharer, address);
+    End_Init(&viewer, address);
+    End_Pair(&sharer, &viewer, 5000);
+
+    // only the viewer's connection dies and it stays away for now; the sharer's next frame to it
+    // comes back as PeerGone
+    DerpNet_Close(viewer.net);
+    SessionResume_OnLinkLost(&viewer.resume, BuddyClock_NowUs());
+    for (int i = 0; i < 2000 && sharer.resume.state == SESSION_RESUME_ACTIVE; i++)
+    {
+        DerpNet_Send(sharer.net, &sharer.peer, "frame", 5);
+        End_Pump(&sharer, address);
+        BuddyThread_Sleep(1);
+    }
+    TEST_ASSERT_EQUAL(SESSION_RESUME_WAITING, sharer.resume.state);
+    TEST_ASSERT_TRUE(sharer.resume.hellos_sent >= 1);
+
+    // the viewer comes back with its key and is welcomed
+    TEST_ASSERT_TRUE(DerpNet_Open(viewer.net, address, &viewer.secret));
+    SessionResume_OnReconnected(&viewer.resume, BuddyClock_NowUs());
+    TEST_ASSERT_TRUE(Ends_WaitActive(&sharer, &viewer, address, 2000));
+    TEST_ASSERT_TRUE(sharer.resume.keyframe_needed);
+    TEST_ASSERT_TRUE(Ends_Exchange(&sharer, &viewer, address));
+
+    End_Free(&sharer);
+    End_Free(&viewer);
+    DerpRelay_Stop(relay);
+}
+
+TEST(stranger_cannot_take_over_a_waiting_session)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, address, sizeof(address));
+    End sharer, viewer;
+    End_Init(&sharer, address);
+    End_Init(&viewer, address);
+    End_Pair(&sharer, &viewer, 5000);
+    TEST_ASSERT_TRUE(SessionResume_OnPeerGone(&sharer.resume, sharer.peer.Bytes, BuddyClock_NowUs()));
+
+    // another key sends HELLO to the sharer: counted, not answered, the session keeps waiting
+    DerpKey stranger_secret, stranger;
+    DerpNet_CreateNewKey(&stranger_secret);
+    DerpNet_GetPublicKey(&stranger_secret, &stranger);
+    DerpNet* intruder = malloc(sizeof(DerpNet));
+    TEST_ASSERT_TRUE(DerpNet_Open(intruder, address, &stranger_secret));
+    uint8_t hello = SESSION_RESUME_HELLO;
+    TEST_ASSERT_TRUE(DerpNet_SendUrgent(intruder, &sharer.public_key, &hello, 1));
+    for (int i = 0; i < 2000 && sharer.resume.strangers == 0; i++)
+    {
+        End_Pump(&sharer, address);
+        BuddyThread_Sleep(1);
+    }
+    TEST_ASSERT_EQUAL(1, sharer.resume.strangers);
+    TEST_ASSERT_EQUAL(SESSION_RESUME_WAITING, sharer.resume.state);
+    DerpNet_Close(intruder);
+    free(intruder);
+
+    TEST_ASSERT_TRUE(Ends_WaitActive(&sharer, &viewer, address, 2000));
+
+    End_Free(&sharer);
+    End_Free(&viewer);
+    DerpRelay_Stop(relay);
+}
+
+TEST(outage_past_the_grace_period_ends_the_session)
+{
+    char address[32];
+    DerpRelay* relay = Relay_Start(0, address, sizeof(address));
+    uint16_t port = DerpRelay_GetPort(relay);
+    End sharer, viewer;
+    End_Init(&sharer, address);
+    End_Init(&viewer, address);
+    End_Pair(&sharer, &viewer, 300);
+
+    DerpRelay_Stop(relay);
+    Ends_Pump(&sharer, &viewer, address, 600);
+    TEST_ASSERT_TRUE(sharer.closed);
+    TEST_ASSERT_TRUE(viewer.closed);
+    TEST_ASSERT_EQUAL(SESSION_RESUME_EXPIRED, sharer.resume.state);
+    TEST_ASSERT_FALSE(sharer.warming);
+
+    // back too late: nothing reconnects
+    relay = Relay_Start(port, address, sizeof(address));
+    Ends_Pump(&sharer, &viewer, address, 300);
+    DerpRelayStats stats;
+    DerpRelay_GetStats(relay, &stats);
+    TEST_ASSERT_EQUAL(0, stats.clients);
+
+    End_Free(&sharer);
+    End_Free(&viewer);
+    DerpRelay_Stop(relay);
+}
+
+int main(void)
+{
+    TEST_INIT();
+
+    RUN_TEST(lost_link_reconnects_and_resumes_on_welcome);
+    RUN_TEST(peer_gone_waits_and_its_hello_is_answered);
+    RUN_TEST(hello_while_active_is_answered_with_a_keyframe);
+    RUN_TEST(only_the_peer_key_resumes);
+    RUN_TEST(grace_period_expires_once_across_losses);
+    RUN_TEST(cut_connections_resume_both_ends_with_the_same_keys);
+    RUN_TEST(relay_outage_resumes_within_a_second_of_recovery);
+    RUN_TEST(one_end_lost_is_noticed_by_the_other_through_peer_gone);
+    RUN_TEST(stranger_cannot_take_over_a_waiting_session);
+    RUN_TEST(outage_past_the_grace_period_ends_the_session);
+
+    TEST_SUMMARY();
+    return g_test_ctx.failed > 0 ? 1 : 0;
+}
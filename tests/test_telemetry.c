@@ -0,0 +1,235 @@
+// Unit tests for the round trip estimator, ping/pong and bitrate control, all on a virtual clock
+#include <stdio.h>
+#include <string.h>
+#include "test_framework.h"
+#include "telemetry.h"
+
+#define MS 1000
+#define MAX_BITRATE (4 * 1000 * 1000)
+
+static void Start(Telemetry* telemetry)
+{
+    TelemetryConfig config = { .max_bitrate = MAX_BITRATE };
+    Telemetry_Init(telemetry, &config, 0);
+}
+
+// one ping answered by the peer after rtt_us, its answer reporting missing frames
+static bool Exchange(Telemetry* telemetry, uint64_t now_us, uint64_t rtt_us, uint64_t missing)
+{
+    uint8_t ping[TELEMETRY_PING_SIZE];
+    uint8_t pong[TELEMETRY_PONG_SIZE];
+    if (!Telemetry_PingDue(telemetry, now_us, ping))
+    {
+        return false;
+    }
+    Telemetry_Answer(ping, missing, pong);
+    return Telemetry_OnPong(telemetry, pong, now_us + rtt_us);
+}
+
+TEST(rtt_min_avg_and_p95)
+{
+    TelemetryRtt rtt;
+    Telemetry_RttReset(&rtt);
+    TEST_ASSERT_EQUAL(0, Telemetry_RttPercentile(&rtt, 95.0));
+
+    TEST_ASSERT_TRUE(Telemetry_RttAdd(&rtt, 40 * MS));
+    TEST_ASSERT_EQUAL(40 * MS, rtt.min_us);
+    TEST_ASSERT_EQUAL(40 * MS, rtt.avg_us);
+
+    // 1..20 ms above 40, in scrambled order: p95 is the 19th smallest
+    for (int i = 0; i < 19; i++)
+    {
+        TEST_ASSERT_TRUE(Telemetry_RttAdd(&rtt, (41 + (i * 7) % 19) * MS));
+    }
+    TEST_ASSERT_EQUAL(20, rtt.count);
+    TEST_ASSERT_EQUAL(40 * MS, rtt.min_us);
+    TEST_ASSERT_EQUAL(58 * MS, Telemetry_RttPercentile(&rtt, 95.0));
+    TEST_ASSERT_EQUAL(59 * MS, Telemetry_RttPercentile(&rtt, 100.0));
+    TEST_ASSERT_TRUE(rtt.avg_us > 40 * MS && rtt.avg_us < 59 * MS);
+
+    // the smoothed average follows a step with gain 1/8
+    int64_t before = rtt.avg_us;
+    Telemetry_RttAdd(&rtt, before + 80 * MS);
+    TEST_ASSERT_EQUAL(before + 10 * MS, rtt.avg_us);
+}
+
+TEST(rtt_rejects_negative_and_stale_samples)
+{
+    TelemetryRtt rtt;
+    Telemetry_RttReset(&rtt);
+    TEST_ASSERT_FALSE(Telemetry_RttAdd(&rtt, -1));
+    TEST_ASSERT_FALSE(Telemetry_RttAdd(&rtt, TELEMETRY_MAX_RTT_US + 1));
+    TEST_ASSERT_EQUAL(0, rtt.count);
+    TEST_ASSERT_TRUE(Telemetry_RttAdd(&rtt, 0));
+}
+
+TEST(rtt_minimum_leaves_with_its_window)
+{
+    TelemetryRtt rtt;
+    Telemetry_RttReset(&rtt);
+    Telemetry_RttAdd(&rtt, 5 * MS);
+    for (int i = 0; i < TELEMETRY_RTT_WINDOW - 1; i++)
+    {
+        Telemetry_RttAdd(&rtt, 30 * MS);
+    }
+    TEST_ASSERT_EQUAL(5 * MS, rtt.min_us);
+
+    // the route changed, the old minimum no longer says anything about the queue
+    Telemetry_RttAdd(&rtt, 30 * MS);
+    TEST_ASSERT_EQUAL(30 * MS, rtt.min_us);
+    TEST_ASSERT_EQUAL(TELEMETRY_RTT_WINDOW, rtt.count);
+}
+
+TEST(pings_are_due_once_per_interval)
+{
+    Telemetry telemetry;
+    Start(&telemetry);
+    uint8_t ping[TELEMETRY_PING_SIZE];
+
+    TEST_ASSERT_TRUE(Telemetry_PingDue(&telemetry, 0, ping));
+    TEST_ASSERT_FALSE(Telemetry_PingDue(&telemetry, 999 * MS, ping));
+    TEST_ASSERT_TRUE(Telemetry_PingDue(&telemetry, 1000 * MS, ping));
+    TEST_ASSERT_EQUAL(2, telemetry.pings_sent);
+}
+
+TEST(pong_gives_round_trip_and_peer_missing_frames)
+{
+    Telemetry telemetry;
+    Start(&telemetry);
+
+    TEST_ASSERT_TRUE(Exchange(&telemetry, 0, 35 * MS, 0));
+    TEST_ASSERT_EQUAL(35 * MS, telemetry.rtt.last_us);
+    TEST_ASSERT_TRUE(Exchange(&telemetry, 1000 * MS, 45 * MS, 3));
+    TEST_ASSERT_EQUAL(45 * MS, telemetry.rtt.last_us);
+    TEST_ASSERT_EQUAL(3, telemetry.peer_missing);
+    TEST_ASSERT_EQUAL(2, telemetry.pongs_received);
+
+    // an answer to a ping never sent is ignored
+    uint8_t ping[TELEMETRY_PING_SIZE] = { 0 };
+    ping[0] = 7;
+    uint8_t pong[TELEMETRY_PONG_SIZE];
+    Telemetry_Answer(ping, 100, pong);
+    TEST_ASSERT_FALSE(Telemetry_OnPong(&telemetry, pong, 2000 * MS));
+    TEST_ASSERT_EQUAL(3, telemetry.peer_missing);
+    TEST_ASSERT_EQUAL(2, telemetry.rtt.count);
+}
+
+TEST(tick_reports_goodput_queue_and_lost_pings)
+{
+    Telemetry telemetry;
+    Start(&telemetry);
+    TelemetrySummary summary;
+
+    Exchange(&telemetry, 0, 20 * MS, 0);
+    Telemetry_OnReceive(&telemetry, 3, 500000);
+    Telemetry_OnReceive(&telemetry, 1, 2000);
+    Telemetry_OnReceive(&telemetry, TELEMETRY_CHANNELS, 99);
+    Telemetry_OnQueue(&telemetry, 80000);
+    Telemetry_OnQueue(&telemetry, 1000);
+    TEST_ASSERT_FALSE(Telemetry_Tick(&telemetry, 999 * MS, &summary));
+
+    uint8_t ping[TELEMETRY_PING_SIZE];
+    TEST_ASSERT_TRUE(Telemetry_PingDue(&telemetry, 1000 * MS, ping));
+    TEST_ASSERT_TRUE(Telemetry_Tick(&telemetry, 2000 * MS, &summary));
+    TEST_ASSERT_EQUAL(250000, summary.goodput[3]);
+    TEST_ASSERT_EQUAL(1000, summary.goodput[1]);
+    TEST_ASSERT_EQUAL(0, summary.goodput[0]);
+    TEST_ASSERT_EQUAL(1000, summary.queue_bytes);
+    TEST_ASSERT_EQUAL(80000, summary.queue_max);
+    TEST_ASSERT_EQUAL(1, summary.pings_lost);
+    TEST_ASSERT_EQUAL(1, summary.rtt_count);
+    TEST_ASSERT_EQUAL(20 * MS, summary.rtt_p95_us);
+
+    // counters start over, the largest queue too
+    TEST_ASSERT_TRUE(Telemetry_Tick(&telemetry, 3000 * MS, &summary));
+    TEST_ASSERT_EQUAL(0, summary.goodput[3]);
+    TEST_ASSERT_EQUAL(1000, summary.queue_max);
+}
+
+TEST(bitrate_backs_off_on_delay_and_recovers)
+{
+    Telemetry telemetry;
+    Start(&telemetry);
+    TelemetrySummary summary;
+    uint64_t now = 0;
+
+    // steady 30 ms path: stays at the maximum
+    for (int i = 0; i < 5; i++, now += 1000 * MS)
+    {
+        Exchange(&telemetry, now, 30 * MS, 0);
+        Telemetry_Tick(&telemetry, now + 1000 * MS, &summary);
+    }
+    TEST_ASSERT_EQUAL(MAX_BITRATE, summary.bitrate);
+
+    // a queue builds: 15% less per tick while it lasts, never under the minimum
+    uint32_t last = MAX_BITRATE;
+    for (int i = 0; i < 3; i++, now += 1000 * MS)
+    {
+        Exchange(&telemetry, now, 250 * MS, 0);
+        Telemetry_Tick(&telemetry, now + 1000 * MS, &summary);
+        TEST_ASSERT_EQUAL((uint64_t)last * 85 / 100, summary.bitrate);
+        last = summary.bitrate;
+    }
+    for (int i = 0; i < 30; i++, now += 1000 * MS)
+    {
+        Exchange(&telemetry, now, 250 * MS, 0);
+        Telemetry_Tick(&telemetry, now + 1000 * MS, &summary);
+    }
+    TEST_ASSERT_EQUAL(MAX_BITRATE / 8, summary.bitrate);
+
+    // drained: the next tick climbs again although the average still remembers the queue
+    Exchange(&telemetry, now, 31 * MS, 0);
+    Telemetry_Tick(&telemetry, now + 1000 * MS, &summary);
+    now += 1000 * MS;
+    TEST_ASSERT_TRUE(summary.rtt_avg_us > 30 * MS + TELEMETRY_QUEUE_DELAY_US);
+    TEST_ASSERT_EQUAL(MAX_BITRATE / 8 + MAX_BITRATE / 20, summary.bitrate);
+    for (int i = 0; i < 30; i++, now += 1000 * MS)
+    {
+        Exchange(&telemetry, now, 31 * MS, 0);
+        Telemetry_Tick(&telemetry, now + 1000 * MS, &summary);
+    }
+    TEST_ASSERT_EQUAL(MAX_BITRATE, summary.bitrate);
+}
+
+TEST(bitrate_backs_off_on_relay_drops_and_send_queue)
+{
+    Telemetry telemetry;
+    Start(&telemetry);
+    TelemetrySummary summary;
+
+    // the viewer found frames missing: the relay dropped for it
+    Exchange(&telemetry, 0, 30 * MS, 2);
+    Telemetry_Tick(&telemetry, 1000 * MS, &summary);
+    TEST_ASSERT_EQUAL(MAX_BITRATE * 85 / 100, summary.bitrate);
+    TEST_ASSERT_EQUAL(2, summary.peer_missing);
+
+    // the same count again is not a new drop
+    Exchange(&telemetry, 1000 * MS, 30 * MS, 2);
+    Telemetry_Tick(&telemetry, 2000 * MS, &summary);
+    TEST_ASSERT_EQUAL(MAX_BITRATE * 85 / 100 + MAX_BITRATE / 20, summary.bitrate);
+
+    // more than half a second of video waits in the send queue
+    uint32_t before = summary.bitrate;
+    Telemetry_OnQueue(&telemetry, before / 8 / 2 + 1);
+    Telemetry_OnQueue(&telemetry, 0);
+    Telemetry_Tick(&telemetry, 3000 * MS, &summary);
+    TEST_ASSERT_EQUAL((uint64_t)before * 85 / 100, summary.bitrate);
+    TEST_ASSERT_EQUAL(2, telemetry.decreases);
+}
+
+int main(void)
+{
+    TEST_INIT();
+
+    RUN_TEST(rtt_min_avg_and_p95);
+    RUN_TEST(rtt_rejects_negative_and_stale_samples);
+    RUN_TEST(rtt_minimum_leaves_with_its_window);
+    RUN_TEST(pings_are_due_once_per_interval);
+    RUN_TEST(pong_gives_round_trip_and_peer_missing_frames);
+    RUN_TEST(tick_reports_goodput_queue_and_lost_pings);
+    RUN_TEST(bitrate_backs_off_on_delay_and_recovers);
+    RUN_TEST(bitrate_backs_off_on_relay_drops_and_send_queue);
+
+    TEST_SUMMARY();
+    return g_test_ctx.failed > 0 ? 1 : 0;
+}
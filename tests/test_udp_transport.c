@@ -0,0 +1,898 @@
+// Tests and benchmark for the UDP video transport (udp_transport.c): candidates, STUN, hole punching
+// over loopback, FEC, selective retransmit and keyframe recovery, through a shim that loses and
+// reorders datagrams
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define LOG_DERP(...) ((void)0)
+#define LOG_ERROR(...) ((void)0)
+#define DERPNET_USE_PLAIN_HTTP 1
+#define DERPNET_STATIC
+#include "external/derpnet.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "test_framework.h"
+#include "platform.h"
+#include "udp_transport.h"
+#include "latency.h"
+
+#define SHIM_MAX_HELD 256
+#define SHIM_MAX_DROPS 8
+#define CONNECT_TIMEOUT_US (2 * 1000 * 1000)
+#define FRAME_TIMEOUT_US (5 * 1000 * 1000)
+
+typedef struct {
+    DerpKey secret;
+    DerpKey public_key;
+} Peer;
+
+static void Peer_Init(Peer* peer)
+{
+    DerpNet_CreateNewKey(&peer->secret);
+    DerpNet_GetPublicKey(&peer->secret, &peer->public_key);
+}
+
+//
+// impairment shim: what one transport sends goes through it
+//
+
+typedef struct {
+    UdpEndpoint to;
+    uint64_t release_us;
+    size_t size;
+    uint8_t data[1500];
+} HeldDatagram;
+
+typedef struct {
+    uint32_t loss_percent;
+    uint32_t reorder_percent;    // held back 1-3 ms, datagrams sent meanwhile overtake it
+    bool blackhole;
+    uint32_t drops[SHIM_MAX_DROPS];  // datagram numbers (counted from Shim_Count) to lose
+    uint32_t drop_count;
+    uint32_t counter;
+    uint64_t random;
+    uintptr_t socket;
+    HeldDatagram held[SHIM_MAX_HELD];
+    uint32_t held_count;
+    uint8_t last[1500];          // copy of the last datagram, for replaying it
+    size_t last_size;
+    uint64_t dropped;
+    uint64_t reordered;
+} Shim;
+
+static uint32_t Shim_Random(Shim* shim)
+{
+    shim->random ^= shim->random << 13;
+    shim->random ^= shim->random >> 7;
+    shim->random ^= shim->random << 17;
+    return (uint32_t)(shim->random >> 32);
+}
+
+static bool Shim_SendTo(uintptr_t socket, const UdpEndpoint* to, const uint8_t* data, size_t size)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(to->port) };
+    memcpy(&addr.sin_addr, to->ip, 4);
+    return sendto((int)socket, data, size, 0, (struct sockaddr*)&addr, sizeof(addr)) == (ssize_t)size;
+}
+
+// restarts the datagram count the drop list refers to
+static void Shim_Count(Shim* shim)
+{
+    shim->counter = 0;
+}
+
+static bool Shim_Send(void* context, uintptr_t socket, const UdpEndpoint* to, const uint8_t* data, size_t size)
+{
+    Shim* shim = context;
+    shim->socket = socket;
+    memcpy(shim->last, data, size);
+    shim->last_size = size;
+
+    uint32_t number = shim->counter++;
+    bool drop = shim->blackhole || (shim->loss_percent && Shim_Random(shim) % 100 < shim->loss_percent);
+    for (uint32_t i = 0; i < shim->drop_count; i++)
+    {
+        drop = drop || shim->drops[i] == number;
+    }
+    if (drop)
+    {
+        // lost on the way, the sender cannot tell
+        shim->dropped++;
+        return true;
+    }
+
+    if (shim->reorder_percent && shim->held_count < SHIM_MAX_HELD && Shim_Random(shim) % 100 < shim->reorder_percent)
+    {
+        HeldDatagram* held = &shim->held[shim->held_count++];
+        held->to = *to;
+        held->release_us = BuddyClock_NowUs() + 1000 + Shim_Random(shim) % 2000;
+        held->size = size;
+        memcpy(held->data, data, size);
+        shim->reordered++;
+        return true;
+    }
+    return Shim_SendTo(socket, to, data, size);
+}
+
+static void Shim_Flush(Shim* shim, uint64_t now_us)
+{
+    for (uint32_t i = 0; i < shim->held_count;)
+    {
+        if (shim->held[i].release_us <= now_us)
+        {
+            Shim_SendTo(shim->socket, &shim->held[i].to, shim->held[i].data, shim->held[i].size);
+            shim->held[i] = shim->held[--shim->held_count];
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+//
+// two transports on loopback, pumped by the test thread
+//
+
+typedef struct {
+    Peer peer_a;
+    Peer peer_b;
+    UdpTransport a;
+    UdpTransport b;
+    Shim shim_a;   // on what a sends
+    Shim shim_b;
+} Link;
+
+static bool Link_Init(Link* link, const UdpTransportConfig* base)
+{
+    memset(link, 0, sizeof(*link));
+    Peer_Init(&link->peer_a);
+    Peer_Init(&link->peer_b);
+    link->shim_a.random = 0x9e3779b97f4a7c15ull;
+    link->shim_b.random = 0xc2b2ae3d27d4eb4full;
+
+    UdpTransportConfig config = *base;
+    memcpy(config.secret, link->peer_a.secret.Bytes, UDP_KEY_SIZE);
+    memcpy(config.peer, link->peer_b.public_key.Bytes, UDP_KEY_SIZE);
+    config.send = &Shim_Send;
+    config.send_context = &link->shim_a;
+    if (!UdpTransport_Open(&link->a, &config, 0))
+    {
+        return false;
+    }
+
+    memcpy(config.secret, link->peer_b.secret.Bytes, UDP_KEY_SIZE);
+    memcpy(config.peer, link->peer_a.public_key.Bytes, UDP_KEY_SIZE);
+    config.send_context = &link->shim_b;
+    return UdpTransport_Open(&link->b, &config, 0);
+}
+
+static void Link_Close(Link* link)
+{
+    UdpTransport_Close(&link->a);
+    UdpTransport_Close(&link->b);
+}
+
+// one round of what the owner's network thread does: wait for a datagram or a timer, read, poll
+static void Link_Pump(Link* link, uint32_t max_wait_ms)
+{
+    uint64_t now = BuddyClock_NowUs();
+    uint32_t wait = max_wait_ms;
+    uint32_t next_a = UdpTransport_NextPollMs(&link->a, now);
+    uint32_t next_b = UdpTransport_NextPollMs(&link->b, now);
+    wait = next_a < wait ? next_a : wait;
+    wait = next_b < wait ? next_b : wait;
+    if ((link->shim_a.held_count || link->shim_b.held_count) && wait > 1)
+    {
+        wait = 1;
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = link->a.state != UDP_STATE_CLOSED ? (int)link->a.socket : -1, .events = POLLIN },
+        { .fd = link->b.state != UDP_STATE_CLOSED ? (int)link->b.socket : -1, .events = POLLIN },
+    };
+    poll(fds, 2, (int)wait);
+
+    now = BuddyClock_NowUs();
+    Shim_Flush(&link->shim_a, now);
+    Shim_Flush(&link->shim_b, now);
+    UdpTransport_Receive(&link->a, now);
+    UdpTransport_Receive(&link->b, now);
+    UdpTransport_Poll(&link->a, now);
+    UdpTransport_Poll(&link->b, now);
+}
+
+static void Link_PumpFor(Link* link, uint64_t duration_us)
+{
+    uint64_t end = BuddyClock_NowUs() + duration_us;
+    while (BuddyClock_NowUs() < end)
+    {
+        Link_Pump(link, 1);
+    }
+}
+
+static void Link_ExchangeCandidates(Link* link)
+{
+    static const uint8_t loopback[4] = { 127, 0, 0, 1 };
+    UdpTransport_AddHostCandidate(&link->a, loopback);
+    UdpTransport_AddHostCandidate(&link->b, loopback);
+
+    uint8_t packed[UDP_CANDIDATES_MAX_SIZE];
+    uint64_t now = BuddyClock_NowUs();
+    size_t size = UdpTransport_PackCandidates(&link->a, packed);
+    UdpTransport_AddRemoteCandidates(&link->b, packed, size, now);
+    size = UdpTransport_PackCandidates(&link->b, packed);
+    UdpTransport_AddRemoteCandidates(&link->a, packed, size, now);
+}
+
+static bool Link_WaitConnected(Link* link)
+{
+    uint64_t end = BuddyClock_NowUs() + CONNECT_TIMEOUT_US;
+    while (BuddyClock_NowUs() < end && (link->a.state != UDP_STATE_CONNECTED || link->b.state != UDP_STATE_CONNECTED))
+    {
+        Link_Pump(link, 5);
+    }
+    return link->a.state == UDP_STATE_CONNECTED && link->b.state == UDP_STATE_CONNECTED;
+}
+
+static bool Link_Open(Link* link, const UdpTransportConfig* base)
+{
+    if (!Link_Init(link, base))
+    {
+        return false;
+    }
+    Link_ExchangeCandidates(link);
+    return Link_WaitConnected(link);
+}
+
+// frame content the receiver can check: id in the 4 byte head, then a pattern derived from it
+static uint8_t* Frame_Make(uint32_t id, uint32_t size)
+{
+    uint8_t* data = malloc(size);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        data[i] = (uint8_t)(id * 31 + i * 7 + (i >> 8));
+    }
+    return data;
+}
+
+static bool Frame_Send(UdpTransport* t, uint32_t id, uint32_t size, bool keyframe)
+{
+    uint8_t head[4];
+    Set32LE(head, id);
+    uint8_t* data = Frame_Make(id, size);
+    bool ok = UdpTransport_SendFrame(t, head, sizeof(head), data, size, keyframe);
+    free(data);
+    return ok;
+}
+
+// returns the id of the popped frame, 0 when none is ready or it came out different from what was sent
+static uint32_t Frame_Pop(UdpTransport* t, bool* intact)
+{
+    const uint8_t* data;
+    uint32_t size;
+    if (!UdpTransport_PopFrame(t, &data, &size))
+    {
+        return 0;
+    }
+    uint32_t id = size >= 4 ? Get32LE(data) : 0;
+    uint8_t* expected = Frame_Make(id, size - 4);
+    *intact = size >= 4 && memcmp(data + 4, expected, size - 4) == 0;
+    free(expected);
+    return id;
+}
+
+// pumps until a frame comes out of b
+static uint32_t Link_WaitFrame(Link* link, bool* intact)
+{
+    uint64_t end = BuddyClock_NowUs() + FRAME_TIMEOUT_US;
+    while (BuddyClock_NowUs() < end)
+    {
+        uint32_t id = Frame_Pop(&link->b, intact);
+        if (id)
+        {
+            return id;
+        }
+        Link_Pump(link, 5);
+    }
+    return 0;
+}
+
+static const UdpTransportConfig DefaultConfig = { 0 };
+
+TEST(candidates_round_trip_and_reject_bad_sizes)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Init(&link, &DefaultConfig));
+    TEST_ASSERT_EQUAL(UDP_STATE_IDLE, link.a.state);
+    TEST_ASSERT_TRUE(link.a.port != 0);
+
+    static const uint8_t lan[4] = { 192, 168, 1, 20 };
+    static const uint8_t loopback[4] = { 127, 0, 0, 1 };
+    TEST_ASSERT_TRUE(UdpTransport_AddHostCandidate(&link.a, lan));
+    TEST_ASSERT_TRUE(UdpTransport_AddHostCandidate(&link.a, loopback));
+    TEST_ASSERT_FALSE(UdpTransport_AddHostCandidate(&link.a, lan));
+
+    uint8_t packed[UDP_CANDIDATES_MAX_SIZE];
+    size_t size = UdpTransport_PackCandidates(&link.a, packed);
+    TEST_ASSERT_EQUAL(1 + 2 * 7, size);
+
+    TEST_ASSERT_FALSE(UdpTransport_AddRemoteCandidates(&link.b, packed, size - 1, 0));
+    TEST_ASSERT_FALSE(UdpTransport_AddRemoteCandidates(&link.b, packed, 1, 0));
+    uint8_t empty[1] = { 0 };
+    TEST_ASSERT_FALSE(UdpTransport_AddRemoteCandidates(&link.b, empty, sizeof(empty), 0));
+    TEST_ASSERT_EQUAL(UDP_STATE_IDLE, link.b.state);
+
+    TEST_ASSERT_TRUE(UdpTransport_AddRemoteCandidates(&link.b, packed, size, 0));
+    TEST_ASSERT_EQUAL(UDP_STATE_PUNCHING, link.b.state);
+    TEST_ASSERT_EQUAL(2, link.b.remote_count);
+    TEST_ASSERT_TRUE(memcmp(link.b.remote[0].ip, lan, 4) == 0);
+    TEST_ASSERT_EQUAL(link.a.port, link.b.remote[1].port);
+
+    // the same ones again add nothing
+    TEST_ASSERT_TRUE(UdpTransport_AddRemoteCandidates(&link.b, packed, size, 0));
+    TEST_ASSERT_EQUAL(2, link.b.remote_count);
+    Link_Close(&link);
+}
+
+TEST(punching_connects_both_ends_over_loopback)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Init(&link, &DefaultConfig));
+
+    // a candidate nobody answers on is probed alongside and does not get in the way
+    static const uint8_t other[4] = { 127, 0, 0, 2 };
+    UdpTransport_AddHostCandidate(&link.a, other);
+    Link_ExchangeCandidates(&link);
+    TEST_ASSERT_TRUE(Link_WaitConnected(&link));
+
+    TEST_ASSERT_EQUAL(link.b.port, link.a.peer.port);
+    TEST_ASSERT_EQUAL(127, link.a.peer.ip[0]);
+    TEST_ASSERT_TRUE(link.a.stats.connect_us < 500 * 1000);
+    TEST_ASSERT_TRUE(link.a.stats.rtt_us > 0);
+    TEST_ASSERT_EQUAL(0, link.a.stats.rejected);
+    TEST_ASSERT_EQUAL(0, link.b.stats.rejected);
+
+    // keepalives hold it up past the time it takes to declare a peer dead
+    UdpTransportConfig config = { .dead_ms = 300 };
+    link.a.config.dead_ms = config.dead_ms;
+    link.a.next_probe_us = 0;
+    Link_PumpFor(&link, 100 * 1000);
+    TEST_ASSERT_EQUAL(UDP_STATE_CONNECTED, link.a.state);
+    Link_Close(&link);
+}
+
+TEST(one_sided_candidates_connect_through_peer_reflexive)
+{
+    // b never hears of a's candidates, as when b's NAT hides them: a's probes show b where a is
+    Link link;
+    TEST_ASSERT_TRUE(Link_Init(&link, &DefaultConfig));
+    static const uint8_t loopback[4] = { 127, 0, 0, 1 };
+    UdpTransport_AddHostCandidate(&link.b, loopback);
+    uint8_t packed[UDP_CANDIDATES_MAX_SIZE];
+    size_t size = UdpTransport_PackCandidates(&link.b, packed);
+    TEST_ASSERT_TRUE(UdpTransport_AddRemoteCandidates(&link.a, packed, size, BuddyClock_NowUs()));
+    TEST_ASSERT_EQUAL(UDP_STATE_IDLE, link.b.state);
+
+    TEST_ASSERT_TRUE(Link_WaitConnected(&link));
+    TEST_ASSERT_EQUAL(1, link.b.remote_count);
+    TEST_ASSERT_EQUAL(link.a.port, link.b.peer.port);
+    Link_Close(&link);
+}
+
+TEST(unanswered_punch_fails_and_silent_peer_is_lost)
+{
+    UdpTransportConfig config = { .punch_timeout_ms = 150, .dead_ms = 150 };
+    Link link;
+    TEST_ASSERT_TRUE(Link_Init(&link, &config));
+
+    // b is there but never told to answer: its socket is closed
+    uint16_t port = link.b.port;
+    UdpTransport_Close(&link.b);
+    uint8_t packed[1 + 7] = { 1, UDP_CANDIDATE_HOST, 127, 0, 0, 1, (uint8_t)port, (uint8_t)(port >> 8) };
+    uint64_t start = BuddyClock_NowUs();
+    TEST_ASSERT_TRUE(UdpTransport_AddRemoteCandidates(&link.a, packed, sizeof(packed), start));
+    while (link.a.state == UDP_STATE_PUNCHING && BuddyClock_NowUs() - start < CONNECT_TIMEOUT_US)
+    {
+        Link_Pump(&link, 5);
+    }
+    TEST_ASSERT_EQUAL(UDP_STATE_FAILED, link.a.state);
+    TEST_ASSERT_TRUE(BuddyClock_NowUs() - start >= 150 * 1000);
+    TEST_ASSERT_TRUE(link.a.stats.datagrams_sent >= 3);
+    TEST_ASSERT_FALSE(Frame_Send(&link.a, 1, 100, true));
+    Link_Close(&link);
+
+    TEST_ASSERT_TRUE(Link_Open(&link, &config));
+    UdpTransport_Close(&link.b);
+    start = BuddyClock_NowUs();
+    while (link.a.state == UDP_STATE_CONNECTED && BuddyClock_NowUs() - start < CONNECT_TIMEOUT_US)
+    {
+        Link_Pump(&link, 5);
+    }
+    TEST_ASSERT_EQUAL(UDP_STATE_LOST, link.a.state);
+    TEST_ASSERT_TRUE(BuddyClock_NowUs() - start >= 100 * 1000);
+    Link_Close(&link);
+}
+
+TEST(forged_replayed_and_reflected_datagrams_are_rejected)
+{
+    UdpTransportConfig config = { .punch_timeout_ms = 150 };
+    Link link;
+    TEST_ASSERT_TRUE(Link_Init(&link, &config));
+
+    // b with keys that do not match: a's probes do not open there and b's none at a
+    Peer impostor;
+    Peer_Init(&impostor);
+    UdpTransportConfig wrong = config;
+    memcpy(wrong.secret, impostor.secret.Bytes, UDP_KEY_SIZE);
+    memcpy(wrong.peer, link.peer_a.public_key.Bytes, UDP_KEY_SIZE);
+    wrong.send = &Shim_Send;
+    wrong.send_context = &link.shim_b;
+    UdpTransport_Close(&link.b);
+    TEST_ASSERT_TRUE(UdpTransport_Open(&link.b, &wrong, 0));
+    Link_ExchangeCandidates(&link);
+    uint64_t start = BuddyClock_NowUs();
+    while ((link.a.state == UDP_STATE_PUNCHING || link.b.state == UDP_STATE_PUNCHING) && BuddyClock_NowUs() - start < CONNECT_TIMEOUT_US)
+    {
+        Link_Pump(&link, 5);
+    }
+    TEST_ASSERT_EQUAL(UDP_STATE_FAILED, link.a.state);
+    TEST_ASSERT_EQUAL(UDP_STATE_FAILED, link.b.state);
+    TEST_ASSERT_TRUE(link.a.stats.rejected >= 2);
+    TEST_ASSERT_TRUE(link.b.stats.rejected >= 2);
+    Link_Close(&link);
+
+    TEST_ASSERT_TRUE(Link_Open(&link, &DefaultConfig));
+    UdpEndpoint from_b = link.a.peer;
+    UdpEndpoint from_a = link.b.peer;
+
+    // the last datagram b sent, once more: a has seen its nonce
+    uint64_t rejected = link.a.stats.rejected;
+    UdpTransport_OnDatagram(&link.a, &from_b, link.shim_b.last, link.shim_b.last_size, BuddyClock_NowUs());
+    TEST_ASSERT_EQUAL(rejected + 1, link.a.stats.rejected);
+
+    // a's own datagram sent back at it opens with the shared key, but carries a's prefix
+    UdpTransport_OnDatagram(&link.a, &from_a, link.shim_a.last, link.shim_a.last_size, BuddyClock_NowUs());
+    TEST_ASSERT_EQUAL(rejected + 2, link.a.stats.rejected);
+
+    // a flipped bit fails the box
+    uint8_t forged[1500];
+    memcpy(forged, link.shim_b.last, link.shim_b.last_size);
+    forged[16] ^= 0x80;   // fresh counter, so it is the box and not the window that says no
+    forged[link.shim_b.last_size - 1] ^= 1;
+    UdpTransport_OnDatagram(&link.a, &from_b, forged, link.shim_b.last_size, BuddyClock_NowUs());
+    TEST_ASSERT_EQUAL(rejected + 3, link.a.stats.rejected);
+    TEST_ASSERT_EQUAL(UDP_STATE_CONNECTED, link.a.state);
+
+    // a datagram under another prefix on the same keys, like one recorded from an earlier session,
+    // is refused: the peer keeps the prefix it started with for the whole session
+    DerpNet__GetRandom(link.b.nonce_prefix, sizeof(link.b.nonce_prefix));
+    link.b.nonce_counter = 1;
+    link.shim_b.blackhole = true;
+    link.b.next_probe_us = 0;
+    UdpTransport_Poll(&link.b, BuddyClock_NowUs());
+    link.shim_b.blackhole = false;
+    UdpTransport_OnDatagram(&link.a, &from_b, link.shim_b.last, link.shim_b.last_size, BuddyClock_NowUs());
+    TEST_ASSERT_EQUAL(rejected + 4, link.a.stats.rejected);
+    TEST_ASSERT_EQUAL(UDP_STATE_CONNECTED, link.a.state);
+    Link_Close(&link);
+}
+
+// a non-blocking socket on loopback, standing in for another address of the peer
+static int Socket_Loopback(uint16_t* port)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_size = sizeof(addr);
+    if (s < 0 || bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || getsockname(s, (struct sockaddr*)&addr, &addr_size) != 0)
+    {
+        return -1;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    *port = ntohs(addr.sin_port);
+    return s;
+}
+
+TEST(peer_is_followed_to_a_new_address_only_after_it_answers_there)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Open(&link, &DefaultConfig));
+    uint16_t old_port = link.a.peer.port;
+
+    // b's NAT moves it to another port: a probes there and follows once b answers
+    uint16_t new_port;
+    int moved = Socket_Loopback(&new_port);
+    TEST_ASSERT_TRUE(moved >= 0);
+    close((int)link.b.socket);
+    link.b.socket = (uintptr_t)moved;
+    link.b.next_probe_us = 0;
+    uint64_t end = BuddyClock_NowUs() + CONNECT_TIMEOUT_US;
+    while (link.a.peer.port != new_port && BuddyClock_NowUs() < end)
+    {
+        Link_Pump(&link, 5);
+    }
+    TEST_ASSERT_EQUAL(new_port, link.a.peer.port);
+    TEST_ASSERT_TRUE(new_port != old_port);
+    TEST_ASSERT_EQUAL(1, link.a.stats.path_changes);
+    TEST_ASSERT_EQUAL(0, link.a.path_probe_us);
+
+    bool intact = false;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 1, 3000, true));
+    TEST_ASSERT_EQUAL(1, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+
+    // one of b's datagrams raced in from another address first: a probes there, nobody answers
+    // with the keys and a keeps sending to b
+    uint16_t decoy_port;
+    int decoy = Socket_Loopback(&decoy_port);
+    TEST_ASSERT_TRUE(decoy >= 0);
+    link.shim_b.blackhole = true;
+    link.b.next_probe_us = 0;
+    UdpTransport_Poll(&link.b, BuddyClock_NowUs());
+    link.shim_b.blackhole = false;
+    UdpEndpoint elsewhere = { .ip = { 127, 0, 0, 1 }, .port = decoy_port };
+    uint64_t rejected = link.a.stats.rejected;
+    UdpTransport_OnDatagram(&link.a, &elsewhere, link.shim_b.last, link.shim_b.last_size, BuddyClock_NowUs());
+    TEST_ASSERT_EQUAL(rejected, link.a.stats.rejected);
+    TEST_ASSERT_EQUAL(new_port, link.a.peer.port);
+    TEST_ASSERT_TRUE(link.a.path_probe_us != 0);
+
+    struct pollfd fd = { .fd = decoy, .events = POLLIN };
+    TEST_ASSERT_EQUAL(1, poll(&fd, 1, 1000));
+    uint8_t probe[1500];
+    TEST_ASSERT_TRUE(recv(decoy, probe, sizeof(probe), 0) > 0);
+
+    Link_PumpFor(&link, 50 * 1000);
+    TEST_ASSERT_EQUAL(new_port, link.a.peer.port);
+    TEST_ASSERT_EQUAL(1, link.a.stats.path_changes);
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 2, 3000, true));
+    TEST_ASSERT_EQUAL(2, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    close(decoy);
+    Link_Close(&link);
+}
+
+TEST(stun_answer_becomes_reflexive_candidate)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Init(&link, &DefaultConfig));
+    static const uint8_t loopback[4] = { 127, 0, 0, 1 };
+    UdpTransport_AddHostCandidate(&link.a, loopback);
+
+    int server = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_size = sizeof(addr);
+    TEST_ASSERT_EQUAL(0, bind(server, (struct sockaddr*)&addr, sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, getsockname(server, (struct sockaddr*)&addr, &addr_size));
+
+    UdpEndpoint stun = { .ip = { 127, 0, 0, 1 }, .port = ntohs(addr.sin_port) };
+    TEST_ASSERT_TRUE(UdpTransport_StartStun(&link.a, &stun, BuddyClock_NowUs()));
+
+    uint8_t request[64];
+    struct sockaddr_in client;
+    socklen_t client_size = sizeof(client);
+    struct pollfd fd = { .fd = server, .events = POLLIN };
+    TEST_ASSERT_EQUAL(1, poll(&fd, 1, 1000));
+    TEST_ASSERT_EQUAL(20, recvfrom(server, request, sizeof(request), 0, (struct sockaddr*)&client, &client_size));
+    TEST_ASSERT_EQUAL(0x0001, request[0] << 8 | request[1]);
+    TEST_ASSERT_EQUAL(0x2112a442u, Get32BE(request + 4));
+
+    // answer from behind a NAT that mapped the socket to 203.0.113.7:40000, after an unknown attribute
+    uint8_t response[20 + 8 + 12] = { 0x01, 0x01, 0x00, 8 + 12 };
+    memcpy(response + 4, request + 4, 16);
+    uint8_t* software = response + 20;
+    software[1] = 0x22;  // SOFTWARE, 4 bytes
+    software[3] = 4;
+    uint8_t* mapped = software + 8;
+    mapped[1] = 0x20;
+    mapped[3] = 8;
+    mapped[5] = 0x01;
+    uint16_t port = 40000 ^ 0x2112;
+    mapped[6] = (uint8_t)(port >> 8);
+    mapped[7] = (uint8_t)port;
+    static const uint8_t ip[4] = { 203, 0, 113, 7 };
+    for (int i = 0; i < 4; i++)
+    {
+        mapped[8 + i] = ip[i] ^ response[4 + i];
+    }
+
+    // a reply with another transaction id is somebody else's
+    response[8] ^= 1;
+    sendto(server, response, sizeof(response), 0, (struct sockaddr*)&client, client_size);
+    response[8] ^= 1;
+    sendto(server, response, sizeof(response), 0, (struct sockaddr*)&client, client_size);
+    uint64_t start = BuddyClock_NowUs();
+    while (!link.a.candidates_changed && BuddyClock_NowUs() - start < CONNECT_TIMEOUT_US)
+    {
+        Link_Pump(&link, 5);
+    }
+    TEST_ASSERT_TRUE(link.a.candidates_changed);
+    TEST_ASSERT_EQUAL(2, link.a.local_count);
+    TEST_ASSERT_EQUAL(UDP_CANDIDATE_REFLEXIVE, link.a.local[1].type);
+    TEST_ASSERT_TRUE(memcmp(link.a.local[1].endpoint.ip, ip, 4) == 0);
+    TEST_ASSERT_EQUAL(40000, link.a.local[1].endpoint.port);
+    TEST_ASSERT_EQUAL(0, link.a.stun_attempts);
+    TEST_ASSERT_EQUAL(0, link.a.stats.rejected);
+
+    uint8_t packed[UDP_CANDIDATES_MAX_SIZE];
+    TEST_ASSERT_EQUAL(1 + 2 * 7, UdpTransport_PackCandidates(&link.a, packed));
+    TEST_ASSERT_FALSE(link.a.candidates_changed);
+    close(server);
+    Link_Close(&link);
+}
+
+TEST(parity_rebuilds_one_lost_shard_per_group_without_nack)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Open(&link, &DefaultConfig));
+
+    // 16 data shards: shard 0 and 1 of group 0 and 1 parity, then group 1 from datagram 9 on
+    uint32_t size = 16 * UDP_SHARD_SIZE - 4;
+    Shim_Count(&link.shim_a);
+    link.shim_a.drops[0] = 3;
+    link.shim_a.drops[1] = 9 + 7;
+    link.shim_a.drop_count = 2;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 1, size, true));
+    link.shim_a.drop_count = 0;
+
+    bool intact = false;
+    TEST_ASSERT_EQUAL(1, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(2, link.b.stats.shards_recovered);
+    TEST_ASSERT_EQUAL(0, link.b.stats.nacks_sent);
+    TEST_ASSERT_EQUAL(0, link.a.stats.shards_retransmitted);
+
+    // the short last shard of a frame is rebuilt to its length, one shard frames are their own parity
+    Shim_Count(&link.shim_a);
+    link.shim_a.drops[0] = 2;
+    link.shim_a.drop_count = 1;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 2, 2 * UDP_SHARD_SIZE + 100, false));
+    Shim_Count(&link.shim_a);
+    link.shim_a.drops[0] = 0;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 3, 300, false));
+    link.shim_a.drop_count = 0;
+    TEST_ASSERT_EQUAL(2, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(3, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(4, link.b.stats.shards_recovered);
+    TEST_ASSERT_EQUAL(0, link.b.stats.nacks_sent);
+    Link_Close(&link);
+}
+
+TEST(nack_retransmits_only_what_parity_cannot_rebuild)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Open(&link, &DefaultConfig));
+
+    // two shards of group 0 and the last shard with its parity: one of group 0 comes back by
+    // retransmit and parity rebuilds the other, the tail needs its own retransmit
+    uint32_t size = 12 * UDP_SHARD_SIZE - 4;
+    Shim_Count(&link.shim_a);
+    uint32_t drops[] = { 1, 2, 9 + 3, 9 + 4 };
+    memcpy(link.shim_a.drops, drops, sizeof(drops));
+    link.shim_a.drop_count = 4;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 1, size, true));
+    link.shim_a.drop_count = 0;
+
+    bool intact = false;
+    TEST_ASSERT_EQUAL(1, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(1, link.b.stats.nacks_sent);
+    TEST_ASSERT_EQUAL(2, link.a.stats.shards_retransmitted);
+    TEST_ASSERT_EQUAL(1, link.b.stats.shards_recovered);
+    TEST_ASSERT_EQUAL(0, link.b.stats.frames_lost);
+
+    // a frame lost whole is noticed by the one after it, and asked for whole
+    Shim_Count(&link.shim_a);
+    link.shim_a.blackhole = true;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 2, 3000, false));
+    link.shim_a.blackhole = false;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 3, 3000, false));
+    TEST_ASSERT_EQUAL(2, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(3, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(2, link.b.stats.nacks_sent);
+    TEST_ASSERT_EQUAL(0, link.b.stats.frames_lost);
+    TEST_ASSERT_FALSE(link.a.keyframe_needed);
+    Link_Close(&link);
+}
+
+TEST(unrecoverable_loss_skips_to_the_next_keyframe)
+{
+    UdpTransportConfig config = { .frame_deadline_ms = 100 };
+    Link link;
+    TEST_ASSERT_TRUE(Link_Open(&link, &config));
+
+    bool intact = false;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 1, 5000, true));
+    TEST_ASSERT_EQUAL(1, Link_WaitFrame(&link, &intact));
+
+    // more frames than the sender keeps vanish, the first of them cannot be had again
+    link.shim_a.blackhole = true;
+    for (uint32_t id = 2; id < 2 + UDP_SEND_HISTORY + 2; id++)
+    {
+        TEST_ASSERT_TRUE(Frame_Send(&link.a, id, 2000, false));
+    }
+    link.shim_a.blackhole = false;
+    uint32_t id = 2 + UDP_SEND_HISTORY + 2;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, id++, 2000, false));
+
+    // frames behind a lost one would decode on a broken reference, they are dropped until a keyframe
+    uint64_t start = BuddyClock_NowUs();
+    while (!link.a.keyframe_needed && BuddyClock_NowUs() - start < FRAME_TIMEOUT_US)
+    {
+        Link_Pump(&link, 5);
+        TEST_ASSERT_EQUAL(0, Frame_Pop(&link.b, &intact));
+    }
+    TEST_ASSERT_TRUE(link.a.keyframe_needed);
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, id++, 2000, false));
+    link.a.keyframe_needed = false;
+    uint32_t keyframe = id;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, id++, 20000, true));
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, id++, 2000, false));
+
+    TEST_ASSERT_EQUAL(keyframe, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_EQUAL(keyframe + 1, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(link.b.stats.frames_lost >= 1);
+    TEST_ASSERT_TRUE(link.b.stats.frames_skipped >= 1);
+    TEST_ASSERT_EQUAL(keyframe + 1, link.b.stats.frames_delivered + link.b.stats.frames_lost + link.b.stats.frames_skipped);
+    Link_Close(&link);
+}
+
+TEST(far_frame_id_gives_up_the_gap_at_once)
+{
+    Link link;
+    TEST_ASSERT_TRUE(Link_Open(&link, &DefaultConfig));
+    bool intact = false;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, 1, 2000, true));
+    TEST_ASSERT_EQUAL(1, Link_WaitFrame(&link, &intact));
+
+    // a sender whose ids leapt ahead: the frames in between are counted lost without visiting each
+    uint32_t far = 1u << 30;
+    link.a.next_send_id = far;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, far, 2000, false));
+    uint64_t start = BuddyClock_NowUs();
+    while (!link.a.keyframe_needed && BuddyClock_NowUs() - start < FRAME_TIMEOUT_US)
+    {
+        Link_Pump(&link, 5);
+        TEST_ASSERT_EQUAL(0, Frame_Pop(&link.b, &intact));
+    }
+    TEST_ASSERT_TRUE(link.a.keyframe_needed);
+    TEST_ASSERT_TRUE(link.b.stats.frames_lost >= far - UDP_RECV_WINDOW - 1);
+    TEST_ASSERT_TRUE(link.b.stats.frames_lost < far);
+
+    link.a.keyframe_needed = false;
+    TEST_ASSERT_TRUE(Frame_Send(&link.a, far + 1, 2000, true));
+    TEST_ASSERT_EQUAL(far + 1, Link_WaitFrame(&link, &intact));
+    TEST_ASSERT_TRUE(intact);
+    Link_Close(&link);
+}
+
+// Video through the shim: a keyframe every 30 frames, paced at 60 fps. Returns the frames that came
+// out intact and in order; latency is from SendFrame to PopFrame.
+static uint32_t Stream(Link* link, uint32_t frames, LatencySummary* latency)
+{
+    LatencyStats stats = { 0 };
+    uint64_t sent_us[64] = { 0 };
+    uint32_t next_send = 1;
+    uint32_t expected = 1;
+    uint32_t good = 0;
+    uint64_t next_frame_us = BuddyClock_NowUs();
+    uint64_t end = next_frame_us + (uint64_t)frames * 16667 + FRAME_TIMEOUT_US;
+
+    while (expected <= frames && BuddyClock_NowUs() < end)
+    {
+        uint64_t now = BuddyClock_NowUs();
+        if (next_send <= frames && now >= next_frame_us)
+        {
+            bool keyframe = next_send % 30 == 1 || link->a.keyframe_needed;
+            link->a.keyframe_needed = false;
+            sent_us[next_send % 64] = now;
+            Frame_Send(&link->a, next_send, keyframe ? 60000 : 8000 + next_send * 37 % 9000, keyframe);
+            next_send++;
+            next_frame_us += 16667;
+        }
+
+        Link_Pump(link, 1);
+        bool intact;
+        uint32_t id;
+        while ((id = Frame_Pop(&link->b, &intact)) != 0)
+        {
+            if (intact && id >= expected)
+            {
+                good++;
+                Latency_StatsAdd(&stats, (int64_t)(BuddyClock_NowUs() - sent_us[id % 64]));
+            }
+            expected = id + 1;
+        }
+        if (next_send > frames && link->b.next_recv_id > frames)
+        {
+            break;
+        }
+    }
+    Latency_StatsSummary(&stats, latency);
+    return good;
+}
+
+TEST(lossy_reordering_link_delivers_every_frame_in_order)
+{
+    UdpTransportConfig config = { .frame_deadline_ms = 1000 };
+    Link link;
+    TEST_ASSERT_TRUE(Link_Open(&link, &config));
+    link.shim_a.loss_percent = 10;
+    link.shim_a.reorder_percent = 10;
+    link.shim_b.loss_percent = 10;
+    link.shim_b.reorder_percent = 10;
+
+    LatencySummary latency;
+    uint32_t good = Stream(&link, 120, &latency);
+    TEST_ASSERT_EQUAL(120, good);
+    TEST_ASSERT_EQUAL(0, link.b.stats.frames_lost);
+    TEST_ASSERT_TRUE(link.shim_a.dropped > 0);
+    TEST_ASSERT_TRUE(link.shim_a.reordered > 0);
+    TEST_ASSERT_TRUE(link.b.stats.shards_recovered > 0);
+    TEST_ASSERT_TRUE(link.a.stats.shards_retransmitted > 0);
+    Link_Close(&link);
+}
+
+TEST(benchmark_loss_against_fec_and_retransmit)
+{
+    static const uint32_t losses[] = { 0, 1, 3, 5, 10 };
+    printf("\n    %-6s %8s %8s %10s %10s %10s %9s\n", "loss", "frames", "lost", "rebuilt", "resent", "p50 ms", "p95 ms");
+    for (uint32_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++)
+    {
+        Link link;
+        TEST_ASSERT_TRUE(Link_Open(&link, &DefaultConfig));
+        link.shim_a.loss_percent = losses[i];
+        link.shim_a.reorder_percent = losses[i] ? 5 : 0;
+        link.shim_b.loss_percent = losses[i];
+
+        LatencySummary latency;
+        uint32_t good = Stream(&link, 180, &latency);
+        printf("    %4u%%  %8u %8llu %10llu %10llu %10.2f %9.2f\n", losses[i], good,
+            (unsigned long long)link.b.stats.frames_lost, (unsigned long long)link.b.stats.shards_recovered,
+            (unsigned long long)link.a.stats.shards_retransmitted, latency.p50_us / 1000.0, latency.p95_us / 1000.0);
+        if (losses[i] == 0)
+        {
+            TEST_ASSERT_EQUAL(180, good);
+            TEST_ASSERT_EQUAL(0, link.b.stats.nacks_sent);
+        }
+        TEST_ASSERT_TRUE(good >= 150);
+        Link_Close(&link);
+    }
+    printf("    ");
+}
+
+int main(void)
+{
+    printf("========================================\n");
+    printf("  UDP Transport Tests\n");
+    printf("========================================\n\n");
+
+    TEST_INIT();
+
+    RUN_TEST(candidates_round_trip_and_reject_bad_sizes);
+    RUN_TEST(punching_connects_both_ends_over_loopback);
+    RUN_TEST(one_sided_candidates_connect_through_peer_reflexive);
+    RUN_TEST(unanswered_punch_fails_and_silent_peer_is_lost);
+    RUN_TEST(forged_replayed_and_reflected_datagrams_are_rejected);
+    RUN_TEST(peer_is_followed_to_a_new_address_only_after_it_answers_there);
+    RUN_TEST(stun_answer_becomes_reflexive_candidate);
+    RUN_TEST(parity_rebuilds_one_lost_shard_per_group_without_nack);
+    RUN_TEST(nack_retransmits_only_what_parity_cannot_rebuild);
+    RUN_TEST(unrecoverable_loss_skips_to_the_next_keyframe);
+    RUN_TEST(far_frame_id_gives_up_the_gap_at_once);
+    RUN_TEST(lossy_reordering_link_delivers_every_frame_in_order);
+    RUN_TEST(benchmark_loss_against_fec_and_retransmit);
+
+    TEST_SUMMARY();
+    return TEST_EXIT_CODE();
+}